@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Stimulus firmware for the keypad latency rig. Runs on a second board
+ * whose stim-gpios are wired to the key lines of the unit under test and
+ * is driven line by line over its console by scripts/latency_bench.py:
+ *
+ *   p <mask>                      press the lines in mask, release others
+ *   b <mask> <count> <period_us>  press/release mask count times
+ *
+ * Every command is answered with "ok" once the lines have been driven.
+ */
+
+#include <stdlib.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/gpio.h>
+#include <zephyr/console/console.h>
+#include <zephyr/sys/printk.h>
+
+#define STIM_NODE DT_PATH(zephyr_user)
+#define STIM_SPEC(node_id, prop, idx) GPIO_DT_SPEC_GET_BY_IDX(node_id, prop, idx),
+
+static const struct gpio_dt_spec stim[] = {
+	DT_FOREACH_PROP_ELEM(STIM_NODE, stim_gpios, STIM_SPEC)
+};
+
+static void stim_apply(uint32_t mask)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(stim); i++) {
+		gpio_pin_set_dt(&stim[i], (mask & BIT(i)) != 0);
+	}
+}
+
+static void stim_burst(uint32_t mask, uint32_t count, uint32_t period_us)
+{
+	unsigned int key = irq_lock();
+
+	for (uint32_t i = 0; i < count; i++) {
+		stim_apply(mask);
+		k_busy_wait(period_us / 2);
+		stim_apply(0);
+		k_busy_wait(period_us - period_us / 2);
+	}
+
+	irq_unlock(key);
+}
+
+void main(void)
+{
+	console_getline_init();
+
+	for (size_t i = 0; i < ARRAY_SIZE(stim); i++) {
+		if (!device_is_ready(stim[i].port) ||
+		    gpio_pin_configure_dt(&stim[i], GPIO_OUTPUT_INACTIVE)) {
+			printk("stimulus line %u unavailable\n", i);
+			return;
+		}
+	}
+
+	printk("stimulus ready, %u lines\n", ARRAY_SIZE(stim));
+
+	while (true) {
+		char *line = console_getline();
+		char *arg;
+		uint32_t mask;
+
+		if (line == NULL || line[0] == '\0') {
+			continue;
+		}
+
+		mask = strtoul(&line[1], &arg, 16);
+
+		switch (line[0]) {
+		case 'p':
+			stim_apply(mask);
+			break;
+		case 'b': {
+			uint32_t count = strtoul(arg, &arg, 10);
+			uint32_t period_us = strtoul(arg, &arg, 10);
+
+			stim_burst(mask, count, period_us);
+			break;
+		}
+		default:
+			printk("err\n");
+			continue;
+		}
+
+		printk("ok\n");
+	}
+}
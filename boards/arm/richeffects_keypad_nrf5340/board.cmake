@@ -0,0 +1,7 @@
+# Copyright (c) 2022 Rich Effects
+# SPDX-License-Identifier: Apache-2.0
+
+board_runner_args(nrfjprog "--nrf-family=NRF53")
+board_runner_args(jlink "--device=nrf5340_xxaa_app" "--speed=4000")
+include(${ZEPHYR_BASE}/boards/common/nrfjprog.board.cmake)
+include(${ZEPHYR_BASE}/boards/common/jlink.board.cmake)
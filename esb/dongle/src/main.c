@@ -0,0 +1,426 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * USB dongle of the ESB keypad, for nrf52840dongle_nrf52840. Receives
+ * the reports of up to CONFIG_ESB_DONGLE_KEYPADS keypads as the ESB
+ * receiver, one pipe each, and presents them to the host as a single
+ * NKRO keyboard polled every millisecond. The ESB acknowledgement goes
+ * out as soon as a payload is in, a keypad counts a report as
+ * delivered from then on.
+ *
+ * The keys of every keypad are kept as an NKRO bitmap, whatever the
+ * format it sends, and the host gets their union: at most one report
+ * per poll, with everything that arrived since the previous one. A
+ * report that would release a key the host has not yet seen pressed
+ * waits for the next poll instead, so no tap is merged away. A keypad
+ * silent for CONFIG_ESB_DONGLE_TIMEOUT_MS, keepalives included, has
+ * its keys released.
+ *
+ * Every payload in leaves the dongle's uptime for the ACK of the
+ * keypad's next one, ESB_AIR_CLOCK: the lighting clock the keypads
+ * on the dongle run their effects on, src/led/fx_clock.h.
+ *
+ *   west build -b nrf52840dongle_nrf52840 esb/dongle
+ */
+
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/clock_control.h>
+#include <zephyr/drivers/clock_control/nrf_clock_control.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/usb/usb_device.h>
+#include <zephyr/usb/class/usb_hid.h>
+#include <esb.h>
+#include <keypad/esb_link.h>
+
+#include "report.h"
+#include "report_desc.h"
+
+LOG_MODULE_REGISTER(esb_dongle, LOG_LEVEL_INF);
+
+BUILD_ASSERT(CONFIG_ESB_DONGLE_KEYPADS <= 8, "ESB has eight pipes");
+BUILD_ASSERT(REPORT_NKRO_SIZE != REPORT_BOOT_SIZE,
+	     "the report formats are told apart by their size");
+
+static const uint8_t hid_report_desc[] = REPORT_NKRO_DESC();
+
+struct air_report {
+	uint8_t pipe;
+	uint8_t len;
+	uint8_t data[REPORT_SIZE];
+};
+
+/* Held keys as an NKRO report: the modifier byte, then the bitmap */
+struct keys {
+	uint8_t data[REPORT_NKRO_SIZE];
+};
+
+K_MSGQ_DEFINE(reports, sizeof(struct air_report), CONFIG_ESB_DONGLE_QUEUE,
+	      4);
+
+/* Reports were queued */
+static K_SEM_DEFINE(received, 0, 1);
+/* The IN endpoint has room for the next report */
+static K_SEM_DEFINE(in_free, 1, 1);
+static atomic_t configured;
+
+/* Keys of every keypad, and the uptime of its last payload in ms */
+static struct keys held[CONFIG_ESB_DONGLE_KEYPADS];
+static atomic_t seen[CONFIG_ESB_DONGLE_KEYPADS];
+
+/*
+ * The ACK of a payload carries what was queued for its pipe before it
+ * came in, so the time of this one goes out with the next
+ */
+static void clock_queue(uint8_t pipe)
+{
+	struct esb_payload ack = {
+		.pipe = pipe,
+		.length = 5,
+	};
+
+	ack.data[0] = ESB_AIR_CLOCK;
+	sys_put_le32(k_uptime_get_32(), &ack.data[1]);
+
+	/* One per pipe at most, each payload in took the one before */
+	(void)esb_write_payload(&ack);
+}
+
+static void esb_event(const struct esb_evt *event)
+{
+	struct esb_payload rx;
+	struct air_report report;
+
+	if (event->evt_id != ESB_EVENT_RX_RECEIVED) {
+		return;
+	}
+
+	while (esb_read_rx_payload(&rx) == 0) {
+		if (rx.pipe >= CONFIG_ESB_DONGLE_KEYPADS) {
+			continue;
+		}
+
+		atomic_set(&seen[rx.pipe], k_uptime_get_32());
+		clock_queue(rx.pipe);
+
+		/* Keepalives only make the keypad see the ACK */
+		if (rx.length < 2 || rx.data[0] != ESB_AIR_REPORT ||
+		    rx.length - 1 > REPORT_SIZE) {
+			continue;
+		}
+
+		report.pipe = rx.pipe;
+		report.len = rx.length - 1;
+		memcpy(report.data, &rx.data[1], report.len);
+
+		if (k_msgq_put(&reports, &report, K_NO_WAIT)) {
+			LOG_WRN("Host not polling, report dropped");
+		}
+	}
+
+	k_sem_give(&received);
+}
+
+/*
+ * Keys of a keypad report, either format. False for a report that
+ * says nothing about the keys, a boot report in rollover error.
+ */
+static bool keys_parse(struct keys *out, const struct air_report *report)
+{
+	const uint8_t *codes = &report->data[KEYPAD_BTN_CODE_REPORT_POS];
+
+	if (report->len == REPORT_NKRO_SIZE) {
+		memcpy(out->data, report->data, REPORT_NKRO_SIZE);
+		return true;
+	}
+
+	if (report->len != REPORT_BOOT_SIZE ||
+	    codes[0] == REPORT_USAGE_ERROR_ROLLOVER) {
+		return false;
+	}
+
+	memset(out->data, 0, sizeof(out->data));
+	out->data[0] = report->data[KEYPAD_BTN_MODIFIER_REPORT_POS];
+
+	for (size_t i = 0; i < KEYPAD_BTN_CODE_REPORT_SLOTS; i++) {
+		if (codes[i] > REPORT_USAGE_ERROR_ROLLOVER &&
+		    codes[i] < REPORT_NKRO_BITS) {
+			out->data[1 + codes[i] / 8] |= BIT(codes[i] % 8);
+		}
+	}
+
+	return true;
+}
+
+/* Union of the keys of every keypad */
+static void keys_merge(struct keys *out)
+{
+	memset(out->data, 0, sizeof(out->data));
+
+	for (size_t i = 0; i < ARRAY_SIZE(held); i++) {
+		for (size_t j = 0; j < sizeof(out->data); j++) {
+			out->data[j] |= held[i].data[j];
+		}
+	}
+}
+
+/* Keys pressed in next but not yet in sent are missing from now */
+static bool keys_tap_lost(const struct keys *sent, const struct keys *next,
+			  const struct keys *now)
+{
+	for (size_t j = 0; j < sizeof(now->data); j++) {
+		if (next->data[j] & ~sent->data[j] & ~now->data[j]) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Apply the queued reports to the keys, as many as fit one host
+ * report, and merge them into next
+ */
+static void keys_collect(const struct keys *sent, struct keys *next)
+{
+	struct air_report report;
+	struct keys before;
+	struct keys now;
+
+	keys_merge(next);
+
+	while (k_msgq_peek(&reports, &report) == 0) {
+		before = held[report.pipe];
+
+		if (keys_parse(&held[report.pipe], &report)) {
+			keys_merge(&now);
+			if (keys_tap_lost(sent, next, &now)) {
+				/* The host sees the press first */
+				held[report.pipe] = before;
+				return;
+			}
+
+			*next = now;
+		}
+
+		(void)k_msgq_get(&reports, &report, K_NO_WAIT);
+	}
+}
+
+/* Release the keys of keypads gone silent, true if any were held */
+static bool keys_expire(void)
+{
+	uint32_t now = k_uptime_get_32();
+	bool expired = false;
+
+	for (size_t i = 0; i < ARRAY_SIZE(held); i++) {
+		static const struct keys none;
+
+		if (now - (uint32_t)atomic_get(&seen[i]) <
+		    CONFIG_ESB_DONGLE_TIMEOUT_MS ||
+		    memcmp(&held[i], &none, sizeof(none)) == 0) {
+			continue;
+		}
+
+		LOG_WRN("Keypad %u lost, keys released", i);
+		held[i] = none;
+		expired = true;
+	}
+
+	return expired;
+}
+
+static void int_in_ready(const struct device *dev)
+{
+	k_sem_give(&in_free);
+}
+
+static const struct hid_ops ops = {
+	.int_in_ready = int_in_ready,
+};
+
+static void status_cb(enum usb_dc_status_code status, const uint8_t *param)
+{
+	switch (status) {
+	case USB_DC_CONFIGURED:
+		atomic_set(&configured, 1);
+		break;
+	case USB_DC_RESET:
+	case USB_DC_DISCONNECTED:
+		atomic_set(&configured, 0);
+		/* A transfer queued before the reset never completes */
+		k_sem_give(&in_free);
+		break;
+	default:
+		break;
+	}
+}
+
+static int clocks_start(void)
+{
+	struct onoff_manager *mgr =
+		z_nrf_clock_control_get_onoff(CLOCK_CONTROL_NRF_SUBSYS_HF);
+	struct onoff_client cli;
+	int res;
+	int ret;
+
+	/* ESB needs the crystal, the radio does not request it itself */
+	sys_notify_init_spinwait(&cli.notify);
+	ret = onoff_request(mgr, &cli);
+	if (ret < 0) {
+		return ret;
+	}
+
+	do {
+		ret = sys_notify_fetch_result(&cli.notify, &res);
+	} while (ret == -EAGAIN);
+
+	return ret ? ret : res;
+}
+
+static int esb_link_init(void)
+{
+	static const uint8_t base_address[4] = {
+		CONFIG_ESB_LINK_BASE_ADDRESS & 0xff,
+		(CONFIG_ESB_LINK_BASE_ADDRESS >> 8) & 0xff,
+		(CONFIG_ESB_LINK_BASE_ADDRESS >> 16) & 0xff,
+		(CONFIG_ESB_LINK_BASE_ADDRESS >> 24) & 0xff,
+	};
+	uint8_t prefix[CONFIG_ESB_DONGLE_KEYPADS];
+	struct esb_config config = ESB_DEFAULT_CONFIG;
+	int ret;
+
+	/* Keypad n transmits on pipe n */
+	for (size_t i = 0; i < ARRAY_SIZE(prefix); i++) {
+		prefix[i] = CONFIG_ESB_LINK_PREFIX + i;
+	}
+
+	config.protocol = ESB_PROTOCOL_ESB_DPL;
+	config.mode = ESB_MODE_PRX;
+	config.bitrate = ESB_BITRATE_2MBPS;
+	config.event_handler = esb_event;
+	config.selective_auto_ack = false;
+
+	ret = esb_init(&config);
+	if (ret == 0) {
+		ret = esb_set_base_address_0(base_address);
+	}
+
+	if (ret == 0) {
+		ret = esb_set_base_address_1(base_address);
+	}
+
+	if (ret == 0) {
+		ret = esb_set_prefixes(prefix, ARRAY_SIZE(prefix));
+	}
+
+	if (ret == 0) {
+		ret = esb_enable_pipes(BIT_MASK(CONFIG_ESB_DONGLE_KEYPADS));
+	}
+
+	if (ret == 0) {
+		ret = esb_set_rf_channel(CONFIG_ESB_LINK_CHANNEL);
+	}
+
+	if (ret == 0) {
+		ret = esb_start_rx();
+	}
+
+	return ret;
+}
+
+void main(void)
+{
+	const struct device *hid_dev = device_get_binding("HID_0");
+	struct air_report report;
+	struct keys sent = { 0 };
+	struct keys next;
+	int ret;
+
+	if (hid_dev == NULL) {
+		LOG_ERR("Cannot get USB HID Device");
+		return;
+	}
+
+	usb_hid_register_device(hid_dev, hid_report_desc,
+				sizeof(hid_report_desc), &ops);
+
+	ret = usb_hid_init(hid_dev);
+	if (ret) {
+		LOG_ERR("Failed to init USB HID, error: %d", ret);
+		return;
+	}
+
+	ret = usb_enable(status_cb);
+	if (ret) {
+		LOG_ERR("Failed to enable USB, error: %d", ret);
+		return;
+	}
+
+	ret = clocks_start();
+	if (ret) {
+		LOG_ERR("Failed to start HFXO, error: %d", ret);
+		return;
+	}
+
+	ret = esb_link_init();
+	if (ret) {
+		LOG_ERR("Failed to init ESB, error: %d", ret);
+		return;
+	}
+
+	LOG_INF("Listening for %u keypads on channel %u",
+		CONFIG_ESB_DONGLE_KEYPADS, CONFIG_ESB_LINK_CHANNEL);
+
+	while (true) {
+		/* Also wakes up to check the keypads are still there */
+		(void)k_sem_take(&received,
+				 K_MSEC(CONFIG_ESB_DONGLE_TIMEOUT_MS));
+
+		if (!keys_expire() && k_msgq_num_used_get(&reports) == 0) {
+			continue;
+		}
+
+		if (!atomic_get(&configured)) {
+			/* Keep track of the keys for when a host is there */
+			while (k_msgq_get(&reports, &report, K_NO_WAIT) == 0) {
+				(void)keys_parse(&held[report.pipe], &report);
+			}
+
+			/* It starts with no key held */
+			memset(&sent, 0, sizeof(sent));
+			continue;
+		}
+
+		/* Whatever arrives until the host polls joins this report */
+		(void)k_sem_take(&in_free, K_FOREVER);
+
+		keys_collect(&sent, &next);
+		if (memcmp(&next, &sent, sizeof(next)) == 0) {
+			k_sem_give(&in_free);
+			continue;
+		}
+
+		/* Copied into the endpoint buffer before this returns */
+		ret = hid_int_ep_write(hid_dev, next.data, sizeof(next.data),
+				       NULL);
+		if (ret) {
+			LOG_DBG("IN write error, %d", ret);
+			k_sem_give(&in_free);
+			continue;
+		}
+
+		sent = next;
+
+		if (k_msgq_num_used_get(&reports) > 0) {
+			/* Held back for the next poll */
+			k_sem_give(&received);
+		}
+	}
+}
@@ -0,0 +1,392 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Network core image of the ESB keypad: takes the reports from the
+ * shared-memory ring and sends each one as an ESB payload to the
+ * dongle, then tells the application core which of them were
+ * acknowledged and whether the dongle is in reach. Build for
+ * nrf5340dk_nrf5340_cpunet next to an application built with
+ * overlay-esb.conf.
+ *
+ * This side consumes the ring to the network core and produces the
+ * one to the application core, the reverse of src/ipc/shm_ring.c.
+ * Everything the ESB interrupt learns is handed to the thread through
+ * atomics, so the thread stays the only producer.
+ *
+ * The dongle's clock in an ACK is from when it received the previous
+ * payload, which is when that one's TX_SUCCESS came, give or take the
+ * ACK. It is passed on with the time since then, and only if neither
+ * payload was retransmitted: the dongle may have taken a retransmitted
+ * one earlier than its ACK made it back.
+ */
+
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/device.h>
+#include <zephyr/devicetree.h>
+#include <zephyr/drivers/clock_control.h>
+#include <zephyr/drivers/clock_control/nrf_clock_control.h>
+#include <zephyr/drivers/mbox.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/byteorder.h>
+#include <esb.h>
+#include <soc.h>
+#include <keypad/esb_link.h>
+
+#include "ipc/shm_ring.h"
+
+LOG_MODULE_REGISTER(esb_netcore, LOG_LEVEL_INF);
+
+#define RING_NODE DT_CHOSEN(richeffects_ipc_ring)
+#define RING_SLOTS CONFIG_KEYPAD_IPC_RING_SLOTS
+
+/* Retry after 300 us, a 2 Mbps payload and its ACK take about 200 */
+#define ESB_RETRANSMIT_DELAY_US 300
+
+BUILD_ASSERT(SHM_MSG_PAYLOAD + 1 <= CONFIG_ESB_MAX_PAYLOAD_LENGTH,
+	     "a report and its type byte must fit a payload");
+BUILD_ASSERT(CONFIG_ESB_TX_FIFO_SIZE <= 32, "FIFO tracked in a word");
+
+static struct shm_region *const region =
+	(struct shm_region *)DT_REG_ADDR(RING_NODE);
+
+static struct mbox_channel tx_channel;
+static struct mbox_channel rx_channel;
+
+static K_SEM_DEFINE(wake, 0, 1);
+
+/* Payloads in the ESB FIFO, oldest in bit 0: set for a report */
+static uint32_t fifo_reports;
+static uint8_t fifo_len;
+
+/* From the ESB interrupt, taken by the thread */
+static atomic_t acked_reports;
+static atomic_t acked;
+static atomic_t failed;
+
+/* k_cycle_get_32() of the last two TX_SUCCESS, and if at first try */
+static uint32_t success_at[2];
+static bool success_clean[2];
+/* Dongle clock for the thread, and k_cycle_get_32() it was read at */
+static uint32_t clock_ms;
+static uint32_t clock_at;
+static atomic_t clock_new;
+
+static void doorbell(const struct device *dev, uint32_t channel,
+		     void *user_data, struct mbox_msg *data)
+{
+	k_sem_give(&wake);
+}
+
+/* ACK payloads, after the TX_SUCCESS of their payload */
+static void ack_read(void)
+{
+	struct esb_payload rx;
+
+	while (esb_read_rx_payload(&rx) == 0) {
+		if (rx.length != 5 || rx.data[0] != ESB_AIR_CLOCK ||
+		    !success_clean[0] || !success_clean[1]) {
+			continue;
+		}
+
+		clock_ms = sys_get_le32(&rx.data[1]);
+		clock_at = success_at[0];
+		atomic_set(&clock_new, 1);
+	}
+}
+
+static void esb_event(const struct esb_evt *event)
+{
+	switch (event->evt_id) {
+	case ESB_EVENT_TX_SUCCESS:
+		if (fifo_reports & BIT(0)) {
+			atomic_inc(&acked_reports);
+		}
+
+		fifo_reports >>= 1;
+		fifo_len--;
+		atomic_set(&acked, 1);
+
+		success_at[0] = success_at[1];
+		success_clean[0] = success_clean[1];
+		success_at[1] = k_cycle_get_32();
+		success_clean[1] = event->tx_attempts == 1;
+		break;
+	case ESB_EVENT_RX_RECEIVED:
+		ack_read();
+		break;
+	case ESB_EVENT_TX_FAILED:
+		/* The rest of the FIFO would go to the same missing dongle */
+		(void)esb_flush_tx();
+		fifo_reports = 0;
+		fifo_len = 0;
+		success_clean[1] = false;
+		atomic_set(&acked, 0);
+		atomic_set(&failed, 1);
+		break;
+	default:
+		return;
+	}
+
+	k_sem_give(&wake);
+}
+
+/* Publish a message on the ring to the application core */
+static void ring_post_data(uint8_t type, const uint8_t *data, size_t len)
+{
+	struct shm_ring *ring = &region->to_app;
+	uint32_t head = ring->head;
+	struct shm_msg *msg;
+
+	if (head - *(volatile uint32_t *)&ring->tail == RING_SLOTS) {
+		LOG_WRN("Ring to the application core full");
+		return;
+	}
+
+	msg = &ring->slot[head % RING_SLOTS];
+	msg->type = type;
+	msg->len = len;
+	memcpy(msg->data, data, len);
+
+	/* The slot is complete before the application core sees the index */
+	__DMB();
+	*(volatile uint32_t *)&ring->head = head + 1;
+	(void)mbox_send(&tx_channel, NULL);
+}
+
+static void ring_post(uint8_t type, uint8_t value)
+{
+	ring_post_data(type, &value, 1);
+}
+
+static int air_send(uint8_t type, const uint8_t *data, size_t len)
+{
+	struct esb_payload tx = {
+		.pipe = CONFIG_ESB_LINK_PIPE,
+		.length = 1 + len,
+	};
+	unsigned int key;
+	int ret;
+
+	tx.data[0] = type;
+	if (len > 0) {
+		memcpy(&tx.data[1], data, len);
+	}
+
+	/* Pushed before the interrupt of this payload can pop it */
+	key = irq_lock();
+	ret = esb_write_payload(&tx);
+	if (ret == 0) {
+		fifo_reports |= (type == ESB_AIR_REPORT) << fifo_len;
+		fifo_len++;
+	}
+	irq_unlock(key);
+
+	return ret;
+}
+
+/* Send every report the application core committed */
+static bool ring_drain(void)
+{
+	struct shm_ring *ring = &region->to_net;
+	bool sent = false;
+
+	while (ring->tail != *(volatile uint32_t *)&ring->head) {
+		const struct shm_msg *msg;
+
+		/* The index was published after the slot */
+		__DMB();
+		msg = &ring->slot[ring->tail % RING_SLOTS];
+
+		if (msg->type == ESB_MSG_REPORT) {
+			if (air_send(ESB_AIR_REPORT, msg->data, msg->len)) {
+				/* Never on air, don't keep the sink waiting */
+				LOG_WRN("ESB FIFO full, report dropped");
+				ring_post(ESB_MSG_DONE, 1);
+			}
+
+			sent = true;
+		}
+
+		/* Done reading before the slot is handed back */
+		__DMB();
+		*(volatile uint32_t *)&ring->tail = ring->tail + 1;
+	}
+
+	return sent;
+}
+
+static void link_update(bool *up)
+{
+	atomic_val_t done = atomic_set(&acked_reports, 0);
+
+	while (done > 0) {
+		uint8_t n = MIN(done, UINT8_MAX);
+
+		ring_post(ESB_MSG_DONE, n);
+		done -= n;
+	}
+
+	if (atomic_cas(&failed, 1, 0) && *up) {
+		*up = false;
+		ring_post(ESB_MSG_LINK, 0);
+	}
+
+	if (atomic_cas(&acked, 1, 0) && !*up) {
+		*up = true;
+		ring_post(ESB_MSG_LINK, 1);
+	}
+
+	if (atomic_cas(&clock_new, 1, 0)) {
+		uint8_t data[8];
+		unsigned int key = irq_lock();
+
+		sys_put_le32(clock_ms, &data[0]);
+		sys_put_le32(k_cyc_to_us_floor32(k_cycle_get_32() - clock_at),
+			     &data[4]);
+		irq_unlock(key);
+		ring_post_data(ESB_MSG_CLOCK, data, sizeof(data));
+	}
+}
+
+static int clocks_start(void)
+{
+	struct onoff_manager *mgr =
+		z_nrf_clock_control_get_onoff(CLOCK_CONTROL_NRF_SUBSYS_HF);
+	struct onoff_client cli;
+	int res;
+	int ret;
+
+	/* ESB needs the crystal, the radio does not request it itself */
+	sys_notify_init_spinwait(&cli.notify);
+	ret = onoff_request(mgr, &cli);
+	if (ret < 0) {
+		return ret;
+	}
+
+	do {
+		ret = sys_notify_fetch_result(&cli.notify, &res);
+	} while (ret == -EAGAIN);
+
+	return ret ? ret : res;
+}
+
+static int esb_link_init(void)
+{
+	static const uint8_t base_address[4] = {
+		CONFIG_ESB_LINK_BASE_ADDRESS & 0xff,
+		(CONFIG_ESB_LINK_BASE_ADDRESS >> 8) & 0xff,
+		(CONFIG_ESB_LINK_BASE_ADDRESS >> 16) & 0xff,
+		(CONFIG_ESB_LINK_BASE_ADDRESS >> 24) & 0xff,
+	};
+	uint8_t prefix[CONFIG_ESB_LINK_PIPE + 1];
+	struct esb_config config = ESB_DEFAULT_CONFIG;
+	int ret;
+
+	/* Pipes up to ours, the dongle tells the keypads apart by them */
+	for (size_t i = 0; i < ARRAY_SIZE(prefix); i++) {
+		prefix[i] = CONFIG_ESB_LINK_PREFIX + i;
+	}
+
+	config.protocol = ESB_PROTOCOL_ESB_DPL;
+	config.mode = ESB_MODE_PTX;
+	config.bitrate = ESB_BITRATE_2MBPS;
+	config.event_handler = esb_event;
+	config.retransmit_delay = ESB_RETRANSMIT_DELAY_US;
+	config.retransmit_count = CONFIG_ESB_LINK_RETRANSMITS;
+	config.tx_mode = ESB_TXMODE_AUTO;
+	config.selective_auto_ack = false;
+
+	ret = esb_init(&config);
+	if (ret == 0) {
+		ret = esb_set_base_address_0(base_address);
+	}
+
+	if (ret == 0) {
+		ret = esb_set_base_address_1(base_address);
+	}
+
+	if (ret == 0) {
+		ret = esb_set_prefixes(prefix, ARRAY_SIZE(prefix));
+	}
+
+	if (ret == 0) {
+		ret = esb_set_rf_channel(CONFIG_ESB_LINK_CHANNEL);
+	}
+
+	return ret;
+}
+
+static int ring_init(void)
+{
+	const struct device *mbox = DEVICE_DT_GET(DT_NODELABEL(mbox));
+	int ret;
+
+	if (!device_is_ready(mbox)) {
+		return -ENODEV;
+	}
+
+	/* The application core clears the rings before setting it */
+	while (*(volatile uint32_t *)&region->magic != SHM_RING_MAGIC) {
+		k_msleep(1);
+	}
+
+	__DMB();
+
+	/* The channels of the application core, the other way round */
+	mbox_init_channel(&tx_channel, mbox, CONFIG_KEYPAD_IPC_RING_RX_CHANNEL);
+	mbox_init_channel(&rx_channel, mbox, CONFIG_KEYPAD_IPC_RING_TX_CHANNEL);
+
+	ret = mbox_register_callback(&rx_channel, doorbell, NULL);
+	if (ret == 0) {
+		ret = mbox_set_enabled(&rx_channel, true);
+	}
+
+	return ret;
+}
+
+void main(void)
+{
+	int64_t last_tx = 0;
+	bool up = false;
+	int ret;
+
+	ret = clocks_start();
+	if (ret) {
+		LOG_ERR("Failed to start HFXO, error: %d", ret);
+		return;
+	}
+
+	ret = esb_link_init();
+	if (ret) {
+		LOG_ERR("Failed to init ESB, error: %d", ret);
+		return;
+	}
+
+	ret = ring_init();
+	if (ret) {
+		LOG_ERR("Failed to set up the ring, error: %d", ret);
+		return;
+	}
+
+	LOG_INF("ESB on channel %u", CONFIG_ESB_LINK_CHANNEL);
+
+	while (true) {
+		(void)k_sem_take(&wake, K_MSEC(CONFIG_ESB_LINK_KEEPALIVE_MS));
+
+		link_update(&up);
+
+		if (ring_drain()) {
+			last_tx = k_uptime_get();
+		} else if (k_uptime_get() - last_tx >=
+			   CONFIG_ESB_LINK_KEEPALIVE_MS) {
+			/* Finds a dongle coming back, or one gone silent */
+			(void)air_send(ESB_AIR_KEEPALIVE, NULL, 0);
+			last_tx = k_uptime_get();
+		}
+	}
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Key actions for keycode properties. The low byte of a plain action is
+ * a HID usage of the keyboard page, the high byte selects a layer
+ * action and the low byte is then the layer number. Tap-hold actions
+ * keep the tap usage in the low byte and the layer or modifier in bits
+ * 8 to 12. Consumer and system actions carry a usage of their page in
+ * the low 13 bits, mouse actions a MOUSE_* code.
+ */
+
+#ifndef KEYPAD_DT_BINDINGS_KEYPAD_LAYERS_H_
+#define KEYPAD_DT_BINDINGS_KEYPAD_LAYERS_H_
+
+#define LAYER_ACTION_MASK 0xff00
+#define LAYER_ACTION_USAGE 0x0000
+#define LAYER_ACTION_NONE 0x0100
+#define LAYER_ACTION_MO 0x0200
+#define LAYER_ACTION_TG 0x0300
+#define LAYER_ACTION_MACRO 0x0400
+#define LAYER_ACTION_LEADER 0x0500
+#define LAYER_ACTION_HOST 0x0600
+#define LAYER_ACTION_OSM 0x0700
+#define LAYER_ACTION_OSL 0x0800
+#define LAYER_ACTION_MULTI_TAP 0x0900
+#define LAYER_ACTION_MACRO_RECORD 0x0a00
+
+#define LAYER_ACTION_TAP_HOLD_MASK 0xe000
+#define LAYER_ACTION_LT 0x4000
+#define LAYER_ACTION_MT 0x6000
+#define LAYER_ACTION_CONSUMER 0x8000
+#define LAYER_ACTION_SYSTEM 0xa000
+#define LAYER_ACTION_MOUSE 0xc000
+
+/* LAYER_MOUSE() codes */
+#define MOUSE_UP 0x00
+#define MOUSE_DOWN 0x01
+#define MOUSE_LEFT 0x02
+#define MOUSE_RIGHT 0x03
+#define MOUSE_WHEEL_UP 0x04
+#define MOUSE_WHEEL_DOWN 0x05
+/* Buttons 1 to 5 */
+#define MOUSE_BUTTON(n) (0x10 + (n) - 1)
+
+/* Layers above the base: the key does what it does on the layer below */
+#define LAYER_TRANSPARENT 0x0000
+/* Sends nothing and hides the layers below */
+#define LAYER_NONE LAYER_ACTION_NONE
+/* Layer active while the key is held */
+#define LAYER_MO(layer) (LAYER_ACTION_MO | (layer))
+/* Layer toggled on and off by each press */
+#define LAYER_TG(layer) (LAYER_ACTION_TG | (layer))
+/* Plays macro n of the richeffects,keypad-macros node */
+#define LAYER_MACRO(macro) (LAYER_ACTION_MACRO | (macro))
+/* Starts a richeffects,keypad-leader sequence */
+#define LAYER_LEADER LAYER_ACTION_LEADER
+/* Reports go to host slot n: 0 is USB, 1 to 3 the BLE bonds */
+#define LAYER_HOST(slot) (LAYER_ACTION_HOST | (slot))
+/*
+ * Modifier usage (0xe0..0xe7) for the next key when tapped, locked on
+ * by a second tap until a third, a plain modifier while held
+ */
+#define LAYER_OSM(modifier) (LAYER_ACTION_OSM | (modifier))
+/* The same for a layer: the next key, toggled on, or momentary */
+#define LAYER_OSL(layer) (LAYER_ACTION_OSL | (layer))
+/* Multi-tap n of the richeffects,keypad-multi-taps node */
+#define LAYER_MULTI_TAP(n) (LAYER_ACTION_MULTI_TAP | (n))
+/* Starts recording macro n, stops and saves it on the next press */
+#define LAYER_MACRO_RECORD(macro) (LAYER_ACTION_MACRO_RECORD | (macro))
+/* Consumer page usage (0x001..0x3ff), on the Consumer Control interface */
+#define LAYER_CONSUMER(usage) (LAYER_ACTION_CONSUMER | (usage))
+/* System Power Down, Sleep or Wake Up (0x81..0x83) */
+#define LAYER_SYSTEM(usage) (LAYER_ACTION_SYSTEM | (usage))
+/* Mouse key, a MOUSE_* code, on the mouse interface */
+#define LAYER_MOUSE(code) (LAYER_ACTION_MOUSE | (code))
+/* Layer while held, usage when tapped */
+#define LAYER_LT(layer, usage) (LAYER_ACTION_LT | ((layer) << 8) | (usage))
+/* Modifier usage (0xe0..0xe7) while held, usage when tapped */
+#define LAYER_MT(modifier, usage) \
+	(LAYER_ACTION_MT | (((modifier) & 0x07) << 8) | (usage))
+
+#endif /* KEYPAD_DT_BINDINGS_KEYPAD_LAYERS_H_ */
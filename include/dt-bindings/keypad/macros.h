@@ -0,0 +1,21 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Opcodes of macro sequences. Any other byte is a HID usage that is
+ * tapped: pressed in one report and released in the next. The opcodes
+ * take the usages of the keyboard error codes, which no key sends.
+ */
+
+#ifndef KEYPAD_DT_BINDINGS_KEYPAD_MACROS_H_
+#define KEYPAD_DT_BINDINGS_KEYPAD_MACROS_H_
+
+/* Next byte is a usage to press and keep held */
+#define MACRO_DOWN 0x01
+/* Next byte is a usage to release */
+#define MACRO_UP 0x02
+/* Next byte is a pause in milliseconds */
+#define MACRO_WAIT 0x03
+
+#endif /* KEYPAD_DT_BINDINGS_KEYPAD_MACROS_H_ */
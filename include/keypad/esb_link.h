@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Enhanced ShockBurst link between the keypad and its USB dongle,
+ * shared by the three images taking part:
+ *
+ *   application core  src/esb/esb_sink.c, a report sink writing to the
+ *                     shared-memory ring (src/ipc/shm_ring.h)
+ *   network core      esb/netcore, the ESB transmitter (PTX)
+ *   dongle            esb/dongle, the receiver (PRX) and USB keyboard
+ *
+ * Every air payload starts with an ESB_AIR_* type byte. The ring
+ * messages between the cores use the ESB_MSG_* types.
+ */
+
+#ifndef KEYPAD_ESB_LINK_H_
+#define KEYPAD_ESB_LINK_H_
+
+/* Air payload: a keyboard report follows, as the keypad built it */
+#define ESB_AIR_REPORT 0x01
+/* Air payload: nothing follows, sent while no report keeps the link */
+#define ESB_AIR_KEEPALIVE 0x02
+/*
+ * Air payload, on the dongle's ACK: le32 of its uptime in ms when it
+ * received the keypad's previous payload, the shared lighting clock
+ */
+#define ESB_AIR_CLOCK 0x03
+
+/* To the network core: data is a keyboard report of len bytes */
+#define ESB_MSG_REPORT 0x01
+/* To the application core: data[0] reports were acknowledged */
+#define ESB_MSG_DONE 0x81
+/*
+ * To the application core: data[0] is 1 once the dongle acknowledges,
+ * 0 when a payload ran out of retransmits. Reports not yet done when
+ * the link goes down are flushed.
+ */
+#define ESB_MSG_LINK 0x82
+/*
+ * To the application core: the dongle's clock, le32 ms in data[0..3],
+ * was that many le32 us before the message in data[4..7]
+ */
+#define ESB_MSG_CLOCK 0x83
+
+#endif /* KEYPAD_ESB_LINK_H_ */
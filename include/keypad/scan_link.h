@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Key scan offloaded to the network core, shared by the two images
+ * taking part:
+ *
+ *   application core  src/ipc/scan_remote.c, the scan.h API over the
+ *                     shared-memory ring (src/ipc/shm_ring.h)
+ *   network core      scan/netcore, src/scan.c and the debounce on the
+ *                     key lines the application core handed over
+ *
+ * The ring messages between the cores use the SCAN_MSG_* types.
+ */
+
+#ifndef KEYPAD_SCAN_LINK_H_
+#define KEYPAD_SCAN_LINK_H_
+
+/*
+ * To the network core: the key lines are now controlled by it, start
+ * the scan. Sent once, from scan_init() on the application core.
+ */
+#define SCAN_MSG_START 0x01
+/* To the network core: data[0] is 1 to suspend the scan, 0 to resume */
+#define SCAN_MSG_SUSPEND 0x02
+/* To the network core: re-read the lines without debounce */
+#define SCAN_MSG_REFRESH 0x03
+/* To the network core: re-read the lines through the debounce */
+#define SCAN_MSG_RESYNC 0x04
+
+/*
+ * To the application core: a debounced change, the pressed and the
+ * changed key bitmaps of the scan handler as little-endian words.
+ */
+#define SCAN_MSG_KEYS 0x81
+#define SCAN_MSG_KEYS_LEN 8
+
+#endif /* KEYPAD_SCAN_LINK_H_ */
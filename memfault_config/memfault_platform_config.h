@@ -0,0 +1,13 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Memfault SDK settings of the keypad, the defaults of the Zephyr port
+ * otherwise.
+ */
+
+#ifndef KEYPAD_MEMFAULT_PLATFORM_CONFIG_H_
+#define KEYPAD_MEMFAULT_PLATFORM_CONFIG_H_
+
+#endif /* KEYPAD_MEMFAULT_PLATFORM_CONFIG_H_ */
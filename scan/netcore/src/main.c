@@ -0,0 +1,212 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Network core image of CONFIG_KEYPAD_SCAN_NETCORE: runs the scan
+ * engine and debounce of src/scan.c on the key lines the application
+ * core handed over, and posts each debounced change to it through the
+ * shared-memory ring. Build for nrf5340dk_nrf5340_cpunet next to an
+ * application built with overlay-netscan.conf.
+ *
+ * This side consumes the ring to the network core and produces the
+ * one to the application core, the reverse of src/ipc/shm_ring.c. The
+ * scan handler posts from the GPIO and timer interrupts with
+ * interrupts locked, so it stays the only producer. A change the full
+ * ring refused is folded into the next message, which carries the
+ * whole pressed bitmap anyway.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/device.h>
+#include <zephyr/devicetree.h>
+#include <zephyr/drivers/mbox.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/byteorder.h>
+#include <soc.h>
+#include <keypad/scan_link.h>
+
+#include "ipc/shm_ring.h"
+#include "scan.h"
+
+LOG_MODULE_REGISTER(scan_netcore, LOG_LEVEL_INF);
+
+#define RING_NODE DT_CHOSEN(richeffects_ipc_ring)
+#define RING_SLOTS CONFIG_KEYPAD_IPC_RING_SLOTS
+
+/* Retry of a change the full ring refused */
+#define KEYS_RETRY K_MSEC(1)
+
+BUILD_ASSERT(SCAN_MSG_KEYS_LEN <= SHM_MSG_PAYLOAD,
+	     "a key change must fit a message");
+
+static struct shm_region *const region =
+	(struct shm_region *)DT_REG_ADDR(RING_NODE);
+
+static struct mbox_channel tx_channel;
+static struct mbox_channel rx_channel;
+
+static K_SEM_DEFINE(wake, 0, 1);
+
+/* Debounced state, and the changes not yet on the ring */
+static keypad_bitmap_t pressed;
+static keypad_bitmap_t unsent;
+
+static void doorbell(const struct device *dev, uint32_t channel,
+		     void *user_data, struct mbox_msg *data)
+{
+	k_sem_give(&wake);
+}
+
+/* Publish the pending changes to the application core, IRQs locked */
+static void keys_post(void)
+{
+	struct shm_ring *ring = &region->to_app;
+	uint32_t head = ring->head;
+	struct shm_msg *msg;
+
+	if (unsent == 0 ||
+	    head - *(volatile uint32_t *)&ring->tail == RING_SLOTS) {
+		return;
+	}
+
+	msg = &ring->slot[head % RING_SLOTS];
+	msg->type = SCAN_MSG_KEYS;
+	msg->len = SCAN_MSG_KEYS_LEN;
+	sys_put_le32(pressed, &msg->data[0]);
+	sys_put_le32(unsent, &msg->data[4]);
+	unsent = 0;
+
+	/* The slot is complete before the application core sees the index */
+	__DMB();
+	*(volatile uint32_t *)&ring->head = head + 1;
+	(void)mbox_send(&tx_channel, NULL);
+}
+
+/* Scan handler, from interrupt context */
+static void keys_changed(keypad_bitmap_t state, keypad_bitmap_t changed)
+{
+	unsigned int key = irq_lock();
+
+	pressed = state;
+	unsent |= changed;
+	keys_post();
+
+	irq_unlock(key);
+}
+
+/* Act on every message of the application core, true once started */
+static bool ring_drain(bool started)
+{
+	struct shm_ring *ring = &region->to_net;
+
+	while (ring->tail != *(volatile uint32_t *)&ring->head) {
+		const struct shm_msg *msg;
+		int ret;
+
+		/* The index was published after the slot */
+		__DMB();
+		msg = &ring->slot[ring->tail % RING_SLOTS];
+
+		switch (msg->type) {
+		case SCAN_MSG_START:
+			if (started) {
+				break;
+			}
+
+			/* The lines are ours from here on */
+			ret = scan_init(keys_changed);
+			if (ret < 0) {
+				LOG_ERR("Failed to init scan, error: %d", ret);
+				break;
+			}
+
+			started = true;
+			break;
+		case SCAN_MSG_SUSPEND:
+			if (!started) {
+				break;
+			}
+
+			if (msg->data[0] != 0) {
+				scan_suspend();
+			} else {
+				scan_resume();
+			}
+			break;
+		case SCAN_MSG_REFRESH:
+			if (started) {
+				scan_refresh();
+			}
+			break;
+		case SCAN_MSG_RESYNC:
+			if (started) {
+				scan_resync();
+			}
+			break;
+		default:
+			LOG_WRN("Unknown message 0x%02x", msg->type);
+			break;
+		}
+
+		/* Done reading before the slot is handed back */
+		__DMB();
+		*(volatile uint32_t *)&ring->tail = ring->tail + 1;
+	}
+
+	return started;
+}
+
+static int ring_init(void)
+{
+	const struct device *mbox = DEVICE_DT_GET(DT_NODELABEL(mbox));
+	int ret;
+
+	if (!device_is_ready(mbox)) {
+		return -ENODEV;
+	}
+
+	/* The application core clears the rings before setting it */
+	while (*(volatile uint32_t *)&region->magic != SHM_RING_MAGIC) {
+		k_msleep(1);
+	}
+
+	__DMB();
+
+	/* The channels of the application core, the other way round */
+	mbox_init_channel(&tx_channel, mbox, CONFIG_KEYPAD_IPC_RING_RX_CHANNEL);
+	mbox_init_channel(&rx_channel, mbox, CONFIG_KEYPAD_IPC_RING_TX_CHANNEL);
+
+	ret = mbox_register_callback(&rx_channel, doorbell, NULL);
+	if (ret == 0) {
+		ret = mbox_set_enabled(&rx_channel, true);
+	}
+
+	return ret;
+}
+
+void main(void)
+{
+	bool started = false;
+	unsigned int key;
+	int ret;
+
+	ret = ring_init();
+	if (ret) {
+		LOG_ERR("Failed to set up the ring, error: %d", ret);
+		return;
+	}
+
+	LOG_INF("Waiting for the key lines");
+
+	while (true) {
+		/* Sleeps on the doorbell, or retries a refused change */
+		(void)k_sem_take(&wake, unsent != 0 ? KEYS_RETRY : K_FOREVER);
+
+		started = ring_drain(started);
+
+		key = irq_lock();
+		keys_post();
+		irq_unlock(key);
+	}
+}
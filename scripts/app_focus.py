@@ -0,0 +1,83 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2022 Rich Effects
+#
+# SPDX-License-Identifier: Apache-2.0
+
+"""Switch the keypad's profile with the application in focus.
+
+Host agent for CONFIG_KEYPAD_PROFILE_CACHE (src/config/profile_cache.h).
+Reads a JSON map of application names to profile slots,
+
+    {"code": 1, "kitty": 2, "blender": 3}
+
+uploaded beforehand with profile_compile.py --slot, and polls the name
+of the focused application by running --focus, by default the window
+class from xdotool on Linux and the frontmost process from osascript on
+macOS. Each time it changes the keypad gets the raw HID APP command
+with its slot, or home for an application not in the map, the keymap
+edited last. Only changes are sent: the keypad keeps the profiles used
+last and the one likely next in RAM, so the switch lands by the next
+scan.
+"""
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import keypad_hid  # noqa: E402
+
+FOCUS_LINUX = 'xdotool getactivewindow getwindowclassname'
+FOCUS_MACOS = ('osascript -e \'tell application "System Events" to get '
+               'name of first process whose frontmost is true\'')
+
+
+def focused(command):
+    """Name of the application in focus, '' when there is none."""
+    try:
+        out = subprocess.run(command, shell=True, capture_output=True,
+                             text=True, timeout=2)
+    except subprocess.TimeoutExpired:
+        return ''
+    return out.stdout.strip().lower()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('apps', help='JSON map of application to slot')
+    parser.add_argument('--hid', required=True,
+                        help='hidraw node or hidapi path of the keypad')
+    parser.add_argument('--focus', default=(FOCUS_MACOS
+                                            if sys.platform == 'darwin'
+                                            else FOCUS_LINUX),
+                        help='command printing the focused application')
+    parser.add_argument('--interval', type=float, default=0.2,
+                        help='seconds between focus polls')
+    args = parser.parse_args()
+
+    with open(args.apps) as f:
+        apps = {name.lower(): slot for name, slot in json.load(f).items()}
+
+    keypad = keypad_hid.Keypad(args.hid)
+    slot = None
+    while True:
+        app = focused(args.focus)
+        wanted = apps.get(app, keypad_hid.PROFILE_HOME)
+        if wanted != slot:
+            try:
+                keypad.app(wanted)
+                slot = wanted
+                print(f'{app or "(none)"}: '
+                      f'{"home" if slot == keypad_hid.PROFILE_HOME else slot}')
+            except (RuntimeError, TimeoutError) as e:
+                # Busy during an edit, tried again at the next poll
+                print(f'{app}: {e}', file=sys.stderr)
+        time.sleep(args.interval)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,59 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2022 Rich Effects
+#
+# SPDX-License-Identifier: Apache-2.0
+
+"""Print every key transition of the keypad.
+
+Turns on the event batches of a keypad built with
+CONFIG_KEYPAD_EVENT_BATCH (src/diag/batch.h) over raw HID and prints one
+line per transition: the key, press or release, when it happened in
+microseconds of the keypad's uptime and in ms of host time since the
+script started, mapped through the clock fit of keypad_hid.py. Unlike
+the keyboard reports nothing is folded together, a tap inside one
+polling interval shows as both its press and its release. Stops the
+batches again on Ctrl-C.
+"""
+
+import argparse
+import os
+import sys
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import keypad_hid  # noqa: E402
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--hid', required=True,
+                        help='hidraw node of the raw HID interface')
+    args = parser.parse_args()
+
+    keypad = keypad_hid.Keypad(args.hid)
+    try:
+        keypad.stream(batch=True)
+    except RuntimeError:
+        sys.exit('batches refused, is CONFIG_KEYPAD_EVENT_BATCH on?')
+
+    start_ns = time.perf_counter_ns()
+    lost = missed = 0
+    try:
+        for event in keypad.events():
+            if keypad.lost != lost or keypad.missed != missed:
+                print(f'{keypad.lost - lost} reports lost, '
+                      f'{keypad.missed - missed} transitions missed')
+                lost, missed = keypad.lost, keypad.missed
+            print(f'key {event.key:2} '
+                  f'{"press  " if event.pressed else "release"} '
+                  f'{event.device_us} us, host '
+                  f'{(event.host_ns - start_ns) / 1e6:.3f} ms')
+    except KeyboardInterrupt:
+        keypad.stream()
+        print(f'clock skew {keypad.clock.skew_ppm:+.1f} ppm, '
+              f'{keypad.overruns} reports dropped on the host')
+
+
+if __name__ == '__main__':
+    main()
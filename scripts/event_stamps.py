@@ -0,0 +1,80 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2022 Rich Effects
+#
+# SPDX-License-Identifier: Apache-2.0
+
+"""Print the device timestamp of every key event.
+
+Turns on the event stamps of a keypad built with
+CONFIG_KEYPAD_EVENT_STAMPS (src/diag/stamps.h) over raw HID and prints
+one line per key event: the keyboard report it went out in, the key,
+press or release, and when it happened in microseconds of the keypad's
+uptime. Events that share a report keep their own times. Stops the
+stamps again on Ctrl-C.
+"""
+
+import argparse
+import os
+import struct
+import sys
+
+RAW_HID_REPORT_SIZE = 64
+RAW_HID_CMD_STAMPS = 0x0d
+RAW_HID_IN_STAMPS = 0x80
+STAMPS_HEADER = struct.Struct('<BBBBBI')
+STAMPS_EVENT = struct.Struct('<BBI')
+UPLOAD_STATUS_SEQUENCE = 1
+UPLOAD_STATUS_UNSUPPORTED = 4
+
+
+def command(fd, seq, on):
+    """Send STAMPS, returns the ack."""
+    out = bytes([RAW_HID_CMD_STAMPS, seq, 1 if on else 0])
+    os.write(fd, b'\0' + out.ljust(RAW_HID_REPORT_SIZE, b'\0'))
+
+    reply = os.read(fd, RAW_HID_REPORT_SIZE)
+    while reply[0] == RAW_HID_IN_STAMPS:
+        reply = os.read(fd, RAW_HID_REPORT_SIZE)
+    return reply
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--hid', required=True,
+                        help='hidraw node of the raw HID interface')
+    args = parser.parse_args()
+
+    fd = os.open(args.hid, os.O_RDWR)
+
+    # A refused sequence number is answered with the expected one
+    reply = command(fd, 0, True)
+    if reply[0] == UPLOAD_STATUS_SEQUENCE:
+        reply = command(fd, reply[1], True)
+    if reply[0] == UPLOAD_STATUS_UNSUPPORTED:
+        sys.exit('stamps refused, is CONFIG_KEYPAD_EVENT_STAMPS on?')
+    seq = reply[1]
+
+    try:
+        while True:
+            report = os.read(fd, RAW_HID_REPORT_SIZE)
+            if report[0] != RAW_HID_IN_STAMPS:
+                continue
+
+            _, frame, count, _, dropped, submit_us = \
+                STAMPS_HEADER.unpack_from(report)
+            if dropped:
+                print(f'{dropped} events dropped')
+            for i in range(count):
+                key, pressed, age_us = STAMPS_EVENT.unpack_from(
+                    report, STAMPS_HEADER.size + i * STAMPS_EVENT.size)
+                at = (submit_us - age_us) % 2**32
+                print(f'report {frame:3} key {key:2} '
+                      f'{"press  " if pressed else "release"} {at} us')
+    except KeyboardInterrupt:
+        os.write(fd, b'\0' + bytes([RAW_HID_CMD_STAMPS, seq, 0]).ljust(
+            RAW_HID_REPORT_SIZE, b'\0'))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,69 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2022 Rich Effects
+#
+# SPDX-License-Identifier: Apache-2.0
+
+"""Run the factory test of the keypad.
+
+Starts the factory test of a keypad built with CONFIG_KEYPAD_FACTORY_TEST
+(src/diag/factory.h) over raw HID while the fixture presses every key,
+then prints the result: the keys that passed, chattered or were never
+pressed, the outputs that failed and the timing stats. Exits with 0 if
+the unit passed, 1 if it failed.
+"""
+
+import argparse
+import os
+import sys
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import keypad_hid  # noqa: E402
+
+OUTPUTS = ('pwm', 'rgb', 'haptic', 'click')
+
+
+def keys(bitmap):
+    """Key indices of a bitmap, as a string."""
+    return ' '.join(str(i) for i in range(32) if bitmap & 1 << i) or '-'
+
+
+def outputs(bits):
+    """Names of FACTORY_OUT_* bits, as a string."""
+    return ' '.join(n for i, n in enumerate(OUTPUTS) if bits & 1 << i) or '-'
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--hid', required=True,
+                        help='hidraw node of the raw HID interface')
+    parser.add_argument('--window', type=int, default=0,
+                        help='ms to wait for the fixture, 0 for the '
+                        'keypad\'s default')
+    args = parser.parse_args()
+
+    keypad = keypad_hid.Keypad(args.hid)
+    try:
+        (_, count, driven, failed, passed, chatter, never, first, spread,
+         hold_min, hold_max, transitions, missed, battery_mv,
+         ms) = keypad.factory(args.window)
+    except RuntimeError as e:
+        sys.exit(f'{e}, is CONFIG_KEYPAD_FACTORY_TEST on?')
+
+    ok = (passed == (1 << count) - 1 and not chatter and not never and
+          not failed)
+    print(f'{"PASS" if ok else "FAIL"} in {ms} ms, {count} keys, '
+          f'{transitions} transitions, {missed} missed')
+    print(f'  passed   {keys(passed)}')
+    print(f'  chatter  {keys(chatter)}')
+    print(f'  never    {keys(never)}')
+    print(f'  outputs  {outputs(driven)}, failed {outputs(failed)}')
+    print(f'  first press {first} us, spread {spread} us, '
+          f'hold {hold_min}..{hold_max} us')
+    if battery_mv:
+        print(f'  battery  {battery_mv} mV')
+    sys.exit(0 if ok else 1)
+
+
+if __name__ == '__main__':
+    main()
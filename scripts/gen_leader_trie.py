@@ -0,0 +1,143 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2022 Rich Effects
+#
+# SPDX-License-Identifier: Apache-2.0
+
+"""Leader sequence trie generator.
+
+Reads the devicetree of the build (edt.pickle) and turns the children
+of the richeffects,keypad-leader node into a trie of const tables, see
+src/leader.h for the layout. Every node's edges are sorted by usage and
+stored next to each other, so the firmware steps one key with a binary
+search over that node's edges only, whatever the number of sequences.
+
+A sequence must not be a prefix of another one: without a timeout there
+would be no way to tell the two apart.
+"""
+
+import argparse
+import os
+import pickle
+import sys
+
+LEADER_COMPAT = "richeffects,keypad-leader"
+MACROS_COMPAT = "richeffects,keypad-macros"
+# struct leader_node::macro of inner nodes
+NO_MACRO = 0xFF
+
+
+class TrieNode:
+    def __init__(self):
+        self.children = {}
+        self.macro = None
+        self.name = None
+
+
+def okay_children(edt, compat):
+    nodes = edt.compat2okay.get(compat, [])
+    if not nodes:
+        return []
+
+    return [c for c in nodes[0].children.values() if c.status == "okay"]
+
+
+def build(edt):
+    macro_count = len(okay_children(edt, MACROS_COMPAT))
+    root = TrieNode()
+
+    for child in okay_children(edt, LEADER_COMPAT):
+        seq = bytes(child.props["sequence"].val)
+        macro = child.props["macro"].val
+
+        if not seq:
+            sys.exit(f"{child.path}: empty sequence")
+        if macro >= macro_count:
+            sys.exit(f"{child.path}: macro {macro}, only {macro_count} defined")
+
+        node = root
+        for usage in seq:
+            if node.macro is not None:
+                sys.exit(f"{child.path}: {node.name} is a prefix of it")
+            node = node.children.setdefault(usage, TrieNode())
+
+        if node.macro is not None or node.children:
+            sys.exit(f"{child.path}: clashes with another sequence")
+
+        node.macro = macro
+        node.name = child.path
+
+    return root
+
+
+def flatten(root):
+    """Breadth first, so the edges of one node end up contiguous."""
+    nodes = [root]
+    edges = []
+    table = []
+
+    for node in nodes:
+        first = len(edges)
+        for usage in sorted(node.children):
+            edges.append((usage, len(nodes)))
+            nodes.append(node.children[usage])
+
+        table.append((first, len(node.children),
+                      NO_MACRO if node.macro is None else node.macro))
+
+    return table, edges
+
+
+def write(out, table, edges):
+    out.write("/* Generated by scripts/gen_leader_trie.py, do not edit */\n\n")
+    out.write('#include "leader.h"\n\n')
+
+    out.write("const struct leader_node leader_nodes[] = {\n")
+    for first, count, macro in table:
+        out.write(f"\t{{ .edge = {first}, .edges = {count}, "
+                  f".macro = 0x{macro:02x} }},\n")
+    out.write("};\n\n")
+
+    # Never empty, so the arrays are valid C without a devicetree node
+    edges = edges or [(0, 0)]
+
+    out.write("const uint8_t leader_edge_usage[] = {\n")
+    for usage, _ in edges:
+        out.write(f"\t0x{usage:02x},\n")
+    out.write("};\n\n")
+
+    out.write("const uint16_t leader_edge_node[] = {\n")
+    for _, node in edges:
+        out.write(f"\t{node},\n")
+    out.write("};\n")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--edt-pickle", required=True,
+                        help="edt.pickle of the build")
+    parser.add_argument("--zephyr-base", required=True,
+                        help="Zephyr tree, for the devicetree package")
+    parser.add_argument("--output", required=True,
+                        help="C source to write")
+    args = parser.parse_args()
+
+    sys.path.insert(0, os.path.join(args.zephyr_base, "scripts", "dts",
+                                    "python-devicetree", "src"))
+
+    with open(args.edt_pickle, "rb") as f:
+        edt = pickle.load(f)
+
+    table, edges = flatten(build(edt))
+    if len(table) > 0xFFFF or len(edges) > 0xFFFF:
+        sys.exit("leader trie has more than 65535 nodes")
+    if any(count > 0xFF for _, count, _ in table):
+        sys.exit("leader trie node with more than 255 edges")
+
+    with open(args.output, "w") as out:
+        write(out, table, edges)
+
+
+if __name__ == "__main__":
+    main()
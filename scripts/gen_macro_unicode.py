@@ -0,0 +1,184 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2022 Rich Effects
+#
+# SPDX-License-Identifier: Apache-2.0
+
+"""Text and unicode macro generator.
+
+Reads the devicetree of the build (edt.pickle) and turns the text or
+unicode string of every richeffects,keypad-macros child that has one
+into the key sequence that types it, in the opcodes of
+include/dt-bindings/keypad/macros.h. src/macro.c takes the sequences
+from the header written here in place of the sequence property, so the
+firmware plays them like any other macro and converts nothing.
+
+Text is typed with the keys of --host-layout, CONFIG_KEYPAD_HOST_LAYOUT,
+see host_layout.py. Unicode is typed code point by code point with the
+input method of the macro's host-os:
+
+  linux    Ctrl+Shift+U, the hex digits, Space (IBus and GTK)
+  macos    the hex digits of each UTF-16 unit with Option held, for the
+           Unicode Hex Input source
+  windows  Right Alt, U, the hex digits, Enter, for WinCompose with its
+           default compose key
+
+The hex digits and U are typed on --host-layout too, but for macOS:
+Unicode Hex Input is a layout of its own, with the US keys.
+"""
+
+import argparse
+import os
+import pickle
+import sys
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import host_layout  # noqa: E402
+
+MACROS_COMPAT = "richeffects,keypad-macros"
+
+# include/dt-bindings/keypad/macros.h
+MACRO_DOWN = 0x01
+MACRO_UP = 0x02
+
+LEFT_CTRL = 0xE0
+LEFT_SHIFT = 0xE1
+LEFT_ALT = 0xE2
+RIGHT_ALT = 0xE6
+USAGE_ENTER = 0x28
+USAGE_SPACE = 0x2C
+# struct macro::len
+SEQUENCE_MAX = 0xFFFF
+
+
+def hex_usages(value, layout, digits=0):
+    """Sequence typing value in hex on layout, at least digits long."""
+    return host_layout.text_sequence(f"{value:0{digits}x}", layout, "hex")
+
+
+def usage_u(layout):
+    """The key typing u on layout."""
+    return host_layout.table(layout)["u"][0]
+
+
+def utf16_units(cp):
+    if cp < 0x10000:
+        return [cp]
+    cp -= 0x10000
+    return [0xD800 + (cp >> 10), 0xDC00 + (cp & 0x3FF)]
+
+
+def linux(cp, layout):
+    return [MACRO_DOWN, LEFT_CTRL, MACRO_DOWN, LEFT_SHIFT, usage_u(layout),
+            MACRO_UP, LEFT_SHIFT, MACRO_UP, LEFT_CTRL] + \
+           hex_usages(cp, layout) + [USAGE_SPACE]
+
+
+def macos(cp, layout):
+    seq = [MACRO_DOWN, LEFT_ALT]
+    for unit in utf16_units(cp):
+        seq += hex_usages(unit, "us", 4)
+    return seq + [MACRO_UP, LEFT_ALT]
+
+
+def windows(cp, layout):
+    return [RIGHT_ALT, usage_u(layout)] + hex_usages(cp, layout) + \
+           [USAGE_ENTER]
+
+
+HOSTS = {
+    "linux": linux,
+    "macos": macos,
+    "windows": windows,
+}
+
+
+def okay_children(edt, compat):
+    nodes = edt.compat2okay.get(compat, [])
+    if not nodes:
+        return []
+
+    return [c for c in nodes[0].children.values() if c.status == "okay"]
+
+
+def collect(edt, layout="us"):
+    """Returns (dependency ordinal, path, sequence) per generated macro."""
+    macros = []
+
+    for child in okay_children(edt, MACROS_COMPAT):
+        given = [p for p in ("sequence", "text", "unicode")
+                 if p in child.props]
+
+        if len(given) != 1:
+            sys.exit(f"{child.path}: needs one of a sequence, text or "
+                     "unicode")
+        if given[0] == "sequence":
+            continue
+
+        string = child.props[given[0]].val
+        if not string:
+            sys.exit(f"{child.path}: empty {given[0]} string")
+
+        if given[0] == "text":
+            seq = host_layout.text_sequence(string, layout, child.path)
+        else:
+            to_keys = HOSTS[child.props["host-os"].val]
+            seq = []
+            for c in string:
+                seq += to_keys(ord(c), layout)
+
+        if len(seq) > SEQUENCE_MAX:
+            sys.exit(f"{child.path}: {len(seq)} bytes, more than "
+                     f"{SEQUENCE_MAX}")
+
+        macros.append((child.dep_ordinal, child.path, seq))
+
+    return macros
+
+
+def write(out, macros):
+    out.write("/* Generated by scripts/gen_macro_unicode.py, "
+              "do not edit */\n\n")
+    out.write("#ifndef KEYPAD_MACRO_UNICODE_H_\n")
+    out.write("#define KEYPAD_MACRO_UNICODE_H_\n")
+
+    for ordinal, path, seq in macros:
+        out.write(f"\n/* {path} */\n")
+        out.write(f"#define MACRO_UNICODE_LEN_{ordinal} {len(seq)}\n")
+        out.write(f"#define MACRO_UNICODE_SEQ_{ordinal} {{ \\\n")
+        for i in range(0, len(seq), 8):
+            row = ", ".join(f"0x{b:02x}" for b in seq[i:i + 8])
+            out.write(f"\t{row}, \\\n")
+        out.write("}\n")
+
+    out.write("\n#endif /* KEYPAD_MACRO_UNICODE_H_ */\n")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--edt-pickle", required=True,
+                        help="edt.pickle of the build")
+    parser.add_argument("--zephyr-base", required=True,
+                        help="Zephyr tree, for the devicetree package")
+    parser.add_argument("--output", required=True,
+                        help="C header to write")
+    parser.add_argument("--host-layout", default="us",
+                        choices=sorted(host_layout.LAYOUTS),
+                        help="keyboard layout of the host")
+    args = parser.parse_args()
+
+    sys.path.insert(0, os.path.join(args.zephyr_base, "scripts", "dts",
+                                    "python-devicetree", "src"))
+
+    with open(args.edt_pickle, "rb") as f:
+        edt = pickle.load(f)
+
+    macros = collect(edt, args.host_layout)
+
+    with open(args.output, "w") as out:
+        write(out, macros)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,177 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2022 Rich Effects
+#
+# SPDX-License-Identifier: Apache-2.0
+
+"""NKRO usage range generator.
+
+Reads the devicetree of the build (edt.pickle) and finds every keyboard
+usage the keymap can put into a report: the keycodes of the key
+backends and the layers, the combos and shortcuts, the tap usages of
+tap-hold actions and every usage the macros press, text and unicode
+macros as scripts/gen_macro_unicode.py types them on --host-layout. The header written here gives
+src/report.h the byte aligned range of the NKRO bitmap that covers
+them, so the report descriptor and the report hold that many bits and
+no more.
+
+Modifiers go in the modifier byte and are left out. A keymap without a
+single usage still gets one byte of bitmap.
+"""
+
+import argparse
+import os
+import pickle
+import sys
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import gen_macro_unicode  # noqa: E402
+
+# Nodes with a keycodes array, one action per key
+KEYCODES_COMPATS = [
+    "richeffects,keypad-matrix",
+    "richeffects,keypad-shift-register",
+    "richeffects,keypad-analog",
+    "richeffects,keypad-split",
+]
+# Nodes with a keycodes array or a keycode in every child
+CHILD_COMPATS = [
+    "richeffects,keypad-layers",
+    "richeffects,keypad-keymap",
+    "richeffects,keypad-combos",
+    "richeffects,keypad-shortcuts",
+]
+MACROS_COMPAT = "richeffects,keypad-macros"
+
+# include/dt-bindings/keypad/layers.h
+LAYER_ACTION_MASK = 0xFF00
+LAYER_ACTION_USAGE = 0x0000
+LAYER_ACTION_TAP_HOLD_MASK = 0xE000
+LAYER_ACTION_LT = 0x4000
+LAYER_ACTION_MT = 0x6000
+
+# include/dt-bindings/keypad/macros.h
+MACRO_DOWN = 0x01
+MACRO_UP = 0x02
+MACRO_WAIT = 0x03
+
+# Keyboard usages that can go in the bitmap, below the modifiers
+USAGE_FIRST = 0x04
+USAGE_LAST = 0xDF
+
+
+def okay_children(edt, compat):
+    nodes = edt.compat2okay.get(compat, [])
+    if not nodes:
+        return []
+
+    return [c for c in nodes[0].children.values() if c.status == "okay"]
+
+
+def action_usage(action):
+    """Usage the action sends as a key of the keyboard, or None."""
+    tap_hold = action & LAYER_ACTION_TAP_HOLD_MASK
+    if tap_hold in (LAYER_ACTION_LT, LAYER_ACTION_MT):
+        return action & 0xFF
+    if tap_hold != 0 or action & LAYER_ACTION_MASK != LAYER_ACTION_USAGE:
+        return None
+    return action
+
+
+def sequence_usages(seq):
+    """Usages pressed by a macro sequence, as src/macro.c plays it."""
+    usages = []
+    pos = 0
+
+    while pos < len(seq):
+        op = seq[pos]
+        if op in (MACRO_DOWN, MACRO_UP, MACRO_WAIT):
+            if op != MACRO_WAIT and pos + 1 < len(seq):
+                usages.append(seq[pos + 1])
+            pos += 2
+        else:
+            usages.append(op)
+            pos += 1
+
+    return usages
+
+
+def collect(edt, layout="us"):
+    """Returns the set of keyboard usages the devicetree emits."""
+    actions = []
+    usages = []
+
+    for compat in KEYCODES_COMPATS:
+        for node in edt.compat2okay.get(compat, []):
+            actions += node.props["keycodes"].val
+
+    for compat in CHILD_COMPATS:
+        for child in okay_children(edt, compat):
+            for name in ("keycodes", "keycode"):
+                prop = child.props.get(name)
+                if prop is None:
+                    continue
+                if isinstance(prop.val, list):
+                    actions += prop.val
+                else:
+                    actions.append(prop.val)
+
+    for child in okay_children(edt, MACROS_COMPAT):
+        seq = child.props.get("sequence")
+        if seq is not None:
+            usages += sequence_usages(seq.val)
+
+    for _, _, seq in gen_macro_unicode.collect(edt, layout):
+        usages += sequence_usages(seq)
+
+    usages += [u for u in map(action_usage, actions) if u is not None]
+
+    return {u for u in usages if USAGE_FIRST <= u <= USAGE_LAST}
+
+
+def write(out, usages):
+    if usages:
+        first = min(usages) & ~7
+        last = max(usages)
+    else:
+        first = 0
+        last = 7
+
+    out.write("/* Generated by scripts/gen_report_usages.py, "
+              "do not edit */\n\n")
+    out.write("#ifndef KEYPAD_REPORT_USAGES_H_\n")
+    out.write("#define KEYPAD_REPORT_USAGES_H_\n\n")
+    out.write(f"/* {len(usages)} usages emitted by the keymap */\n")
+    out.write(f"#define REPORT_NKRO_FIRST 0x{first:02x}\n")
+    out.write(f"#define REPORT_NKRO_LAST 0x{last:02x}\n")
+    out.write("\n#endif /* KEYPAD_REPORT_USAGES_H_ */\n")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--edt-pickle", required=True,
+                        help="edt.pickle of the build")
+    parser.add_argument("--zephyr-base", required=True,
+                        help="Zephyr tree, for the devicetree package")
+    parser.add_argument("--output", required=True,
+                        help="C header to write")
+    parser.add_argument("--host-layout", default="us",
+                        help="keyboard layout of the host, for text "
+                        "macros")
+    args = parser.parse_args()
+
+    sys.path.insert(0, os.path.join(args.zephyr_base, "scripts", "dts",
+                                    "python-devicetree", "src"))
+
+    with open(args.edt_pickle, "rb") as f:
+        edt = pickle.load(f)
+
+    usages = collect(edt, args.host_layout)
+
+    with open(args.output, "w") as out:
+        write(out, usages)
+
+
+if __name__ == "__main__":
+    main()
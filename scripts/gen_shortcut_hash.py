@@ -0,0 +1,159 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2022 Rich Effects
+#
+# SPDX-License-Identifier: Apache-2.0
+
+"""Shortcut perfect hash generator.
+
+Reads the devicetree of the build (edt.pickle) and turns the children
+of the richeffects,keypad-shortcuts node into a minimal perfect hash of
+const tables, see src/shortcut.h for the layout. Triggers are spread
+over buckets of about two, and the buckets are placed largest first:
+each gets the first seed that hashes all of its triggers to slots still
+free. The firmware then finds a trigger with two hashes and one compare.
+
+Two shortcuts with the same layer, key and modifiers are an error.
+"""
+
+import argparse
+import os
+import pickle
+import sys
+
+SHORTCUTS_COMPAT = "richeffects,keypad-shortcuts"
+# Triggers per bucket on average
+BUCKET_LOAD = 2
+SEED_MAX = 0xFFFF
+# src/shortcut.h SHORTCUT_TRIGGER_NONE
+TRIGGER_NONE = 0xFFFFFFFF
+MASK32 = 0xFFFFFFFF
+
+
+def shortcut_hash(x, seed):
+    """Same as the one in src/shortcut.c."""
+    x ^= (seed * 0x9E3779B9) & MASK32
+    x ^= x >> 16
+    x = (x * 0x7FEB352D) & MASK32
+    x ^= x >> 15
+    x = (x * 0x846CA68B) & MASK32
+    x ^= x >> 16
+    return x
+
+
+def trigger(layer, key, modifiers):
+    return layer << 16 | modifiers << 8 | key
+
+
+def okay_children(edt, compat):
+    nodes = edt.compat2okay.get(compat, [])
+    if not nodes:
+        return []
+
+    return [c for c in nodes[0].children.values() if c.status == "okay"]
+
+
+def collect(edt):
+    shortcuts = {}
+
+    for child in okay_children(edt, SHORTCUTS_COMPAT):
+        layer = child.props["layer"].val
+        key = child.props["key"].val
+        modifiers = child.props["modifiers"].val
+        action = child.props["keycode"].val
+
+        if layer > 0xFF or key > 0xFF or modifiers > 0xFF:
+            sys.exit(f"{child.path}: layer, key and modifiers are bytes")
+        if action > 0xFFFF:
+            sys.exit(f"{child.path}: action 0x{action:x} is not 16 bits")
+
+        t = trigger(layer, key, modifiers)
+        if t in shortcuts:
+            sys.exit(f"{child.path}: same trigger as {shortcuts[t][1]}")
+        shortcuts[t] = (action, child.path)
+
+    return {t: action for t, (action, _) in shortcuts.items()}
+
+
+def place(shortcuts):
+    """Returns the bucket seeds and the slots, None where free."""
+    slot_count = max(len(shortcuts), 1)
+    bucket_count = max((len(shortcuts) + BUCKET_LOAD - 1) // BUCKET_LOAD, 1)
+    buckets = [[] for _ in range(bucket_count)]
+    seeds = [0] * bucket_count
+    slots = [None] * slot_count
+
+    for t in shortcuts:
+        buckets[shortcut_hash(t, 0) % bucket_count].append(t)
+
+    order = sorted(range(bucket_count), key=lambda b: -len(buckets[b]))
+    for b in order:
+        if not buckets[b]:
+            break
+
+        for seed in range(1, SEED_MAX + 1):
+            taken = [shortcut_hash(t, seed) % slot_count for t in buckets[b]]
+            if len(set(taken)) == len(taken) and \
+               all(slots[s] is None for s in taken):
+                break
+        else:
+            sys.exit("no perfect hash found, too many shortcuts")
+
+        seeds[b] = seed
+        for t, s in zip(buckets[b], taken):
+            slots[s] = (t, shortcuts[t])
+
+    return seeds, slots
+
+
+def write(out, seeds, slots, count):
+    out.write("/* Generated by scripts/gen_shortcut_hash.py, "
+              "do not edit */\n\n")
+    out.write('#include "shortcut.h"\n\n')
+
+    out.write("const struct shortcut_entry shortcut_entries[] = {\n")
+    for slot in slots:
+        t, action = slot or (TRIGGER_NONE, 0)
+        out.write(f"\t{{ .trigger = 0x{t:08x}, "
+                  f".action = 0x{action:04x} }},\n")
+    out.write("};\n\n")
+
+    out.write("const uint16_t shortcut_seeds[] = {\n")
+    for seed in seeds:
+        out.write(f"\t{seed},\n")
+    out.write("};\n\n")
+
+    out.write(f"const uint16_t shortcut_slot_count = {len(slots)};\n")
+    out.write(f"const uint16_t shortcut_bucket_count = {len(seeds)};\n")
+    out.write(f"const uint16_t shortcut_count = {count};\n")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--edt-pickle", required=True,
+                        help="edt.pickle of the build")
+    parser.add_argument("--zephyr-base", required=True,
+                        help="Zephyr tree, for the devicetree package")
+    parser.add_argument("--output", required=True,
+                        help="C source to write")
+    args = parser.parse_args()
+
+    sys.path.insert(0, os.path.join(args.zephyr_base, "scripts", "dts",
+                                    "python-devicetree", "src"))
+
+    with open(args.edt_pickle, "rb") as f:
+        edt = pickle.load(f)
+
+    shortcuts = collect(edt)
+    if len(shortcuts) > 0xFFFF:
+        sys.exit("more than 65535 shortcuts")
+
+    seeds, slots = place(shortcuts)
+
+    with open(args.output, "w") as out:
+        write(out, seeds, slots, len(shortcuts))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,124 @@
+#
+# Copyright (c) 2022 Rich Effects
+#
+# SPDX-License-Identifier: Apache-2.0
+
+"""Host keyboard layouts, for typing text as macro sequences.
+
+The host turns the usages of a report into characters with its own
+keyboard layout, so text typed by a macro has to be given as the keys
+that make each character on that layout, not the US ones. The tables
+here give the key and modifier of every character a layout types
+with one keystroke, by the position of the key on a US keyboard, and
+text_sequence() turns a string into the sequence of
+include/dt-bindings/keypad/macros.h that types it. Dead keys, and the
+characters only they make, are left out: a macro types those as
+unicode.
+
+Imported by gen_macro_unicode.py for the devicetree macros, with
+CONFIG_KEYPAD_HOST_LAYOUT, and by profile_compile.py for uploaded ones,
+so the keypad plays the result like any other macro and converts
+nothing.
+
+  us      US QWERTY
+  fr      French AZERTY
+  de      German QWERTZ
+  dvorak  US Dvorak
+"""
+
+import sys
+
+# include/dt-bindings/keypad/macros.h
+MACRO_DOWN = 0x01
+MACRO_UP = 0x02
+
+LEFT_SHIFT = 0xE1
+RIGHT_ALT = 0xE6
+
+# Usages of the keys of each row on a US keyboard, left to right: the
+# backquote key to Equals, Q to Backslash, A to the ISO Non-US # key,
+# the ISO Non-US \ key to Slash
+ROWS = [
+    [0x35] + list(range(0x1E, 0x28)) + [0x2D, 0x2E],
+    [0x14, 0x1A, 0x08, 0x15, 0x17, 0x1C, 0x18, 0x0C, 0x12, 0x13, 0x2F,
+     0x30, 0x31],
+    [0x04, 0x16, 0x07, 0x09, 0x0A, 0x0B, 0x0D, 0x0E, 0x0F, 0x33, 0x34,
+     0x32],
+    [0x64, 0x1D, 0x1B, 0x06, 0x19, 0x05, 0x11, 0x10, 0x36, 0x37, 0x38],
+]
+
+# What each key of ROWS types, per row: plain, with Shift and with
+# AltGr. A space is a key that types nothing, or only a dead key.
+LAYOUTS = {
+    "us": [
+        ("`1234567890-=", "~!@#$%^&*()_+", ""),
+        ("qwertyuiop[]\\", "QWERTYUIOP{}|", ""),
+        ("asdfghjkl;' ", "ASDFGHJKL:\" ", ""),
+        (" zxcvbnm,./", " ZXCVBNM<>?", ""),
+    ],
+    "fr": [
+        ("²&é\"'(-è_çà)=", " 1234567890°+", "   #{[| \\^@]}"),
+        ("azertyuiop $ ", "AZERTYUIOP £ ", "  €        ¤ "),
+        ("qsdfghjklmù*", "QSDFGHJKLM%µ", ""),
+        ("<wxcvbn,;:!", ">WXCVBN?./§", ""),
+    ],
+    "de": [
+        (" 1234567890ß ", "°!\"§$%&/()=? ", "  ²³   {[]}\\ "),
+        ("qwertzuiopü+ ", "QWERTZUIOPÜ* ", "@ €        ~ "),
+        ("asdfghjklöä#", "ASDFGHJKLÖÄ'", ""),
+        ("<yxcvbnm,.-", ">YXCVBNM;:_", "|      µ   "),
+    ],
+    "dvorak": [
+        ("`1234567890[]", "~!@#$%^&*(){}", ""),
+        ("',.pyfgcrl/=\\", "\"<>PYFGCRL?+|", ""),
+        ("aoeuidhtns- ", "AOEUIDHTNS_ ", ""),
+        (" ;qjkxbmwvz", " :QJKXBMWVZ", ""),
+    ],
+}
+
+# The same on every layout
+COMMON = {
+    "\n": (0x28, None),
+    "\t": (0x2B, None),
+    " ": (0x2C, None),
+}
+
+
+def table(layout):
+    """Character to (usage, modifier or None) for layout."""
+    keys = dict(COMMON)
+
+    for usages, levels in zip(ROWS, LAYOUTS[layout]):
+        for chars, mod in zip(levels, (None, LEFT_SHIFT, RIGHT_ALT)):
+            for usage, c in zip(usages, chars):
+                if c != " ":
+                    keys.setdefault(c, (usage, mod))
+
+    return keys
+
+
+def text_sequence(text, layout, where):
+    """The macro sequence typing text on layout, exits if it cannot."""
+    keys = table(layout)
+    seq = []
+    held = None
+
+    for c in text:
+        if c not in keys:
+            sys.exit(f"{where}: {c!r} has no key of its own on the "
+                     f"{layout} layout, type it as unicode")
+
+        usage, mod = keys[c]
+        if mod != held:
+            # Runs of capitals share one press of Shift
+            if held is not None:
+                seq += [MACRO_UP, held]
+            if mod is not None:
+                seq += [MACRO_DOWN, mod]
+            held = mod
+        seq.append(usage)
+
+    if held is not None:
+        seq += [MACRO_UP, held]
+
+    return seq
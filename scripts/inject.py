@@ -0,0 +1,109 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2022 Rich Effects
+#
+# SPDX-License-Identifier: Apache-2.0
+
+"""Play a key script through a keypad, for host test automation.
+
+Queues key transitions over raw HID to a keypad built with
+CONFIG_KEYPAD_INJECT (src/diag/inject.h), played into its key pipeline
+like real presses: layers, combos and the report scheduler take them
+as they would the scan's. A script is a text file, one record a line:
+
+    press 4 1000        press key 4, 1000 us after the record before
+    release 4 20000
+    press 5 frame       on the next USB frame, one record per frame
+    wait 500000         a gap of 0.5 s
+
+--flood taps a key once per frame instead, press and release each on a
+frame of its own, for throughput tests of a host application. Prints
+the records played and how late they were once the script is done.
+"""
+
+import argparse
+import os
+import sys
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import keypad_hid  # noqa: E402
+
+# src/diag/inject.h INJECT_*
+PRESS = 0x01
+FRAME = 0x02
+WAIT = 0x04
+# A record waits at most this long, longer gaps take several
+DELAY_MAX = 0xffff
+
+
+def parse(path):
+    """Records of a script file, as (key, flags, delay_us)."""
+    records = []
+    with open(path) as f:
+        for n, line in enumerate(f, 1):
+            words = line.split('#', 1)[0].split()
+            if not words:
+                continue
+            try:
+                if words[0] == 'wait':
+                    us = int(words[1])
+                    while us > DELAY_MAX:
+                        records.append((0, WAIT, DELAY_MAX))
+                        us -= DELAY_MAX
+                    records.append((0, WAIT, us))
+                    continue
+                if words[0] not in ('press', 'release'):
+                    raise ValueError(words[0])
+                flags = PRESS if words[0] == 'press' else 0
+                when = words[2] if len(words) > 2 else '0'
+                if when == 'frame':
+                    records.append((int(words[1]), flags | FRAME, 0))
+                    continue
+                us = int(when)
+                while us > DELAY_MAX:
+                    records.append((0, WAIT, DELAY_MAX))
+                    us -= DELAY_MAX
+                records.append((int(words[1]), flags, us))
+            except (IndexError, ValueError):
+                sys.exit(f'{path}:{n}: cannot read "{line.strip()}"')
+    return records
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--hid', required=True,
+                        help='hidraw node of the raw HID interface')
+    group = parser.add_mutually_exclusive_group(required=True)
+    group.add_argument('--script', help='script file to play')
+    group.add_argument('--flood', type=int, metavar='KEY',
+                       help='tap KEY once per frame')
+    parser.add_argument('--count', type=int, default=1000,
+                        help='taps of --flood')
+    args = parser.parse_args()
+
+    if args.script:
+        records = parse(args.script)
+    else:
+        records = [(args.flood, flags, 0)
+                   for _ in range(args.count)
+                   for flags in (PRESS | FRAME, FRAME)]
+
+    keypad = keypad_hid.Keypad(args.hid)
+    start = time.monotonic()
+    try:
+        queued, _, played, _, _ = keypad.inject(records, stop=True)
+        while queued:
+            time.sleep(0.01)
+            queued, _, played, _, _ = keypad.inject([])
+        status = keypad.inject([])
+    except RuntimeError as e:
+        sys.exit(f'{e}, is CONFIG_KEYPAD_INJECT on?')
+
+    _, _, played, late_max, late_mean = status
+    print(f'{played} records in {time.monotonic() - start:.3f} s, '
+          f'late {late_mean} us mean, {late_max} us at most')
+
+
+if __name__ == '__main__':
+    main()
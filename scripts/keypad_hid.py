@@ -0,0 +1,440 @@
+#
+# Copyright (c) 2022 Rich Effects
+#
+# SPDX-License-Identifier: Apache-2.0
+
+"""Host side of the keypad's raw HID interface, for the latency tools.
+
+Imported by the scripts here, not run. Keypad opens the configuration
+interface (src/usb/raw_hid.h) and reads it from a thread of its own into
+a pool of preallocated report buffers, each stamped with the host time
+it arrived at. On Linux the node is a hidraw device read straight into
+the buffers; elsewhere the hidapi module (pip install hidapi), through
+IOKit or the Windows HID API, takes the path hid.enumerate() lists.
+
+Commands are sent with Keypad.command() and Keypad.read_all(), which
+follow the sequence numbers and wait for the ack, and uploads
+(src/upload.h) with Keypad.upload(). Event stamps
+(CONFIG_KEYPAD_EVENT_STAMPS) and batches (CONFIG_KEYPAD_EVENT_BATCH)
+arriving in between are streamed by Keypad.events() as Event tuples,
+with the device time in us of the keypad's uptime and the host time
+in ns of time.perf_counter_ns() it maps to.
+
+The mapping is ClockSync: both clocks run at their own rate, so it
+fits host = offset + rate * device through the fastest reports, the
+lowest host minus device time of each quarter second, over the last
+minute. A report leaves the keypad after the events it carries, the
+fastest of them only about a polling interval after, so the fit holds
+a small constant lag on top of the skew it follows.
+"""
+
+import collections
+import os
+import queue
+import struct
+import threading
+import time
+import zlib
+
+try:
+    import hid
+except ImportError:
+    hid = None
+
+RAW_HID_REPORT_SIZE = 64
+RAW_HID_CHUNK = RAW_HID_REPORT_SIZE - 2
+
+RAW_HID_CMD_BEGIN = 0x01
+RAW_HID_CMD_DATA = 0x02
+RAW_HID_CMD_END = 0x03
+RAW_HID_CMD_CHECK = 0x07
+
+RAW_HID_CMD_STAMPS = 0x0d
+RAW_HID_CMD_BATCH = 0x10
+RAW_HID_CMD_APP = 0x11
+RAW_HID_CMD_FACTORY = 0x12
+RAW_HID_CMD_INJECT = 0x13
+RAW_HID_CMD_BENCH = 0x14
+RAW_HID_IN_STAMPS = 0x80
+RAW_HID_IN_BATCH = 0x81
+
+UPLOAD_STATUS_OK = 0
+UPLOAD_STATUS_SEQUENCE = 1
+UPLOAD_STATUS_BUSY = 2
+UPLOAD_STATUS_UNSUPPORTED = 4
+
+# src/config/profile_cache.h PROFILE_CACHE_HOME
+PROFILE_HOME = 0xff
+
+STAMPS_HEADER = struct.Struct('<BBBBBI')
+STAMPS_EVENT = struct.Struct('<BBI')
+BATCH_HEADER = struct.Struct('<BBBBI')
+BATCH_EVENT = struct.Struct('<BBH')
+# src/diag/factory.h
+FACTORY_RESULT = struct.Struct('<BBBBIIIIIIIHHHH')
+# src/diag/inject.h: a record, and the status of the ack
+INJECT_RECORD = struct.Struct('<BBH')
+INJECT_STATUS = struct.Struct('<HHIII')
+# src/usb/raw_hid.h RAW_HID_INJECT_*
+INJECT_STOP = 0x01
+INJECT_MAX = (RAW_HID_CHUNK - 2) // INJECT_RECORD.size
+# src/diag/upload_bench.h
+BENCH_RESULT = struct.Struct('<13I')
+
+# A key transition; source is RAW_HID_IN_STAMPS or RAW_HID_IN_BATCH
+Event = collections.namedtuple(
+    'Event', 'key pressed device_us host_ns source')
+
+
+class Report:
+    """One input report in a pool buffer, release() hands it back."""
+
+    __slots__ = ('data', 'host_ns', '_reader', '_slot')
+
+    def __init__(self, reader, slot, length, host_ns):
+        self.data = reader.views[slot][:length]
+        self.host_ns = host_ns
+        self._reader = reader
+        self._slot = slot
+
+    def release(self):
+        if self._reader is not None:
+            self.data.release()
+            self._reader.free.put(self._slot)
+            self._reader = None
+
+
+class HidReader(threading.Thread):
+    """Reads input reports into a pool of buffers as they arrive."""
+
+    def __init__(self, path, slots=256):
+        super().__init__(daemon=True)
+        self.pool = bytearray(slots * RAW_HID_REPORT_SIZE)
+        self.views = [memoryview(self.pool)[i * RAW_HID_REPORT_SIZE:
+                                               (i + 1) * RAW_HID_REPORT_SIZE]
+                      for i in range(slots + 1)]
+        # The last one takes what arrives with every buffer in use
+        self.scratch = slots
+        self.free = queue.SimpleQueue()
+        for i in range(slots):
+            self.free.put(i)
+        self.ready = queue.SimpleQueue()
+        self.overruns = 0
+
+        if os.path.exists(path):
+            self.fd = os.open(path, os.O_RDWR)
+            self.dev = None
+        elif hid is not None:
+            self.fd = None
+            self.dev = hid.device()
+            self.dev.open_path(path.encode())
+        else:
+            raise OSError(f'no hidraw node {path} and no hidapi module')
+
+    def write(self, report):
+        # Report ID 0, the interface has no numbered reports
+        out = b'\0' + bytes(report).ljust(RAW_HID_REPORT_SIZE, b'\0')
+        if self.dev is not None:
+            self.dev.write(out)
+        else:
+            os.write(self.fd, out)
+
+    def _read(self, view):
+        if self.dev is not None:
+            data = self.dev.read(RAW_HID_REPORT_SIZE)
+            view[:len(data)] = bytes(data)
+            return len(data)
+        return os.readv(self.fd, [view])
+
+    def run(self):
+        while True:
+            try:
+                slot = self.free.get_nowait()
+            except queue.Empty:
+                slot = self.scratch
+            length = self._read(self.views[slot])
+            host_ns = time.perf_counter_ns()
+            if slot == self.scratch:
+                # The consumer fell behind, this one is lost
+                self.overruns += 1
+                continue
+            self.ready.put((slot, length, host_ns))
+
+    def get(self, timeout=None):
+        """The next Report, None after timeout seconds without one."""
+        try:
+            slot, length, host_ns = self.ready.get(timeout=timeout)
+        except queue.Empty:
+            return None
+        return Report(self, slot, length, host_ns)
+
+
+class ClockSync:
+    """Maps the keypad's 32-bit us of uptime to host perf_counter ns."""
+
+    def __init__(self, bucket_ns=250_000_000, buckets=240):
+        self.bucket_ns = bucket_ns
+        # bucket: (device us, host ns) of its lowest host - device time
+        self.lowest = collections.OrderedDict()
+        self.buckets = buckets
+        self.last32 = None
+        self.last = 0
+        self.offset = None
+        self.rate = 1000.0
+
+    def _unwrap(self, device_us):
+        """The 64-bit device time nearest the latest one seen."""
+        if self.last32 is None:
+            return device_us
+        delta = (device_us - self.last32 + 2**31) % 2**32 - 2**31
+        return self.last + delta
+
+    def add(self, device_us, host_ns):
+        """The report arriving at host_ns was made at device_us or later."""
+        device = self._unwrap(device_us)
+        if self.last32 is None or device > self.last:
+            self.last32 = device_us
+            self.last = device
+
+        bucket = host_ns // self.bucket_ns
+        lowest = self.lowest.get(bucket)
+        if lowest is None or host_ns - device * 1000 < \
+                lowest[1] - lowest[0] * 1000:
+            self.lowest[bucket] = (device, host_ns)
+        while len(self.lowest) > self.buckets:
+            self.lowest.popitem(last=False)
+
+        self._fit()
+
+    def _fit(self):
+        points = list(self.lowest.values())
+        if len(points) < 2:
+            device, host_ns = points[0]
+            self.rate = 1000.0
+            self.offset = host_ns - device * 1000
+            return
+
+        # Least squares about the means, the values themselves are huge
+        mean_d = sum(p[0] for p in points) / len(points)
+        mean_h = sum(p[1] for p in points) / len(points)
+        var = sum((p[0] - mean_d) ** 2 for p in points)
+        if var == 0:
+            return
+        cov = sum((p[0] - mean_d) * (p[1] - mean_h) for p in points)
+        self.rate = cov / var
+        # Through the lowest point, not the mean: the fastest report
+        self.offset = min(p[1] - self.rate * p[0] for p in points)
+
+    def to_host(self, device_us):
+        """Host ns of a device time, None before the first add()."""
+        if self.offset is None:
+            return None
+        return int(self.offset + self.rate * self._unwrap(device_us))
+
+    @property
+    def skew_ppm(self):
+        """How much faster the host clock runs, in parts per million."""
+        return (self.rate / 1000.0 - 1.0) * 1e6
+
+
+class Keypad:
+    """The configuration interface of a keypad."""
+
+    def __init__(self, path, slots=256):
+        self.reader = HidReader(path, slots)
+        self.reader.start()
+        self.clock = ClockSync()
+        self.seq = 0
+        # Stream reports that came while a command waited for its ack
+        self.backlog = collections.deque()
+        # Reports lost on the way and transitions the keypad dropped
+        self.lost = 0
+        self.missed = 0
+        self._batch = None
+
+    def command(self, cmd, payload=b'', timeout=1.0):
+        """Send cmd with payload, returns the ack as bytes."""
+        for _ in range(4):
+            self.reader.write(bytes([cmd, self.seq]) + bytes(payload))
+            reply = self._ack(timeout)
+            self.seq = reply[1]
+            if reply[0] != UPLOAD_STATUS_SEQUENCE:
+                return reply
+
+        raise RuntimeError(f'command 0x{cmd:02x} out of sequence')
+
+    def _ack(self, timeout):
+        deadline = time.monotonic() + timeout
+        while True:
+            report = self.reader.get(max(0, deadline - time.monotonic()))
+            if report is None:
+                raise TimeoutError('no ack from the keypad')
+            if report.data[0] in (RAW_HID_IN_STAMPS, RAW_HID_IN_BATCH):
+                self.backlog.append((bytes(report.data), report.host_ns))
+                report.release()
+                continue
+            reply = bytes(report.data)
+            report.release()
+            return reply
+
+    def read_all(self, cmd, which=0):
+        """All bytes of a read command (JOURNAL, SEQ, ...) from offset 0."""
+        data = b''
+        while True:
+            reply = self.command(cmd, struct.pack('<BH', which, len(data)))
+            if reply[0] != UPLOAD_STATUS_OK:
+                raise RuntimeError(f'read 0x{cmd:02x} refused, '
+                                   f'status {reply[0]}')
+            if reply[3] == 0:
+                return data
+            data += reply[4:4 + reply[3]]
+
+    def upload(self, target, data, timeout=1.0):
+        """Upload data to target, checked with its CRC and applied."""
+        reply = self.command(RAW_HID_CMD_BEGIN,
+                             struct.pack('<BH', target, len(data)), timeout)
+        if reply[0] != UPLOAD_STATUS_OK:
+            raise RuntimeError(f'upload refused, status {reply[0]}')
+
+        # The keypad acks every half window of chunks
+        half = max(1, reply[2] // 2)
+        chunks = [data[i:i + RAW_HID_CHUNK]
+                  for i in range(0, len(data), RAW_HID_CHUNK)]
+        pos = 0
+        while pos < len(chunks):
+            group = chunks[pos:pos + half]
+            for i, chunk in enumerate(group):
+                self.reader.write(bytes([RAW_HID_CMD_DATA,
+                                         (self.seq + i) % 256]) + chunk)
+            if len(group) < half:
+                # No ack comes for a short group, the CHECK gets one
+                self.reader.write(bytes([RAW_HID_CMD_CHECK,
+                                         (self.seq + len(group)) % 256]) +
+                                  struct.pack('<I', zlib.crc32(data)))
+            reply = self._ack(timeout)
+            if reply[0] not in (UPLOAD_STATUS_OK, UPLOAD_STATUS_SEQUENCE):
+                raise RuntimeError(f'upload dropped, status {reply[0]}')
+            # Resend from the ack after a report went missing
+            pos += min((reply[1] - self.seq) % 256, len(group))
+            self.seq = reply[1]
+            if len(group) < half and reply[0] == UPLOAD_STATUS_OK:
+                break
+        else:
+            reply = self.command(RAW_HID_CMD_CHECK,
+                                 struct.pack('<I', zlib.crc32(data)), timeout)
+            if reply[0] != UPLOAD_STATUS_OK:
+                raise RuntimeError(f'upload corrupt, status {reply[0]}')
+
+        reply = self.command(RAW_HID_CMD_END, timeout=timeout)
+        if reply[0] != UPLOAD_STATUS_OK:
+            raise RuntimeError(f'upload not applied, status {reply[0]}')
+
+    def app(self, slot):
+        """Switch to the profile of slot, PROFILE_HOME for none."""
+        reply = self.command(RAW_HID_CMD_APP, bytes([slot]))
+        if reply[0] != UPLOAD_STATUS_OK:
+            raise RuntimeError(f'profile {slot} refused, status {reply[0]}')
+
+    def factory(self, window_ms=0):
+        """Run the factory test, returns the fields of its result."""
+        # Acked once the test is done, at most the window from now
+        reply = self.command(RAW_HID_CMD_FACTORY,
+                             struct.pack('<BH', 1, window_ms),
+                             timeout=1.0 + (window_ms or 4500) / 1000)
+        if reply[0] != UPLOAD_STATUS_OK:
+            raise RuntimeError(f'factory test refused, status {reply[0]}')
+        return FACTORY_RESULT.unpack_from(reply, 4)
+
+    def inject(self, records, stop=False):
+        """Queue (key, flags, delay_us) records, returns the last status.
+
+        Records are sent as the keypad has room for them, so this
+        returns once the last ones are queued, not played. stop drops
+        the script before and releases its keys.
+        """
+        records = list(records)
+        status = None
+        while True:
+            group = records[:INJECT_MAX]
+            payload = bytes([INJECT_STOP if stop else 0, len(group)])
+            payload += b''.join(INJECT_RECORD.pack(*r) for r in group)
+            reply = self.command(RAW_HID_CMD_INJECT, payload)
+            if reply[0] == UPLOAD_STATUS_UNSUPPORTED:
+                raise RuntimeError('injection not supported')
+            if reply[0] not in (UPLOAD_STATUS_OK, UPLOAD_STATUS_BUSY):
+                raise RuntimeError(f'injection refused, status {reply[0]}')
+            status = INJECT_STATUS.unpack_from(reply, 4)
+            if reply[0] == UPLOAD_STATUS_BUSY:
+                # Played at most one per frame, wait for room
+                time.sleep(0.001 * (len(group) - status[1]))
+                continue
+            stop = False
+            records = records[len(group):]
+            if not records:
+                return status
+
+    def bench(self, start=False):
+        """Fields of the upload benchmark window, start a new one first."""
+        reply = self.command(RAW_HID_CMD_BENCH, bytes([1 if start else 0]))
+        if reply[0] != UPLOAD_STATUS_OK:
+            raise RuntimeError(f'benchmark refused, status {reply[0]}')
+        return BENCH_RESULT.unpack_from(reply, 4)
+
+    def stream(self, stamps=False, batch=False):
+        """Turn the event stamps and batches on or off."""
+        for cmd, on in ((RAW_HID_CMD_STAMPS, stamps),
+                        (RAW_HID_CMD_BATCH, batch)):
+            reply = self.command(cmd, bytes([1 if on else 0]))
+            if on and reply[0] == UPLOAD_STATUS_UNSUPPORTED:
+                raise RuntimeError(f'command 0x{cmd:02x} unsupported '
+                                   'by this build')
+        self._batch = None
+
+    def _decode(self, data, host_ns):
+        if data[0] == RAW_HID_IN_STAMPS:
+            _, _, count, _, dropped, submit_us = \
+                STAMPS_HEADER.unpack_from(data)
+            self.missed += dropped
+            self.clock.add(submit_us, host_ns)
+            for i in range(count):
+                key, pressed, age_us = STAMPS_EVENT.unpack_from(
+                    data, STAMPS_HEADER.size + i * STAMPS_EVENT.size)
+                at = (submit_us - age_us) % 2**32
+                yield Event(key, bool(pressed), at, self.clock.to_host(at),
+                            RAW_HID_IN_STAMPS)
+        elif data[0] == RAW_HID_IN_BATCH:
+            _, number, count, missed, first_us = \
+                BATCH_HEADER.unpack_from(data)
+            if self._batch is not None:
+                self.lost += (number - self._batch - 1) % 256
+            self._batch = number
+            self.missed += missed
+            events = [BATCH_EVENT.unpack_from(
+                data, BATCH_HEADER.size + i * BATCH_EVENT.size)
+                for i in range(count)]
+            if events:
+                # Sent no sooner than its last event
+                self.clock.add((first_us + events[-1][2]) % 2**32, host_ns)
+            for key, pressed, delta_us in events:
+                at = (first_us + delta_us) % 2**32
+                yield Event(key, bool(pressed), at, self.clock.to_host(at),
+                            RAW_HID_IN_BATCH)
+
+    def events(self, timeout=None):
+        """Yield every Event as it comes, until timeout s without one."""
+        while True:
+            while self.backlog:
+                yield from self._decode(*self.backlog.popleft())
+
+            report = self.reader.get(timeout)
+            if report is None:
+                return
+            try:
+                yield from self._decode(report.data, report.host_ns)
+            finally:
+                report.release()
+
+    @property
+    def overruns(self):
+        """Reports dropped on the host, the pool was all in use."""
+        return self.reader.overruns
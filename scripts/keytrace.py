@@ -0,0 +1,308 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2022 Rich Effects
+#
+# SPDX-License-Identifier: Apache-2.0
+
+"""Capture and inspect key traces for the replay benchmark.
+
+capture  polls the post-mortem journal of a keypad over raw HID (the
+         JOURNAL command of src/usb/raw_hid.h), decodes its key stream
+         and appends the transitions to a trace file until
+         interrupted. The journal only holds the last
+         CONFIG_KEYPAD_JOURNAL_KEY_BYTES of the stream, so the polls
+         must come faster than they are typed over; transitions lost
+         between two polls are counted and reported. --prev reads the
+         ring of the previous boot once instead.
+show     prints a trace and its key, event and timing statistics.
+synth    writes a trace of steady typing, the keys tapped in turn at a
+         given rate with a seeded jitter, so benchmark builds need no
+         unit to capture from.
+
+A trace is JOURNAL_KEY records, struct journal_record little endian:
+le32 ms, u8 type, u8 key, le16 pressed. The firmware keeps key
+transitions compressed, see src/diag/journal.h, and only this script
+decodes them. CONFIG_KEYPAD_REPLAY_TRACE builds a trace into the image,
+see src/diag/replay.h.
+"""
+
+import argparse
+import os
+import random
+import statistics
+import struct
+import sys
+import time
+
+RAW_HID_REPORT_SIZE = 64
+RAW_HID_CMD_JOURNAL = 0x05
+UPLOAD_STATUS_OK = 0
+UPLOAD_STATUS_SEQUENCE = 1
+
+JOURNAL_CURRENT = 0
+JOURNAL_PREVIOUS = 1
+JOURNAL_MAGIC = 0x4a524e4c
+JOURNAL_KEY = 0x02
+JOURNAL_KEY_BLOCK = 64
+JOURNAL_KEY_END = 0xff
+
+# magic, boot, head, fault reason, pc, lr, key head, key events,
+# records, key bytes
+RING_HEADER = struct.Struct('<IIIIIIIIHH')
+RECORD = struct.Struct('<IBBH')
+BLOCK_MS = struct.Struct('<I')
+
+
+class RawHid:
+    """The configuration interface of the keypad, through hidraw."""
+
+    def __init__(self, path):
+        self.fd = os.open(path, os.O_RDWR)
+        self.seq = 0
+
+    def read(self, which, offset):
+        """One JOURNAL read, the bytes at offset of a ring."""
+        for _ in range(4):
+            out = struct.pack('<BBBH', RAW_HID_CMD_JOURNAL, self.seq,
+                              which, offset)
+            # Report ID 0, the interface has no numbered reports
+            os.write(self.fd, b'\0' + out.ljust(RAW_HID_REPORT_SIZE, b'\0'))
+            reply = os.read(self.fd, RAW_HID_REPORT_SIZE)
+            self.seq = reply[1]
+            if reply[0] == UPLOAD_STATUS_SEQUENCE:
+                # Resend under the sequence number the keypad expects
+                continue
+            if reply[0] != UPLOAD_STATUS_OK:
+                raise RuntimeError(f'journal read refused, status {reply[0]}')
+            return reply[4:4 + reply[3]]
+
+        raise RuntimeError('journal read out of sequence')
+
+    def ring(self, which):
+        """Header and raw records of a ring, b'' without one."""
+        data = b''
+        while True:
+            chunk = self.read(which, len(data))
+            if not chunk:
+                return data
+            data += chunk
+
+
+class Ring:
+    """One ring of the journal, parsed.
+
+    head and key_head count the records and key stream bytes written,
+    key_events the transitions. A ring takes several reads, and the
+    keypad goes on writing it: key_head_after, the key head read once
+    the ring is in, drops the blocks that may have been written over
+    meanwhile.
+    """
+
+    def __init__(self, data, key_head_after=None):
+        self.valid = False
+        if len(data) < RING_HEADER.size:
+            return
+
+        (magic, _, self.head, _, _, _, self.key_head, self.key_events,
+         records, key_bytes) = RING_HEADER.unpack_from(data)
+        base = RING_HEADER.size + records * RECORD.size
+        if magic != JOURNAL_MAGIC or len(data) < base + key_bytes:
+            return
+
+        self.valid = True
+        self.keys = key_stream(data[base:base + key_bytes], self.key_head,
+                               key_head_after)
+
+
+def key_stream(keys, head, head_after=None):
+    """[(offset, record), ...] of a key stream, oldest first.
+
+    offset is that of the transition in the stream, ever increasing,
+    record a JOURNAL_KEY struct journal_record tuple.
+    """
+    # The oldest whole block, none that was written over
+    oldest = max(0, (head_after or head) - len(keys))
+    oldest = -(-oldest // JOURNAL_KEY_BLOCK) * JOURNAL_KEY_BLOCK
+    events = []
+
+    for block in range(oldest, head, JOURNAL_KEY_BLOCK):
+        pos = block % len(keys)
+        end = min(JOURNAL_KEY_BLOCK, head - block)
+        if end < BLOCK_MS.size:
+            break
+
+        ms = BLOCK_MS.unpack_from(keys, pos)[0]
+        i = BLOCK_MS.size
+        while i < end and keys[pos + i] != JOURNAL_KEY_END:
+            offset = block + i
+            code = keys[pos + i]
+            i += 1
+
+            delta = shift = 0
+            while i < end:
+                byte = keys[pos + i]
+                i += 1
+                delta |= (byte & 0x7f) << shift
+                shift += 7
+                if not byte & 0x80:
+                    break
+
+            ms = (ms + delta) & 0xffffffff
+            events.append((offset, (ms, JOURNAL_KEY, code >> 1, code & 1)))
+
+    return events
+
+
+def ring_key_head(hid, which):
+    header = hid.read(which, 0)
+    if len(header) < RING_HEADER.size:
+        return None
+    return RING_HEADER.unpack_from(header)[6]
+
+
+def key_records(records):
+    return [r for r in records if r[1] == JOURNAL_KEY]
+
+
+def capture(args):
+    hid = RawHid(args.hid)
+
+    with open(args.output, 'ab') as out:
+        if args.prev:
+            ring = Ring(hid.ring(JOURNAL_PREVIOUS))
+            if not ring.valid:
+                sys.exit('no journal of a previous boot')
+            for _, rec in ring.keys:
+                out.write(RECORD.pack(*rec))
+            print(f'{len(ring.keys)} key records of the previous boot, '
+                  f'{ring.key_events} transitions in all')
+        else:
+            poll(hid, out, args.interval)
+
+
+def poll(hid, out, interval):
+    written = 0
+
+    ring = Ring(hid.ring(JOURNAL_CURRENT))
+    if not ring.valid:
+        sys.exit('no journal on the keypad, is CONFIG_KEYPAD_JOURNAL on?')
+
+    # Only what is typed from now on
+    last = ring.key_head
+    first_events = last_events = ring.key_events
+    print('capturing, ^C to stop', file=sys.stderr)
+    try:
+        while True:
+            time.sleep(interval / 1000)
+            data = hid.ring(JOURNAL_CURRENT)
+            ring = Ring(data, ring_key_head(hid, JOURNAL_CURRENT))
+            if not ring.valid:
+                continue
+
+            for offset, rec in ring.keys:
+                if offset >= last:
+                    out.write(RECORD.pack(*rec))
+                    written += 1
+            last = ring.key_head
+            last_events = ring.key_events
+            out.flush()
+    except KeyboardInterrupt:
+        pass
+
+    print(f'{written} key records', file=sys.stderr)
+    lost = last_events - first_events - written
+    if lost > 0:
+        print(f'warning: {lost} transitions lost between polls, poll '
+              'faster or build with more CONFIG_KEYPAD_JOURNAL_KEY_BYTES',
+              file=sys.stderr)
+
+
+def show(args):
+    with open(args.trace, 'rb') as f:
+        data = f.read()
+
+    records = [RECORD.unpack_from(data, pos)
+               for pos in range(0, len(data) - RECORD.size + 1, RECORD.size)]
+    records = key_records(records)
+    if not records:
+        sys.exit(f'{args.trace}: no key records')
+
+    if args.verbose:
+        start = records[0][0]
+        for ms, _, key, pressed in records:
+            print(f'{ms - start:9} ms  key {key:2}  '
+                  f'{"press" if pressed else "release"}')
+
+    presses = [r for r in records if r[3]]
+    gaps = [b[0] - a[0] for a, b in zip(presses, presses[1:])]
+    seconds = (records[-1][0] - records[0][0]) / 1000
+    keys = sorted({r[2] for r in records})
+
+    print(f'{len(records)} events, {len(presses)} presses of '
+          f'{len(keys)} keys ({", ".join(map(str, keys))}) in {seconds:.1f} s')
+    if gaps:
+        print(f'press to press: median {statistics.median(gaps)} ms, '
+              f'min {min(gaps)} ms')
+
+
+def synth(args):
+    rng = random.Random(args.seed)
+    period = 1000 / args.rate
+    events = []
+
+    at = 0.0
+    for i in range(round(args.rate * args.seconds)):
+        key = i % args.keys
+        press = round(at)
+        hold = max(round(args.hold * rng.uniform(0.7, 1.3)), 1)
+        events.append((press, key, 1))
+        events.append((press + hold, key, 0))
+        at += period * rng.uniform(0.7, 1.3)
+
+    events.sort()
+    with open(args.output, 'wb') as out:
+        for ms, key, pressed in events:
+            out.write(RECORD.pack(ms, JOURNAL_KEY, key, pressed))
+
+    print(f'{len(events)} key records', file=sys.stderr)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    sub = parser.add_subparsers(dest='command', required=True)
+
+    p = sub.add_parser('capture', help='record a trace from a keypad')
+    p.add_argument('--hid', required=True,
+                   help='hidraw node of the raw HID interface')
+    p.add_argument('--output', required=True,
+                   help='trace file, appended to')
+    p.add_argument('--interval', type=int, default=50,
+                   help='journal poll period, ms')
+    p.add_argument('--prev', action='store_true',
+                   help="read the previous boot's journal once")
+    p.set_defaults(func=capture)
+
+    p = sub.add_parser('show', help='print a trace')
+    p.add_argument('trace')
+    p.add_argument('-v', '--verbose', action='store_true',
+                   help='every event, not just the statistics')
+    p.set_defaults(func=show)
+
+    p = sub.add_parser('synth', help='write a trace of steady typing')
+    p.add_argument('--output', required=True, help='trace file')
+    p.add_argument('--keys', type=int, default=4,
+                   help='keys tapped in turn, from key 0')
+    p.add_argument('--rate', type=float, default=10,
+                   help='presses per second')
+    p.add_argument('--hold', type=float, default=40,
+                   help='ms a key stays pressed, on average')
+    p.add_argument('--seconds', type=float, default=20)
+    p.add_argument('--seed', type=int, default=1)
+    p.set_defaults(func=synth)
+
+    args = parser.parse_args()
+    args.func(args)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,227 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2022 Rich Effects
+#
+# SPDX-License-Identifier: Apache-2.0
+
+"""Keypad press-to-report latency benchmark.
+
+Drives the key lines of the unit under test through the stimulus board
+(bench/stimulus) and timestamps the resulting HID input reports read
+from hidraw. Three scenarios are run:
+
+  tap    one key pressed and released, repeated
+  chord  up to six keys pressed together, repeated
+  burst  one key toggled at a fixed rate by the stimulus board
+
+Results (p50/p99/max latency in ms and missed events) are printed and
+optionally written as JSON. When a baseline JSON is given, any scenario
+that is slower or misses more events than the baseline allows makes the
+script exit non-zero.
+"""
+
+import argparse
+import json
+import math
+import os
+import queue
+import statistics
+import sys
+import threading
+import time
+
+import serial
+
+# Keymap of the firmware: sw0..sw3 send R, I, C, H
+DEFAULT_USAGES = [0x15, 0x0C, 0x06, 0x0B]
+
+
+class HidReader(threading.Thread):
+    """Reads hidraw reports with a host timestamp taken on arrival."""
+
+    def __init__(self, path, size):
+        super().__init__(daemon=True)
+        self.fd = os.open(path, os.O_RDONLY)
+        self.size = size
+        self.reports = queue.Queue()
+
+    def run(self):
+        while True:
+            data = os.read(self.fd, self.size)
+            self.reports.put((time.perf_counter_ns(), data))
+
+    def drain(self):
+        while not self.reports.empty():
+            self.reports.get_nowait()
+
+
+def held_usages(report, fmt):
+    """Return the set of non-modifier usages held in a report."""
+    if fmt == 'nkro':
+        return {byte * 8 + bit
+                for byte, value in enumerate(report[1:])
+                for bit in range(8) if value & (1 << bit)}
+    return {usage for usage in report[2:8] if usage > 0x03}
+
+
+class Bench:
+    def __init__(self, args):
+        self.args = args
+        self.stim = serial.Serial(args.stim, 115200, timeout=1)
+        self.hid = HidReader(args.hid, 64)
+        self.hid.start()
+        self.usages = args.usages[:args.keys]
+
+    def command(self, line):
+        self.stim.write((line + '\n').encode())
+        reply = self.stim.readline().decode().strip()
+        if reply != 'ok':
+            raise RuntimeError('stimulus replied %r to %r' % (reply, line))
+
+    def wait_for(self, expected, start_ns, timeout_s):
+        """Latency in ms until a report holds exactly expected, or None."""
+        deadline = time.monotonic() + timeout_s
+        while time.monotonic() < deadline:
+            try:
+                stamp, report = self.hid.reports.get(timeout=0.005)
+            except queue.Empty:
+                continue
+            if held_usages(report, self.args.report) == expected:
+                return (stamp - start_ns) / 1e6
+        return None
+
+    def press(self, mask, expected, samples):
+        start = time.perf_counter_ns()
+        self.command('p %x' % mask)
+        latency = self.wait_for(expected, start, self.args.timeout)
+        if latency is not None:
+            samples.append(latency)
+        return latency is not None
+
+    def repeat(self, mask):
+        expected = {u for i, u in enumerate(self.usages) if mask & (1 << i)}
+        samples = []
+        missed = 0
+        for _ in range(self.args.iterations):
+            self.hid.drain()
+            missed += not self.press(mask, expected, samples)
+            time.sleep(self.args.hold)
+            missed += not self.press(0, set(), samples)
+            time.sleep(self.args.gap)
+        return summarize(samples, missed)
+
+    def burst(self):
+        count = self.args.burst_count
+        period = self.args.burst_period_us
+        self.hid.drain()
+        self.command('b 1 %d %d' % (count, period))
+        time.sleep(self.args.timeout)
+
+        presses = 0
+        held = False
+        while not self.hid.reports.empty():
+            _, report = self.hid.reports.get_nowait()
+            now = self.usages[0] in held_usages(report, self.args.report)
+            presses += now and not held
+            held = now
+        return {'events': count, 'reported': presses,
+                'missed': max(count - presses, 0)}
+
+
+def percentile(samples, pct):
+    ordered = sorted(samples)
+    return ordered[max(math.ceil(pct / 100 * len(ordered)) - 1, 0)]
+
+
+def summarize(samples, missed):
+    if not samples:
+        return {'samples': 0, 'missed': missed}
+    return {
+        'samples': len(samples),
+        'missed': missed,
+        'p50_ms': round(statistics.median(samples), 3),
+        'p99_ms': round(percentile(samples, 99), 3),
+        'max_ms': round(max(samples), 3),
+    }
+
+
+def compare(results, baseline, tolerance):
+    """Return a list of regressions against the baseline."""
+    failures = []
+    for name, base in baseline.items():
+        cur = results.get(name, {})
+        for key in ('p50_ms', 'p99_ms', 'max_ms'):
+            if key in base and key in cur:
+                limit = base[key] * (1 + tolerance / 100) + 0.1
+                if cur[key] > limit:
+                    failures.append('%s %s %.3f > %.3f' %
+                                    (name, key, cur[key], limit))
+        if cur.get('missed', 0) > base.get('missed', 0):
+            failures.append('%s missed %d > %d' %
+                            (name, cur['missed'], base['missed']))
+    return failures
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--stim', default='/dev/ttyACM0',
+                        help='console of the stimulus board')
+    parser.add_argument('--hid', default='/dev/hidraw0',
+                        help='hidraw node of the keypad')
+    parser.add_argument('--report', choices=('6kro', 'nkro'), default='6kro')
+    parser.add_argument('--keys', type=int, default=len(DEFAULT_USAGES),
+                        help='number of wired key lines (max 6)')
+    parser.add_argument('--usages', type=lambda s: [int(u, 0) for u in s.split(',')],
+                        default=DEFAULT_USAGES,
+                        help='comma separated usage of each key line')
+    parser.add_argument('--iterations', type=int, default=200)
+    parser.add_argument('--hold', type=float, default=0.03,
+                        help='seconds a key stays pressed')
+    parser.add_argument('--gap', type=float, default=0.03,
+                        help='seconds between iterations')
+    parser.add_argument('--timeout', type=float, default=0.2,
+                        help='seconds to wait for a report')
+    parser.add_argument('--burst-count', type=int, default=100)
+    parser.add_argument('--burst-period-us', type=int, default=1000)
+    parser.add_argument('--json', help='write results to this file')
+    parser.add_argument('--baseline', help='compare against this JSON file')
+    parser.add_argument('--save-baseline', help='write results as baseline')
+    parser.add_argument('--tolerance', type=float, default=10,
+                        help='allowed latency regression in percent')
+    return parser.parse_args()
+
+
+def main():
+    args = parse_args()
+    args.keys = min(args.keys, 6, len(args.usages))
+    if args.baseline and not os.path.exists(args.baseline):
+        # Before the run, not after minutes of it
+        sys.exit('no baseline at %s, capture one with --save-baseline' %
+                 args.baseline)
+    bench = Bench(args)
+
+    results = {
+        'tap': bench.repeat(0x1),
+        'chord': bench.repeat((1 << args.keys) - 1),
+        'burst': bench.burst(),
+    }
+    print(json.dumps(results, indent=2))
+
+    for path in (args.json, args.save_baseline):
+        if path:
+            with open(path, 'w') as f:
+                json.dump(results, f, indent=2)
+
+    if args.baseline:
+        with open(args.baseline) as f:
+            failures = compare(results, json.load(f), args.tolerance)
+        for failure in failures:
+            print('REGRESSION:', failure)
+        return 1 if failures else 0
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,142 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2022 Rich Effects
+#
+# SPDX-License-Identifier: Apache-2.0
+
+"""Loopback latency test of a keypad, without the stimulus rig.
+
+Sends LOOPBACK commands over raw HID (src/usb/raw_hid.h) to a keypad
+built with CONFIG_KEYPAD_LOOPBACK, each injecting a press or release
+of --key, and times the OUT report to the keyboard report it causes,
+read from the keyboard interface's hidraw node. The keypad echoes each
+token with its own share: injection to submission and submission to
+the host picking the report up. The round trip is both USB transfers
+and the host's polls on top of the firmware.
+
+Leave the keypad alone while it runs, and pick a key that sends a
+plain usage on the active layer.
+"""
+
+import argparse
+import os
+import queue
+import statistics
+import struct
+import sys
+import threading
+import time
+
+RAW_HID_REPORT_SIZE = 64
+RAW_HID_CMD_LOOPBACK = 0x0b
+UPLOAD_STATUS_OK = 0
+UPLOAD_STATUS_SEQUENCE = 1
+
+# token, inject to submit us, submit to done us
+ECHO = struct.Struct('<III')
+
+
+class HidReader(threading.Thread):
+    """Reads hidraw reports with a host timestamp taken on arrival."""
+
+    def __init__(self, fd):
+        super().__init__(daemon=True)
+        self.fd = fd
+        self.reports = queue.Queue()
+
+    def run(self):
+        while True:
+            data = os.read(self.fd, RAW_HID_REPORT_SIZE)
+            self.reports.put((time.perf_counter_ns(), data))
+
+    def get(self, timeout):
+        try:
+            return self.reports.get(timeout=timeout)
+        except queue.Empty:
+            return None, None
+
+    def drain(self):
+        while not self.reports.empty():
+            self.reports.get_nowait()
+
+
+def percentiles(samples):
+    samples = sorted(samples)
+    pick = lambda p: samples[min(len(samples) - 1, len(samples) * p // 100)]
+    return f'p50 {pick(50)} p99 {pick(99)} max {samples[-1]} us'
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--hid', required=True,
+                        help='hidraw node of the raw HID interface')
+    parser.add_argument('--kbd', required=True,
+                        help='hidraw node of the keyboard interface')
+    parser.add_argument('--key', type=int, default=0,
+                        help='key index to inject')
+    parser.add_argument('--count', type=int, default=100,
+                        help='presses, each with its release')
+    parser.add_argument('--interval', type=int, default=20,
+                        help='ms between transitions')
+    args = parser.parse_args()
+
+    raw_fd = os.open(args.hid, os.O_RDWR)
+    raw = HidReader(raw_fd)
+    kbd = HidReader(os.open(args.kbd, os.O_RDONLY))
+    raw.start()
+    kbd.start()
+
+    seq = 0
+    round_trip, to_submit, to_done = [], [], []
+    missed = 0
+    for token in range(2 * args.count):
+        time.sleep(args.interval / 1000)
+        raw.drain()
+        kbd.drain()
+
+        for _ in range(4):
+            out = struct.pack('<BBBBI', RAW_HID_CMD_LOOPBACK, seq, args.key,
+                              (token + 1) % 2, token)
+            sent = time.perf_counter_ns()
+            os.write(raw_fd, b'\0' + out.ljust(RAW_HID_REPORT_SIZE, b'\0'))
+            _, reply = raw.get(0.01)
+            if reply is None or reply[0] != UPLOAD_STATUS_SEQUENCE:
+                break
+            # Resend under the sequence number the keypad expects
+            seq = reply[1]
+            reply = None
+
+        arrived, _ = kbd.get(1.0)
+        while reply is None or reply[3] != ECHO.size or \
+                ECHO.unpack_from(reply, 4)[0] != token:
+            if reply is not None and reply[0] != UPLOAD_STATUS_OK:
+                sys.exit(f'loopback refused, status {reply[0]}, '
+                         'is CONFIG_KEYPAD_LOOPBACK on?')
+            _, reply = raw.get(1.0)
+            if reply is None:
+                break
+
+        if arrived is None or reply is None:
+            missed += 1
+            continue
+
+        seq = reply[1]
+        _, submit_us, done_us = ECHO.unpack_from(reply, 4)
+        round_trip.append((arrived - sent) // 1000)
+        to_submit.append(submit_us)
+        to_done.append(done_us)
+
+    if not round_trip:
+        sys.exit('no loopback came back')
+
+    print(f'{len(round_trip)} transitions, {missed} missed')
+    print(f'round trip:        {percentiles(round_trip)}')
+    print(f'inject->submit:    {percentiles(to_submit)}')
+    print(f'submit->done:      {percentiles(to_done)}')
+    print(f'mean round trip {statistics.mean(round_trip):.0f} us')
+
+    sys.exit(1 if missed else 0)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,123 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2022 Rich Effects
+#
+# SPDX-License-Identifier: Apache-2.0
+
+"""Host agent posting the Memfault data of a keypad to the cloud.
+
+The keypad has no network of its own. With CONFIG_KEYPAD_MEMFAULT it
+hands out its Memfault chunks over raw HID, one per MEMFAULT command
+(src/usb/raw_hid.h). This agent drains them every --interval seconds
+and posts each to the Memfault chunks API under the device serial,
+the hardware ID the firmware reports itself with (`hwinfo devid` in
+the shell). A chunk is taken from the keypad once read, so the agent
+holds on to chunks it could not post and retries them first.
+"""
+
+import argparse
+import os
+import struct
+import sys
+import time
+import urllib.error
+import urllib.request
+
+RAW_HID_REPORT_SIZE = 64
+RAW_HID_CMD_MEMFAULT = 0x09
+UPLOAD_STATUS_OK = 0
+UPLOAD_STATUS_SEQUENCE = 1
+UPLOAD_STATUS_UNSUPPORTED = 4
+
+CHUNKS_URL = 'https://chunks.memfault.com/api/v0/chunks/'
+
+
+class RawHid:
+    """The configuration interface of the keypad, through hidraw."""
+
+    def __init__(self, path):
+        self.fd = os.open(path, os.O_RDWR)
+        self.seq = 0
+
+    def chunk(self):
+        """The next chunk, b'' when the keypad has none."""
+        for _ in range(4):
+            out = struct.pack('<BB', RAW_HID_CMD_MEMFAULT, self.seq)
+            # Report ID 0, the interface has no numbered reports
+            os.write(self.fd, b'\0' + out.ljust(RAW_HID_REPORT_SIZE, b'\0'))
+            reply = os.read(self.fd, RAW_HID_REPORT_SIZE)
+            self.seq = reply[1]
+            if reply[0] == UPLOAD_STATUS_SEQUENCE:
+                # Resend under the sequence number the keypad expects
+                continue
+            if reply[0] == UPLOAD_STATUS_UNSUPPORTED:
+                sys.exit('no Memfault on the keypad, '
+                         'is CONFIG_KEYPAD_MEMFAULT on?')
+            if reply[0] != UPLOAD_STATUS_OK:
+                raise RuntimeError(f'chunk read refused, status {reply[0]}')
+            return bytes(reply[4:4 + reply[3]])
+
+        raise RuntimeError('chunk read out of sequence')
+
+
+def post(chunk, serial, project_key):
+    req = urllib.request.Request(CHUNKS_URL + serial, data=chunk,
+                                 method='POST')
+    req.add_header('Memfault-Project-Key', project_key)
+    req.add_header('Content-Type', 'application/octet-stream')
+    with urllib.request.urlopen(req, timeout=10) as resp:
+        resp.read()
+
+
+def drain(hid, pending, serial, project_key):
+    """Post the held chunks, then the keypad's, until either fails."""
+    posted = 0
+    while True:
+        if not pending:
+            chunk = hid.chunk()
+            if not chunk:
+                return posted
+            pending.append(chunk)
+
+        try:
+            post(pending[0], serial, project_key)
+        except (urllib.error.URLError, OSError) as e:
+            print(f'post failed, {len(pending)} chunks held: {e}',
+                  file=sys.stderr)
+            return posted
+
+        pending.pop(0)
+        posted += 1
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--hid', required=True,
+                        help='hidraw node of the raw HID interface')
+    parser.add_argument('--device-serial', required=True,
+                        help='hardware ID of the keypad')
+    parser.add_argument('--project-key',
+                        default=os.environ.get('MEMFAULT_PROJECT_KEY'),
+                        help='Memfault project key, or $MEMFAULT_PROJECT_KEY')
+    parser.add_argument('--interval', type=int, default=60,
+                        help='seconds between drains')
+    parser.add_argument('--once', action='store_true',
+                        help='drain once and exit')
+    args = parser.parse_args()
+
+    if not args.project_key:
+        sys.exit('no Memfault project key')
+
+    hid = RawHid(args.hid)
+    pending = []
+    while True:
+        posted = drain(hid, pending, args.device_serial, args.project_key)
+        if posted:
+            print(f'{posted} chunks posted', file=sys.stderr)
+        if args.once:
+            break
+        time.sleep(args.interval)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,285 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2022 Rich Effects
+#
+# SPDX-License-Identifier: Apache-2.0
+
+"""Keypad current consumption benchmark.
+
+Measures the supply current of the unit under test with a Nordic Power
+Profiler Kit II in ampere-meter mode, wired as for the Power profiles
+table of the README, while the stimulus board (bench/stimulus) and the
+host drive it through scripted scenarios:
+
+  idle       USB configured, no key pressed
+  suspended  USB suspended by the host, needs --usb-port
+  slow       one key tapped twice a second
+  burst      the keys tapped in turn, ten a second
+  rgb        the wave effect running, needs --console
+
+Each scenario settles for --settle seconds and is then sampled for
+--duration seconds at 100 kHz. The average is over every sample; the
+peak is the highest 1 ms average, so a single ADC sample does not set
+it. The summary is printed and optionally written as JSON together with
+the firmware it was measured on, taken from --build-dir. When a
+baseline JSON is given, any scenario that draws more than the baseline
+allows makes the script exit non-zero.
+"""
+
+import argparse
+import hashlib
+import json
+import os
+import sys
+import threading
+import time
+
+import serial
+from ppk2_api.ppk2_api import PPK2_API
+
+# Samples per second of the PPK2, and per peak window
+SAMPLE_RATE = 100000
+PEAK_WINDOW = SAMPLE_RATE // 1000
+
+
+class Profiler(threading.Thread):
+    """Collects PPK2 samples, in uA, while recording is set."""
+
+    def __init__(self, port):
+        super().__init__(daemon=True)
+        self.ppk2 = PPK2_API(port)
+        self.ppk2.get_modifiers()
+        self.ppk2.use_ampere_meter()
+        self.lock = threading.Lock()
+        self.recording = False
+        self.samples = []
+
+    def run(self):
+        self.ppk2.start_measuring()
+        while True:
+            data = self.ppk2.get_data()
+            if not data:
+                time.sleep(0.001)
+                continue
+            samples = self.ppk2.get_samples(data)
+            if isinstance(samples, tuple):
+                # Newer ppk2-api releases add the digital channels
+                samples = samples[0]
+            with self.lock:
+                if self.recording:
+                    self.samples.extend(samples)
+
+    def measure(self, seconds):
+        with self.lock:
+            self.samples = []
+            self.recording = True
+        time.sleep(seconds)
+        with self.lock:
+            self.recording = False
+            return self.samples
+
+
+class Bench:
+    def __init__(self, args):
+        self.args = args
+        self.stim = serial.Serial(args.stim, 115200, timeout=1)
+        self.console = None
+        if args.console:
+            self.console = serial.Serial(args.console, 115200, timeout=1)
+        self.profiler = Profiler(args.ppk2)
+        self.profiler.start()
+
+    def command(self, line):
+        self.stim.write((line + '\n').encode())
+        reply = self.stim.readline().decode().strip()
+        if reply != 'ok':
+            raise RuntimeError('stimulus replied %r to %r' % (reply, line))
+
+    def shell(self, line):
+        self.console.write((line + '\r\n').encode())
+        time.sleep(0.1)
+        self.console.reset_input_buffer()
+
+    def usb_power(self, control):
+        path = os.path.join('/sys/bus/usb/devices', self.args.usb_port,
+                            'power')
+        if control == 'auto':
+            with open(os.path.join(path, 'autosuspend_delay_ms'), 'w') as f:
+                f.write('0')
+        with open(os.path.join(path, 'control'), 'w') as f:
+            f.write(control)
+
+    def sample(self, during=None):
+        """Settle, then sample while during() types, if given."""
+        time.sleep(self.args.settle)
+        if during is None:
+            return summarize(self.profiler.measure(self.args.duration))
+
+        done = threading.Event()
+        typist = threading.Thread(target=during, args=(done,))
+        typist.start()
+        samples = self.profiler.measure(self.args.duration)
+        done.set()
+        typist.join()
+        return summarize(samples)
+
+    def typing(self, rate, keys):
+        """A typist tapping keys in turn at rate per second."""
+        period = 1 / rate
+
+        def run(done):
+            key = 0
+            while not done.is_set():
+                start = time.monotonic()
+                self.command('p %x' % (1 << key))
+                time.sleep(self.args.hold)
+                self.command('p 0')
+                key = (key + 1) % keys
+                done.wait(max(period - (time.monotonic() - start), 0))
+
+        return run
+
+    def idle(self):
+        return self.sample()
+
+    def suspended(self):
+        if not self.args.usb_port:
+            return {'skipped': 'no --usb-port'}
+        self.usb_power('auto')
+        try:
+            return self.sample()
+        finally:
+            self.usb_power('on')
+
+    def slow(self):
+        return self.sample(self.typing(2, 1))
+
+    def burst(self):
+        return self.sample(self.typing(10, self.args.keys))
+
+    def rgb(self):
+        if self.console is None:
+            return {'skipped': 'no --console'}
+        self.shell('rgb fx wave')
+        try:
+            return self.sample()
+        finally:
+            self.shell('rgb fx reactive')
+
+
+def summarize(samples):
+    if not samples:
+        return {'samples': 0}
+    windows = [sum(samples[i:i + PEAK_WINDOW]) / PEAK_WINDOW
+               for i in range(0, len(samples) - PEAK_WINDOW + 1,
+                              PEAK_WINDOW)]
+    return {
+        'samples': len(samples),
+        'avg_ua': round(sum(samples) / len(samples)),
+        'peak_ua': round(max(windows or samples)),
+    }
+
+
+def firmware(build_dir):
+    """Identity of the image under test, from its build directory."""
+    if not build_dir:
+        return {}
+    info = {}
+    image = os.path.join(build_dir, 'zephyr', 'zephyr.bin')
+    if os.path.exists(image):
+        with open(image, 'rb') as f:
+            info['sha256'] = hashlib.sha256(f.read()).hexdigest()
+    config = os.path.join(build_dir, 'zephyr', '.config')
+    if os.path.exists(config):
+        with open(config) as f:
+            for line in f:
+                name, _, value = line.strip().partition('=')
+                if name == 'CONFIG_BOARD':
+                    info['board'] = value.strip('"')
+                elif name.startswith('CONFIG_KEYPAD_POLL_') and \
+                        value == 'y':
+                    info['profile'] = name[len('CONFIG_KEYPAD_POLL_'):]\
+                        .lower()
+    return info
+
+
+def compare(results, baseline, tolerance):
+    """Return a list of regressions against the baseline."""
+    failures = []
+    for name, base in baseline.get('scenarios', {}).items():
+        cur = results['scenarios'].get(name, {})
+        for key in ('avg_ua', 'peak_ua'):
+            if key in base and key in cur:
+                limit = base[key] * (1 + tolerance / 100) + 1
+                if cur[key] > limit:
+                    failures.append('%s %s %d > %d' %
+                                    (name, key, cur[key], limit))
+    return failures
+
+
+SCENARIOS = ('idle', 'suspended', 'slow', 'burst', 'rgb')
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--ppk2', default='/dev/ttyACM2',
+                        help='serial port of the Power Profiler Kit II')
+    parser.add_argument('--stim', default='/dev/ttyACM0',
+                        help='console of the stimulus board')
+    parser.add_argument('--console',
+                        help='shell console of the keypad, for rgb')
+    parser.add_argument('--usb-port',
+                        help='sysfs name of the keypad, e.g. 1-4, for '
+                             'suspended')
+    parser.add_argument('--build-dir',
+                        help='build directory of the firmware under test')
+    parser.add_argument('--keys', type=int, default=4,
+                        help='number of wired key lines')
+    parser.add_argument('--scenarios', default=','.join(SCENARIOS),
+                        help='comma separated scenarios to run')
+    parser.add_argument('--settle', type=float, default=2,
+                        help='seconds before each measurement')
+    parser.add_argument('--duration', type=float, default=10,
+                        help='seconds measured per scenario')
+    parser.add_argument('--hold', type=float, default=0.03,
+                        help='seconds a tapped key stays pressed')
+    parser.add_argument('--json', help='write results to this file')
+    parser.add_argument('--baseline', help='compare against this JSON file')
+    parser.add_argument('--save-baseline', help='write results as baseline')
+    parser.add_argument('--tolerance', type=float, default=10,
+                        help='allowed current increase in percent')
+    return parser.parse_args()
+
+
+def main():
+    args = parse_args()
+    bench = Bench(args)
+
+    results = {'firmware': firmware(args.build_dir), 'scenarios': {}}
+    for name in args.scenarios.split(','):
+        if name not in SCENARIOS:
+            sys.exit('unknown scenario %r' % name)
+        results['scenarios'][name] = getattr(bench, name)()
+    print(json.dumps(results, indent=2))
+
+    for path in (args.json, args.save_baseline):
+        if path:
+            with open(path, 'w') as f:
+                json.dump(results, f, indent=2)
+
+    if args.baseline:
+        if not os.path.exists(args.baseline):
+            print('no baseline at %s, skipping comparison' % args.baseline)
+            return 0
+        with open(args.baseline) as f:
+            failures = compare(results, json.load(f), args.tolerance)
+        for failure in failures:
+            print('REGRESSION:', failure)
+        return 1 if failures else 0
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
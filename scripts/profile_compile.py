@@ -0,0 +1,197 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2022 Rich Effects
+#
+# SPDX-License-Identifier: Apache-2.0
+
+"""Compile a keypad profile into a load-ready UPLOAD_TARGET_PROFILE blob.
+
+Reads a profile in JSON, every layer as a list of actions and the
+macros as a list of sequences:
+
+    {
+        "layers": [["0x04", "0x05", "LAYER_MO(1)", "LAYER_MACRO(0)"],
+                   ["LAYER_TRANSPARENT", "0x1e", "LAYER_NONE",
+                    "LAYER_LT(1, 0x2c)"]],
+        "macros": [{"delay": 10,
+                    "sequence": ["MACRO_DOWN", "0xe1", "0x0b",
+                                 "MACRO_UP", "0xe1", "0x08"]},
+                   {"text": "Grüße"}]
+    }
+
+An action or sequence byte is a number or an expression of the macros
+in include/dt-bindings/keypad/layers.h and macros.h, as in the
+devicetree. A macro with "text" instead is typed with the keys of the
+host layout given with --layout, see host_layout.py. The blob is what the firmware keeps in RAM (src/upload.h):
+a header the keypad checks against its build, the keymap image with
+the layer mask of every key already worked out, as layer_resolve()
+uses it, and the macro table. The keypad copies it in place and only
+checks it. "macros" left out keeps the macros on the keypad.
+
+Writes the blob with --output, uploads it over raw HID with --hid, or
+both. With --slot the profile is compiled without macros for one
+application, as UPLOAD_TARGET_APP_PROFILE(slot), see app_focus.py.
+Combos, leader sequences and shortcuts stay in the devicetree, compiled
+into the firmware by the gen_*.py scripts.
+"""
+
+import argparse
+import json
+import os
+import re
+import struct
+import sys
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import host_layout  # noqa: E402
+import keypad_hid  # noqa: E402
+
+BINDINGS = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                        '..', 'include', 'dt-bindings', 'keypad')
+
+# src/upload.h
+UPLOAD_TARGET_PROFILE = 0x08
+UPLOAD_TARGET_APP_PROFILE = 0x10
+UPLOAD_APP_PROFILE_MAX = 16
+PROFILE_MAGIC = 0x4652504b
+PROFILE_VERSION = 1
+PROFILE_HEADER = struct.Struct('<IBBBBHH')
+# src/keymap.h KEYPAD_MAX_KEYS
+MAX_KEYS = 32
+LAYER_MAX = 32
+LAYER_TRANSPARENT = 0x0000
+
+DEFINE = re.compile(r'#define\s+(\w+)(\(([\w\s,]*)\))?\s+(.*)')
+
+
+def load_bindings():
+    """The macros of the binding headers, as names to eval() against."""
+    names = {'__builtins__': {}}
+    for header in ('layers.h', 'macros.h'):
+        with open(os.path.join(BINDINGS, header)) as f:
+            text = f.read().replace('\\\n', ' ')
+        for line in text.splitlines():
+            m = DEFINE.match(line.strip())
+            if m is None or not m.group(4) or m.group(1).endswith('_H_'):
+                continue
+            name, params, body = m.group(1), m.group(3), m.group(4)
+            if params is not None:
+                names[name] = eval(f'lambda {params}: {body}', names)
+            else:
+                names[name] = eval(body, names)
+    return names
+
+
+def value(expr, names, what):
+    if isinstance(expr, int):
+        return expr
+    try:
+        return int(eval(expr, names))
+    except Exception as e:
+        sys.exit(f'{what}: cannot evaluate {expr!r}: {e}')
+
+
+def compile_keymap(layers, names, max_keys):
+    """The keymap image of layer_keymap_image(), masks included."""
+    keys = len(layers[0])
+    if not 0 < keys <= max_keys:
+        sys.exit(f'{keys} keys, the keypad takes 1 to {max_keys}')
+    if len(layers) > LAYER_MAX:
+        sys.exit(f'{len(layers)} layers, at most {LAYER_MAX}')
+
+    actions = []
+    for n, layer in enumerate(layers):
+        if len(layer) != keys:
+            sys.exit(f'layer {n} has {len(layer)} keys, '
+                     f'layer 0 has {keys}')
+        row = [value(a, names, f'layer {n} key {k}') & 0xffff
+               for k, a in enumerate(layer)]
+        actions.append(row + [LAYER_TRANSPARENT] * (max_keys - keys))
+
+    masks = []
+    for k in range(max_keys):
+        # Bit n: layer n maps the key, the base layer always does
+        mask = 1
+        for n in range(1, len(layers)):
+            if actions[n][k] != LAYER_TRANSPARENT:
+                mask |= 1 << n
+        masks.append(mask)
+
+    image = b''.join(struct.pack(f'<{max_keys}H', *row) for row in actions)
+    return keys, image + struct.pack(f'<{max_keys}I', *masks)
+
+
+def compile_macros(macros, names, layout):
+    """The macro table, le16 length, le16 delay and the sequence each."""
+    table = b''
+    for n, macro in enumerate(macros):
+        if 'text' in macro:
+            seq = bytes(host_layout.text_sequence(macro['text'], layout,
+                                                  f'macro {n}'))
+        else:
+            seq = bytes(value(b, names, f'macro {n}') & 0xff
+                        for b in macro.get('sequence', []))
+        table += struct.pack('<HH', len(seq), macro.get('delay', 0)) + seq
+    return table
+
+
+def compile_profile(profile, max_keys=MAX_KEYS, layout='us'):
+    names = load_bindings()
+    layers = profile.get('layers')
+    if not layers:
+        sys.exit('the profile has no layers')
+
+    keys, image = compile_keymap(layers, names, max_keys)
+    macros = compile_macros(profile.get('macros', []), names, layout)
+    if PROFILE_HEADER.size + len(image) + len(macros) > 0xffff:
+        sys.exit('the profile does not fit an upload')
+
+    header = PROFILE_HEADER.pack(PROFILE_MAGIC, PROFILE_VERSION,
+                                 len(layers), max_keys, keys,
+                                 len(macros), 0)
+    return header + image + macros
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('profile', help='profile JSON')
+    parser.add_argument('-o', '--output', help='write the blob here')
+    parser.add_argument('--hid', help='upload to this hidraw node')
+    parser.add_argument('--max-keys', type=int, default=MAX_KEYS,
+                        help='KEYPAD_MAX_KEYS of the firmware')
+    parser.add_argument('--slot', type=int,
+                        help='per-application profile slot')
+    parser.add_argument('--layout', default='us',
+                        choices=sorted(host_layout.LAYOUTS),
+                        help='host keyboard layout of text macros, '
+                        'CONFIG_KEYPAD_HOST_LAYOUT')
+    args = parser.parse_args()
+
+    with open(args.profile) as f:
+        profile = json.load(f)
+    target = UPLOAD_TARGET_PROFILE
+    if args.slot is not None:
+        if not 0 <= args.slot < UPLOAD_APP_PROFILE_MAX:
+            sys.exit(f'slot {args.slot}, the keypad takes 0 to '
+                     f'{UPLOAD_APP_PROFILE_MAX - 1}')
+        if profile.get('macros'):
+            sys.exit('an application profile shares the keypad\'s macros')
+        target = UPLOAD_TARGET_APP_PROFILE + args.slot
+    blob = compile_profile(profile, args.max_keys, args.layout)
+    print(f'{len(blob)} bytes')
+
+    if args.output:
+        with open(args.output, 'wb') as f:
+            f.write(blob)
+
+    if args.hid:
+        keypad = keypad_hid.Keypad(args.hid)
+        try:
+            keypad.upload(target, blob)
+        except (RuntimeError, TimeoutError) as e:
+            sys.exit(f'upload failed: {e}')
+        print('uploaded')
+
+
+if __name__ == '__main__':
+    main()
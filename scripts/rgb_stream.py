@@ -0,0 +1,189 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2022 Rich Effects
+#
+# SPDX-License-Identifier: Apache-2.0
+
+"""Stream lighting frames to a keypad over raw HID.
+
+Sends RGB commands (src/usb/raw_hid.h) to a keypad built with
+CONFIG_KEYPAD_LED_RGB: each frame in reports of up to RAW_HID_RGB_MAX
+LEDs, the last one with RAW_HID_RGB_SYNC. The keypad acks the sync at
+its next frame, once the new frame is on the LEDs, and the next frame
+is only sent then. Plays a rainbow moving along the strip as a demo
+of what a screen-sync client would send.
+
+Each frame goes in whichever encoding takes the fewest reports: raw
+r, g, b, runs of one color, or 4 bit indices into a palette of up to
+16 colors, plain or in runs. The palette is only sent when it
+changes. --hues quantizes the rainbow so the palette formats apply.
+"""
+
+import argparse
+import colorsys
+import os
+import struct
+import sys
+import time
+
+RAW_HID_REPORT_SIZE = 64
+RAW_HID_CMD_RGB = 0x0c
+RAW_HID_RGB_SYNC = 0x01
+RAW_HID_RGB_DATA = RAW_HID_REPORT_SIZE - 2 - 3
+RAW_HID_RGB_MAX = RAW_HID_RGB_DATA // 3
+# enum led_rgb_format, in bits 1..3 of the flags
+FORMAT_RAW = 0
+FORMAT_RLE = 1
+FORMAT_INDEXED = 2
+FORMAT_INDEXED_RLE = 3
+FORMAT_PALETTE = 4
+PALETTE_SIZE = 16
+UPLOAD_STATUS_OK = 0
+UPLOAD_STATUS_SEQUENCE = 1
+UPLOAD_STATUS_BUSY = 2
+UPLOAD_STATUS_UNSUPPORTED = 4
+
+
+def rainbow(leds, t, hues):
+    for i in range(leds):
+        h = (t / 3 + i / leds) % 1
+        if hues:
+            h = int(h * hues) / hues
+        r, g, b = colorsys.hsv_to_rgb(h, 1, 1)
+        yield int(r * 255), int(g * 255), int(b * 255)
+
+
+def report(fmt, first, count, data):
+    return struct.pack('<BBB', first, count, fmt << 1) + bytes(data)
+
+
+def runs(items, longest):
+    """(length, item) of each run of equal items, at most longest"""
+    out = []
+    for item in items:
+        if out and out[-1][1] == item and out[-1][0] < longest:
+            out[-1][0] += 1
+        else:
+            out.append([1, item])
+    return out
+
+
+def pack(fmt, runs_or_items, size, span):
+    """Fit encoded items of size bytes covering span LEDs to reports"""
+    out = []
+    first = 0
+    data = b''
+    count = 0
+    for item in runs_or_items:
+        if len(data) + size > RAW_HID_RGB_DATA or count + span(item) > 255:
+            out.append(report(fmt, first, count, data))
+            first += count
+            data = b''
+            count = 0
+        data += encode(fmt, item)
+        count += span(item)
+    if count:
+        out.append(report(fmt, first, count, data))
+    return out
+
+
+def encode(fmt, item):
+    if fmt == FORMAT_RAW:
+        return bytes(item)
+    if fmt == FORMAT_RLE:
+        return bytes([item[0]]) + bytes(item[1])
+    if fmt == FORMAT_INDEXED:
+        return bytes([item[0] | (item[1] if len(item) > 1 else 0) << 4])
+    return bytes([(item[0] - 1) << 4 | item[1]])
+
+
+def encodings(frame):
+    """Each encoding of the frame: (palette or None, reports)"""
+    yield None, pack(FORMAT_RAW, frame, 3, lambda c: 1)
+    yield None, pack(FORMAT_RLE, runs(frame, 255), 4, lambda r: r[0])
+
+    colors = sorted(set(frame))
+    if len(colors) > PALETTE_SIZE:
+        return
+    index = [colors.index(c) for c in frame]
+    pairs = [index[i:i + 2] for i in range(0, len(index), 2)]
+    yield colors, pack(FORMAT_INDEXED, pairs, 1, len)
+    yield colors, pack(FORMAT_INDEXED_RLE, runs(index, 16), 1,
+                       lambda r: r[0])
+
+
+def reports(frame, sent_palette):
+    """Reports for the frame, and the palette the keypad has after it"""
+    best = None
+    for palette, out in encodings(frame):
+        if palette is not None and palette != sent_palette:
+            out = [report(FORMAT_PALETTE, 0, len(palette),
+                          b''.join(bytes(c) for c in palette))] + out
+        if best is None or len(out) < len(best[1]):
+            best = palette, out
+    palette, out = best
+    last = out[-1]
+    out[-1] = last[:2] + bytes([last[2] | RAW_HID_RGB_SYNC]) + last[3:]
+    return out, palette if palette is not None else sent_palette
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--hid', required=True,
+                        help='hidraw node of the raw HID interface')
+    parser.add_argument('--leds', type=int, default=4,
+                        help='LEDs on the strip')
+    parser.add_argument('--fps', type=int, default=60)
+    parser.add_argument('--seconds', type=float, default=10)
+    parser.add_argument('--hues', type=int, default=0,
+                        help='quantize the rainbow to this many hues')
+    args = parser.parse_args()
+
+    fd = os.open(args.hid, os.O_RDWR)
+    seq = 0
+    frames = 0
+    sent = 0
+    palette = None
+    start = time.monotonic()
+
+    while time.monotonic() - start < args.seconds:
+        due = start + frames / args.fps
+        time.sleep(max(0, due - time.monotonic()))
+        frame = list(rainbow(args.leds, time.monotonic() - start,
+                             args.hues))
+        pending, palette = reports(frame, palette)
+        sent += len(pending)
+
+        while pending:
+            out = bytes([RAW_HID_CMD_RGB, seq]) + pending[0]
+            os.write(fd, b'\0' + out.ljust(RAW_HID_REPORT_SIZE, b'\0'))
+            sync = pending[0][2] & RAW_HID_RGB_SYNC
+            seq = (seq + 1) % 256
+            pending.pop(0)
+            if not sync:
+                continue
+
+            # Everything up to the sync is acked from the vsync, skip
+            # the window acks of the reports before it
+            reply = os.read(fd, RAW_HID_REPORT_SIZE)
+            while reply[0] == UPLOAD_STATUS_OK and reply[1] != seq:
+                reply = os.read(fd, RAW_HID_REPORT_SIZE)
+            if reply[0] == UPLOAD_STATUS_UNSUPPORTED:
+                sys.exit('RGB refused, is CONFIG_KEYPAD_LED_RGB on?')
+            if reply[0] in (UPLOAD_STATUS_SEQUENCE, UPLOAD_STATUS_BUSY):
+                # Resend the frame under the sequence number expected,
+                # with its palette as that may not have been taken
+                seq = reply[1]
+                pending, palette = reports(frame, None)
+                sent += len(pending)
+
+        frames += 1
+
+    elapsed = time.monotonic() - start
+    raw = frames * -(-args.leds // RAW_HID_RGB_MAX)
+    print(f'{frames} frames in {elapsed:.1f} s, {frames / elapsed:.1f} fps, '
+          f'{sent} reports where raw takes {raw}')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,113 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2022 Rich Effects
+#
+# SPDX-License-Identifier: Apache-2.0
+
+"""Record the raw scan stream of the keypad.
+
+Turns on the scan stream of a keypad built with CONFIG_KEYPAD_SCAN_STREAM
+(src/diag/scan_stream.h) over the WebUSB interface and writes one CSV
+line per scan: microseconds of the keypad's uptime, then the raw line
+bitmap of a matrix or shift register scan, or the raw SAADC sample of
+every analog key. Chunks missed on the way and scans the keypad dropped
+are reported on stderr. Stops the stream again on Ctrl-C.
+
+Needs pyusb, and on Linux access to the device node.
+"""
+
+import argparse
+import struct
+import sys
+
+import usb.core
+import usb.util
+
+# src/usb/webusb.h
+WEBUSB_CMD_STREAM = 0x03
+# src/diag/scan_stream.h
+SCAN_STREAM_TAG = 0x80
+SCAN_STREAM_BITMAP = 0x01
+SCAN_STREAM_SAMPLES = 0x02
+HEADER = struct.Struct('<BBHHH')
+# CONFIG_USB_DEVICE_VID, USB_PID_HID_SAMPLE
+VID = 0x2FE3
+PID = 0x0007
+
+
+def open_interface(vid, pid):
+    """The vendor interface's bulk OUT and IN endpoints."""
+    dev = usb.core.find(idVendor=vid, idProduct=pid)
+    if dev is None:
+        sys.exit(f'no device {vid:04x}:{pid:04x}')
+
+    intf = usb.util.find_descriptor(
+        dev.get_active_configuration(),
+        bInterfaceClass=usb.CLASS_VENDOR_SPEC)
+    if intf is None:
+        sys.exit('no WebUSB interface, is CONFIG_KEYPAD_WEBUSB on?')
+    usb.util.claim_interface(dev, intf)
+
+    def direction(d):
+        return lambda ep: usb.util.endpoint_direction(
+            ep.bEndpointAddress) == d
+
+    return (usb.util.find_descriptor(intf, custom_match=direction(
+                usb.util.ENDPOINT_OUT)),
+            usb.util.find_descriptor(intf, custom_match=direction(
+                usb.util.ENDPOINT_IN)))
+
+
+def records(chunk, kind, count):
+    """(us, values) of every scan in a chunk."""
+    body = chunk[HEADER.size:]
+    size = len(body) // count if count else 0
+    for i in range(count):
+        rec = body[i * size:(i + 1) * size]
+        us, = struct.unpack_from('<I', rec)
+        if kind == SCAN_STREAM_BITMAP:
+            yield us, [f'0x{struct.unpack_from("<I", rec, 4)[0]:08x}']
+        else:
+            yield us, list(struct.unpack_from(f'<{(size - 4) // 2}h',
+                                              rec, 4))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('-o', '--output', help='CSV file, stdout if none')
+    parser.add_argument('--vid', type=lambda v: int(v, 0), default=VID)
+    parser.add_argument('--pid', type=lambda v: int(v, 0), default=PID)
+    args = parser.parse_args()
+
+    ep_out, ep_in = open_interface(args.vid, args.pid)
+    out = open(args.output, 'w') if args.output else sys.stdout
+
+    ep_out.write(bytes([WEBUSB_CMD_STREAM, 1, 0, 0]))
+    number = None
+    try:
+        while True:
+            chunk = bytes(ep_in.read(4096, timeout=0))
+            if chunk[0] != SCAN_STREAM_TAG:
+                if chunk[0] != 0:
+                    sys.exit(f'stream refused, status {chunk[0]}, is '
+                             f'CONFIG_KEYPAD_SCAN_STREAM on?')
+                continue
+
+            _, kind, n, count, dropped = HEADER.unpack_from(chunk)
+            if number is not None and n != (number + 1) & 0xFFFF:
+                print(f'{(n - number - 1) & 0xFFFF} chunks missed',
+                      file=sys.stderr)
+            if dropped:
+                print(f'{dropped} scans dropped', file=sys.stderr)
+            number = n
+
+            for us, values in records(chunk, kind, count):
+                print(us, *values, sep=',', file=out)
+    except KeyboardInterrupt:
+        pass
+    finally:
+        ep_out.write(bytes([WEBUSB_CMD_STREAM, 0, 0, 0]))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,186 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2022 Rich Effects
+#
+# SPDX-License-Identifier: Apache-2.0
+
+"""Check a keypad's key pipeline for lost, reordered or merged events.
+
+Polls the sequence trace of a keypad built with CONFIG_KEYPAD_SEQ_TRACE
+over raw HID (the SEQ command of src/usb/raw_hid.h) while keys are
+typed by hand or by the stimulus rig, until interrupted or --duration
+is over. Between two of its records, one per report the keypad sent:
+
+  lost       event numbers that advanced by more than the events taken,
+             transitions the event ring had no room for
+  reordered  event numbers that went back
+  merged     reports that took more than one event
+
+With --kbd, the keyboard interface's hidraw node, the reports the host
+received are counted against the ones the keypad recorded. Records
+written over before a poll read them are counted as unread; poll
+faster or build with more CONFIG_KEYPAD_SEQ_TRACE_RECORDS.
+"""
+
+import argparse
+import os
+import struct
+import sys
+import threading
+import time
+
+RAW_HID_REPORT_SIZE = 64
+RAW_HID_CMD_SEQ = 0x0a
+UPLOAD_STATUS_OK = 0
+UPLOAD_STATUS_SEQUENCE = 1
+
+# head, records
+RING_HEADER = struct.Struct('<II')
+# report, event, taken, reserved, us
+RECORD = struct.Struct('<IIHHI')
+
+
+class RawHid:
+    """The configuration interface of the keypad, through hidraw."""
+
+    def __init__(self, path):
+        self.fd = os.open(path, os.O_RDWR)
+        self.seq = 0
+
+    def read(self, offset):
+        """One SEQ read, the bytes at offset of the trace."""
+        for _ in range(4):
+            out = struct.pack('<BBBH', RAW_HID_CMD_SEQ, self.seq, 0, offset)
+            # Report ID 0, the interface has no numbered reports
+            os.write(self.fd, b'\0' + out.ljust(RAW_HID_REPORT_SIZE, b'\0'))
+            reply = os.read(self.fd, RAW_HID_REPORT_SIZE)
+            self.seq = reply[1]
+            if reply[0] == UPLOAD_STATUS_SEQUENCE:
+                # Resend under the sequence number the keypad expects
+                continue
+            if reply[0] != UPLOAD_STATUS_OK:
+                sys.exit(f'trace read refused, status {reply[0]}, '
+                         'is CONFIG_KEYPAD_SEQ_TRACE on?')
+            return reply[4:4 + reply[3]]
+
+        raise RuntimeError('trace read out of sequence')
+
+    def head(self):
+        return RING_HEADER.unpack_from(self.read(0))[0]
+
+    def records(self):
+        """[(index, record), ...] of the trace, oldest first."""
+        data = b''
+        while True:
+            chunk = self.read(len(data))
+            if not chunk:
+                break
+            data += chunk
+
+        head, slots = RING_HEADER.unpack_from(data)
+        # Slots written while the trace was read may be torn
+        oldest = max(0, self.head() - slots)
+        records = []
+        for index in range(max(oldest, head - slots), head):
+            pos = RING_HEADER.size + (index % slots) * RECORD.size
+            records.append((index, RECORD.unpack_from(data, pos)))
+
+        return head, records
+
+
+class ReportCounter(threading.Thread):
+    """Counts the keyboard reports the host receives."""
+
+    def __init__(self, path):
+        super().__init__(daemon=True)
+        self.fd = os.open(path, os.O_RDONLY)
+        self.count = 0
+
+    def run(self):
+        while True:
+            os.read(self.fd, RAW_HID_REPORT_SIZE)
+            self.count += 1
+
+
+class Checker:
+    def __init__(self):
+        self.prev = None
+        self.records = 0
+        self.unread = 0
+        self.lost = 0
+        self.reordered = 0
+        self.merged = 0
+        self.events = 0
+
+    def add(self, rec):
+        report, event, taken, _, _ = rec
+        self.records += 1
+        self.events += taken
+        if taken > 1:
+            self.merged += 1
+
+        if self.prev is not None:
+            prev_report, prev_event = self.prev[0], self.prev[1]
+            self.unread += report - prev_report - 1
+            if event < prev_event:
+                self.reordered += 1
+            elif report == prev_report + 1 and \
+                    event - prev_event > taken:
+                self.lost += event - prev_event - taken
+
+        self.prev = rec
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--hid', required=True,
+                        help='hidraw node of the raw HID interface')
+    parser.add_argument('--kbd',
+                        help='hidraw node of the keyboard interface')
+    parser.add_argument('--interval', type=int, default=50,
+                        help='trace poll period, ms')
+    parser.add_argument('--duration', type=float,
+                        help='seconds to check for, until ^C without')
+    args = parser.parse_args()
+
+    hid = RawHid(args.hid)
+    counter = None
+    if args.kbd:
+        counter = ReportCounter(args.kbd)
+        counter.start()
+
+    check = Checker()
+    # Only what is sent from now on
+    last = hid.head()
+    received = counter.count if counter else 0
+    end = time.monotonic() + args.duration if args.duration else None
+    print('checking, ^C to stop', file=sys.stderr)
+    try:
+        while end is None or time.monotonic() < end:
+            time.sleep(args.interval / 1000)
+            head, records = hid.records()
+            if records and records[0][0] > last:
+                check.unread += records[0][0] - last
+            for index, rec in records:
+                if index >= last:
+                    check.add(rec)
+            last = head
+    except KeyboardInterrupt:
+        pass
+
+    print(f'{check.records} reports, {check.events} events taken')
+    print(f'lost {check.lost}, reordered {check.reordered}, '
+          f'merged {check.merged} reports')
+    if check.unread:
+        print(f'warning: {check.unread} records unread, poll faster',
+              file=sys.stderr)
+    if counter:
+        # Within a report or two, the ends of the window are not exact
+        print(f'host received {counter.count - received} keyboard '
+              f'reports, keypad recorded {check.records + check.unread}')
+
+    sys.exit(1 if check.lost or check.reordered else 0)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,277 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2022 Rich Effects
+#
+# SPDX-License-Identifier: Apache-2.0
+
+"""Per-module flash and RAM budget of a keypad build.
+
+Reads the GNU ld map file of zephyr.elf and adds up the allocated input
+sections per module: the keypad's own sources by directory of src/
+(app, app/usb, app/config, ...), Zephyr by kernel, arch, driver class
+and subsystem, modules by name and the toolchain libraries together.
+Initialised data counts for both flash, where it is loaded from, and
+RAM. Thread stacks and other noinit buffers belong to the module that
+defines them, so they show up with it.
+
+Free flash and RAM are the lengths of the FLASH and RAM regions less
+what is used, and are compared with the reserves to keep for LED
+framebuffers and macro storage. Falling below a reserve is a warning,
+or an error with --check.
+"""
+
+import argparse
+import os
+import re
+import sys
+
+# Output sections without a place in memory
+SKIP_SECTIONS = ('.debug', '.comment', '.ARM.attributes', '.stab',
+                 '.note', '/DISCARD/')
+
+HEX = r'0x[0-9a-fA-F]+'
+
+# " .text.foo   0x00001234   0x40 app/libapp.a(foo.c.obj)"
+INPUT_RE = re.compile(r'^ (\S+)?\s+(' + HEX + r')\s+(' + HEX + r')\s+(\S.*)$')
+# "text   0x00001234   0x5a2c" and "datas   0x20000000  0x1a4 load address 0x63c4"
+OUTPUT_RE = re.compile(r'^(\S+)\s+(' + HEX + r')\s+(' + HEX + r')'
+                       r'(?:\s+load address\s+(' + HEX + r'))?')
+# Either name alone on its line, address and size on the next one
+NAME_RE = re.compile(r'^ (\S+)$')
+OUTPUT_NAME_RE = re.compile(r'^(\S+)$')
+OUTPUT_NEXT_RE = re.compile(r'^\s+(' + HEX + r')\s+(' + HEX + r')'
+                            r'(?:\s+load address\s+(' + HEX + r'))?\s*$')
+REGION_RE = re.compile(r'^(\S+)\s+(' + HEX + r')\s+(' + HEX + r')')
+
+
+class Region:
+    def __init__(self, name, origin, length):
+        self.name = name
+        self.origin = origin
+        self.length = length
+        self.used = 0
+
+    def __contains__(self, addr):
+        return self.origin <= addr < self.origin + self.length
+
+
+def source_index(source_dir):
+    """Source file name to its directory below src/, '' at the top."""
+    index = {}
+
+    for root, _, files in os.walk(source_dir):
+        rel = os.path.relpath(root, source_dir).replace(os.sep, '/')
+        for name in files:
+            if name.endswith('.c'):
+                index[name] = '' if rel == '.' else rel
+
+    return index
+
+
+def module_of(where, sources):
+    """Module an input file belongs to, from its path in the map."""
+    m = re.match(r'^(.*?)(?:\((.*)\))?$', where.strip())
+    path = m.group(1).replace('\\', '/')
+    member = m.group(2) or os.path.basename(path)
+    parts = [p for p in path.split('/') if p not in ('', '.', '..')]
+    source = re.sub(r'\.obj$|\.o$', '', member)
+
+    if 'libapp.a' in parts or 'app.dir' in parts:
+        sub = sources.get(source)
+        if sub is None:
+            return 'app (generated)'
+        return 'app/' + sub if sub else 'app'
+
+    if any(p.startswith('arm-') and p.endswith('-eabi') for p in parts) or \
+            'gcc' in parts or 'picolibc' in parts or 'newlib' in parts:
+        return 'toolchain'
+
+    if parts and parts[0] == 'zephyr':
+        parts = parts[1:]
+
+    if not parts:
+        return 'other'
+
+    if parts[0] == 'modules':
+        return 'modules/' + parts[1] if len(parts) > 2 else 'modules'
+
+    if parts[0] in ('drivers', 'subsys', 'lib') and len(parts) > 2:
+        return parts[0] + '/' + parts[1]
+
+    if parts[0] in ('kernel', 'arch', 'soc', 'boards', 'drivers',
+                    'subsys', 'lib'):
+        return parts[0]
+
+    return 'zephyr'
+
+
+def parse(map_file, sources):
+    regions = []
+    modules = {}
+    in_map = False
+    in_regions = False
+    section = None
+    load = None
+    pending = None
+    output_pending = None
+
+    def region_of(addr):
+        for region in regions:
+            if addr in region:
+                return region
+        return None
+
+    def place(name, addr, size, lma):
+        """Count an output section against its regions."""
+        if name.startswith(SKIP_SECTIONS) or size == 0:
+            return
+
+        vma = region_of(addr)
+        lma = region_of(lma) if lma is not None else None
+        for region in {vma, lma} - {None}:
+            region.used += size
+
+    def add(name, addr, size, where):
+        if section is None or section.startswith(SKIP_SECTIONS) or size == 0:
+            return
+
+        vma = region_of(addr)
+        if vma is None:
+            return
+
+        module = modules.setdefault(module_of(where, sources),
+                                    {'FLASH': 0, 'RAM': 0})
+        kinds = {vma.name}
+        if load is not None:
+            lma = region_of(load)
+            if lma is not None:
+                kinds.add(lma.name)
+
+        for kind in kinds:
+            if kind in module:
+                module[kind] += size
+
+    with open(map_file, encoding='utf-8', errors='replace') as f:
+        for line in f:
+            line = line.rstrip('\n')
+
+            if line.startswith('Memory Configuration'):
+                in_regions = True
+                continue
+
+            if line.startswith('Linker script and memory map'):
+                in_regions = False
+                in_map = True
+                continue
+
+            if in_regions:
+                m = REGION_RE.match(line)
+                if m and m.group(1) in ('FLASH', 'RAM'):
+                    regions.append(Region(m.group(1), int(m.group(2), 16),
+                                          int(m.group(3), 16)))
+                continue
+
+            if not in_map:
+                continue
+
+            if output_pending is not None:
+                m = OUTPUT_NEXT_RE.match(line)
+                output_pending = None
+                if m:
+                    load = int(m.group(3), 16) if m.group(3) else None
+                    place(section, int(m.group(1), 16), int(m.group(2), 16),
+                          load)
+                    continue
+
+            if line and not line[0].isspace():
+                pending = None
+                m = OUTPUT_RE.match(line)
+                if m:
+                    section = m.group(1)
+                    load = int(m.group(4), 16) if m.group(4) else None
+                    place(section, int(m.group(2), 16), int(m.group(3), 16),
+                          load)
+                    continue
+
+                section = line.split()[0]
+                load = None
+                if OUTPUT_NAME_RE.match(line):
+                    output_pending = section
+                continue
+
+            m = NAME_RE.match(line)
+            if m:
+                pending = m.group(1)
+                continue
+
+            m = INPUT_RE.match(line)
+            if m:
+                add(m.group(1) or pending, int(m.group(2), 16),
+                    int(m.group(3), 16), m.group(4))
+            pending = None
+
+    return regions, modules
+
+
+def report(regions, modules, reserves, out):
+    short = []
+    width = max([len(m) for m in modules] + [len('module')])
+
+    out.write(f'{"module":<{width}} {"flash":>9} {"ram":>9}\n')
+    for name, size in sorted(modules.items(),
+                             key=lambda m: (not m[0].startswith('app'),
+                                            -m[1]['FLASH'] - m[1]['RAM'],
+                                            m[0])):
+        out.write(f'{name:<{width}} {size["FLASH"]:>9} {size["RAM"]:>9}\n')
+
+    flash = sum(m['FLASH'] for m in modules.values())
+    ram = sum(m['RAM'] for m in modules.values())
+    out.write(f'{"total":<{width}} {flash:>9} {ram:>9}\n')
+    out.write('(region use below includes alignment padding)\n\n')
+
+    for region in regions:
+        free = region.length - region.used
+        reserve = reserves.get(region.name, 0)
+        out.write(f'{region.name:<5} {region.used} of {region.length} '
+                  f'used, {free} free, {reserve} reserved\n')
+        if free < reserve:
+            short.append(f'{region.name}: {free} bytes free, '
+                         f'{reserve} reserved')
+
+    return short
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--map', required=True, help='zephyr.map')
+    parser.add_argument('--source-dir', required=True,
+                        help='the src directory of the keypad')
+    parser.add_argument('--flash-reserve', type=int, default=0,
+                        help='flash to keep free, bytes')
+    parser.add_argument('--ram-reserve', type=int, default=0,
+                        help='RAM to keep free, bytes')
+    parser.add_argument('--output', help='also write the report here')
+    parser.add_argument('--check', action='store_true',
+                        help='exit non-zero below a reserve')
+    args = parser.parse_args()
+
+    regions, modules = parse(args.map, source_index(args.source_dir))
+    if not regions:
+        sys.exit(f'{args.map}: no FLASH and RAM regions found')
+
+    reserves = {'FLASH': args.flash_reserve, 'RAM': args.ram_reserve}
+    short = report(regions, modules, reserves, sys.stdout)
+
+    if args.output:
+        with open(args.output, 'w', encoding='utf-8') as f:
+            report(regions, modules, reserves, f)
+
+    for line in short:
+        print(f'warning: size budget exceeded, {line}', file=sys.stderr)
+
+    if short and args.check:
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2022 Rich Effects
+#
+# SPDX-License-Identifier: Apache-2.0
+
+"""Compare the per-stage cycles of a replay against a baseline.
+
+Reads the JSON a keypad built with CONFIG_KEYPAD_STAGE_BENCH prints for
+a replay (src/diag/stage_bench.h): the "replay: json" line of the
+CONFIG_KEYPAD_REPLAY_CHECK console output, as in a twister handler.log,
+or the output of the "replay json" shell command. The last one in the
+input counts. Prints the cycles per call of every stage and, when a
+baseline JSON is given, exits non-zero if any stage, or the total per
+event, takes more than the tolerance over it.
+
+    scripts/stage_compare.py handler.log --save-baseline gaming.json
+    scripts/stage_compare.py handler.log --baseline gaming.json
+"""
+
+import argparse
+import json
+import sys
+
+
+def load(path):
+    """The last replay result in a log, or a result file itself."""
+    result = None
+    with open(path) if path != '-' else sys.stdin as f:
+        for line in f:
+            start = line.find('{')
+            if start < 0:
+                continue
+            try:
+                result = json.loads(line[start:])
+            except json.JSONDecodeError:
+                continue
+    if result is None:
+        sys.exit(f'no replay JSON in {path}')
+    return result
+
+
+def per_call(result):
+    """{stage: cycles per call}, the total per event as 'event'."""
+    out = {'event': result['cycles_per_event']}
+    for name, stage in result.get('stages', {}).items():
+        if stage['calls'] > 0:
+            out[name] = stage['cycles'] / stage['calls']
+    return out
+
+
+def compare(current, baseline, tolerance):
+    """Return a list of regressions against the baseline."""
+    failures = []
+    for name, base in baseline.items():
+        if name not in current:
+            continue
+        limit = base * (1 + tolerance / 100) + 1
+        if current[name] > limit:
+            failures.append('%s %.0f cycles > %.0f' %
+                            (name, current[name], limit))
+    return failures
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('log', help='console log or result, - for stdin')
+    parser.add_argument('--baseline', help='compare against this JSON file')
+    parser.add_argument('--save-baseline', help='write cycles as baseline')
+    parser.add_argument('--tolerance', type=float, default=20,
+                        help='allowed regression per stage in percent')
+    args = parser.parse_args()
+
+    result = load(args.log)
+    current = per_call(result)
+    for name, cycles in current.items():
+        print(f'{name:10} {cycles:10.0f} cycles')
+
+    if args.save_baseline:
+        with open(args.save_baseline, 'w') as f:
+            json.dump(current, f, indent=2)
+
+    if args.baseline:
+        with open(args.baseline) as f:
+            failures = compare(current, json.load(f), args.tolerance)
+        for failure in failures:
+            print('REGRESSION', failure)
+        if failures:
+            sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,176 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2022 Rich Effects
+#
+# SPDX-License-Identifier: Apache-2.0
+
+"""Configuration upload throughput and its cost to typing.
+
+Uploads UPLOAD_TARGET_BENCH data of each size to a keypad built with
+CONFIG_KEYPAD_UPLOAD_BENCH (src/diag/upload_bench.h) over raw HID and
+prints the throughput with the keypad's time per stage: CRC, AES-CCM
+decryption with --key, apply, flash programming, commit and the config
+store's writes. The bytes take the path of a profile, through the
+vendor channel, the decryption and the integrity check, into flash.
+An upload is at most 64 KB, so the larger sizes go as uploads of
+SEGMENT bytes back to back, as a tool would send them. --profile adds
+a compiled profile (scripts/profile_compile.py) applied for real.
+
+With --typing KEY the keypad taps KEY every --tap-ms through the
+injector (CONFIG_KEYPAD_INJECT) during an idle window first, then
+during each upload, and the latency of its reports, event to done, is
+printed against the idle window's. --max-p99-delta fails the run if
+any upload adds more than that many us to p99.
+"""
+
+import argparse
+import os
+import struct
+import sys
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import keypad_hid  # noqa: E402
+
+# src/upload.h
+UPLOAD_TARGET_PROFILE = 0x08
+UPLOAD_TARGET_BENCH = 0x09
+UPLOAD_TARGET_ENCRYPTED = 0x80
+# src/config/upload_crypt.h
+NONCE_SIZE = 12
+TAG_SIZE = 16
+# le16 length of an upload, less the encryption overhead
+SEGMENT = 60 * 1024
+# src/diag/inject.h
+INJECT_PRESS = 0x01
+
+STAGES = ('crc', 'decrypt', 'apply', 'flash', 'commit', 'store')
+
+
+def seal(key, target, data):
+    """data as an encrypted upload to target, see upload_crypt.h."""
+    from cryptography.hazmat.primitives.ciphers.aead import AESCCM
+
+    nonce = os.urandom(NONCE_SIZE)
+    aad = bytes([target]) + struct.pack('<H', len(data))
+    return nonce + AESCCM(key, tag_length=TAG_SIZE).encrypt(nonce, data,
+                                                            aad)
+
+
+def taps(key, count, period_ms):
+    """Inject records tapping key count times, one every period_ms."""
+    half = period_ms * 500
+    return [rec for _ in range(count)
+            for rec in ((key, INJECT_PRESS, half), (key, 0, half))]
+
+
+class Typing:
+    """Keeps the keypad's injector topped up with taps, if asked to."""
+
+    def __init__(self, keypad, key, period_ms):
+        self.keypad = keypad
+        self.key = key
+        self.period_ms = period_ms
+
+    def top_up(self, first=False):
+        if self.key is None:
+            return
+        free = self.keypad.inject([], stop=first)[1]
+        self.keypad.inject(taps(self.key, free // 2, self.period_ms))
+
+    def stop(self):
+        if self.key is not None:
+            self.keypad.inject([], stop=True)
+
+
+def window(keypad, typing, uploads):
+    """Run uploads, (target, data) each, in one benchmark window."""
+    keypad.bench(start=True)
+    typing.top_up(first=True)
+    for target, data in uploads:
+        typing.top_up()
+        keypad.upload(target, data, timeout=5.0)
+    typing.stop()
+    return keypad.bench()
+
+
+def report(name, result, idle):
+    (uploads, nbytes, span_us, *stages), latency = \
+        result[:9], result[9:]
+    count, p50, p99, worst = latency
+    mbps = nbytes / span_us if span_us else 0
+    print(f'{name:>8}: {uploads} uploads, {nbytes} bytes in '
+          f'{span_us / 1000:.1f} ms, {mbps:.3f} MB/s')
+    print('          ' + ', '.join(f'{n} {us / 1000:.1f} ms'
+                                   for n, us in zip(STAGES, stages)))
+    if count == 0:
+        return 0
+    delta = p99 - idle[11] if idle else 0
+    print(f'          {count} reports, p50 {p50} p99 {p99} max {worst} us'
+          + (f', p99 {delta:+d} us over idle' if idle else ''))
+    return delta
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--hid', required=True,
+                        help='hidraw node of the raw HID interface')
+    parser.add_argument('--sizes', default='1,4,16,64,256',
+                        help='KB per run, comma separated')
+    parser.add_argument('--key', type=bytes.fromhex,
+                        help='upload key as hex, to send encrypted')
+    parser.add_argument('--profile', help='compiled profile to upload too')
+    parser.add_argument('--typing', type=int, metavar='KEY',
+                        help='tap KEY during the uploads')
+    parser.add_argument('--tap-ms', type=int, default=30,
+                        help='ms between taps')
+    parser.add_argument('--idle-ms', type=int, default=2000,
+                        help='ms of the idle window with --typing')
+    parser.add_argument('--max-p99-delta', type=int,
+                        help='most us an upload may add to p99')
+    args = parser.parse_args()
+
+    keypad = keypad_hid.Keypad(args.hid)
+    typing = Typing(keypad, args.typing, args.tap_ms)
+
+    def upload_of(target, data):
+        if args.key is None:
+            return target, data
+        return (target | UPLOAD_TARGET_ENCRYPTED,
+                seal(args.key, target, data))
+
+    runs = []
+    for kb in (int(s) for s in args.sizes.split(',')):
+        data = os.urandom(kb * 1024)
+        runs.append((f'{kb} KB', [upload_of(UPLOAD_TARGET_BENCH,
+                                            data[i:i + SEGMENT])
+                                  for i in range(0, len(data), SEGMENT)]))
+    if args.profile:
+        with open(args.profile, 'rb') as f:
+            runs.append(('profile',
+                         [upload_of(UPLOAD_TARGET_PROFILE, f.read())]))
+
+    try:
+        idle = None
+        if args.typing is not None:
+            keypad.bench(start=True)
+            typing.top_up(first=True)
+            time.sleep(args.idle_ms / 1000)
+            typing.stop()
+            idle = keypad.bench()
+            report('idle', idle, None)
+
+        worst = 0
+        for name, uploads in runs:
+            worst = max(worst, report(name, window(keypad, typing, uploads),
+                                      idle))
+    except RuntimeError as e:
+        sys.exit(f'{e}, is CONFIG_KEYPAD_UPLOAD_BENCH on?')
+
+    if args.max_p99_delta is not None and worst > args.max_p99_delta:
+        sys.exit(f'uploads add up to {worst} us to p99, over '
+                 f'{args.max_p99_delta} us')
+
+
+if __name__ == '__main__':
+    main()
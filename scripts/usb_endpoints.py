@@ -0,0 +1,190 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2022 Rich Effects
+#
+# SPDX-License-Identifier: Apache-2.0
+
+"""USB endpoint plan of a keypad build.
+
+Reads the Kconfig of the build (.config) and its devicetree (edt.pickle)
+and lists every interface of the USB device with the endpoints it takes:
+the keyboard, the gamepad and the configuration interface always on
+interrupt endpoints of their own, Consumer Control, System Control, the
+encoder and mouse keys on theirs or, with CONFIG_KEYPAD_HID_SHARED, as
+report IDs of one shared HID interface (src/usb/hid_shared.h), then
+WebUSB, MIDI and every CDC ACM UART.
+
+The nRF USBD has 7 IN and 7 OUT bulk or interrupt endpoints besides the
+control endpoint. A plan that needs more fails, as does one where the
+number of HID instances Kconfig creates differs from the interfaces:
+the USB stack would otherwise leave the last interfaces without an
+endpoint at enumeration, the keyboard's LED endpoint among them.
+"""
+
+import argparse
+import os
+import pickle
+import sys
+
+# nRF52840 and nRF5340 USBD, EP1 to EP7 each way
+ENDPOINTS_IN = 7
+ENDPOINTS_OUT = 7
+
+CDC_ACM_COMPAT = 'zephyr,cdc-acm-uart'
+
+# src/usb/hid_shared.h HID_SHARED_ID_*
+SHARED_IDS = {'consumer': 1, 'system': 2, 'encoder': 3, 'mouse': 4}
+
+
+class Interface:
+    def __init__(self, name, endpoints, dedicated=True, classes=()):
+        self.name = name
+        # (direction, type, bInterval in ms or None)
+        self.endpoints = endpoints
+        self.dedicated = dedicated
+        self.classes = classes
+
+    def count(self, direction):
+        return sum(1 for ep in self.endpoints if ep[0] == direction)
+
+
+def read_config(path):
+    """CONFIG_ symbols of a .config, strings unquoted."""
+    config = {}
+    with open(path) as f:
+        for line in f:
+            line = line.strip()
+            if not line.startswith('CONFIG_') or '=' not in line:
+                continue
+            name, value = line.split('=', 1)
+            if value.startswith('"'):
+                value = value[1:-1]
+            config[name[len('CONFIG_'):]] = value
+    return config
+
+
+def hid(name, config, interval, classes=(), dedicated=True):
+    """A HID interface, with its OUT endpoint if the class has them."""
+    endpoints = [('IN', 'interrupt', interval)]
+    if config.get('ENABLE_HID_INT_OUT_EP') == 'y':
+        endpoints.append(('OUT', 'interrupt', interval))
+    return Interface(name, endpoints, dedicated, classes)
+
+
+def plan(config, cdc_count):
+    """Interfaces in the order of src/usb/hid_iface.h, then the others."""
+    poll = int(config.get('USB_HID_POLL_INTERVAL_MS', 10))
+
+    def on(sym):
+        return config.get(sym) == 'y'
+
+    def interval(sym):
+        return int(config.get(sym, poll))
+
+    secondary = []
+    if on('KEYPAD_HID_CONTROL'):
+        secondary.append(('consumer',
+                          interval('KEYPAD_HID_CONSUMER_POLL_MS')))
+        secondary.append(('system', interval('KEYPAD_HID_SYSTEM_POLL_MS')))
+    if on('KEYPAD_ENCODER'):
+        secondary.append(('encoder', poll))
+    if on('KEYPAD_MOUSE_KEYS'):
+        secondary.append(('mouse', interval('KEYPAD_MOUSE_POLL_MS')))
+
+    ifaces = [hid('keyboard', config, poll, ('keyboard',))]
+    if on('KEYPAD_HID_SHARED') and secondary:
+        ifaces.append(hid('shared', config,
+                          min(ms for _, ms in secondary),
+                          tuple(f'{name} (report ID {SHARED_IDS[name]})'
+                                for name, _ in secondary),
+                          dedicated=False))
+    else:
+        ifaces += [hid(name, config, ms, (name,)) for name, ms in secondary]
+    if on('KEYPAD_GAMEPAD'):
+        ifaces.append(hid('gamepad', config,
+                          interval('KEYPAD_GAMEPAD_POLL_MS'), ('gamepad',)))
+    if on('KEYPAD_RAW_HID'):
+        ifaces.append(hid('configuration', config,
+                          interval('KEYPAD_RAW_HID_POLL_MS'),
+                          ('configuration',)))
+    hid_count = len(ifaces)
+
+    if on('KEYPAD_WEBUSB'):
+        ifaces.append(Interface('webusb', [('OUT', 'bulk', None),
+                                           ('IN', 'bulk', None)]))
+    if on('KEYPAD_MIDI'):
+        ifaces.append(Interface('midi', [('IN', 'bulk', None)]))
+    for i in range(cdc_count if on('USB_CDC_ACM') else 0):
+        ifaces.append(Interface(f'cdc_acm {i}',
+                                [('IN', 'interrupt', None),
+                                 ('IN', 'bulk', None),
+                                 ('OUT', 'bulk', None)]))
+
+    return ifaces, hid_count
+
+
+def render(ifaces):
+    """The endpoint map as text, one line per endpoint.
+
+    Endpoints are counted per direction in interface order, which is
+    the budget; the addresses the USB stack assigns may differ.
+    """
+    lines = []
+    used = {'IN': 0, 'OUT': 0}
+    for iface in ifaces:
+        kind = 'dedicated' if iface.dedicated else 'shared'
+        lines.append(f'{iface.name}: {kind}, {", ".join(iface.classes)}'
+                     if iface.classes else f'{iface.name}:')
+        for direction, ep_type, ms in iface.endpoints:
+            used[direction] += 1
+            poll = f', {ms} ms' if ms is not None else ''
+            lines.append(f'  {direction:<3} {used[direction]} '
+                         f'{ep_type}{poll}')
+    lines.append(f'{used["IN"]} of {ENDPOINTS_IN} IN, '
+                 f'{used["OUT"]} of {ENDPOINTS_OUT} OUT endpoints')
+    return lines
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--config', required=True,
+                        help='.config of the build')
+    parser.add_argument('--edt-pickle', required=True,
+                        help='edt.pickle of the build')
+    parser.add_argument('--zephyr-base', required=True,
+                        help='Zephyr tree, for the devicetree package')
+    parser.add_argument('--output', required=True,
+                        help='endpoint map to write')
+    args = parser.parse_args()
+
+    sys.path.insert(0, os.path.join(args.zephyr_base, 'scripts', 'dts',
+                                    'python-devicetree', 'src'))
+    with open(args.edt_pickle, 'rb') as f:
+        edt = pickle.load(f)
+
+    config = read_config(args.config)
+    ifaces, hid_count = plan(config,
+                             len(edt.compat2okay.get(CDC_ACM_COMPAT, [])))
+    lines = render(ifaces)
+    with open(args.output, 'w') as f:
+        f.write('\n'.join(lines) + '\n')
+    print('\n'.join(lines))
+
+    hid_devices = int(config.get('USB_HID_DEVICE_COUNT', 1))
+    if hid_devices != hid_count:
+        sys.exit(f'CONFIG_USB_HID_DEVICE_COUNT is {hid_devices} for '
+                 f'{hid_count} HID interfaces, leave it to its default')
+
+    for direction, budget in (('IN', ENDPOINTS_IN), ('OUT', ENDPOINTS_OUT)):
+        need = sum(iface.count(direction) for iface in ifaces)
+        if need <= budget:
+            continue
+        hint = ('turn off a class' if config.get('KEYPAD_HID_SHARED') == 'y'
+                else 'set CONFIG_KEYPAD_HID_SHARED=y or turn off a class')
+        sys.exit(f'{need} {direction} endpoints, the USB controller has '
+                 f'{budget}: {hint}')
+
+
+if __name__ == '__main__':
+    main()
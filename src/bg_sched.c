@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * A handful of jobs, so the queue is the list of every job ever
+ * submitted with a flag for the queued ones, and a pick walks them all
+ * under the lock. The thread sleeps on a semaphore, until the earliest
+ * release if one is pending, and every submission gives it.
+ *
+ * A job whose cost does not fit the time to the next frame is released
+ * again GUARD_US past it. One that can never fit, longer than a frame
+ * period, runs right after a frame instead, where it has the most of
+ * one; a wake up to a guard late, a system clock tick or two, still
+ * counts as right after. A deadline closer than the frame runs the job
+ * at once: late background work is worse than one report built a
+ * little later.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/sys/slist.h>
+
+#include "bg_sched.h"
+#include "diag/log_flush.h"
+#include "report_sched.h"
+#include "timebase.h"
+
+#define GUARD_US CONFIG_KEYPAD_BG_GUARD_US
+
+static sys_slist_t jobs = SYS_SLIST_STATIC_INIT(&jobs);
+static struct k_spinlock lock;
+static K_SEM_DEFINE(bg_sem, 0, 1);
+
+static inline bool before(uint32_t a, uint32_t b)
+{
+	return (int32_t)(a - b) < 0;
+}
+
+void bg_sched_submit(struct bg_job *job, uint32_t release_us,
+		     uint32_t deadline_us)
+{
+	uint32_t now = timebase_uptime_us32();
+	uint32_t release = now + release_us;
+	uint32_t deadline = now + MAX(deadline_us, release_us);
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	if (!job->registered) {
+		job->registered = true;
+		sys_slist_append(&jobs, &job->node);
+	}
+
+	if (!job->queued) {
+		job->queued = true;
+		job->release = release;
+		job->deadline = deadline;
+	} else {
+		if (before(release, job->release)) {
+			job->release = release;
+		}
+		if (before(deadline, job->deadline)) {
+			job->deadline = deadline;
+		}
+	}
+	k_spin_unlock(&lock, key);
+
+	k_sem_give(&bg_sem);
+}
+
+/*
+ * The released job with the earliest deadline, or NULL and the time
+ * to the next release in wait_us, UINT32_MAX for none. Lock held.
+ */
+static struct bg_job *bg_pick(uint32_t now, uint32_t *wait_us)
+{
+	struct bg_job *job = NULL;
+	struct bg_job *j;
+
+	*wait_us = UINT32_MAX;
+
+	SYS_SLIST_FOR_EACH_CONTAINER(&jobs, j, node) {
+		if (!j->queued) {
+			continue;
+		}
+
+		if (before(now, j->release)) {
+			*wait_us = MIN(*wait_us, j->release - now);
+			continue;
+		}
+
+		if (job == NULL || before(j->deadline, job->deadline)) {
+			job = j;
+		}
+	}
+
+	return job;
+}
+
+/* Put job off until past the next frame if it does not fit before it */
+static bool bg_defer(struct bg_job *job, uint32_t now)
+{
+	uint32_t period;
+	uint32_t gap = report_sched_next_frame_us(&period);
+
+	if (gap == UINT32_MAX || job->cost_us + GUARD_US <= gap) {
+		return false;
+	}
+
+	if (gap + 2 * GUARD_US >= period) {
+		/* Within a guard of the frame just past, as good as it gets */
+		return false;
+	}
+
+	if (before(job->deadline, now + gap + GUARD_US)) {
+		return false;
+	}
+
+	job->release = now + gap + GUARD_US;
+	job->deferred++;
+
+	return true;
+}
+
+static void bg_run(void *p1, void *p2, void *p3)
+{
+	struct bg_job *job;
+	k_spinlock_key_t key;
+	uint32_t wait_us;
+	uint32_t start;
+	uint32_t took;
+	uint32_t now;
+
+	ARG_UNUSED(p1);
+	ARG_UNUSED(p2);
+	ARG_UNUSED(p3);
+
+	for (;;) {
+		now = timebase_uptime_us32();
+		key = k_spin_lock(&lock);
+		job = bg_pick(now, &wait_us);
+		if (job != NULL && bg_defer(job, now)) {
+			k_spin_unlock(&lock, key);
+			continue;
+		}
+		if (job != NULL) {
+			job->queued = false;
+		}
+		k_spin_unlock(&lock, key);
+
+		if (job == NULL) {
+			/* Nothing else to do, print what was logged */
+			log_flush_kick();
+			(void)k_sem_take(&bg_sem, wait_us == UINT32_MAX ?
+					 K_FOREVER : K_USEC(wait_us));
+			continue;
+		}
+
+		start = timebase_now32();
+		job->run(job);
+		took = timebase_to_us32(timebase_now32() - start);
+
+		key = k_spin_lock(&lock);
+		if (took >= job->cost_us) {
+			job->cost_us = took;
+		} else {
+			job->cost_us -= (job->cost_us - took) / 8;
+		}
+		job->runs++;
+		if (before(job->deadline, now + took)) {
+			job->late++;
+		}
+		k_spin_unlock(&lock, key);
+	}
+}
+
+K_THREAD_DEFINE(bg_thread, CONFIG_KEYPAD_BG_STACK_SIZE, bg_run, NULL, NULL,
+		NULL, K_LOWEST_APPLICATION_THREAD_PRIO, 0, 0);
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static int cmd_bg_show(const struct shell *sh, size_t argc, char **argv)
+{
+	struct bg_job copy;
+	struct bg_job *job;
+	k_spinlock_key_t key;
+
+	SYS_SLIST_FOR_EACH_CONTAINER(&jobs, job, node) {
+		key = k_spin_lock(&lock);
+		copy = *job;
+		k_spin_unlock(&lock, key);
+
+		shell_print(sh, "%-12s %u runs, %u late, %u deferred, "
+			    "cost %u us%s", copy.name, copy.runs, copy.late,
+			    copy.deferred, copy.cost_us,
+			    copy.queued ? ", queued" : "");
+	}
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_bg,
+	SHELL_CMD(show, NULL, "Print the background jobs", cmd_bg_show),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(bg, &sub_bg, "Background jobs", NULL);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Background jobs, earliest deadline first. The work that is not on
+ * the way of a key to the host, the config store's flash writes, the
+ * status display and the typing analytics, runs as jobs on one thread
+ * at the lowest application priority. A submission gives the job a
+ * release time and a deadline, in microseconds from now, and the
+ * thread runs the released job with the earliest deadline.
+ *
+ * Before it starts a job the thread asks the report scheduler how far
+ * the picked link's next transmission is. A job that would not be done
+ * by then, going by its longest recent run, waits until just past that
+ * transmission unless its deadline comes first: the gaps between
+ * frames take the background work, and a flash write, which stalls the
+ * CPU, does not start just ahead of a frame. The input thread is ahead
+ * of all of it, its deadline is always the next frame.
+ */
+
+#ifndef KEYPAD_BG_SCHED_H_
+#define KEYPAD_BG_SCHED_H_
+
+#include <zephyr/zephyr.h>
+#include <zephyr/sys/slist.h>
+
+struct bg_job {
+	/* For the "bg" shell command */
+	const char *name;
+	/* Runs on the background thread, may submit the job again */
+	void (*run)(struct bg_job *job);
+
+	/* Owned by bg_sched.c */
+	sys_snode_t node;
+	bool registered;
+	bool queued;
+	/* timebase_uptime_us32() */
+	uint32_t release;
+	uint32_t deadline;
+	/* Longest recent run, decaying by 1/8 per shorter one */
+	uint32_t cost_us;
+	uint32_t runs;
+	/* Runs that ended past the deadline, starts put off for a frame */
+	uint32_t late;
+	uint32_t deferred;
+};
+
+/*
+ * Run job no earlier than release_us and no later than deadline_us
+ * from now, deadline_us at least release_us. A job already queued
+ * keeps the earlier of each. ISR safe.
+ */
+void bg_sched_submit(struct bg_job *job, uint32_t release_us,
+		     uint32_t deadline_us);
+
+#endif /* KEYPAD_BG_SCHED_H_ */
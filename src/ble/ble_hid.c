@@ -0,0 +1,980 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * The report map is the USB keyboard report descriptor, so the report
+ * built by the scheduler goes out unchanged as the input report. The
+ * sink is active once the host has subscribed to it, which takes an
+ * encrypted link. Notifications are copied into the host's buffers by
+ * bt_hids_inp_rep_send() and completed from the BT TX path.
+ *
+ * Each bonded host has a slot with its own connection and sink, and
+ * all of them stay connected: a host switch only changes the sink the
+ * scheduler is pinned to. HIDS keeps the CCCD of every client.
+ *
+ * With CONFIG_KEYPAD_BLE_RECONNECT a bonded host that is not connected
+ * gets a round of high duty cycle directed advertising, at boot, when
+ * it drops and, while no link is up at all, at the next key. The
+ * rounds go through the hosts one after the other. A round is up to
+ * 1.28 s, and ends in connected() with either the host or
+ * BT_HCI_ERR_ADV_TIMEOUT; undirected advertising follows the last
+ * one. While nobody is subscribed the report scheduler is held, so
+ * the keys pressed meanwhile wait in the event ring for the host's
+ * CCCD rather than fold away, for CONFIG_KEYPAD_BLE_RECONNECT_HOLD_MS
+ * at most. The HIDS attributes are registered in the same order every
+ * boot, so with GATT caching the bonded host finds the database hash
+ * unchanged and skips the discovery.
+ *
+ * With CONFIG_KEYPAD_BLE_ANCHOR_SYNC each slot learns when its
+ * connection events are. The controller on the network core does not
+ * tell, but the completions of the notifications come a fixed time
+ * after the event they went out in, plus the IPC, and later still
+ * when a packet was retransmitted. The phase of the completions within
+ * the interval is tracked, following an earlier completion quickly and
+ * a later one slowly, so it settles on the undelayed ones. The report
+ * is then built CONFIG_KEYPAD_BLE_ANCHOR_LEAD_US ahead of that phase.
+ * A phase older than a second has drifted by too much between the two
+ * clocks and is learnt again from the next report, sent at once.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/bluetooth/uuid.h>
+#include <zephyr/settings/settings.h>
+#include <bluetooth/services/hids.h>
+
+#include "report.h"
+#include "report_sched.h"
+#include "report_sink.h"
+#include "ble/ble_hid.h"
+#include "ble/nfc_pair.h"
+#include "power/deep_sleep.h"
+
+LOG_MODULE_REGISTER(ble_hid, LOG_LEVEL_INF);
+
+#define BLE_HID_VERSION 0x0101
+
+/* Index of the keyboard report in the input report group */
+#define BLE_HID_INPUT_IDX 0
+
+/*
+ * Connection intervals in 1.25 ms units. The supervision timeout of
+ * 6 s covers the idle interval times its latency twice over.
+ */
+#define BLE_HID_TIMEOUT 600
+
+#define BLE_HID_CONN_FAST \
+	BT_LE_CONN_PARAM(CONFIG_KEYPAD_BLE_CONN_INTERVAL, \
+			 CONFIG_KEYPAD_BLE_CONN_INTERVAL, 0, BLE_HID_TIMEOUT)
+
+#define BLE_HID_CONN_IDLE \
+	BT_LE_CONN_PARAM(CONFIG_KEYPAD_BLE_IDLE_INTERVAL, \
+			 CONFIG_KEYPAD_BLE_IDLE_INTERVAL, \
+			 CONFIG_KEYPAD_BLE_IDLE_LATENCY, BLE_HID_TIMEOUT)
+
+#if defined(CONFIG_KEYPAD_BLE_ANCHOR_SYNC)
+BUILD_ASSERT(CONFIG_KEYPAD_BLE_ANCHOR_LEAD_US <
+	     CONFIG_KEYPAD_BLE_CONN_INTERVAL * 1250,
+	     "the lead must be shorter than the connection interval");
+#define BLE_HID_ANCHOR_LEAD_US CONFIG_KEYPAD_BLE_ANCHOR_LEAD_US
+#else
+#define BLE_HID_ANCHOR_LEAD_US 0
+#endif
+
+/* Past this the two sleep clocks may have drifted by the lead */
+#define BLE_HID_ANCHOR_STALE_US USEC_PER_SEC
+
+BUILD_ASSERT((CONFIG_KEYPAD_BLE_IDLE_LATENCY + 1) *
+	     CONFIG_KEYPAD_BLE_IDLE_INTERVAL * 125 * 2 <
+	     BLE_HID_TIMEOUT * 1000, "idle latency exceeds the timeout");
+
+#if defined(CONFIG_KEYPAD_BLE_RECONNECT)
+#define BLE_HID_HOLD K_MSEC(CONFIG_KEYPAD_BLE_RECONNECT_HOLD_MS)
+#else
+#define BLE_HID_HOLD K_NO_WAIT
+#endif
+
+BT_HIDS_DEF(hids, REPORT_SIZE);
+
+static const struct bt_data ad[] = {
+	BT_DATA_BYTES(BT_DATA_GAP_APPEARANCE,
+		      CONFIG_BT_DEVICE_APPEARANCE & 0xFF,
+		      CONFIG_BT_DEVICE_APPEARANCE >> 8),
+	BT_DATA_BYTES(BT_DATA_FLAGS, BT_LE_AD_GENERAL | BT_LE_AD_NO_BREDR),
+	BT_DATA_BYTES(BT_DATA_UUID16_ALL, BT_UUID_16_ENCODE(BT_UUID_HIDS_VAL)),
+};
+
+static const struct bt_data sd[] = {
+	BT_DATA(BT_DATA_NAME_COMPLETE, CONFIG_BT_DEVICE_NAME,
+		sizeof(CONFIG_BT_DEVICE_NAME) - 1),
+};
+
+BUILD_ASSERT(BLE_HID_SLOTS <= CONFIG_BT_MAX_CONN &&
+	     BLE_HID_SLOTS <= CONFIG_BT_HIDS_MAX_CLIENT_COUNT,
+	     "every host slot needs a connection and a HIDS client");
+
+/* One connected host, and the sink its reports go to */
+struct ble_slot {
+	struct report_sink sink;
+	struct bt_conn *conn;
+	/* Identity of the host once paired, kept while disconnected */
+	bt_addr_le_t addr;
+	bool bonded;
+	/* The host enabled notifications of the keyboard report */
+	atomic_t subscribed;
+	atomic_t encrypted;
+	/* The link is on, or asked for, the idle parameters */
+	atomic_t idle_params;
+	/* Parameters to ask for next, from the key path or the idle timer */
+	struct k_work fast_work;
+	struct k_work_delayable idle_work;
+	/* Latest parameters in use */
+	uint16_t interval;
+	uint16_t latency;
+	/* Phase of the completions and when it was last seen, 0 unknown */
+	int64_t anchor_us;
+	int64_t anchor_seen_us;
+};
+
+static const char *const slot_names[] = { "ble1", "ble2", "ble3" };
+
+BUILD_ASSERT(BLE_HID_SLOTS <= ARRAY_SIZE(slot_names));
+
+/* conn and addr of the slots */
+static struct k_spinlock lock;
+static struct ble_slot slots[BLE_HID_SLOTS];
+/* Slot the key activity is for, -1 for the first one subscribed */
+static atomic_t target = ATOMIC_INIT(-1);
+/* Set by ble_hid_init(), keys may come first off a deferred start */
+static atomic_t started;
+
+static struct k_work adv_work;
+
+/* Bonded slots still due a directed round, and the slot of the one on */
+static atomic_t directed_due;
+static atomic_t directed = ATOMIC_INIT(-1);
+static struct k_work reconnect_work;
+static struct k_work_delayable hold_work;
+
+/* Wakes the scheduler ahead of the next event of the picked slot */
+static struct k_timer anchor_timer;
+static atomic_t anchor_armed;
+
+static void ble_hid_sent(struct bt_conn *conn, void *user_data);
+
+static struct bt_conn *slot_conn_ref(struct ble_slot *slot)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	struct bt_conn *conn = slot->conn ? bt_conn_ref(slot->conn) : NULL;
+
+	k_spin_unlock(&lock, key);
+
+	return conn;
+}
+
+static struct ble_slot *slot_of(struct bt_conn *conn)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	struct ble_slot *found = NULL;
+
+	for (size_t i = 0; i < BLE_HID_SLOTS; i++) {
+		if (slots[i].conn == conn) {
+			found = &slots[i];
+			break;
+		}
+	}
+
+	k_spin_unlock(&lock, key);
+
+	return found;
+}
+
+/*
+ * The slot of the host's bond, else the first slot without a bond.
+ * NULL when every slot belongs to another host.
+ */
+static struct ble_slot *slot_claim(struct bt_conn *conn)
+{
+	const bt_addr_le_t *dst = bt_conn_get_dst(conn);
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	struct ble_slot *found = NULL;
+
+	for (size_t i = 0; i < BLE_HID_SLOTS; i++) {
+		if (slots[i].conn == NULL && slots[i].bonded &&
+		    bt_addr_le_cmp(&slots[i].addr, dst) == 0) {
+			found = &slots[i];
+			break;
+		}
+	}
+
+	for (size_t i = 0; found == NULL && i < BLE_HID_SLOTS; i++) {
+		if (slots[i].conn == NULL && !slots[i].bonded) {
+			found = &slots[i];
+		}
+	}
+
+	if (found != NULL) {
+		found->conn = bt_conn_ref(conn);
+		bt_addr_le_copy(&found->addr, dst);
+	}
+
+	k_spin_unlock(&lock, key);
+
+	return found;
+}
+
+static bool slots_subscribed(void)
+{
+	for (size_t i = 0; i < BLE_HID_SLOTS; i++) {
+		if (atomic_get(&slots[i].subscribed)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static size_t slots_connected(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	size_t n = 0;
+
+	for (size_t i = 0; i < BLE_HID_SLOTS; i++) {
+		n += slots[i].conn != NULL;
+	}
+
+	k_spin_unlock(&lock, key);
+
+	return n;
+}
+
+static int ble_hid_write(struct report_sink *sink, const uint8_t *report,
+			 size_t len)
+{
+	struct ble_slot *slot = CONTAINER_OF(sink, struct ble_slot, sink);
+	struct bt_conn *conn = slot_conn_ref(slot);
+	int ret;
+
+	if (conn == NULL) {
+		return -ENOTCONN;
+	}
+
+	ret = bt_hids_inp_rep_send(&hids, conn, BLE_HID_INPUT_IDX, report,
+				   len, ble_hid_sent);
+	bt_conn_unref(conn);
+
+	return ret;
+}
+
+static bool ble_hid_active(struct report_sink *sink)
+{
+	struct ble_slot *slot = CONTAINER_OF(sink, struct ble_slot, sink);
+
+	return atomic_get(&slot->subscribed) != 0;
+}
+
+static int64_t anchor_now_us(void)
+{
+	return k_ticks_to_us_floor64(k_uptime_ticks());
+}
+
+/* A completion at now, lock held */
+static void slot_anchor_update(struct ble_slot *slot, int64_t now)
+{
+	int64_t interval = slot->interval * 1250;
+	int64_t err;
+
+	if (interval == 0) {
+		return;
+	}
+
+	if (slot->anchor_us == 0 ||
+	    now - slot->anchor_seen_us > BLE_HID_ANCHOR_STALE_US) {
+		slot->anchor_us = now;
+		slot->anchor_seen_us = now;
+		return;
+	}
+
+	/* Against the event closest in time, early is negative */
+	err = (now - slot->anchor_us) % interval;
+	if (err > interval / 2) {
+		err -= interval;
+	}
+
+	slot->anchor_us = now - err + (err < 0 ? err / 2 : err / 16);
+	slot->anchor_seen_us = now;
+}
+
+static void ble_hid_sent(struct bt_conn *conn, void *user_data)
+{
+	struct ble_slot *slot = slot_of(conn);
+	k_spinlock_key_t key;
+
+	if (slot == NULL) {
+		return;
+	}
+
+	if (IS_ENABLED(CONFIG_KEYPAD_BLE_ANCHOR_SYNC)) {
+		key = k_spin_lock(&lock);
+		slot_anchor_update(slot, anchor_now_us());
+		k_spin_unlock(&lock, key);
+	}
+
+	report_sched_sink_done(&slot->sink);
+}
+
+static void anchor_expired(struct k_timer *timer)
+{
+	atomic_set(&anchor_armed, 0);
+	report_sched_frame();
+}
+
+static void ble_hid_schedule(struct report_sink *sink)
+{
+	struct ble_slot *slot = CONTAINER_OF(sink, struct ble_slot, sink);
+	int64_t now = anchor_now_us();
+	int64_t interval;
+	int64_t wait = 0;
+	k_spinlock_key_t key;
+
+	if (!atomic_cas(&anchor_armed, 0, 1)) {
+		/* The wake already set takes this too */
+		return;
+	}
+
+	key = k_spin_lock(&lock);
+	interval = slot->interval * 1250;
+	if (slot->anchor_us != 0 && interval != 0 &&
+	    now - slot->anchor_seen_us <= BLE_HID_ANCHOR_STALE_US) {
+		wait = slot->anchor_us - BLE_HID_ANCHOR_LEAD_US - now;
+		wait = ((wait % interval) + interval) % interval;
+	}
+	k_spin_unlock(&lock, key);
+
+	if (wait == 0) {
+		/* Unknown or stale phase, the completion teaches it again */
+		atomic_set(&anchor_armed, 0);
+		report_sched_frame();
+		return;
+	}
+
+	k_timer_start(&anchor_timer, K_USEC(wait), K_NO_WAIT);
+}
+
+static uint32_t ble_hid_next_frame(struct report_sink *sink,
+				   uint32_t *period_us)
+{
+	struct ble_slot *slot = CONTAINER_OF(sink, struct ble_slot, sink);
+	int64_t now = anchor_now_us();
+	uint32_t next = UINT32_MAX;
+	int64_t interval;
+	int64_t wait;
+	k_spinlock_key_t key;
+
+	key = k_spin_lock(&lock);
+	interval = slot->interval * 1250;
+	if (slot->anchor_us != 0 && interval != 0 &&
+	    now - slot->anchor_seen_us <= BLE_HID_ANCHOR_STALE_US) {
+		wait = slot->anchor_us - now;
+		next = ((wait % interval) + interval) % interval;
+	}
+	k_spin_unlock(&lock, key);
+
+	*period_us = interval;
+
+	return next;
+}
+
+/* HIDS reports a CCCD write without its connection, check them all */
+static void subscriptions_update(void)
+{
+	const struct bt_gatt_attr *attr =
+		&hids.gp.svc.attrs[hids.inp_rep_group.reports[BLE_HID_INPUT_IDX]
+					   .att_ind];
+
+	for (size_t i = 0; i < BLE_HID_SLOTS; i++) {
+		struct bt_conn *conn = slot_conn_ref(&slots[i]);
+
+		atomic_set(&slots[i].subscribed,
+			   conn != NULL &&
+			   bt_gatt_is_subscribed(conn, attr, BT_GATT_CCC_NOTIFY));
+
+		if (conn != NULL) {
+			bt_conn_unref(conn);
+		}
+	}
+
+	if (IS_ENABLED(CONFIG_KEYPAD_BLE_RECONNECT) && slots_subscribed()) {
+		/* The keys held back go out to the host now */
+		k_work_cancel_delayable(&hold_work);
+		report_sched_hold(false);
+	}
+
+	/* The scheduler picks its link again */
+	report_sched_notify();
+}
+
+static void ble_hid_notify(enum bt_hids_notify_evt evt)
+{
+	subscriptions_update();
+}
+
+/* Take the next slot due a directed round, false if there is none */
+static bool directed_next(bt_addr_le_t *peer)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	/* The host typed to is called first */
+	size_t first = MAX(atomic_get(&target), 0);
+	bool found = false;
+
+	for (size_t n = 0; n < BLE_HID_SLOTS; n++) {
+		size_t i = (first + n) % BLE_HID_SLOTS;
+
+		if (!atomic_test_and_clear_bit(&directed_due, i) ||
+		    slots[i].conn != NULL || !slots[i].bonded) {
+			continue;
+		}
+
+		bt_addr_le_copy(peer, &slots[i].addr);
+		atomic_set(&directed, i);
+		found = true;
+		break;
+	}
+
+	k_spin_unlock(&lock, key);
+
+	return found;
+}
+
+static void ble_hid_advertise(struct k_work *work)
+{
+	bt_addr_le_t peer;
+	int ret;
+
+	if (slots_connected() == BLE_HID_SLOTS) {
+		/* Again once a host goes */
+		atomic_clear(&directed_due);
+		return;
+	}
+
+	if (atomic_get(&directed) >= 0) {
+		/* connected() submits us again once the round is over */
+		return;
+	}
+
+	while (directed_next(&peer)) {
+		/* The one advertising set, undirected has to make way */
+		(void)bt_le_adv_stop();
+
+		ret = bt_le_adv_start(BT_LE_ADV_CONN_DIR(&peer), NULL, 0,
+				      NULL, 0);
+		if (ret == 0) {
+			return;
+		}
+
+		LOG_WRN("Failed to start directed advertising, error: %d",
+			ret);
+		atomic_set(&directed, -1);
+	}
+
+	ret = bt_le_adv_start(BT_LE_ADV_CONN, ad, ARRAY_SIZE(ad), sd,
+			      ARRAY_SIZE(sd));
+	if (ret && ret != -EALREADY) {
+		LOG_ERR("Failed to start advertising, error: %d", ret);
+	}
+}
+
+static void ble_hid_param_update(struct ble_slot *slot,
+				 const struct bt_le_conn_param *param)
+{
+	struct bt_conn *conn = slot_conn_ref(slot);
+	int ret;
+
+	if (conn == NULL) {
+		return;
+	}
+
+	ret = bt_conn_le_param_update(conn, param);
+	if (ret) {
+		LOG_WRN("Failed to request connection parameters, error: %d",
+			ret);
+	}
+
+	bt_conn_unref(conn);
+}
+
+static void ble_hid_fast(struct k_work *work)
+{
+	struct ble_slot *slot = CONTAINER_OF(work, struct ble_slot, fast_work);
+
+	ble_hid_param_update(slot, BLE_HID_CONN_FAST);
+}
+
+static void ble_hid_idle(struct k_work *work)
+{
+	struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+	struct ble_slot *slot = CONTAINER_OF(dwork, struct ble_slot, idle_work);
+
+	if (!atomic_get(&slot->encrypted)) {
+		return;
+	}
+
+	atomic_set(&slot->idle_params, 1);
+	ble_hid_param_update(slot, BLE_HID_CONN_IDLE);
+}
+
+static void slot_activity(struct ble_slot *slot)
+{
+	if (!atomic_get(&slot->encrypted)) {
+		return;
+	}
+
+	/*
+	 * The first report does not wait for the update: peripheral
+	 * latency only lets the keypad skip events with nothing to send,
+	 * so it leaves at the next idle interval while the short one is
+	 * negotiated.
+	 */
+	if (atomic_cas(&slot->idle_params, 1, 0)) {
+		k_work_submit(&slot->fast_work);
+	}
+
+	k_work_reschedule(&slot->idle_work, K_MSEC(CONFIG_KEYPAD_BLE_IDLE_MS));
+}
+
+/* A directed round for every bonded host not connected */
+static void reconnect_start(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	atomic_val_t due = 0;
+
+	for (size_t i = 0; i < BLE_HID_SLOTS; i++) {
+		if (slots[i].bonded && slots[i].conn == NULL) {
+			due |= BIT(i);
+		}
+	}
+
+	k_spin_unlock(&lock, key);
+
+	if (due == 0) {
+		return;
+	}
+
+	atomic_or(&directed_due, due);
+	k_work_submit(&adv_work);
+
+	if (!slots_subscribed()) {
+		report_sched_hold(true);
+		k_work_reschedule(&hold_work, BLE_HID_HOLD);
+	}
+}
+
+static void ble_hid_reconnect(struct k_work *work)
+{
+	if (report_sink_select() != NULL || atomic_get(&directed) >= 0 ||
+	    atomic_get(&directed_due) != 0) {
+		/* A link is up, or the hosts are being called already */
+		return;
+	}
+
+	reconnect_start();
+}
+
+static void ble_hid_hold_expired(struct k_work *work)
+{
+	/* Nobody came back in time, the keys fold as without a link */
+	report_sched_hold(false);
+}
+
+void ble_hid_activity(void)
+{
+	atomic_val_t idx = atomic_get(&target);
+
+	if (atomic_get(&started) == 0) {
+		return;
+	}
+
+	if (IS_ENABLED(CONFIG_KEYPAD_BLE_RECONNECT) && !slots_subscribed()) {
+		/* Maybe a host that slept, it may be listening again */
+		k_work_submit(&reconnect_work);
+	}
+
+	if (idx >= 0) {
+		slot_activity(&slots[idx]);
+		return;
+	}
+
+	/* The one the scheduler picks among the BLE sinks */
+	for (size_t i = 0; i < BLE_HID_SLOTS; i++) {
+		if (atomic_get(&slots[i].subscribed)) {
+			slot_activity(&slots[i]);
+			return;
+		}
+	}
+}
+
+struct report_sink *ble_hid_sink_get(uint8_t slot)
+{
+	__ASSERT(slot < BLE_HID_SLOTS, "bad slot %u", slot);
+
+	return &slots[slot].sink;
+}
+
+void ble_hid_target_set(int slot)
+{
+	atomic_set(&target, slot);
+
+	/* Typing is about to move over, the others idle on their own */
+	ble_hid_activity();
+}
+
+static void connected(struct bt_conn *conn, uint8_t err)
+{
+	struct bt_conn_info info;
+	struct ble_slot *slot;
+	k_spinlock_key_t key;
+	int ret;
+
+	/* Whatever it was, a directed round is over */
+	atomic_set(&directed, -1);
+
+	if (err == BT_HCI_ERR_ADV_TIMEOUT) {
+		/* The host did not answer, on to the next one */
+		k_work_submit(&adv_work);
+		return;
+	}
+
+	if (err) {
+		LOG_WRN("Connection failed, error: %u", err);
+		k_work_submit(&adv_work);
+		return;
+	}
+
+	slot = slot_claim(conn);
+	if (slot == NULL) {
+		LOG_WRN("All host slots are bonded, disconnecting");
+		(void)bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+		return;
+	}
+
+	LOG_INF("Connected as %s", slot->sink.name);
+
+	/* le_param_updated() only reports the changes */
+	if (bt_conn_get_info(conn, &info) == 0) {
+		key = k_spin_lock(&lock);
+		slot->interval = info.le.interval;
+		slot->latency = info.le.latency;
+		slot->anchor_us = 0;
+		k_spin_unlock(&lock, key);
+	}
+
+	ret = bt_hids_connected(&hids, conn);
+	if (ret) {
+		LOG_ERR("Failed to notify HIDS of the connection, error: %d",
+			ret);
+	}
+
+	/* Reports need an encrypted link, don't wait for the host */
+	ret = bt_conn_set_security(conn, BT_SECURITY_L2);
+	if (ret) {
+		LOG_WRN("Failed to request security, error: %d", ret);
+	}
+
+	/* Room for the next host */
+	k_work_submit(&adv_work);
+}
+
+static void disconnected(struct bt_conn *conn, uint8_t reason)
+{
+	struct ble_slot *slot = slot_of(conn);
+	k_spinlock_key_t key;
+
+	if (slot == NULL) {
+		/* Turned away by connected() */
+		k_work_submit(&adv_work);
+		return;
+	}
+
+	LOG_INF("%s disconnected, reason 0x%02x", slot->sink.name, reason);
+
+	bt_hids_disconnected(&hids, conn);
+	atomic_set(&slot->subscribed, 0);
+	atomic_set(&slot->encrypted, 0);
+	atomic_set(&slot->idle_params, 0);
+	k_work_cancel_delayable(&slot->idle_work);
+
+	key = k_spin_lock(&lock);
+	bt_conn_unref(slot->conn);
+	slot->conn = NULL;
+	slot->anchor_us = 0;
+	k_spin_unlock(&lock, key);
+
+	report_sink_reset(&slot->sink);
+	report_sched_notify();
+
+	if (IS_ENABLED(CONFIG_KEYPAD_BLE_RECONNECT) && slot->bonded) {
+		reconnect_start();
+	} else {
+		k_work_submit(&adv_work);
+	}
+}
+
+static void security_changed(struct bt_conn *conn, bt_security_t level,
+			     enum bt_security_err err)
+{
+	struct ble_slot *slot = slot_of(conn);
+
+	if (slot == NULL) {
+		return;
+	}
+
+	if (err || level < BT_SECURITY_L2) {
+		LOG_WRN("Security failed, level %u, error: %d", level, err);
+		return;
+	}
+
+	/* Restored subscriptions of a bonded host show up now */
+	subscriptions_update();
+
+	/*
+	 * Hosts often turn down parameter updates before bonding, ask
+	 * once the link is encrypted. The user is about to type.
+	 */
+	atomic_set(&slot->encrypted, 1);
+	slot_activity(slot);
+	k_work_submit(&slot->fast_work);
+
+	/* A host that was just tapped takes the reports */
+	nfc_pair_secured(slot - slots);
+}
+
+static void le_param_updated(struct bt_conn *conn, uint16_t interval,
+			     uint16_t latency, uint16_t timeout)
+{
+	struct ble_slot *slot = slot_of(conn);
+	k_spinlock_key_t key;
+
+	if (slot == NULL) {
+		return;
+	}
+
+	key = k_spin_lock(&lock);
+	slot->interval = interval;
+	slot->latency = latency;
+	/* The events moved */
+	slot->anchor_us = 0;
+	k_spin_unlock(&lock, key);
+
+	LOG_INF("%s interval %u.%02u ms, latency %u", slot->sink.name,
+		interval * 125 / 100, interval * 125 % 100, latency);
+}
+
+BT_CONN_CB_DEFINE(conn_callbacks) = {
+	.connected = connected,
+	.disconnected = disconnected,
+	.security_changed = security_changed,
+	.le_param_updated = le_param_updated,
+};
+
+static void pairing_complete(struct bt_conn *conn, bool bonded)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	for (size_t i = 0; i < BLE_HID_SLOTS; i++) {
+		if (slots[i].conn == conn) {
+			/* The identity address, now that it is resolved */
+			bt_addr_le_copy(&slots[i].addr, bt_conn_get_dst(conn));
+			slots[i].bonded = bonded;
+		}
+	}
+
+	k_spin_unlock(&lock, key);
+}
+
+static void bond_deleted(uint8_t id, const bt_addr_le_t *peer)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	for (size_t i = 0; i < BLE_HID_SLOTS; i++) {
+		if (bt_addr_le_cmp(&slots[i].addr, peer) == 0) {
+			slots[i].bonded = false;
+		}
+	}
+
+	k_spin_unlock(&lock, key);
+}
+
+static struct bt_conn_auth_info_cb auth_info_callbacks = {
+	.pairing_complete = pairing_complete,
+	.bond_deleted = bond_deleted,
+};
+
+/* Bonds loaded from settings take the slots in storage order */
+static void bond_load(const struct bt_bond_info *info, void *user_data)
+{
+	for (size_t i = 0; i < BLE_HID_SLOTS; i++) {
+		if (!slots[i].bonded) {
+			bt_addr_le_copy(&slots[i].addr, &info->addr);
+			slots[i].bonded = true;
+			return;
+		}
+	}
+
+	LOG_WRN("More bonds than host slots");
+}
+
+static int ble_hid_service_init(void)
+{
+	struct bt_hids_init_param param = { 0 };
+	struct bt_hids_inp_rep *rep = &param.inp_rep_group_init.reports[0];
+	size_t map_size;
+
+	param.rep_map.data = report_desc_get(&map_size);
+	param.rep_map.size = map_size;
+
+	param.info.bcd_hid = BLE_HID_VERSION;
+	param.info.b_country_code = 0;
+	param.info.flags = BT_HIDS_REMOTE_WAKE | BT_HIDS_NORMALLY_CONNECTABLE;
+
+	/* No report ID, the map has only the one input report */
+	rep->size = REPORT_SIZE;
+	rep->id = 0;
+	rep->handler = ble_hid_notify;
+	param.inp_rep_group_init.cnt = 1;
+
+	return bt_hids_init(&hids, &param);
+}
+
+int ble_hid_init(void)
+{
+	struct deep_sleep_state kept;
+	int ret;
+
+	k_work_init(&adv_work, ble_hid_advertise);
+	k_work_init(&reconnect_work, ble_hid_reconnect);
+	k_work_init_delayable(&hold_work, ble_hid_hold_expired);
+	k_timer_init(&anchor_timer, anchor_expired, NULL);
+
+	for (size_t i = 0; i < BLE_HID_SLOTS; i++) {
+		struct ble_slot *slot = &slots[i];
+
+		slot->sink.name = slot_names[i];
+		/* Fallback once the cable is gone, the first host first */
+		slot->sink.priority = 1 + i;
+		slot->sink.depth = CONFIG_KEYPAD_BLE_TX_DEPTH;
+		slot->sink.write = ble_hid_write;
+		slot->sink.active = ble_hid_active;
+		if (IS_ENABLED(CONFIG_KEYPAD_BLE_ANCHOR_SYNC)) {
+			slot->sink.schedule = ble_hid_schedule;
+			slot->sink.next_frame = ble_hid_next_frame;
+		}
+		k_work_init(&slot->fast_work, ble_hid_fast);
+		k_work_init_delayable(&slot->idle_work, ble_hid_idle);
+	}
+
+	ret = ble_hid_service_init();
+	if (ret) {
+		LOG_ERR("Failed to init HIDS, error: %d", ret);
+		return ret;
+	}
+
+	ret = bt_conn_auth_info_cb_register(&auth_info_callbacks);
+	if (ret) {
+		LOG_ERR("Failed to register pairing callbacks, error: %d", ret);
+		return ret;
+	}
+
+	ret = bt_enable(NULL);
+	if (ret) {
+		LOG_ERR("Failed to enable Bluetooth, error: %d", ret);
+		return ret;
+	}
+
+	if (IS_ENABLED(CONFIG_SETTINGS)) {
+		/* Bonds */
+		settings_load();
+	}
+
+	bt_foreach_bond(BT_ID_DEFAULT, bond_load, NULL);
+
+	ret = nfc_pair_init();
+	if (ret) {
+		/* Pairing from the host's own menu still works */
+		LOG_WRN("No NFC pairing, error: %d", ret);
+	}
+
+	for (size_t i = 0; i < BLE_HID_SLOTS; i++) {
+		report_sink_register(&slots[i].sink);
+	}
+
+	if (deep_sleep_state_get(&kept) == 0 && kept.host > 0) {
+		/* Before the round starts, host_select() only follows later */
+		atomic_set(&target, kept.host - 1);
+	}
+
+	if (IS_ENABLED(CONFIG_KEYPAD_BLE_RECONNECT)) {
+		/* The keypad was off, its hosts may be waiting */
+		reconnect_start();
+	}
+
+	atomic_set(&started, 1);
+	k_work_submit(&adv_work);
+
+	return 0;
+}
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static int cmd_ble_show(const struct shell *sh, size_t argc, char **argv)
+{
+	for (size_t i = 0; i < BLE_HID_SLOTS; i++) {
+		struct ble_slot *slot = &slots[i];
+		char addr[BT_ADDR_LE_STR_LEN];
+
+		bt_addr_le_to_str(&slot->addr, addr, sizeof(addr));
+
+		if (slot->conn == NULL) {
+			shell_print(sh, "%s: %s, not connected", slot->sink.name,
+				    slot->bonded ? addr : "no bond");
+			continue;
+		}
+
+		shell_print(sh, "%s: %s, interval %u.%02u ms, latency %u, "
+			    "%s parameters", slot->sink.name, addr,
+			    slot->interval * 125 / 100,
+			    slot->interval * 125 % 100, slot->latency,
+			    atomic_get(&slot->idle_params) ? "idle" : "typing");
+
+		if (IS_ENABLED(CONFIG_KEYPAD_BLE_ANCHOR_SYNC) &&
+		    slot->anchor_us != 0 && slot->interval != 0) {
+			shell_print(sh, "  event phase %u us, seen %u ms ago",
+				    (uint32_t)(slot->anchor_us %
+					       (slot->interval * 1250)),
+				    (uint32_t)((anchor_now_us() -
+						slot->anchor_seen_us) /
+					       USEC_PER_MSEC));
+		}
+	}
+
+	if (atomic_get(&directed) >= 0) {
+		shell_print(sh, "directed advertising to %s",
+			    slot_names[atomic_get(&directed)]);
+	}
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_ble,
+	SHELL_CMD(show, NULL, "Print the hosts and connection parameters",
+		  cmd_ble_show),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(ble, &sub_ble, "BLE HID link", NULL);
+#endif /* CONFIG_SHELL */
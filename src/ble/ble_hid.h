@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * BLE HID over GATT keyboard, a report sink next to USB. The host runs
+ * on the application core, the controller is the hci_rpmsg image on
+ * the network core (child_image/hci_rpmsg.conf). While keys are in
+ * use the keypad asks for a 7.5 ms connection interval without
+ * peripheral latency; after CONFIG_KEYPAD_BLE_IDLE_MS without a key it
+ * moves to a long interval with high peripheral latency, and the next
+ * key asks for the short one again. Up to CONFIG_KEYPAD_BLE_TX_DEPTH
+ * reports are handed to the controller at once, so the reports of a
+ * chord leave in one connection event.
+ *
+ * Up to CONFIG_KEYPAD_BLE_HOSTS bonded hosts are connected at once,
+ * each in a slot with its own sink, "ble1" to "ble3".
+ *
+ * BLE hosts get the report protocol only, there is no boot keyboard
+ * characteristic.
+ *
+ * Build with overlay-ble.conf. Compiles to nothing unless
+ * CONFIG_KEYPAD_BLE is enabled.
+ */
+
+#ifndef KEYPAD_BLE_BLE_HID_H_
+#define KEYPAD_BLE_BLE_HID_H_
+
+#include <zephyr/zephyr.h>
+
+#include "report_sink.h"
+
+#if defined(CONFIG_KEYPAD_BLE)
+
+#define BLE_HID_SLOTS CONFIG_KEYPAD_BLE_HOSTS
+
+/* Register the sinks and start advertising */
+int ble_hid_init(void);
+
+/* Key activity seen, ISR safe */
+void ble_hid_activity(void);
+
+/* Sink of host slot, 0 to BLE_HID_SLOTS - 1 */
+struct report_sink *ble_hid_sink_get(uint8_t slot);
+
+/*
+ * Slot the key activity is for, its link moves to the typing
+ * parameters. -1 for whichever the scheduler picks.
+ */
+void ble_hid_target_set(int slot);
+
+#else
+
+#define BLE_HID_SLOTS 0
+
+static inline int ble_hid_init(void)
+{
+	return 0;
+}
+
+static inline void ble_hid_activity(void) {}
+
+static inline struct report_sink *ble_hid_sink_get(uint8_t slot)
+{
+	return NULL;
+}
+
+static inline void ble_hid_target_set(int slot) {}
+
+#endif /* CONFIG_KEYPAD_BLE */
+
+#endif /* KEYPAD_BLE_BLE_HID_H_ */
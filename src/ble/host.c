@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * The switch pins the report scheduler to the slot's sink, which
+ * sends the old host a report with everything released and the new
+ * one the keys held now. The first report to a BLE host that was idle
+ * leaves at its next idle connection event, 30 ms by default, while
+ * the typing parameters are negotiated.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/logging/log.h>
+
+#include "layer.h"
+#include "report_sched.h"
+#include "report_sink.h"
+#include "ble/ble_hid.h"
+#include "ble/host.h"
+
+LOG_MODULE_REGISTER(host, LOG_LEVEL_INF);
+
+/* Only the report thread switches */
+static uint8_t current;
+/* Toggled layers of every slot, the live ones for the current slot */
+static uint32_t toggled[HOST_SLOTS];
+static uint32_t switches;
+/* Slot asked for by host_request(), -1 for none */
+static atomic_t requested = ATOMIC_INIT(-1);
+
+int host_select(uint8_t slot)
+{
+	if (slot >= HOST_SLOTS) {
+		return -EINVAL;
+	}
+
+	if (slot == current) {
+		return 0;
+	}
+
+	toggled[current] = layer_toggled_get();
+	layer_toggled_set(toggled[slot]);
+	current = slot;
+	switches++;
+
+	if (slot == 0) {
+		report_sink_prefer(NULL);
+		ble_hid_target_set(-1);
+	} else {
+		report_sink_prefer(ble_hid_sink_get(slot - 1));
+		ble_hid_target_set(slot - 1);
+	}
+
+	LOG_INF("Host %u", slot);
+
+	/* Picked up at the start of the next pass */
+	report_sched_notify();
+
+	return 0;
+}
+
+uint8_t host_current(void)
+{
+	return current;
+}
+
+void host_request(uint8_t slot)
+{
+	atomic_set(&requested, slot);
+	report_sched_notify();
+}
+
+void host_frame(void)
+{
+	atomic_val_t slot = atomic_set(&requested, -1);
+
+	if (slot >= 0) {
+		(void)host_select(slot);
+	}
+}
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static int cmd_host_show(const struct shell *sh, size_t argc, char **argv)
+{
+	shell_print(sh, "host %u of %u, %u switches", current, HOST_SLOTS,
+		    switches);
+
+	for (uint8_t i = 0; i < HOST_SLOTS; i++) {
+		struct report_sink *sink =
+			i == 0 ? NULL : ble_hid_sink_get(i - 1);
+
+		shell_print(sh, "%c%u: %s, toggled 0x%08x",
+			    i == current ? '*' : ' ', i,
+			    sink != NULL ? sink->name : "usb",
+			    i == current ? layer_toggled_get() : toggled[i]);
+	}
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_host,
+	SHELL_CMD(show, NULL, "Print the host slots", cmd_host_show),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(host, &sub_host, "Host slots", NULL);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Host slots. Slot 0 is the USB host, with the BLE fallback of the
+ * sink priorities; slots 1 to CONFIG_KEYPAD_BLE_HOSTS are the BLE
+ * bonds, each kept connected. A LAYER_HOST() key moves the reports to
+ * another slot and swaps in that host's toggled layers, all in RAM:
+ * no link is brought up or down, nothing is read from flash.
+ */
+
+#ifndef KEYPAD_BLE_HOST_H_
+#define KEYPAD_BLE_HOST_H_
+
+#include <zephyr/zephyr.h>
+
+#if defined(CONFIG_KEYPAD_HOSTS)
+
+#define HOST_SLOTS (1 + CONFIG_KEYPAD_BLE_HOSTS)
+
+/*
+ * Send reports to slot from the next scheduler pass. From the report
+ * thread, like the layer keys. A BLE slot whose host is not connected
+ * takes the reports anyway: they stay staged until it is back.
+ */
+int host_select(uint8_t slot);
+
+uint8_t host_current(void);
+
+/*
+ * Ask for slot from any other context, the report thread switches at
+ * its next pass. The last request wins.
+ */
+void host_request(uint8_t slot);
+
+/* Report thread, once per pass: take a request */
+void host_frame(void);
+
+#else
+
+#define HOST_SLOTS 1
+
+static inline int host_select(uint8_t slot)
+{
+	return slot == 0 ? 0 : -EINVAL;
+}
+
+static inline uint8_t host_current(void)
+{
+	return 0;
+}
+
+static inline void host_request(uint8_t slot) {}
+static inline void host_frame(void) {}
+
+#endif /* CONFIG_KEYPAD_HOSTS */
+
+#endif /* KEYPAD_BLE_HOST_H_ */
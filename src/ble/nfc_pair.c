@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * The OOB data comes from bt_le_oob_get_local() and is kept for the
+ * pairing it is read for: the host stack asks for it back in
+ * oob_data_request(), and the peer's confirm value only checks out
+ * against the random value that was on the tag. The tag can only be
+ * rewritten with the emulation stopped, so the new data after a
+ * pairing is written from the system work queue, not from the
+ * Bluetooth callbacks. The tag callbacks come from the NFCT interrupt
+ * and only take the time of the tap.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/conn.h>
+#include <nfc_t2t_lib.h>
+#include <nfc/ndef/msg.h>
+#include <nfc/ndef/le_oob_rec.h>
+
+#include "ble/ble_hid.h"
+#include "ble/host.h"
+#include "ble/nfc_pair.h"
+
+LOG_MODULE_REGISTER(nfc_pair, LOG_LEVEL_INF);
+
+/* One LE OOB record with the name, well within a Type 2 tag */
+#define NDEF_MSG_SIZE 128
+
+static struct bt_le_oob oob_local;
+static uint8_t ndef_msg[NDEF_MSG_SIZE];
+static size_t ndef_len;
+static struct k_work refresh_work;
+
+/* A tap not yet claimed by a host, and when it was */
+static atomic_t tapped;
+static uint32_t tap_time;
+static uint32_t taps;
+static uint32_t claims;
+
+static int tag_encode(void)
+{
+	struct nfc_ndef_le_oob_rec_payload_desc payload = {
+		.addr = &oob_local.addr,
+		.le_sc_data = &oob_local.le_sc_data,
+		.local_name = bt_get_name(),
+		.le_role = NFC_NDEF_LE_OOB_REC_LE_ROLE(
+			NFC_NDEF_LE_OOB_REC_LE_ROLE_PERIPH_ONLY),
+		.appearance = NFC_NDEF_LE_OOB_REC_APPEARANCE(
+			CONFIG_BT_DEVICE_APPEARANCE),
+		.flags = NFC_NDEF_LE_OOB_REC_FLAGS(
+			BT_LE_AD_GENERAL | BT_LE_AD_NO_BREDR),
+	};
+	uint32_t len = sizeof(ndef_msg);
+	int ret;
+
+	NFC_NDEF_LE_OOB_RECORD_DESC_DEF(oob_rec, '0', &payload);
+	NFC_NDEF_MSG_DEF(oob_msg, 1);
+
+	ret = nfc_ndef_msg_record_add(&NFC_NDEF_MSG(oob_msg),
+				      &NFC_NDEF_LE_OOB_RECORD_DESC(oob_rec));
+	if (ret) {
+		return ret;
+	}
+
+	ret = nfc_ndef_msg_encode(&NFC_NDEF_MSG(oob_msg), ndef_msg, &len);
+	if (ret) {
+		return ret;
+	}
+
+	ndef_len = len;
+
+	return 0;
+}
+
+/* Fresh OOB data onto the tag */
+static int tag_write(bool running)
+{
+	int ret;
+
+	ret = bt_le_oob_get_local(BT_ID_DEFAULT, &oob_local);
+	if (ret) {
+		return ret;
+	}
+
+	ret = tag_encode();
+	if (ret) {
+		return ret;
+	}
+
+	if (running) {
+		(void)nfc_t2t_emulation_stop();
+	}
+
+	ret = nfc_t2t_payload_set(ndef_msg, ndef_len);
+	if (ret) {
+		return ret;
+	}
+
+	return nfc_t2t_emulation_start();
+}
+
+static void tag_refresh(struct k_work *work)
+{
+	int ret = tag_write(true);
+
+	if (ret) {
+		LOG_ERR("Failed to write the tag, error: %d", ret);
+	}
+}
+
+static void nfc_callback(void *context, nfc_t2t_event_t event,
+			 const uint8_t *data, size_t data_length)
+{
+	if (event != NFC_T2T_EVENT_FIELD_ON) {
+		return;
+	}
+
+	tap_time = k_uptime_get_32();
+	atomic_set(&tapped, 1);
+	taps++;
+
+	/* Links idling at the long interval come back for the host */
+	ble_hid_activity();
+}
+
+void nfc_pair_secured(uint8_t slot)
+{
+	if (!atomic_get(&tapped) ||
+	    k_uptime_get_32() - tap_time >= CONFIG_KEYPAD_NFC_PAIR_CLAIM_MS) {
+		return;
+	}
+
+	atomic_clear(&tapped);
+	claims++;
+	LOG_INF("Tapped host on slot %u", slot + 1);
+
+	/* Slot 0 is the USB host */
+	host_request(slot + 1);
+}
+
+static void oob_data_request(struct bt_conn *conn,
+			     struct bt_conn_oob_info *info)
+{
+	int ret;
+
+	if (info->type != BT_CONN_OOB_LE_SC) {
+		/* The tag carries no legacy TK */
+		(void)bt_conn_auth_cancel(conn);
+		return;
+	}
+
+	/* Only the peer has read anything, there is no remote data */
+	ret = bt_le_oob_set_sc_data(conn, &oob_local.le_sc_data, NULL);
+	if (ret) {
+		LOG_WRN("Failed to set the OOB data, error: %d", ret);
+		(void)bt_conn_auth_cancel(conn);
+	}
+}
+
+static void pairing_done(struct bt_conn *conn, bool bonded)
+{
+	/* Used up, the next host gets new values */
+	k_work_submit(&refresh_work);
+}
+
+static void pairing_failed(struct bt_conn *conn,
+			   enum bt_security_err reason)
+{
+	k_work_submit(&refresh_work);
+}
+
+static struct bt_conn_auth_cb auth_callbacks = {
+	.oob_data_request = oob_data_request,
+};
+
+static struct bt_conn_auth_info_cb auth_info_callbacks = {
+	.pairing_complete = pairing_done,
+	.pairing_failed = pairing_failed,
+};
+
+int nfc_pair_init(void)
+{
+	int ret;
+
+	k_work_init(&refresh_work, tag_refresh);
+
+	ret = bt_conn_auth_cb_register(&auth_callbacks);
+	if (ret) {
+		LOG_ERR("Failed to register OOB callbacks, error: %d", ret);
+		return ret;
+	}
+
+	ret = bt_conn_auth_info_cb_register(&auth_info_callbacks);
+	if (ret) {
+		LOG_ERR("Failed to register pairing callbacks, error: %d", ret);
+		return ret;
+	}
+
+	ret = nfc_t2t_setup(nfc_callback, NULL);
+	if (ret) {
+		LOG_ERR("Failed to set up the NFC tag, error: %d", ret);
+		return ret;
+	}
+
+	ret = tag_write(false);
+	if (ret) {
+		LOG_ERR("Failed to write the tag, error: %d", ret);
+		return ret;
+	}
+
+	LOG_INF("NFC tag ready, %u bytes", ndef_len);
+
+	return 0;
+}
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static int cmd_nfc_show(const struct shell *sh, size_t argc, char **argv)
+{
+	shell_print(sh, "tag: %u bytes, taps: %u, hosts switched: %u",
+		    ndef_len, taps, claims);
+	shell_print(sh, "claim open: %s", atomic_get(&tapped) &&
+		    k_uptime_get_32() - tap_time <
+		    CONFIG_KEYPAD_NFC_PAIR_CLAIM_MS ? "yes" : "no");
+
+	return 0;
+}
+
+static int cmd_nfc_refresh(const struct shell *sh, size_t argc,
+			   char **argv)
+{
+	/* Never while the work queue writes it */
+	k_work_submit(&refresh_work);
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_nfc,
+	SHELL_CMD(show, NULL, "Print the tap-to-pair state", cmd_nfc_show),
+	SHELL_CMD(refresh, NULL, "Put new OOB data on the tag",
+		  cmd_nfc_refresh),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(nfc, &sub_nfc, "NFC tap-to-pair", NULL);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * NFC tap-to-pair. The NFCT peripheral emulates a Type 2 tag holding
+ * one NDEF record, the Bluetooth LE OOB data of the keypad: its
+ * address, role, name and appearance and the LE Secure Connections
+ * confirm and random values. A phone or host that reads it connects
+ * and pairs with that data, no menu to go through and no passkey, and
+ * the values are made anew after every pairing. The host that secures
+ * a link within CONFIG_KEYPAD_NFC_PAIR_CLAIM_MS of a tap, a new one or
+ * a bonded one coming back, is switched to: at a shared desk the tap
+ * is the host switch too.
+ *
+ * Build with overlay-nfc.conf on top of overlay-ble.conf. Compiles to
+ * nothing unless CONFIG_KEYPAD_NFC_PAIR is enabled.
+ */
+
+#ifndef KEYPAD_BLE_NFC_PAIR_H_
+#define KEYPAD_BLE_NFC_PAIR_H_
+
+#include <zephyr/zephyr.h>
+
+#if defined(CONFIG_KEYPAD_NFC_PAIR)
+
+/* Write the tag and start the emulation, after bt_enable() */
+int nfc_pair_init(void);
+
+/* The link of BLE slot came up encrypted, from ble_hid.c */
+void nfc_pair_secured(uint8_t slot);
+
+#else
+
+static inline int nfc_pair_init(void)
+{
+	return 0;
+}
+
+static inline void nfc_pair_secured(uint8_t slot) {}
+
+#endif /* CONFIG_KEYPAD_NFC_PAIR */
+
+#endif /* KEYPAD_BLE_NFC_PAIR_H_ */
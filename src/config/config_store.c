@@ -0,0 +1,471 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * NVMC writes and erases stall the CPU, so the store writes only when
+ * nobody is typing: the flush waits for CONFIG_KEYPAD_CONFIG_STORE_DELAY_MS
+ * after the first change, to gather the rest of an edit, and then for
+ * the keys to be quiet. It runs as a background job, at the lowest
+ * application priority, so the scan and report threads preempt it
+ * between two flash operations, and the job starts in a gap between
+ * two frames of the link. A suspend flushes at once: nobody types on a
+ * suspended bus, and the state is kept if power goes next.
+ *
+ * The CRC of the stored value is kept per entry, so the store knows
+ * without reading flash back whether a change undid itself. NVS values
+ * carry it as a le32 trailer and tables of CONFIG_KEYPAD_CONFIG_XIP
+ * entries in their index. Loading checks it: a value that fails is
+ * never applied, the entry keeps its defaults and is stored anew on
+ * the next change. One CRC pass over a keymap or a macro table takes
+ * well under a millisecond of boot time.
+ *
+ * The CONFIG_KEYPAD_CONFIG_XIP tables that changed are written together
+ * into one new slot of the partition, committed by its header, so a
+ * profile upload that changes the keymap and the macros is never
+ * stored half way.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/crc.h>
+#include <zephyr/sys/slist.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/settings/settings.h>
+
+#include "bg_sched.h"
+#include "suspend.h"
+#include "config/config_store.h"
+#include "config/config_xip.h"
+#include "diag/upload_bench.h"
+#include "timebase.h"
+
+LOG_MODULE_REGISTER(config_store, LOG_LEVEL_INF);
+
+#define CONFIG_WEAR_NAME "keypad/wear"
+/* le32 CRC32 after every NVS value */
+#define CRC_SIZE 4
+
+/* Lifetime counters, stored with every flush that writes */
+struct config_wear {
+	uint32_t writes;
+	uint32_t bytes;
+	uint32_t flushes;
+};
+
+static sys_slist_t entries = SYS_SLIST_STATIC_INIT(&entries);
+
+#define DELAY_US (CONFIG_KEYPAD_CONFIG_STORE_DELAY_MS * USEC_PER_MSEC)
+#define IDLE_US (CONFIG_KEYPAD_CONFIG_STORE_IDLE_MS * USEC_PER_MSEC)
+
+static void store_flush(struct bg_job *job);
+
+static struct bg_job store_job = {
+	.name = "config_store",
+	.run = store_flush,
+};
+static bool started;
+
+/*
+ * Staging for one value and its CRC, only touched by the store's
+ * thread and init. Word aligned, entries may read their value in place.
+ */
+static uint8_t buf[CONFIG_KEYPAD_CONFIG_STORE_MAX_SIZE + CRC_SIZE] __aligned(4);
+
+static atomic_t last_activity;
+/* Flush without waiting for the keys */
+static atomic_t flush_now;
+
+static struct k_spinlock lock;
+static struct config_wear wear;
+static struct config_store_stats stats;
+
+static int entry_load(const char *key, size_t len, settings_read_cb read_cb,
+		      void *cb_arg, void *param)
+{
+	struct config_entry *entry = param;
+	uint32_t crc;
+	ssize_t ret;
+
+	if (key != NULL) {
+		/* Below the entry's name, not its value */
+		return 0;
+	}
+
+	if (len > sizeof(buf) || len < CRC_SIZE) {
+		LOG_WRN("%s: stored value of %u bytes ignored", entry->name,
+			len);
+		return 0;
+	}
+
+	ret = read_cb(cb_arg, buf, len);
+	if (ret < 0) {
+		return ret;
+	}
+
+	len = MAX(ret, CRC_SIZE) - CRC_SIZE;
+	crc = sys_get_le32(&buf[len]);
+	if (ret < CRC_SIZE || crc32_ieee(buf, len) != crc) {
+		LOG_ERR("%s: stored value corrupt, using defaults",
+			entry->name);
+		stats.corrupt++;
+		return 0;
+	}
+
+	ret = entry->set(buf, len);
+	if (ret < 0) {
+		/* A value this firmware won't take, e.g. another key count */
+		LOG_WRN("%s: stored value ignored, error: %d", entry->name,
+			(int)ret);
+		return 0;
+	}
+
+	entry->crc = crc;
+
+	return 0;
+}
+
+static int xip_load(struct config_entry *entry)
+{
+	const void *data;
+	uint32_t crc;
+	size_t len;
+	int ret;
+
+	data = config_xip_get(entry->xip, &len, &crc);
+	if (data == NULL) {
+		return 0;
+	}
+
+	if (crc32_ieee(data, len) != crc) {
+		LOG_ERR("%s: stored table corrupt, using defaults",
+			entry->name);
+		stats.corrupt++;
+		return 0;
+	}
+
+	ret = entry->set(data, len);
+	if (ret < 0) {
+		LOG_WRN("%s: stored table ignored, error: %d", entry->name,
+			ret);
+		return 0;
+	}
+
+	entry->crc = crc;
+
+	return 0;
+}
+
+static int wear_load(const char *key, size_t len, settings_read_cb read_cb,
+		     void *cb_arg, void *param)
+{
+	if (key != NULL || len != sizeof(wear)) {
+		return 0;
+	}
+
+	return MIN(read_cb(cb_arg, &wear, sizeof(wear)), 0);
+}
+
+static bool keys_quiet(void)
+{
+	return k_uptime_get_32() - (uint32_t)atomic_get(&last_activity) >=
+	       CONFIG_KEYPAD_CONFIG_STORE_IDLE_MS;
+}
+
+/*
+ * Copy the value of entry into buf and its CRC into crc. Returns the
+ * length, or a negative errno if there is nothing to write.
+ */
+static ssize_t entry_value(struct config_entry *entry, uint32_t *crc)
+{
+	ssize_t len;
+
+	len = entry->get(buf, CONFIG_KEYPAD_CONFIG_STORE_MAX_SIZE);
+	if (len < 0) {
+		LOG_ERR("%s: no value to store, error: %d", entry->name,
+			(int)len);
+		return len;
+	}
+
+	*crc = crc32_ieee(buf, len);
+	if (*crc == entry->crc) {
+		stats.unchanged++;
+		return -EALREADY;
+	}
+
+	return len;
+}
+
+static void entry_written(struct config_entry *entry, uint32_t crc,
+			  size_t len)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	entry->crc = crc;
+	entry->writes++;
+	wear.writes++;
+	wear.bytes += len;
+	k_spin_unlock(&lock, key);
+}
+
+static void entry_failed(struct config_entry *entry, int err)
+{
+	LOG_ERR("%s: write failed, error: %d", entry->name, err);
+	atomic_set(&entry->dirty, 1);
+	stats.errors++;
+}
+
+static bool entry_flush(struct config_entry *entry)
+{
+	ssize_t len;
+	uint32_t crc;
+	int ret;
+
+	len = entry_value(entry, &crc);
+	if (len < 0) {
+		return false;
+	}
+
+	sys_put_le32(crc, &buf[len]);
+	ret = settings_save_one(entry->name, buf, len + CRC_SIZE);
+	if (ret < 0) {
+		entry_failed(entry, ret);
+		return false;
+	}
+
+	entry_written(entry, crc, len);
+
+	return true;
+}
+
+/*
+ * Every changed table goes into one new slot, made current by a single
+ * commit, so they are all stored or none is.
+ */
+static bool xip_flush(void)
+{
+	struct config_entry *entry;
+	bool begun = false;
+	ssize_t len;
+	uint32_t crc;
+	int ret = 0;
+
+	SYS_SLIST_FOR_EACH_CONTAINER(&entries, entry, node) {
+		entry->staged = false;
+		if (entry->xip == 0 || !atomic_cas(&entry->dirty, 1, 0)) {
+			continue;
+		}
+
+		len = entry_value(entry, &crc);
+		if (len < 0) {
+			continue;
+		}
+
+		if (!begun) {
+			ret = config_xip_begin();
+			if (ret < 0) {
+				entry_failed(entry, ret);
+				break;
+			}
+			begun = true;
+		}
+
+		ret = config_xip_put(entry->xip, buf, len, crc);
+		if (ret < 0) {
+			config_xip_abort();
+			entry_failed(entry, ret);
+			break;
+		}
+
+		entry->staged = true;
+		entry->staged_crc = crc;
+		entry->staged_len = len;
+	}
+
+	if (begun && ret == 0) {
+		ret = config_xip_commit();
+	}
+
+	SYS_SLIST_FOR_EACH_CONTAINER(&entries, entry, node) {
+		if (!entry->staged) {
+			continue;
+		}
+
+		entry->staged = false;
+		if (ret < 0) {
+			entry_failed(entry, ret);
+		} else {
+			entry_written(entry, entry->staged_crc,
+				      entry->staged_len);
+		}
+	}
+
+	return begun && ret == 0;
+}
+
+static void store_flush(struct bg_job *job)
+{
+	struct config_entry *entry;
+	struct config_wear record;
+	k_spinlock_key_t key;
+	bool wrote = false;
+	uint32_t start;
+	int ret;
+
+	if (!atomic_cas(&flush_now, 1, 0) && !keys_quiet()) {
+		stats.deferred++;
+		bg_sched_submit(&store_job, IDLE_US, 2 * IDLE_US);
+		return;
+	}
+
+	start = timebase_now32();
+
+	SYS_SLIST_FOR_EACH_CONTAINER(&entries, entry, node) {
+		if (entry->xip == 0 && atomic_cas(&entry->dirty, 1, 0)) {
+			wrote |= entry_flush(entry);
+		}
+	}
+
+	if (IS_ENABLED(CONFIG_KEYPAD_CONFIG_XIP)) {
+		wrote |= xip_flush();
+	}
+
+	if (!wrote) {
+		return;
+	}
+
+	key = k_spin_lock(&lock);
+	wear.flushes++;
+	record = wear;
+	k_spin_unlock(&lock, key);
+
+	ret = settings_save_one(CONFIG_WEAR_NAME, &record, sizeof(record));
+	if (ret < 0) {
+		stats.errors++;
+	}
+
+	upload_bench_add(UPLOAD_BENCH_STORE, start);
+}
+
+static void store_suspend(bool suspended)
+{
+	if (suspended) {
+		config_store_flush();
+	}
+}
+
+static struct suspend_listener listener = {
+	.changed = store_suspend,
+};
+
+static int store_start(void)
+{
+	int ret;
+
+	ret = settings_subsys_init();
+	if (ret < 0) {
+		LOG_ERR("Failed to init settings, error: %d", ret);
+		return ret;
+	}
+
+	(void)settings_load_subtree_direct(CONFIG_WEAR_NAME, wear_load, NULL);
+
+	suspend_listener_register(&listener);
+	started = true;
+
+	return 0;
+}
+
+int config_store_register(struct config_entry *entry)
+{
+	int ret;
+
+	if (!started) {
+		ret = store_start();
+		if (ret < 0) {
+			return ret;
+		}
+	}
+
+	atomic_clear(&entry->dirty);
+	sys_slist_append(&entries, &entry->node);
+
+	if (entry->xip != 0) {
+		return xip_load(entry);
+	}
+
+	return settings_load_subtree_direct(entry->name, entry_load, entry);
+}
+
+void config_store_changed(struct config_entry *entry)
+{
+	atomic_set(&entry->dirty, 1);
+
+	/* From the first change, so a busy editor cannot hold it off */
+	bg_sched_submit(&store_job, DELAY_US, DELAY_US + IDLE_US);
+}
+
+void config_store_activity(void)
+{
+	atomic_set(&last_activity, k_uptime_get_32());
+}
+
+void config_store_flush(void)
+{
+	atomic_set(&flush_now, 1);
+	bg_sched_submit(&store_job, 0, 0);
+}
+
+void config_store_stats_get(struct config_store_stats *out)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	*out = stats;
+	out->writes = wear.writes;
+	out->bytes = wear.bytes;
+	out->flushes = wear.flushes;
+	k_spin_unlock(&lock, key);
+}
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static int cmd_config_show(const struct shell *sh, size_t argc, char **argv)
+{
+	struct config_store_stats s;
+	struct config_entry *entry;
+
+	config_store_stats_get(&s);
+
+	shell_print(sh, "lifetime: %u writes, %u bytes, %u flushes",
+		    s.writes, s.bytes, s.flushes);
+	shell_print(sh, "since boot: %u unchanged, %u deferred, %u errors, "
+		    "%u corrupt", s.unchanged, s.deferred, s.errors, s.corrupt);
+
+	SYS_SLIST_FOR_EACH_CONTAINER(&entries, entry, node) {
+		shell_print(sh, "  %s: %u writes since boot%s", entry->name,
+			    entry->writes,
+			    atomic_get(&entry->dirty) ? ", pending" : "");
+	}
+
+	return 0;
+}
+
+static int cmd_config_flush(const struct shell *sh, size_t argc, char **argv)
+{
+	config_store_flush();
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_config,
+	SHELL_CMD(show, NULL, "Print the stored entries and write counts",
+		  cmd_config_show),
+	SHELL_CMD(flush, NULL, "Write pending changes now", cmd_config_flush),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(config, &sub_config, "Persistent configuration", NULL);
+#endif /* CONFIG_SHELL */
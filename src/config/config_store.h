@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Persistent configuration in NVS through the settings subsystem.
+ * Each module registers an entry for the state it wants kept (keymap,
+ * macro table, analog calibration, LED levels) and reports changes;
+ * the store writes them later, from its own lowest priority thread,
+ * once the keys have been quiet for CONFIG_KEYPAD_CONFIG_STORE_IDLE_MS
+ * or the bus is suspended. Changes in between coalesce into a single
+ * write per entry, and a value equal to the stored one is not written
+ * at all. Flash writes are counted for wear monitoring, over the
+ * lifetime of the part.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_CONFIG_STORE is enabled.
+ */
+
+#ifndef KEYPAD_CONFIG_CONFIG_STORE_H_
+#define KEYPAD_CONFIG_CONFIG_STORE_H_
+
+#include <zephyr/zephyr.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/slist.h>
+
+struct config_entry {
+	sys_snode_t node;
+	/* Settings name, e.g. "keypad/keymap" */
+	const char *name;
+	/*
+	 * Copy the value to store into buf, from the store's thread.
+	 * Returns its length or a negative errno.
+	 */
+	ssize_t (*get)(void *buf, size_t size);
+	/*
+	 * Apply the stored value, called by config_store_register(). For
+	 * a table read in place, data stays valid after the call.
+	 */
+	int (*set)(const void *data, size_t len);
+	/* Table id in config_xip.h to read in place, 0 for NVS */
+	uint8_t xip;
+
+	/* Owned by config_store.c */
+	atomic_t dirty;
+	uint32_t crc;
+	uint32_t writes;
+	/* Put into the XIP slot being written, not committed yet */
+	bool staged;
+	uint32_t staged_crc;
+	uint32_t staged_len;
+};
+
+struct config_store_stats {
+	/* Entries and bytes written and flushes, since the first boot */
+	uint32_t writes;
+	uint32_t bytes;
+	uint32_t flushes;
+	/* Entries found equal to flash, flushes put off by key activity */
+	uint32_t unchanged;
+	uint32_t deferred;
+	uint32_t errors;
+	/* Stored values that failed their CRC on load */
+	uint32_t corrupt;
+};
+
+#if defined(CONFIG_KEYPAD_CONFIG_STORE)
+
+/* Add an entry and apply its stored value, if any. From init code */
+int config_store_register(struct config_entry *entry);
+
+/* The value of entry changed, write it when idle. ISR safe */
+void config_store_changed(struct config_entry *entry);
+
+/* Key activity seen, postpones writes. ISR safe */
+void config_store_activity(void);
+
+/* Write pending changes now, whatever the keys do */
+void config_store_flush(void);
+
+void config_store_stats_get(struct config_store_stats *out);
+
+#else
+
+static inline int config_store_register(struct config_entry *entry)
+{
+	return 0;
+}
+
+static inline void config_store_changed(struct config_entry *entry) {}
+static inline void config_store_activity(void) {}
+static inline void config_store_flush(void) {}
+
+static inline void config_store_stats_get(struct config_store_stats *out)
+{
+	*out = (struct config_store_stats){ 0 };
+}
+
+#endif /* CONFIG_KEYPAD_CONFIG_STORE */
+
+#endif /* KEYPAD_CONFIG_CONFIG_STORE_H_ */
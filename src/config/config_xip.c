@@ -0,0 +1,328 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * The header is the index: finding the current slot reads two headers
+ * in place, and nothing but a pointer to it is kept in RAM. The magic
+ * is the last word of the header and the header the last thing
+ * programmed, so a slot is only valid once everything it indexes is
+ * in flash, and the header carries a CRC of its own, so a header torn
+ * or worn into something else that still ends in the magic is not
+ * taken either. Carried over tables go through a small RAM bounce
+ * buffer, flash is never programmed straight from flash.
+ *
+ * On the QSPI flash the XIP window is turned on with the first read,
+ * and stays on: the driver serves erase and program commands with it
+ * on. Those bypass the cache, which is invalidated once a write is
+ * done so no line of the old slot is read back.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/sys/crc.h>
+#include <zephyr/logging/log.h>
+
+#include "config/config_xip.h"
+
+#if defined(CONFIG_KEYPAD_CONFIG_XIP_QSPI)
+#include <zephyr/drivers/flash/nrf_qspi_nor.h>
+#include <hal/nrf_cache.h>
+#endif
+
+LOG_MODULE_REGISTER(config_xip, LOG_LEVEL_INF);
+
+BUILD_ASSERT(FLASH_AREA_LABEL_EXISTS(keypad_tables),
+	     "the tables need a keypad_tables partition, see xip-tables.overlay");
+
+#define XIP_MAGIC 0x4b585054
+#define XIP_TABLES CONFIG_KEYPAD_CONFIG_XIP_TABLES
+#define XIP_SLOT_SIZE (FLASH_AREA_SIZE(keypad_tables) / 2)
+
+#if defined(CONFIG_KEYPAD_CONFIG_XIP_QSPI)
+#define XIP_QSPI_NODE DT_INST(0, nordic_qspi_nor)
+/* Flash offset 0 is the start of the window */
+#define XIP_BASE (DT_REG_ADDR_BY_NAME(DT_NODELABEL(qspi), qspi_mm) + \
+		  FLASH_AREA_OFFSET(keypad_tables))
+/* Line of the app core cache */
+#define XIP_CACHE_LINE 16
+#else
+#define XIP_BASE (CONFIG_FLASH_BASE_ADDRESS + FLASH_AREA_OFFSET(keypad_tables))
+#endif
+
+struct xip_record {
+	uint8_t id;
+	uint8_t reserved[3];
+	/* From the start of the slot */
+	uint32_t offset;
+	uint32_t len;
+	uint32_t crc;
+};
+
+struct xip_header {
+	/* Generation, the higher of two valid headers is current */
+	uint32_t seq;
+	uint32_t count;
+	struct xip_record rec[XIP_TABLES];
+	/* CRC32 of everything above */
+	uint32_t crc;
+	/* Programmed last */
+	uint32_t magic;
+};
+
+BUILD_ASSERT(sizeof(struct xip_header) % 4 == 0,
+	     "the header is programmed in whole words");
+
+static const struct xip_header *current;
+static bool scanned;
+
+/* The bank being written, from config_xip_begin() to its commit */
+static const struct flash_area *bank_fa;
+static struct xip_header bank;
+static uint8_t bank_slot;
+static uint32_t bank_pos;
+/* Ids put into the bank, not carried over from the current one */
+static uint32_t bank_ids;
+
+static const struct xip_header *slot_header(uint8_t slot)
+{
+	return (const struct xip_header *)(XIP_BASE + slot * XIP_SLOT_SIZE);
+}
+
+static uint32_t header_crc(const struct xip_header *hdr)
+{
+	return crc32_ieee((const uint8_t *)hdr,
+			  offsetof(struct xip_header, crc));
+}
+
+static bool header_valid(const struct xip_header *hdr)
+{
+	return hdr->magic == XIP_MAGIC && hdr->count <= XIP_TABLES &&
+	       hdr->crc == header_crc(hdr);
+}
+
+static const struct xip_header *current_get(void)
+{
+	const struct xip_header *a = slot_header(0);
+	const struct xip_header *b = slot_header(1);
+
+	if (scanned) {
+		return current;
+	}
+
+	scanned = true;
+
+#if defined(CONFIG_KEYPAD_CONFIG_XIP_QSPI)
+	nrf_qspi_nor_xip_enable(DEVICE_DT_GET(XIP_QSPI_NODE), true);
+#endif
+
+	if (header_valid(a) && (!header_valid(b) || a->seq > b->seq)) {
+		current = a;
+	} else if (header_valid(b)) {
+		current = b;
+	}
+
+	return current;
+}
+
+const void *config_xip_get(uint8_t id, size_t *len, uint32_t *crc)
+{
+	const struct xip_header *hdr = current_get();
+
+	if (hdr == NULL) {
+		return NULL;
+	}
+
+	for (uint32_t i = 0; i < hdr->count; i++) {
+		const struct xip_record *rec = &hdr->rec[i];
+
+		if (rec->id == id) {
+			*len = rec->len;
+			*crc = rec->crc;
+			return (const uint8_t *)hdr + rec->offset;
+		}
+	}
+
+	return NULL;
+}
+
+/* Program len bytes from RAM or flash, the last word padded */
+static int xip_program(const struct flash_area *fa, off_t off,
+		       const uint8_t *src, size_t len)
+{
+	uint8_t bounce[64] __aligned(4);
+	int ret;
+
+	while (len > 0) {
+		size_t n = MIN(len, sizeof(bounce));
+
+		memset(bounce, 0xff, sizeof(bounce));
+		memcpy(bounce, src, n);
+
+		ret = flash_area_write(fa, off, bounce, ROUND_UP(n, 4));
+		if (ret < 0) {
+			return ret;
+		}
+
+		off += n;
+		src += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static void bank_close(void)
+{
+	flash_area_close(bank_fa);
+	bank_fa = NULL;
+
+#if defined(CONFIG_KEYPAD_CONFIG_XIP_QSPI)
+	nrf_cache_invalidate(NRF_CACHE);
+#endif
+}
+
+int config_xip_begin(void)
+{
+	const struct xip_header *old = current_get();
+	int ret;
+
+	if (bank_fa != NULL) {
+		return -EBUSY;
+	}
+
+	ret = flash_area_open(FLASH_AREA_ID(keypad_tables), &bank_fa);
+	if (ret < 0) {
+		bank_fa = NULL;
+		return ret;
+	}
+
+	bank_slot = old == slot_header(0) ? 1 : 0;
+	bank_pos = sizeof(struct xip_header);
+	bank_ids = 0;
+	memset(&bank, 0xff, sizeof(bank));
+	bank.seq = old != NULL ? old->seq + 1 : 0;
+	bank.count = 0;
+
+	ret = flash_area_erase(bank_fa, bank_slot * XIP_SLOT_SIZE,
+			       XIP_SLOT_SIZE);
+	if (ret < 0) {
+		bank_close();
+	}
+
+	return ret;
+}
+
+/* Program a table into the bank and index it, no checks on id */
+static int bank_add(const struct xip_record *rec, const uint8_t *data)
+{
+	int ret;
+
+	if (bank.count == XIP_TABLES || rec->len > XIP_SLOT_SIZE - bank_pos) {
+		LOG_ERR("Table 0x%02x does not fit, %u bytes", rec->id,
+			rec->len);
+		return -ENOSPC;
+	}
+
+	ret = xip_program(bank_fa, bank_slot * XIP_SLOT_SIZE + bank_pos,
+			  data, rec->len);
+	if (ret < 0) {
+		return ret;
+	}
+
+	bank.rec[bank.count] = *rec;
+	bank.rec[bank.count++].offset = bank_pos;
+	bank_pos += ROUND_UP(rec->len, 4);
+
+	return 0;
+}
+
+int config_xip_put(uint8_t id, const void *data, size_t len, uint32_t crc)
+{
+	const struct xip_record rec = {
+		.id = id,
+		.len = len,
+		.crc = crc,
+	};
+	int ret;
+
+	if (bank_fa == NULL) {
+		return -EACCES;
+	}
+
+	if (id == 0 || id >= 32 || (bank_ids & BIT(id))) {
+		return -EINVAL;
+	}
+
+	bank_ids |= BIT(id);
+	if (len == 0) {
+		/* Removed: not carried over either */
+		return 0;
+	}
+
+	ret = bank_add(&rec, data);
+	if (ret < 0) {
+		config_xip_abort();
+	}
+
+	return ret;
+}
+
+int config_xip_commit(void)
+{
+	const struct xip_header *old = current_get();
+	int ret = 0;
+
+	if (bank_fa == NULL) {
+		return -EACCES;
+	}
+
+	for (uint32_t i = 0; old != NULL && i < old->count; i++) {
+		const struct xip_record *rec = &old->rec[i];
+
+		if (rec->id >= 32 || (bank_ids & BIT(rec->id))) {
+			continue;
+		}
+
+		ret = bank_add(rec, (const uint8_t *)old + rec->offset);
+		if (ret < 0) {
+			goto out;
+		}
+	}
+
+	/* The flip: once the magic is in, the new bank is current */
+	bank.crc = header_crc(&bank);
+	bank.magic = XIP_MAGIC;
+	ret = flash_area_write(bank_fa, bank_slot * XIP_SLOT_SIZE, &bank,
+			       sizeof(bank));
+	if (ret == 0) {
+		current = slot_header(bank_slot);
+	}
+
+out:
+	bank_close();
+
+	return ret;
+}
+
+void config_xip_abort(void)
+{
+	if (bank_fa != NULL) {
+		bank_close();
+	}
+}
+
+#if defined(CONFIG_KEYPAD_CONFIG_XIP_QSPI)
+void config_xip_prefetch(const void *data, size_t len)
+{
+	uintptr_t addr = ROUND_DOWN((uintptr_t)data, XIP_CACHE_LINE);
+	uintptr_t end = (uintptr_t)data + len;
+
+	for (; addr < end; addr += XIP_CACHE_LINE) {
+		(void)*(const volatile uint32_t *)addr;
+	}
+}
+#endif
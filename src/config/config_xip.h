@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Config store tables laid out to be read in place from the
+ * memory-mapped keypad_tables partition, see xip-tables.overlay. The
+ * partition is two slots, each a header that indexes the tables and
+ * then their data, word aligned; the slot with the newest valid header
+ * is current. Loading a table is a lookup in that header and returns a
+ * pointer into flash, so an entry rebuilds at most a small index of
+ * it in RAM and nothing is copied or parsed at boot.
+ *
+ * A write goes to the other slot: the tables that changed, in one
+ * batch, then the ones that did not carried over, and the header last,
+ * which holds a generation one past the current one. Programming that
+ * header is the commit, so a reset anywhere before it leaves the old
+ * slot current with every table as it was: the keymap and macros of a
+ * profile change together or not at all. Boot picks the slot by
+ * reading both headers, however many writes the flash has seen. The
+ * data returned by config_xip_get() stays readable until the second
+ * write after it; a table's own consumer drops its pointer at its next
+ * change, which is what gets written.
+ *
+ * With CONFIG_KEYPAD_CONFIG_XIP_QSPI the partition is on the external
+ * QSPI flash instead, see xip-qspi.overlay, read through its XIP
+ * window. A cache miss there is a serial flash read, so data about to
+ * be used at the poll rate is pulled into the cache first.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_CONFIG_XIP is enabled.
+ */
+
+#ifndef KEYPAD_CONFIG_CONFIG_XIP_H_
+#define KEYPAD_CONFIG_CONFIG_XIP_H_
+
+#include <zephyr/zephyr.h>
+
+/* Table ids, 0 is none */
+#define XIP_TABLE_MACROS 0x01
+#define XIP_TABLE_KEYMAP 0x02
+
+#if defined(CONFIG_KEYPAD_CONFIG_XIP)
+
+/*
+ * Data and length of a table, and the CRC it was written with. NULL
+ * if the table is not stored.
+ */
+const void *config_xip_get(uint8_t id, size_t *len, uint32_t *crc);
+
+/*
+ * Write a new slot, from the config store thread only, this erases and
+ * programs flash. config_xip_begin() erases the slot not in use,
+ * config_xip_put() programs a table into it, an empty one removes the
+ * table, and config_xip_commit() carries the tables not put over and
+ * makes the slot current. A failed put drops the slot; so does
+ * config_xip_abort(), the current one stays as it was.
+ */
+int config_xip_begin(void);
+int config_xip_put(uint8_t id, const void *data, size_t len, uint32_t crc);
+int config_xip_commit(void);
+void config_xip_abort(void);
+
+#else
+
+static inline const void *config_xip_get(uint8_t id, size_t *len,
+					 uint32_t *crc)
+{
+	return NULL;
+}
+
+static inline int config_xip_begin(void)
+{
+	return -ENOTSUP;
+}
+
+static inline int config_xip_put(uint8_t id, const void *data, size_t len,
+				 uint32_t crc)
+{
+	return -ENOTSUP;
+}
+
+static inline int config_xip_commit(void)
+{
+	return -ENOTSUP;
+}
+
+static inline void config_xip_abort(void) {}
+
+#endif /* CONFIG_KEYPAD_CONFIG_XIP */
+
+#if defined(CONFIG_KEYPAD_CONFIG_XIP_QSPI)
+
+/*
+ * Read len bytes at data into the cache, one word per line, before
+ * they are needed. Any address will do, flash or RAM.
+ */
+void config_xip_prefetch(const void *data, size_t len);
+
+#else
+
+static inline void config_xip_prefetch(const void *data, size_t len) {}
+
+#endif /* CONFIG_KEYPAD_CONFIG_XIP_QSPI */
+
+#endif /* KEYPAD_CONFIG_CONFIG_XIP_H_ */
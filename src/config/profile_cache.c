@@ -0,0 +1,615 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Every slot is one settings value, "keypad/app/<n>": the keymap image
+ * and its le32 CRC32, as the config store keeps its values. A cache
+ * entry holds the same bytes, so an upload is stored straight from the
+ * entry it went to and a read lands in one. Entries not yet in flash
+ * are never evicted, nor one being read or written. The flash reads and
+ * writes run as background jobs, with the lock released: a switch to a
+ * cached profile does not wait for them.
+ *
+ * The prediction is first order: one saturating count per pair of
+ * slots of how often the second followed the first, halved across the
+ * row when one runs out. Switching between an editor and a terminal,
+ * or across a handful of apps in turn, keeps the next one read ahead.
+ */
+
+#include <stdlib.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/crc.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/settings/settings.h>
+
+#include "bg_sched.h"
+#include "layer.h"
+#include "config/profile_cache.h"
+
+LOG_MODULE_REGISTER(profile_cache, LOG_LEVEL_INF);
+
+#define SLOTS CONFIG_KEYPAD_PROFILE_SLOTS
+#define ENTRIES CONFIG_KEYPAD_PROFILE_CACHE_SIZE
+#define PROFILE_NAME "keypad/app"
+#define CRC_SIZE 4
+/* Neither a slot nor home, e.g. an entry holding nothing */
+#define SLOT_NONE 0xfe
+/* Row and column of home in the follow counts */
+#define HOME_INDEX SLOTS
+
+/* A missed switch is read at once, a read ahead may wait a little */
+#define AHEAD_DEADLINE_US (50 * USEC_PER_MSEC)
+#define SAVE_DEADLINE_US (100 * USEC_PER_MSEC)
+/* For a keymap edit in progress to end */
+#define RETRY_US USEC_PER_MSEC
+
+BUILD_ASSERT(SLOTS <= 16, "slots are bits of a uint16_t");
+
+struct cache_entry {
+	/* The image and its le32 CRC32, as stored */
+	uint8_t image[LAYER_IMAGE_SIZE + CRC_SIZE] __aligned(4);
+	/* Of the LRU clock, 0 for nothing held */
+	uint32_t used;
+	uint8_t slot;
+	/* Being read or uploaded into, neither looked up nor evicted */
+	bool busy;
+	/* Being written to flash, not evicted */
+	bool saving;
+	/* Read ahead and not switched to since */
+	bool ahead;
+};
+
+struct slot_read {
+	struct cache_entry *entry;
+	bool ok;
+};
+
+static void load_run(struct bg_job *job);
+static void save_run(struct bg_job *job);
+
+static struct bg_job load_job = {
+	.name = "profile_load",
+	.run = load_run,
+};
+
+static struct bg_job save_job = {
+	.name = "profile_save",
+	.run = save_run,
+};
+
+static K_MUTEX_DEFINE(cache_lock);
+static struct cache_entry cache[ENTRIES];
+static uint32_t lru_clock;
+/* Slots with a profile in flash, and those only in the cache so far */
+static uint16_t stored;
+static uint16_t unsaved;
+/* SLOT_NONE while the slot in use is swapped in again after an upload */
+static uint8_t current = PROFILE_CACHE_HOME;
+static uint8_t wanted = PROFILE_CACHE_HOME;
+/* To read ahead after the last switch, SLOT_NONE for nothing */
+static uint8_t predicted = SLOT_NONE;
+/* follows[a][b]: switches from a to b */
+static uint8_t follows[SLOTS + 1][SLOTS + 1];
+/* The keymap in use before the first switch */
+static uint8_t home[LAYER_IMAGE_SIZE] __aligned(4);
+
+static struct cache_entry *uploading;
+static uint8_t upload_slot;
+
+static uint32_t hits;
+static uint32_t misses;
+static uint32_t reads_ahead;
+static uint32_t ahead_hits;
+static uint32_t corrupt;
+
+static inline uint8_t follow_index(uint8_t slot)
+{
+	return slot == PROFILE_CACHE_HOME ? HOME_INDEX : slot;
+}
+
+/* Lock held for all of the cache_ and follows_ helpers */
+static struct cache_entry *cache_find(uint8_t slot)
+{
+	for (size_t i = 0; i < ENTRIES; i++) {
+		if (!cache[i].busy && cache[i].slot == slot) {
+			return &cache[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* The least recently used entry that may go, NULL if none */
+static struct cache_entry *cache_victim(void)
+{
+	struct cache_entry *victim = NULL;
+
+	for (size_t i = 0; i < ENTRIES; i++) {
+		struct cache_entry *e = &cache[i];
+
+		if (e->busy || e->saving ||
+		    (e->slot < SLOTS && (unsaved & BIT(e->slot)))) {
+			continue;
+		}
+
+		if (victim == NULL || e->used < victim->used) {
+			victim = e;
+		}
+	}
+
+	return victim;
+}
+
+static void cache_take(struct cache_entry *e)
+{
+	e->busy = true;
+	e->slot = SLOT_NONE;
+	e->used = 0;
+	e->ahead = false;
+}
+
+static void cache_hit(struct cache_entry *e)
+{
+	hits++;
+	e->used = ++lru_clock;
+	if (e->ahead) {
+		ahead_hits++;
+		e->ahead = false;
+	}
+}
+
+static void follows_note(uint8_t from, uint8_t to)
+{
+	uint8_t *row = follows[follow_index(from)];
+
+	if (row[follow_index(to)] == UINT8_MAX) {
+		for (uint8_t i = 0; i <= SLOTS; i++) {
+			row[i] /= 2;
+		}
+	}
+
+	row[follow_index(to)]++;
+}
+
+/* The slot that most often followed slot, if it is to be read */
+static uint8_t follows_predict(uint8_t slot)
+{
+	const uint8_t *row = follows[follow_index(slot)];
+	uint8_t best = SLOT_NONE;
+
+	/* Home is always at hand */
+	for (uint8_t i = 0; i < SLOTS; i++) {
+		if (row[i] > 0 && (best == SLOT_NONE || row[i] > row[best])) {
+			best = i;
+		}
+	}
+
+	if (best == SLOT_NONE || best == slot ||
+	    (stored & BIT(best)) == 0 || cache_find(best) != NULL) {
+		return SLOT_NONE;
+	}
+
+	return best;
+}
+
+/* Swap image in as the keymap of slot, lock held */
+static int profile_apply(uint8_t slot, const uint8_t *image)
+{
+	size_t size;
+	uint8_t *buf;
+	int ret;
+
+	ret = layer_keymap_begin();
+	if (ret < 0) {
+		return ret;
+	}
+
+	/* The spare buffer starts as a copy of the keymap in use */
+	buf = layer_keymap_image(&size);
+	if (current == PROFILE_CACHE_HOME) {
+		memcpy(home, buf, size);
+	}
+	memcpy(buf, image, size);
+
+	ret = layer_keymap_image_swap();
+	if (ret < 0) {
+		LOG_WRN("Profile %u refused, error: %d", slot, ret);
+		return ret;
+	}
+
+	if (current != SLOT_NONE) {
+		follows_note(current, slot);
+	}
+	current = slot;
+	predicted = follows_predict(slot);
+
+	return 0;
+}
+
+static bool slot_image_read(struct cache_entry *e, size_t len,
+			    settings_read_cb read_cb, void *cb_arg)
+{
+	ssize_t ret;
+
+	if (len != sizeof(e->image)) {
+		/* Of a build with other layers or keys */
+		return false;
+	}
+
+	ret = read_cb(cb_arg, e->image, len);
+	if (ret != len ||
+	    crc32_ieee(e->image, LAYER_IMAGE_SIZE) !=
+	    sys_get_le32(&e->image[LAYER_IMAGE_SIZE])) {
+		LOG_ERR("Stored profile corrupt, ignored");
+		corrupt++;
+		return false;
+	}
+
+	return true;
+}
+
+static int slot_load(const char *key, size_t len, settings_read_cb read_cb,
+		     void *cb_arg, void *param)
+{
+	struct slot_read *rd = param;
+
+	if (key != NULL) {
+		/* Below the slot's name, not its value */
+		return 0;
+	}
+
+	rd->ok = slot_image_read(rd->entry, len, read_cb, cb_arg);
+
+	return 0;
+}
+
+/* Read slot from flash into the cache unless it is there */
+static void cache_read(uint8_t slot, bool ahead)
+{
+	char name[sizeof(PROFILE_NAME "/255")];
+	struct slot_read rd = { 0 };
+
+	k_mutex_lock(&cache_lock, K_FOREVER);
+	if (cache_find(slot) == NULL) {
+		rd.entry = cache_victim();
+	}
+	if (rd.entry != NULL) {
+		cache_take(rd.entry);
+	}
+	k_mutex_unlock(&cache_lock);
+
+	if (rd.entry == NULL) {
+		return;
+	}
+
+	snprintk(name, sizeof(name), PROFILE_NAME "/%u", slot);
+	(void)settings_load_subtree_direct(name, slot_load, &rd);
+
+	k_mutex_lock(&cache_lock, K_FOREVER);
+	rd.entry->busy = false;
+	/* An upload to the slot meanwhile is newer */
+	if (rd.ok && cache_find(slot) == NULL &&
+	    (uploading == NULL || upload_slot != slot)) {
+		rd.entry->slot = slot;
+		rd.entry->used = ++lru_clock;
+		rd.entry->ahead = ahead;
+		if (ahead) {
+			reads_ahead++;
+		}
+	}
+	k_mutex_unlock(&cache_lock);
+}
+
+/* The switch the cache missed, then the read ahead */
+static void load_run(struct bg_job *job)
+{
+	const uint8_t *image = NULL;
+	struct cache_entry *e;
+	uint8_t next;
+	uint8_t slot;
+	int ret = 0;
+
+	k_mutex_lock(&cache_lock, K_FOREVER);
+	slot = wanted;
+	k_mutex_unlock(&cache_lock);
+
+	if (slot < SLOTS) {
+		cache_read(slot, false);
+	}
+
+	k_mutex_lock(&cache_lock, K_FOREVER);
+	if (wanted == slot && slot != current) {
+		e = slot == PROFILE_CACHE_HOME ? NULL : cache_find(slot);
+		if (slot == PROFILE_CACHE_HOME) {
+			image = home;
+		} else if (e != NULL) {
+			e->used = ++lru_clock;
+			image = e->image;
+		}
+
+		if (image != NULL) {
+			ret = profile_apply(slot, image);
+		} else {
+			LOG_WRN("Profile %u could not be read", slot);
+		}
+	}
+
+	next = SLOT_NONE;
+	if (ret != -EBUSY) {
+		next = predicted;
+		predicted = SLOT_NONE;
+	}
+	k_mutex_unlock(&cache_lock);
+
+	if (ret == -EBUSY) {
+		bg_sched_submit(job, RETRY_US, RETRY_US);
+		return;
+	}
+
+	if (next != SLOT_NONE) {
+		cache_read(next, true);
+	}
+}
+
+static void save_run(struct bg_job *job)
+{
+	char name[sizeof(PROFILE_NAME "/255")];
+	struct cache_entry *e;
+	int ret;
+
+	for (uint8_t slot = 0; slot < SLOTS; slot++) {
+		k_mutex_lock(&cache_lock, K_FOREVER);
+		e = (unsaved & BIT(slot)) ? cache_find(slot) : NULL;
+		if (e != NULL) {
+			unsaved &= ~BIT(slot);
+			e->saving = true;
+		}
+		k_mutex_unlock(&cache_lock);
+
+		if (e == NULL) {
+			continue;
+		}
+
+		snprintk(name, sizeof(name), PROFILE_NAME "/%u", slot);
+		ret = settings_save_one(name, e->image, sizeof(e->image));
+
+		k_mutex_lock(&cache_lock, K_FOREVER);
+		e->saving = false;
+		if (ret < 0 && e->slot == slot) {
+			LOG_ERR("Failed to store profile %u, error: %d", slot,
+				ret);
+			/* Kept in the cache for the next try */
+			unsaved |= BIT(slot);
+		}
+		k_mutex_unlock(&cache_lock);
+
+		if (ret < 0) {
+			bg_sched_submit(job, SAVE_DEADLINE_US,
+					SAVE_DEADLINE_US);
+		}
+	}
+}
+
+int profile_cache_select(uint8_t slot)
+{
+	struct cache_entry *e;
+	bool read = false;
+	bool ahead;
+	int ret = 0;
+
+	if (slot != PROFILE_CACHE_HOME &&
+	    (slot >= SLOTS || (stored & BIT(slot)) == 0)) {
+		return -ENOENT;
+	}
+
+	k_mutex_lock(&cache_lock, K_FOREVER);
+	wanted = slot;
+	if (slot != current) {
+		e = slot == PROFILE_CACHE_HOME ? NULL : cache_find(slot);
+		if (slot == PROFILE_CACHE_HOME) {
+			ret = profile_apply(slot, home);
+		} else if (e != NULL) {
+			cache_hit(e);
+			ret = profile_apply(slot, e->image);
+		} else {
+			misses++;
+			read = true;
+		}
+	}
+	ahead = predicted != SLOT_NONE;
+	k_mutex_unlock(&cache_lock);
+
+	if (read || (ret == 0 && ahead)) {
+		bg_sched_submit(&load_job, 0, read ? 0 : AHEAD_DEADLINE_US);
+	}
+
+	return ret;
+}
+
+uint8_t *profile_cache_upload_begin(uint8_t slot, size_t *size)
+{
+	struct cache_entry *e = NULL;
+
+	if (slot >= SLOTS) {
+		return NULL;
+	}
+
+	k_mutex_lock(&cache_lock, K_FOREVER);
+	if (uploading == NULL) {
+		e = cache_victim();
+	}
+	if (e != NULL) {
+		cache_take(e);
+		uploading = e;
+		upload_slot = slot;
+	}
+	k_mutex_unlock(&cache_lock);
+
+	*size = LAYER_IMAGE_SIZE;
+
+	return e != NULL ? e->image : NULL;
+}
+
+int profile_cache_upload_commit(void)
+{
+	struct cache_entry *e = uploading;
+	struct cache_entry *old;
+	bool refresh;
+	int ret;
+
+	if (e == NULL) {
+		return -EACCES;
+	}
+
+	ret = layer_keymap_image_verify(e->image);
+	sys_put_le32(crc32_ieee(e->image, LAYER_IMAGE_SIZE),
+		     &e->image[LAYER_IMAGE_SIZE]);
+
+	k_mutex_lock(&cache_lock, K_FOREVER);
+	uploading = NULL;
+	e->busy = false;
+	if (ret < 0) {
+		k_mutex_unlock(&cache_lock);
+		return ret;
+	}
+
+	old = cache_find(upload_slot);
+	if (old != NULL) {
+		old->slot = SLOT_NONE;
+		old->used = 0;
+	}
+
+	e->slot = upload_slot;
+	e->used = ++lru_clock;
+	stored |= BIT(upload_slot);
+	unsaved |= BIT(upload_slot);
+
+	refresh = current == upload_slot;
+	if (refresh) {
+		/* Swapped in again by the load job */
+		current = SLOT_NONE;
+	}
+	k_mutex_unlock(&cache_lock);
+
+	bg_sched_submit(&save_job, 0, SAVE_DEADLINE_US);
+	if (refresh) {
+		bg_sched_submit(&load_job, 0, 0);
+	}
+
+	return 0;
+}
+
+void profile_cache_upload_abort(void)
+{
+	k_mutex_lock(&cache_lock, K_FOREVER);
+	if (uploading != NULL) {
+		uploading->busy = false;
+		uploading = NULL;
+	}
+	k_mutex_unlock(&cache_lock);
+}
+
+/* Every stored slot, the first few read into the cache on the way */
+static int slot_scan(const char *key, size_t len, settings_read_cb read_cb,
+		     void *cb_arg, void *param)
+{
+	struct cache_entry *e;
+	unsigned long slot;
+	char *end;
+
+	if (key == NULL) {
+		return 0;
+	}
+
+	slot = strtoul(key, &end, 10);
+	if (*end != '\0' || end == key || slot >= SLOTS) {
+		return 0;
+	}
+
+	stored |= BIT(slot);
+
+	e = cache_victim();
+	if (e != NULL && e->used == 0 &&
+	    slot_image_read(e, len, read_cb, cb_arg)) {
+		e->slot = slot;
+		e->used = ++lru_clock;
+	}
+
+	return 0;
+}
+
+static int profile_cache_init(const struct device *dev)
+{
+	int ret;
+
+	ARG_UNUSED(dev);
+
+	for (size_t i = 0; i < ENTRIES; i++) {
+		cache[i].slot = SLOT_NONE;
+	}
+
+	ret = settings_subsys_init();
+	if (ret < 0) {
+		LOG_ERR("Failed to init settings, error: %d", ret);
+		return ret;
+	}
+
+	return settings_load_subtree_direct(PROFILE_NAME, slot_scan, NULL);
+}
+
+SYS_INIT(profile_cache_init, APPLICATION, 0);
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static int cmd_profile_show(const struct shell *sh, size_t argc,
+			    char **argv)
+{
+	k_mutex_lock(&cache_lock, K_FOREVER);
+
+	shell_print(sh, "in use %u, wanted %u, stored 0x%04x, unsaved 0x%04x",
+		    current, wanted, stored, unsaved);
+	for (size_t i = 0; i < ENTRIES; i++) {
+		if (cache[i].slot != SLOT_NONE) {
+			shell_print(sh, "  slot %u, used %u%s%s", cache[i].slot,
+				    cache[i].used,
+				    cache[i].ahead ? ", read ahead" : "",
+				    cache[i].saving ? ", saving" : "");
+		}
+	}
+	shell_print(sh, "%u hits, %u misses, %u read ahead, %u of them hit, "
+		    "%u corrupt", hits, misses, reads_ahead, ahead_hits,
+		    corrupt);
+
+	k_mutex_unlock(&cache_lock);
+
+	return 0;
+}
+
+static int cmd_profile_select(const struct shell *sh, size_t argc,
+			      char **argv)
+{
+	int ret;
+
+	ret = profile_cache_select(strcmp(argv[1], "home") == 0 ?
+				   PROFILE_CACHE_HOME :
+				   (uint8_t)strtoul(argv[1], NULL, 0));
+	if (ret < 0) {
+		shell_error(sh, "Select failed, error: %d", ret);
+	}
+
+	return ret;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_profile,
+	SHELL_CMD(show, NULL, "Print the profile cache", cmd_profile_show),
+	SHELL_CMD_ARG(select, NULL, "Switch to <slot> or home",
+		      cmd_profile_select, 2, 0),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(profile, &sub_profile, "Per-application profiles", NULL);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Per-application keymaps. The host agent uploads a compiled profile
+ * without macros into one of CONFIG_KEYPAD_PROFILE_SLOTS slots, as
+ * UPLOAD_TARGET_APP_PROFILE(slot), and names the slot of the
+ * application in focus with the raw HID APP command. The
+ * CONFIG_KEYPAD_PROFILE_CACHE_SIZE most recently used profiles are kept
+ * decoded in RAM, as keymap images ready to be copied in, so switching
+ * to one of them is a copy into the layer's spare buffer, in use from
+ * the next scan. Any other is read from flash on the background thread
+ * first. After every switch the slot that has most often followed the
+ * new one is read ahead into the cache.
+ *
+ * Switched keymaps are not stored as the keypad's keymap: it comes back
+ * from a reboot, and from PROFILE_CACHE_HOME, as edited last.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_PROFILE_CACHE is enabled.
+ */
+
+#ifndef KEYPAD_CONFIG_PROFILE_CACHE_H_
+#define KEYPAD_CONFIG_PROFILE_CACHE_H_
+
+#include <zephyr/zephyr.h>
+
+/* The keymap in use before the first switch, for apps without a slot */
+#define PROFILE_CACHE_HOME 0xff
+
+#if defined(CONFIG_KEYPAD_PROFILE_CACHE)
+
+/*
+ * Switch to the profile of slot, or back home. A cached one is swapped
+ * in before this returns, any other once it is read. -ENOENT for a
+ * slot with nothing stored, -EBUSY while a keymap edit is in progress.
+ * From thread context.
+ */
+int profile_cache_select(uint8_t slot);
+
+/*
+ * Upload into slot: the profile's keymap image goes to the returned
+ * buffer of *size bytes, NULL if the slot does not exist or the whole
+ * cache is still being written. The commit checks the image, caches
+ * it, stores it and, for the slot in use, swaps it in.
+ */
+uint8_t *profile_cache_upload_begin(uint8_t slot, size_t *size);
+int profile_cache_upload_commit(void);
+void profile_cache_upload_abort(void);
+
+#else
+
+static inline int profile_cache_select(uint8_t slot)
+{
+	return -ENOTSUP;
+}
+
+static inline uint8_t *profile_cache_upload_begin(uint8_t slot,
+						  size_t *size)
+{
+	return NULL;
+}
+
+static inline int profile_cache_upload_commit(void)
+{
+	return -ENOTSUP;
+}
+
+static inline void profile_cache_upload_abort(void) {}
+
+#endif /* CONFIG_KEYPAD_PROFILE_CACHE */
+
+#endif /* KEYPAD_CONFIG_PROFILE_CACHE_H_ */
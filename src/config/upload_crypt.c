@@ -0,0 +1,273 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * A PSA multi-part AEAD operation runs over the whole upload. With TF-M
+ * each PSA call is a trip into the secure image, and the CryptoCell
+ * behind it takes a whole chunk in one go, so a chunk is decrypted in a
+ * single psa_aead_update() rather than block by block: more of the time
+ * goes to the AES itself than to the calls, and the upload keeps up
+ * with the transport. CCM and not GCM as the CC3xx of the nRF5340 does
+ * CCM in hardware. All calls come from upload.c, one upload at a time.
+ */
+
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/init.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/logging/log.h>
+#include <psa/crypto.h>
+
+#include "config/upload_crypt.h"
+
+LOG_MODULE_REGISTER(upload_crypt, LOG_LEVEL_INF);
+
+#define UPLOAD_CRYPT_ALG PSA_ALG_CCM
+#define UPLOAD_CRYPT_KEY ((psa_key_id_t)CONFIG_KEYPAD_UPLOAD_CRYPT_KEY_ID)
+
+/* Ciphertext bytes per psa_aead_update(), a USB chunk */
+#define UPLOAD_CRYPT_CHUNK 64
+
+static psa_aead_operation_t op;
+static bool active;
+
+static uint8_t nonce[UPLOAD_CRYPT_NONCE_SIZE];
+static uint8_t nonce_len;
+static uint8_t tag[UPLOAD_CRYPT_TAG_SIZE];
+static uint8_t tag_len;
+/* Ciphertext still to come */
+static uint16_t remaining;
+/* Associated data, target and le16 plaintext length */
+static uint8_t aad[3];
+
+static uint8_t plain[PSA_AEAD_UPDATE_OUTPUT_SIZE(PSA_KEY_TYPE_AES,
+						 UPLOAD_CRYPT_ALG,
+						 UPLOAD_CRYPT_CHUNK)];
+
+static uint32_t failures;
+
+void upload_crypt_abort(void)
+{
+	if (active) {
+		psa_aead_abort(&op);
+		active = false;
+	}
+}
+
+uint8_t upload_crypt_begin(uint8_t target, uint16_t len)
+{
+	psa_status_t err;
+
+	upload_crypt_abort();
+
+	op = psa_aead_operation_init();
+	err = psa_aead_decrypt_setup(&op, UPLOAD_CRYPT_KEY, UPLOAD_CRYPT_ALG);
+	if (err == PSA_SUCCESS) {
+		err = psa_aead_set_lengths(&op, sizeof(aad), len);
+	}
+
+	if (err != PSA_SUCCESS) {
+		psa_aead_abort(&op);
+		/* No key imported yet, most likely */
+		LOG_WRN("Encrypted upload refused, %d", err);
+		return err == PSA_ERROR_INVALID_HANDLE ?
+		       UPLOAD_STATUS_UNSUPPORTED : UPLOAD_STATUS_BUSY;
+	}
+
+	aad[0] = target;
+	sys_put_le16(len, &aad[1]);
+	nonce_len = 0;
+	tag_len = 0;
+	remaining = len;
+	active = true;
+
+	return UPLOAD_STATUS_OK;
+}
+
+/* Decrypt len bytes of ciphertext, at most UPLOAD_CRYPT_CHUNK */
+static uint8_t upload_crypt_update(const uint8_t *data, size_t len,
+				   upload_crypt_out_t out)
+{
+	size_t out_len;
+
+	if (psa_aead_update(&op, data, len, plain, sizeof(plain),
+			    &out_len) != PSA_SUCCESS) {
+		return UPLOAD_STATUS_AUTH;
+	}
+
+	return out_len > 0 ? out(plain, out_len) : UPLOAD_STATUS_OK;
+}
+
+uint8_t upload_crypt_data(const uint8_t *data, size_t len,
+			  upload_crypt_out_t out)
+{
+	uint8_t status;
+	size_t n;
+
+	if (!active) {
+		return UPLOAD_STATUS_INVALID;
+	}
+
+	while (len > 0) {
+		if (nonce_len < sizeof(nonce)) {
+			n = MIN(len, sizeof(nonce) - nonce_len);
+			memcpy(&nonce[nonce_len], data, n);
+			nonce_len += n;
+
+			if (nonce_len == sizeof(nonce) &&
+			    (psa_aead_set_nonce(&op, nonce,
+						sizeof(nonce)) != PSA_SUCCESS ||
+			     psa_aead_update_ad(&op, aad,
+						sizeof(aad)) != PSA_SUCCESS)) {
+				upload_crypt_abort();
+				return UPLOAD_STATUS_AUTH;
+			}
+		} else if (remaining > 0) {
+			n = MIN(MIN(len, remaining), UPLOAD_CRYPT_CHUNK);
+			remaining -= n;
+
+			status = upload_crypt_update(data, n, out);
+			if (status != UPLOAD_STATUS_OK) {
+				upload_crypt_abort();
+				return status;
+			}
+		} else {
+			n = MIN(len, sizeof(tag) - tag_len);
+			if (n == 0) {
+				break;
+			}
+
+			memcpy(&tag[tag_len], data, n);
+			tag_len += n;
+		}
+
+		data += n;
+		len -= n;
+	}
+
+	return UPLOAD_STATUS_OK;
+}
+
+uint8_t upload_crypt_end(upload_crypt_out_t out)
+{
+	psa_status_t err;
+	size_t out_len;
+
+	if (!active) {
+		return UPLOAD_STATUS_INVALID;
+	}
+
+	if (remaining > 0 || tag_len < sizeof(tag)) {
+		upload_crypt_abort();
+		return UPLOAD_STATUS_AUTH;
+	}
+
+	err = psa_aead_verify(&op, plain, sizeof(plain), &out_len, tag,
+			      sizeof(tag));
+	active = false;
+	if (err != PSA_SUCCESS) {
+		psa_aead_abort(&op);
+		failures++;
+		LOG_WRN("Upload failed authentication, %d", err);
+		return UPLOAD_STATUS_AUTH;
+	}
+
+	return out_len > 0 ? out(plain, out_len) : UPLOAD_STATUS_OK;
+}
+
+static int upload_crypt_init(const struct device *dev)
+{
+	psa_status_t err;
+
+	ARG_UNUSED(dev);
+
+	err = psa_crypto_init();
+	if (err != PSA_SUCCESS) {
+		LOG_ERR("PSA crypto init failed, %d", err);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+SYS_INIT(upload_crypt_init, APPLICATION, 0);
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static int cmd_upload_key(const struct shell *sh, size_t argc, char **argv)
+{
+	psa_key_attributes_t attr = PSA_KEY_ATTRIBUTES_INIT;
+	psa_key_id_t id;
+	uint8_t key[32];
+	psa_status_t err;
+
+	if (hex2bin(argv[1], strlen(argv[1]), key, sizeof(key)) !=
+	    sizeof(key)) {
+		shell_error(sh, "key must be 64 hex digits");
+		return -EINVAL;
+	}
+
+	/* Replaces the key, there is no reading it back */
+	upload_crypt_abort();
+	psa_destroy_key(UPLOAD_CRYPT_KEY);
+
+	psa_set_key_id(&attr, UPLOAD_CRYPT_KEY);
+	psa_set_key_lifetime(&attr, PSA_KEY_LIFETIME_PERSISTENT);
+	psa_set_key_usage_flags(&attr, PSA_KEY_USAGE_DECRYPT);
+	psa_set_key_algorithm(&attr, UPLOAD_CRYPT_ALG);
+	psa_set_key_type(&attr, PSA_KEY_TYPE_AES);
+	psa_set_key_bits(&attr, 256);
+
+	err = psa_import_key(&attr, key, sizeof(key), &id);
+	memset(key, 0, sizeof(key));
+	psa_reset_key_attributes(&attr);
+	if (err != PSA_SUCCESS) {
+		shell_error(sh, "import failed, %d", err);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int cmd_upload_clear(const struct shell *sh, size_t argc,
+			    char **argv)
+{
+	upload_crypt_abort();
+	psa_destroy_key(UPLOAD_CRYPT_KEY);
+
+	return 0;
+}
+
+static int cmd_upload_show(const struct shell *sh, size_t argc, char **argv)
+{
+	psa_key_attributes_t attr = PSA_KEY_ATTRIBUTES_INIT;
+	bool present;
+
+	present = psa_get_key_attributes(UPLOAD_CRYPT_KEY, &attr) ==
+		  PSA_SUCCESS;
+	psa_reset_key_attributes(&attr);
+
+	shell_print(sh, "key: %s, %u failed authentication since boot",
+		    present ? "present" : "none", failures);
+	shell_print(sh, "plaintext uploads: %s",
+		    IS_ENABLED(CONFIG_KEYPAD_UPLOAD_CRYPT_REQUIRED) ?
+		    "LED and DFU only" : "accepted");
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_upload,
+	SHELL_CMD_ARG(key, NULL, "Set the upload key: <64 hex digits>",
+		      cmd_upload_key, 2, 0),
+	SHELL_CMD(clear, NULL, "Destroy the upload key", cmd_upload_clear),
+	SHELL_CMD(show, NULL, "Print the key state and failures",
+		  cmd_upload_show),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(upload, &sub_upload, "Encrypted uploads", NULL);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Encrypted configuration uploads. A target ORed with
+ * UPLOAD_TARGET_ENCRYPTED makes the bytes of the upload
+ *
+ *   [0..11]           nonce, never used twice with the same key
+ *   [12..12+len-1]    the upload, AES-CCM encrypted
+ *   [12+len..]        16 byte authentication tag
+ *
+ * and the length given at the begin is that of all of them, len plus
+ * UPLOAD_CRYPT_OVERHEAD, so a transport counts the bytes as usual. The
+ * target byte and the le16 len are the associated data: an upload
+ * cannot be passed off as another target or cut short. The key
+ * is the device's upload key, a persistent PSA key that the
+ * "upload key" shell command imports once and nothing can read back.
+ *
+ * The upload is decrypted chunk by chunk as it comes in, into the same
+ * spare buffers a plaintext upload streams into. Nothing it holds is
+ * applied until the tag checks out at the end. LED frames and firmware
+ * images take effect, or have no length, before the end, so they are
+ * only sent in plaintext. A firmware image is signed anyway.
+ *
+ * There is no replay protection: an upload recorded on the wire can be
+ * sent again and is applied again. It only ever sets what its sender
+ * already set once.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_UPLOAD_CRYPT is enabled.
+ */
+
+#ifndef KEYPAD_CONFIG_UPLOAD_CRYPT_H_
+#define KEYPAD_CONFIG_UPLOAD_CRYPT_H_
+
+#include <zephyr/zephyr.h>
+
+#include "upload.h"
+
+#define UPLOAD_CRYPT_NONCE_SIZE 12
+#define UPLOAD_CRYPT_TAG_SIZE 16
+/* Bytes on the wire beyond the plaintext */
+#define UPLOAD_CRYPT_OVERHEAD (UPLOAD_CRYPT_NONCE_SIZE + UPLOAD_CRYPT_TAG_SIZE)
+
+/* Takes the plaintext as it is decrypted, returns an UPLOAD_STATUS_* */
+typedef uint8_t (*upload_crypt_out_t)(const uint8_t *data, size_t len);
+
+#if defined(CONFIG_KEYPAD_UPLOAD_CRYPT)
+
+/* Start decrypting an upload of len plaintext bytes to target */
+uint8_t upload_crypt_begin(uint8_t target, uint16_t len);
+
+/*
+ * Next bytes on the wire, the nonce, the ciphertext or the tag. The
+ * plaintext goes to out; anything past the tag is ignored.
+ */
+uint8_t upload_crypt_data(const uint8_t *data, size_t len,
+			  upload_crypt_out_t out);
+
+/*
+ * All bytes are in: check the tag, handing out the last plaintext.
+ * UPLOAD_STATUS_AUTH unless the upload is authentic and complete.
+ */
+uint8_t upload_crypt_end(upload_crypt_out_t out);
+
+void upload_crypt_abort(void);
+
+#else
+
+static inline uint8_t upload_crypt_begin(uint8_t target, uint16_t len)
+{
+	return UPLOAD_STATUS_UNSUPPORTED;
+}
+
+static inline uint8_t upload_crypt_data(const uint8_t *data, size_t len,
+					upload_crypt_out_t out)
+{
+	return UPLOAD_STATUS_UNSUPPORTED;
+}
+
+static inline uint8_t upload_crypt_end(upload_crypt_out_t out)
+{
+	return UPLOAD_STATUS_UNSUPPORTED;
+}
+
+static inline void upload_crypt_abort(void) {}
+
+#endif /* CONFIG_KEYPAD_UPLOAD_CRYPT */
+
+#endif /* KEYPAD_CONFIG_UPLOAD_CRYPT_H_ */
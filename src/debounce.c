@@ -0,0 +1,460 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Presses and releases have a policy each, an algorithm and a window.
+ * The policy that applies is that of the edge the key would take from
+ * its debounced state: the press policy while it is up, the release
+ * policy while it is down. A window after a reported eager edge is a
+ * hold-off of that edge's length and ignores the line; any other is a
+ * settle window, restarted by every edge. A key whose line is in the
+ * other state when a hold-off ends takes its next edge by the policy
+ * for it, at once if eager, after a quiet window if not.
+ *
+ * The vertical counters are the bits of one counter per key spread
+ * over CONFIG_KEYPAD_DEBOUNCE_VERTICAL_BITS bitmaps, bit k of plane i
+ * being bit i of the counter of key k. Adding one to every key that
+ * differs from its debounced state is a ripple carry through the
+ * planes, one XOR and two ANDs each; the carry out of the top plane is
+ * the set of keys that differed for 2^bits scans in a row, and their
+ * counters have wrapped back to 0 on the way. A key that reads as
+ * debounced has its counter cleared by the same AND.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/spinlock.h>
+
+#include "debounce.h"
+#include "hot_path.h"
+#include "diag/stage_bench.h"
+#include "diag/usage.h"
+#include "diag/watchdog.h"
+
+/* Chatter adds this to a key's score, a clean press takes one off */
+#define CHATTER_WEIGHT 4
+/* Score at which the window is doubled: two chatters in a few presses */
+#define CHATTER_LIMIT 8
+/* Clean presses in a row after which a widened window is halved */
+#define CHATTER_RELAX_PRESSES 1000
+
+/* Edge directions, the index of the per-edge policy */
+#define EDGE_PRESS 0
+#define EDGE_RELEASE 1
+
+/* Keys using the eager algorithm, for presses and for releases */
+static keypad_bitmap_t eager[2];
+/* Last raw level of every key */
+static keypad_bitmap_t raw_state;
+/* Debounced level of every key */
+static keypad_bitmap_t stable;
+/* Keys inside a settle or hold-off window, and those in a hold-off */
+static keypad_bitmap_t pending;
+static keypad_bitmap_t holdoff;
+/* End of the window of every pending key, in kernel ticks */
+static uint32_t deadline[KEYPAD_MAX_KEYS];
+/* Window length of every key for presses and releases, kernel ticks */
+static uint32_t window[2][KEYPAD_MAX_KEYS];
+static uint32_t rejects;
+
+#if defined(CONFIG_KEYPAD_DEBOUNCE_VERTICAL)
+/* Bit-planes of the per-key sample counters, plane 0 the lowest bit */
+static keypad_bitmap_t vertical[CONFIG_KEYPAD_DEBOUNCE_VERTICAL_BITS];
+#endif
+
+#if defined(CONFIG_KEYPAD_DEBOUNCE_ADAPT)
+/* Windows from the keymap, the narrowest adaptation goes back to */
+static uint32_t window_base[2][KEYPAD_MAX_KEYS];
+/* Debounced release of every key, in kernel ticks, 0 before the first */
+static uint32_t released_at[KEYPAD_MAX_KEYS];
+static uint8_t chatter_score[KEYPAD_MAX_KEYS];
+static uint16_t clean_presses[KEYPAD_MAX_KEYS];
+#endif
+
+static scan_handler_t debounce_out;
+static struct k_spinlock lock;
+static struct k_timer timer;
+
+static inline bool deadline_passed(uint32_t when, uint32_t now)
+{
+	return (int32_t)(when - now) <= 0;
+}
+
+/* Direction of the edge a key would take from its debounced state */
+static inline int edge_of(uint8_t key)
+{
+	return (stable & BIT(key)) ? EDGE_RELEASE : EDGE_PRESS;
+}
+
+static inline bool edge_eager(uint8_t key)
+{
+	return (eager[edge_of(key)] & BIT(key)) != 0;
+}
+
+static inline uint32_t edge_window(uint8_t key)
+{
+	return window[edge_of(key)][key];
+}
+
+#if defined(CONFIG_KEYPAD_DEBOUNCE_ADAPT)
+/*
+ * Follow the debounced transitions of one key, lock held. A press
+ * sooner after the release than a finger can tap is a bounce that got
+ * past the window. Each one scores CHATTER_WEIGHT and each clean press
+ * takes one point off, so a single stray bounce fades out while a
+ * switch that chatters twice in a few presses reaches CHATTER_LIMIT
+ * and gets its windows doubled, up to CONFIG_KEYPAD_DEBOUNCE_ADAPT_MAX_US.
+ * Only that key pays the extra latency. A long clean run halves them
+ * again, in case the cause was dirt rather than wear.
+ */
+static void debounce_adapt(uint8_t key, bool pressed, uint32_t now)
+{
+	uint32_t max = k_us_to_ticks_ceil32(
+		CONFIG_KEYPAD_DEBOUNCE_ADAPT_MAX_US);
+
+	if (!pressed) {
+		released_at[key] = now;
+		return;
+	}
+
+	if (released_at[key] != 0 && now - released_at[key] <
+	    k_ms_to_ticks_ceil32(CONFIG_KEYPAD_DEBOUNCE_CHATTER_MS)) {
+		chatter_score[key] = MIN(chatter_score[key] + CHATTER_WEIGHT,
+					 CHATTER_LIMIT);
+		clean_presses[key] = 0;
+		if (chatter_score[key] >= CHATTER_LIMIT &&
+		    (window[EDGE_PRESS][key] < max ||
+		     window[EDGE_RELEASE][key] < max)) {
+			for (int e = 0; e < 2; e++) {
+				window[e][key] = MIN(MAX(window[e][key] * 2, 1),
+						     max);
+			}
+			chatter_score[key] = 0;
+			usage_debounce_widened(key);
+		}
+		return;
+	}
+
+	chatter_score[key] -= chatter_score[key] > 0;
+	if ((window[EDGE_PRESS][key] > window_base[EDGE_PRESS][key] ||
+	     window[EDGE_RELEASE][key] > window_base[EDGE_RELEASE][key]) &&
+	    ++clean_presses[key] >= CHATTER_RELAX_PRESSES) {
+		for (int e = 0; e < 2; e++) {
+			window[e][key] = MAX(window[e][key] / 2,
+					     window_base[e][key]);
+		}
+		clean_presses[key] = 0;
+	}
+}
+
+static void debounce_adapt_all(keypad_bitmap_t accepted, uint32_t now)
+{
+	while (accepted != 0) {
+		uint8_t key = find_lsb_set(accepted) - 1;
+
+		accepted &= ~BIT(key);
+		debounce_adapt(key, (stable & BIT(key)) != 0, now);
+	}
+}
+#else
+static inline void debounce_adapt_all(keypad_bitmap_t accepted,
+				      uint32_t now) {}
+#endif /* CONFIG_KEYPAD_DEBOUNCE_ADAPT */
+
+/* Arm the shared timer for the earliest pending deadline */
+static void debounce_timer_arm(uint32_t now)
+{
+	keypad_bitmap_t keys = pending;
+	int32_t earliest = INT32_MAX;
+
+	/*
+	 * The timer armed before expired or is armed again here; under the
+	 * lock, like every post of the scan stage
+	 */
+	watchdog_done(WATCHDOG_SCAN, watchdog_seen(WATCHDOG_SCAN));
+
+	if (keys == 0) {
+		k_timer_stop(&timer);
+		return;
+	}
+
+	while (keys != 0) {
+		uint8_t key = find_lsb_set(keys) - 1;
+		int32_t left = (int32_t)(deadline[key] - now);
+
+		keys &= ~BIT(key);
+		earliest = MIN(earliest, left);
+	}
+
+	k_timer_start(&timer, K_TICKS(MAX(earliest, 1)), K_NO_WAIT);
+	watchdog_post(WATCHDOG_SCAN);
+}
+
+static void debounce_expire(struct k_timer *t)
+{
+	uint32_t now = k_uptime_ticks();
+	keypad_bitmap_t accepted = 0;
+	keypad_bitmap_t state;
+	k_spinlock_key_t key_lock = k_spin_lock(&lock);
+
+	for (keypad_bitmap_t keys = pending; keys != 0; ) {
+		uint8_t key = find_lsb_set(keys) - 1;
+
+		keys &= ~BIT(key);
+		if (!deadline_passed(deadline[key], now)) {
+			continue;
+		}
+
+		pending &= ~BIT(key);
+		if (((raw_state ^ stable) & BIT(key)) == 0) {
+			holdoff &= ~BIT(key);
+			continue;
+		}
+
+		/* Line ended the window in the other state */
+		if ((holdoff & BIT(key)) && !edge_eager(key)) {
+			/* The next edge settles first */
+			holdoff &= ~BIT(key);
+			pending |= BIT(key);
+			deadline[key] = now + edge_window(key);
+			continue;
+		}
+
+		accepted |= BIT(key);
+		WRITE_BIT(holdoff, key, edge_eager(key));
+		if (edge_eager(key)) {
+			/* Reported right away, so hold it off again */
+			pending |= BIT(key);
+			deadline[key] = now + edge_window(key);
+		}
+	}
+
+	stable ^= accepted;
+	state = stable;
+	debounce_adapt_all(accepted, now);
+	debounce_timer_arm(now);
+	k_spin_unlock(&lock, key_lock);
+
+	if (accepted != 0) {
+		debounce_out(state, accepted);
+	}
+}
+
+void debounce_input(keypad_bitmap_t raw, keypad_bitmap_t changed)
+{
+	uint32_t bench = stage_bench_begin();
+	uint32_t now = k_uptime_ticks();
+	keypad_bitmap_t accepted = 0;
+	keypad_bitmap_t state;
+	k_spinlock_key_t key_lock = k_spin_lock(&lock);
+
+	raw_state = raw;
+
+	while (changed != 0) {
+		uint8_t key = find_lsb_set(changed) - 1;
+
+		changed &= ~BIT(key);
+		if (pending & BIT(key)) {
+			rejects++;
+			if ((holdoff & BIT(key)) == 0) {
+				/* Still bouncing, restart the quiet window */
+				deadline[key] = now + edge_window(key);
+			}
+			continue;
+		}
+
+		if (edge_eager(key)) {
+			holdoff |= BIT(key);
+			if ((raw ^ stable) & BIT(key)) {
+				accepted |= BIT(key);
+			}
+		}
+
+		/* Of the edge just reported, before stable takes it */
+		pending |= BIT(key);
+		deadline[key] = now + edge_window(key);
+	}
+
+	stable ^= accepted;
+	state = stable;
+	debounce_adapt_all(accepted, now);
+	debounce_timer_arm(now);
+	k_spin_unlock(&lock, key_lock);
+	/* Up to the handoff, keys_changed() is not debounce */
+	stage_bench_end(STAGE_BENCH_DEBOUNCE, bench);
+
+	if (accepted != 0) {
+		debounce_out(state, accepted);
+	}
+}
+
+#if defined(CONFIG_KEYPAD_DEBOUNCE_VERTICAL)
+KEYPAD_HOT keypad_bitmap_t debounce_sample(keypad_bitmap_t raw)
+{
+	uint32_t bench = stage_bench_begin();
+	keypad_bitmap_t delta = raw ^ stable;
+	keypad_bitmap_t counting = 0;
+	keypad_bitmap_t carry = delta;
+
+	for (int i = 0; i < CONFIG_KEYPAD_DEBOUNCE_VERTICAL_BITS; i++) {
+		keypad_bitmap_t plane = vertical[i];
+
+		counting |= plane;
+		vertical[i] = (plane ^ carry) & delta;
+		carry &= plane;
+	}
+
+	/* Counters cleared before they ran out were bounces */
+	rejects += __builtin_popcount(counting & ~delta);
+	stable ^= carry;
+	stage_bench_end(STAGE_BENCH_DEBOUNCE, bench);
+
+	return carry;
+}
+
+keypad_bitmap_t debounce_state_get(void)
+{
+	return stable;
+}
+#endif /* CONFIG_KEYPAD_DEBOUNCE_VERTICAL */
+
+uint32_t debounce_reject_count(void)
+{
+	return rejects;
+}
+
+uint32_t debounce_window_us(uint8_t key, bool release)
+{
+	return key < KEYPAD_MAX_KEYS ?
+	       k_ticks_to_us_floor32(window[release][key]) : 0;
+}
+
+/* Policy of one edge direction of a key, lock held */
+static void debounce_policy(uint8_t key, int edge, uint8_t mode,
+			    uint32_t us)
+{
+	WRITE_BIT(eager[edge], key, mode == KEYPAD_DEBOUNCE_EAGER);
+	window[edge][key] = k_us_to_ticks_ceil32(us);
+#if defined(CONFIG_KEYPAD_DEBOUNCE_ADAPT)
+	window_base[edge][key] = window[edge][key];
+#endif
+}
+
+int debounce_policy_set(uint8_t key, bool release, uint8_t mode,
+			uint32_t us)
+{
+	k_spinlock_key_t key_lock;
+
+	if (key >= keypad_key_count || mode == KEYPAD_DEBOUNCE_DEFAULT ||
+	    mode > KEYPAD_DEBOUNCE_EAGER || us > UINT16_MAX) {
+		return -EINVAL;
+	}
+
+	/* The window running now keeps its deadline */
+	key_lock = k_spin_lock(&lock);
+	debounce_policy(key, release ? EDGE_RELEASE : EDGE_PRESS, mode, us);
+	k_spin_unlock(&lock, key_lock);
+
+	return 0;
+}
+
+void debounce_init(scan_handler_t out)
+{
+	debounce_out = out;
+	k_timer_init(&timer, debounce_expire, NULL);
+
+	for (size_t i = 0; i < keypad_key_count; i++) {
+		const struct keypad_key *key = &keypad_keys[i];
+		uint32_t us = key->debounce_us ? key->debounce_us :
+			      CONFIG_KEYPAD_DEBOUNCE_US;
+		uint8_t mode = key->debounce_mode;
+
+		if (mode == KEYPAD_DEBOUNCE_DEFAULT) {
+			mode = IS_ENABLED(CONFIG_KEYPAD_DEBOUNCE_MODE_EAGER) ?
+			       KEYPAD_DEBOUNCE_EAGER : KEYPAD_DEBOUNCE_SETTLE;
+		}
+
+		debounce_policy(i, EDGE_PRESS, mode, us);
+
+		/* Releases as presses unless the keymap says otherwise */
+		if (key->release_debounce_mode != KEYPAD_DEBOUNCE_DEFAULT) {
+			mode = key->release_debounce_mode;
+		}
+		if (key->release_debounce_us != 0) {
+			us = key->release_debounce_us;
+		}
+
+		debounce_policy(i, EDGE_RELEASE, mode, us);
+	}
+}
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static int cmd_debounce_show(const struct shell *sh, size_t argc,
+			     char **argv)
+{
+	shell_print(sh, "%u edges rejected", rejects);
+
+	for (uint8_t i = 0; i < keypad_key_count; i++) {
+		shell_print(sh, "key %2u: press %s %u us, release %s %u us", i,
+			    (eager[EDGE_PRESS] & BIT(i)) ? "eager" : "settle",
+			    debounce_window_us(i, false),
+			    (eager[EDGE_RELEASE] & BIT(i)) ? "eager" : "settle",
+			    debounce_window_us(i, true));
+	}
+
+	return 0;
+}
+
+static int cmd_debounce_set(const struct shell *sh, size_t argc,
+			    char **argv)
+{
+	unsigned long key = strtoul(argv[1], NULL, 0);
+	bool release = strcmp(argv[2], "release") == 0;
+	uint8_t mode;
+	int err;
+
+	/* Range check before narrowing, or 256 would land on key 0 */
+	if (key >= keypad_key_count) {
+		shell_error(sh, "Key is 0 to %zu", keypad_key_count - 1);
+		return -EINVAL;
+	}
+
+	if (!release && strcmp(argv[2], "press") != 0) {
+		shell_error(sh, "Edge is press or release");
+		return -EINVAL;
+	}
+
+	if (strcmp(argv[3], "eager") == 0) {
+		mode = KEYPAD_DEBOUNCE_EAGER;
+	} else if (strcmp(argv[3], "settle") == 0) {
+		mode = KEYPAD_DEBOUNCE_SETTLE;
+	} else {
+		shell_error(sh, "Mode is settle or eager");
+		return -EINVAL;
+	}
+
+	err = debounce_policy_set((uint8_t)key, release, mode,
+				  strtoul(argv[4], NULL, 0));
+	if (err) {
+		shell_error(sh, "Window is at most %u us", UINT16_MAX);
+	}
+
+	return err;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_debounce,
+	SHELL_CMD(show, NULL, "Print the press and release policy per key",
+		  cmd_debounce_show),
+	SHELL_CMD_ARG(set, NULL, "Set an edge's policy until reboot: <key> "
+		      "press|release settle|eager <us>", cmd_debounce_set, 5,
+		      0),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(debounce, &sub_debounce, "Software debounce", NULL);
+#endif /* CONFIG_SHELL */
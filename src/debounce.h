@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Software debounce for the GPIO edge path. Every key runs either the
+ * settle algorithm (wait for a quiet window) or the eager algorithm
+ * (report the first edge, then hold the key off for the window). All
+ * windows share one kernel timer armed for the earliest deadline. With
+ * CONFIG_KEYPAD_DEBOUNCE_ADAPT a key that chatters gets a wider window
+ * of its own.
+ *
+ * Presses and releases are debounced by policies of their own from
+ * the keymap, release-debounce-mode and release-debounce-us, so a key
+ * can take an eager press and a settled release or, for a switch as
+ * clean as it is quick to let go, release with no delay at all.
+ *
+ * With CONFIG_KEYPAD_DEBOUNCE_VERTICAL the matrix and shift register
+ * backends, which read every key on every scan, are debounced by
+ * sample count instead: a key changes state once it has read the other
+ * way for 2^CONFIG_KEYPAD_DEBOUNCE_VERTICAL_BITS scans in a row. The
+ * counters of all keys are updated together by a few bitwise
+ * operations per scan, whatever the key count, and no timer is armed.
+ * The per-key policies and the adaptation do not apply to them.
+ */
+
+#ifndef KEYPAD_DEBOUNCE_H_
+#define KEYPAD_DEBOUNCE_H_
+
+#include "scan.h"
+
+/* Debounced state changes are delivered to out, possibly from ISR */
+void debounce_init(scan_handler_t out);
+
+/*
+ * Feed a raw scan result. raw is the current level of every key,
+ * changed the keys whose level differs from the previous raw scan.
+ */
+void debounce_input(keypad_bitmap_t raw, keypad_bitmap_t changed);
+
+#if defined(CONFIG_KEYPAD_DEBOUNCE_VERTICAL)
+/*
+ * Feed a complete scan, every key's level. Returns the keys whose
+ * debounced state changed, the state itself from debounce_state_get().
+ * From the one context the backend scans in.
+ */
+keypad_bitmap_t debounce_sample(keypad_bitmap_t raw);
+keypad_bitmap_t debounce_state_get(void);
+#endif
+
+/* Edges inside a window since boot, bounce the windows filtered out */
+uint32_t debounce_reject_count(void);
+
+/* Press or release window of a key right now, in microseconds */
+uint32_t debounce_window_us(uint8_t key, bool release);
+
+/*
+ * Replace the press or release policy of a key until reboot, mode
+ * KEYPAD_DEBOUNCE_SETTLE or _EAGER, for tuning each edge direction
+ * with a latency harness. -EINVAL for a bad key, mode or window.
+ */
+int debounce_policy_set(uint8_t key, bool release, uint8_t mode,
+			uint32_t us);
+
+#endif /* KEYPAD_DEBOUNCE_H_ */
@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Blocks are compressed independently, so decompressing one needs
+ * nothing from the ones before it and RAM is one compressed and one
+ * plain block, not an LZ4 window. flash_img erases the slot page by
+ * page ahead of the writes (CONFIG_IMG_ERASE_PROGRESSIVELY), with no
+ * erase of the whole slot up front to stall the CPU for a second.
+ *
+ * All calls come from the upload transport, one owner at a time, and
+ * need no lock.
+ */
+
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/dfu/flash_img.h>
+#include <zephyr/dfu/mcuboot.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/reboot.h>
+#include <zephyr/logging/log.h>
+
+#include <lz4.h>
+
+#if defined(CONFIG_MCUMGR_SMP_BT)
+#include <zephyr/mgmt/mcumgr/smp_bt.h>
+#include "img_mgmt/img_mgmt.h"
+#include "os_mgmt/os_mgmt.h"
+#endif
+
+#include "config/config_store.h"
+#include "dfu/dfu.h"
+
+LOG_MODULE_REGISTER(dfu, LOG_LEVEL_INF);
+
+#define BLOCK_SIZE CONFIG_KEYPAD_DFU_BLOCK_SIZE
+#define BLOCK_BOUND LZ4_COMPRESSBOUND(BLOCK_SIZE)
+/* Leaves room for the ack of the end and the config store's flush */
+#define REBOOT_DELAY_MS 1000
+
+BUILD_ASSERT(BLOCK_BOUND <= DFU_BLOCK_LEN_MASK, "blocks too large");
+
+static struct flash_img_context img;
+static bool writing;
+
+/* Header and payload of the block being received */
+static uint8_t block[2 + BLOCK_BOUND];
+static size_t block_len;
+static uint8_t plain[BLOCK_SIZE];
+
+static uint32_t bytes_in;
+static uint32_t bytes_out;
+
+static size_t block_needed(void)
+{
+	if (block_len < 2) {
+		return 2;
+	}
+
+	return 2 + (sys_get_le16(block) & DFU_BLOCK_LEN_MASK);
+}
+
+static int block_write(void)
+{
+	uint16_t hdr = sys_get_le16(block);
+	size_t len = hdr & DFU_BLOCK_LEN_MASK;
+	const uint8_t *out = &block[2];
+	int n = len;
+
+	if (!(hdr & DFU_BLOCK_STORED)) {
+		n = LZ4_decompress_safe((const char *)&block[2],
+					(char *)plain, len, sizeof(plain));
+		if (n < 0) {
+			LOG_ERR("Block at image offset %u does not decompress",
+				bytes_out);
+			return -EILSEQ;
+		}
+
+		out = plain;
+	} else if (len > BLOCK_SIZE) {
+		return -EMSGSIZE;
+	}
+
+	bytes_out += n;
+
+	return flash_img_buffered_write(&img, out, n, false);
+}
+
+int dfu_begin(void)
+{
+	int ret;
+
+	ret = flash_img_init(&img);
+	if (ret < 0) {
+		LOG_ERR("No secondary slot, error: %d", ret);
+		return ret;
+	}
+
+	writing = true;
+	block_len = 0;
+	bytes_in = 0;
+	bytes_out = 0;
+
+	return 0;
+}
+
+int dfu_data(const uint8_t *data, size_t len)
+{
+	if (!writing) {
+		return -EACCES;
+	}
+
+	bytes_in += len;
+
+	while (len > 0) {
+		size_t n;
+		int ret;
+
+		if (block_len == 2 && block_needed() > sizeof(block)) {
+			writing = false;
+			return -EMSGSIZE;
+		}
+
+		n = MIN(len, block_needed() - block_len);
+		memcpy(&block[block_len], data, n);
+		block_len += n;
+		data += n;
+		len -= n;
+
+		if (block_len < block_needed()) {
+			continue;
+		}
+
+		ret = block_write();
+		block_len = 0;
+		if (ret < 0) {
+			writing = false;
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static void dfu_reboot(struct k_work *work)
+{
+	sys_reboot(SYS_REBOOT_WARM);
+}
+
+static K_WORK_DELAYABLE_DEFINE(reboot_work, dfu_reboot);
+
+int dfu_end(void)
+{
+	int ret;
+
+	if (!writing) {
+		return -EACCES;
+	}
+
+	writing = false;
+
+	if (block_len != 0) {
+		/* The stream stopped inside a block */
+		return -EINVAL;
+	}
+
+	ret = flash_img_buffered_write(&img, NULL, 0, true);
+	if (ret < 0) {
+		return ret;
+	}
+
+	ret = boot_request_upgrade(BOOT_UPGRADE_TEST);
+	if (ret < 0) {
+		LOG_ERR("Failed to mark the image for test, error: %d", ret);
+		return ret;
+	}
+
+	LOG_INF("Image of %u bytes in, %u received, rebooting", bytes_out,
+		bytes_in);
+
+	config_store_flush();
+	k_work_schedule(&reboot_work, K_MSEC(REBOOT_DELAY_MS));
+
+	return 0;
+}
+
+void dfu_abort(void)
+{
+	/* What was written stays unmarked, MCUboot ignores it */
+	writing = false;
+}
+
+int dfu_init(void)
+{
+	int ret;
+
+#if defined(CONFIG_MCUMGR_SMP_BT)
+	os_mgmt_register_group();
+	img_mgmt_register_group();
+
+	ret = smp_bt_register();
+	if (ret < 0) {
+		LOG_ERR("Failed to register the SMP service, error: %d", ret);
+	}
+#endif
+
+	if (boot_is_img_confirmed()) {
+		return 0;
+	}
+
+	/* Reaching here means scanning and the report path came up */
+	ret = boot_write_img_confirmed();
+	if (ret < 0) {
+		LOG_ERR("Failed to confirm the image, error: %d", ret);
+		return ret;
+	}
+
+	LOG_INF("Image confirmed");
+
+	return 0;
+}
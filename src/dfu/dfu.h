@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Firmware updates into the MCUboot secondary slot, uploaded as
+ * UPLOAD_TARGET_DFU over raw HID or WebUSB. The image comes as a
+ * stream of blocks, each one le16 header and its payload:
+ *
+ *   bit 15      payload stored as is
+ *   bits 0..14  payload length
+ *
+ * A payload is CONFIG_KEYPAD_DFU_BLOCK_SIZE bytes of image or less,
+ * LZ4 block compressed on its own unless stored. Blocks are
+ * decompressed and written to the slot as they come in, and the keys
+ * keep working while they are. The end of the upload marks the image
+ * for a test swap and reboots into it; the new image confirms itself
+ * once it has come up. Over BLE, overlay-dfu.conf adds the standard
+ * MCUmgr image upload instead.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_DFU is enabled.
+ */
+
+#ifndef KEYPAD_DFU_DFU_H_
+#define KEYPAD_DFU_DFU_H_
+
+#include <zephyr/zephyr.h>
+
+#define DFU_BLOCK_STORED BIT(15)
+#define DFU_BLOCK_LEN_MASK GENMASK(14, 0)
+
+#if defined(CONFIG_KEYPAD_DFU)
+
+/* Confirm the running image if it is on test, once the keypad is up */
+int dfu_init(void);
+
+/* Start writing a new image to the secondary slot */
+int dfu_begin(void);
+
+/* Next bytes of the block stream, blocks may span calls */
+int dfu_data(const uint8_t *data, size_t len);
+
+/* All blocks are in: request the swap and reboot */
+int dfu_end(void);
+
+void dfu_abort(void);
+
+#else
+
+static inline int dfu_init(void)
+{
+	return 0;
+}
+
+static inline int dfu_begin(void)
+{
+	return -ENOTSUP;
+}
+
+static inline int dfu_data(const uint8_t *data, size_t len)
+{
+	return -ENOTSUP;
+}
+
+static inline int dfu_end(void)
+{
+	return -ENOTSUP;
+}
+
+static inline void dfu_abort(void) {}
+
+#endif /* CONFIG_KEYPAD_DFU */
+
+#endif /* KEYPAD_DFU_DFU_H_ */
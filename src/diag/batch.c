@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * A subscriber of the event bus, so it sees every transition the scan
+ * put in the ring, before the report thread folds them into keyboard
+ * reports, and never holds the producer back. The reader is only read
+ * from the raw HID send work, one report at a time; what the ring kept
+ * is the backlog, there is no queue of its own. Events are turned into
+ * us of uptime as they are taken from the ring, and those a report had
+ * no room for wait in pending[] for the next one.
+ */
+
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/init.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/sys/byteorder.h>
+
+#include "diag/batch.h"
+#include "diag/latency.h"
+#include "event_ring.h"
+#include "timebase.h"
+#include "usb/raw_hid.h"
+
+BUILD_ASSERT(BATCH_HEADER_SIZE + BATCH_MAX_EVENTS * BATCH_EVENT_SIZE <=
+	     RAW_HID_REPORT_SIZE, "a batch must fit a raw HID report");
+
+struct batch_event {
+	uint32_t us;
+	uint8_t key;
+	bool pressed;
+};
+
+static void batch_notify(void);
+
+static struct event_ring_sub sub = {
+	.name = "batch",
+	.notify = batch_notify,
+};
+
+static struct k_spinlock lock;
+static void (*ready_cb)(void);
+
+/* Taken from the ring, not sent yet */
+static struct batch_event pending[BATCH_MAX_EVENTS];
+static size_t pending_len;
+/* sub.reader.missed at the last report */
+static uint32_t missed_base;
+static uint8_t number;
+
+static void batch_notify(void)
+{
+	void (*ready)(void);
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	ready = ready_cb;
+	k_spin_unlock(&lock, key);
+
+	if (ready != NULL) {
+		ready();
+	}
+}
+
+void batch_enable(void (*ready)(void))
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	ready_cb = ready;
+	event_ring_reader_init(&sub.reader);
+	missed_base = 0;
+	pending_len = 0;
+
+	k_spin_unlock(&lock, key);
+}
+
+/* Move what pending[] has room for out of the ring */
+static void batch_take(void)
+{
+	struct key_event events[BATCH_MAX_EVENTS];
+	uint32_t now;
+	uint32_t now_us;
+	size_t n;
+
+	n = event_ring_read(&sub.reader, events,
+			    ARRAY_SIZE(pending) - pending_len);
+	now = latency_timestamp();
+	now_us = timebase_uptime_us32();
+
+	for (size_t i = 0; i < n; i++) {
+		pending[pending_len++] = (struct batch_event){
+			.us = now_us - latency_to_us(now - events[i].timestamp),
+			.key = events[i].key,
+			.pressed = events[i].pressed,
+		};
+	}
+}
+
+size_t batch_read(uint8_t *buf, size_t len)
+{
+	size_t max = MIN((len - BATCH_HEADER_SIZE) / BATCH_EVENT_SIZE,
+			 BATCH_MAX_EVENTS);
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	uint8_t *out = &buf[BATCH_HEADER_SIZE];
+	size_t count = 0;
+	uint32_t first;
+
+	if (ready_cb == NULL) {
+		k_spin_unlock(&lock, key);
+		return 0;
+	}
+
+	batch_take();
+	if (pending_len == 0) {
+		k_spin_unlock(&lock, key);
+		return 0;
+	}
+
+	first = pending[0].us;
+	buf[0] = RAW_HID_IN_BATCH;
+	buf[1] = number++;
+	buf[3] = MIN(sub.reader.missed - missed_base, UINT8_MAX);
+	sys_put_le32(first, &buf[4]);
+	missed_base = sub.reader.missed;
+
+	while (count < MIN(pending_len, max) &&
+	       pending[count].us - first <= UINT16_MAX) {
+		const struct batch_event *e = &pending[count];
+
+		out[0] = e->key;
+		out[1] = e->pressed;
+		sys_put_le16(e->us - first, &out[2]);
+		out += BATCH_EVENT_SIZE;
+		count++;
+	}
+
+	buf[2] = count;
+	pending_len -= count;
+	memmove(pending, &pending[count], pending_len * sizeof(pending[0]));
+
+	k_spin_unlock(&lock, key);
+
+	return BATCH_HEADER_SIZE + count * BATCH_EVENT_SIZE;
+}
+
+static int batch_init(const struct device *dev)
+{
+	ARG_UNUSED(dev);
+
+	event_ring_subscribe(&sub);
+
+	return 0;
+}
+
+SYS_INIT(batch_init, APPLICATION, 0);
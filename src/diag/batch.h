@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Every key transition for the host, batched. The keyboard interface
+ * carries the state of the keys, and a press and release inside one
+ * polling interval fold into a report that shows neither. Rhythm games
+ * and lab rigs need each transition: with the batches on, the raw HID
+ * interface sends them all, up to BATCH_MAX_EVENTS per report, so a
+ * 1 kHz burst of transitions takes a few reports instead of a thousand.
+ * The keyboard reports are the same as without.
+ *
+ * Off until the host turns it on with RAW_HID_CMD_BATCH. A report,
+ * little endian, see usb/raw_hid.h for byte 0:
+ *
+ *   [0]     RAW_HID_IN_BATCH
+ *   [1]     batch number, one more per report
+ *   [2]     events in this report
+ *   [3]     events missed since the last report, saturating
+ *   [4..7]  le32 time of the first event, us of uptime
+ *   [8..]   per event: u8 key, u8 1 press or 0 release, le16 us from
+ *           the first event
+ *
+ * Events follow each other in the order they happened and across
+ * reports. One more than 65 ms after the first of a report starts the
+ * next one. With CONFIG_KEYPAD_LATENCY_EDGE the times are the hardware
+ * captured first edges, otherwise those of the scan interrupt.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_EVENT_BATCH is enabled.
+ */
+
+#ifndef KEYPAD_DIAG_BATCH_H_
+#define KEYPAD_DIAG_BATCH_H_
+
+#include <zephyr/zephyr.h>
+
+#define BATCH_HEADER_SIZE 8
+#define BATCH_EVENT_SIZE 4
+/* Events a 64-byte report holds */
+#define BATCH_MAX_EVENTS ((64 - BATCH_HEADER_SIZE) / BATCH_EVENT_SIZE)
+
+#if defined(CONFIG_KEYPAD_EVENT_BATCH)
+
+/*
+ * Start sending, ready is called from the scan interrupt when events
+ * can be read; NULL stops and drops those not read yet.
+ */
+void batch_enable(void (*ready)(void));
+
+/* Fill one batch report into buf, 0 if there is nothing to send */
+size_t batch_read(uint8_t *buf, size_t len);
+
+#else
+
+static inline void batch_enable(void (*ready)(void)) {}
+
+static inline size_t batch_read(uint8_t *buf, size_t len)
+{
+	return 0;
+}
+
+#endif /* CONFIG_KEYPAD_EVENT_BATCH */
+
+#endif /* KEYPAD_DIAG_BATCH_H_ */
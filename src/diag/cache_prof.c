@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Hit and miss counters of the app core cache, which sits between the
+ * core and flash. Counting starts at boot and on "cache reset"; type
+ * for a while, then "cache show". Code in RAM, CONFIG_KEYPAD_HOT_RAM,
+ * does not go through the cache and is not counted.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/init.h>
+#include <zephyr/shell/shell.h>
+
+#include <hal/nrf_cache.h>
+
+/* Hits per thousand lookups */
+static uint32_t cache_permille(uint32_t hits, uint32_t misses)
+{
+	uint64_t total = (uint64_t)hits + misses;
+
+	return total != 0 ? (uint32_t)(hits * 1000ULL / total) : 0;
+}
+
+static int cache_prof_init(const struct device *dev)
+{
+	ARG_UNUSED(dev);
+
+	nrf_cache_profiling_counters_clear(NRF_CACHE);
+	nrf_cache_profiling_set(NRF_CACHE, true);
+
+	return 0;
+}
+
+SYS_INIT(cache_prof_init, APPLICATION, 0);
+
+static int cmd_cache_show(const struct shell *sh, size_t argc, char **argv)
+{
+	uint32_t ihit = nrf_cache_instruction_hit_counter_get(NRF_CACHE);
+	uint32_t imiss = nrf_cache_instruction_miss_counter_get(NRF_CACHE);
+	uint32_t dhit = nrf_cache_data_hit_counter_get(NRF_CACHE);
+	uint32_t dmiss = nrf_cache_data_miss_counter_get(NRF_CACHE);
+	uint32_t rate;
+
+	shell_print(sh, "cache %s", NRF_CACHE->ENABLE ? "on" : "off");
+
+	rate = cache_permille(ihit, imiss);
+	shell_print(sh, "instruction: %u hits, %u misses, %u.%u%% hit",
+		    ihit, imiss, rate / 10, rate % 10);
+	rate = cache_permille(dhit, dmiss);
+	shell_print(sh, "data: %u hits, %u misses, %u.%u%% hit",
+		    dhit, dmiss, rate / 10, rate % 10);
+
+	return 0;
+}
+
+static int cmd_cache_reset(const struct shell *sh, size_t argc, char **argv)
+{
+	nrf_cache_profiling_counters_clear(NRF_CACHE);
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_cache,
+	SHELL_CMD(show, NULL, "Print the cache hit and miss counters",
+		  cmd_cache_show),
+	SHELL_CMD(reset, NULL, "Start counting again", cmd_cache_reset),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(cache, &sub_cache, "App core cache profiling", NULL);
@@ -0,0 +1,312 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * A subscriber of the event bus like the batches, so the fixture's
+ * presses are seen as the scan put them in the ring, whatever the
+ * keyboard reports fold together. The reader is drained on the system
+ * work queue after every batch of events into one record per key,
+ * which is all the result needs: the first press, the last release and
+ * the count of presses. The outputs are all started in the same pass
+ * and run on their own peripherals meanwhile, so the test takes as
+ * long as the fixture does and no longer.
+ */
+
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/init.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/sys/byteorder.h>
+
+#include "diag/factory.h"
+#include "diag/latency.h"
+#include "event_ring.h"
+#include "feedback/click.h"
+#include "feedback/haptic.h"
+#include "keymap.h"
+#include "led/led_pwm.h"
+#include "led/led_rgb.h"
+#include "power/battery.h"
+#include "timebase.h"
+
+#if defined(CONFIG_KEYPAD_LED_RGB)
+#define FACTORY_RGB_LEN DT_PROP(DT_ALIAS(led_strip), chain_length)
+#else
+#define FACTORY_RGB_LEN 0
+#endif
+/* RLE runs of full white covering the strip */
+#define FACTORY_RGB_RUNS DIV_ROUND_UP(FACTORY_RGB_LEN, UINT8_MAX)
+
+struct factory_key {
+	/* us of uptime */
+	uint32_t first_press;
+	uint32_t last_release;
+	uint16_t presses;
+	uint16_t releases;
+};
+
+static void factory_notify(void);
+static void factory_take(struct k_work *work);
+static void factory_end(struct k_work *work);
+
+static struct event_ring_sub sub = {
+	.name = "factory",
+	.notify = factory_notify,
+};
+
+static K_WORK_DEFINE(take_work, factory_take);
+static K_WORK_DELAYABLE_DEFINE(end_work, factory_end);
+
+/*
+ * Only touched from the system work queue while the test runs, but for
+ * failed, which the render thread clears
+ */
+static struct k_spinlock lock;
+static uint8_t state;
+static void (*done_cb)(void);
+static struct factory_key keys[KEYPAD_MAX_KEYS];
+static uint32_t start_us;
+static uint32_t start_ms;
+static uint16_t transitions;
+static uint8_t driven;
+static uint8_t failed;
+
+/* Written at the end, read by the host */
+static uint8_t result[FACTORY_RESULT_SIZE];
+
+static void factory_notify(void)
+{
+	if (state == FACTORY_RUNNING) {
+		k_work_submit(&take_work);
+	}
+}
+
+static inline keypad_bitmap_t factory_all_keys(void)
+{
+	return keypad_key_count >= 32 ? UINT32_MAX :
+					BIT(keypad_key_count) - 1;
+}
+
+/* Keys pressed and released exactly once */
+static keypad_bitmap_t factory_passed(void)
+{
+	keypad_bitmap_t passed = 0;
+
+	for (size_t i = 0; i < keypad_key_count; i++) {
+		if (keys[i].presses == 1 && keys[i].releases == 1) {
+			passed |= BIT(i);
+		}
+	}
+
+	return passed;
+}
+
+static void factory_take(struct k_work *work)
+{
+	struct key_event events[16];
+	uint32_t now;
+	uint32_t now_us;
+	size_t n;
+
+	if (state != FACTORY_RUNNING) {
+		return;
+	}
+
+	while ((n = event_ring_read(&sub.reader, events,
+				    ARRAY_SIZE(events))) > 0) {
+		now = latency_timestamp();
+		now_us = timebase_uptime_us32();
+
+		for (size_t i = 0; i < n; i++) {
+			struct factory_key *k = &keys[events[i].key];
+			uint32_t us = now_us -
+				      latency_to_us(now - events[i].timestamp);
+
+			if (events[i].pressed) {
+				if (k->presses++ == 0) {
+					k->first_press = us;
+				}
+			} else if (k->presses > 0) {
+				/* A key held at the start is not counted */
+				k->last_release = us;
+				k->releases++;
+			}
+			transitions++;
+		}
+	}
+
+	if (factory_passed() == factory_all_keys()) {
+		/* Every key is done, no need to wait out the window */
+		k_work_reschedule(&end_work, K_NO_WAIT);
+	}
+}
+
+static void factory_rgb_shown(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	failed &= ~FACTORY_OUT_RGB;
+	k_spin_unlock(&lock, key);
+}
+
+/* Everything at once, each on its own peripheral */
+static void factory_outputs(bool on)
+{
+	if (IS_ENABLED(CONFIG_KEYPAD_LED_PWM)) {
+		for (uint8_t i = 0; i < LED_PWM_COUNT; i++) {
+			led_pwm_level_set(i, on ? LED_PWM_MAX : 0);
+		}
+		driven |= FACTORY_OUT_PWM;
+	}
+
+	if (IS_ENABLED(CONFIG_KEYPAD_LED_RGB) && on) {
+		uint8_t runs[MAX(FACTORY_RGB_RUNS, 1)][4];
+		size_t left = FACTORY_RGB_LEN;
+
+		for (size_t i = 0; i < FACTORY_RGB_RUNS; i++) {
+			runs[i][0] = MIN(left, UINT8_MAX);
+			memset(&runs[i][1], UINT8_MAX, 3);
+			left -= runs[i][0];
+		}
+
+		/* Until the vsync says it is on the strip */
+		driven |= FACTORY_OUT_RGB;
+		failed |= FACTORY_OUT_RGB;
+		if (led_rgb_stream_write(LED_RGB_FORMAT_RLE, 0,
+					 FACTORY_RGB_LEN,
+					 (const uint8_t *)runs,
+					 FACTORY_RGB_RUNS * 4) == 0) {
+			(void)led_rgb_stream_sync(factory_rgb_shown);
+		}
+		/* Back to the effects after the stream timeout */
+	}
+
+	if (IS_ENABLED(CONFIG_KEYPAD_HAPTIC) && on) {
+		haptic_press();
+		driven |= FACTORY_OUT_HAPTIC;
+	}
+
+	if (IS_ENABLED(CONFIG_KEYPAD_CLICK) && on) {
+		click_press();
+		driven |= FACTORY_OUT_CLICK;
+	}
+}
+
+int factory_start(uint16_t window_ms, void (*done)(void))
+{
+	if (state == FACTORY_RUNNING) {
+		return -EBUSY;
+	}
+
+	if (window_ms == 0) {
+		window_ms = CONFIG_KEYPAD_FACTORY_WINDOW_MS;
+	}
+
+	memset(keys, 0, sizeof(keys));
+	transitions = 0;
+	driven = 0;
+	failed = 0;
+	done_cb = done;
+	event_ring_reader_init(&sub.reader);
+	start_us = timebase_uptime_us32();
+	start_ms = k_uptime_get_32();
+	state = FACTORY_RUNNING;
+
+	factory_outputs(true);
+	k_work_reschedule(&end_work, K_MSEC(window_ms));
+
+	return 0;
+}
+
+static void factory_end(struct k_work *work)
+{
+	keypad_bitmap_t pressed = 0;
+	keypad_bitmap_t chatter = 0;
+	uint32_t first = UINT32_MAX;
+	uint32_t last = 0;
+	uint32_t hold_min = UINT32_MAX;
+	uint32_t hold_max = 0;
+	k_spinlock_key_t key;
+
+	if (state != FACTORY_RUNNING) {
+		return;
+	}
+
+	/* The last events; take_work runs on this queue, so no more */
+	factory_take(NULL);
+	factory_outputs(false);
+
+	for (size_t i = 0; i < keypad_key_count; i++) {
+		const struct factory_key *k = &keys[i];
+
+		if (k->presses == 0) {
+			continue;
+		}
+
+		pressed |= BIT(i);
+		if (k->presses > 1) {
+			chatter |= BIT(i);
+		}
+		first = MIN(first, k->first_press - start_us);
+		last = MAX(last, k->first_press - start_us);
+		if (k->releases > 0) {
+			hold_min = MIN(hold_min, k->last_release -
+						 k->first_press);
+			hold_max = MAX(hold_max, k->last_release -
+						 k->first_press);
+		}
+	}
+
+	key = k_spin_lock(&lock);
+	memset(result, 0, sizeof(result));
+	result[0] = FACTORY_DONE;
+	result[1] = keypad_key_count;
+	result[2] = driven;
+	result[3] = failed;
+	k_spin_unlock(&lock, key);
+
+	sys_put_le32(factory_passed(), &result[4]);
+	sys_put_le32(chatter, &result[8]);
+	sys_put_le32(factory_all_keys() & ~pressed, &result[12]);
+	sys_put_le32(pressed != 0 ? first : 0, &result[16]);
+	sys_put_le32(pressed != 0 ? last - first : 0, &result[20]);
+	sys_put_le32(hold_max > 0 ? hold_min : 0, &result[24]);
+	sys_put_le32(hold_max, &result[28]);
+	sys_put_le16(transitions, &result[32]);
+	sys_put_le16(MIN(sub.reader.missed, UINT16_MAX), &result[34]);
+	sys_put_le16(battery_mv_get(), &result[36]);
+	sys_put_le16(k_uptime_get_32() - start_ms, &result[38]);
+	state = FACTORY_DONE;
+
+	if (done_cb != NULL) {
+		done_cb();
+	}
+}
+
+size_t factory_read(uint8_t *buf, size_t len)
+{
+	size_t n = MIN(len, sizeof(result));
+
+	if (state == FACTORY_RUNNING) {
+		memset(buf, 0, n);
+		buf[0] = FACTORY_RUNNING;
+		return n;
+	}
+
+	memcpy(buf, result, n);
+
+	return n;
+}
+
+static int factory_init(const struct device *dev)
+{
+	ARG_UNUSED(dev);
+
+	event_ring_subscribe(&sub);
+
+	return 0;
+}
+
+SYS_INIT(factory_init, APPLICATION, 0);
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Factory test for the production line. One command starts it: every
+ * output is driven at once, the PWM LEDs and the RGB strip at full
+ * white, the haptic motor and the click, and for up to a window of
+ * milliseconds every key transition is recorded with its time while
+ * the fixture presses all keys together. The test ends as soon as
+ * every key has been pressed and released, or at the end of the
+ * window, and answers with one result, little endian:
+ *
+ *   [0]       FACTORY_IDLE, FACTORY_RUNNING or FACTORY_DONE
+ *   [1]       keys tested, keypad_key_count
+ *   [2]       outputs driven, FACTORY_OUT_* bits
+ *   [3]       outputs that failed, FACTORY_OUT_* bits
+ *   [4..7]    le32 keys pressed and released exactly once
+ *   [8..11]   le32 keys pressed more than once, chatter
+ *   [12..15]  le32 keys never pressed
+ *   [16..19]  le32 us from the start to the first press
+ *   [20..23]  le32 us from the first press to the last
+ *   [24..27]  le32 us of the shortest hold, of keys released
+ *   [28..31]  le32 us of the longest hold
+ *   [32..33]  le16 transitions recorded
+ *   [34..35]  le16 transitions missed, the event ring lapped the test
+ *   [36..37]  le16 battery mV, 0 without a battery
+ *   [38..39]  le16 ms the test ran
+ *
+ * Only the RGB strip can fail here, when its frame is refused or not on
+ * the strip by the end; the PWM LEDs, the motor and the click have no
+ * way back and are checked by the fixture's camera and microphone. A
+ * unit passes with all of [4..7] set for its keys, [8..15] clear and
+ * [3] clear.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_FACTORY_TEST is enabled.
+ */
+
+#ifndef KEYPAD_DIAG_FACTORY_H_
+#define KEYPAD_DIAG_FACTORY_H_
+
+#include <zephyr/zephyr.h>
+
+#define FACTORY_IDLE 0x00
+#define FACTORY_RUNNING 0x01
+#define FACTORY_DONE 0x02
+
+#define FACTORY_OUT_PWM BIT(0)
+#define FACTORY_OUT_RGB BIT(1)
+#define FACTORY_OUT_HAPTIC BIT(2)
+#define FACTORY_OUT_CLICK BIT(3)
+
+#define FACTORY_RESULT_SIZE 40
+
+#if defined(CONFIG_KEYPAD_FACTORY_TEST)
+
+/*
+ * Start the test, window_ms 0 for CONFIG_KEYPAD_FACTORY_WINDOW_MS. done
+ * is called from the system work queue once the result can be read.
+ * -EBUSY while a test is running.
+ */
+int factory_start(uint16_t window_ms, void (*done)(void));
+
+/* Copy the result of the last test into buf, returns its length */
+size_t factory_read(uint8_t *buf, size_t len);
+
+#else
+
+static inline int factory_start(uint16_t window_ms, void (*done)(void))
+{
+	return -ENOTSUP;
+}
+
+static inline size_t factory_read(uint8_t *buf, size_t len)
+{
+	return 0;
+}
+
+#endif /* CONFIG_KEYPAD_FACTORY_TEST */
+
+#endif /* KEYPAD_DIAG_FACTORY_H_ */
@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * The records wait in a ring of CONFIG_KEYPAD_INJECT_QUEUE_SIZE, filled
+ * from the raw HID OUT report and played from a one-shot timer, or the
+ * SOF for a frame record, whichever is due. The whole pass runs under
+ * the lock, keys_changed() included: it takes interrupts out as the
+ * replay does, so the injector is the only producer of the event ring
+ * meanwhile, and a timer and a SOF arriving together cannot play two
+ * records out of order.
+ *
+ * Each record's time is the time the one before it was due, not when
+ * it played, so a late record does not push the rest of the script
+ * back.
+ */
+
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/sys/byteorder.h>
+
+#include "diag/inject.h"
+#include "keymap.h"
+#include "keys.h"
+#include "timebase.h"
+
+#define INJECT_QUEUE_MASK (CONFIG_KEYPAD_INJECT_QUEUE_SIZE - 1)
+
+BUILD_ASSERT((CONFIG_KEYPAD_INJECT_QUEUE_SIZE &
+	      INJECT_QUEUE_MASK) == 0,
+	     "CONFIG_KEYPAD_INJECT_QUEUE_SIZE must be a power of two");
+
+struct inject_record {
+	uint8_t key;
+	uint8_t flags;
+	uint16_t delay_us;
+};
+
+static void inject_expired(struct k_timer *timer);
+
+static K_TIMER_DEFINE(timer, inject_expired, NULL);
+
+static struct k_spinlock lock;
+static struct inject_record queue[CONFIG_KEYPAD_INJECT_QUEUE_SIZE];
+/* Free running, the slot is the low bits */
+static uint32_t head;
+static uint32_t tail;
+/* A script is playing: records are queued or one just played */
+static bool running;
+/* The record at the tail is due and waits for a frame */
+static volatile bool frame_wait;
+/* timebase_uptime_us32() the last record was due */
+static uint32_t at_us;
+static keypad_bitmap_t held;
+
+static uint32_t played;
+static uint32_t late_max_us;
+static uint64_t late_sum_us;
+static uint32_t late_count;
+
+/* Play every record due, from under the lock */
+static void inject_pump(bool sof)
+{
+	while (tail != head) {
+		const struct inject_record *r =
+			&queue[tail & INJECT_QUEUE_MASK];
+		uint32_t now = timebase_uptime_us32();
+		uint32_t due = at_us + r->delay_us;
+		int32_t wait = (int32_t)(due - now);
+		keypad_bitmap_t changed;
+
+		if (wait > 0) {
+			k_timer_start(&timer, K_USEC(wait), K_NO_WAIT);
+			return;
+		}
+
+		if (r->flags & INJECT_FRAME) {
+			if (!sof) {
+				frame_wait = true;
+				return;
+			}
+
+			/* One per frame, the next counts from this one */
+			sof = false;
+			due = now;
+		} else if (!(r->flags & INJECT_WAIT)) {
+			late_max_us = MAX(late_max_us, (uint32_t)-wait);
+			late_sum_us += (uint32_t)-wait;
+			late_count++;
+		}
+
+		at_us = due;
+		tail++;
+		played++;
+
+		if (r->flags & INJECT_WAIT) {
+			continue;
+		}
+
+		changed = held;
+		WRITE_BIT(held, r->key, (r->flags & INJECT_PRESS) != 0);
+		changed ^= held;
+		if (changed != 0) {
+			keys_changed(held, changed);
+		}
+	}
+
+	running = false;
+}
+
+static void inject_expired(struct k_timer *t)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	inject_pump(false);
+	k_spin_unlock(&lock, key);
+}
+
+void inject_sof(void)
+{
+	k_spinlock_key_t key;
+
+	if (!frame_wait) {
+		return;
+	}
+
+	key = k_spin_lock(&lock);
+	frame_wait = false;
+	inject_pump(true);
+	k_spin_unlock(&lock, key);
+}
+
+int inject_queue(const uint8_t *records, size_t count)
+{
+	k_spinlock_key_t key;
+
+	for (size_t i = 0; i < count; i++) {
+		const uint8_t *rec = &records[i * INJECT_RECORD_SIZE];
+
+		if (!(rec[1] & INJECT_WAIT) && rec[0] >= keypad_key_count) {
+			return -EINVAL;
+		}
+	}
+
+	key = k_spin_lock(&lock);
+	if (count > CONFIG_KEYPAD_INJECT_QUEUE_SIZE - (head - tail)) {
+		k_spin_unlock(&lock, key);
+		return -ENOBUFS;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		const uint8_t *rec = &records[i * INJECT_RECORD_SIZE];
+
+		queue[head++ & INJECT_QUEUE_MASK] = (struct inject_record){
+			.key = rec[0],
+			.flags = rec[1],
+			.delay_us = sys_get_le16(&rec[2]),
+		};
+	}
+
+	if (!running && count > 0) {
+		/* A script that ran dry counts on from now */
+		running = true;
+		at_us = timebase_uptime_us32();
+		inject_pump(false);
+	}
+	k_spin_unlock(&lock, key);
+
+	return 0;
+}
+
+void inject_stop(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	keypad_bitmap_t released = held;
+
+	(void)k_timer_stop(&timer);
+	tail = head;
+	running = false;
+	frame_wait = false;
+	held = 0;
+	/* The next script is measured on its own */
+	played = 0;
+	late_max_us = 0;
+	late_sum_us = 0;
+	late_count = 0;
+	if (released != 0) {
+		keys_changed(0, released);
+	}
+	k_spin_unlock(&lock, key);
+}
+
+size_t inject_read(uint8_t *buf, size_t len)
+{
+	uint8_t status[sizeof(struct inject_status)];
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	uint32_t queued = head - tail;
+
+	sys_put_le16(queued, &status[0]);
+	sys_put_le16(CONFIG_KEYPAD_INJECT_QUEUE_SIZE - queued, &status[2]);
+	sys_put_le32(played, &status[4]);
+	sys_put_le32(late_max_us, &status[8]);
+	sys_put_le32(late_count != 0 ? late_sum_us / late_count : 0,
+		     &status[12]);
+	k_spin_unlock(&lock, key);
+
+	len = MIN(len, sizeof(status));
+	memcpy(buf, status, len);
+
+	return len;
+}
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static int cmd_inject_show(const struct shell *sh, size_t argc, char **argv)
+{
+	uint8_t buf[sizeof(struct inject_status)];
+
+	(void)inject_read(buf, sizeof(buf));
+	shell_print(sh, "%u records queued, %u free, %u played",
+		    sys_get_le16(&buf[0]), sys_get_le16(&buf[2]),
+		    sys_get_le32(&buf[4]));
+	shell_print(sh, "late %u us at most, %u us mean",
+		    sys_get_le32(&buf[8]), sys_get_le32(&buf[12]));
+
+	return 0;
+}
+
+static int cmd_inject_stop(const struct shell *sh, size_t argc, char **argv)
+{
+	inject_stop();
+	shell_print(sh, "Script stopped, its keys released");
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_inject,
+	SHELL_CMD(show, NULL, "Print the injector status", cmd_inject_show),
+	SHELL_CMD(stop, NULL, "Drop the script and release its keys",
+		  cmd_inject_stop),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(inject, &sub_inject, "Scripted key injection", NULL);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Scripted key injection for host test automation. The host queues key
+ * transitions with their timing over raw HID, INJECT_RECORD_SIZE bytes
+ * each:
+ *
+ *   [0]     key index
+ *   [1]     INJECT_* flags
+ *   [2..3]  le16 us after the record before it
+ *
+ * and the keypad plays them into keys_changed() where a scan would, so
+ * layers, tap-hold, combos, macros and the report scheduler take them
+ * like real presses. A record with INJECT_PRESS presses its key, one
+ * without releases it; INJECT_WAIT only waits, for gaps longer than
+ * 65 ms. INJECT_FRAME holds a record for the first USB frame at or
+ * after its time and plays one such record per frame, so a script of
+ * them sends a report every poll for throughput tests. The next
+ * record's time counts from that frame.
+ *
+ * Records play on the system clock tick at or after their time, 30.5
+ * us at the most late; the lateness is measured. A script that runs
+ * dry starts its next record's time from when it is queued. Keys the
+ * script holds are released when it is stopped. Keys typed meanwhile
+ * mix with the script, so leave the keypad alone.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_INJECT is enabled.
+ */
+
+#ifndef KEYPAD_DIAG_INJECT_H_
+#define KEYPAD_DIAG_INJECT_H_
+
+#include <zephyr/zephyr.h>
+
+#define INJECT_RECORD_SIZE 4
+
+/* Record flags */
+#define INJECT_PRESS BIT(0)
+#define INJECT_FRAME BIT(1)
+#define INJECT_WAIT BIT(2)
+
+/* The status as read by inject_read(), little endian */
+struct inject_status {
+	/* Records waiting, and room for more */
+	uint16_t queued;
+	uint16_t free;
+	/* Records played since the last stop */
+	uint32_t played;
+	/* Late behind their time, of the records not on a frame */
+	uint32_t late_max_us;
+	uint32_t late_mean_us;
+};
+
+#if defined(CONFIG_KEYPAD_INJECT)
+
+/*
+ * Queue count records behind those waiting, all or none. -EINVAL for a
+ * key out of range, -ENOBUFS without room for all of them.
+ */
+int inject_queue(const uint8_t *records, size_t count);
+
+/*
+ * Drop the records waiting, release the keys the script holds and
+ * start the counters over
+ */
+void inject_stop(void);
+
+/* Start of a USB frame, plays the record waiting for one */
+void inject_sof(void);
+
+/* Copy the status, struct inject_status */
+size_t inject_read(uint8_t *buf, size_t len);
+
+#else
+
+static inline int inject_queue(const uint8_t *records, size_t count)
+{
+	return -ENOTSUP;
+}
+
+static inline void inject_stop(void) {}
+static inline void inject_sof(void) {}
+
+static inline size_t inject_read(uint8_t *buf, size_t len)
+{
+	return 0;
+}
+
+#endif /* CONFIG_KEYPAD_INJECT */
+
+#endif /* KEYPAD_DIAG_INJECT_H_ */
@@ -0,0 +1,240 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * The rings are in .noinit, which startup neither zeroes nor copies,
+ * so a warm reset (software, watchdog, lockup, pin) leaves them as
+ * they were. At boot the valid ring of the highest boot count is the
+ * previous boot's; the other one is reset for this boot, its magic
+ * written last. Writers claim a slot with one atomic increment, so
+ * records from threads and ISRs interleave without a lock; a reset in
+ * the middle of a write leaves at most that record torn.
+ *
+ * The key stream has one writer, keys_changed(), which runs in the
+ * scan interrupt or with interrupts locked, so it needs no claim:
+ * the bytes of a transition are stored first and key_head moves past
+ * them last. Encoding is a bounded handful of stores, at most six
+ * bytes and the padding of one block; decoding is left to the host.
+ */
+
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/init.h>
+#include <zephyr/drivers/hwinfo.h>
+#include <zephyr/fatal.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/reboot.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/logging/log_ctrl.h>
+
+#include "diag/journal.h"
+#include "keymap.h"
+
+LOG_MODULE_REGISTER(journal, LOG_LEVEL_INF);
+
+#define JOURNAL_MAGIC 0x4a524e4c
+#define RECORDS CONFIG_KEYPAD_JOURNAL_RECORDS
+#define KEY_BYTES CONFIG_KEYPAD_JOURNAL_KEY_BYTES
+
+BUILD_ASSERT(IS_POWER_OF_TWO(RECORDS), "records must be a power of two");
+BUILD_ASSERT(IS_POWER_OF_TWO(KEY_BYTES) && KEY_BYTES >= JOURNAL_KEY_BLOCK,
+	     "key bytes must be a power of two of at least one block");
+BUILD_ASSERT(sizeof(keypad_bitmap_t) * 8 <= JOURNAL_KEY_END >> 1,
+	     "key << 1 | pressed must stay below the end of block byte");
+
+/* A key byte and a 32 bit LEB128 varint */
+#define KEY_EVENT_MAX 6
+
+static struct journal_ring rings[2] __noinit;
+static struct journal_ring *current;
+static struct journal_ring *previous;
+/* Time of the last key transition written */
+static uint32_t key_ms;
+
+void journal_put(uint8_t type, uint8_t a, uint16_t b)
+{
+	struct journal_ring *ring = current;
+	struct journal_record *rec;
+
+	if (ring == NULL) {
+		return;
+	}
+
+	rec = &ring->rec[(uint32_t)atomic_inc(&ring->head) % RECORDS];
+	*rec = (struct journal_record){
+		.ms = k_uptime_get_32(),
+		.type = type,
+		.a = a,
+		.b = b,
+	};
+}
+
+void journal_key(uint8_t key, bool pressed)
+{
+	struct journal_ring *ring = current;
+	uint8_t event[KEY_EVENT_MAX];
+	uint32_t now = k_uptime_get_32();
+	uint32_t head, fill, delta;
+	size_t n = 0;
+
+	if (ring == NULL) {
+		return;
+	}
+
+	head = ring->key_head;
+	fill = head % JOURNAL_KEY_BLOCK;
+	delta = now - key_ms;
+
+	/* The worst case decides, so the varint is encoded only once */
+	if (fill == 0 || fill + KEY_EVENT_MAX > JOURNAL_KEY_BLOCK) {
+		if (fill != 0) {
+			memset(&ring->keys[head % KEY_BYTES], JOURNAL_KEY_END,
+			       JOURNAL_KEY_BLOCK - fill);
+			head += JOURNAL_KEY_BLOCK - fill;
+		}
+
+		sys_put_le32(now, &ring->keys[head % KEY_BYTES]);
+		head += sizeof(uint32_t);
+		delta = 0;
+	}
+
+	event[n++] = key << 1 | pressed;
+	do {
+		event[n++] = (delta & 0x7f) | (delta > 0x7f ? 0x80 : 0);
+		delta >>= 7;
+	} while (delta != 0);
+
+	memcpy(&ring->keys[head % KEY_BYTES], event, n);
+	key_ms = now;
+	ring->key_events++;
+	/* A reader never finds the head past bytes not yet written */
+	compiler_barrier();
+	ring->key_head = head + n;
+}
+
+size_t journal_read(uint8_t which, size_t offset, uint8_t *buf, size_t len)
+{
+	const struct journal_ring *ring =
+		which == JOURNAL_PREVIOUS ? previous : current;
+
+	if (ring == NULL || offset >= sizeof(*ring)) {
+		return 0;
+	}
+
+	len = MIN(len, sizeof(*ring) - offset);
+	memcpy(buf, (const uint8_t *)ring + offset, len);
+
+	return len;
+}
+
+/* A dead keypad tells nothing: record the fault and start over */
+void k_sys_fatal_error_handler(unsigned int reason, const z_arch_esf_t *esf)
+{
+	if (current != NULL) {
+		current->fault_reason = reason;
+		current->fault_pc = esf != NULL ? esf->basic.pc : 0;
+		current->fault_lr = esf != NULL ? esf->basic.lr : 0;
+	}
+
+	journal_put(JOURNAL_FAULT, reason, 0);
+
+	LOG_PANIC();
+	sys_reboot(SYS_REBOOT_WARM);
+	CODE_UNREACHABLE;
+}
+
+static bool ring_valid(const struct journal_ring *ring)
+{
+	return ring->magic == JOURNAL_MAGIC;
+}
+
+static int journal_init(const struct device *dev)
+{
+	struct journal_ring *next;
+	uint32_t cause = 0;
+
+	ARG_UNUSED(dev);
+
+	if (ring_valid(&rings[0]) &&
+	    (!ring_valid(&rings[1]) || rings[0].boot > rings[1].boot)) {
+		previous = &rings[0];
+	} else if (ring_valid(&rings[1])) {
+		previous = &rings[1];
+	}
+
+	next = previous == &rings[0] ? &rings[1] : &rings[0];
+	memset(next, 0, sizeof(*next));
+	next->boot = previous != NULL ? previous->boot + 1 : 1;
+	next->fault_reason = UINT32_MAX;
+	next->records = RECORDS;
+	next->key_bytes = KEY_BYTES;
+	next->magic = JOURNAL_MAGIC;
+	current = next;
+
+	if (IS_ENABLED(CONFIG_HWINFO) && hwinfo_get_reset_cause(&cause) == 0) {
+		(void)hwinfo_clear_reset_cause();
+	}
+
+	journal_put(JOURNAL_BOOT, 0, cause);
+
+	return 0;
+}
+
+SYS_INIT(journal_init, PRE_KERNEL_1, 0);
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static const char *const type_names[] = {
+	[JOURNAL_BOOT] = "boot",
+	[JOURNAL_USB] = "usb",
+	[JOURNAL_FAULT] = "fault",
+	[JOURNAL_WATCHDOG] = "wdt",
+};
+
+static int cmd_journal_show(const struct shell *sh, size_t argc, char **argv)
+{
+	const struct journal_ring *ring = current;
+	uint32_t head;
+
+	if (argc > 1 && strcmp(argv[1], "prev") == 0) {
+		ring = previous;
+	}
+
+	if (ring == NULL) {
+		shell_print(sh, "no journal");
+		return 0;
+	}
+
+	head = (uint32_t)atomic_get(&ring->head);
+
+	shell_print(sh, "boot %u, %u records, %u key events in %u bytes",
+		    ring->boot, head, ring->key_events, ring->key_head);
+	if (ring->fault_reason != UINT32_MAX) {
+		shell_print(sh, "fault %u at pc 0x%08x, lr 0x%08x",
+			    ring->fault_reason, ring->fault_pc, ring->fault_lr);
+	}
+
+	for (uint32_t i = head > RECORDS ? head - RECORDS : 0; i < head; i++) {
+		const struct journal_record *rec = &ring->rec[i % RECORDS];
+		const char *name = rec->type < ARRAY_SIZE(type_names) &&
+				   type_names[rec->type] != NULL ?
+				   type_names[rec->type] : "?";
+
+		shell_print(sh, "  %10u ms  %-5s %3u %5u", rec->ms, name,
+			    rec->a, rec->b);
+	}
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_journal,
+	SHELL_CMD_ARG(show, NULL, "Print this boot's journal, or the "
+		      "previous one with \"prev\"", cmd_journal_show, 1, 1),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(journal, &sub_journal, "Post-mortem event journal", NULL);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Post-mortem journal in RAM that survives a warm reset: the last
+ * CONFIG_KEYPAD_JOURNAL_RECORDS USB device states, boots and watchdog
+ * stages, the fault that ended a boot, if any, and the last key
+ * transitions that fit in CONFIG_KEYPAD_JOURNAL_KEY_BYTES. Every boot writes
+ * one of two rings and leaves the other, the previous boot's, as it
+ * was, so after a reset the ring of the boot that died can be read
+ * from the shell ("journal show prev") or over raw HID. A fatal error
+ * is recorded and reboots the keypad instead of halting it.
+ *
+ * Key transitions come by the hundred per minute, so they are not 8
+ * byte records but a compressed stream, decoded only by the host
+ * (scripts/keytrace.py). The stream is cut into JOURNAL_KEY_BLOCK byte
+ * blocks, each
+ *
+ *   [0..3]  le32 k_uptime_get_32() of its first transition
+ *   [4..]   transitions, one byte key << 1 | pressed followed by the
+ *           ms since the previous transition as an unsigned LEB128
+ *           varint, 0 for the first of the block
+ *
+ * and 0xff past the last transition of a block. A transition that
+ * does not fit in the rest of a block starts the next one, so the
+ * oldest block can be overwritten whole and the stream still decodes
+ * from any block. Typing at a few keys a second takes two or three
+ * bytes a transition, about a third of a record.
+ *
+ * Nothing is written to flash; recording is one atomic increment and
+ * an 8 byte store, or a handful of byte stores for a key transition,
+ * cheap enough for production builds. A power cycle loses the journal.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_JOURNAL is enabled.
+ */
+
+#ifndef KEYPAD_DIAG_JOURNAL_H_
+#define KEYPAD_DIAG_JOURNAL_H_
+
+#include <zephyr/zephyr.h>
+#include <zephyr/sys/atomic.h>
+
+/* Record types and their a and b fields */
+#define JOURNAL_BOOT 0x01 /* b: hwinfo reset cause bits 0..15 */
+/* Only in trace files, the journal keeps key transitions compressed */
+#define JOURNAL_KEY 0x02  /* a: key index, b: 1 pressed, 0 released */
+#define JOURNAL_USB 0x03  /* a: enum usb_dc_status_code */
+#define JOURNAL_FAULT 0x04 /* a: K_ERR_* reason */
+#define JOURNAL_WATCHDOG 0x05 /* a: enum watchdog_stage, b: ms stalled */
+
+#define JOURNAL_CURRENT 0
+#define JOURNAL_PREVIOUS 1
+
+/* Bytes per block of the key stream, and the byte past its last */
+#define JOURNAL_KEY_BLOCK 64
+#define JOURNAL_KEY_END 0xff
+
+struct journal_record {
+	/* k_uptime_get_32() */
+	uint32_t ms;
+	uint8_t type;
+	uint8_t a;
+	uint16_t b;
+};
+
+#if defined(CONFIG_KEYPAD_JOURNAL)
+
+/*
+ * One ring as read by journal_read(), little endian. rec[] and keys[]
+ * are written in a circle: the oldest record is at head % records once
+ * the ring has wrapped, the oldest block of the key stream at the first
+ * block boundary from key_head % key_bytes.
+ */
+struct journal_ring {
+	uint32_t magic;
+	uint32_t boot;
+	/* Records written, ever increasing */
+	atomic_t head;
+	/*
+	 * Fatal error that ended the boot, UINT32_MAX for none, and the
+	 * pc and lr of its exception frame, 0 without one
+	 */
+	uint32_t fault_reason;
+	uint32_t fault_pc;
+	uint32_t fault_lr;
+	/* Bytes of the key stream written, ever increasing */
+	uint32_t key_head;
+	/* Key transitions written, ever increasing */
+	uint32_t key_events;
+	/* CONFIG_KEYPAD_JOURNAL_RECORDS and _KEY_BYTES, for the host */
+	uint16_t records;
+	uint16_t key_bytes;
+	struct journal_record rec[CONFIG_KEYPAD_JOURNAL_RECORDS];
+	uint8_t keys[CONFIG_KEYPAD_JOURNAL_KEY_BYTES];
+};
+
+/* Add a record to the ring of this boot. ISR safe */
+void journal_put(uint8_t type, uint8_t a, uint16_t b);
+
+/*
+ * Add a key transition to the key stream of this boot. From
+ * keys_changed() only, the one writer of the stream.
+ */
+void journal_key(uint8_t key, bool pressed);
+
+/*
+ * Copy up to len bytes of a ring, JOURNAL_CURRENT or JOURNAL_PREVIOUS,
+ * from offset. Returns the bytes copied, 0 past the end or if there is
+ * no previous boot.
+ */
+size_t journal_read(uint8_t which, size_t offset, uint8_t *buf, size_t len);
+
+#else
+
+static inline void journal_put(uint8_t type, uint8_t a, uint16_t b) {}
+static inline void journal_key(uint8_t key, bool pressed) {}
+
+static inline size_t journal_read(uint8_t which, size_t offset, uint8_t *buf,
+				  size_t len)
+{
+	return 0;
+}
+
+#endif /* CONFIG_KEYPAD_JOURNAL */
+
+#endif /* KEYPAD_DIAG_JOURNAL_H_ */
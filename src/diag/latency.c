@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/logging/log.h>
+
+#if defined(CONFIG_KEYPAD_LATENCY_DWT)
+#include <soc.h>
+#endif
+
+#if defined(CONFIG_KEYPAD_LATENCY_EDGE)
+#include "input/debounce_hw.h"
+#endif
+
+#include "diag/latency.h"
+#include "timebase.h"
+
+LOG_MODULE_REGISTER(latency, LOG_LEVEL_INF);
+
+static struct latency_hist hist[LATENCY_STAGE_COUNT];
+static struct k_spinlock lock;
+
+/* Oldest event of the report being built */
+static uint32_t build_oldest;
+static bool build_valid;
+
+/* Stamps of the report queued on the endpoint */
+static uint32_t flight_oldest;
+static uint32_t flight_submit;
+static bool flight_valid;
+
+#if defined(CONFIG_KEYPAD_LATENCY_DWT)
+/* Started by the timebase, and never reset as it anchors there */
+uint32_t latency_timestamp(void)
+{
+	return DWT->CYCCNT;
+}
+
+uint32_t latency_to_us(uint32_t delta)
+{
+	/* Read every time, the core clock may be scaled at runtime */
+	return delta / (SystemCoreClock / USEC_PER_SEC);
+}
+#elif defined(CONFIG_KEYPAD_LATENCY_EDGE)
+uint32_t latency_timestamp(void)
+{
+	return debounce_hw_now();
+}
+
+uint32_t latency_to_us(uint32_t delta)
+{
+	return delta / (DEBOUNCE_HW_STAMP_HZ / USEC_PER_SEC);
+}
+#else
+uint32_t latency_timestamp(void)
+{
+	return timebase_now32();
+}
+
+uint32_t latency_to_us(uint32_t delta)
+{
+	return timebase_to_us32(delta);
+}
+#endif /* CONFIG_KEYPAD_LATENCY_DWT */
+
+uint32_t latency_edge_timestamp(void)
+{
+#if defined(CONFIG_KEYPAD_LATENCY_EDGE)
+	struct debounce_hw_edges edges;
+
+	/* Changes are only handed out from the settled handler */
+	debounce_hw_edges_get(&edges);
+
+	return edges.first;
+#else
+	return latency_timestamp();
+#endif
+}
+
+static void hist_add(struct latency_hist *h, uint32_t delta)
+{
+	uint32_t us = latency_to_us(delta);
+	uint32_t bucket = us ? find_msb_set(us) - 1 : 0;
+
+	h->bucket[MIN(bucket, LATENCY_BUCKETS - 1)]++;
+	h->min_us = h->count ? MIN(h->min_us, us) : us;
+	h->max_us = MAX(h->max_us, us);
+	h->sum_us += us;
+	h->count++;
+}
+
+void latency_frame_event(uint32_t timestamp)
+{
+	if (!build_valid || (int32_t)(timestamp - build_oldest) < 0) {
+		build_oldest = timestamp;
+		build_valid = true;
+	}
+}
+
+void latency_frame_submit(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	flight_submit = latency_timestamp();
+	flight_oldest = build_oldest;
+	flight_valid = build_valid;
+	build_valid = false;
+
+	if (flight_valid) {
+		hist_add(&hist[LATENCY_EVENT_TO_SUBMIT],
+			 flight_submit - flight_oldest);
+	}
+
+	k_spin_unlock(&lock, key);
+}
+
+void latency_frame_done(void)
+{
+	uint32_t now = latency_timestamp();
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	if (flight_valid) {
+		hist_add(&hist[LATENCY_SUBMIT_TO_DONE], now - flight_submit);
+		hist_add(&hist[LATENCY_EVENT_TO_DONE], now - flight_oldest);
+		flight_valid = false;
+	}
+
+	k_spin_unlock(&lock, key);
+}
+
+void latency_hist_get(enum latency_stage stage, struct latency_hist *out)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	*out = hist[stage];
+	k_spin_unlock(&lock, key);
+}
+
+uint32_t latency_hist_percentile(const struct latency_hist *h, uint8_t pct)
+{
+	uint64_t rank = DIV_ROUND_UP((uint64_t)h->count * pct, 100);
+	uint32_t seen = 0;
+
+	for (int b = 0; b < LATENCY_BUCKETS; b++) {
+		seen += h->bucket[b];
+		if (seen >= rank && seen != 0 && b < LATENCY_BUCKETS - 1) {
+			return MIN(BIT(b + 1) - 1, h->max_us);
+		}
+	}
+
+	/* The last bucket has no upper end */
+
+	return h->max_us;
+}
+
+void latency_reset(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	memset(hist, 0, sizeof(hist));
+	k_spin_unlock(&lock, key);
+}
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static const char *const stage_names[] = {
+	[LATENCY_EVENT_TO_SUBMIT] = "event->submit",
+	[LATENCY_SUBMIT_TO_DONE] = "submit->done",
+	[LATENCY_EVENT_TO_DONE] = "event->done",
+};
+
+static int cmd_latency_show(const struct shell *sh, size_t argc, char **argv)
+{
+	struct latency_hist h;
+
+	for (int stage = 0; stage < LATENCY_STAGE_COUNT; stage++) {
+		latency_hist_get(stage, &h);
+		shell_print(sh, "%s: n %u min %u max %u avg %u us",
+			    stage_names[stage], h.count, h.min_us, h.max_us,
+			    h.count ? (uint32_t)(h.sum_us / h.count) : 0);
+
+		for (int b = 0; b < LATENCY_BUCKETS; b++) {
+			if (h.bucket[b] != 0) {
+				shell_print(sh, "  >= %6u us: %u", BIT(b) & ~1U,
+					    h.bucket[b]);
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int cmd_latency_reset(const struct shell *sh, size_t argc, char **argv)
+{
+	latency_reset();
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_latency,
+	SHELL_CMD(show, NULL, "Print latency histograms", cmd_latency_show),
+	SHELL_CMD(reset, NULL, "Clear latency histograms", cmd_latency_reset),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(latency, &sub_latency, "Keypress latency statistics",
+		   NULL);
+#endif /* CONFIG_SHELL */
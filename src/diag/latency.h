@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Keypress latency instrumentation. Every report is stamped at three
+ * points: detection of its oldest key event, submission to the IN
+ * endpoint and endpoint completion. The differences are collected into
+ * fixed power-of-two microsecond histograms in RAM.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_LATENCY_STATS is enabled.
+ */
+
+#ifndef KEYPAD_DIAG_LATENCY_H_
+#define KEYPAD_DIAG_LATENCY_H_
+
+#include <zephyr/zephyr.h>
+
+#include "timebase.h"
+
+enum latency_stage {
+	/* Key event detected -> report submitted */
+	LATENCY_EVENT_TO_SUBMIT,
+	/* Report submitted -> IN transfer completed */
+	LATENCY_SUBMIT_TO_DONE,
+	/* Key event detected -> IN transfer completed */
+	LATENCY_EVENT_TO_DONE,
+	LATENCY_STAGE_COUNT,
+};
+
+/* Bucket n counts samples in [2^n, 2^(n+1)) us; bucket 0 includes 0 */
+#define LATENCY_BUCKETS 16
+
+struct latency_hist {
+	uint32_t bucket[LATENCY_BUCKETS];
+	uint32_t count;
+	uint32_t min_us;
+	uint32_t max_us;
+	uint64_t sum_us;
+};
+
+#if defined(CONFIG_KEYPAD_LATENCY_STATS)
+
+/* Timestamp in the units used by the whole key pipeline */
+uint32_t latency_timestamp(void);
+
+/* Difference of two timestamps in microseconds */
+uint32_t latency_to_us(uint32_t delta);
+
+/*
+ * Timestamp of the key edge behind the change being handled. The
+ * hardware captured first edge with CONFIG_KEYPAD_LATENCY_EDGE, the
+ * current time otherwise.
+ */
+uint32_t latency_edge_timestamp(void);
+
+/* A key event detected at timestamp went into the report being built */
+void latency_frame_event(uint32_t timestamp);
+
+/* The report being built was handed to the endpoint */
+void latency_frame_submit(void);
+
+/* The submitted report was picked up by the host */
+void latency_frame_done(void);
+
+void latency_hist_get(enum latency_stage stage, struct latency_hist *out);
+void latency_reset(void);
+
+/*
+ * Latency that pct percent of the samples of a histogram do not
+ * exceed: the upper end of the bucket it falls in, at most max_us.
+ */
+uint32_t latency_hist_percentile(const struct latency_hist *h, uint8_t pct);
+
+#else
+
+static inline uint32_t latency_timestamp(void)
+{
+	return timebase_now32();
+}
+
+static inline uint32_t latency_to_us(uint32_t delta)
+{
+	return timebase_to_us32(delta);
+}
+
+static inline uint32_t latency_edge_timestamp(void)
+{
+	return timebase_now32();
+}
+
+static inline void latency_frame_event(uint32_t timestamp) {}
+static inline void latency_frame_submit(void) {}
+static inline void latency_frame_done(void) {}
+
+#endif /* CONFIG_KEYPAD_LATENCY_STATS */
+
+#endif /* KEYPAD_DIAG_LATENCY_H_ */
@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * With CONFIG_LOG_PROCESS_THREAD off the log core neither starts a
+ * thread nor arms its flush timer, and messages stay buffered until
+ * someone calls log_process(). A run takes a batch of them, so its
+ * cost, which the scheduler weighs against the time to the next frame,
+ * stays that of a batch; the background thread kicks the job again
+ * before it sleeps if more are left. The deadline bounds how long a
+ * message waits while frames keep the gaps short.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/logging/log_ctrl.h>
+
+#include "bg_sched.h"
+#include "diag/log_flush.h"
+
+#define DEADLINE_US (CONFIG_KEYPAD_LOG_FLUSH_DEADLINE_MS * USEC_PER_MSEC)
+
+static void log_flush_run(struct bg_job *job);
+
+static struct bg_job log_job = {
+	.name = "log",
+	.run = log_flush_run,
+};
+
+static void log_flush_run(struct bg_job *job)
+{
+	ARG_UNUSED(job);
+
+	for (int i = 0; i < CONFIG_KEYPAD_LOG_FLUSH_BATCH; i++) {
+		if (!log_process()) {
+			break;
+		}
+	}
+}
+
+void log_flush_kick(void)
+{
+	if (log_buffered_cnt() == 0) {
+		return;
+	}
+
+	bg_sched_submit(&log_job, 0, DEADLINE_US);
+}
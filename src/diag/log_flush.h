@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Deferred log processing as a background job instead of the log
+ * thread. The input thread, each time it has built everything the ring
+ * held, and the background thread, before it sleeps, kick it; the job
+ * is only submitted if messages are buffered, and the background
+ * scheduler runs it between frames like any other job. Nothing wakes
+ * the CPU for the log when nothing was logged, and a typing burst is
+ * not interrupted to print. A fatal error and System OFF still flush
+ * everything at once through log_panic().
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_LOG_IDLE_FLUSH is enabled.
+ */
+
+#ifndef KEYPAD_DIAG_LOG_FLUSH_H_
+#define KEYPAD_DIAG_LOG_FLUSH_H_
+
+#include <zephyr/zephyr.h>
+
+#if defined(CONFIG_KEYPAD_LOG_IDLE_FLUSH)
+
+/* Submit the log job if messages are waiting. ISR safe */
+void log_flush_kick(void);
+
+#else
+
+static inline void log_flush_kick(void) {}
+
+#endif /* CONFIG_KEYPAD_LOG_IDLE_FLUSH */
+
+#endif /* KEYPAD_DIAG_LOG_FLUSH_H_ */
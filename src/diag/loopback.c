@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * The injected event goes in with interrupts locked, so it is the only
+ * producer of the event ring meanwhile, as the scan interrupt is. It
+ * is marked, and the report thread follows the mark through the frame
+ * it lands in, like the latency stamps: built, submitted, done.
+ */
+
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/spinlock.h>
+
+#include "diag/latency.h"
+#include "diag/loopback.h"
+#include "keymap.h"
+#include "report_sched.h"
+
+enum loopback_state {
+	LOOPBACK_IDLE,
+	/* In the event ring or the layer queue */
+	LOOPBACK_INJECTED,
+	/* In the report being built */
+	LOOPBACK_BUILT,
+	/* On the link */
+	LOOPBACK_SUBMITTED,
+};
+
+static struct k_spinlock lock;
+static enum loopback_state state;
+static uint32_t token;
+static uint32_t injected_at;
+static uint32_t submitted_at;
+static void (*done_cb)(void);
+
+static struct loopback_echo echo;
+static bool echoed;
+
+int loopback_inject(uint8_t key, bool pressed, uint32_t t,
+		    void (*done)(void))
+{
+	struct key_event event = {
+		.key = key,
+		.pressed = pressed,
+		.loopback = true,
+	};
+	k_spinlock_key_t key_lock;
+	unsigned int irq;
+	bool put;
+
+	if (key >= keypad_key_count) {
+		return -EINVAL;
+	}
+
+	key_lock = k_spin_lock(&lock);
+	token = t;
+	done_cb = done;
+	state = LOOPBACK_INJECTED;
+	injected_at = latency_timestamp();
+	k_spin_unlock(&lock, key_lock);
+
+	event.timestamp = injected_at;
+	irq = irq_lock();
+	put = event_ring_put(&event);
+	irq_unlock(irq);
+
+	if (!put) {
+		key_lock = k_spin_lock(&lock);
+		state = LOOPBACK_IDLE;
+		k_spin_unlock(&lock, key_lock);
+		return -ENOBUFS;
+	}
+
+	report_sched_notify();
+
+	return 0;
+}
+
+void loopback_frame_event(const struct key_event *event)
+{
+	k_spinlock_key_t key;
+
+	if (!event->loopback) {
+		return;
+	}
+
+	key = k_spin_lock(&lock);
+	if (state == LOOPBACK_INJECTED) {
+		state = LOOPBACK_BUILT;
+	}
+	k_spin_unlock(&lock, key);
+}
+
+void loopback_frame_submit(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	if (state == LOOPBACK_BUILT) {
+		state = LOOPBACK_SUBMITTED;
+		submitted_at = latency_timestamp();
+	}
+
+	k_spin_unlock(&lock, key);
+}
+
+void loopback_frame_done(void)
+{
+	uint32_t now = latency_timestamp();
+	void (*done)(void) = NULL;
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	if (state == LOOPBACK_SUBMITTED) {
+		echo = (struct loopback_echo){
+			.token = token,
+			.inject_to_submit_us =
+				latency_to_us(submitted_at - injected_at),
+			.submit_to_done_us = latency_to_us(now - submitted_at),
+		};
+		echoed = true;
+		state = LOOPBACK_IDLE;
+		done = done_cb;
+	}
+
+	k_spin_unlock(&lock, key);
+
+	if (done != NULL) {
+		done();
+	}
+}
+
+size_t loopback_read(uint8_t *buf, size_t len)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	len = echoed ? MIN(len, sizeof(echo)) : 0;
+	memcpy(buf, &echo, len);
+	k_spin_unlock(&lock, key);
+
+	return len;
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Loopback latency test. The host sends a token over raw HID with the
+ * LOOPBACK command; the keypad puts a press or release of a key into
+ * the event ring, where the scan interrupt puts real ones, and once
+ * the report carrying it has been picked up by the host, echoes the
+ * token with the time from injection to submission and from
+ * submission to completion. The host times the OUT report to the
+ * keyboard report itself, so firmware and USB round trip are measured
+ * on any PC without the stimulus rig, see scripts/loopback.py.
+ *
+ * The key should map to a plain usage on the active layer: an event
+ * that changes no report is never echoed. A new token replaces one
+ * still waiting.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_LOOPBACK is enabled.
+ */
+
+#ifndef KEYPAD_DIAG_LOOPBACK_H_
+#define KEYPAD_DIAG_LOOPBACK_H_
+
+#include <zephyr/zephyr.h>
+
+#include "event_ring.h"
+
+/* The echo as read by loopback_read(), little endian */
+struct loopback_echo {
+	uint32_t token;
+	uint32_t inject_to_submit_us;
+	uint32_t submit_to_done_us;
+};
+
+#if defined(CONFIG_KEYPAD_LOOPBACK)
+
+/*
+ * Inject a transition of key carrying token. done is called once the
+ * echo can be read, from the link's completion. -EINVAL for a key
+ * out of range, -ENOBUFS with the event ring full.
+ */
+int loopback_inject(uint8_t key, bool pressed, uint32_t token,
+		    void (*done)(void));
+
+/* The report being built takes event, from the report thread */
+void loopback_frame_event(const struct key_event *event);
+
+/* The report being built went to the link */
+void loopback_frame_submit(void);
+
+/* The submitted report was picked up by the host */
+void loopback_frame_done(void);
+
+/* Copy the last echo, 0 bytes before the first */
+size_t loopback_read(uint8_t *buf, size_t len);
+
+#else
+
+static inline int loopback_inject(uint8_t key, bool pressed, uint32_t token,
+				  void (*done)(void))
+{
+	return -ENOTSUP;
+}
+
+static inline void loopback_frame_event(const struct key_event *event) {}
+static inline void loopback_frame_submit(void) {}
+static inline void loopback_frame_done(void) {}
+
+static inline size_t loopback_read(uint8_t *buf, size_t len)
+{
+	return 0;
+}
+
+#endif /* CONFIG_KEYPAD_LOOPBACK */
+
+#endif /* KEYPAD_DIAG_LOOPBACK_H_ */
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * SystemView sends marker names as events of their own, so they only
+ * reach the host while it records. They go out again with the first
+ * marker after every start of a recording, which a marker can tell
+ * cheaply. Tracealyzer keeps its strings in the recorder, registered
+ * once at boot.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/init.h>
+
+#if defined(CONFIG_SEGGER_SYSTEMVIEW)
+#include <SEGGER_SYSVIEW.h>
+#else
+#include <trcRecorder.h>
+#endif
+
+#include "diag/markers.h"
+
+/* Names as the hosts show them */
+static const char *const names[MARKER_COUNT] = {
+	[MARKER_KEY_ISR] = "key isr",
+	[MARKER_EVENT_PUT] = "event put",
+	[MARKER_REPORT_BUILD] = "report build",
+	[MARKER_EP_WRITE] = "ep write",
+	[MARKER_EP_DONE] = "ep done",
+};
+
+#if defined(CONFIG_SEGGER_SYSTEMVIEW)
+
+static bool named;
+
+static void marker_names(void)
+{
+	bool started = SEGGER_SYSVIEW_IsStarted() != 0;
+
+	/* Twice if two contexts race here, which does no harm */
+	if (started && !named) {
+		for (size_t i = 0; i < MARKER_COUNT; i++) {
+			SEGGER_SYSVIEW_NameMarker(i, names[i]);
+		}
+	}
+
+	named = started;
+}
+
+void marker_begin(enum marker m)
+{
+	marker_names();
+	SEGGER_SYSVIEW_MarkStart(m);
+}
+
+void marker_end(enum marker m)
+{
+	marker_names();
+	SEGGER_SYSVIEW_MarkStop(m);
+}
+
+void marker_point(enum marker m)
+{
+	marker_names();
+	SEGGER_SYSVIEW_Mark(m);
+}
+
+#else
+
+static traceString channel;
+static traceString labels[MARKER_COUNT];
+
+void marker_begin(enum marker m)
+{
+	vTracePrintF(channel, "%s begin", labels[m]);
+}
+
+void marker_end(enum marker m)
+{
+	vTracePrintF(channel, "%s end", labels[m]);
+}
+
+void marker_point(enum marker m)
+{
+	vTracePrintF(channel, "%s", labels[m]);
+}
+
+static int markers_init(const struct device *dev)
+{
+	ARG_UNUSED(dev);
+
+	channel = xTraceRegisterString("keypad");
+	for (size_t i = 0; i < MARKER_COUNT; i++) {
+		labels[i] = xTraceRegisterString(names[i]);
+	}
+
+	return 0;
+}
+
+/* Before the drivers, whose interrupts may already mark */
+SYS_INIT(markers_init, PRE_KERNEL_2, 0);
+
+#endif /* CONFIG_SEGGER_SYSTEMVIEW */
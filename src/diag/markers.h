@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Application markers for the trace recorders. The kernel already
+ * records interrupts, thread switches and kernel objects; these put the
+ * key pipeline on the same timeline: the key interrupt, every event
+ * into the ring, report building and the IN endpoint write and its
+ * completion. SEGGER SystemView shows them as named markers, Percepio
+ * Tracealyzer as user events on the "keypad" channel.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_MARKERS is enabled, see
+ * overlay-systemview.conf.
+ */
+
+#ifndef KEYPAD_DIAG_MARKERS_H_
+#define KEYPAD_DIAG_MARKERS_H_
+
+#include <zephyr/zephyr.h>
+
+enum marker {
+	/* Key GPIO interrupt entry */
+	MARKER_KEY_ISR,
+	/* A key event went into the event ring */
+	MARKER_EVENT_PUT,
+	/* Around building one report */
+	MARKER_REPORT_BUILD,
+	/* Around hid_int_ep_write() */
+	MARKER_EP_WRITE,
+	/* The IN endpoint completed */
+	MARKER_EP_DONE,
+	MARKER_COUNT,
+};
+
+#if defined(CONFIG_KEYPAD_MARKERS)
+
+/* Start and end of a span, not nested within a marker */
+void marker_begin(enum marker m);
+void marker_end(enum marker m);
+
+/* A point in time */
+void marker_point(enum marker m);
+
+#else
+
+static inline void marker_begin(enum marker m) {}
+static inline void marker_end(enum marker m) {}
+static inline void marker_point(enum marker m) {}
+
+#endif /* CONFIG_KEYPAD_MARKERS */
+
+#endif /* KEYPAD_DIAG_MARKERS_H_ */
@@ -0,0 +1,320 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * The trace is an array of bytes built from the trace file, copied out
+ * a record at a time, so it needs no alignment. Only records that
+ * change the replay's own key state are played: the release of a key
+ * pressed before the journal window began, or a record seen twice
+ * where two captures overlap, is skipped. Events go in with
+ * interrupts locked, so keys_changed() is the only producer of the
+ * event ring meanwhile, as it is from the scan interrupt.
+ */
+
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/init.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/logging/log.h>
+
+#include "diag/journal.h"
+#include "diag/latency.h"
+#include "diag/replay.h"
+#include "keymap.h"
+#include "keys.h"
+#include "report_sched.h"
+
+LOG_MODULE_REGISTER(replay, LOG_LEVEL_INF);
+
+BUILD_ASSERT(sizeof(struct journal_record) == 8,
+	     "a trace record is 8 bytes, see scripts/keytrace.py");
+
+/* After the last event, for tap-hold and combo decisions to finish */
+#define REPLAY_DRAIN_MS \
+	(CONFIG_KEYPAD_TAPPING_TERM_MS + CONFIG_KEYPAD_COMBO_TERM_MS + 10)
+
+static const uint8_t trace[] = {
+#include "replay_trace.inc"
+};
+
+static atomic_t running;
+
+static void replay_event(keypad_bitmap_t held, uint8_t k, uint32_t *cycles)
+{
+	uint32_t start = latency_timestamp();
+	unsigned int key = irq_lock();
+
+	keys_changed(held, BIT(k));
+	irq_unlock(key);
+	*cycles += latency_timestamp() - start;
+}
+
+int replay_run(uint32_t speed, struct replay_result *out)
+{
+	struct report_sched_stats before, after;
+	struct journal_record rec, first;
+	struct latency_hist h;
+	keypad_bitmap_t held = 0;
+	uint32_t cycles = 0;
+	int64_t start;
+
+	if (!atomic_cas(&running, 0, 1)) {
+		return -EBUSY;
+	}
+
+	memset(out, 0, sizeof(*out));
+	memcpy(&first, trace, MIN(sizeof(first), sizeof(trace)));
+
+	latency_reset();
+	stage_bench_reset();
+	report_sched_stats_get(&before);
+	start = k_uptime_get();
+
+	for (size_t i = 0; i + sizeof(rec) <= sizeof(trace); i += sizeof(rec)) {
+		bool pressed;
+
+		memcpy(&rec, &trace[i], sizeof(rec));
+		pressed = rec.b != 0;
+
+		if (rec.type != JOURNAL_KEY || rec.a >= keypad_key_count ||
+		    ((held & BIT(rec.a)) != 0) == pressed) {
+			out->skipped++;
+			continue;
+		}
+
+		if (speed != 0) {
+			int64_t at = start * USEC_PER_MSEC +
+				     (int64_t)(rec.ms - first.ms) *
+				     USEC_PER_MSEC / speed;
+			int64_t now = k_ticks_to_us_floor64(k_uptime_ticks());
+
+			if (at > now) {
+				k_sleep(K_USEC(at - now));
+			}
+		}
+
+		WRITE_BIT(held, rec.a, pressed);
+		replay_event(held, rec.a, &cycles);
+		out->events++;
+	}
+
+	/* Nothing stays held after the trace */
+	while (held != 0) {
+		uint8_t k = find_lsb_set(held) - 1;
+
+		held &= ~BIT(k);
+		replay_event(held, k, &cycles);
+		out->events++;
+	}
+
+	k_sleep(K_MSEC(REPLAY_DRAIN_MS));
+
+	report_sched_stats_get(&after);
+	latency_hist_get(LATENCY_EVENT_TO_DONE, &h);
+
+	out->ms = k_uptime_get() - start;
+	out->reports = after.sent - before.sent;
+	if (out->events != 0) {
+		out->cycles_per_event =
+			(cycles + (after.cycles - before.cycles)) / out->events;
+	}
+	out->p50_us = latency_hist_percentile(&h, 50);
+	out->p90_us = latency_hist_percentile(&h, 90);
+	out->p99_us = latency_hist_percentile(&h, 99);
+	out->max_us = h.max_us;
+	stage_bench_get(out->stages);
+
+	atomic_set(&running, 0);
+
+	return 0;
+}
+
+#if defined(CONFIG_KEYPAD_REPLAY_CHECK) || defined(CONFIG_SHELL)
+/* One line of JSON, for scripts/stage_compare.py */
+static const char *replay_json(const struct replay_result *r)
+{
+	static char buf[128 + STAGE_BENCH_COUNT * 64];
+	int len;
+
+	len = snprintk(buf, sizeof(buf), "{\"events\":%u,\"reports\":%u,"
+		       "\"cycles_per_event\":%u,\"p50_us\":%u,"
+		       "\"p90_us\":%u,\"p99_us\":%u,\"max_us\":%u,"
+		       "\"stages\":{", r->events, r->reports,
+		       r->cycles_per_event, r->p50_us, r->p90_us, r->p99_us,
+		       r->max_us);
+
+	for (int i = 0; IS_ENABLED(CONFIG_KEYPAD_STAGE_BENCH) &&
+	     i < STAGE_BENCH_COUNT; i++) {
+		const struct stage_bench_stat *s = &r->stages[i];
+
+		len += snprintk(&buf[len], sizeof(buf) - len,
+				"%s\"%s\":{\"calls\":%u,\"cycles\":%llu}",
+				i > 0 ? "," : "", stage_bench_name(i),
+				s->calls, s->cycles);
+	}
+
+	snprintk(&buf[len], sizeof(buf) - len, "}}");
+
+	return buf;
+}
+#endif
+
+#if defined(CONFIG_KEYPAD_REPLAY_CHECK)
+/* Printed for the twister console harness, like the host simulation */
+static bool replay_within(const char *what, uint32_t value, uint32_t limit)
+{
+	if (limit != 0 && value > limit) {
+		printk("replay: %s %u, over %u\n", what, value, limit);
+		return false;
+	}
+
+	return true;
+}
+
+static void replay_check(void *p1, void *p2, void *p3)
+{
+	struct replay_result r;
+	bool pass;
+	int ret;
+
+	ret = replay_run(CONFIG_KEYPAD_REPLAY_SPEED, &r);
+	if (ret != 0) {
+		printk("replay: FAIL, error %d\n", ret);
+		return;
+	}
+
+	printk("replay: %u events, %u reports, %u cycles per event, "
+	       "p99 %u us\n", r.events, r.reports, r.cycles_per_event,
+	       r.p99_us);
+	printk("replay: json %s\n", replay_json(&r));
+
+	pass = replay_within("cycles per event", r.cycles_per_event,
+			     CONFIG_KEYPAD_REPLAY_CHECK_CYCLES);
+	pass &= replay_within("p99 us", r.p99_us,
+			      CONFIG_KEYPAD_REPLAY_CHECK_P99_US);
+	if (CONFIG_KEYPAD_REPLAY_CHECK_P99_US != 0 && r.reports == 0) {
+		printk("replay: no report reached a host\n");
+		pass = false;
+	}
+
+	printk("replay: %s\n", pass ? "PASS" : "FAIL");
+}
+
+K_THREAD_DEFINE(replay_check_tid, CONFIG_KEYPAD_REPLAY_STACK_SIZE,
+		replay_check, NULL, NULL, NULL,
+		K_LOWEST_APPLICATION_THREAD_PRIO, 0,
+		CONFIG_KEYPAD_REPLAY_CHECK_DELAY_MS);
+#endif /* CONFIG_KEYPAD_REPLAY_CHECK */
+
+#if defined(CONFIG_SHELL)
+#include <stdlib.h>
+
+#include <zephyr/shell/shell.h>
+
+static K_THREAD_STACK_DEFINE(replay_stack, CONFIG_KEYPAD_REPLAY_STACK_SIZE);
+static struct k_work_q replay_wq;
+static struct k_work replay_work;
+static uint32_t replay_speed;
+static struct replay_result result;
+static int result_err = -ENODATA;
+
+static void replay_handler(struct k_work *work)
+{
+	struct replay_result r = { 0 };
+	int ret = replay_run(replay_speed, &r);
+
+	if (ret == 0) {
+		result = r;
+	}
+
+	result_err = ret;
+	LOG_INF("Replay done, %u events, error: %d", r.events, ret);
+}
+
+static int replay_init(const struct device *dev)
+{
+	const struct k_work_queue_config cfg = {
+		.name = "replay",
+	};
+
+	ARG_UNUSED(dev);
+
+	k_work_queue_start(&replay_wq, replay_stack,
+			   K_THREAD_STACK_SIZEOF(replay_stack),
+			   K_LOWEST_APPLICATION_THREAD_PRIO, &cfg);
+	k_work_init(&replay_work, replay_handler);
+
+	return 0;
+}
+
+SYS_INIT(replay_init, APPLICATION, 0);
+
+static int cmd_replay_start(const struct shell *sh, size_t argc, char **argv)
+{
+	if (atomic_get(&running) || k_work_busy_get(&replay_work) != 0) {
+		shell_error(sh, "A replay is running");
+		return -EBUSY;
+	}
+
+	replay_speed = argc > 1 ? strtoul(argv[1], NULL, 0) :
+				  CONFIG_KEYPAD_REPLAY_SPEED;
+	k_work_submit_to_queue(&replay_wq, &replay_work);
+	shell_print(sh, "Replaying %u records at speed %u, keep off the keys",
+		    sizeof(trace) / sizeof(struct journal_record),
+		    replay_speed);
+
+	return 0;
+}
+
+static int cmd_replay_show(const struct shell *sh, size_t argc, char **argv)
+{
+	if (result_err != 0) {
+		shell_print(sh, "no result, error: %d", result_err);
+		return 0;
+	}
+
+	shell_print(sh, "%u events, %u skipped, %u reports in %u ms",
+		    result.events, result.skipped, result.reports, result.ms);
+	shell_print(sh, "%u cycles per event", result.cycles_per_event);
+	shell_print(sh, "event->done p50 %u p90 %u p99 %u max %u us",
+		    result.p50_us, result.p90_us, result.p99_us,
+		    result.max_us);
+
+	for (int i = 0; IS_ENABLED(CONFIG_KEYPAD_STAGE_BENCH) &&
+	     i < STAGE_BENCH_COUNT; i++) {
+		const struct stage_bench_stat *s = &result.stages[i];
+
+		shell_print(sh, "  %-8s %6u calls, %llu cycles each",
+			    stage_bench_name(i), s->calls,
+			    s->calls > 0 ? s->cycles / s->calls : 0);
+	}
+
+	return 0;
+}
+
+static int cmd_replay_json(const struct shell *sh, size_t argc, char **argv)
+{
+	if (result_err != 0) {
+		shell_error(sh, "no result, error: %d", result_err);
+		return result_err;
+	}
+
+	shell_print(sh, "%s", replay_json(&result));
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_replay,
+	SHELL_CMD_ARG(start, NULL, "Play the built-in trace [speed]",
+		      cmd_replay_start, 1, 1),
+	SHELL_CMD(show, NULL, "Print the result of the last replay",
+		  cmd_replay_show),
+	SHELL_CMD(json, NULL, "Print the last result as JSON",
+		  cmd_replay_json),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(replay, &sub_replay, "Key trace replay benchmark", NULL);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Replay of a recorded typing session through the key pipeline, as a
+ * benchmark. A trace is JOURNAL_KEY records, struct journal_record
+ * little endian, as scripts/keytrace.py decodes them from the key stream
+ * of a unit's journal over raw HID. CONFIG_KEYPAD_REPLAY_TRACE builds
+ * one into the image.
+ *
+ * The replay hands the transitions to keys_changed() at their recorded
+ * times, divided by the speed, so everything after debounce runs as it
+ * did on the unit: layers, tap-hold, combos, the report scheduler and
+ * the link. It measures the time spent per event in keys_changed() and
+ * the report thread, the reports sent and the latency percentiles of
+ * the CONFIG_KEYPAD_LATENCY_STATS event->done histogram, and with
+ * CONFIG_KEYPAD_STAGE_BENCH the time in each stage, see
+ * diag/stage_bench.h. Keys typed meanwhile would be counted too, so
+ * leave the keypad alone.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_REPLAY is enabled.
+ */
+
+#ifndef KEYPAD_DIAG_REPLAY_H_
+#define KEYPAD_DIAG_REPLAY_H_
+
+#include <zephyr/zephyr.h>
+
+#include "diag/stage_bench.h"
+
+struct replay_result {
+	/* Transitions played, including the releases at the end */
+	uint32_t events;
+	/* Records of keys this keymap has not, or that changed nothing */
+	uint32_t skipped;
+	/* Reports written to the link */
+	uint32_t reports;
+	/*
+	 * keys_changed() and report thread time per event, in
+	 * latency_timestamp() units: timebase units, core cycles with
+	 * CONFIG_KEYPAD_LATENCY_DWT
+	 */
+	uint32_t cycles_per_event;
+	/* Event to report done, per report from its oldest event */
+	uint32_t p50_us;
+	uint32_t p90_us;
+	uint32_t p99_us;
+	uint32_t max_us;
+	/* Length of the replay */
+	uint32_t ms;
+	/* Per stage, all zero without CONFIG_KEYPAD_STAGE_BENCH */
+	struct stage_bench_stat stages[STAGE_BENCH_COUNT];
+};
+
+#if defined(CONFIG_KEYPAD_REPLAY)
+
+/*
+ * Play the built-in trace and fill out. speed divides the recorded
+ * gaps, 1 is real time and 0 plays without any. Blocks until the last
+ * report is done; -EBUSY while another replay runs.
+ */
+int replay_run(uint32_t speed, struct replay_result *out);
+
+#else
+
+static inline int replay_run(uint32_t speed, struct replay_result *out)
+{
+	return -ENOTSUP;
+}
+
+#endif /* CONFIG_KEYPAD_REPLAY */
+
+#endif /* KEYPAD_DIAG_REPLAY_H_ */
@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Two chunks, each free, being filled, or the link's from
+ * scan_stream_take() to scan_stream_release(). The scan interrupt
+ * appends to the one being filled and hands it over once no other scan
+ * fits; the link takes them in that order. Only the lock is shared
+ * between the two, the chunk on the link is left alone until it is
+ * released, so EasyDMA reads it in place without a copy.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/sys/byteorder.h>
+
+#include "diag/scan_stream.h"
+#include "input/analog.h"
+#include "timebase.h"
+
+#define CHUNK_SIZE CONFIG_KEYPAD_SCAN_STREAM_CHUNK
+
+#if defined(CONFIG_KEYPAD_SCAN_ANALOG)
+#define STREAM_KIND SCAN_STREAM_SAMPLES
+#define RECORD_SIZE (4 + 2 * ANALOG_KEYS)
+#else
+#define STREAM_KIND SCAN_STREAM_BITMAP
+#define RECORD_SIZE 8
+#endif
+
+/* Scans a chunk holds */
+#define CHUNK_SCANS ((CHUNK_SIZE - SCAN_STREAM_HEADER_SIZE) / RECORD_SIZE)
+
+BUILD_ASSERT(CHUNK_SCANS > 0,
+	     "CONFIG_KEYPAD_SCAN_STREAM_CHUNK holds no scan");
+
+enum chunk_state {
+	CHUNK_FREE,
+	/* Full, waiting for the link */
+	CHUNK_FULL,
+	CHUNK_LINK,
+};
+
+static struct k_spinlock lock;
+static void (*ready_cb)(void);
+
+static uint8_t chunks[2][CHUNK_SIZE] __aligned(4);
+static enum chunk_state state[2];
+/* Chunk being filled and its scans, chunk the link takes next */
+static uint8_t fill;
+static uint16_t scans;
+static uint8_t next;
+/* Header fields of the chunk being filled */
+static uint16_t number;
+static uint16_t dropped;
+
+void scan_stream_enable(void (*ready)(void))
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	ready_cb = ready;
+	for (int i = 0; i < ARRAY_SIZE(state); i++) {
+		if (state[i] == CHUNK_FULL) {
+			state[i] = CHUNK_FREE;
+		}
+	}
+	/* The link's chunk is released as usual, the fill goes on past it */
+	fill = state[0] == CHUNK_LINK ? 1 : 0;
+	next = fill;
+	scans = 0;
+	number = 0;
+	dropped = 0;
+	k_spin_unlock(&lock, key);
+}
+
+/* Room for the next scan, NULL if it is dropped; with the lock held */
+static uint8_t *stream_record(void)
+{
+	if (ready_cb == NULL) {
+		return NULL;
+	}
+
+	if (state[fill] != CHUNK_FREE) {
+		if (dropped < UINT16_MAX) {
+			dropped++;
+		}
+		return NULL;
+	}
+
+	return &chunks[fill][SCAN_STREAM_HEADER_SIZE + scans * RECORD_SIZE];
+}
+
+/* The scan is in, returns true if that filled the chunk and it is over */
+static bool stream_commit(void)
+{
+	uint8_t *head = chunks[fill];
+
+	if (++scans < CHUNK_SCANS) {
+		return false;
+	}
+
+	head[0] = SCAN_STREAM_TAG;
+	head[1] = STREAM_KIND;
+	sys_put_le16(number++, &head[2]);
+	sys_put_le16(scans, &head[4]);
+	sys_put_le16(dropped, &head[6]);
+
+	state[fill] = CHUNK_FULL;
+	fill ^= 1;
+	scans = 0;
+	dropped = 0;
+
+	return true;
+}
+
+void scan_stream_bitmap(keypad_bitmap_t raw)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	uint8_t *rec = stream_record();
+	void (*ready)(void) = NULL;
+
+	if (rec != NULL) {
+		sys_put_le32(timebase_uptime_us32(), rec);
+		sys_put_le32(raw, rec + 4);
+		ready = stream_commit() ? ready_cb : NULL;
+	}
+	k_spin_unlock(&lock, key);
+
+	if (ready != NULL) {
+		ready();
+	}
+}
+
+void scan_stream_samples(const int16_t *samples, size_t count)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	uint8_t *rec = stream_record();
+	void (*ready)(void) = NULL;
+
+	if (rec != NULL) {
+		sys_put_le32(timebase_uptime_us32(), rec);
+		for (size_t i = 0; i < count; i++) {
+			sys_put_le16(samples[i], rec + 4 + 2 * i);
+		}
+		ready = stream_commit() ? ready_cb : NULL;
+	}
+	k_spin_unlock(&lock, key);
+
+	if (ready != NULL) {
+		ready();
+	}
+}
+
+const uint8_t *scan_stream_take(size_t *len)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	const uint8_t *chunk = NULL;
+
+	if (state[next] == CHUNK_FULL) {
+		state[next] = CHUNK_LINK;
+		chunk = chunks[next];
+		*len = SCAN_STREAM_HEADER_SIZE + CHUNK_SCANS * RECORD_SIZE;
+		next ^= 1;
+	}
+	k_spin_unlock(&lock, key);
+
+	return chunk;
+}
+
+void scan_stream_release(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	/* Only one chunk is on the link at a time */
+	for (int i = 0; i < ARRAY_SIZE(state); i++) {
+		if (state[i] == CHUNK_LINK) {
+			state[i] = CHUNK_FREE;
+		}
+	}
+	k_spin_unlock(&lock, key);
+}
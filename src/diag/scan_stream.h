@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Raw scan stream for hardware validation. Every scan of a bulk backend
+ * goes to the host as the raw line bitmap, before the debounce, and
+ * every SAADC scan of the analog backend as its raw samples, before
+ * the filter: bounce and Hall curves at the full scan rate, without a
+ * logic analyzer. Not for production builds.
+ *
+ * Off until the host turns it on with WEBUSB_CMD_STREAM. Scans fill one
+ * of two chunks while the other is on the WebUSB bulk IN endpoint, read
+ * by the USB controller's EasyDMA straight from the chunk. Scans that
+ * find both full are dropped and counted in the next chunk. A chunk,
+ * little endian:
+ *
+ *   [0]     SCAN_STREAM_TAG, never an UPLOAD_STATUS_* of a reply
+ *   [1]     SCAN_STREAM_BITMAP or SCAN_STREAM_SAMPLES
+ *   [2..3]  le16 chunk number, one more per chunk
+ *   [4..5]  le16 scans in this chunk
+ *   [6..7]  le16 scans dropped since the last chunk, saturating
+ *   [8..]   per scan: le32 us of uptime, then the le32 line bitmap or
+ *           one le16 raw SAADC sample per analog key
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_SCAN_STREAM is enabled.
+ */
+
+#ifndef KEYPAD_DIAG_SCAN_STREAM_H_
+#define KEYPAD_DIAG_SCAN_STREAM_H_
+
+#include <zephyr/zephyr.h>
+
+#include "keymap.h"
+
+#define SCAN_STREAM_TAG 0x80
+#define SCAN_STREAM_BITMAP 0x01
+#define SCAN_STREAM_SAMPLES 0x02
+
+#define SCAN_STREAM_HEADER_SIZE 8
+
+#if defined(CONFIG_KEYPAD_SCAN_STREAM)
+
+/*
+ * Start streaming, ready is called from the scan interrupt when a chunk
+ * is full; NULL stops and drops the chunk being filled.
+ */
+void scan_stream_enable(void (*ready)(void));
+
+/* Raw lines of a bulk scan, from the scan interrupt */
+void scan_stream_bitmap(keypad_bitmap_t raw);
+
+/* Raw samples of an analog scan, from the SAADC interrupt */
+void scan_stream_samples(const int16_t *samples, size_t count);
+
+/*
+ * The oldest full chunk and its length, NULL if there is none; it stays
+ * the link's until scan_stream_release()
+ */
+const uint8_t *scan_stream_take(size_t *len);
+void scan_stream_release(void);
+
+#else
+
+static inline void scan_stream_enable(void (*ready)(void)) {}
+static inline void scan_stream_bitmap(keypad_bitmap_t raw) {}
+static inline void scan_stream_samples(const int16_t *samples,
+				       size_t count) {}
+
+static inline const uint8_t *scan_stream_take(size_t *len)
+{
+	return NULL;
+}
+
+static inline void scan_stream_release(void) {}
+
+#endif /* CONFIG_KEYPAD_SCAN_STREAM */
+
+#endif /* KEYPAD_DIAG_SCAN_STREAM_H_ */
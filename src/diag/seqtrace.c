@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Numbers come from the scan interrupt, records from the report
+ * thread only, so neither needs a lock. A record is complete before
+ * head counts it; a host reading the ring while it is written reads
+ * head again afterwards and drops the slots that may have been written
+ * over meanwhile, as for the journal.
+ */
+
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+
+#include "diag/seqtrace.h"
+#include "timebase.h"
+
+#define RECORDS CONFIG_KEYPAD_SEQ_TRACE_RECORDS
+
+BUILD_ASSERT(IS_POWER_OF_TWO(RECORDS), "records must be a power of two");
+BUILD_ASSERT(sizeof(struct seqtrace_record) == 16,
+	     "a record is 16 bytes, see scripts/seqcheck.py");
+
+static struct seqtrace_ring ring = {
+	.records = RECORDS,
+};
+
+/* Transitions detected, the last number given out */
+static uint32_t detected;
+
+/* Report thread state */
+static uint32_t reports;
+static uint32_t newest;
+static uint16_t taken;
+
+void seqtrace_detect(struct key_event *event)
+{
+	event->seq = ++detected;
+}
+
+void seqtrace_take(const struct key_event *event)
+{
+	newest = event->seq;
+	if (taken < UINT16_MAX) {
+		taken++;
+	}
+}
+
+void seqtrace_report(void)
+{
+	uint32_t head = (uint32_t)atomic_get(&ring.head);
+	struct seqtrace_record *rec = &ring.rec[head % RECORDS];
+
+	*rec = (struct seqtrace_record){
+		.report = ++reports,
+		.event = newest,
+		.taken = taken,
+		.us = timebase_uptime_us32(),
+	};
+	atomic_set(&ring.head, head + 1);
+
+	taken = 0;
+}
+
+size_t seqtrace_read(size_t offset, uint8_t *buf, size_t len)
+{
+	if (offset >= sizeof(ring)) {
+		return 0;
+	}
+
+	len = MIN(len, sizeof(ring) - offset);
+	memcpy(buf, (const uint8_t *)&ring + offset, len);
+
+	return len;
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Sequence trace, for a host to check that no key event is lost,
+ * reordered or silently merged on its way to a report. Every
+ * debounced transition is numbered when it is detected, whether or not
+ * the event ring has room for it. Every report the scheduler writes to
+ * a link adds a record: its own number, the newest event number the
+ * report thread has taken from the ring and how many events it took
+ * since the previous report.
+ *
+ * Between two records, the event numbers advance by exactly the events
+ * taken unless the ring dropped some, never go back, and more than one
+ * event taken means transitions that share a report. Report numbers
+ * without a gap, against the keyboard reports a host receives, show
+ * that none went missing on the link. scripts/seqcheck.py reads the
+ * trace over raw HID with the SEQ command and does these checks.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_SEQ_TRACE is enabled.
+ */
+
+#ifndef KEYPAD_DIAG_SEQTRACE_H_
+#define KEYPAD_DIAG_SEQTRACE_H_
+
+#include <zephyr/zephyr.h>
+#include <zephyr/sys/atomic.h>
+
+#include "event_ring.h"
+
+struct seqtrace_record {
+	/* Reports the scheduler wrote to any link, this one included */
+	uint32_t report;
+	/* Number of the newest event taken from the ring, 0 for none */
+	uint32_t event;
+	/* Events taken since the previous record, at most UINT16_MAX */
+	uint16_t taken;
+	uint16_t reserved;
+	/* timebase_uptime_us32() when written, wraps */
+	uint32_t us;
+};
+
+#if defined(CONFIG_KEYPAD_SEQ_TRACE)
+
+/*
+ * The trace as read by seqtrace_read(), little endian. rec[] is written
+ * in a circle, the oldest record is at head % records once it has
+ * wrapped.
+ */
+struct seqtrace_ring {
+	/* Records written, ever increasing */
+	atomic_t head;
+	uint32_t records;
+	struct seqtrace_record rec[CONFIG_KEYPAD_SEQ_TRACE_RECORDS];
+};
+
+/* Number a detected transition, from the scan engine */
+void seqtrace_detect(struct key_event *event);
+
+/* The report thread took event from the ring */
+void seqtrace_take(const struct key_event *event);
+
+/* A report went to a link, from the report thread */
+void seqtrace_report(void);
+
+/* Copy up to len bytes of the ring from offset, 0 past the end */
+size_t seqtrace_read(size_t offset, uint8_t *buf, size_t len);
+
+#else
+
+static inline void seqtrace_detect(struct key_event *event) {}
+static inline void seqtrace_take(const struct key_event *event) {}
+static inline void seqtrace_report(void) {}
+
+static inline size_t seqtrace_read(size_t offset, uint8_t *buf, size_t len)
+{
+	return 0;
+}
+
+#endif /* CONFIG_KEYPAD_SEQ_TRACE */
+
+#endif /* KEYPAD_DIAG_SEQTRACE_H_ */
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Each stage is only ever ended from one context, the scan interrupt
+ * for debounce and the report thread for the rest, so its counters
+ * take no lock. Reading and resetting lock interrupts, which keeps
+ * both of those out for the copy.
+ */
+
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+
+#include "diag/stage_bench.h"
+
+static struct stage_bench_stat stats[STAGE_BENCH_COUNT];
+
+static const char *const names[] = {
+	[STAGE_BENCH_DEBOUNCE] = "debounce",
+	[STAGE_BENCH_RESOLVE] = "resolve",
+	[STAGE_BENCH_COMBO] = "combo",
+	[STAGE_BENCH_BUILD] = "build",
+	[STAGE_BENCH_SUBMIT] = "submit",
+};
+
+BUILD_ASSERT(ARRAY_SIZE(names) == STAGE_BENCH_COUNT,
+	     "every stage needs a name");
+
+void stage_bench_end(enum stage_bench_stage stage, uint32_t start)
+{
+	struct stage_bench_stat *s = &stats[stage];
+
+	s->cycles += latency_timestamp() - start;
+	s->calls++;
+}
+
+void stage_bench_reset(void)
+{
+	unsigned int key = irq_lock();
+
+	memset(stats, 0, sizeof(stats));
+	irq_unlock(key);
+}
+
+void stage_bench_get(struct stage_bench_stat out[STAGE_BENCH_COUNT])
+{
+	unsigned int key = irq_lock();
+
+	memcpy(out, stats, sizeof(stats));
+	irq_unlock(key);
+}
+
+const char *stage_bench_name(enum stage_bench_stage stage)
+{
+	return stage < STAGE_BENCH_COUNT ? names[stage] : "";
+}
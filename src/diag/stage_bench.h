@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Time spent in each stage of the key pipeline: the debounce step of a
+ * scan, resolving key events through the layers, the combo match
+ * within that, building a report and writing it to the link. Each
+ * stage counts its calls and latency_timestamp() units, core cycles
+ * with CONFIG_KEYPAD_LATENCY_DWT. The replay benchmark resets them
+ * before a trace and hands them back with its result, so a change that
+ * makes one stage slower shows in that stage, not only in the total.
+ *
+ * The replay feeds keys_changed(), after debounce: the debounce stage
+ * only counts scans of keys typed on the unit.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_STAGE_BENCH is enabled.
+ */
+
+#ifndef KEYPAD_DIAG_STAGE_BENCH_H_
+#define KEYPAD_DIAG_STAGE_BENCH_H_
+
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+
+#include "diag/latency.h"
+
+enum stage_bench_stage {
+	/* debounce_input(), scan interrupt, or an analog scan's thresholds */
+	STAGE_BENCH_DEBOUNCE,
+	/* layer_get(), the combo match included */
+	STAGE_BENCH_RESOLVE,
+	/* One combo decision in layer_get() */
+	STAGE_BENCH_COMBO,
+	/* report_build() */
+	STAGE_BENCH_BUILD,
+	/* Writing a staged report to the link */
+	STAGE_BENCH_SUBMIT,
+	STAGE_BENCH_COUNT,
+};
+
+struct stage_bench_stat {
+	uint32_t calls;
+	uint64_t cycles;
+};
+
+#if defined(CONFIG_KEYPAD_STAGE_BENCH)
+
+/* Start of a span, pass it to stage_bench_end() */
+static inline uint32_t stage_bench_begin(void)
+{
+	return latency_timestamp();
+}
+
+/* End of a span of stage; one context per stage */
+void stage_bench_end(enum stage_bench_stage stage, uint32_t start);
+
+/* Start every stage from zero */
+void stage_bench_reset(void);
+
+void stage_bench_get(struct stage_bench_stat out[STAGE_BENCH_COUNT]);
+
+/* Name of a stage, as in the JSON of the replay */
+const char *stage_bench_name(enum stage_bench_stage stage);
+
+#else
+
+static inline uint32_t stage_bench_begin(void)
+{
+	return 0;
+}
+
+static inline void stage_bench_end(enum stage_bench_stage stage,
+				   uint32_t start) {}
+static inline void stage_bench_reset(void) {}
+
+static inline void stage_bench_get(
+	struct stage_bench_stat out[STAGE_BENCH_COUNT])
+{
+	memset(out, 0, STAGE_BENCH_COUNT * sizeof(out[0]));
+}
+
+static inline const char *stage_bench_name(enum stage_bench_stage stage)
+{
+	return "";
+}
+
+#endif /* CONFIG_KEYPAD_STAGE_BENCH */
+
+#endif /* KEYPAD_DIAG_STAGE_BENCH_H_ */
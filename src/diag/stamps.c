@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * The events of the report being built are kept as they are applied.
+ * A submission only notes the time and how many of them it carries: a
+ * refused write leaves the report staged and folding in more events,
+ * and the next submission carries those too. Completion turns the
+ * carried events into queue entries and shifts the rest down. The
+ * queue is read one raw HID report at a time from the system work
+ * queue, with an entry per event so a frame of any size fits.
+ */
+
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/sys/byteorder.h>
+
+#include "diag/latency.h"
+#include "diag/stamps.h"
+#include "keymap.h"
+#include "timebase.h"
+#include "usb/raw_hid.h"
+
+#define QUEUE_SIZE CONFIG_KEYPAD_EVENT_STAMPS_QUEUE
+
+BUILD_ASSERT(QUEUE_SIZE > 0 && (QUEUE_SIZE & (QUEUE_SIZE - 1)) == 0,
+	     "the stamp queue size must be a power of two");
+
+struct stamp {
+	uint32_t timestamp;
+	uint8_t key;
+	bool pressed;
+};
+
+struct stamp_entry {
+	uint32_t submit_us;
+	uint32_t age_us;
+	uint8_t frame;
+	uint8_t key;
+	bool pressed;
+};
+
+static struct k_spinlock lock;
+static void (*ready_cb)(void);
+
+/* One event per key and report, see sched_collect() */
+static struct stamp building[KEYPAD_MAX_KEYS];
+static size_t building_len;
+/* Events of building[] on the link, and when they went */
+static size_t submitted_len;
+static uint32_t submitted_at;
+static uint32_t submitted_us;
+static uint8_t frame;
+
+static struct stamp_entry queue[QUEUE_SIZE];
+static uint32_t head;
+static uint32_t tail;
+static uint32_t dropped;
+
+void stamps_enable(void (*ready)(void))
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	ready_cb = ready;
+	tail = head;
+	dropped = 0;
+
+	k_spin_unlock(&lock, key);
+}
+
+void stamps_frame_event(const struct key_event *event)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	if (ready_cb != NULL && building_len < ARRAY_SIZE(building)) {
+		building[building_len++] = (struct stamp){
+			.timestamp = event->timestamp,
+			.key = event->key,
+			.pressed = event->pressed,
+		};
+	}
+
+	k_spin_unlock(&lock, key);
+}
+
+void stamps_frame_submit(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	submitted_len = building_len;
+	submitted_at = latency_timestamp();
+	submitted_us = timebase_uptime_us32();
+
+	k_spin_unlock(&lock, key);
+}
+
+void stamps_frame_done(void)
+{
+	void (*ready)(void);
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	if (submitted_len == 0) {
+		k_spin_unlock(&lock, key);
+		return;
+	}
+
+	for (size_t i = 0; i < submitted_len; i++) {
+		const struct stamp *s = &building[i];
+
+		if (head - tail == QUEUE_SIZE) {
+			dropped++;
+			continue;
+		}
+
+		queue[head++ % QUEUE_SIZE] = (struct stamp_entry){
+			.submit_us = submitted_us,
+			.age_us = latency_to_us(submitted_at - s->timestamp),
+			.frame = frame,
+			.key = s->key,
+			.pressed = s->pressed,
+		};
+	}
+
+	building_len -= submitted_len;
+	memmove(building, &building[submitted_len],
+		building_len * sizeof(building[0]));
+	submitted_len = 0;
+	frame++;
+	ready = ready_cb;
+
+	k_spin_unlock(&lock, key);
+
+	if (ready != NULL) {
+		ready();
+	}
+}
+
+size_t stamps_read(uint8_t *buf, size_t len)
+{
+	size_t max = (len - STAMPS_HEADER_SIZE) / STAMPS_EVENT_SIZE;
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	const struct stamp_entry *first;
+	uint8_t *out = &buf[STAMPS_HEADER_SIZE];
+	size_t count = 0;
+
+	if (tail == head) {
+		k_spin_unlock(&lock, key);
+		return 0;
+	}
+
+	first = &queue[tail % QUEUE_SIZE];
+	buf[0] = RAW_HID_IN_STAMPS;
+	buf[1] = first->frame;
+	buf[3] = 0;
+	buf[4] = MIN(dropped, UINT8_MAX);
+	sys_put_le32(first->submit_us, &buf[5]);
+	dropped = 0;
+
+	while (tail != head && queue[tail % QUEUE_SIZE].frame == buf[1]) {
+		const struct stamp_entry *e = &queue[tail % QUEUE_SIZE];
+
+		if (count == max) {
+			buf[3] = STAMPS_MORE;
+			break;
+		}
+
+		out[0] = e->key;
+		out[1] = e->pressed;
+		sys_put_le32(e->age_us, &out[2]);
+		out += STAMPS_EVENT_SIZE;
+		count++;
+		tail++;
+	}
+
+	buf[2] = count;
+
+	k_spin_unlock(&lock, key);
+
+	return STAMPS_HEADER_SIZE + count * STAMPS_EVENT_SIZE;
+}
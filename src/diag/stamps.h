@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Per-event timestamps for the host. Once a keyboard report has been
+ * picked up, every key event it carried is sent on the raw HID
+ * interface with its age at submission, so a host can tell when each
+ * key really changed even when several share one report. With
+ * CONFIG_KEYPAD_LATENCY_EDGE the ages are taken from the hardware
+ * captured first edge, otherwise from the scan interrupt.
+ *
+ * Off until the host turns it on with RAW_HID_CMD_STAMPS. A report,
+ * little endian, see usb/raw_hid.h for byte 0:
+ *
+ *   [0]     RAW_HID_IN_STAMPS
+ *   [1]     frame number, one more per keyboard report with events
+ *   [2]     events in this report
+ *   [3]     STAMPS_MORE if the frame goes on in the next report
+ *   [4]     events dropped since the last report, saturating
+ *   [5..8]  le32 submission of the keyboard report, us of uptime
+ *   [9..]   per event: u8 key, u8 1 press or 0 release, le32 us from
+ *           the event to the submission
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_EVENT_STAMPS is enabled.
+ */
+
+#ifndef KEYPAD_DIAG_STAMPS_H_
+#define KEYPAD_DIAG_STAMPS_H_
+
+#include <zephyr/zephyr.h>
+
+#include "event_ring.h"
+
+#define STAMPS_HEADER_SIZE 9
+#define STAMPS_EVENT_SIZE 6
+/* Byte 3: more events of the same frame follow */
+#define STAMPS_MORE BIT(0)
+
+#if defined(CONFIG_KEYPAD_EVENT_STAMPS)
+
+/*
+ * Start sending, ready is called from the link's completion when
+ * stamps can be read; NULL stops and drops those not read yet.
+ */
+void stamps_enable(void (*ready)(void));
+
+/* The report being built takes event, from the report thread */
+void stamps_frame_event(const struct key_event *event);
+
+/* The report being built went to the link */
+void stamps_frame_submit(void);
+
+/* The submitted report was picked up by the host */
+void stamps_frame_done(void);
+
+/* Fill one stamps report into buf, 0 if there is nothing to send */
+size_t stamps_read(uint8_t *buf, size_t len);
+
+#else
+
+static inline void stamps_enable(void (*ready)(void)) {}
+static inline void stamps_frame_event(const struct key_event *event) {}
+static inline void stamps_frame_submit(void) {}
+static inline void stamps_frame_done(void) {}
+
+static inline size_t stamps_read(uint8_t *buf, size_t len)
+{
+	return 0;
+}
+
+#endif /* CONFIG_KEYPAD_EVENT_STAMPS */
+
+#endif /* KEYPAD_DIAG_STAMPS_H_ */
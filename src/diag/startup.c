@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Times are uptime, which starts with the kernel: time spent in a
+ * bootloader before it is not included.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/logging/log.h>
+
+#include "diag/startup.h"
+#include "timebase.h"
+
+LOG_MODULE_REGISTER(startup, LOG_LEVEL_INF);
+
+#define STARTUP_ENUM_STAGES \
+	(BIT(STARTUP_CONFIGURED) | BIT(STARTUP_FIRST_REPORT))
+/* Stamped again every time */
+#define STARTUP_REPEATED (BIT(STARTUP_VBUS) | BIT(STARTUP_BUS_RESET))
+
+static struct k_spinlock lock;
+static uint32_t stamp_us[STARTUP_STAGE_COUNT];
+/* Bit n: stage n has been stamped */
+static uint32_t reached;
+
+void startup_mark(enum startup_stage stage)
+{
+	uint32_t now = timebase_uptime_us32();
+	k_spinlock_key_t key;
+
+	if ((reached & BIT(stage)) && !(STARTUP_REPEATED & BIT(stage))) {
+		/* Every report comes through here, keep it to one test */
+		return;
+	}
+
+	key = k_spin_lock(&lock);
+	if (stage == STARTUP_VBUS) {
+		/* A new plug, the bus reset of the last one is gone */
+		reached &= ~(STARTUP_ENUM_STAGES | BIT(STARTUP_BUS_RESET));
+	} else if (stage == STARTUP_BUS_RESET) {
+		/* A new enumeration, its stages are stamped again */
+		reached &= ~STARTUP_ENUM_STAGES;
+	}
+
+	stamp_us[stage] = now;
+	reached |= BIT(stage);
+	k_spin_unlock(&lock, key);
+
+	if (stage == STARTUP_FIRST_REPORT) {
+		LOG_INF("First report %u us after boot, %u us after bus reset",
+			now, now - stamp_us[STARTUP_BUS_RESET]);
+	}
+
+	if (stage == STARTUP_FIRST_REPORT && (reached & BIT(STARTUP_VBUS))) {
+		LOG_INF("First report %u us after the plug",
+			now - stamp_us[STARTUP_VBUS]);
+	}
+}
+
+void startup_get(uint32_t out[STARTUP_STAGE_COUNT])
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	for (int stage = 0; stage < STARTUP_STAGE_COUNT; stage++) {
+		out[stage] = (reached & BIT(stage)) ? stamp_us[stage] : 0;
+	}
+
+	k_spin_unlock(&lock, key);
+}
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static const char *const stage_names[] = {
+	[STARTUP_MAIN] = "main",
+	[STARTUP_USB_ENABLED] = "usb_enable",
+	[STARTUP_INPUT_READY] = "inputs ready",
+	[STARTUP_VBUS] = "vbus",
+	[STARTUP_BUS_RESET] = "bus reset",
+	[STARTUP_CONFIGURED] = "configured",
+	[STARTUP_FIRST_REPORT] = "first report",
+	[STARTUP_DEFERRED] = "deferred",
+};
+
+static int cmd_startup_show(const struct shell *sh, size_t argc,
+			    char **argv)
+{
+	uint32_t us[STARTUP_STAGE_COUNT];
+
+	startup_get(us);
+
+	for (int stage = 0; stage < STARTUP_STAGE_COUNT; stage++) {
+		if (us[stage] == 0) {
+			shell_print(sh, "  %-12s -", stage_names[stage]);
+		} else {
+			shell_print(sh, "  %-12s %u us", stage_names[stage],
+				    us[stage]);
+		}
+	}
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_startup,
+	SHELL_CMD(show, NULL, "Print the startup time stamps",
+		  cmd_startup_show),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(startup, &sub_startup, "Startup time measurement",
+		   NULL);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Startup time stamps, from reset to the first report the host reads.
+ * The boot stages are kept from the first time they are reached; the
+ * enumeration stages start over with every bus reset, so a KVM switch
+ * re-enumerating the device shows its own reset to report time. VBUS
+ * starts them over too, for the time from the plug to typing.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_STARTUP_TIME is enabled.
+ */
+
+#ifndef KEYPAD_DIAG_STARTUP_H_
+#define KEYPAD_DIAG_STARTUP_H_
+
+#include <zephyr/zephyr.h>
+
+enum startup_stage {
+	/* Boot */
+	STARTUP_MAIN,
+	STARTUP_USB_ENABLED,
+	STARTUP_INPUT_READY,
+	/* Latest enumeration, and the cable plugged in before it */
+	STARTUP_VBUS,
+	STARTUP_BUS_RESET,
+	STARTUP_CONFIGURED,
+	STARTUP_FIRST_REPORT,
+	/* Boot, the non-critical subsystems up */
+	STARTUP_DEFERRED,
+	STARTUP_STAGE_COUNT,
+};
+
+#if defined(CONFIG_KEYPAD_STARTUP_TIME)
+
+/* Stamp a stage unless it already is; ISR safe */
+void startup_mark(enum startup_stage stage);
+
+/* Microseconds since boot of each stage, 0 if not reached */
+void startup_get(uint32_t out[STARTUP_STAGE_COUNT]);
+
+#else
+
+static inline void startup_mark(enum startup_stage stage) {}
+
+#endif /* CONFIG_KEYPAD_STARTUP_TIME */
+
+#endif /* KEYPAD_DIAG_STARTUP_H_ */
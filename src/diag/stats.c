@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * One screen of the counters that matter for typing performance, for a
+ * shell on a deployed unit, e.g. over the CDC ACM console of
+ * overlay-cdc.conf. Rates are over the time since the previous
+ * "stats show", or since boot for the first one.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/shell/shell.h>
+
+#include "debounce.h"
+#include "diag/latency.h"
+#include "event_ring.h"
+#include "input/debounce_hw.h"
+#include "input/stuck.h"
+#include "led/led_rgb.h"
+#include "power/activity.h"
+#include "report_sched.h"
+#include "report_sink.h"
+#include "scan.h"
+
+struct stats_mark {
+	int64_t ms;
+	uint32_t events;
+	uint32_t reports;
+};
+
+static struct stats_mark last;
+
+/* Per second over ms, in tenths */
+static uint32_t stats_rate(uint32_t count, int64_t ms)
+{
+	return ms > 0 ? (uint32_t)(count * 10000ULL / ms) : 0;
+}
+
+static void stats_latency(const struct shell *sh)
+{
+#if defined(CONFIG_KEYPAD_LATENCY_STATS)
+	struct latency_hist h;
+
+	latency_hist_get(LATENCY_EVENT_TO_DONE, &h);
+	shell_print(sh, "event->done: n %u p50 %u p99 %u max %u us", h.count,
+		    latency_hist_percentile(&h, 50),
+		    latency_hist_percentile(&h, 99), h.max_us);
+#endif
+}
+
+static void stats_power(const struct shell *sh)
+{
+#if defined(CONFIG_KEYPAD_ACTIVITY_PM)
+	struct activity_stats s;
+	uint64_t total;
+
+	activity_stats_get(&s);
+	total = s.mode_ms[ACTIVITY_TYPING] + s.mode_ms[ACTIVITY_IDLE];
+	if (total == 0) {
+		return;
+	}
+
+	shell_print(sh, "residency: typing %u%%, idle %u%%",
+		    (uint32_t)(s.mode_ms[ACTIVITY_TYPING] * 100 / total),
+		    (uint32_t)(s.mode_ms[ACTIVITY_IDLE] * 100 / total));
+
+#if defined(CONFIG_PM)
+	for (int state = 0; state < PM_STATE_COUNT; state++) {
+		if (s.state_entries[state] != 0) {
+			shell_print(sh, "  state %d: %u%%", state,
+				    (uint32_t)(s.state_ms[state] * 100 /
+					       total));
+		}
+	}
+#endif
+
+#if defined(CONFIG_KEYPAD_EDGE_TIMESTAMP)
+	if (s.wake[ACTIVITY_TYPING].count != 0) {
+		shell_print(sh, "wakeup: floor %u ns typing, up to %u ns idle",
+			    s.wake[ACTIVITY_TYPING].min_ns,
+			    s.wake[ACTIVITY_IDLE].max_ns);
+	}
+#endif
+#endif
+}
+
+static void stats_rgb(const struct shell *sh)
+{
+#if defined(CONFIG_KEYPAD_LED_RGB)
+	struct led_rgb_stats s;
+
+	led_rgb_stats_get(&s);
+	shell_print(sh, "rgb: %u fps of %u allowed, late %u, lowered %u times",
+		    s.fps, s.fps_target, s.late, s.degraded);
+	shell_print(sh, "rgb: %u mA, dimmed %u frames", s.current_ua / 1000,
+		    s.limited);
+#endif
+}
+
+static void stats_stuck(const struct shell *sh)
+{
+#if defined(CONFIG_KEYPAD_STUCK_CHECK)
+	struct stuck_stats s;
+
+	stuck_stats_get(&s);
+	shell_print(sh, "stuck keys: %u released, %u read again, %u checks",
+		    s.released, s.resynced, s.checks);
+#endif
+}
+
+static int cmd_stats_show(const struct shell *sh, size_t argc, char **argv)
+{
+	struct report_sched_stats sched;
+	struct report_sink_stats links;
+	struct stats_mark now;
+	uint32_t events_rate, reports_rate;
+	uint32_t rejects;
+
+	report_sched_stats_get(&sched);
+	report_sink_totals_get(&links);
+	now.ms = k_uptime_get();
+	now.events = event_ring_put_count();
+	now.reports = sched.sent;
+
+	events_rate = stats_rate(now.events - last.events, now.ms - last.ms);
+	reports_rate = stats_rate(now.reports - last.reports,
+				  now.ms - last.ms);
+	rejects = IS_ENABLED(CONFIG_KEYPAD_DEBOUNCE_HW) ?
+		  debounce_hw_extend_count() : debounce_reject_count();
+
+	shell_print(sh, "over %u ms: %u.%u events/s, %u.%u reports/s",
+		    (uint32_t)(now.ms - last.ms), events_rate / 10,
+		    events_rate % 10, reports_rate / 10, reports_rate % 10);
+	shell_print(sh, "events %u, ring overflows %u, debounce rejects %u",
+		    now.events, event_ring_overflow_count(), rejects);
+	if (IS_ENABLED(CONFIG_KEYPAD_SCAN_LATCH)) {
+		shell_print(sh, "pulses recovered from the latches %u",
+			    scan_pulse_count());
+	}
+	shell_print(sh, "reports %u, write errors %u, waited on busy link %u",
+		    now.reports, links.errors, sched.busy);
+	for (int i = 0; i < REPORT_LANE_COUNT; i++) {
+		shell_print(sh, "  lane %d: %u reports, %u deferred, "
+			    "wait %u us max %u, up to %u ahead", i,
+			    sched.lanes[i].sent, sched.lanes[i].deferred,
+			    sched.lanes[i].wait_us, sched.lanes[i].wait_max_us,
+			    sched.lanes[i].ahead_max);
+	}
+	stats_stuck(sh);
+	stats_latency(sh);
+	stats_power(sh);
+	stats_rgb(sh);
+
+	last = now;
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_stats,
+	SHELL_CMD(show, NULL, "Print the pipeline counters and rates",
+		  cmd_stats_show),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(stats, &sub_stats, "Typing performance counters", NULL);
@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * The pipeline counters run since boot and the shell reads them too,
+ * so each heartbeat takes the difference from the previous one instead
+ * of clearing them. That includes the latency histogram, whose bucket
+ * differences give the percentiles of the interval alone.
+ */
+
+#include <zephyr/zephyr.h>
+
+#include <memfault/core/data_packetizer.h>
+#include <memfault/metrics/metrics.h>
+
+#include "diag/latency.h"
+#include "diag/telemetry.h"
+#include "diag/wake.h"
+#include "event_ring.h"
+#include "report_sink.h"
+
+/* At the previous heartbeat */
+static struct latency_hist last_hist;
+static struct report_sink_stats last_links;
+static uint32_t last_overflows;
+#if defined(CONFIG_KEYPAD_WAKE_PROFILER)
+static uint32_t last_wakes;
+#endif
+
+void telemetry_usb_reset(void)
+{
+	memfault_metrics_heartbeat_add(MEMFAULT_METRICS_KEY(usb_resets), 1);
+}
+
+size_t telemetry_chunk_read(uint8_t *buf, size_t len)
+{
+	size_t n = len;
+
+	if (!memfault_packetizer_get_chunk(buf, &n)) {
+		return 0;
+	}
+
+	return n;
+}
+
+static void telemetry_latency(void)
+{
+	struct latency_hist h, d;
+
+	latency_hist_get(LATENCY_EVENT_TO_DONE, &h);
+
+	d.count = h.count - last_hist.count;
+	/* Only since boot, the percentiles stay below it */
+	d.max_us = h.max_us;
+	for (int b = 0; b < LATENCY_BUCKETS; b++) {
+		d.bucket[b] = h.bucket[b] - last_hist.bucket[b];
+	}
+
+	last_hist = h;
+
+	if (d.count == 0) {
+		/* No typing, no samples rather than zeros */
+		return;
+	}
+
+	memfault_metrics_heartbeat_set_unsigned(
+		MEMFAULT_METRICS_KEY(typing_latency_p50_us),
+		latency_hist_percentile(&d, 50));
+	memfault_metrics_heartbeat_set_unsigned(
+		MEMFAULT_METRICS_KEY(typing_latency_p99_us),
+		latency_hist_percentile(&d, 99));
+	memfault_metrics_heartbeat_set_unsigned(
+		MEMFAULT_METRICS_KEY(typing_events), d.count);
+}
+
+static void telemetry_wakes(void)
+{
+#if defined(CONFIG_KEYPAD_WAKE_PROFILER)
+	struct wake_stats w;
+	uint32_t wakes = 0;
+
+	wake_stats_get(&w);
+	for (int source = 0; source < WAKE_SOURCE_COUNT; source++) {
+		wakes += w.count[source];
+	}
+
+	memfault_metrics_heartbeat_set_unsigned(
+		MEMFAULT_METRICS_KEY(idle_wakeups), wakes - last_wakes);
+	last_wakes = wakes;
+#endif
+}
+
+/* Called by the Memfault SDK at the end of every heartbeat interval */
+void memfault_metrics_heartbeat_collect_data(void)
+{
+	struct report_sink_stats links;
+	uint32_t overflows = event_ring_overflow_count();
+
+	telemetry_latency();
+
+	report_sink_totals_get(&links);
+	memfault_metrics_heartbeat_set_unsigned(
+		MEMFAULT_METRICS_KEY(reports_sent),
+		links.sent - last_links.sent);
+	memfault_metrics_heartbeat_set_unsigned(
+		MEMFAULT_METRICS_KEY(reports_dropped),
+		links.dropped - last_links.dropped);
+	memfault_metrics_heartbeat_set_unsigned(
+		MEMFAULT_METRICS_KEY(report_write_errors),
+		links.errors - last_links.errors);
+	memfault_metrics_heartbeat_set_unsigned(
+		MEMFAULT_METRICS_KEY(event_ring_overflows),
+		overflows - last_overflows);
+	last_links = links;
+	last_overflows = overflows;
+
+	telemetry_wakes();
+}
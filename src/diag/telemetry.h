@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Memfault heartbeat metrics for the fleet: the event->done latency
+ * percentiles of each heartbeat interval, reports dropped by links
+ * going down, link write errors, event ring overflows, USB bus resets
+ * and, with CONFIG_KEYPAD_WAKE_PROFILER, wakeups from idle. The
+ * metrics are declared in memfault_config/.
+ *
+ * A keypad has no network of its own: a host agent,
+ * scripts/memfault_agent.py, reads the Memfault chunks over raw HID
+ * with the MEMFAULT command and posts them to the cloud.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_MEMFAULT is enabled.
+ */
+
+#ifndef KEYPAD_DIAG_TELEMETRY_H_
+#define KEYPAD_DIAG_TELEMETRY_H_
+
+#include <zephyr/zephyr.h>
+
+#if defined(CONFIG_KEYPAD_MEMFAULT)
+
+/* A USB bus reset, from the device status callback */
+void telemetry_usb_reset(void);
+
+/*
+ * Take the next Memfault chunk of up to len bytes, 0 when there is
+ * nothing to send. A chunk taken is gone, from a thread only.
+ */
+size_t telemetry_chunk_read(uint8_t *buf, size_t len);
+
+#else
+
+static inline void telemetry_usb_reset(void) {}
+
+static inline size_t telemetry_chunk_read(uint8_t *buf, size_t len)
+{
+	return 0;
+}
+
+#endif /* CONFIG_KEYPAD_MEMFAULT */
+
+#endif /* KEYPAD_DIAG_TELEMETRY_H_ */
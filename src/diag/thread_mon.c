@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Stacks grow down, so the fill left over from CONFIG_INIT_STACKS sits
+ * at the bottom of each; the peak is what is left of the stack above
+ * it. Threads are walked without the thread list lock, as the kernel
+ * shell does, so scanning their stacks does not hold off interrupts.
+ * The kernel charges interrupt time to the thread it interrupted, so
+ * the interrupt stack has no load of its own.
+ */
+
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/init.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/logging/log.h>
+
+#include "diag/thread_mon.h"
+
+LOG_MODULE_REGISTER(thread_mon, LOG_LEVEL_INF);
+
+#define MON_THREADS CONFIG_KEYPAD_THREAD_MON_THREADS
+/* The fill of CONFIG_INIT_STACKS */
+#define STACK_FILL 0xaa
+
+K_KERNEL_STACK_ARRAY_EXTERN(z_interrupt_stacks, CONFIG_MP_NUM_CPUS,
+			    CONFIG_ISR_STACK_SIZE);
+
+/* Runtime of a thread at the previous sample */
+struct mon_slot {
+	const struct k_thread *thread;
+	uint64_t cycles;
+	bool warned;
+};
+
+struct mon_sample {
+	struct thread_mon_record *records;
+	struct mon_slot *slots;
+	size_t count;
+	uint32_t elapsed;
+};
+
+static struct k_spinlock lock;
+static struct thread_mon_record records[MON_THREADS + 1];
+static size_t record_count;
+
+/* Only the sample work touches these */
+static struct thread_mon_record next[ARRAY_SIZE(records)];
+static struct mon_slot slots[MON_THREADS];
+static struct mon_slot next_slots[MON_THREADS];
+static uint32_t sampled_at;
+static bool isr_warned;
+
+static struct k_work_delayable sample_work;
+
+static bool mon_over(size_t peak, size_t size)
+{
+	return peak * 100 >= size * CONFIG_KEYPAD_THREAD_MON_WARN_PERCENT;
+}
+
+static const struct mon_slot *mon_slot_find(const struct k_thread *thread)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(slots); i++) {
+		if (slots[i].thread == thread) {
+			return &slots[i];
+		}
+	}
+
+	return NULL;
+}
+
+static void mon_thread(const struct k_thread *cthread, void *user_data)
+{
+	struct k_thread *thread = (struct k_thread *)cthread;
+	struct mon_sample *s = user_data;
+	const struct mon_slot *prev = mon_slot_find(thread);
+	struct thread_mon_record *r;
+	k_thread_runtime_stats_t rt;
+	struct mon_slot *slot;
+	const char *name;
+	size_t unused;
+
+	if (s->count == MON_THREADS) {
+		return;
+	}
+
+	r = &s->records[s->count];
+	slot = &s->slots[s->count];
+	s->count++;
+
+	memset(r, 0, sizeof(*r));
+	name = k_thread_name_get(thread);
+	if (name != NULL && name[0] != '\0') {
+		strncpy(r->name, name, sizeof(r->name));
+	} else {
+		snprintk(r->name, sizeof(r->name), "%p", thread);
+	}
+
+	slot->thread = thread;
+	slot->warned = prev != NULL && prev->warned;
+
+	r->stack_size = sys_cpu_to_le16(thread->stack_info.size);
+	if (k_thread_stack_space_get(thread, &unused) == 0) {
+		size_t peak = thread->stack_info.size - unused;
+
+		r->stack_peak = sys_cpu_to_le16(peak);
+		if (!slot->warned && mon_over(peak, thread->stack_info.size)) {
+			LOG_WRN("Thread %.*s used %u of %u stack bytes",
+				(int)sizeof(r->name), r->name, peak,
+				thread->stack_info.size);
+			slot->warned = true;
+		}
+	}
+
+	slot->cycles = prev != NULL ? prev->cycles : 0;
+	if (k_thread_runtime_stats_get(thread, &rt) == 0) {
+		uint64_t ran = rt.execution_cycles - slot->cycles;
+
+		slot->cycles = rt.execution_cycles;
+		if (s->elapsed != 0) {
+			r->load = sys_cpu_to_le16(
+				MIN(ran * 1000 / s->elapsed, 1000));
+		}
+	}
+}
+
+static void mon_isr(struct thread_mon_record *r)
+{
+	const uint8_t *buf = Z_KERNEL_STACK_BUFFER(z_interrupt_stacks[0]);
+	size_t size = K_KERNEL_STACK_SIZEOF(z_interrupt_stacks[0]);
+	size_t unused = 0;
+
+	while (unused < size && buf[unused] == STACK_FILL) {
+		unused++;
+	}
+
+	memset(r, 0, sizeof(*r));
+	strncpy(r->name, "isr", sizeof(r->name));
+	r->stack_size = sys_cpu_to_le16(size);
+	r->stack_peak = sys_cpu_to_le16(size - unused);
+
+	if (!isr_warned && mon_over(size - unused, size)) {
+		LOG_WRN("Interrupts used %u of %u stack bytes", size - unused,
+			size);
+		isr_warned = true;
+	}
+}
+
+static void mon_sample(struct k_work *work)
+{
+	uint32_t now = k_cycle_get_32();
+	struct mon_sample s = {
+		.records = next,
+		.slots = next_slots,
+		.elapsed = now - sampled_at,
+	};
+	k_spinlock_key_t key;
+
+	memset(next_slots, 0, sizeof(next_slots));
+	k_thread_foreach_unlocked(mon_thread, &s);
+	mon_isr(&next[s.count]);
+
+	memcpy(slots, next_slots, sizeof(slots));
+	sampled_at = now;
+
+	key = k_spin_lock(&lock);
+	memcpy(records, next, (s.count + 1) * sizeof(next[0]));
+	record_count = s.count + 1;
+	k_spin_unlock(&lock, key);
+
+	k_work_reschedule(&sample_work,
+			  K_MSEC(CONFIG_KEYPAD_THREAD_MON_INTERVAL_MS));
+}
+
+size_t thread_mon_read(size_t offset, uint8_t *buf, size_t len)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	size_t size = record_count * sizeof(records[0]);
+
+	if (offset >= size) {
+		len = 0;
+	} else {
+		len = MIN(len, size - offset);
+		memcpy(buf, (const uint8_t *)records + offset, len);
+	}
+
+	k_spin_unlock(&lock, key);
+
+	return len;
+}
+
+static int thread_mon_init(const struct device *dev)
+{
+	ARG_UNUSED(dev);
+
+	sampled_at = k_cycle_get_32();
+	k_work_init_delayable(&sample_work, mon_sample);
+	k_work_schedule(&sample_work,
+			K_MSEC(CONFIG_KEYPAD_THREAD_MON_INTERVAL_MS));
+
+	return 0;
+}
+
+SYS_INIT(thread_mon_init, APPLICATION, 0);
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static int cmd_threads_show(const struct shell *sh, size_t argc, char **argv)
+{
+	struct thread_mon_record r;
+
+	shell_print(sh, "%-12s %6s %6s %5s %6s", "thread", "stack", "peak",
+		    "used", "load");
+
+	for (size_t off = 0; thread_mon_read(off, (uint8_t *)&r,
+					     sizeof(r)) == sizeof(r);
+	     off += sizeof(r)) {
+		uint16_t size = sys_le16_to_cpu(r.stack_size);
+		uint16_t peak = sys_le16_to_cpu(r.stack_peak);
+		uint16_t load = sys_le16_to_cpu(r.load);
+
+		shell_print(sh, "%-12.*s %6u %6u %4u%% %4u.%u%%",
+			    (int)sizeof(r.name), r.name, size, peak,
+			    size != 0 ? peak * 100 / size : 0,
+			    load / 10, load % 10);
+	}
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_threads,
+	SHELL_CMD(show, NULL, "Print the stack peaks and CPU load",
+		  cmd_threads_show),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(threads, &sub_threads, "Stack and CPU load monitor",
+		   NULL);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Stack and CPU load monitor. Once per CONFIG_KEYPAD_THREAD_MON_INTERVAL_MS
+ * the system work queue samples every thread and the interrupt stack:
+ * the peak stack use since boot, from the untouched part of the
+ * CONFIG_INIT_STACKS fill, and the share of the core each thread took
+ * over the interval, from the kernel's runtime statistics. The stack
+ * sizes of prj.conf are meant to be set from these numbers.
+ *
+ * Read over raw HID with the THREADS command or from the "threads"
+ * shell command.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_THREAD_MON is enabled.
+ */
+
+#ifndef KEYPAD_DIAG_THREAD_MON_H_
+#define KEYPAD_DIAG_THREAD_MON_H_
+
+#include <zephyr/zephyr.h>
+
+#define THREAD_MON_NAME_LEN 12
+
+/* One thread of the last sample, as read by thread_mon_read() */
+struct thread_mon_record {
+	/* NUL padded, "isr" for the interrupt stack */
+	char name[THREAD_MON_NAME_LEN];
+	/* Bytes, little endian */
+	uint16_t stack_size;
+	uint16_t stack_peak;
+	/* Share of the core over the last interval, 0.1 % units */
+	uint16_t load;
+	uint16_t reserved;
+} __packed;
+
+#if defined(CONFIG_KEYPAD_THREAD_MON)
+
+/*
+ * Copy up to len bytes of the records of the last sample from offset,
+ * 0 past the end. The idle thread's load is the time the core slept.
+ * Threads past CONFIG_KEYPAD_THREAD_MON_THREADS are left out.
+ */
+size_t thread_mon_read(size_t offset, uint8_t *buf, size_t len);
+
+#else
+
+static inline size_t thread_mon_read(size_t offset, uint8_t *buf, size_t len)
+{
+	return 0;
+}
+
+#endif /* CONFIG_KEYPAD_THREAD_MON */
+
+#endif /* KEYPAD_DIAG_THREAD_MON_H_ */
@@ -0,0 +1,268 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Typing follows the key stream with an event ring reader, like the
+ * lighting, so the scan path only schedules a work item. The batch
+ * runs CONFIG_KEYPAD_TYPING_BATCH_MS after the first new event, as a
+ * background job, and every event costs a few additions: the bin of
+ * an interval is the position of its top bit, and the words per minute
+ * are a sum over a ring of per-second press counts that moves one slot
+ * per second passed.
+ *
+ * Intervals are measured on the event timestamps. The counter behind
+ * them wraps after half a minute at the fastest, so anything longer
+ * than LONG_MS by the uptime of the batches, which is late by up to
+ * the batch delay, goes to the last bin without looking at them.
+ */
+
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/spinlock.h>
+
+#include "bg_sched.h"
+#include "event_ring.h"
+#include "keymap.h"
+#include "diag/latency.h"
+#include "diag/typing.h"
+
+#define BATCH_US (CONFIG_KEYPAD_TYPING_BATCH_MS * USEC_PER_MSEC)
+#define WINDOW_S CONFIG_KEYPAD_TYPING_WPM_WINDOW_S
+/* Past the last bin, and well below a wrap of the timestamps */
+#define LONG_MS (16 * MSEC_PER_SEC)
+
+static void typing_notify(void);
+
+static struct event_ring_sub sub = {
+	.name = "typing",
+	.notify = typing_notify,
+};
+static struct k_spinlock lock;
+
+static struct typing_summary summary;
+/* Taken by a read at offset 0 */
+static struct typing_summary snapshot;
+/* Uptime of the last clearing, and missed events before it */
+static uint32_t started_s;
+static uint32_t missed_base;
+
+/* Presses in each of the last WINDOW_S seconds, head is the latest */
+static uint8_t per_second[WINDOW_S];
+static uint8_t head;
+static uint32_t head_s;
+static uint32_t window_sum;
+
+/* Last press of any key, and of every key still held */
+static bool pressed_any;
+static uint32_t last_press;
+static uint32_t last_press_ms;
+static keypad_bitmap_t held;
+static uint32_t pressed_at[KEYPAD_MAX_KEYS];
+static uint32_t pressed_ms[KEYPAD_MAX_KEYS];
+
+static uint8_t typing_bin(uint32_t from, uint32_t from_ms, uint32_t to,
+			  uint32_t to_ms)
+{
+	uint32_t ms;
+
+	if (to_ms - from_ms >= LONG_MS) {
+		return TYPING_BINS - 1;
+	}
+
+	ms = latency_to_us(to - from) / USEC_PER_MSEC;
+	if (ms < 8) {
+		return 0;
+	}
+
+	return MIN(find_msb_set(ms) - 3, TYPING_BINS - 1);
+}
+
+/* Move the ring to now_s, lock held */
+static void typing_window_advance(uint32_t now_s)
+{
+	if (now_s - head_s >= WINDOW_S) {
+		memset(per_second, 0, sizeof(per_second));
+		window_sum = 0;
+		head_s = now_s;
+		return;
+	}
+
+	while (head_s != now_s) {
+		head = (head + 1) % WINDOW_S;
+		window_sum -= per_second[head];
+		per_second[head] = 0;
+		head_s++;
+	}
+}
+
+static void typing_wpm_update(void)
+{
+	/* Five presses to a word */
+	summary.wpm = window_sum * 60 / (5 * WINDOW_S);
+	summary.wpm_max = MAX(summary.wpm_max, summary.wpm);
+}
+
+/* One event, lock held */
+static void typing_event(const struct key_event *event, uint32_t now_ms)
+{
+	uint8_t key = event->key;
+
+#if defined(CONFIG_KEYPAD_LOOPBACK)
+	if (event->loopback) {
+		/* Injected by a test, not typed */
+		return;
+	}
+#endif
+
+	if (key >= KEYPAD_MAX_KEYS) {
+		return;
+	}
+
+	if (!event->pressed) {
+		if (held & BIT(key)) {
+			held &= ~BIT(key);
+			summary.dwell[typing_bin(pressed_at[key],
+						 pressed_ms[key],
+						 event->timestamp, now_ms)]++;
+		}
+		return;
+	}
+
+	held |= BIT(key);
+	pressed_at[key] = event->timestamp;
+	pressed_ms[key] = now_ms;
+
+	if (pressed_any) {
+		summary.interval[typing_bin(last_press, last_press_ms,
+					    event->timestamp, now_ms)]++;
+	}
+
+	pressed_any = true;
+	last_press = event->timestamp;
+	last_press_ms = now_ms;
+	summary.presses++;
+
+	typing_window_advance(now_ms / MSEC_PER_SEC);
+	if (per_second[head] < UINT8_MAX) {
+		per_second[head]++;
+		window_sum++;
+	}
+
+	typing_wpm_update();
+}
+
+static void typing_batch(struct bg_job *job)
+{
+	struct key_event events[8];
+	uint32_t now_ms = k_uptime_get_32();
+	k_spinlock_key_t key;
+	size_t count;
+
+	while ((count = event_ring_read(&sub.reader, events,
+					ARRAY_SIZE(events))) > 0) {
+		key = k_spin_lock(&lock);
+		for (size_t i = 0; i < count; i++) {
+			typing_event(&events[i], now_ms);
+		}
+		summary.missed = sub.reader.missed - missed_base;
+		k_spin_unlock(&lock, key);
+	}
+}
+
+static struct bg_job batch_job = {
+	.name = "typing",
+	.run = typing_batch,
+};
+
+/* Key events were put in the event ring */
+static void typing_notify(void)
+{
+	/* Already scheduled: the batch takes this event too */
+	bg_sched_submit(&batch_job, BATCH_US, 2 * BATCH_US);
+}
+
+size_t typing_read(size_t offset, bool clear, uint8_t *buf, size_t len)
+{
+	uint32_t now_s = k_uptime_get_32() / MSEC_PER_SEC;
+	k_spinlock_key_t key;
+
+	if (offset == 0) {
+		key = k_spin_lock(&lock);
+		typing_window_advance(now_s);
+		typing_wpm_update();
+		summary.seconds = now_s - started_s;
+		snapshot = summary;
+
+		if (clear) {
+			/* The window goes on, only the totals start again */
+			memset(&summary, 0, sizeof(summary));
+			summary.wpm = snapshot.wpm;
+			summary.wpm_max = snapshot.wpm;
+			started_s = now_s;
+			missed_base = sub.reader.missed;
+		}
+		k_spin_unlock(&lock, key);
+	}
+
+	if (offset >= sizeof(snapshot)) {
+		return 0;
+	}
+
+	len = MIN(len, sizeof(snapshot) - offset);
+	memcpy(buf, (const uint8_t *)&snapshot + offset, len);
+
+	return len;
+}
+
+static int typing_init(const struct device *dev)
+{
+	ARG_UNUSED(dev);
+
+	head_s = k_uptime_get_32() / MSEC_PER_SEC;
+	event_ring_subscribe(&sub);
+
+	return 0;
+}
+
+SYS_INIT(typing_init, APPLICATION, 0);
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static void typing_hist_print(const struct shell *sh, const char *name,
+			      const uint32_t *bins)
+{
+	shell_print(sh, "%s:", name);
+
+	for (int i = 0; i < TYPING_BINS; i++) {
+		shell_print(sh, "  %s%5u ms: %u", i == TYPING_BINS - 1 ?
+			    ">=" : "< ", i == TYPING_BINS - 1 ?
+			    BIT(i + 2) : BIT(i + 3), bins[i]);
+	}
+}
+
+static int cmd_typing_show(const struct shell *sh, size_t argc, char **argv)
+{
+	bool clear = argc > 1 && strcmp(argv[1], "clear") == 0;
+	struct typing_summary s;
+
+	(void)typing_read(0, clear, (uint8_t *)&s, sizeof(s));
+
+	shell_print(sh, "%u presses in %u s, %u wpm, at most %u, %u missed",
+		    s.presses, s.seconds, s.wpm, s.wpm_max, s.missed);
+	typing_hist_print(sh, "press to press", s.interval);
+	typing_hist_print(sh, "held", s.dwell);
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_typing,
+	SHELL_CMD_ARG(show, NULL, "Print the typing summary, and start a "
+		      "new one with \"clear\"", cmd_typing_show, 1, 1),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(typing, &sub_typing, "Typing speed and rhythm", NULL);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Typing analytics: rolling words per minute and histograms of the
+ * interval from one press to the next and of the time a key is held,
+ * counted on the device so a host pulls a summary now and then instead
+ * of every key event. Every press counts as a character, five to a
+ * word, over the last CONFIG_KEYPAD_TYPING_WPM_WINDOW_S seconds.
+ *
+ * Read over raw HID with the TYPING command or from the "typing show"
+ * shell command.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_TYPING is enabled.
+ */
+
+#ifndef KEYPAD_DIAG_TYPING_H_
+#define KEYPAD_DIAG_TYPING_H_
+
+#include <zephyr/zephyr.h>
+
+/*
+ * Histogram bins: bin 0 counts below 8 ms, bin n from 2^(n + 2) ms up
+ * to twice that, the last bin everything longer.
+ */
+#define TYPING_BINS 12
+
+/* As read by typing_read(), little endian */
+struct typing_summary {
+	/* Seconds counted, since boot or the last read that cleared */
+	uint32_t seconds;
+	uint32_t presses;
+	/* Key events overwritten in the ring before they were counted */
+	uint32_t missed;
+	/* Words per minute right now, and the most since the clearing */
+	uint16_t wpm;
+	uint16_t wpm_max;
+	/* Press to the next press of any key */
+	uint32_t interval[TYPING_BINS];
+	/* Press to the release of the same key */
+	uint32_t dwell[TYPING_BINS];
+};
+
+#if defined(CONFIG_KEYPAD_TYPING)
+
+/*
+ * Copy up to len bytes of the summary from offset, 0 past the end. A
+ * read at offset 0 takes the snapshot the later offsets read, and with
+ * clear the counting starts again from zero right after it.
+ */
+size_t typing_read(size_t offset, bool clear, uint8_t *buf, size_t len);
+
+#else
+
+static inline size_t typing_read(size_t offset, bool clear, uint8_t *buf,
+				 size_t len)
+{
+	return 0;
+}
+
+#endif /* CONFIG_KEYPAD_TYPING */
+
+#endif /* KEYPAD_DIAG_TYPING_H_ */
@@ -0,0 +1,240 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * The upload stages nest, decryption hands the plaintext to the apply
+ * and the apply of a bench upload to flash, so the stages entered are
+ * kept on a short stack and a stage's clock stops while one it called
+ * runs. The stack is only touched from the upload transport, one owner
+ * at a time like upload.c; the sums take the lock, the config store
+ * adds to them from the background thread.
+ *
+ * The bench target writes through flash_img as the DFU does, erasing
+ * the slot page by page ahead of the writes, so its figures are those
+ * of a firmware image on the same flash. The secondary slot holds no
+ * image worth keeping: a DFU overwrites it anyway, and the swap is
+ * only ever requested at the end of one.
+ */
+
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/dfu/flash_img.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/logging/log.h>
+
+#include "diag/latency.h"
+#include "diag/upload_bench.h"
+#include "timebase.h"
+
+LOG_MODULE_REGISTER(upload_bench, LOG_LEVEL_INF);
+
+/* DECRYPT, APPLY, FLASH is as deep as the uploads go */
+#define BENCH_DEPTH 4
+
+static struct k_spinlock lock;
+static uint64_t sums[UPLOAD_BENCH_STAGE_COUNT];
+static uint32_t uploads;
+static uint32_t bytes;
+/* timebase_now() of the first begin, 0 before it, and the last end */
+static uint64_t first_begin;
+static uint64_t last_end;
+
+static enum upload_bench_stage stack[BENCH_DEPTH];
+static uint8_t depth;
+/* timebase_now32() the stage on top of the stack last started */
+static uint32_t mark;
+
+static struct flash_img_context img;
+
+void upload_bench_start(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	memset(sums, 0, sizeof(sums));
+	uploads = 0;
+	bytes = 0;
+	first_begin = 0;
+	last_end = 0;
+	k_spin_unlock(&lock, key);
+
+	latency_reset();
+}
+
+void upload_bench_begin(void)
+{
+	uint64_t now = timebase_now();
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	if (first_begin == 0) {
+		first_begin = now;
+	}
+	k_spin_unlock(&lock, key);
+
+	/* A dropped upload leaves nothing on the stack */
+	depth = 0;
+}
+
+void upload_bench_end(uint32_t len)
+{
+	uint64_t now = timebase_now();
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	uploads++;
+	bytes += len;
+	last_end = now;
+	k_spin_unlock(&lock, key);
+}
+
+void upload_bench_add(enum upload_bench_stage stage, uint32_t start)
+{
+	uint32_t elapsed = timebase_now32() - start;
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	sums[stage] += elapsed;
+	k_spin_unlock(&lock, key);
+}
+
+void upload_bench_enter(enum upload_bench_stage stage)
+{
+	uint32_t now = timebase_now32();
+
+	if (depth == BENCH_DEPTH) {
+		return;
+	}
+
+	if (depth > 0) {
+		upload_bench_add(stack[depth - 1], mark);
+	}
+
+	stack[depth++] = stage;
+	mark = now;
+}
+
+void upload_bench_exit(void)
+{
+	if (depth == 0) {
+		return;
+	}
+
+	upload_bench_add(stack[--depth], mark);
+	/* The stage below goes on from here */
+	mark = timebase_now32();
+}
+
+int upload_bench_target_begin(void)
+{
+	int ret = flash_img_init(&img);
+
+	if (ret < 0) {
+		LOG_ERR("No secondary slot, error: %d", ret);
+	}
+
+	return ret;
+}
+
+int upload_bench_target_data(const uint8_t *data, size_t len)
+{
+	int ret;
+
+	upload_bench_enter(UPLOAD_BENCH_FLASH);
+	ret = flash_img_buffered_write(&img, data, len, false);
+	upload_bench_exit();
+
+	return ret;
+}
+
+int upload_bench_target_end(void)
+{
+	int ret;
+
+	upload_bench_enter(UPLOAD_BENCH_FLASH);
+	ret = flash_img_buffered_write(&img, NULL, 0, true);
+	upload_bench_exit();
+
+	return ret;
+}
+
+size_t upload_bench_read(uint8_t *buf, size_t len)
+{
+	uint8_t result[UPLOAD_BENCH_RESULT_SIZE];
+	struct latency_hist h;
+	k_spinlock_key_t key;
+
+	latency_hist_get(LATENCY_EVENT_TO_DONE, &h);
+
+	key = k_spin_lock(&lock);
+	sys_put_le32(uploads, &result[0]);
+	sys_put_le32(bytes, &result[4]);
+	sys_put_le32(last_end > first_begin ?
+		     TIMEBASE_TO_US(last_end - first_begin) : 0, &result[8]);
+	for (int i = 0; i < UPLOAD_BENCH_STAGE_COUNT; i++) {
+		sys_put_le32(TIMEBASE_TO_US(sums[i]), &result[12 + 4 * i]);
+	}
+	k_spin_unlock(&lock, key);
+
+	sys_put_le32(h.count, &result[36]);
+	sys_put_le32(latency_hist_percentile(&h, 50), &result[40]);
+	sys_put_le32(latency_hist_percentile(&h, 99), &result[44]);
+	sys_put_le32(h.max_us, &result[48]);
+
+	len = MIN(len, sizeof(result));
+	memcpy(buf, result, len);
+
+	return len;
+}
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static const char *const stage_names[] = {
+	[UPLOAD_BENCH_CRC] = "crc",
+	[UPLOAD_BENCH_DECRYPT] = "decrypt",
+	[UPLOAD_BENCH_APPLY] = "apply",
+	[UPLOAD_BENCH_FLASH] = "flash",
+	[UPLOAD_BENCH_COMMIT] = "commit",
+	[UPLOAD_BENCH_STORE] = "store",
+};
+
+static int cmd_bench_show(const struct shell *sh, size_t argc, char **argv)
+{
+	uint8_t r[UPLOAD_BENCH_RESULT_SIZE];
+	uint32_t span;
+
+	(void)upload_bench_read(r, sizeof(r));
+	span = sys_get_le32(&r[8]);
+	shell_print(sh, "%u uploads, %u bytes in %u us, %u KB/s",
+		    sys_get_le32(&r[0]), sys_get_le32(&r[4]), span,
+		    span != 0 ? (uint32_t)((uint64_t)sys_get_le32(&r[4]) *
+					   1000 / 1024 * 1000 / span) : 0);
+	for (int i = 0; i < UPLOAD_BENCH_STAGE_COUNT; i++) {
+		shell_print(sh, "  %-8s %u us", stage_names[i],
+			    sys_get_le32(&r[12 + 4 * i]));
+	}
+	shell_print(sh, "%u reports meanwhile: p50 %u p99 %u max %u us",
+		    sys_get_le32(&r[36]), sys_get_le32(&r[40]),
+		    sys_get_le32(&r[44]), sys_get_le32(&r[48]));
+
+	return 0;
+}
+
+static int cmd_bench_start(const struct shell *sh, size_t argc,
+			   char **argv)
+{
+	upload_bench_start();
+	shell_print(sh, "Window started");
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_upload_bench,
+	SHELL_CMD(show, NULL, "Print the window so far", cmd_bench_show),
+	SHELL_CMD(start, NULL, "Start a new window", cmd_bench_start),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(upload_bench, &sub_upload_bench,
+		   "Configuration upload benchmark", NULL);
+#endif /* CONFIG_SHELL */
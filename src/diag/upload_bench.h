@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Configuration upload benchmark. Between a start and a read, every
+ * upload is timed by stage as it passes through the keypad, the time
+ * in each stage excluding the stages it calls:
+ *
+ *   CRC      the CRC32 of the bytes as they come in
+ *   DECRYPT  AES-CCM decryption and the tag, sealed uploads only
+ *   APPLY    copying the plaintext where it goes
+ *   FLASH    programming flash as the bytes come, UPLOAD_TARGET_BENCH
+ *   COMMIT   upload_end() applying the upload
+ *   STORE    the config store writing the changes, later, off the
+ *            upload path and only while nobody types
+ *
+ * and the key latency histogram, event to report done, starts over
+ * with the window, so typing meanwhile shows what the uploads cost the
+ * input path. The result, little endian:
+ *
+ *   [0..3]    le32 uploads ended
+ *   [4..7]    le32 bytes of them on the wire
+ *   [8..11]   le32 us from the first begin to the last end
+ *   [12..35]  le32 us in each stage, in the order above
+ *   [36..39]  le32 reports in the latency histogram
+ *   [40..51]  le32 p50, p99 and max event to done us
+ *
+ * The time the uploads spent in none of the stages is the transport's,
+ * waiting for chunks. UPLOAD_TARGET_BENCH is an upload of any bytes that
+ * are written to the MCUboot secondary slot like an image and then
+ * left there, never swapped to, for flash throughput at any size; it
+ * may be sent encrypted.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_UPLOAD_BENCH is enabled.
+ */
+
+#ifndef KEYPAD_DIAG_UPLOAD_BENCH_H_
+#define KEYPAD_DIAG_UPLOAD_BENCH_H_
+
+#include <zephyr/zephyr.h>
+
+#include "timebase.h"
+
+enum upload_bench_stage {
+	UPLOAD_BENCH_CRC,
+	UPLOAD_BENCH_DECRYPT,
+	UPLOAD_BENCH_APPLY,
+	UPLOAD_BENCH_FLASH,
+	UPLOAD_BENCH_COMMIT,
+	UPLOAD_BENCH_STORE,
+	UPLOAD_BENCH_STAGE_COUNT,
+};
+
+#define UPLOAD_BENCH_RESULT_SIZE 52
+
+#if defined(CONFIG_KEYPAD_UPLOAD_BENCH)
+
+/* Start a window: the counters and the latency histogram start over */
+void upload_bench_start(void);
+
+/* An upload begun, and one ended and applied with bytes on the wire */
+void upload_bench_begin(void);
+void upload_bench_end(uint32_t bytes);
+
+/*
+ * Time stage from the upload transport until the matching exit; a
+ * stage entered meanwhile is taken out of it
+ */
+void upload_bench_enter(enum upload_bench_stage stage);
+void upload_bench_exit(void);
+
+/* Add the time of stage since start, a timebase_now32(), any thread */
+void upload_bench_add(enum upload_bench_stage stage, uint32_t start);
+
+/* UPLOAD_TARGET_BENCH, from upload.c like dfu.h */
+int upload_bench_target_begin(void);
+int upload_bench_target_data(const uint8_t *data, size_t len);
+int upload_bench_target_end(void);
+
+/* Copy the result of the window so far, returns its length */
+size_t upload_bench_read(uint8_t *buf, size_t len);
+
+#else
+
+static inline void upload_bench_start(void) {}
+static inline void upload_bench_begin(void) {}
+static inline void upload_bench_end(uint32_t bytes) {}
+static inline void upload_bench_enter(enum upload_bench_stage stage) {}
+static inline void upload_bench_exit(void) {}
+
+static inline void upload_bench_add(enum upload_bench_stage stage,
+				    uint32_t start)
+{
+}
+
+static inline int upload_bench_target_begin(void)
+{
+	return -ENOTSUP;
+}
+
+static inline int upload_bench_target_data(const uint8_t *data, size_t len)
+{
+	return -ENOTSUP;
+}
+
+static inline int upload_bench_target_end(void)
+{
+	return -ENOTSUP;
+}
+
+static inline size_t upload_bench_read(uint8_t *buf, size_t len)
+{
+	return 0;
+}
+
+#endif /* CONFIG_KEYPAD_UPLOAD_BENCH */
+
+#endif /* KEYPAD_DIAG_UPLOAD_BENCH_H_ */
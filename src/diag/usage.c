@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Counters are aligned 32-bit words, which Cortex-M reads and writes
+ * whole, so a reader never sees one half updated. A copy taken while
+ * a writer runs may be a count behind, which the next save makes up.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/init.h>
+#include <zephyr/logging/log.h>
+
+#include "config/config_store.h"
+#include "debounce.h"
+#include "diag/usage.h"
+
+LOG_MODULE_REGISTER(usage, LOG_LEVEL_INF);
+
+static struct usage_counters counters;
+/* Last release of every key, k_uptime_get_32() */
+static uint32_t released_ms[KEYPAD_MAX_KEYS];
+/* Counted since the last save, set by the writers */
+static bool counted;
+
+void usage_key(uint8_t key, bool pressed)
+{
+	uint32_t now = k_uptime_get_32();
+
+	if (key >= KEYPAD_MAX_KEYS) {
+		return;
+	}
+
+	if (!pressed) {
+		released_ms[key] = now;
+		return;
+	}
+
+	counters.presses[key]++;
+	if (released_ms[key] != 0 &&
+	    now - released_ms[key] < CONFIG_KEYPAD_USAGE_CHATTER_MS) {
+		counters.chatter[key]++;
+	}
+
+	counted = true;
+}
+
+void usage_layer(uint8_t layer)
+{
+	if (layer < LAYER_MAX) {
+		counters.layers[layer]++;
+		counted = true;
+	}
+}
+
+void usage_debounce_widened(uint8_t key)
+{
+	if (key < KEYPAD_MAX_KEYS) {
+		counters.widened[key]++;
+		counted = true;
+	}
+}
+
+size_t usage_read(size_t offset, uint8_t *buf, size_t len)
+{
+	if (offset >= sizeof(counters)) {
+		return 0;
+	}
+
+	len = MIN(len, sizeof(counters) - offset);
+	memcpy(buf, (const uint8_t *)&counters + offset, len);
+
+	return len;
+}
+
+#if defined(CONFIG_KEYPAD_CONFIG_STORE)
+BUILD_ASSERT(sizeof(counters) <= CONFIG_KEYPAD_CONFIG_STORE_MAX_SIZE,
+	     "the counters must fit a stored value");
+
+static ssize_t usage_store_get(void *buf, size_t size)
+{
+	memcpy(buf, &counters, sizeof(counters));
+
+	return sizeof(counters);
+}
+
+static int usage_store_set(const void *data, size_t len)
+{
+	/* Stored before the widened counters, which then start at 0 */
+	if (len != sizeof(counters) &&
+	    len != offsetof(struct usage_counters, widened)) {
+		/* Stored for another key or layer limit */
+		return -EINVAL;
+	}
+
+	memcpy(&counters, data, len);
+
+	return 0;
+}
+#endif /* CONFIG_KEYPAD_CONFIG_STORE */
+
+static struct config_entry usage_entry = {
+	.name = "keypad/usage",
+#if defined(CONFIG_KEYPAD_CONFIG_STORE)
+	.get = usage_store_get,
+	.set = usage_store_set,
+#endif
+};
+
+static void usage_save(struct k_work *work);
+
+static K_WORK_DELAYABLE_DEFINE(save_work, usage_save);
+
+static void usage_save(struct k_work *work)
+{
+	if (counted) {
+		counted = false;
+		/* The store still waits for the keys to be quiet */
+		config_store_changed(&usage_entry);
+	}
+
+	k_work_schedule(&save_work,
+			K_HOURS(CONFIG_KEYPAD_USAGE_SAVE_INTERVAL_H));
+}
+
+static int usage_init(const struct device *dev)
+{
+	ARG_UNUSED(dev);
+
+	if (config_store_register(&usage_entry) < 0) {
+		LOG_WRN("Stored usage counters not loaded");
+	}
+
+	k_work_schedule(&save_work,
+			K_HOURS(CONFIG_KEYPAD_USAGE_SAVE_INTERVAL_H));
+
+	return 0;
+}
+
+SYS_INIT(usage_init, APPLICATION, 0);
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static int cmd_usage_show(const struct shell *sh, size_t argc, char **argv)
+{
+	for (uint8_t i = 0; i < keypad_key_count; i++) {
+		shell_print(sh, "key %2u: %u presses, %u chatter, debounce "
+			    "widened %u times, now %u/%u us", i,
+			    counters.presses[i], counters.chatter[i],
+			    counters.widened[i], debounce_window_us(i, false),
+			    debounce_window_us(i, true));
+	}
+
+	for (uint8_t l = 0; l < layer_count(); l++) {
+		shell_print(sh, "layer %u: %u presses", l, counters.layers[l]);
+	}
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_usage,
+	SHELL_CMD(show, NULL, "Print the per-key and per-layer counters",
+		  cmd_usage_show),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(usage, &sub_usage, "Switch wear counters", NULL);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Usage counters for switch wear: presses and chatter per key and
+ * presses per layer, since the first boot. Chatter is a press that
+ * follows the release of the same key by less than
+ * CONFIG_KEYPAD_USAGE_CHATTER_MS, quicker than a finger can tap: a
+ * contact that bounces past the debounce window. A rising chatter count
+ * is the usual first sign of a worn switch. Once the debounce engine
+ * widens a chattering key's window the chatter is filtered out, so the
+ * times it did so are counted too.
+ *
+ * Every counter has a single writer, the key counters the scan engine
+ * and the layer counters the report thread, so they are plain
+ * increments. They go to the config store once per
+ * CONFIG_KEYPAD_USAGE_SAVE_INTERVAL_H at most, a power loss costs at
+ * most that much counting. Read over raw HID with the USAGE command or
+ * from the "usage show" shell command.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_USAGE is enabled.
+ */
+
+#ifndef KEYPAD_DIAG_USAGE_H_
+#define KEYPAD_DIAG_USAGE_H_
+
+#include <zephyr/zephyr.h>
+
+#include "keymap.h"
+#include "layer.h"
+
+/* As read by usage_read() and stored, little endian */
+struct usage_counters {
+	uint32_t presses[KEYPAD_MAX_KEYS];
+	uint32_t chatter[KEYPAD_MAX_KEYS];
+	uint32_t layers[LAYER_MAX];
+	/* Times the debounce window of the key was widened for chatter */
+	uint32_t widened[KEYPAD_MAX_KEYS];
+};
+
+#if defined(CONFIG_KEYPAD_USAGE)
+
+/* A debounced transition, from the scan engine */
+void usage_key(uint8_t key, bool pressed);
+
+/* A press resolved on layer, from the report thread */
+void usage_layer(uint8_t layer);
+
+/* The debounce engine widened the window of key, from the scan engine */
+void usage_debounce_widened(uint8_t key);
+
+/* Copy up to len bytes of the counters from offset, 0 past the end */
+size_t usage_read(size_t offset, uint8_t *buf, size_t len);
+
+#else
+
+static inline void usage_key(uint8_t key, bool pressed) {}
+static inline void usage_layer(uint8_t layer) {}
+static inline void usage_debounce_widened(uint8_t key) {}
+
+static inline size_t usage_read(size_t offset, uint8_t *buf, size_t len)
+{
+	return 0;
+}
+
+#endif /* CONFIG_KEYPAD_USAGE */
+
+#endif /* KEYPAD_DIAG_USAGE_H_ */
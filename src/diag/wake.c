@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * The idle hook stamps entry to idle. The first non-nested interrupt
+ * after that is the wake source; its number is read from IPSR. A
+ * system timer wakeup is reattributed to the log thread if that is the
+ * next thread switched in.
+ */
+
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/logging/log.h>
+#include <soc.h>
+
+#include "diag/wake.h"
+
+LOG_MODULE_REGISTER(wake, LOG_LEVEL_INF);
+
+#define WAKE_IRQN(label) DT_IRQN(DT_NODELABEL(label))
+
+static struct k_spinlock lock;
+static uint32_t count[WAKE_SOURCE_COUNT];
+static uint64_t idle_cycles;
+static int64_t reset_time;
+
+static uint32_t idle_since;
+static bool idle;
+/* Last wakeup came from the system timer, the next switch decides */
+static bool timer_wake;
+
+static enum wake_source wake_classify(int irqn)
+{
+	switch (irqn) {
+	case WAKE_IRQN(gpiote):
+		return WAKE_GPIO;
+	case WAKE_IRQN(usbd):
+	case WAKE_IRQN(usbreg):
+		return WAKE_USB;
+	case WAKE_IRQN(rtc1):
+		return WAKE_TIMER;
+	default:
+		return WAKE_OTHER;
+	}
+}
+
+void sys_trace_idle_user(void)
+{
+	idle_since = k_cycle_get_32();
+	idle = true;
+}
+
+void sys_trace_isr_enter_user(int nested_interrupts)
+{
+	enum wake_source source;
+
+	if (!idle || nested_interrupts != 0) {
+		return;
+	}
+
+	idle = false;
+	idle_cycles += k_cycle_get_32() - idle_since;
+
+	source = wake_classify((int)__get_IPSR() - 16);
+	count[source]++;
+	timer_wake = (source == WAKE_TIMER);
+}
+
+void sys_trace_isr_exit_user(int nested_interrupts)
+{
+}
+
+void sys_trace_thread_switched_in_user(struct k_thread *thread)
+{
+	const char *name;
+
+	if (!timer_wake) {
+		return;
+	}
+
+	timer_wake = false;
+
+	name = k_thread_name_get(thread);
+	if (name != NULL && strcmp(name, "logging") == 0) {
+		count[WAKE_TIMER]--;
+		count[WAKE_LOG]++;
+	}
+}
+
+void sys_trace_thread_switched_out_user(struct k_thread *thread)
+{
+}
+
+void wake_stats_get(struct wake_stats *out)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	memcpy(out->count, count, sizeof(count));
+	out->idle_ms = k_cyc_to_ms_floor64(idle_cycles);
+	out->total_ms = k_uptime_get() - reset_time;
+	k_spin_unlock(&lock, key);
+}
+
+void wake_stats_reset(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	memset(count, 0, sizeof(count));
+	idle_cycles = 0;
+	reset_time = k_uptime_get();
+	k_spin_unlock(&lock, key);
+}
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static const char *const source_names[] = {
+	[WAKE_GPIO] = "gpio",
+	[WAKE_USB] = "usb",
+	[WAKE_TIMER] = "timer",
+	[WAKE_LOG] = "log",
+	[WAKE_OTHER] = "other",
+};
+
+static int cmd_wake_show(const struct shell *sh, size_t argc, char **argv)
+{
+	struct wake_stats s;
+
+	wake_stats_get(&s);
+
+	/* PM state residency is kept by the "power" command */
+	shell_print(sh, "idle %llu of %llu ms", s.idle_ms, s.total_ms);
+
+	for (int source = 0; source < WAKE_SOURCE_COUNT; source++) {
+		shell_print(sh, "  %-5s %u wakeups", source_names[source],
+			    s.count[source]);
+	}
+
+	return 0;
+}
+
+static int cmd_wake_reset(const struct shell *sh, size_t argc, char **argv)
+{
+	wake_stats_reset();
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_wake,
+	SHELL_CMD(show, NULL, "Print wakeups by source and idle time",
+		  cmd_wake_show),
+	SHELL_CMD(reset, NULL, "Clear wakeup counters", cmd_wake_reset),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(wake, &sub_wake, "Wakeup profiler", NULL);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Wakeup profiler. Hooks the user tracing backend to count every exit
+ * from idle by the interrupt that caused it and to sum the time spent
+ * idle. Timer wakeups that only run the deferred log thread are
+ * counted separately, so its share of idle wakeups is visible.
+ *
+ * Needs CONFIG_TRACING and CONFIG_TRACING_USER, see overlay-profiler.conf.
+ */
+
+#ifndef KEYPAD_DIAG_WAKE_H_
+#define KEYPAD_DIAG_WAKE_H_
+
+#include <zephyr/zephyr.h>
+
+enum wake_source {
+	WAKE_GPIO,
+	WAKE_USB,
+	/* System timer, excluding wakeups for the log thread */
+	WAKE_TIMER,
+	WAKE_LOG,
+	WAKE_OTHER,
+	WAKE_SOURCE_COUNT,
+};
+
+struct wake_stats {
+	uint32_t count[WAKE_SOURCE_COUNT];
+	/* Time spent in the idle thread and since the last reset, ms */
+	uint64_t idle_ms;
+	uint64_t total_ms;
+};
+
+void wake_stats_get(struct wake_stats *out);
+void wake_stats_reset(void);
+
+#endif /* KEYPAD_DIAG_WAKE_H_ */
@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Every stage counts the work posted to it and, once handled, stores
+ * the posted count it had read before starting. The stage is idle when
+ * the two are equal and late when they differ and the done count has
+ * not moved for its deadline. The transport keeps its own counters in
+ * the sinks: reports queued on a link are its work, completions and
+ * resets its progress. While the bus is suspended a queued report only
+ * completes after the resume, so the transport is not checked then.
+ *
+ * The check runs every CONFIG_KEYPAD_WATCHDOG_CHECK_MS on the system
+ * work queue and feeds the hardware watchdog, so a work queue that no
+ * longer runs, or a cooperative thread that never yields, also ends
+ * in a reset. A late stage is logged and left in the journal, which
+ * the next boot can read back, and the feeding stops for good.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/watchdog.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/logging/log.h>
+
+#include "diag/journal.h"
+#include "diag/watchdog.h"
+#include "report_sink.h"
+#include "suspend.h"
+
+LOG_MODULE_REGISTER(watchdog, LOG_LEVEL_INF);
+
+#define CHECK_PERIOD K_MSEC(CONFIG_KEYPAD_WATCHDOG_CHECK_MS)
+
+BUILD_ASSERT(CONFIG_KEYPAD_WATCHDOG_CHECK_MS <
+	     CONFIG_KEYPAD_WATCHDOG_TIMEOUT_MS,
+	     "the check must run more often than the watchdog times out");
+
+static const struct device *const wdt = DEVICE_DT_GET(DT_NODELABEL(wdt0));
+static int wdt_channel;
+
+static const uint32_t deadline_ms[WATCHDOG_STAGE_COUNT] = {
+	[WATCHDOG_SCAN] = CONFIG_KEYPAD_WATCHDOG_SCAN_MS,
+	[WATCHDOG_REPORT] = CONFIG_KEYPAD_WATCHDOG_REPORT_MS,
+	[WATCHDOG_TRANSPORT] = CONFIG_KEYPAD_WATCHDOG_TRANSPORT_MS,
+};
+
+static const char *const names[WATCHDOG_STAGE_COUNT] = {
+	[WATCHDOG_SCAN] = "scan",
+	[WATCHDOG_REPORT] = "report",
+	[WATCHDOG_TRANSPORT] = "transport",
+};
+
+static atomic_t posted[WATCHDOG_STAGE_COUNT];
+static atomic_t done[WATCHDOG_STAGE_COUNT];
+
+/* Owned by the check */
+static uint32_t last_done[WATCHDOG_STAGE_COUNT];
+static uint32_t stalled_ms[WATCHDOG_STAGE_COUNT];
+static uint32_t stalled_max_ms[WATCHDOG_STAGE_COUNT];
+static bool wedged;
+
+static void watchdog_check(struct k_work *work);
+
+static K_WORK_DELAYABLE_DEFINE(check_work, watchdog_check);
+
+void watchdog_post(enum watchdog_stage stage)
+{
+	atomic_inc(&posted[stage]);
+}
+
+atomic_val_t watchdog_seen(enum watchdog_stage stage)
+{
+	return atomic_get(&posted[stage]);
+}
+
+void watchdog_done(enum watchdog_stage stage, atomic_val_t seen)
+{
+	atomic_set(&done[stage], seen);
+}
+
+/* Work left to the stage, and a count that moves as it makes progress */
+static bool watchdog_sample(enum watchdog_stage stage, uint32_t *progress)
+{
+	struct report_sink_stats s;
+
+	if (stage != WATCHDOG_TRANSPORT) {
+		*progress = atomic_get(&done[stage]);
+		return *progress != (uint32_t)atomic_get(&posted[stage]);
+	}
+
+	report_sink_totals_get(&s);
+	*progress = s.completed + s.dropped;
+
+	return s.queued > 0 && !suspend_is_active();
+}
+
+static void watchdog_check(struct k_work *work)
+{
+	uint32_t progress;
+	bool owed;
+
+	for (int i = 0; i < WATCHDOG_STAGE_COUNT; i++) {
+		owed = watchdog_sample(i, &progress);
+
+		if (!owed || progress != last_done[i]) {
+			last_done[i] = progress;
+			stalled_ms[i] = 0;
+			continue;
+		}
+
+		stalled_ms[i] += CONFIG_KEYPAD_WATCHDOG_CHECK_MS;
+		stalled_max_ms[i] = MAX(stalled_max_ms[i], stalled_ms[i]);
+
+		if (stalled_ms[i] >= deadline_ms[i] && !wedged) {
+			LOG_ERR("%s stage stalled for %u ms, resetting",
+				names[i], stalled_ms[i]);
+			journal_put(JOURNAL_WATCHDOG, i,
+				    MIN(stalled_ms[i], UINT16_MAX));
+			wedged = true;
+		}
+	}
+
+	if (wedged) {
+		/* Left to the watchdog, the reset is its to make */
+		return;
+	}
+
+	(void)wdt_feed(wdt, wdt_channel);
+	k_work_schedule(&check_work, CHECK_PERIOD);
+}
+
+int watchdog_init(void)
+{
+	struct wdt_timeout_cfg cfg = {
+		.window.max = CONFIG_KEYPAD_WATCHDOG_TIMEOUT_MS,
+		.flags = WDT_FLAG_RESET_SOC,
+	};
+	int ret;
+
+	if (!device_is_ready(wdt)) {
+		LOG_ERR("Watchdog %s is not ready", wdt->name);
+		return -ENODEV;
+	}
+
+	wdt_channel = wdt_install_timeout(wdt, &cfg);
+	if (wdt_channel < 0) {
+		LOG_ERR("Failed to install the timeout, error: %d",
+			wdt_channel);
+		return wdt_channel;
+	}
+
+	/* Halted on a breakpoint, a debug session would not survive */
+	ret = wdt_setup(wdt, WDT_OPT_PAUSE_HALTED_BY_DBG);
+	if (ret < 0) {
+		LOG_ERR("Failed to start the watchdog, error: %d", ret);
+		return ret;
+	}
+
+	k_work_schedule(&check_work, CHECK_PERIOD);
+
+	return 0;
+}
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static int cmd_watchdog_show(const struct shell *sh, size_t argc,
+			     char **argv)
+{
+	for (int i = 0; i < WATCHDOG_STAGE_COUNT; i++) {
+		shell_print(sh, "%-9s deadline %5u ms, stalled %5u ms, "
+			    "worst %5u ms", names[i], deadline_ms[i],
+			    stalled_ms[i], stalled_max_ms[i]);
+	}
+
+	shell_print(sh, "timeout %u ms%s", CONFIG_KEYPAD_WATCHDOG_TIMEOUT_MS,
+		    wedged ? ", no longer fed" : "");
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_watchdog,
+	SHELL_CMD(show, NULL, "Print the stage deadlines and stalls",
+		  cmd_watchdog_show),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(watchdog, &sub_watchdog, "Pipeline watchdog", NULL);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Pipeline watchdog. The hardware watchdog is fed only while every
+ * stage from the key lines to the link keeps up with its work: a stage
+ * that has work posted and finishes none of it within its deadline
+ * stops the feeding, and the watchdog resets the keypad
+ * CONFIG_KEYPAD_WATCHDOG_TIMEOUT_MS later. An idle stage is never
+ * late, so a keypad nobody types on keeps running.
+ *
+ * A stage posts work as it is handed over and marks it done from the
+ * context that handles it; both are one atomic operation. The scan
+ * stage is the debounce timer, the report stage the report thread,
+ * the transport the reports on the links, which the check reads from
+ * the sink counters.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_WATCHDOG is enabled.
+ */
+
+#ifndef KEYPAD_DIAG_WATCHDOG_H_
+#define KEYPAD_DIAG_WATCHDOG_H_
+
+#include <zephyr/zephyr.h>
+#include <zephyr/sys/atomic.h>
+
+enum watchdog_stage {
+	WATCHDOG_SCAN,
+	WATCHDOG_REPORT,
+	WATCHDOG_TRANSPORT,
+	WATCHDOG_STAGE_COUNT,
+};
+
+#if defined(CONFIG_KEYPAD_WATCHDOG)
+
+/* Start the hardware watchdog, it cannot be stopped again */
+int watchdog_init(void);
+
+/* Work was handed to stage, ISR safe */
+void watchdog_post(enum watchdog_stage stage);
+
+/* Work posted to stage so far, read before handling it */
+atomic_val_t watchdog_seen(enum watchdog_stage stage);
+
+/* stage has handled everything posted up to seen, ISR safe */
+void watchdog_done(enum watchdog_stage stage, atomic_val_t seen);
+
+#else
+
+static inline int watchdog_init(void)
+{
+	return 0;
+}
+
+static inline void watchdog_post(enum watchdog_stage stage) {}
+
+static inline atomic_val_t watchdog_seen(enum watchdog_stage stage)
+{
+	return 0;
+}
+
+static inline void watchdog_done(enum watchdog_stage stage,
+				 atomic_val_t seen) {}
+
+#endif /* CONFIG_KEYPAD_WATCHDOG */
+
+#endif /* KEYPAD_DIAG_WATCHDOG_H_ */
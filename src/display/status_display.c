@@ -0,0 +1,330 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * The panel is a page-tiled monochrome controller like the SSD1306:
+ * each byte is a column of 8 pixels, a page is a band of 8 rows, and a
+ * write sets a run of columns on one page. Text lines sit on pages, so
+ * drawing only changes whole bytes of fb[]. Every byte that differs
+ * widens the dirty run of its page, and a refresh writes one run per
+ * dirty page from fb[] in place; the driver sends it with spi_write(),
+ * which is an EasyDMA transfer on the nRF SPIM, while the job
+ * sleeps. A run that fails stays dirty and goes out with the next one.
+ *
+ * A background job refreshes it every CONFIG_KEYPAD_DISPLAY_REFRESH_MS
+ * and reads the layer and host state without locking: a refresh that
+ * sees a value half-way through its change draws it right on the next
+ * one. In suspend the panel is blanked and the job waits for resume.
+ */
+
+#include <ctype.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/display.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/logging/log.h>
+
+#include "bg_sched.h"
+#include "ble/host.h"
+#include "display/status_display.h"
+#include "event_ring.h"
+#include "layer.h"
+#include "report_sched.h"
+#include "suspend.h"
+#include "usb/usb_state.h"
+
+LOG_MODULE_REGISTER(status_display, LOG_LEVEL_INF);
+
+#define PANEL_NODE DT_CHOSEN(zephyr_display)
+#define PANEL_WIDTH DT_PROP(PANEL_NODE, width)
+#define PANEL_HEIGHT DT_PROP(PANEL_NODE, height)
+#define PANEL_PAGES (PANEL_HEIGHT / 8)
+
+#define GLYPH_WIDTH 5
+/* A blank column between characters */
+#define CELL_WIDTH (GLYPH_WIDTH + 1)
+#define LINE_CHARS (PANEL_WIDTH / CELL_WIDTH)
+#define LINES MIN(PANEL_PAGES, 4)
+#define FONT_FIRST ' '
+#define FONT_LAST '_'
+
+/* Rates are taken over this window, not per refresh, so they hold */
+#define RATE_WINDOW_MS 1000
+#define REFRESH_US (CONFIG_KEYPAD_DISPLAY_REFRESH_MS * USEC_PER_MSEC)
+
+BUILD_ASSERT(PANEL_HEIGHT % 8 == 0, "the panel is drawn in pages");
+
+/* 5x7 columns, bit 0 at the top, of ' ' to '_': no lower case */
+static const uint8_t font[FONT_LAST - FONT_FIRST + 1][GLYPH_WIDTH] = {
+	{0x00, 0x00, 0x00, 0x00, 0x00}, {0x00, 0x00, 0x5f, 0x00, 0x00},
+	{0x00, 0x07, 0x00, 0x07, 0x00}, {0x14, 0x7f, 0x14, 0x7f, 0x14},
+	{0x24, 0x2a, 0x7f, 0x2a, 0x12}, {0x23, 0x13, 0x08, 0x64, 0x62},
+	{0x36, 0x49, 0x56, 0x20, 0x50}, {0x00, 0x08, 0x07, 0x03, 0x00},
+	{0x00, 0x1c, 0x22, 0x41, 0x00}, {0x00, 0x41, 0x22, 0x1c, 0x00},
+	{0x2a, 0x1c, 0x7f, 0x1c, 0x2a}, {0x08, 0x08, 0x3e, 0x08, 0x08},
+	{0x00, 0x50, 0x30, 0x00, 0x00}, {0x08, 0x08, 0x08, 0x08, 0x08},
+	{0x00, 0x60, 0x60, 0x00, 0x00}, {0x20, 0x10, 0x08, 0x04, 0x02},
+	{0x3e, 0x51, 0x49, 0x45, 0x3e}, {0x00, 0x42, 0x7f, 0x40, 0x00},
+	{0x42, 0x61, 0x51, 0x49, 0x46}, {0x21, 0x41, 0x45, 0x4b, 0x31},
+	{0x18, 0x14, 0x12, 0x7f, 0x10}, {0x27, 0x45, 0x45, 0x45, 0x39},
+	{0x3c, 0x4a, 0x49, 0x49, 0x30}, {0x01, 0x71, 0x09, 0x05, 0x03},
+	{0x36, 0x49, 0x49, 0x49, 0x36}, {0x06, 0x49, 0x49, 0x29, 0x1e},
+	{0x00, 0x36, 0x36, 0x00, 0x00}, {0x00, 0x56, 0x36, 0x00, 0x00},
+	{0x08, 0x14, 0x22, 0x41, 0x00}, {0x14, 0x14, 0x14, 0x14, 0x14},
+	{0x00, 0x41, 0x22, 0x14, 0x08}, {0x02, 0x01, 0x51, 0x09, 0x06},
+	{0x32, 0x49, 0x79, 0x41, 0x3e}, {0x7e, 0x11, 0x11, 0x11, 0x7e},
+	{0x7f, 0x49, 0x49, 0x49, 0x36}, {0x3e, 0x41, 0x41, 0x41, 0x22},
+	{0x7f, 0x41, 0x41, 0x22, 0x1c}, {0x7f, 0x49, 0x49, 0x49, 0x41},
+	{0x7f, 0x09, 0x09, 0x09, 0x01}, {0x3e, 0x41, 0x49, 0x49, 0x7a},
+	{0x7f, 0x08, 0x08, 0x08, 0x7f}, {0x00, 0x41, 0x7f, 0x41, 0x00},
+	{0x20, 0x40, 0x41, 0x3f, 0x01}, {0x7f, 0x08, 0x14, 0x22, 0x41},
+	{0x7f, 0x40, 0x40, 0x40, 0x40}, {0x7f, 0x02, 0x0c, 0x02, 0x7f},
+	{0x7f, 0x04, 0x08, 0x10, 0x7f}, {0x3e, 0x41, 0x41, 0x41, 0x3e},
+	{0x7f, 0x09, 0x09, 0x09, 0x06}, {0x3e, 0x41, 0x51, 0x21, 0x5e},
+	{0x7f, 0x09, 0x19, 0x29, 0x46}, {0x46, 0x49, 0x49, 0x49, 0x31},
+	{0x01, 0x01, 0x7f, 0x01, 0x01}, {0x3f, 0x40, 0x40, 0x40, 0x3f},
+	{0x1f, 0x20, 0x40, 0x20, 0x1f}, {0x3f, 0x40, 0x38, 0x40, 0x3f},
+	{0x63, 0x14, 0x08, 0x14, 0x63}, {0x07, 0x08, 0x70, 0x08, 0x07},
+	{0x61, 0x51, 0x49, 0x45, 0x43}, {0x00, 0x7f, 0x41, 0x41, 0x00},
+	{0x02, 0x04, 0x08, 0x10, 0x20}, {0x00, 0x41, 0x41, 0x7f, 0x00},
+	{0x04, 0x02, 0x01, 0x02, 0x04}, {0x40, 0x40, 0x40, 0x40, 0x40},
+};
+
+static const struct device *const panel = DEVICE_DT_GET(PANEL_NODE);
+
+/* What the panel shows, page by page */
+static uint8_t fb[PANEL_PAGES][PANEL_WIDTH];
+/* Columns of each page changed since they were written, lo > hi if none */
+static uint16_t dirty_lo[PANEL_PAGES];
+static uint16_t dirty_hi[PANEL_PAGES];
+
+static struct k_spinlock lock;
+static struct status_display_stats stats;
+static atomic_t suspended;
+
+static void display_put(uint8_t page, uint16_t x, uint8_t bits)
+{
+	if (fb[page][x] == bits) {
+		return;
+	}
+
+	fb[page][x] = bits;
+	dirty_lo[page] = MIN(dirty_lo[page], x);
+	dirty_hi[page] = MAX(dirty_hi[page], x);
+}
+
+/* Draw text over the whole of one line, blanking what it leaves */
+static void display_line(uint8_t line, const char *text)
+{
+	uint16_t x = 0;
+	const uint8_t *glyph;
+	int c;
+
+	for (int i = 0; i < LINE_CHARS; i++) {
+		c = *text != '\0' ? toupper((unsigned char)*text++) : ' ';
+		if (c < FONT_FIRST || c > FONT_LAST) {
+			c = '?';
+		}
+
+		glyph = font[c - FONT_FIRST];
+		for (int col = 0; col < GLYPH_WIDTH; col++) {
+			display_put(line, x++, glyph[col]);
+		}
+		display_put(line, x++, 0);
+	}
+}
+
+static void display_draw(uint32_t events_rate, uint32_t reports_rate)
+{
+	char text[4][LINE_CHARS + 1];
+
+	snprintk(text[0], sizeof(text[0]), "LAYER %u",
+		 find_msb_set(layer_active_get()) - 1);
+	snprintk(text[1], sizeof(text[1]), "HOST %u USB %s", host_current(),
+		 usb_state_configured() ? "ON" : "OFF");
+	snprintk(text[2], sizeof(text[2]), "EVENTS/S %u", events_rate);
+	snprintk(text[3], sizeof(text[3]), "REPORTS/S %u", reports_rate);
+
+	for (int i = 0; i < LINES; i++) {
+		display_line(i, text[i]);
+	}
+}
+
+/* Write the dirty run of every page */
+static void display_flush(void)
+{
+	struct display_buffer_descriptor desc = {
+		.height = 8,
+	};
+	uint32_t bytes = 0;
+	uint32_t errors = 0;
+	k_spinlock_key_t key;
+	int writes = 0;
+	int ret;
+
+	for (int page = 0; page < PANEL_PAGES; page++) {
+		if (dirty_lo[page] > dirty_hi[page]) {
+			continue;
+		}
+
+		desc.width = dirty_hi[page] - dirty_lo[page] + 1;
+		desc.pitch = desc.width;
+		desc.buf_size = desc.width;
+		ret = display_write(panel, dirty_lo[page], page * 8, &desc,
+				    &fb[page][dirty_lo[page]]);
+		if (ret < 0) {
+			errors++;
+			continue;
+		}
+
+		bytes += desc.buf_size;
+		writes++;
+		dirty_lo[page] = PANEL_WIDTH;
+		dirty_hi[page] = 0;
+	}
+
+	key = k_spin_lock(&lock);
+	if (writes > 0 || errors > 0) {
+		stats.updates++;
+		stats.full_bytes += sizeof(fb);
+	}
+	stats.writes += writes;
+	stats.bytes += bytes;
+	stats.errors += errors;
+	k_spin_unlock(&lock, key);
+}
+
+/* Rates over the last window, from a mark taken at its start */
+static uint32_t mark_ms;
+static uint32_t mark_events;
+static uint32_t mark_sent;
+static uint32_t events_rate;
+static uint32_t reports_rate;
+static bool blanked = true;
+
+static void display_refresh(struct bg_job *job)
+{
+	struct report_sched_stats sched;
+	uint32_t now;
+
+	if (atomic_get(&suspended) != 0) {
+		if (!blanked) {
+			(void)display_blanking_on(panel);
+			blanked = true;
+		}
+		/* The resume submits the job again */
+		return;
+	}
+
+	now = k_uptime_get_32();
+	if (now - mark_ms >= RATE_WINDOW_MS) {
+		report_sched_stats_get(&sched);
+		events_rate = (event_ring_put_count() - mark_events) *
+			      1000ULL / (now - mark_ms);
+		reports_rate = (sched.sent - mark_sent) * 1000ULL /
+			       (now - mark_ms);
+		mark_events = event_ring_put_count();
+		mark_sent = sched.sent;
+		mark_ms = now;
+	}
+
+	display_draw(events_rate, reports_rate);
+	display_flush();
+	if (blanked) {
+		(void)display_blanking_off(panel);
+		blanked = false;
+	}
+
+	bg_sched_submit(job, REFRESH_US, 2 * REFRESH_US);
+}
+
+static struct bg_job refresh_job = {
+	.name = "display",
+	.run = display_refresh,
+};
+
+static void display_suspend(bool state)
+{
+	atomic_set(&suspended, state);
+	bg_sched_submit(&refresh_job, 0, 0);
+}
+
+static struct suspend_listener listener = {
+	.changed = display_suspend,
+};
+
+void status_display_stats_get(struct status_display_stats *out)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	*out = stats;
+	k_spin_unlock(&lock, key);
+}
+
+int status_display_init(void)
+{
+	struct report_sched_stats sched;
+	struct display_capabilities caps;
+
+	if (!device_is_ready(panel)) {
+		LOG_ERR("Display %s not ready", panel->name);
+		return -ENODEV;
+	}
+
+	display_get_capabilities(panel, &caps);
+	if (!(caps.screen_info & SCREEN_INFO_MONO_VTILED) ||
+	    (caps.screen_info & SCREEN_INFO_MONO_MSB_FIRST) ||
+	    (caps.current_pixel_format != PIXEL_FORMAT_MONO01 &&
+	     caps.current_pixel_format != PIXEL_FORMAT_MONO10)) {
+		LOG_ERR("Display %s is not a page-tiled monochrome panel",
+			panel->name);
+		return -ENOTSUP;
+	}
+
+	/* The first refresh clears whatever the panel RAM held */
+	for (int page = 0; page < PANEL_PAGES; page++) {
+		dirty_lo[page] = 0;
+		dirty_hi[page] = PANEL_WIDTH - 1;
+	}
+
+	report_sched_stats_get(&sched);
+	mark_ms = k_uptime_get_32();
+	mark_events = event_ring_put_count();
+	mark_sent = sched.sent;
+
+	suspend_listener_register(&listener);
+	bg_sched_submit(&refresh_job, 0, REFRESH_US);
+
+	return 0;
+}
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static int cmd_display_show(const struct shell *sh, size_t argc,
+			    char **argv)
+{
+	struct status_display_stats s;
+
+	status_display_stats_get(&s);
+	shell_print(sh, "%ux%u, %u lines of %u, refresh %u ms", PANEL_WIDTH,
+		    PANEL_HEIGHT, LINES, LINE_CHARS,
+		    CONFIG_KEYPAD_DISPLAY_REFRESH_MS);
+	shell_print(sh, "updates %u, writes %u, errors %u", s.updates,
+		    s.writes, s.errors);
+	shell_print(sh, "sent %u bytes, full frames would be %u", s.bytes,
+		    s.full_bytes);
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_display,
+	SHELL_CMD(show, NULL, "Print update counters", cmd_display_show),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(display, &sub_display, "Status display", NULL);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Status display: the active layer, the host slot and the event and
+ * report rates as text on a small monochrome panel, the zephyr,display
+ * chosen node. Drawn into a RAM copy of the panel by a background job,
+ * see bg_sched.h; only the bytes that changed go out over
+ * the panel's SPI bus, so a layer change is a few bytes of transfer.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_DISPLAY is enabled.
+ */
+
+#ifndef KEYPAD_DISPLAY_STATUS_DISPLAY_H_
+#define KEYPAD_DISPLAY_STATUS_DISPLAY_H_
+
+#include <zephyr/zephyr.h>
+
+struct status_display_stats {
+	/* Refreshes that found something changed, and writes to the panel */
+	uint32_t updates;
+	uint32_t writes;
+	/* Bytes sent, and what full frames would have taken */
+	uint32_t bytes;
+	uint32_t full_bytes;
+	/* Writes the panel driver refused */
+	uint32_t errors;
+};
+
+#if defined(CONFIG_KEYPAD_DISPLAY)
+
+int status_display_init(void);
+
+void status_display_stats_get(struct status_display_stats *out);
+
+#else
+
+static inline int status_display_init(void)
+{
+	return 0;
+}
+
+#endif /* CONFIG_KEYPAD_DISPLAY */
+
+#endif /* KEYPAD_DISPLAY_STATUS_DISPLAY_H_ */
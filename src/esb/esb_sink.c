@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Only the report thread writes, so it is the single producer of the
+ * ring to the network core. The messages coming back are read from
+ * the doorbell interrupt: acknowledgements complete reports on the
+ * sink in the order they were written.
+ */
+
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/logging/log.h>
+#include <keypad/esb_link.h>
+
+#include "report_sched.h"
+#include "report_sink.h"
+#include "esb/esb_sink.h"
+#include "ipc/shm_ring.h"
+#include "led/fx_clock.h"
+
+LOG_MODULE_REGISTER(esb_sink, LOG_LEVEL_INF);
+
+BUILD_ASSERT(REPORT_SINK_DEPTH_MAX <= CONFIG_KEYPAD_IPC_RING_SLOTS,
+	     "the ring must hold every report in flight");
+
+/* The dongle acknowledged the latest payload */
+static atomic_t link_up;
+
+static int esb_sink_write(struct report_sink *s, const uint8_t *report,
+			  size_t len)
+{
+	struct shm_msg *msg;
+
+	if (len > SHM_MSG_PAYLOAD) {
+		return -EMSGSIZE;
+	}
+
+	msg = shm_ring_claim();
+	if (msg == NULL) {
+		return -ENOMEM;
+	}
+
+	msg->type = ESB_MSG_REPORT;
+	msg->len = len;
+	memcpy(msg->data, report, len);
+
+	return shm_ring_commit();
+}
+
+static bool esb_sink_active(struct report_sink *s)
+{
+	return atomic_get(&link_up) != 0;
+}
+
+static struct report_sink sink = {
+	.name = "esb",
+	/* Fallback once the cable is gone */
+	.priority = 1,
+	.depth = CONFIG_KEYPAD_ESB_TX_DEPTH,
+	.write = esb_sink_write,
+	.active = esb_sink_active,
+};
+
+static void esb_sink_link(bool up)
+{
+	if (atomic_set(&link_up, up) == up) {
+		return;
+	}
+
+	LOG_INF("Dongle %s", up ? "in range" : "lost");
+
+	if (!up) {
+		/* The network core flushed whatever was in its FIFO */
+		report_sink_reset(&sink);
+	}
+
+	/* The scheduler picks its link again */
+	report_sched_notify();
+}
+
+static void esb_sink_received(void)
+{
+	const struct shm_msg *msg;
+
+	while ((msg = shm_ring_peek()) != NULL) {
+		switch (msg->type) {
+		case ESB_MSG_DONE:
+			for (uint8_t i = 0; i < msg->data[0]; i++) {
+				report_sched_sink_done(&sink);
+			}
+			break;
+		case ESB_MSG_LINK:
+			esb_sink_link(msg->data[0] != 0);
+			break;
+		case ESB_MSG_CLOCK:
+			fx_clock_dongle(sys_get_le32(&msg->data[0]),
+					sys_get_le32(&msg->data[4]));
+			break;
+		default:
+			LOG_WRN("Unknown message 0x%02x", msg->type);
+			break;
+		}
+
+		shm_ring_release();
+	}
+}
+
+int esb_sink_init(void)
+{
+	unsigned int key;
+
+	report_sink_register(&sink);
+	shm_ring_callback_set(esb_sink_received);
+
+	/* Messages committed before the callback was set, off the IRQ */
+	key = irq_lock();
+	esb_sink_received();
+	irq_unlock(key);
+
+	return 0;
+}
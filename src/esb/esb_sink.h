@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * 2.4 GHz Enhanced ShockBurst link to the USB dongle, a report sink
+ * next to USB. The radio runs on the network core (esb/netcore); the
+ * reports reach it through the shared-memory ring, and its
+ * acknowledgements and link state come back the same way. A report
+ * takes one ESB transfer of a few hundred microseconds plus the
+ * dongle's 1 ms USB poll.
+ *
+ * The dongle gets the report protocol only, like BLE hosts.
+ *
+ * Build with overlay-esb.conf. Compiles to nothing unless
+ * CONFIG_KEYPAD_ESB is enabled.
+ */
+
+#ifndef KEYPAD_ESB_ESB_SINK_H_
+#define KEYPAD_ESB_ESB_SINK_H_
+
+#include <zephyr/zephyr.h>
+
+#if defined(CONFIG_KEYPAD_ESB)
+
+/* Register the sink and take the messages of the network core */
+int esb_sink_init(void);
+
+#else
+
+static inline int esb_sink_init(void)
+{
+	return 0;
+}
+
+#endif /* CONFIG_KEYPAD_ESB */
+
+#endif /* KEYPAD_ESB_ESB_SINK_H_ */
@@ -0,0 +1,229 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/slist.h>
+
+#include "diag/markers.h"
+#include "diag/seqtrace.h"
+#include "event_ring.h"
+#include "hot_path.h"
+#include "keymap.h"
+
+#define RING_SIZE CONFIG_KEYPAD_EVENT_RING_SIZE
+#define RING_MASK (RING_SIZE - 1)
+
+BUILD_ASSERT(IS_POWER_OF_TWO(RING_SIZE),
+	     "CONFIG_KEYPAD_EVENT_RING_SIZE must be a power of two");
+
+/*
+ * head and tail are free running; only the producer writes head and only
+ * the consumer writes tail. The atomic accesses order the slot contents
+ * against the index update on both sides.
+ */
+static atomic_t head;
+static atomic_t tail;
+static uint32_t overflow;
+static struct key_event ring[RING_SIZE];
+
+/*
+ * Summarized keys and their latest state, the producer's latest event
+ * of them for its timestamp. Written by the producer, taken by the
+ * consumer with interrupts locked. taken is the state of every key as
+ * of the events the consumer took.
+ */
+static keypad_bitmap_t summary_keys;
+static keypad_bitmap_t summary_pressed;
+static struct key_event summary_last;
+static keypad_bitmap_t taken;
+static uint32_t summaries;
+static struct k_spinlock summary_lock;
+
+/* Only changed with the producer locked out */
+static sys_slist_t subs = SYS_SLIST_STATIC_INIT(&subs);
+static struct k_spinlock subs_lock;
+
+KEYPAD_HOT bool event_ring_put(const struct key_event *event)
+{
+	uint32_t h = (uint32_t)atomic_get(&head);
+
+	if ((summary_keys & BIT(event->key)) != 0 ||
+	    h - (uint32_t)atomic_get(&tail) == RING_SIZE) {
+		/* Its events in the ring all go ahead of the summary */
+		summary_keys |= BIT(event->key);
+		WRITE_BIT(summary_pressed, event->key, event->pressed);
+		summary_last = *event;
+		overflow++;
+		return false;
+	}
+
+	ring[h & RING_MASK] = *event;
+	atomic_set(&head, h + 1);
+	marker_point(MARKER_EVENT_PUT);
+
+	return true;
+}
+
+/*
+ * Once the ring is empty, every event of the summarized keys that the
+ * consumer is to see has been taken, the summary goes after them. A
+ * key back in the state the consumer last took needs no event.
+ */
+static size_t event_ring_summary_take(struct key_event *out, size_t max)
+{
+	k_spinlock_key_t key = k_spin_lock(&summary_lock);
+	size_t count = 0;
+
+	while (summary_keys != 0 && count < max &&
+	       atomic_get(&head) == atomic_get(&tail)) {
+		uint8_t k = find_lsb_set(summary_keys) - 1;
+		bool pressed = (summary_pressed & BIT(k)) != 0;
+
+		summary_keys &= ~BIT(k);
+		if (((taken & BIT(k)) != 0) == pressed) {
+			continue;
+		}
+
+		out[count] = summary_last;
+		out[count].key = k;
+		out[count].pressed = pressed;
+		out[count].summarized = true;
+		WRITE_BIT(taken, k, pressed);
+		count++;
+	}
+
+	summaries += count;
+	k_spin_unlock(&summary_lock, key);
+
+	return count;
+}
+
+KEYPAD_HOT size_t event_ring_get(struct key_event *out, size_t max)
+{
+	uint32_t t = (uint32_t)atomic_get(&tail);
+	size_t count = MIN((uint32_t)atomic_get(&head) - t, max);
+
+	for (size_t i = 0; i < count; i++) {
+		out[i] = ring[(t + i) & RING_MASK];
+		WRITE_BIT(taken, out[i].key, out[i].pressed);
+		seqtrace_take(&out[i]);
+	}
+
+	atomic_set(&tail, t + count);
+
+	if (count < max && summary_keys != 0) {
+		count += event_ring_summary_take(out + count, max - count);
+	}
+
+	return count;
+}
+
+size_t event_ring_pending(void)
+{
+	return (uint32_t)atomic_get(&head) - (uint32_t)atomic_get(&tail);
+}
+
+void event_ring_reader_init(struct event_ring_reader *reader)
+{
+	reader->cursor = (uint32_t)atomic_get(&head);
+	reader->missed = 0;
+}
+
+/*
+ * The slot of event n is rewritten with event n + RING_SIZE, which the
+ * producer may be writing as soon as head reaches it. A copy is only
+ * kept if head was still short of that once the copy was made.
+ */
+size_t event_ring_read(struct event_ring_reader *reader,
+		       struct key_event *out, size_t max)
+{
+	uint32_t h = (uint32_t)atomic_get(&head);
+	uint32_t c = reader->cursor;
+	size_t count;
+	size_t kept = 0;
+
+	if (h - c > RING_SIZE) {
+		/* Lapped, the oldest events are gone */
+		reader->missed += h - c - RING_SIZE;
+		c = h - RING_SIZE;
+	}
+
+	count = MIN(h - c, max);
+	for (size_t i = 0; i < count; i++) {
+		out[kept] = ring[(c + i) & RING_MASK];
+		/* The producer is an ISR on this core, keep the copy first */
+		compiler_barrier();
+		if ((uint32_t)atomic_get(&head) - (c + i) >= RING_SIZE) {
+			reader->missed++;
+			continue;
+		}
+		kept++;
+	}
+
+	reader->cursor = c + count;
+
+	return kept;
+}
+
+void event_ring_subscribe(struct event_ring_sub *sub)
+{
+	k_spinlock_key_t key = k_spin_lock(&subs_lock);
+
+	event_ring_reader_init(&sub->reader);
+	sys_slist_append(&subs, &sub->node);
+	k_spin_unlock(&subs_lock, key);
+}
+
+KEYPAD_HOT void event_ring_notify(void)
+{
+	struct event_ring_sub *sub;
+
+	SYS_SLIST_FOR_EACH_CONTAINER(&subs, sub, node) {
+		sub->notify();
+	}
+}
+
+uint32_t event_ring_overflow_count(void)
+{
+	return overflow;
+}
+
+uint32_t event_ring_summary_count(void)
+{
+	return summaries;
+}
+
+uint32_t event_ring_put_count(void)
+{
+	return (uint32_t)atomic_get(&head);
+}
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static int cmd_events(const struct shell *sh, size_t argc, char **argv)
+{
+	uint32_t h = (uint32_t)atomic_get(&head);
+	struct event_ring_sub *sub;
+
+	shell_print(sh, "%u put, %u pending, %u overflows", h,
+		    event_ring_pending(), overflow);
+	shell_print(sh, "%u summarized events, keys 0x%08x summarized now",
+		    summaries, summary_keys);
+
+	SYS_SLIST_FOR_EACH_CONTAINER(&subs, sub, node) {
+		shell_print(sh, "  %-8s %u behind, %u missed", sub->name,
+			    MIN(h - sub->reader.cursor, RING_SIZE),
+			    sub->reader.missed);
+	}
+
+	return 0;
+}
+
+SHELL_CMD_REGISTER(events, NULL, "Key event bus and its subscribers",
+		   cmd_events);
+#endif /* CONFIG_SHELL */
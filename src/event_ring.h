@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Lock-free single-producer/single-consumer ring of key events between
+ * the scan interrupt and the report thread, and the bus the other
+ * followers of the key stream read it through.
+ *
+ * The producer side must only be used from interrupt handlers running
+ * at one priority level (GPIOTE, TIMER and the system clock all use the
+ * devicetree default), the consumer side from one thread.
+ *
+ * The ring is all the memory the key stream gets, however long the
+ * consumer is held up: a suspended or stalled host, or a link coming
+ * up. A transition that finds it full is not dropped but summarized:
+ * the key's latest state is kept aside, and so is every later
+ * transition of that key, until the consumer has emptied the ring. It
+ * then gets one event per summarized key whose state differs from the
+ * last it took, marked summarized. Taps in between are lost, the held
+ * keys are always right. Readers see only the events of the ring.
+ */
+
+#ifndef KEYPAD_EVENT_RING_H_
+#define KEYPAD_EVENT_RING_H_
+
+#include <zephyr/zephyr.h>
+#include <zephyr/sys/slist.h>
+
+struct key_event {
+	/* latency_timestamp() when the transition was detected */
+	uint32_t timestamp;
+	/* Index into keypad_keys[] */
+	uint8_t key;
+	/* true for press, false for release */
+	bool pressed;
+	/* HID usage the key resolved to, set by layer_get() */
+	uint8_t usage;
+	/* Stands for transitions lost to a full ring, see above */
+	bool summarized;
+#if defined(CONFIG_KEYPAD_LOOPBACK)
+	/* Injected by the loopback test, see diag/loopback.h */
+	bool loopback;
+#endif
+#if defined(CONFIG_KEYPAD_SEQ_TRACE)
+	/* Number of the transition, see diag/seqtrace.h */
+	uint32_t seq;
+#endif
+};
+
+/*
+ * Producer: queue event, or summarize it if the ring is full or its key
+ * is summarized already. Returns false and counts an overflow when it
+ * was summarized; the consumer still gets the key's state.
+ */
+bool event_ring_put(const struct key_event *event);
+
+/*
+ * Consumer: move up to max events into out, oldest first, followed by
+ * the summarized keys once the ring is empty
+ */
+size_t event_ring_get(struct key_event *out, size_t max);
+
+/* Consumer: events put and not taken yet */
+size_t event_ring_pending(void);
+
+/*
+ * Read-only second consumer with a cursor of its own, for lighting and
+ * other followers of the key stream. It neither frees slots nor holds
+ * the producer back: events overwritten before it got to them are
+ * skipped and counted in missed. One thread per reader.
+ */
+struct event_ring_reader {
+	uint32_t cursor;
+	uint32_t missed;
+};
+
+/* Start reader at the next event put */
+void event_ring_reader_init(struct event_ring_reader *reader);
+
+/* Copy up to max events not yet seen by reader into out, oldest first */
+size_t event_ring_read(struct event_ring_reader *reader,
+		       struct key_event *out, size_t max);
+
+/*
+ * A subscriber of the bus: a reader the producer wakes after each batch
+ * of events, however many subscribers there are each event is written
+ * once. A subscriber reads sub->reader at its own pace and one that
+ * falls behind only runs up its missed count.
+ */
+struct event_ring_sub {
+	sys_snode_t node;
+	/* For the "events" shell command */
+	const char *name;
+	/* From the producer's interrupt, must not block */
+	void (*notify)(void);
+	struct event_ring_reader reader;
+};
+
+/* Add sub, reading from the next event put */
+void event_ring_subscribe(struct event_ring_sub *sub);
+
+/* Producer: wake every subscriber, once after a batch of puts */
+void event_ring_notify(void);
+
+/* Number of transitions summarized because the ring was full */
+uint32_t event_ring_overflow_count(void);
+
+/* Number of summarized events the consumer took */
+uint32_t event_ring_summary_count(void);
+
+/* Number of events put since boot, wraps */
+uint32_t event_ring_put_count(void);
+
+#endif /* KEYPAD_EVENT_RING_H_ */
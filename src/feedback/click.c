@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * The click is a square wave of CONFIG_KEYPAD_CLICK_HZ decaying to
+ * silence, the same sample in both channels of each 32-bit word. A
+ * press starts I2S on the buffer. The driver asks for the next buffer
+ * as soon as EasyDMA has taken a pointer: the first time it is given
+ * the click again, the second time (the first click is out) the
+ * transfer is stopped, unless a press came in meanwhile and the click
+ * runs once more. STOP takes effect at the end of the current frame,
+ * so the second copy is cut after one sample. Pressing starts the
+ * first sample within a few bit clocks, there is no copy and no
+ * rendering per press, and the only interrupts are the two pointer
+ * updates of each click.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/gpio.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/logging/log.h>
+
+#include <nrfx_i2s.h>
+
+#include "feedback/click.h"
+#include "hot_path.h"
+#include "irq_plan.h"
+#include "nrf_psel.h"
+
+LOG_MODULE_REGISTER(click, LOG_LEVEL_INF);
+
+#define CLICK_I2S_NODE DT_NODELABEL(i2s0)
+/* 32 MHz / 8 MCK and 128 MCK per frame */
+#define CLICK_RATE_HZ 31250
+#define CLICK_WORDS (CLICK_RATE_HZ * CONFIG_KEYPAD_CLICK_MS / 1000)
+#define CLICK_HALF_PERIOD (CLICK_RATE_HZ / CONFIG_KEYPAD_CLICK_HZ / 2)
+#define CLICK_PEAK (INT16_MAX * CONFIG_KEYPAD_CLICK_VOLUME / 100)
+
+BUILD_ASSERT(CLICK_HALF_PERIOD > 0, "click tone above the sample rate");
+
+enum click_state {
+	CLICK_IDLE,
+	CLICK_PLAYING,
+	/* A press came in while playing, play the click once more */
+	CLICK_AGAIN,
+};
+
+static const struct gpio_dt_spec sck = GPIO_DT_SPEC_GET(CLICK_NODE,
+							sck_gpios);
+static const struct gpio_dt_spec lrck = GPIO_DT_SPEC_GET(CLICK_NODE,
+							 lrck_gpios);
+static const struct gpio_dt_spec sdout = GPIO_DT_SPEC_GET(CLICK_NODE,
+							  sdout_gpios);
+
+/* EasyDMA reads it, so it must stay in RAM */
+static uint32_t samples[CLICK_WORDS];
+static const nrfx_i2s_buffers_t buffers = {
+	.p_tx_buffer = samples,
+};
+
+static atomic_t state;
+/* Started, after the first reports: presses before are silent */
+static atomic_t ready;
+static atomic_t enabled = ATOMIC_INIT(1);
+static atomic_t clicks;
+static atomic_t again;
+
+static void click_handler(nrfx_i2s_buffers_t const *released,
+			  uint32_t status)
+{
+	if (status & NRFX_I2S_STATUS_TRANSFER_STOPPED) {
+		atomic_set(&state, CLICK_IDLE);
+		return;
+	}
+
+	if (!(status & NRFX_I2S_STATUS_NEXT_BUFFERS_NEEDED)) {
+		return;
+	}
+
+	/* Nothing released yet: the click has only just started */
+	if (released->p_tx_buffer == NULL ||
+	    atomic_cas(&state, CLICK_AGAIN, CLICK_PLAYING)) {
+		(void)nrfx_i2s_next_buffers_set(&buffers);
+		return;
+	}
+
+	nrfx_i2s_stop();
+}
+
+KEYPAD_HOT void click_press(void)
+{
+	if (atomic_get(&ready) == 0 || atomic_get(&enabled) == 0) {
+		return;
+	}
+
+	if (atomic_cas(&state, CLICK_IDLE, CLICK_PLAYING)) {
+		if (nrfx_i2s_start(&buffers, CLICK_WORDS, 0) != NRFX_SUCCESS) {
+			atomic_set(&state, CLICK_IDLE);
+			return;
+		}
+	} else if (atomic_cas(&state, CLICK_PLAYING, CLICK_AGAIN)) {
+		atomic_inc(&again);
+	}
+
+	atomic_inc(&clicks);
+}
+
+static void click_render(void)
+{
+	int32_t level;
+	int16_t sample;
+
+	for (int i = 0; i < CLICK_WORDS; i++) {
+		/* Linear decay from the peak to silence at the end */
+		level = CLICK_PEAK * (CLICK_WORDS - i) / CLICK_WORDS;
+		sample = (i / CLICK_HALF_PERIOD) % 2 ? -level : level;
+		samples[i] = ((uint32_t)(uint16_t)sample << 16) |
+			     (uint16_t)sample;
+	}
+}
+
+int click_init(void)
+{
+	nrfx_i2s_config_t config = NRFX_I2S_DEFAULT_CONFIG(
+		nrf_psel_get(&sck), nrf_psel_get(&lrck),
+		NRFX_I2S_PIN_NOT_USED, nrf_psel_get(&sdout),
+		NRFX_I2S_PIN_NOT_USED);
+	nrfx_err_t err;
+
+	config.mode = NRF_I2S_MODE_MASTER;
+	config.format = NRF_I2S_FORMAT_I2S;
+	config.sample_width = NRF_I2S_SWIDTH_16BIT;
+	config.channels = NRF_I2S_CHANNELS_STEREO;
+	config.mck_setup = NRF_I2S_MCK_32MDIV8;
+	config.ratio = NRF_I2S_RATIO_128X;
+	config.irq_priority = IRQ_PLAN_LOW;
+
+	click_render();
+
+	IRQ_CONNECT(DT_IRQN(CLICK_I2S_NODE), IRQ_PLAN_LOW,
+		    nrfx_i2s_irq_handler, NULL, 0);
+
+	err = nrfx_i2s_init(&config, click_handler);
+	if (err != NRFX_SUCCESS) {
+		LOG_ERR("Failed to init click I2S, error: 0x%08x", err);
+		return -EIO;
+	}
+
+	atomic_set(&ready, 1);
+
+	return 0;
+}
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static int cmd_click_show(const struct shell *sh, size_t argc, char **argv)
+{
+	shell_print(sh, "%s, %u ms at %u Hz, volume %u%%",
+		    atomic_get(&enabled) ? "on" : "off", CONFIG_KEYPAD_CLICK_MS,
+		    CONFIG_KEYPAD_CLICK_HZ, CONFIG_KEYPAD_CLICK_VOLUME);
+	shell_print(sh, "clicks %u, played again for a press %u",
+		    (uint32_t)atomic_get(&clicks),
+		    (uint32_t)atomic_get(&again));
+
+	return 0;
+}
+
+static int cmd_click_on(const struct shell *sh, size_t argc, char **argv)
+{
+	atomic_set(&enabled, 1);
+
+	return 0;
+}
+
+static int cmd_click_off(const struct shell *sh, size_t argc, char **argv)
+{
+	atomic_set(&enabled, 0);
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_click,
+	SHELL_CMD(show, NULL, "Print the click settings", cmd_click_show),
+	SHELL_CMD(on, NULL, "Click on every press", cmd_click_on),
+	SHELL_CMD(off, NULL, "No clicks", cmd_click_off),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(click, &sub_click, "Audible key feedback", NULL);
+#endif /* CONFIG_SHELL */
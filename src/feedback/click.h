@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Audible key feedback on the richeffects,keypad-click devicetree
+ * node. A click of CONFIG_KEYPAD_CLICK_MS is rendered into RAM at boot
+ * and every press hands that buffer to I2S0, so nothing is copied or
+ * computed per key.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_CLICK is enabled.
+ */
+
+#ifndef KEYPAD_FEEDBACK_CLICK_H_
+#define KEYPAD_FEEDBACK_CLICK_H_
+
+#include <zephyr/zephyr.h>
+
+#define CLICK_NODE DT_INST(0, richeffects_keypad_click)
+
+#if defined(CONFIG_KEYPAD_CLICK)
+
+int click_init(void);
+
+/* A key was pressed, ISR safe */
+void click_press(void);
+
+#else
+
+static inline int click_init(void)
+{
+	return 0;
+}
+
+static inline void click_press(void) {}
+
+#endif /* CONFIG_KEYPAD_CLICK */
+
+#endif /* KEYPAD_FEEDBACK_CLICK_H_ */
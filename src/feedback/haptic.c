@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * One PWM period is one cycle of the actuator's resonance. Channel 0
+ * drives bridge input A high at the start of the period and channel 1
+ * drives input B high at its end, each for up to half of it, so the
+ * bridge reverses the actuator every half cycle. The sequence is that
+ * single pair of values repeated CONFIG_KEYPAD_HAPTIC_CYCLES times and
+ * ending in STOP, where both inputs fall back low and the bridge
+ * coasts. A press only triggers SEQSTART: an idle PWM starts the
+ * pulse at once, with no interrupt and no CPU work until the next
+ * press; a press during a pulse starts it over.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/gpio.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/logging/log.h>
+
+#include <nrfx_pwm.h>
+
+#include "feedback/haptic.h"
+#include "hot_path.h"
+#include "nrf_psel.h"
+
+LOG_MODULE_REGISTER(haptic, LOG_LEVEL_INF);
+
+/* PWM counts of one resonance cycle at the 1 MHz base clock */
+#define HAPTIC_TOP (1000000 / DT_PROP(HAPTIC_NODE, resonance_hz))
+#define HAPTIC_DUTY (HAPTIC_TOP / 2 * CONFIG_KEYPAD_HAPTIC_STRENGTH / 100)
+/* High for the duty from the start of the period, not from its end */
+#define HAPTIC_RISING BIT(15)
+
+BUILD_ASSERT(HAPTIC_TOP <= 0x7fff, "resonance below the PWM range");
+
+static const struct gpio_dt_spec in_a =
+	GPIO_DT_SPEC_GET(HAPTIC_NODE, in_a_gpios);
+static const struct gpio_dt_spec in_b =
+	GPIO_DT_SPEC_GET(HAPTIC_NODE, in_b_gpios);
+
+static const nrfx_pwm_t pwm = NRFX_PWM_INSTANCE(2);
+
+/* EasyDMA reads it, so it must stay in RAM */
+static nrf_pwm_values_individual_t drive;
+static const nrf_pwm_sequence_t pulse = {
+	.values.p_individual = &drive,
+	.length = NRF_PWM_VALUES_LENGTH(drive),
+	.repeats = CONFIG_KEYPAD_HAPTIC_CYCLES - 1,
+	.end_delay = 0,
+};
+
+/* Started, after the first reports: presses before are silent */
+static atomic_t ready;
+static atomic_t enabled = ATOMIC_INIT(1);
+static atomic_t pulses;
+
+KEYPAD_HOT void haptic_press(void)
+{
+	if (atomic_get(&ready) == 0 || atomic_get(&enabled) == 0) {
+		return;
+	}
+
+	nrfx_pwm_simple_playback(&pwm, &pulse, 1, NRFX_PWM_FLAG_STOP);
+	atomic_inc(&pulses);
+}
+
+int haptic_init(void)
+{
+	nrfx_pwm_config_t config = NRFX_PWM_DEFAULT_CONFIG(
+		nrf_psel_get(&in_a), nrf_psel_get(&in_b),
+		NRFX_PWM_PIN_NOT_USED, NRFX_PWM_PIN_NOT_USED);
+	nrfx_err_t err;
+
+	if (!device_is_ready(in_a.port) || !device_is_ready(in_b.port)) {
+		return -ENODEV;
+	}
+
+	config.base_clock = NRF_PWM_CLK_1MHz;
+	config.count_mode = NRF_PWM_MODE_UP;
+	config.top_value = HAPTIC_TOP;
+	config.load_mode = NRF_PWM_LOAD_INDIVIDUAL;
+	config.step_mode = NRF_PWM_STEP_AUTO;
+
+	drive.channel_0 = HAPTIC_DUTY | HAPTIC_RISING;
+	drive.channel_1 = HAPTIC_TOP - HAPTIC_DUTY;
+
+	/* No handler: a pulse needs no interrupt at all */
+	err = nrfx_pwm_init(&pwm, &config, NULL, NULL);
+	if (err != NRFX_SUCCESS) {
+		LOG_ERR("Failed to init haptic PWM, error: 0x%08x", err);
+		return -EIO;
+	}
+
+	atomic_set(&ready, 1);
+
+	return 0;
+}
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static int cmd_haptic_show(const struct shell *sh, size_t argc, char **argv)
+{
+	shell_print(sh, "%s, %u Hz, %u cycles at %u%%, %u pulses",
+		    atomic_get(&enabled) ? "on" : "off",
+		    DT_PROP(HAPTIC_NODE, resonance_hz),
+		    CONFIG_KEYPAD_HAPTIC_CYCLES, CONFIG_KEYPAD_HAPTIC_STRENGTH,
+		    (uint32_t)atomic_get(&pulses));
+
+	return 0;
+}
+
+static int cmd_haptic_on(const struct shell *sh, size_t argc, char **argv)
+{
+	atomic_set(&enabled, 1);
+
+	return 0;
+}
+
+static int cmd_haptic_off(const struct shell *sh, size_t argc, char **argv)
+{
+	atomic_set(&enabled, 0);
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_haptic,
+	SHELL_CMD(show, NULL, "Print the pulse settings", cmd_haptic_show),
+	SHELL_CMD(on, NULL, "Pulse on every press", cmd_haptic_on),
+	SHELL_CMD(off, NULL, "No pulses", cmd_haptic_off),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(haptic, &sub_haptic, "Haptic key feedback", NULL);
+#endif /* CONFIG_SHELL */
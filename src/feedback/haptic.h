@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Haptic key feedback on the richeffects,keypad-haptic devicetree
+ * node. Every press starts a pulse of CONFIG_KEYPAD_HAPTIC_CYCLES
+ * resonance cycles that PWM2 plays from a sequence prepared at boot,
+ * so a press costs one register write on the key path.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_HAPTIC is enabled.
+ */
+
+#ifndef KEYPAD_FEEDBACK_HAPTIC_H_
+#define KEYPAD_FEEDBACK_HAPTIC_H_
+
+#include <zephyr/zephyr.h>
+
+#define HAPTIC_NODE DT_INST(0, richeffects_keypad_haptic)
+
+#if defined(CONFIG_KEYPAD_HAPTIC)
+
+int haptic_init(void);
+
+/* A key was pressed, ISR safe */
+void haptic_press(void);
+
+#else
+
+static inline int haptic_init(void)
+{
+	return 0;
+}
+
+static inline void haptic_press(void) {}
+
+#endif /* CONFIG_KEYPAD_HAPTIC */
+
+#endif /* KEYPAD_FEEDBACK_HAPTIC_H_ */
@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Both delivery paths run in USB driver context. The new state is
+ * compared against the last one first, so a host repeating the same
+ * report costs one byte compare and touches no LED and no thread.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/gpio.h>
+#include <zephyr/logging/log.h>
+
+#include <zephyr/usb/usb_device.h>
+#include <zephyr/usb/class/usb_hid.h>
+
+#include "host_leds.h"
+#include "led/led_pwm.h"
+#include "suspend.h"
+
+LOG_MODULE_REGISTER(host_leds, LOG_LEVEL_INF);
+
+/* HID class SET_REPORT wValue high byte */
+#define HOST_LEDS_REPORT_TYPE_OUTPUT 0x02
+
+#define LED_SPEC(n) GPIO_DT_SPEC_GET_OR(DT_ALIAS(led##n), gpios, {0})
+
+/* LED index for every lock bit, led0 stays the activity LED */
+static const struct gpio_dt_spec lock_leds[] = {
+	LED_SPEC(1), LED_SPEC(2), LED_SPEC(3),
+};
+
+static uint8_t lock_state;
+
+static void host_leds_apply(uint8_t state)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(lock_leds); i++) {
+		bool on = (state & BIT(i)) != 0;
+
+		if (IS_ENABLED(CONFIG_KEYPAD_LED_PWM)) {
+			led_pwm_level_set(i + 1, on ? LED_PWM_MAX : 0);
+		} else if (lock_leds[i].port != NULL) {
+			gpio_pin_set_dt(&lock_leds[i], on);
+		}
+	}
+}
+
+static void host_leds_update(uint8_t state)
+{
+	state &= HOST_LED_NUM_LOCK | HOST_LED_CAPS_LOCK |
+		 HOST_LED_SCROLL_LOCK;
+
+	if (state == lock_state) {
+		return;
+	}
+
+	lock_state = state;
+
+	if (!suspend_is_active()) {
+		host_leds_apply(state);
+	}
+}
+
+int host_leds_set_report(const struct device *dev,
+			 struct usb_setup_packet *setup, int32_t *len,
+			 uint8_t **data)
+{
+	if ((setup->wValue >> 8) != HOST_LEDS_REPORT_TYPE_OUTPUT ||
+	    *len < 1) {
+		return -ENOTSUP;
+	}
+
+	host_leds_update((*data)[0]);
+
+	return 0;
+}
+
+void host_leds_out_ready(const struct device *dev)
+{
+	uint8_t buf[CONFIG_HID_INTERRUPT_EP_MPS];
+	uint32_t len;
+	int ret;
+
+	ret = hid_int_ep_read(dev, buf, sizeof(buf), &len);
+	if (ret < 0 || len < 1) {
+		return;
+	}
+
+	host_leds_update(buf[0]);
+}
+
+uint8_t host_leds_get(void)
+{
+	return lock_state;
+}
+
+static void host_leds_suspend(bool suspended)
+{
+	/* LEDs were blanked for suspend, show the lock state again */
+	if (!suspended) {
+		host_leds_apply(lock_state);
+	}
+}
+
+static struct suspend_listener listener = {
+	.changed = host_leds_suspend,
+};
+
+void host_leds_init(void)
+{
+	suspend_listener_register(&listener);
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Lock key state from the host keyboard output report. Num, Caps and
+ * Scroll Lock are shown on led1, led2 and led3. Reports may arrive on
+ * the interrupt OUT endpoint or as SET_REPORT on the control pipe.
+ */
+
+#ifndef KEYPAD_HOST_LEDS_H_
+#define KEYPAD_HOST_LEDS_H_
+
+#include <zephyr/device.h>
+#include <zephyr/usb/usb_device.h>
+
+/* Output report bits, HID Usage Tables LED page 0x01..0x03 */
+#define HOST_LED_NUM_LOCK    BIT(0)
+#define HOST_LED_CAPS_LOCK   BIT(1)
+#define HOST_LED_SCROLL_LOCK BIT(2)
+
+void host_leds_init(void);
+
+/* Last lock state received from the host */
+uint8_t host_leds_get(void);
+
+/* struct hid_ops::set_report */
+int host_leds_set_report(const struct device *dev,
+			 struct usb_setup_packet *setup, int32_t *len,
+			 uint8_t **data);
+
+/* struct hid_ops::int_out_ready */
+void host_leds_out_ready(const struct device *dev);
+
+#endif /* KEYPAD_HOST_LEDS_H_ */
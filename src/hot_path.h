@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Placement of the key pipeline's hot path: the scan interrupt, the
+ * event ring, the report builder and the write to the link. With
+ * CONFIG_KEYPAD_HOT_RAM the functions marked KEYPAD_HOT are copied to
+ * RAM at boot and run there, with the same cycle count on every pass:
+ * no flash wait states, no instruction cache misses and no stall while
+ * the NVMC writes, as the config store does. What they call in the
+ * kernel and the drivers stays in flash.
+ */
+
+#ifndef KEYPAD_HOT_PATH_H_
+#define KEYPAD_HOT_PATH_H_
+
+#include <zephyr/toolchain.h>
+
+#if defined(CONFIG_KEYPAD_HOT_RAM)
+#define KEYPAD_HOT __ramfunc
+#else
+#define KEYPAD_HOT
+#endif
+
+#endif /* KEYPAD_HOT_PATH_H_ */
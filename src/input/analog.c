@@ -0,0 +1,699 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * TIMER2 COMPARE0 ends every scan period and is published on a DPPI
+ * channel the SAADC SAMPLE task subscribes to. With more than one
+ * channel enabled the SAADC is in scan mode, so one SAMPLE converts
+ * every sensor and the buffer of ANALOG_KEYS samples fills per scan.
+ * The driver runs in advanced mode with start_on_end: the buffer for
+ * the next scan is handed over on BUF_REQ and started by hardware, the
+ * finished one is processed on DONE.
+ *
+ * Reading to travel: the reading is normalized against the key's rest
+ * and bottom values to Q12 with a per-key reciprocal, so no division
+ * is needed per sample, then mapped through the 17 point travel curve
+ * with linear interpolation.
+ *
+ * The front of that runs on pairs of keys, two 16 bit lanes to a
+ * word: the optional IIR smoothing of the readings and the rest value
+ * taken off them. With CONFIG_KEYPAD_ANALOG_DSP these are the SIMD
+ * instructions of the M33 DSP extension, n SHADD16 for a smoothing
+ * of 1/2^n and one QSUB16, and the normalization is one SMULWB or
+ * SMULWT per key, the 32 bit gain times a lane, instead of a 64 bit
+ * multiply. Without it the same arithmetic runs lane by lane, with
+ * the same rounding.
+ *
+ * With CONFIG_KEYPAD_ANALOG_AUTOCAL every sample also feeds the
+ * calibration. Readings at rest pass a slow IIR that follows offset
+ * drift, which moves both ends of the key. Presses that read deeper
+ * than the bottom value widen it quickly. Full presses that stop short
+ * of it pull it back slowly. The reciprocal is only recomputed when an
+ * integer end value changes. Persisting is left to a work item that
+ * hands the values to the config store once the keys have been quiet
+ * for a while, at most once per save interval.
+ */
+
+#include <stdlib.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/logging/log.h>
+
+#include <nrfx_dppi.h>
+#include <nrfx_saadc.h>
+#include <nrfx_timer.h>
+#include <hal/nrf_saadc.h>
+#include <helpers/nrfx_gppi.h>
+#if defined(CONFIG_KEYPAD_ANALOG_DSP)
+#include <arm_acle.h>
+#endif
+
+#include "input/analog.h"
+#include "config/config_store.h"
+#include "diag/scan_stream.h"
+#include "diag/stage_bench.h"
+#include "irq_plan.h"
+
+LOG_MODULE_REGISTER(analog, LOG_LEVEL_INF);
+
+#define ANALOG_TIMER_NODE DT_NODELABEL(timer2)
+#define ANALOG_ADC_NODE DT_NODELABEL(adc)
+#define ANALOG_PERIOD_US (USEC_PER_SEC / CONFIG_KEYPAD_ANALOG_SCAN_HZ)
+#define ANALOG_TRAVEL_UM DT_PROP(ANALOG_NODE, travel_um)
+
+/* Normalized reading, 0 at rest and ANALOG_Q_ONE bottomed out */
+#define ANALOG_Q_SHIFT 12
+#define ANALOG_Q_ONE BIT(ANALOG_Q_SHIFT)
+/* Curve segments are ANALOG_Q_ONE / 16 wide */
+#define ANALOG_SEG_SHIFT (ANALOG_Q_SHIFT - 4)
+/* Keys in pairs of 16 bit lanes, the last lane a pad for an odd count */
+#define ANALOG_PAIRS DIV_ROUND_UP(ANALOG_KEYS, 2)
+
+BUILD_ASSERT(ANALOG_KEYS <= 8, "the SAADC has eight channels");
+BUILD_ASSERT(DT_PROP_LEN(ANALOG_NODE, ain) == ANALOG_KEYS &&
+	     DT_PROP_LEN(ANALOG_NODE, rest_raw) == ANALOG_KEYS &&
+	     DT_PROP_LEN(ANALOG_NODE, bottom_raw) == ANALOG_KEYS,
+	     "ain, rest-raw and bottom-raw need one entry per key");
+BUILD_ASSERT(DT_PROP_LEN(ANALOG_NODE, travel_curve) == ANALOG_CURVE_POINTS,
+	     "travel-curve needs 17 points");
+
+/* Fraction bits of the filtered calibration values */
+#define ANALOG_CAL_Q 8
+/* Smallest rest to bottom distance calibration may shrink a key to */
+#define ANALOG_CAL_MIN_SPAN 64
+/* No key change for this long before calibration is written to flash */
+#define ANALOG_CAL_QUIET_MS 5000
+
+/*
+ * What the scan loop reads and writes for every key on every scan, one
+ * array per field: the loop walks each in key order and the whole set
+ * for eight keys is under a hundred bytes. Whether a key is down is
+ * its bit of state.
+ */
+struct analog_hot {
+	/* Q12 reciprocal of the rest to bottom span, signed */
+	int32_t gain[ANALOG_KEYS];
+	/* Last scan in the dead zone */
+	uint32_t rest_scan[ANALOG_KEYS];
+	uint16_t travel_um[ANALOG_KEYS];
+	/* Deepest point while pressed, highest while released */
+	uint16_t extreme_um[ANALOG_KEYS];
+	uint16_t actuation_um[ANALOG_KEYS];
+	uint16_t rapid_um[ANALOG_KEYS];
+	/* Passed the actuation point since it last left the dead zone */
+	keypad_bitmap_t armed;
+};
+
+/*
+ * Calibration, read by the scan loop only with auto-calibration and
+ * then all fields of a key together, so it stays a struct per key
+ */
+struct analog_cal {
+	/* Raw readings at both ends */
+	int16_t rest;
+	int16_t bottom;
+#if defined(CONFIG_KEYPAD_ANALOG_AUTOCAL)
+	/* Deepest reading of the current press */
+	int16_t peak;
+	/* Filtered end values with ANALOG_CAL_Q fraction bits */
+	int32_t rest_q;
+	int32_t bottom_q;
+#endif
+};
+
+union analog_lanes {
+	int32_t pair[ANALOG_PAIRS];
+	int16_t lane[ANALOG_PAIRS * 2];
+};
+
+#define ANALOG_ELEM(node_id, prop, idx) DT_PROP_BY_IDX(node_id, prop, idx),
+
+static const uint8_t ain[] = {
+	DT_FOREACH_PROP_ELEM(ANALOG_NODE, ain, ANALOG_ELEM)
+};
+static const int16_t rest_raw[] = {
+	DT_FOREACH_PROP_ELEM(ANALOG_NODE, rest_raw, ANALOG_ELEM)
+};
+static const int16_t bottom_raw[] = {
+	DT_FOREACH_PROP_ELEM(ANALOG_NODE, bottom_raw, ANALOG_ELEM)
+};
+static const uint16_t curve_permille[] = {
+	DT_FOREACH_PROP_ELEM(ANALOG_NODE, travel_curve, ANALOG_ELEM)
+};
+
+static const nrfx_timer_t analog_timer = NRFX_TIMER_INSTANCE(2);
+static uint8_t sample_channel;
+
+/* EasyDMA targets, one filling while the other is processed */
+static union analog_lanes samples[2];
+static uint8_t next_buf;
+/* Smoothed readings, the rest value of every key and the difference */
+static union analog_lanes smooth;
+static union analog_lanes rest_lanes;
+static union analog_lanes depth;
+
+/* travel-curve scaled to um */
+static uint16_t curve_um[ANALOG_CURVE_POINTS];
+static struct analog_hot hot;
+static struct analog_cal cal[ANALOG_KEYS];
+/* Travel speed of the last press, written once per press */
+static uint16_t press_speed[ANALOG_KEYS];
+static struct k_spinlock lock;
+static keypad_bitmap_t state;
+static analog_scan_t scan_handler;
+static uint32_t scan_count;
+
+static void analog_key_calibrate(uint8_t i, int16_t rest, int16_t bottom)
+{
+	/* Sign follows the magnet polarity, never zero */
+	int32_t span = (bottom != rest) ? bottom - rest : 1;
+
+	cal[i].rest = rest;
+	cal[i].bottom = bottom;
+	hot.gain[i] = (ANALOG_Q_ONE << 16) / span;
+	rest_lanes.lane[i] = rest;
+}
+
+#if defined(CONFIG_KEYPAD_ANALOG_DSP)
+/* Smooth every reading and take its rest value off, two keys at a time */
+static void analog_filter(const union analog_lanes *in)
+{
+	for (uint8_t p = 0; p < ANALOG_PAIRS; p++) {
+		int16x2_t s = in->pair[p];
+
+		/* Halfway from the last value n times, 1/2^n of the way */
+		for (int n = 0; n < CONFIG_KEYPAD_ANALOG_SMOOTH_SHIFT; n++) {
+			s = __shadd16(smooth.pair[p], s);
+		}
+
+		smooth.pair[p] = s;
+		depth.pair[p] = __qsub16(s, rest_lanes.pair[p]);
+	}
+}
+
+/* Depth of key i in Q12 of its span, the sign taken care of by the gain */
+static inline int32_t analog_normalize(uint8_t i)
+{
+	int16x2_t d = depth.pair[i >> 1];
+
+	return (i & 1) ? __smulwt(hot.gain[i], d) :
+			 __smulwb(hot.gain[i], d);
+}
+#else
+static void analog_filter(const union analog_lanes *in)
+{
+	for (uint8_t i = 0; i < ANALOG_PAIRS * 2; i++) {
+		int32_t s = in->lane[i];
+
+		for (int n = 0; n < CONFIG_KEYPAD_ANALOG_SMOOTH_SHIFT; n++) {
+			s = (smooth.lane[i] + s) >> 1;
+		}
+
+		smooth.lane[i] = s;
+		depth.lane[i] = CLAMP(s - rest_lanes.lane[i], INT16_MIN,
+				      INT16_MAX);
+	}
+}
+
+static inline int32_t analog_normalize(uint8_t i)
+{
+	return ((int64_t)depth.lane[i] * hot.gain[i]) >> 16;
+}
+#endif /* CONFIG_KEYPAD_ANALOG_DSP */
+
+static uint16_t analog_travel(int32_t q)
+{
+	int32_t seg;
+	int32_t frac;
+
+	q = CLAMP(q, 0, ANALOG_Q_ONE);
+	seg = q >> ANALOG_SEG_SHIFT;
+	frac = q & BIT_MASK(ANALOG_SEG_SHIFT);
+
+	if (seg == ANALOG_CURVE_POINTS - 1) {
+		return curve_um[seg];
+	}
+
+	return curve_um[seg] + (((curve_um[seg + 1] - curve_um[seg]) * frac) >>
+				ANALOG_SEG_SHIFT);
+}
+
+/* First actuation since rest: travel over the scans it took, um/ms */
+static void analog_key_speed(uint8_t i, uint16_t travel)
+{
+	uint32_t scans = MAX(scan_count - hot.rest_scan[i], 1);
+	uint32_t speed = travel * (uint32_t)CONFIG_KEYPAD_ANALOG_SCAN_HZ /
+			 (scans * MSEC_PER_SEC);
+
+	press_speed[i] = MIN(speed, UINT16_MAX);
+}
+
+static bool analog_key_update(uint8_t i, bool pressed, uint16_t travel)
+{
+	uint16_t extreme = hot.extreme_um[i];
+	uint16_t rapid = hot.rapid_um[i];
+
+	hot.travel_um[i] = travel;
+
+	if (travel < CONFIG_KEYPAD_ANALOG_DEADZONE_UM) {
+		/* Fully up, the next press needs the actuation point again */
+		hot.armed &= ~BIT(i);
+		hot.extreme_um[i] = travel;
+		hot.rest_scan[i] = scan_count;
+		return false;
+	}
+
+	if (pressed) {
+		if (travel > extreme) {
+			hot.extreme_um[i] = travel;
+		} else if (rapid != 0 ? extreme - travel >= rapid :
+			   travel + CONFIG_KEYPAD_ANALOG_HYSTERESIS_UM <
+			   hot.actuation_um[i]) {
+			hot.extreme_um[i] = travel;
+			return false;
+		}
+	} else {
+		bool armed = hot.armed & BIT(i);
+
+		if (travel < extreme) {
+			hot.extreme_um[i] = travel;
+		} else if (travel >= hot.actuation_um[i] ||
+			   (armed && rapid != 0 && travel - extreme >= rapid)) {
+			if (!armed) {
+				analog_key_speed(i, travel);
+			}
+			hot.armed |= BIT(i);
+			hot.extreme_um[i] = travel;
+			return true;
+		}
+	}
+
+	return pressed;
+}
+
+#if defined(CONFIG_KEYPAD_ANALOG_AUTOCAL)
+static bool cal_dirty;
+static uint32_t last_change_ms;
+
+/* Distance of a reading from rest towards bottom, whatever the polarity */
+static int32_t analog_depth(const struct analog_cal *c, int32_t raw)
+{
+	return (c->bottom > c->rest) ? raw - c->rest : c->rest - raw;
+}
+
+static void analog_key_track(uint8_t i, nrf_saadc_value_t raw,
+			     bool pressed, bool was_pressed)
+{
+	struct analog_cal *c = &cal[i];
+	int32_t sample_q = (int32_t)raw << ANALOG_CAL_Q;
+	int32_t rest;
+	int32_t bottom;
+
+	if (pressed != was_pressed) {
+		last_change_ms = k_uptime_get_32();
+	}
+
+	if (!pressed && hot.travel_um[i] < CONFIG_KEYPAD_ANALOG_DEADZONE_UM) {
+		int32_t drift_q = (sample_q - c->rest_q) >>
+				  CONFIG_KEYPAD_ANALOG_CAL_REST_SHIFT;
+
+		/* Offset drift shifts the whole transfer curve */
+		c->rest_q += drift_q;
+		c->bottom_q += drift_q;
+	} else if (pressed) {
+		if (!was_pressed ||
+		    analog_depth(c, raw) > analog_depth(c, c->peak)) {
+			c->peak = raw;
+		}
+
+		if (analog_depth(c, raw) > analog_depth(c, c->bottom)) {
+			c->bottom_q += (sample_q - c->bottom_q) >> 2;
+		}
+	} else if (was_pressed && analog_depth(c, c->peak) * 4 >=
+				  analog_depth(c, c->bottom) * 3) {
+		c->bottom_q += (((int32_t)c->peak << ANALOG_CAL_Q) -
+				c->bottom_q) >>
+			       CONFIG_KEYPAD_ANALOG_CAL_BOTTOM_SHIFT;
+	}
+
+	rest = c->rest_q >> ANALOG_CAL_Q;
+	bottom = c->bottom_q >> ANALOG_CAL_Q;
+
+	if ((rest == c->rest && bottom == c->bottom) ||
+	    abs(bottom - rest) < ANALOG_CAL_MIN_SPAN) {
+		return;
+	}
+
+	analog_key_calibrate(i, rest, bottom);
+	cal_dirty = true;
+}
+#endif /* CONFIG_KEYPAD_ANALOG_AUTOCAL */
+
+static void analog_scan_process(const union analog_lanes *buf)
+{
+	k_spinlock_key_t key;
+	uint32_t bench;
+
+	/* Raw, ahead of the filter and out of the bench */
+	scan_stream_samples(buf->lane, ANALOG_KEYS);
+
+	bench = stage_bench_begin();
+	key = k_spin_lock(&lock);
+	analog_filter(buf);
+
+	for (uint8_t i = 0; i < ANALOG_KEYS; i++) {
+		bool was_pressed = state & BIT(i);
+		uint16_t travel = analog_travel(analog_normalize(i));
+		bool pressed = analog_key_update(i, was_pressed, travel);
+
+		WRITE_BIT(state, i, pressed);
+#if defined(CONFIG_KEYPAD_ANALOG_AUTOCAL)
+		analog_key_track(i, smooth.lane[i], pressed, was_pressed);
+#endif
+	}
+
+	k_spin_unlock(&lock, key);
+	/* The analog keys' counterpart of the debounce */
+	stage_bench_end(STAGE_BENCH_DEBOUNCE, bench);
+
+	scan_count++;
+	scan_handler(state);
+}
+
+static void analog_timer_handler(nrf_timer_event_t event, void *context)
+{
+	/* nrfx requires a handler even with no compare interrupt enabled */
+}
+
+static void analog_saadc_handler(nrfx_saadc_evt_t const *event)
+{
+	switch (event->type) {
+	case NRFX_SAADC_EVT_BUF_REQ:
+		nrfx_saadc_buffer_set(samples[next_buf].lane, ANALOG_KEYS);
+		next_buf ^= 1;
+		break;
+	case NRFX_SAADC_EVT_DONE:
+		/* The lanes are the first member of the buffer's union */
+		analog_scan_process((const union analog_lanes *)
+				    event->data.done.p_buffer);
+		break;
+	default:
+		break;
+	}
+}
+
+static int analog_saadc_configure(void)
+{
+	nrfx_saadc_channel_t channels[ANALOG_KEYS];
+	nrfx_saadc_adv_config_t adv = NRFX_SAADC_DEFAULT_ADV_CONFIG;
+	nrfx_err_t err;
+
+	for (uint8_t i = 0; i < ANALOG_KEYS; i++) {
+		channels[i] = (nrfx_saadc_channel_t)NRFX_SAADC_DEFAULT_CHANNEL_SE(
+			NRF_SAADC_INPUT_AIN0 + ain[i], i);
+		/* Full VDD range, Hall sensors are ratiometric */
+		channels[i].channel_config.gain = NRF_SAADC_GAIN1_4;
+		channels[i].channel_config.reference = NRF_SAADC_REFERENCE_VDD4;
+		channels[i].channel_config.acq_time = NRF_SAADC_ACQTIME_3US;
+	}
+
+	err = nrfx_saadc_init(IRQ_PLAN_INPUT);
+	if (err != NRFX_SUCCESS) {
+		LOG_ERR("Failed to init SAADC, error: 0x%08x", err);
+		return -EIO;
+	}
+
+	IRQ_CONNECT(DT_IRQN(ANALOG_ADC_NODE), IRQ_PLAN_INPUT,
+		    nrfx_saadc_irq_handler, NULL, 0);
+
+	err = nrfx_saadc_channels_config(channels, ANALOG_KEYS);
+	if (err != NRFX_SUCCESS) {
+		LOG_ERR("Failed to configure SAADC channels, error: 0x%08x",
+			err);
+		return -EIO;
+	}
+
+	/* SAMPLE comes from DPPI, END restarts into the requested buffer */
+	adv.internal_timer_cc = 0;
+	adv.start_on_end = true;
+
+	err = nrfx_saadc_advanced_mode_set(BIT_MASK(ANALOG_KEYS),
+					   NRF_SAADC_RESOLUTION_12BIT, &adv,
+					   analog_saadc_handler);
+	if (err == NRFX_SUCCESS) {
+		err = nrfx_saadc_buffer_set(samples[0].lane, ANALOG_KEYS);
+	}
+	if (err == NRFX_SUCCESS) {
+		next_buf = 1;
+		err = nrfx_saadc_mode_trigger();
+	}
+	if (err != NRFX_SUCCESS) {
+		LOG_ERR("Failed to start SAADC, error: 0x%08x", err);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+#if defined(CONFIG_KEYPAD_ANALOG_CAL_PERSIST)
+struct analog_cal_record {
+	int16_t rest;
+	int16_t bottom;
+};
+
+static struct k_work_delayable save_work;
+
+static ssize_t analog_cal_get(void *buf, size_t size)
+{
+	struct analog_cal_record *rec = buf;
+	k_spinlock_key_t key;
+
+	if (size < sizeof(*rec) * ANALOG_KEYS) {
+		return -ENOSPC;
+	}
+
+	key = k_spin_lock(&lock);
+	for (uint8_t i = 0; i < ANALOG_KEYS; i++) {
+		rec[i].rest = cal[i].rest;
+		rec[i].bottom = cal[i].bottom;
+	}
+	k_spin_unlock(&lock, key);
+
+	return sizeof(*rec) * ANALOG_KEYS;
+}
+
+static int analog_cal_set(const void *data, size_t len)
+{
+	const struct analog_cal_record *rec = data;
+
+	if (len != sizeof(*rec) * ANALOG_KEYS) {
+		/* Saved for another key count, keep the devicetree values */
+		return -EINVAL;
+	}
+
+	for (uint8_t i = 0; i < ANALOG_KEYS; i++) {
+		analog_key_calibrate(i, rec[i].rest, rec[i].bottom);
+	}
+
+	return 0;
+}
+
+/* Same key as before the config store, so old calibrations still load */
+static struct config_entry cal_entry = {
+	.name = "keypad/cal/keys",
+	.get = analog_cal_get,
+	.set = analog_cal_set,
+};
+
+static void analog_cal_save(struct k_work *work)
+{
+	k_spinlock_key_t key;
+	bool save = false;
+
+	key = k_spin_lock(&lock);
+
+	if (cal_dirty && state == 0 &&
+	    k_uptime_get_32() - last_change_ms >= ANALOG_CAL_QUIET_MS) {
+		cal_dirty = false;
+		save = true;
+	}
+
+	k_spin_unlock(&lock, key);
+
+	if (!save) {
+		/* Nothing new, or the keys are in use: look again later */
+		k_work_schedule(&save_work, K_MSEC(cal_dirty ?
+						   ANALOG_CAL_QUIET_MS :
+						   CONFIG_KEYPAD_ANALOG_CAL_SAVE_INTERVAL_S *
+						   MSEC_PER_SEC));
+		return;
+	}
+
+	/* The store snapshots the values when it writes */
+	config_store_changed(&cal_entry);
+
+	k_work_schedule(&save_work,
+			K_SECONDS(CONFIG_KEYPAD_ANALOG_CAL_SAVE_INTERVAL_S));
+}
+
+static void analog_cal_restore(void)
+{
+	int ret;
+
+	ret = config_store_register(&cal_entry);
+	if (ret < 0) {
+		LOG_ERR("Failed to load calibration, error: %d", ret);
+	}
+
+	k_work_init_delayable(&save_work, analog_cal_save);
+	k_work_schedule(&save_work,
+			K_SECONDS(CONFIG_KEYPAD_ANALOG_CAL_SAVE_INTERVAL_S));
+}
+#endif /* CONFIG_KEYPAD_ANALOG_CAL_PERSIST */
+
+int analog_init(analog_scan_t scan_done)
+{
+	nrfx_timer_config_t config = NRFX_TIMER_DEFAULT_CONFIG;
+	nrfx_err_t err;
+	int ret;
+
+	scan_handler = scan_done;
+
+	for (uint8_t p = 0; p < ANALOG_CURVE_POINTS; p++) {
+		curve_um[p] = curve_permille[p] * ANALOG_TRAVEL_UM / 1000;
+	}
+
+	for (uint8_t i = 0; i < ANALOG_KEYS; i++) {
+		analog_key_calibrate(i, rest_raw[i], bottom_raw[i]);
+		smooth.lane[i] = rest_raw[i];
+		hot.actuation_um[i] = DT_PROP(ANALOG_NODE, actuation_um);
+		hot.rapid_um[i] = DT_PROP(ANALOG_NODE, rapid_trigger_um);
+	}
+
+#if defined(CONFIG_KEYPAD_ANALOG_CAL_PERSIST)
+	analog_cal_restore();
+#endif
+
+#if defined(CONFIG_KEYPAD_ANALOG_AUTOCAL)
+	for (uint8_t i = 0; i < ANALOG_KEYS; i++) {
+		cal[i].rest_q = (int32_t)cal[i].rest << ANALOG_CAL_Q;
+		cal[i].bottom_q = (int32_t)cal[i].bottom << ANALOG_CAL_Q;
+	}
+#endif
+
+	ret = analog_saadc_configure();
+	if (ret < 0) {
+		return ret;
+	}
+
+	config.frequency = NRF_TIMER_FREQ_1MHz;
+	config.bit_width = NRF_TIMER_BIT_WIDTH_32;
+
+	/* No timer interrupt, the SAADC END is the only one */
+	err = nrfx_timer_init(&analog_timer, &config,
+			      analog_timer_handler);
+	if (err != NRFX_SUCCESS) {
+		LOG_ERR("Failed to init analog scan timer, error: 0x%08x", err);
+		return -EIO;
+	}
+
+	nrfx_timer_extended_compare(&analog_timer, NRF_TIMER_CC_CHANNEL0,
+				    nrfx_timer_us_to_ticks(&analog_timer,
+							   ANALOG_PERIOD_US),
+				    NRF_TIMER_SHORT_COMPARE0_CLEAR_MASK, false);
+
+	err = nrfx_dppi_channel_alloc(&sample_channel);
+	if (err != NRFX_SUCCESS) {
+		LOG_ERR("Failed to allocate DPPI channel, error: 0x%08x", err);
+		return -ENOMEM;
+	}
+
+	nrfx_gppi_channel_endpoints_setup(sample_channel,
+		nrfx_timer_compare_event_address_get(&analog_timer,
+						     NRF_TIMER_CC_CHANNEL0),
+		nrf_saadc_task_address_get(NRF_SAADC, NRF_SAADC_TASK_SAMPLE));
+	nrfx_gppi_channels_enable(BIT(sample_channel));
+
+	nrfx_timer_enable(&analog_timer);
+
+	return 0;
+}
+
+int analog_actuation_set(uint8_t key, uint16_t actuation_um,
+			 uint16_t rapid_um)
+{
+	k_spinlock_key_t lock_key;
+
+	if (key >= ANALOG_KEYS ||
+	    actuation_um <= CONFIG_KEYPAD_ANALOG_DEADZONE_UM ||
+	    actuation_um > ANALOG_TRAVEL_UM) {
+		return -EINVAL;
+	}
+
+	/* Both values are read together by the SAADC interrupt */
+	lock_key = k_spin_lock(&lock);
+	hot.actuation_um[key] = actuation_um;
+	hot.rapid_um[key] = rapid_um;
+	k_spin_unlock(&lock, lock_key);
+
+	return 0;
+}
+
+uint16_t analog_travel_get(uint8_t key)
+{
+	return key < ANALOG_KEYS ? hot.travel_um[key] : 0;
+}
+
+uint16_t analog_press_speed_get(uint8_t key)
+{
+	return key < ANALOG_KEYS ? press_speed[key] : 0;
+}
+
+uint32_t analog_scan_count(void)
+{
+	return scan_count;
+}
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static int cmd_analog_show(const struct shell *sh, size_t argc, char **argv)
+{
+	shell_print(sh, "scans: %u", scan_count);
+
+	for (uint8_t i = 0; i < ANALOG_KEYS; i++) {
+		shell_print(sh, "  key %u: %4u um %s, actuation %u um, "
+			    "rapid trigger %u um, rest %d bottom %d", i,
+			    hot.travel_um[i],
+			    (state & BIT(i)) ? "down" : "up  ",
+			    hot.actuation_um[i], hot.rapid_um[i],
+			    cal[i].rest, cal[i].bottom);
+	}
+
+	return 0;
+}
+
+static int cmd_analog_set(const struct shell *sh, size_t argc, char **argv)
+{
+	int ret = analog_actuation_set(strtoul(argv[1], NULL, 0),
+				       strtoul(argv[2], NULL, 0),
+				       strtoul(argv[3], NULL, 0));
+
+	if (ret < 0) {
+		shell_error(sh, "Invalid key or actuation point");
+	}
+
+	return ret;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_analog,
+	SHELL_CMD(show, NULL, "Print travel of every key", cmd_analog_show),
+	SHELL_CMD_ARG(set, NULL, "<key> <actuation_um> <rapid_um>",
+		      cmd_analog_set, 4, 0),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(analog, &sub_analog, "Analog key settings", NULL);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Analog Hall effect keys. TIMER2 triggers a SAADC scan of every sensor
+ * over DPPI; EasyDMA fills one of two sample buffers while the other is
+ * converted to travel and run through the actuation logic, all in
+ * integer math in the SAADC interrupt.
+ */
+
+#ifndef KEYPAD_INPUT_ANALOG_H_
+#define KEYPAD_INPUT_ANALOG_H_
+
+#include <zephyr/devicetree.h>
+
+#include "keymap.h"
+
+#define ANALOG_NODE DT_INST(0, richeffects_keypad_analog)
+#define ANALOG_KEYS DT_PROP_LEN(ANALOG_NODE, keycodes)
+/* Points of the travel-curve property */
+#define ANALOG_CURVE_POINTS 17
+
+/* Called from the SAADC interrupt after every converted scan */
+typedef void (*analog_scan_t)(keypad_bitmap_t state);
+
+int analog_init(analog_scan_t scan_done);
+
+/*
+ * Change the actuation point and rapid trigger distance of one key,
+ * rapid_um 0 turns rapid trigger off. Returns -EINVAL for a bad key.
+ */
+int analog_actuation_set(uint8_t key, uint16_t actuation_um,
+			 uint16_t rapid_um);
+
+/* Last converted travel of a key, um */
+uint16_t analog_travel_get(uint8_t key);
+
+/*
+ * Travel speed of the last press of a key from rest to its actuation
+ * point, um/ms, timed in scans of the TIMER2 period. Set before the
+ * press reaches the scan handler; a rapid trigger re-press keeps the
+ * value of the press that started from rest.
+ */
+uint16_t analog_press_speed_get(uint8_t key);
+
+/* Completed scans since boot */
+uint32_t analog_scan_count(void);
+
+#endif /* KEYPAD_INPUT_ANALOG_H_ */
@@ -0,0 +1,437 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Every key line gets a GPIOTE IN channel in toggle mode with its
+ * interrupt disabled. All of them publish on one DPPI channel that
+ * starts TIMER1. COMPARE0 fires CONFIG_KEYPAD_DEBOUNCE_US after the first
+ * edge, stops and clears the timer through shortcuts, and is the only
+ * interrupt raised for the whole bounce burst. Further edges inside the
+ * window hit an already running timer and cost nothing.
+ *
+ * With CONFIG_KEYPAD_EDGE_TIMESTAMP, TIMER0 runs free at 16 MHz as the
+ * timestamp base. The edge channel also triggers its CAPTURE0, so CC0
+ * holds the time of the latest edge. The TIMER1 COMPARE0 event triggers
+ * CAPTURE1 over a second DPPI channel, so CC1 holds the exact end of the
+ * window and the first edge is CC1 minus the window. All three are
+ * taken by hardware; the interrupt only reads them. It also captures
+ * CC3 as it starts, and CC3 minus CC1 is its own latency: how long the
+ * key interrupt waited behind others, see src/irq_plan.h.
+ *
+ * With CONFIG_KEYPAD_DEBOUNCE_HW_ZLI the TIMER1 interrupt is a zero
+ * latency one, running from RAM so an NVMC write does not stall it,
+ * and does no more than the window check: the stamps go into a ring
+ * and EGU5 is pended, whose interrupt at the normal priority runs the
+ * settled handler. The kernel masks neither the capture nor the
+ * window restart then. The ring only carries the stamps; a settle
+ * that finds it full is still handled, the handler reads the lines.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/gpio.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/logging/log.h>
+
+#include <nrfx_dppi.h>
+#include <nrfx_gpiote.h>
+#include <nrfx_timer.h>
+#include <helpers/nrfx_gppi.h>
+
+#include "input/debounce_hw.h"
+#include "irq_plan.h"
+#include "nrf_psel.h"
+
+LOG_MODULE_REGISTER(debounce_hw, LOG_LEVEL_INF);
+
+#define DEBOUNCE_TIMER_NODE DT_NODELABEL(timer1)
+#define DEBOUNCE_STAMP_PER_US (DEBOUNCE_HW_STAMP_HZ / USEC_PER_SEC)
+
+#if defined(CONFIG_KEYPAD_DEBOUNCE_HW_ZLI)
+#define DEBOUNCE_EGU_NODE DT_NODELABEL(egu5)
+/* Settles the EGU interrupt has not handled yet, a power of two */
+#define ZLI_RING_SIZE 4
+/* Called from the zero latency interrupt, which runs from RAM */
+#define DEBOUNCE_ZLI_FUNC __ramfunc
+#else
+#define DEBOUNCE_ZLI_FUNC
+#endif
+
+static const nrfx_timer_t debounce_timer = NRFX_TIMER_INSTANCE(1);
+/* DPPI channel every key edge publishes on */
+static uint8_t edge_channel;
+static debounce_hw_settled_t settled_handler;
+static uint32_t settle_count;
+
+/* Attached lines and their GPIOTE IN channels */
+static nrfx_gpiote_pin_t attached_pin[GPIOTE_CH_NUM];
+static uint8_t attached_channel[GPIOTE_CH_NUM];
+static size_t attached_count;
+
+#if defined(CONFIG_KEYPAD_EDGE_TIMESTAMP)
+static const nrfx_timer_t stamp_timer = NRFX_TIMER_INSTANCE(0);
+/* DPPI channel of the TIMER1 window end */
+static uint8_t settle_channel;
+static struct k_spinlock stamp_lock;
+/* First edge of the burst in progress, kept over window extensions */
+static uint32_t burst_first;
+static bool burst_extended;
+static struct debounce_hw_edges edges;
+static uint32_t extend_count;
+/* Longest and latest window end to interrupt, in stamp ticks */
+static uint32_t irq_latency_max;
+static uint32_t irq_latency_last;
+#endif
+
+#if defined(CONFIG_KEYPAD_DEBOUNCE_HW_ZLI)
+static struct debounce_hw_edges zli_ring[ZLI_RING_SIZE];
+/* Written by the zero latency interrupt only */
+static volatile uint8_t zli_head;
+/* Written by the EGU interrupt only */
+static volatile uint8_t zli_tail;
+#endif
+
+#if defined(CONFIG_KEYPAD_EDGE_TIMESTAMP)
+
+static void stamp_timer_handler(nrf_timer_event_t event, void *context)
+{
+	/* No compare interrupts are enabled on the timestamp timer */
+}
+
+/*
+ * Called at the end of every window. Returns false if the latest edge
+ * was too close to it, the window has then been restarted. Otherwise
+ * the stamps of the burst go to out.
+ */
+static DEBOUNCE_ZLI_FUNC bool
+debounce_edges_settled(struct debounce_hw_edges *out)
+{
+	uint32_t end = nrf_timer_cc_get(NRF_TIMER0, NRF_TIMER_CC_CHANNEL1);
+	uint32_t last = nrf_timer_cc_get(NRF_TIMER0, NRF_TIMER_CC_CHANNEL0);
+	uint32_t now;
+
+	/* CC3 is this interrupt's alone, debounce_hw_now() has CC2 */
+	nrf_timer_task_trigger(NRF_TIMER0, NRF_TIMER_TASK_CAPTURE3);
+	now = nrf_timer_cc_get(NRF_TIMER0, NRF_TIMER_CC_CHANNEL3);
+	irq_latency_last = now - end;
+	if (irq_latency_last > irq_latency_max) {
+		irq_latency_max = irq_latency_last;
+	}
+
+	if (!burst_extended) {
+		burst_first = end - CONFIG_KEYPAD_DEBOUNCE_US *
+				    DEBOUNCE_STAMP_PER_US;
+	}
+
+	if (end - last < CONFIG_KEYPAD_DEBOUNCE_HW_QUIET_US *
+			 DEBOUNCE_STAMP_PER_US) {
+		/* Still bouncing at the end of the window: one more */
+		burst_extended = true;
+		extend_count++;
+		/* nrfx_timer_enable() lives in flash */
+		nrf_timer_task_trigger(NRF_TIMER1, NRF_TIMER_TASK_START);
+		return false;
+	}
+
+	burst_extended = false;
+	out->first = burst_first;
+	out->last = last;
+
+	return true;
+}
+
+static int debounce_stamp_init(void)
+{
+	nrfx_timer_config_t config = NRFX_TIMER_DEFAULT_CONFIG;
+	nrfx_err_t err;
+
+	config.frequency = NRF_TIMER_FREQ_16MHz;
+	config.bit_width = NRF_TIMER_BIT_WIDTH_32;
+
+	err = nrfx_timer_init(&stamp_timer, &config, stamp_timer_handler);
+	if (err != NRFX_SUCCESS) {
+		LOG_ERR("Failed to init timestamp timer, error: 0x%08x", err);
+		return -EIO;
+	}
+
+	err = nrfx_dppi_channel_alloc(&settle_channel);
+	if (err != NRFX_SUCCESS) {
+		LOG_ERR("Failed to allocate DPPI channel, error: 0x%08x", err);
+		return -ENOMEM;
+	}
+
+	nrfx_gppi_fork_endpoint_setup(edge_channel,
+		nrfx_timer_capture_task_address_get(&stamp_timer,
+						    NRF_TIMER_CC_CHANNEL0));
+	nrfx_gppi_channel_endpoints_setup(settle_channel,
+		nrfx_timer_compare_event_address_get(&debounce_timer,
+						     NRF_TIMER_CC_CHANNEL0),
+		nrfx_timer_capture_task_address_get(&stamp_timer,
+						    NRF_TIMER_CC_CHANNEL1));
+	nrfx_gppi_channels_enable(BIT(settle_channel));
+
+	nrfx_timer_enable(&stamp_timer);
+
+	return 0;
+}
+
+uint32_t debounce_hw_now(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&stamp_lock);
+	/* CC2 is shared by all callers, capture and read as one */
+	uint32_t now = nrfx_timer_capture(&stamp_timer, NRF_TIMER_CC_CHANNEL2);
+
+	k_spin_unlock(&stamp_lock, key);
+
+	return now;
+}
+
+void debounce_hw_edges_get(struct debounce_hw_edges *out)
+{
+	*out = edges;
+}
+
+uint32_t debounce_hw_extend_count(void)
+{
+	return extend_count;
+}
+
+uint32_t debounce_hw_irq_latency_ns(bool reset)
+{
+	uint32_t ns = irq_latency_max * NSEC_PER_USEC / DEBOUNCE_STAMP_PER_US;
+
+	if (reset) {
+		irq_latency_max = 0;
+	}
+
+	return ns;
+}
+
+uint32_t debounce_hw_irq_latency_last_ns(void)
+{
+	return irq_latency_last * NSEC_PER_USEC / DEBOUNCE_STAMP_PER_US;
+}
+#else
+static inline bool debounce_edges_settled(struct debounce_hw_edges *out)
+{
+	return true;
+}
+
+static inline int debounce_stamp_init(void)
+{
+	return 0;
+}
+#endif /* CONFIG_KEYPAD_EDGE_TIMESTAMP */
+
+#if defined(CONFIG_KEYPAD_DEBOUNCE_HW_ZLI)
+static void debounce_timer_handler(nrf_timer_event_t event, void *context)
+{
+	/* nrfx_timer_1_irq_handler() is not connected */
+}
+
+/*
+ * Plain function in the vector table: the direct ISR wrappers call
+ * into the kernel for tracing and power management, which a zero
+ * latency interrupt must not. Registers go by their fixed addresses,
+ * the nrfx instances are in flash.
+ */
+static DEBOUNCE_ZLI_FUNC void debounce_zli_isr(void)
+{
+	uint8_t head = zli_head;
+	struct debounce_hw_edges burst = { 0 };
+
+	if (!nrf_timer_event_check(NRF_TIMER1, NRF_TIMER_EVENT_COMPARE0)) {
+		return;
+	}
+
+	nrf_timer_event_clear(NRF_TIMER1, NRF_TIMER_EVENT_COMPARE0);
+	if (!debounce_edges_settled(&burst)) {
+		return;
+	}
+
+	if ((uint8_t)(head - zli_tail) != ZLI_RING_SIZE) {
+		zli_ring[head % ZLI_RING_SIZE] = burst;
+		compiler_barrier();
+		zli_head = head + 1;
+	}
+
+	NVIC_SetPendingIRQ(DT_IRQN(DEBOUNCE_EGU_NODE));
+}
+
+static void debounce_egu_isr(const void *arg)
+{
+	do {
+		if (zli_tail != zli_head) {
+#if defined(CONFIG_KEYPAD_EDGE_TIMESTAMP)
+			edges = zli_ring[zli_tail % ZLI_RING_SIZE];
+#endif
+			zli_tail++;
+		}
+
+		settle_count++;
+		settled_handler();
+	} while (zli_tail != zli_head);
+}
+
+static void debounce_irq_connect(void)
+{
+	/* Over the priority nrfx_timer_init() set, to the zero latency one */
+	IRQ_DIRECT_CONNECT(DT_IRQN(DEBOUNCE_TIMER_NODE), 0, debounce_zli_isr,
+			   IRQ_ZERO_LATENCY);
+	IRQ_CONNECT(DT_IRQN(DEBOUNCE_EGU_NODE), IRQ_PLAN_INPUT,
+		    debounce_egu_isr, NULL, 0);
+	irq_enable(DT_IRQN(DEBOUNCE_EGU_NODE));
+}
+#else
+static void debounce_timer_handler(nrf_timer_event_t event, void *context)
+{
+	struct debounce_hw_edges *out = NULL;
+
+#if defined(CONFIG_KEYPAD_EDGE_TIMESTAMP)
+	out = &edges;
+#endif
+	if (event != NRF_TIMER_EVENT_COMPARE0 || !debounce_edges_settled(out)) {
+		return;
+	}
+
+	settle_count++;
+	settled_handler();
+}
+
+static void debounce_irq_connect(void)
+{
+	IRQ_CONNECT(DT_IRQN(DEBOUNCE_TIMER_NODE), IRQ_PLAN_INPUT,
+		    nrfx_timer_1_irq_handler, NULL, 0);
+}
+#endif /* CONFIG_KEYPAD_DEBOUNCE_HW_ZLI */
+
+int debounce_hw_init(debounce_hw_settled_t settled)
+{
+	nrfx_timer_config_t config = NRFX_TIMER_DEFAULT_CONFIG;
+	nrfx_err_t err;
+
+	settled_handler = settled;
+
+	config.frequency = NRF_TIMER_FREQ_1MHz;
+	config.bit_width = NRF_TIMER_BIT_WIDTH_32;
+	config.interrupt_priority = IRQ_PLAN_INPUT;
+
+	err = nrfx_timer_init(&debounce_timer, &config, debounce_timer_handler);
+	if (err != NRFX_SUCCESS) {
+		LOG_ERR("Failed to init debounce timer, error: 0x%08x", err);
+		return -EIO;
+	}
+
+	debounce_irq_connect();
+
+	/* Left stopped; the first edge starts it over DPPI */
+	nrfx_timer_extended_compare(&debounce_timer, NRF_TIMER_CC_CHANNEL0,
+				    nrfx_timer_us_to_ticks(&debounce_timer,
+					CONFIG_KEYPAD_DEBOUNCE_US),
+				    NRF_TIMER_SHORT_COMPARE0_STOP_MASK |
+				    NRF_TIMER_SHORT_COMPARE0_CLEAR_MASK,
+				    true);
+
+	err = nrfx_dppi_channel_alloc(&edge_channel);
+	if (err != NRFX_SUCCESS) {
+		LOG_ERR("Failed to allocate DPPI channel, error: 0x%08x", err);
+		return -ENOMEM;
+	}
+
+	nrfx_gppi_task_endpoint_setup(edge_channel,
+		nrfx_timer_task_address_get(&debounce_timer,
+					    NRF_TIMER_TASK_START));
+	nrfx_gppi_channels_enable(BIT(edge_channel));
+
+	return debounce_stamp_init();
+}
+
+static int debounce_pin_route(nrfx_gpiote_pin_t pin, uint8_t in_channel)
+{
+	nrfx_gpiote_trigger_config_t trigger = {
+		.trigger = NRFX_GPIOTE_TRIGGER_TOGGLE,
+		.p_in_channel = &in_channel,
+	};
+	nrfx_err_t err;
+
+	/* Pull and polarity were already applied by the GPIO driver */
+	err = nrfx_gpiote_input_configure(pin, NULL, &trigger, NULL);
+	if (err != NRFX_SUCCESS) {
+		LOG_ERR("Failed to configure GPIOTE for pin %u, error: 0x%08x",
+			pin, err);
+		return -EIO;
+	}
+
+	nrfx_gppi_event_endpoint_setup(edge_channel,
+				       nrfx_gpiote_in_event_addr_get(pin));
+
+	/* Event only, no interrupt: the CPU sleeps through the bounce */
+	nrfx_gpiote_trigger_enable(pin, false);
+
+	return 0;
+}
+
+int debounce_hw_attach(const struct gpio_dt_spec *spec)
+{
+	nrfx_gpiote_pin_t pin = nrf_psel_get(spec);
+	uint8_t in_channel;
+	nrfx_err_t err;
+
+	if (attached_count == ARRAY_SIZE(attached_pin)) {
+		LOG_ERR("No GPIOTE channel left for pin %u", pin);
+		return -ENOMEM;
+	}
+
+	err = nrfx_gpiote_channel_alloc(&in_channel);
+	if (err != NRFX_SUCCESS) {
+		LOG_ERR("No GPIOTE channel left for pin %u", pin);
+		return -ENOMEM;
+	}
+
+	attached_pin[attached_count] = pin;
+	attached_channel[attached_count] = in_channel;
+	attached_count++;
+
+	return debounce_pin_route(pin, in_channel);
+}
+
+void debounce_hw_enable(bool enable)
+{
+	for (size_t i = 0; i < attached_count; i++) {
+		if (enable) {
+			/* The pin may have been reconfigured for SENSE */
+			debounce_pin_route(attached_pin[i], attached_channel[i]);
+		} else {
+			nrfx_gpiote_trigger_disable(attached_pin[i]);
+		}
+	}
+
+	if (!enable) {
+		/*
+		 * Drop a window in progress; the next edge restarts it. The
+		 * caller's lock does not mask a zero latency interrupt,
+		 * which could restart the window meanwhile.
+		 */
+		if (IS_ENABLED(CONFIG_KEYPAD_DEBOUNCE_HW_ZLI)) {
+			irq_disable(DT_IRQN(DEBOUNCE_TIMER_NODE));
+		}
+
+		nrfx_timer_disable(&debounce_timer);
+		nrfx_timer_clear(&debounce_timer);
+		nrf_timer_event_clear(debounce_timer.p_reg,
+				      NRF_TIMER_EVENT_COMPARE0);
+#if defined(CONFIG_KEYPAD_EDGE_TIMESTAMP)
+		burst_extended = false;
+#endif
+
+		if (IS_ENABLED(CONFIG_KEYPAD_DEBOUNCE_HW_ZLI)) {
+			irq_enable(DT_IRQN(DEBOUNCE_TIMER_NODE));
+		}
+	}
+}
+
+uint32_t debounce_hw_settle_count(void)
+{
+	return settle_count;
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Hardware debounce: key edges are routed GPIOTE -> DPPI -> TIMER so the
+ * bounce window is timed without waking the CPU. Only the TIMER compare
+ * at the end of the window raises an interrupt.
+ */
+
+#ifndef KEYPAD_INPUT_DEBOUNCE_HW_H_
+#define KEYPAD_INPUT_DEBOUNCE_HW_H_
+
+#include <zephyr/drivers/gpio.h>
+
+/*
+ * Called from the TIMER interrupt CONFIG_KEYPAD_DEBOUNCE_US after the
+ * first edge, whatever the lines do meanwhile. The window is fixed:
+ * later edges inside it do not restart the timer.
+ */
+typedef void (*debounce_hw_settled_t)(void);
+
+int debounce_hw_init(debounce_hw_settled_t settled);
+
+/* Route the edges of one key line into the debounce timer */
+int debounce_hw_attach(const struct gpio_dt_spec *spec);
+
+/*
+ * Disable to stop all GPIOTE IN channels and the timer, e.g. while the
+ * lines are armed for SENSE during USB suspend. Enabling routes every
+ * attached line again.
+ */
+void debounce_hw_enable(bool enable);
+
+/* Number of settled windows, i.e. CPU wakeups spent on debounce */
+uint32_t debounce_hw_settle_count(void);
+
+/* Tick rate of the CONFIG_KEYPAD_EDGE_TIMESTAMP time base */
+#define DEBOUNCE_HW_STAMP_HZ 16000000
+
+struct debounce_hw_edges {
+	/* First edge of the burst, i.e. when the key really changed */
+	uint32_t first;
+	/* Last bounce before the lines went quiet */
+	uint32_t last;
+};
+
+/* Free running time base, DEBOUNCE_HW_STAMP_HZ ticks */
+uint32_t debounce_hw_now(void);
+
+/*
+ * Hardware stamps of the burst that settled last. Valid inside the
+ * settled handler and until the next burst settles.
+ */
+void debounce_hw_edges_get(struct debounce_hw_edges *out);
+
+/* Windows restarted because the lines were still bouncing at the end */
+uint32_t debounce_hw_extend_count(void);
+
+/*
+ * Longest delay from the end of a window to its interrupt running, in
+ * ns: the key input interrupt latency. reset starts measuring again.
+ */
+uint32_t debounce_hw_irq_latency_ns(bool reset);
+
+/* The same delay of the window that settled last, in ns */
+uint32_t debounce_hw_irq_latency_last_ns(void);
+
+#endif /* KEYPAD_INPUT_DEBOUNCE_HW_H_ */
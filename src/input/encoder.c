@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * The QDEC interrupt only adds ACC to a step counter and kicks the send
+ * work item; reports are written from the system work queue because
+ * hid_int_ep_write() may block. The IN completion kicks it again, so a
+ * backlog drains at one report per host poll.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/gpio.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/usb/class/usb_hid.h>
+
+#include <nrfx_qdec.h>
+
+#include "input/encoder.h"
+#include "irq_plan.h"
+#include "nrf_psel.h"
+#include "suspend.h"
+#include "usb/hid_iface.h"
+
+LOG_MODULE_REGISTER(encoder, LOG_LEVEL_INF);
+
+#define ENCODER_QDEC_NODE DT_NODELABEL(qdec0)
+#define ENCODER_STEPS DT_PROP(ENCODER_NODE, steps_per_detent)
+
+/* Consumer page usages, not provided by usb_hid.h */
+#define ENCODER_USAGE_PAGE_CONSUMER 0x0C
+#define ENCODER_USAGE_CONSUMER_CONTROL 0x01
+#define ENCODER_USAGE_VOLUME_INCREMENT 0xE9
+#define ENCODER_USAGE_VOLUME_DECREMENT 0xEA
+
+#if defined(CONFIG_KEYPAD_ENCODER_WHEEL)
+static const uint8_t encoder_report_desc[] = {
+	HID_USAGE_PAGE(HID_USAGE_GEN_DESKTOP),
+	HID_USAGE(HID_USAGE_GEN_DESKTOP_MOUSE),
+	HID_COLLECTION(HID_COLLECTION_APPLICATION),
+		HID_USAGE(HID_USAGE_GEN_DESKTOP_POINTER),
+		HID_COLLECTION(HID_COLLECTION_PHYSICAL),
+			HID_USAGE(HID_USAGE_GEN_DESKTOP_WHEEL),
+			HID_LOGICAL_MIN8(-127),
+			HID_LOGICAL_MAX8(127),
+			HID_REPORT_SIZE(8),
+			HID_REPORT_COUNT(1),
+			/* Data,Var,Rel */
+			HID_INPUT(0x06),
+		HID_END_COLLECTION,
+	HID_END_COLLECTION,
+};
+#else
+static const uint8_t encoder_report_desc[] = {
+	HID_USAGE_PAGE(ENCODER_USAGE_PAGE_CONSUMER),
+	HID_USAGE(ENCODER_USAGE_CONSUMER_CONTROL),
+	HID_COLLECTION(HID_COLLECTION_APPLICATION),
+		HID_USAGE(ENCODER_USAGE_VOLUME_INCREMENT),
+		HID_USAGE(ENCODER_USAGE_VOLUME_DECREMENT),
+		HID_LOGICAL_MIN8(0),
+		HID_LOGICAL_MAX8(1),
+		HID_REPORT_SIZE(1),
+		HID_REPORT_COUNT(2),
+		/* Data,Var,Abs */
+		HID_INPUT(0x02),
+		HID_REPORT_SIZE(6),
+		HID_REPORT_COUNT(1),
+		/* Cnst,Array,Abs */
+		HID_INPUT(0x03),
+	HID_END_COLLECTION,
+};
+#endif
+
+static const struct gpio_dt_spec phase_a =
+	GPIO_DT_SPEC_GET(ENCODER_NODE, a_gpios);
+static const struct gpio_dt_spec phase_b =
+	GPIO_DT_SPEC_GET(ENCODER_NODE, b_gpios);
+
+static const struct device *hid;
+static struct k_work send_work;
+/* Quadrature steps not yet reported, positive clockwise */
+static atomic_t steps;
+static atomic_t in_flight;
+/* Consumer usage held by the previous report */
+static uint8_t held;
+
+static void encoder_qdec_handler(nrfx_qdec_event_t event)
+{
+	int32_t acc;
+
+	if (event.type != NRF_QDEC_EVENT_REPORTRDY) {
+		return;
+	}
+
+	acc = event.data.report.acc;
+	if (DT_PROP(ENCODER_NODE, reverse)) {
+		acc = -acc;
+	}
+
+	if (suspend_is_active()) {
+		/* A turn wakes the host but is not replayed */
+		suspend_wakeup_request();
+		return;
+	}
+
+	atomic_add(&steps, acc);
+	k_work_submit(&send_work);
+}
+
+/* Take up to max whole detents out of the step counter */
+static int32_t encoder_detents_take(int32_t max)
+{
+	int32_t detents = atomic_get(&steps) / ENCODER_STEPS;
+
+	detents = CLAMP(detents, -max, max);
+	atomic_sub(&steps, detents * ENCODER_STEPS);
+
+	return detents;
+}
+
+static void encoder_send(struct k_work *work)
+{
+	uint8_t report;
+	int ret;
+
+	if (!atomic_cas(&in_flight, 0, 1)) {
+		/* The IN completion submits us again */
+		return;
+	}
+
+	if (IS_ENABLED(CONFIG_KEYPAD_ENCODER_WHEEL)) {
+		report = (int8_t)encoder_detents_take(INT8_MAX);
+		if (report == 0) {
+			atomic_set(&in_flight, 0);
+			return;
+		}
+	} else if (held != 0) {
+		/* Every detent is a full press and release */
+		report = 0;
+	} else {
+		int32_t detents = encoder_detents_take(1);
+
+		if (detents == 0) {
+			atomic_set(&in_flight, 0);
+			return;
+		}
+		report = detents > 0 ? BIT(0) : BIT(1);
+	}
+
+	ret = hid_iface_write(hid, HID_SHARED_ID_ENCODER, &report,
+			      sizeof(report));
+	if (ret) {
+		LOG_ERR("Encoder HID write error, %d", ret);
+		atomic_set(&in_flight, 0);
+		return;
+	}
+
+	held = report;
+}
+
+static void encoder_in_ready(const struct device *dev)
+{
+	atomic_set(&in_flight, 0);
+	k_work_submit(&send_work);
+}
+
+static const struct hid_ops encoder_ops = {
+	.int_in_ready = encoder_in_ready,
+};
+
+static int encoder_qdec_start(void)
+{
+	nrfx_qdec_config_t config = {
+		.reportper = NRF_QDEC_REPORTPER_10,
+		.sampleper = NRF_QDEC_SAMPLEPER_128us,
+		.psela = nrf_psel_get(&phase_a),
+		.pselb = nrf_psel_get(&phase_b),
+		.pselled = NRF_QDEC_LED_NOT_CONNECTED,
+		.ledpre = 0,
+		.ledpol = NRF_QDEC_LEPOL_ACTIVE_HIGH,
+		/* Contact bounce is filtered by QDEC */
+		.dbfen = true,
+		.sample_inten = false,
+		.interrupt_priority = IRQ_PLAN_INPUT,
+	};
+	nrfx_err_t err;
+	int ret;
+
+	/* QDEC takes the pins as they are, the pulls come from GPIO */
+	ret = gpio_pin_configure_dt(&phase_a, GPIO_INPUT);
+	if (ret == 0) {
+		ret = gpio_pin_configure_dt(&phase_b, GPIO_INPUT);
+	}
+	if (ret < 0) {
+		LOG_ERR("Failed to configure encoder pins, error: %d", ret);
+		return ret;
+	}
+
+	err = nrfx_qdec_init(&config, encoder_qdec_handler);
+	if (err != NRFX_SUCCESS) {
+		LOG_ERR("Failed to init QDEC, error: 0x%08x", err);
+		return -EIO;
+	}
+
+	IRQ_CONNECT(DT_IRQN(ENCODER_QDEC_NODE), IRQ_PLAN_INPUT,
+		    nrfx_qdec_irq_handler, NULL, 0);
+
+	nrfx_qdec_enable();
+
+	return 0;
+}
+
+int encoder_init(void)
+{
+	int ret;
+
+	hid = hid_iface_get(HID_IFACE_ENCODER);
+	if (hid == NULL) {
+		LOG_ERR("Cannot get USB HID Device for the encoder");
+		return -ENODEV;
+	}
+
+	k_work_init(&send_work, encoder_send);
+
+	ret = hid_iface_add(hid, HID_SHARED_ID_ENCODER, encoder_report_desc,
+			    sizeof(encoder_report_desc), &encoder_ops, 0);
+	if (ret < 0) {
+		LOG_ERR("Failed to init encoder HID, error: %d", ret);
+		return ret;
+	}
+
+	return encoder_qdec_start();
+}
+
+void encoder_reset(void)
+{
+	/* A transfer queued before a bus reset never completes */
+	atomic_set(&in_flight, 0);
+	held = 0;
+	k_work_submit(&send_work);
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Rotary encoder on its own HID interface. QDEC samples and counts the
+ * quadrature steps in hardware and raises one REPORTRDY interrupt per
+ * report period with the accumulated count, however fast the knob
+ * spins. The detents are sent once per IN transfer, as a mouse wheel
+ * movement or as Volume Increment/Decrement.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_ENCODER is enabled.
+ */
+
+#ifndef KEYPAD_INPUT_ENCODER_H_
+#define KEYPAD_INPUT_ENCODER_H_
+
+#include <zephyr/zephyr.h>
+
+#define ENCODER_NODE DT_INST(0, richeffects_keypad_encoder)
+
+#if defined(CONFIG_KEYPAD_ENCODER)
+
+/* Registers the encoder HID interface, call before usb_enable() */
+int encoder_init(void);
+
+/* Forget the in-flight report after a bus reset or reconfiguration */
+void encoder_reset(void);
+
+#else
+
+static inline int encoder_init(void)
+{
+	return 0;
+}
+
+static inline void encoder_reset(void) {}
+
+#endif /* CONFIG_KEYPAD_ENCODER */
+
+#endif /* KEYPAD_INPUT_ENCODER_H_ */
@@ -0,0 +1,454 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * The recorder follows the key stream with an event ring reader, like
+ * typing, and only while recording: the scan path schedules a work item
+ * and nothing else, so recording adds nothing to the latency of the
+ * keys it records. The work item, on the system work queue, resolves
+ * each key through the layers active by then, which the report thread
+ * has already updated for the keys before it, and appends it to the
+ * recording in the encoding of the journal: key << 1 | pressed, a press
+ * followed by its usage, then the pause since the previous key as a
+ * LEB128 varint of milliseconds. Two to three bytes a transition.
+ *
+ * Start and stop are requests to the work item, which owns the reader
+ * and the recording. The stop expands the recording into macro steps,
+ * releases keys still held, and commits it with macro_upload_patch();
+ * the flash write is left to the config store, which writes the whole
+ * macro table once the keys go idle.
+ *
+ * The event timestamps wrap after half a minute at the fastest, so a
+ * pause longer than LONG_MS by the uptime of the batches is taken from
+ * the uptime. Pauses are cut to CONFIG_KEYPAD_MACRO_RECORD_PAUSE_MAX_MS.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/init.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/logging/log.h>
+
+#include "event_ring.h"
+#include "keymap.h"
+#include "layer.h"
+#include "macro.h"
+#include "report.h"
+#include "diag/latency.h"
+#include "input/macro_rec.h"
+
+LOG_MODULE_REGISTER(macro_rec, LOG_LEVEL_INF);
+
+#define PAUSE_MAX_MS CONFIG_KEYPAD_MACRO_RECORD_PAUSE_MAX_MS
+#define LONG_MS (16 * MSEC_PER_SEC)
+/* Longest MACRO_WAIT */
+#define WAIT_MAX_MS UINT8_MAX
+
+enum {
+	/* Recording, the notify schedules the work item */
+	REC_ON,
+	REC_STOP,
+};
+
+static void rec_notify(void);
+
+static struct event_ring_sub sub = {
+	.name = "macro_rec",
+	.notify = rec_notify,
+};
+
+static atomic_t flags;
+/* Macro id + 1 to start recording into, 0 for none */
+static atomic_t start_req;
+
+/* Work item only */
+static uint8_t rec_id;
+static uint8_t rec[CONFIG_KEYPAD_MACRO_RECORD_SIZE];
+static size_t rec_len;
+static uint32_t rec_keys;
+static bool rec_full;
+static bool rec_first;
+static uint32_t last_ts;
+static uint32_t last_ms;
+/* Usages of the keys pressed in the recording and not released */
+static keypad_bitmap_t held;
+static uint8_t held_usage[KEYPAD_MAX_KEYS];
+
+/* The usage key reports on the active layers, 0 if it reports none */
+static uint8_t rec_usage(uint8_t key)
+{
+	uint32_t active = layer_active_get() | BIT(0);
+	uint16_t action = LAYER_TRANSPARENT;
+	uint8_t layer;
+
+	while (active != 0 && action == LAYER_TRANSPARENT) {
+		layer = find_msb_set(active) - 1;
+		action = layer_keymap_get(layer, key);
+		active &= ~BIT(layer);
+	}
+
+	if ((action & LAYER_ACTION_MASK) != LAYER_ACTION_USAGE ||
+	    !report_usage_reportable(action)) {
+		return 0;
+	}
+
+	return action;
+}
+
+static bool rec_put(const uint8_t *bytes, size_t len)
+{
+	if (rec_full || len > sizeof(rec) - rec_len) {
+		rec_full = true;
+		return false;
+	}
+
+	memcpy(&rec[rec_len], bytes, len);
+	rec_len += len;
+
+	return true;
+}
+
+/* One event of the stream */
+static void rec_event(const struct key_event *event, uint32_t now_ms)
+{
+	uint8_t key = event->key;
+	uint8_t bytes[8];
+	size_t len = 0;
+	uint32_t ms;
+	uint8_t usage;
+
+#if defined(CONFIG_KEYPAD_LOOPBACK)
+	if (event->loopback) {
+		/* Injected by a test, not typed */
+		return;
+	}
+#endif
+
+	if (key >= KEYPAD_MAX_KEYS) {
+		return;
+	}
+
+	if (event->pressed) {
+		usage = rec_usage(key);
+		if (usage == 0) {
+			return;
+		}
+	} else if (!(held & BIT(key))) {
+		/* Pressed before the start, or not a usage */
+		return;
+	} else {
+		usage = held_usage[key];
+	}
+
+	if (rec_first) {
+		ms = 0;
+	} else if (now_ms - last_ms >= LONG_MS) {
+		ms = now_ms - last_ms;
+	} else {
+		ms = latency_to_us(event->timestamp - last_ts) /
+		     USEC_PER_MSEC;
+	}
+	ms = MIN(ms, PAUSE_MAX_MS);
+
+	bytes[len++] = key << 1 | event->pressed;
+	if (event->pressed) {
+		bytes[len++] = usage;
+	}
+	do {
+		bytes[len] = ms & 0x7f;
+		ms >>= 7;
+		bytes[len++] |= ms != 0 ? 0x80 : 0;
+	} while (ms != 0);
+
+	if (!rec_put(bytes, len)) {
+		return;
+	}
+
+	rec_first = false;
+	last_ts = event->timestamp;
+	last_ms = now_ms;
+	WRITE_BIT(held, key, event->pressed);
+	held_usage[key] = usage;
+	rec_keys += event->pressed;
+}
+
+static void rec_drain(void)
+{
+	struct key_event events[8];
+	uint32_t now_ms = k_uptime_get_32();
+	size_t count;
+
+	while ((count = event_ring_read(&sub.reader, events,
+					ARRAY_SIZE(events))) > 0) {
+		for (size_t i = 0; i < count; i++) {
+			rec_event(&events[i], now_ms);
+		}
+	}
+}
+
+static void rec_begin(uint8_t id)
+{
+	event_ring_reader_init(&sub.reader);
+	rec_id = id;
+	rec_len = 0;
+	rec_keys = 0;
+	rec_full = false;
+	rec_first = true;
+	held = 0;
+	atomic_set_bit(&flags, REC_ON);
+
+	LOG_INF("recording macro %u", id);
+}
+
+/*
+ * Walk the recording and write its macro steps to out, or only count
+ * them with out NULL. A press and its release with no pause between
+ * them are one tap, the plain usage byte.
+ */
+static size_t rec_expand(uint8_t *out)
+{
+	keypad_bitmap_t down = 0;
+	uint8_t usage[KEYPAD_MAX_KEYS];
+	uint8_t step[2];
+	size_t len = 0;
+	size_t pos = 0;
+	size_t n;
+	uint32_t ms;
+	uint8_t key;
+	bool pressed;
+	bool tap;
+
+	while (pos < rec_len) {
+		key = rec[pos] >> 1;
+		pressed = rec[pos++] & 1;
+		if (pressed) {
+			usage[key] = rec[pos++];
+		}
+
+		ms = 0;
+		for (uint8_t shift = 0; pos < rec_len; shift += 7) {
+			ms |= (rec[pos] & 0x7f) << shift;
+			if (!(rec[pos++] & 0x80)) {
+				break;
+			}
+		}
+
+		/* The next transition releases this press right away */
+		tap = pressed && pos + 1 < rec_len &&
+		      rec[pos] == key << 1 && rec[pos + 1] == 0;
+
+		while (ms > 0) {
+			n = MIN(ms, WAIT_MAX_MS);
+			if (out != NULL) {
+				out[len] = MACRO_WAIT;
+				out[len + 1] = n;
+			}
+			len += 2;
+			ms -= n;
+		}
+
+		if (tap) {
+			step[0] = usage[key];
+			n = 1;
+			pos += 2;
+		} else {
+			step[0] = pressed ? MACRO_DOWN : MACRO_UP;
+			step[1] = usage[key];
+			n = 2;
+			WRITE_BIT(down, key, pressed);
+		}
+
+		if (out != NULL) {
+			memcpy(&out[len], step, n);
+		}
+		len += n;
+	}
+
+	/* Nothing stays held once the macro ends */
+	for (key = 0; key < KEYPAD_MAX_KEYS; key++) {
+		if (down & BIT(key)) {
+			if (out != NULL) {
+				out[len] = MACRO_UP;
+				out[len + 1] = usage[key];
+			}
+			len += 2;
+		}
+	}
+
+	return len;
+}
+
+static void rec_end(void)
+{
+	size_t seq_len;
+	uint8_t *entry;
+	size_t len;
+	int ret;
+
+	atomic_clear_bit(&flags, REC_ON);
+
+	if (rec_full) {
+		LOG_WRN("recording full after %zu bytes", rec_len);
+	}
+
+	seq_len = rec_expand(NULL);
+	if (seq_len > UINT16_MAX) {
+		LOG_ERR("macro %u: %zu bytes, too long", rec_id, seq_len);
+		return;
+	}
+
+	ret = macro_upload_patch(rec_id, 4 + seq_len, &entry, &len);
+	if (ret < 0) {
+		LOG_ERR("macro %u not saved (%d)", rec_id, ret);
+		return;
+	}
+
+	sys_put_le16(seq_len, entry);
+	sys_put_le16(0, entry + 2);
+	(void)rec_expand(entry + 4);
+
+	ret = macro_upload_commit(len);
+	if (ret < 0) {
+		LOG_ERR("macro %u not saved (%d)", rec_id, ret);
+		return;
+	}
+
+	LOG_INF("macro %u: %u keys, %zu bytes", rec_id, rec_keys, seq_len);
+}
+
+static void rec_work_fn(struct k_work *work)
+{
+	atomic_val_t id = atomic_set(&start_req, 0);
+
+	if (id != 0 && !atomic_test_bit(&flags, REC_ON)) {
+		rec_begin(id - 1);
+	}
+
+	if (atomic_test_bit(&flags, REC_ON)) {
+		rec_drain();
+	}
+
+	if (atomic_test_and_clear_bit(&flags, REC_STOP) &&
+	    atomic_test_bit(&flags, REC_ON)) {
+		rec_end();
+	}
+}
+
+static K_WORK_DEFINE(rec_work, rec_work_fn);
+
+/* Key events were put in the event ring */
+static void rec_notify(void)
+{
+	if (atomic_test_bit(&flags, REC_ON)) {
+		(void)k_work_submit(&rec_work);
+	}
+}
+
+int macro_rec_start(uint8_t id)
+{
+	if (id >= MACRO_MAX) {
+		return -EINVAL;
+	}
+
+	if (atomic_test_bit(&flags, REC_ON) ||
+	    !atomic_cas(&start_req, 0, id + 1)) {
+		return -EBUSY;
+	}
+
+	(void)k_work_submit(&rec_work);
+
+	return 0;
+}
+
+int macro_rec_stop(void)
+{
+	if (!atomic_test_bit(&flags, REC_ON) &&
+	    atomic_get(&start_req) == 0) {
+		return -EALREADY;
+	}
+
+	atomic_set_bit(&flags, REC_STOP);
+	(void)k_work_submit(&rec_work);
+
+	return 0;
+}
+
+void macro_rec_toggle(uint8_t id)
+{
+	if (macro_rec_stop() == -EALREADY) {
+		(void)macro_rec_start(id);
+	}
+}
+
+static int macro_rec_init(const struct device *dev)
+{
+	ARG_UNUSED(dev);
+
+	event_ring_subscribe(&sub);
+
+	return 0;
+}
+
+SYS_INIT(macro_rec_init, APPLICATION, 0);
+
+#if defined(CONFIG_SHELL)
+#include <stdlib.h>
+
+#include <zephyr/shell/shell.h>
+
+static int cmd_rec_start(const struct shell *sh, size_t argc, char **argv)
+{
+	unsigned long id = strtoul(argv[1], NULL, 0);
+	int ret;
+
+	ret = macro_rec_start(id < MACRO_MAX ? id : MACRO_MAX);
+	if (ret < 0) {
+		shell_error(sh, "cannot record (%d)", ret);
+		return ret;
+	}
+
+	shell_print(sh, "recording macro %lu", id);
+
+	return 0;
+}
+
+static int cmd_rec_stop(const struct shell *sh, size_t argc, char **argv)
+{
+	int ret = macro_rec_stop();
+
+	if (ret < 0) {
+		shell_error(sh, "not recording");
+		return ret;
+	}
+
+	return 0;
+}
+
+static int cmd_rec_show(const struct shell *sh, size_t argc, char **argv)
+{
+	if (!atomic_test_bit(&flags, REC_ON)) {
+		shell_print(sh, "not recording");
+		return 0;
+	}
+
+	/* Read from the shell thread, a snapshot at best */
+	shell_print(sh, "macro %u: %u keys, %zu of %zu bytes%s", rec_id,
+		    rec_keys, rec_len, sizeof(rec),
+		    rec_full ? ", full" : "");
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_rec,
+	SHELL_CMD_ARG(start, NULL, "Record macro <id>", cmd_rec_start, 2, 0),
+	SHELL_CMD(stop, NULL, "Stop and save the recording", cmd_rec_stop),
+	SHELL_CMD(show, NULL, "Recording state", cmd_rec_show),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(record, &sub_rec, "Macro recorder", NULL);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Macro recorder. Between a start and a stop the keys typed are kept
+ * in RAM with the time between them, and the stop turns them into
+ * macro id: presses and releases of the usages the keys had on the
+ * layers active at the time, the pauses as MACRO_WAIT steps. The macro
+ * goes in with macro_upload_patch() like an upload of that one macro,
+ * and is stored with the rest of the table by the next idle write of
+ * the config store, so a recording costs one flash write whatever its
+ * length. A LAYER_MACRO_RECORD(n) key starts and stops recording into
+ * macro n.
+ *
+ * Only keys that report a keyboard usage are recorded; layer, tap-hold
+ * and other special keys change what the keys after them record but
+ * are not recorded themselves.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_MACRO_RECORD is enabled.
+ */
+
+#ifndef KEYPAD_INPUT_MACRO_REC_H_
+#define KEYPAD_INPUT_MACRO_REC_H_
+
+#include <errno.h>
+
+#include <zephyr/zephyr.h>
+
+#if defined(CONFIG_KEYPAD_MACRO_RECORD)
+
+/* Start recording into macro id, -EBUSY while recording */
+int macro_rec_start(uint8_t id);
+
+/* Stop and commit the recording, -EALREADY if none is running */
+int macro_rec_stop(void);
+
+/* Report thread, a LAYER_MACRO_RECORD(id) press: start or stop */
+void macro_rec_toggle(uint8_t id);
+
+#else
+
+static inline int macro_rec_start(uint8_t id)
+{
+	return -ENOTSUP;
+}
+
+static inline int macro_rec_stop(void)
+{
+	return -ENOTSUP;
+}
+
+static inline void macro_rec_toggle(uint8_t id) {}
+
+#endif /* CONFIG_KEYPAD_MACRO_RECORD */
+
+#endif /* KEYPAD_INPUT_MACRO_REC_H_ */
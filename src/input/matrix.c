@@ -0,0 +1,573 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Every column pin gets a GPIOTE OUT channel. One DPPI channel carries
+ * the TIMER2 COMPARE0 slot start; the "release" task of the column being
+ * read and the "drive" task of the next column are subscribed to it, so
+ * the switch happens on the exact timer tick. The COMPARE1 interrupt,
+ * settle-us into the slot, reads the rows and moves both subscriptions
+ * one column on. The interrupt is the only CPU work per column.
+ *
+ * With CONFIG_KEYPAD_MATRIX_RTC the slots come from RTC0 on the 32 kHz
+ * clock instead, so scanning keeps no high-frequency clock running.
+ * The RTC has no clear-on-compare short, so the row interrupt also
+ * moves COMPARE0 and COMPARE1 one slot on, from the start of the slot
+ * rather than from its own time so the rate does not drift. While no
+ * key is down the scan stops either way: every column is driven and
+ * the rows sense their level, which wakes the CPU on the first press
+ * with no strobe at all. The GPIO peripheral has no task to capture
+ * the rows, so a running scan still reads them in the interrupt.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/gpio.h>
+#include <zephyr/logging/log.h>
+
+#include <nrfx_dppi.h>
+#include <nrfx_gpiote.h>
+#include <helpers/nrfx_gppi.h>
+#include <hal/nrf_gpio.h>
+#if defined(CONFIG_KEYPAD_MATRIX_RTC)
+#include <nrfx_rtc.h>
+#else
+#include <nrfx_timer.h>
+#endif
+
+#include "input/matrix.h"
+#include "irq_plan.h"
+#include "nrf_psel.h"
+
+LOG_MODULE_REGISTER(matrix, LOG_LEVEL_INF);
+
+#define MATRIX_SLOT_US (USEC_PER_SEC / \
+			(CONFIG_KEYPAD_MATRIX_SCAN_HZ * MATRIX_COLS))
+#define MATRIX_SETTLE_US DT_PROP(MATRIX_NODE, settle_us)
+/* Row and column pins may be spread over P0 and P1 */
+#define MATRIX_MAX_PORTS 2
+
+BUILD_ASSERT(MATRIX_ROWS * MATRIX_COLS <= KEYPAD_MAX_KEYS,
+	     "matrix has more keys than KEYPAD_MAX_KEYS");
+BUILD_ASSERT(DT_PROP_LEN(MATRIX_NODE, keycodes) == MATRIX_ROWS * MATRIX_COLS,
+	     "one keycode per matrix position is required");
+BUILD_ASSERT(MATRIX_COLS >= 2, "column strobing needs two columns or more");
+BUILD_ASSERT(MATRIX_SETTLE_US < MATRIX_SLOT_US,
+	     "settle-us does not fit the column slot, lower the scan rate");
+
+#if defined(CONFIG_KEYPAD_MATRIX_RTC)
+#define MATRIX_RTC_NODE DT_NODELABEL(rtc0)
+#define MATRIX_RTC_HZ 32768
+#define MATRIX_SLOT_TICKS \
+	(MATRIX_RTC_HZ / (CONFIG_KEYPAD_MATRIX_SCAN_HZ * MATRIX_COLS))
+/* The rows settle within the first tick of a slot or two */
+#define MATRIX_SETTLE_TICKS \
+	MAX(DIV_ROUND_UP(MATRIX_SETTLE_US * MATRIX_RTC_HZ, USEC_PER_SEC), 1)
+/* A compare value this close to the counter may not fire */
+#define MATRIX_RTC_MIN_TICKS 2
+
+BUILD_ASSERT(MATRIX_SETTLE_TICKS + MATRIX_RTC_MIN_TICKS < MATRIX_SLOT_TICKS,
+	     "column slot too short for the RTC, lower the scan rate");
+#else
+#define MATRIX_TIMER_NODE DT_NODELABEL(timer2)
+#endif
+
+#define MATRIX_SPEC(node_id, prop, idx) GPIO_DT_SPEC_GET_BY_IDX(node_id, prop, idx),
+
+static const struct gpio_dt_spec rows[] = {
+	DT_FOREACH_PROP_ELEM(MATRIX_NODE, row_gpios, MATRIX_SPEC)
+};
+
+static const struct gpio_dt_spec cols[] = {
+	DT_FOREACH_PROP_ELEM(MATRIX_NODE, col_gpios, MATRIX_SPEC)
+};
+
+#if defined(CONFIG_KEYPAD_MATRIX_RTC)
+static const nrfx_rtc_t matrix_rtc = NRFX_RTC_INSTANCE(0);
+/* RTC counter at the start of the slot being read */
+static uint32_t slot_start;
+#else
+static const nrfx_timer_t matrix_timer = NRFX_TIMER_INSTANCE(2);
+#endif
+static uint8_t slot_channel;
+
+/* GPIOTE task addresses that drive and release every column */
+static uint32_t drive_task[MATRIX_COLS];
+static uint32_t release_task[MATRIX_COLS];
+
+/* Row ports, read once per column */
+static const struct device *row_port[MATRIX_MAX_PORTS];
+static uint8_t row_port_count;
+static uint8_t row_port_of[MATRIX_ROWS];
+
+static uint8_t col;
+static keypad_bitmap_t state;
+static matrix_scan_t scan_handler;
+static uint32_t scan_count;
+
+/* Level interrupts on the rows while idle, one callback per row port */
+static struct gpio_callback row_callback[MATRIX_MAX_PORTS];
+static matrix_wake_t wake_handler;
+
+#if defined(CONFIG_KEYPAD_MATRIX_ANTI_GHOST)
+/* State handed out by the previous scan */
+static keypad_bitmap_t reported;
+static uint32_t ghost_count;
+
+static inline uint32_t matrix_row_get(keypad_bitmap_t scan, uint8_t r)
+{
+	return (scan >> (r * MATRIX_COLS)) & BIT_MASK(MATRIX_COLS);
+}
+
+/*
+ * Without diodes, three keys on the corners of a rectangle also close
+ * the fourth, so any two rows sharing two or more active columns are
+ * ambiguous. Keys on those crossings keep their previous state: held
+ * keys stay down, nothing new is pressed until the pattern resolves.
+ * One AND per row pair, the pair loop has constant bounds.
+ */
+static keypad_bitmap_t matrix_ghost_filter(keypad_bitmap_t scan)
+{
+	keypad_bitmap_t ambiguous = 0;
+
+	for (uint8_t a = 0; a < MATRIX_ROWS - 1; a++) {
+		uint32_t row_a = matrix_row_get(scan, a);
+
+		for (uint8_t b = a + 1; b < MATRIX_ROWS; b++) {
+			uint32_t common = row_a & matrix_row_get(scan, b);
+
+			/* More than one bit set */
+			if ((common & (common - 1)) != 0) {
+				ambiguous |= ((keypad_bitmap_t)common << (a * MATRIX_COLS)) |
+					     ((keypad_bitmap_t)common << (b * MATRIX_COLS));
+			}
+		}
+	}
+
+	if (ambiguous != 0) {
+		ghost_count++;
+		scan = (scan & ~ambiguous) | (reported & ambiguous);
+	}
+
+	reported = scan;
+
+	return scan;
+}
+
+uint32_t matrix_ghost_count(void)
+{
+	return ghost_count;
+}
+#else
+static inline keypad_bitmap_t matrix_ghost_filter(keypad_bitmap_t scan)
+{
+	return scan;
+}
+#endif /* CONFIG_KEYPAD_MATRIX_ANTI_GHOST */
+
+static uint32_t matrix_rows_read(void)
+{
+	gpio_port_value_t value[MATRIX_MAX_PORTS];
+	uint32_t active = 0;
+
+	for (uint8_t p = 0; p < row_port_count; p++) {
+		gpio_port_get_raw(row_port[p], &value[p]);
+	}
+
+	for (uint8_t r = 0; r < MATRIX_ROWS; r++) {
+		bool level = value[row_port_of[r]] & BIT(rows[r].pin);
+
+		if (level != ((rows[r].dt_flags & GPIO_ACTIVE_LOW) != 0)) {
+			active |= BIT(r);
+		}
+	}
+
+	return active;
+}
+
+/* Settle time into the slot of col */
+static void matrix_slot_read(void)
+{
+	uint32_t active;
+	uint8_t next;
+
+	active = matrix_rows_read();
+
+	for (uint8_t r = 0; r < MATRIX_ROWS; r++) {
+		WRITE_BIT(state, r * MATRIX_COLS + col, active & BIT(r));
+	}
+
+	/* Next slot start releases this column and drives the next one */
+	next = (col + 1) % MATRIX_COLS;
+	nrfx_gppi_task_endpoint_clear(slot_channel,
+				      release_task[(col + MATRIX_COLS - 1) %
+						   MATRIX_COLS]);
+	nrfx_gppi_task_endpoint_clear(slot_channel, drive_task[col]);
+	nrfx_gppi_task_endpoint_setup(slot_channel, release_task[col]);
+	nrfx_gppi_task_endpoint_setup(slot_channel, drive_task[next]);
+	col = next;
+
+	if (col == 0) {
+		scan_count++;
+		scan_handler(matrix_ghost_filter(state));
+	}
+}
+
+#if defined(CONFIG_KEYPAD_MATRIX_RTC)
+static void matrix_rtc_handler(nrfx_rtc_int_type_t int_type)
+{
+	uint32_t max = NRF_RTC_COUNTER_MAX;
+	uint32_t now;
+	uint32_t ahead;
+
+	if (int_type != NRFX_RTC_INT_COMPARE1 || wake_handler != NULL) {
+		/* A compare still pending when the scan went idle */
+		return;
+	}
+
+	matrix_slot_read();
+
+	/*
+	 * COMPARE0 of this slot has fired, both move to the next one. If
+	 * this interrupt ran so late that the next start has passed, the
+	 * column is still driven and the slot starts as soon as it can.
+	 */
+	slot_start += MATRIX_SLOT_TICKS;
+	now = nrfx_rtc_counter_get(&matrix_rtc);
+	ahead = (slot_start - now) & max;
+	if (ahead < MATRIX_RTC_MIN_TICKS || ahead > MATRIX_SLOT_TICKS) {
+		slot_start = now + MATRIX_RTC_MIN_TICKS;
+	}
+
+	(void)nrfx_rtc_cc_set(&matrix_rtc, 0, slot_start & max, false);
+	(void)nrfx_rtc_cc_set(&matrix_rtc, 1,
+			      (slot_start + MATRIX_SETTLE_TICKS) & max, true);
+}
+
+static int matrix_clock_init(void)
+{
+	nrfx_rtc_config_t config = NRFX_RTC_DEFAULT_CONFIG;
+	nrfx_err_t err;
+
+	config.prescaler = 0;
+	config.interrupt_priority = IRQ_PLAN_INPUT;
+
+	err = nrfx_rtc_init(&matrix_rtc, &config, matrix_rtc_handler);
+	if (err != NRFX_SUCCESS) {
+		LOG_ERR("Failed to init matrix RTC, error: 0x%08x", err);
+		return -EIO;
+	}
+
+	IRQ_CONNECT(DT_IRQN(MATRIX_RTC_NODE), IRQ_PLAN_INPUT,
+		    nrfx_rtc_0_irq_handler, NULL, 0);
+
+	return 0;
+}
+
+static uint32_t matrix_clock_slot_event(void)
+{
+	return nrfx_rtc_event_address_get(&matrix_rtc,
+					  NRF_RTC_EVENT_COMPARE_0);
+}
+
+/* Column 0 is driven, the first slot reads it from counter 0 */
+static void matrix_clock_start(void)
+{
+	nrfx_rtc_counter_clear(&matrix_rtc);
+	slot_start = 0;
+	(void)nrfx_rtc_cc_set(&matrix_rtc, 0, MATRIX_SLOT_TICKS, false);
+	(void)nrfx_rtc_cc_set(&matrix_rtc, 1,
+			      MATRIX_SETTLE_TICKS + MATRIX_RTC_MIN_TICKS, true);
+	nrfx_rtc_enable(&matrix_rtc);
+}
+
+static void matrix_clock_stop(void)
+{
+	nrfx_rtc_disable(&matrix_rtc);
+}
+#else
+static void matrix_timer_handler(nrf_timer_event_t event, void *context)
+{
+	if (event != NRF_TIMER_EVENT_COMPARE1 || wake_handler != NULL) {
+		/* A compare still pending when the scan went idle */
+		return;
+	}
+
+	matrix_slot_read();
+}
+
+static int matrix_clock_init(void)
+{
+	nrfx_timer_config_t config = NRFX_TIMER_DEFAULT_CONFIG;
+	nrfx_err_t err;
+
+	config.frequency = NRF_TIMER_FREQ_1MHz;
+	config.bit_width = NRF_TIMER_BIT_WIDTH_32;
+	config.interrupt_priority = IRQ_PLAN_INPUT;
+
+	err = nrfx_timer_init(&matrix_timer, &config, matrix_timer_handler);
+	if (err != NRFX_SUCCESS) {
+		LOG_ERR("Failed to init matrix timer, error: 0x%08x", err);
+		return -EIO;
+	}
+
+	IRQ_CONNECT(DT_IRQN(MATRIX_TIMER_NODE), IRQ_PLAN_INPUT,
+		    nrfx_timer_2_irq_handler, NULL, 0);
+
+	/* COMPARE0 starts the next slot, COMPARE1 reads the rows */
+	nrfx_timer_extended_compare(&matrix_timer, NRF_TIMER_CC_CHANNEL0,
+				    nrfx_timer_us_to_ticks(&matrix_timer,
+							   MATRIX_SLOT_US),
+				    NRF_TIMER_SHORT_COMPARE0_CLEAR_MASK, false);
+	nrfx_timer_compare(&matrix_timer, NRF_TIMER_CC_CHANNEL1,
+			   nrfx_timer_us_to_ticks(&matrix_timer,
+						  MATRIX_SETTLE_US),
+			   true);
+
+	return 0;
+}
+
+static uint32_t matrix_clock_slot_event(void)
+{
+	return nrfx_timer_compare_event_address_get(&matrix_timer,
+						    NRF_TIMER_CC_CHANNEL0);
+}
+
+static void matrix_clock_start(void)
+{
+	nrfx_timer_clear(&matrix_timer);
+	nrfx_timer_enable(&matrix_timer);
+}
+
+static void matrix_clock_stop(void)
+{
+	nrfx_timer_disable(&matrix_timer);
+}
+#endif /* CONFIG_KEYPAD_MATRIX_RTC */
+
+static void matrix_col_set(uint8_t c, bool drive)
+{
+	nrfx_gpiote_pin_t pin = nrf_psel_get(&cols[c]);
+
+	if (drive != ((cols[c].dt_flags & GPIO_ACTIVE_LOW) != 0)) {
+		nrfx_gpiote_set_task_trigger(pin);
+	} else {
+		nrfx_gpiote_clr_task_trigger(pin);
+	}
+}
+
+static void matrix_rows_sense(bool enable)
+{
+	for (uint8_t r = 0; r < MATRIX_ROWS; r++) {
+		/* Level interrupts use PIN_CNF.SENSE, not GPIOTE */
+		gpio_pin_interrupt_configure_dt(&rows[r], enable ?
+						GPIO_INT_LEVEL_ACTIVE :
+						GPIO_INT_DISABLE);
+	}
+}
+
+static void matrix_row_isr(const struct device *gpio, struct gpio_callback *cb,
+			   uint32_t pins)
+{
+	if (wake_handler == NULL) {
+		return;
+	}
+
+	/* The level stays active while the key is held */
+	matrix_rows_sense(false);
+	wake_handler();
+}
+
+static int matrix_row_configure(uint8_t r)
+{
+	int ret;
+
+	if (!device_is_ready(rows[r].port)) {
+		LOG_ERR("GPIO port %s is not ready", rows[r].port->name);
+		return -ENODEV;
+	}
+
+	ret = gpio_pin_configure_dt(&rows[r], GPIO_INPUT);
+	if (ret < 0) {
+		LOG_ERR("Failed to configure row %u, error: %d", r, ret);
+		return ret;
+	}
+
+	for (uint8_t p = 0; p < row_port_count; p++) {
+		if (row_port[p] == rows[r].port) {
+			row_port_of[r] = p;
+			return 0;
+		}
+	}
+
+	row_port[row_port_count] = rows[r].port;
+	row_port_of[r] = row_port_count++;
+
+	return 0;
+}
+
+static int matrix_row_callbacks_add(void)
+{
+	int ret;
+
+	for (uint8_t p = 0; p < row_port_count; p++) {
+		gpio_port_pins_t mask = 0;
+
+		for (uint8_t r = 0; r < MATRIX_ROWS; r++) {
+			if (row_port_of[r] == p) {
+				mask |= BIT(rows[r].pin);
+			}
+		}
+
+		gpio_init_callback(&row_callback[p], matrix_row_isr, mask);
+		ret = gpio_add_callback(row_port[p], &row_callback[p]);
+		if (ret < 0) {
+			LOG_ERR("Failed to add the row callback, error: %d", ret);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static int matrix_col_configure(uint8_t c)
+{
+	nrfx_gpiote_pin_t pin = nrf_psel_get(&cols[c]);
+	bool active_low = cols[c].dt_flags & GPIO_ACTIVE_LOW;
+	nrfx_gpiote_output_config_t output = NRFX_GPIOTE_DEFAULT_OUTPUT_CONFIG;
+	nrfx_gpiote_task_config_t task = {
+		.polarity = NRF_GPIOTE_POLARITY_TOGGLE,
+	};
+	nrfx_err_t err;
+
+	err = nrfx_gpiote_channel_alloc(&task.task_ch);
+	if (err != NRFX_SUCCESS) {
+		LOG_ERR("No GPIOTE channel left for column %u", c);
+		return -ENOMEM;
+	}
+
+	/* Column 0 starts driven, the first slot reads it */
+	task.init_val = ((c == 0) != active_low) ?
+			NRF_GPIOTE_INITIAL_VALUE_HIGH :
+			NRF_GPIOTE_INITIAL_VALUE_LOW;
+
+	err = nrfx_gpiote_output_configure(pin, &output, &task);
+	if (err != NRFX_SUCCESS) {
+		LOG_ERR("Failed to configure column %u, error: 0x%08x", c, err);
+		return -EIO;
+	}
+
+	nrfx_gpiote_out_task_enable(pin);
+
+	if (active_low) {
+		drive_task[c] = nrfx_gpiote_clr_task_address_get(pin);
+		release_task[c] = nrfx_gpiote_set_task_address_get(pin);
+	} else {
+		drive_task[c] = nrfx_gpiote_set_task_address_get(pin);
+		release_task[c] = nrfx_gpiote_clr_task_address_get(pin);
+	}
+
+	return 0;
+}
+
+int matrix_init(matrix_scan_t scan_done)
+{
+	nrfx_err_t err;
+	int ret;
+
+	scan_handler = scan_done;
+
+	for (uint8_t r = 0; r < MATRIX_ROWS; r++) {
+		ret = matrix_row_configure(r);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+
+	for (uint8_t c = 0; c < MATRIX_COLS; c++) {
+		ret = matrix_col_configure(c);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+
+	ret = matrix_row_callbacks_add();
+	if (ret < 0) {
+		return ret;
+	}
+
+	ret = matrix_clock_init();
+	if (ret < 0) {
+		return ret;
+	}
+
+	err = nrfx_dppi_channel_alloc(&slot_channel);
+	if (err != NRFX_SUCCESS) {
+		LOG_ERR("Failed to allocate DPPI channel, error: 0x%08x", err);
+		return -ENOMEM;
+	}
+
+	nrfx_gppi_event_endpoint_setup(slot_channel, matrix_clock_slot_event());
+	nrfx_gppi_channels_enable(BIT(slot_channel));
+
+	matrix_clock_start();
+
+	return 0;
+}
+
+void matrix_idle_enter(matrix_wake_t wake)
+{
+	matrix_clock_stop();
+
+	/* Whatever the interrupted scan had subscribed */
+	nrfx_gppi_task_endpoint_clear(slot_channel,
+				      release_task[(col + MATRIX_COLS - 1) %
+						   MATRIX_COLS]);
+	nrfx_gppi_task_endpoint_clear(slot_channel, drive_task[col]);
+
+	/* Any key now pulls its row, whatever its column */
+	for (uint8_t c = 0; c < MATRIX_COLS; c++) {
+		matrix_col_set(c, true);
+	}
+
+	wake_handler = wake;
+	matrix_rows_sense(true);
+}
+
+static void matrix_off_wake(void)
+{
+	/* The press resets the chip, there is nothing to wake */
+}
+
+void matrix_off_enter(void)
+{
+	matrix_idle_enter(matrix_off_wake);
+
+	for (uint8_t c = 0; c < MATRIX_COLS; c++) {
+		nrfx_gpiote_pin_t pin = nrf_psel_get(&cols[c]);
+
+		nrf_gpio_pin_write(pin, !(cols[c].dt_flags & GPIO_ACTIVE_LOW));
+		nrfx_gpiote_out_task_disable(pin);
+	}
+}
+
+void matrix_idle_exit(void)
+{
+	wake_handler = NULL;
+	matrix_rows_sense(false);
+
+	/* Same line state as after matrix_init(), column 0 driven */
+	for (uint8_t c = 0; c < MATRIX_COLS; c++) {
+		matrix_col_set(c, c == 0);
+	}
+
+	col = 0;
+	state = 0;
+	matrix_clock_start();
+}
+
+uint32_t matrix_scan_count(void)
+{
+	return scan_count;
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Row/column matrix scanner. TIMER2 slices every scan into one slot per
+ * column. The slot start event drives the next column through DPPI and
+ * GPIOTE with no CPU involvement; settle-us later a single interrupt
+ * reads all rows of that column with one read per row port.
+ */
+
+#ifndef KEYPAD_INPUT_MATRIX_H_
+#define KEYPAD_INPUT_MATRIX_H_
+
+#include <zephyr/devicetree.h>
+
+#include "keymap.h"
+
+#define MATRIX_NODE DT_INST(0, richeffects_keypad_matrix)
+#define MATRIX_ROWS DT_PROP_LEN(MATRIX_NODE, row_gpios)
+#define MATRIX_COLS DT_PROP_LEN(MATRIX_NODE, col_gpios)
+
+/* Called from the TIMER interrupt after every complete scan */
+typedef void (*matrix_scan_t)(keypad_bitmap_t state);
+
+/* Called from the GPIO interrupt when a key is pressed while idle */
+typedef void (*matrix_wake_t)(void);
+
+int matrix_init(matrix_scan_t scan_done);
+
+/*
+ * Stop scanning, drive every column and wait for any row to become
+ * active. wake is called once, the scanner stays stopped until
+ * matrix_idle_exit().
+ */
+void matrix_idle_enter(matrix_wake_t wake);
+
+/* Restart scanning from column 0 */
+void matrix_idle_exit(void);
+
+/*
+ * Like matrix_idle_enter() with nothing to wake, for System OFF: the
+ * columns are handed from GPIOTE to their OUT register, which keeps
+ * driving them once GPIOTE is off.
+ */
+void matrix_off_enter(void);
+
+/* Completed scans since boot */
+uint32_t matrix_scan_count(void);
+
+/* Scans with an ambiguous pattern masked, CONFIG_KEYPAD_MATRIX_ANTI_GHOST */
+uint32_t matrix_ghost_count(void);
+
+#endif /* KEYPAD_INPUT_MATRIX_H_ */
@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * State changes come from three interrupts: the backend's scan
+ * completion, the matrix row wake and the release timeout. All of them
+ * take the same spinlock, the backend is switched with it held.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/logging/log.h>
+
+#include "input/matrix.h"
+#include "input/scan_rate.h"
+#include "input/shiftreg.h"
+
+LOG_MODULE_REGISTER(scan_rate, LOG_LEVEL_INF);
+
+static struct k_spinlock lock;
+static enum scan_rate_state state = SCAN_RATE_RELEASE;
+static int64_t state_since;
+/* A key was seen since the last wake */
+static bool woken_by_key;
+static struct scan_rate_stats stats;
+
+static struct k_timer release_timer;
+
+static void scan_rate_wake(void);
+
+static void backend_idle(bool idle)
+{
+#if defined(CONFIG_KEYPAD_SCAN_MATRIX)
+	if (idle) {
+		matrix_idle_enter(scan_rate_wake);
+	} else {
+		matrix_idle_exit();
+	}
+#elif defined(CONFIG_KEYPAD_SCAN_SHIFTREG)
+	shiftreg_rate_set(idle ? CONFIG_KEYPAD_SHIFTREG_IDLE_HZ :
+				 CONFIG_KEYPAD_SHIFTREG_SCAN_HZ);
+#endif
+}
+
+/* Called with lock held */
+static void state_set(enum scan_rate_state next)
+{
+	int64_t now = k_uptime_get();
+
+	stats.state_ms[state] += now - state_since;
+	state_since = now;
+
+	if (next == state) {
+		return;
+	}
+
+	if (state == SCAN_RATE_IDLE) {
+		backend_idle(false);
+		woken_by_key = false;
+	}
+
+	if (next == SCAN_RATE_IDLE) {
+		if (!woken_by_key) {
+			stats.spurious_wakeups++;
+		}
+		backend_idle(true);
+	}
+
+	if (next == SCAN_RATE_RELEASE) {
+		k_timer_start(&release_timer,
+			      K_MSEC(CONFIG_KEYPAD_SCAN_RELEASE_TIMEOUT_MS),
+			      K_NO_WAIT);
+	} else {
+		k_timer_stop(&release_timer);
+	}
+
+	state = next;
+	stats.entries[next]++;
+}
+
+static void release_expired(struct k_timer *timer)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	if (state == SCAN_RATE_RELEASE) {
+		state_set(SCAN_RATE_IDLE);
+	}
+
+	k_spin_unlock(&lock, key);
+}
+
+static void scan_rate_wake(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	/* The first full rate scan decides whether a key really is down */
+	if (state == SCAN_RATE_IDLE) {
+		state_set(SCAN_RATE_RELEASE);
+	}
+
+	k_spin_unlock(&lock, key);
+}
+
+void scan_rate_update(keypad_bitmap_t keys)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	stats.scans[state]++;
+
+	if (keys != 0) {
+		woken_by_key = true;
+		state_set(SCAN_RATE_ACTIVE);
+	} else if (state == SCAN_RATE_ACTIVE) {
+		state_set(SCAN_RATE_RELEASE);
+	}
+
+	k_spin_unlock(&lock, key);
+}
+
+enum scan_rate_state scan_rate_state_get(void)
+{
+	return state;
+}
+
+void scan_rate_stats_get(struct scan_rate_stats *out)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	/* Bring the current state up to date */
+	state_set(state);
+	*out = stats;
+	k_spin_unlock(&lock, key);
+}
+
+void scan_rate_stats_reset(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	memset(&stats, 0, sizeof(stats));
+	state_since = k_uptime_get();
+	k_spin_unlock(&lock, key);
+}
+
+void scan_rate_init(void)
+{
+	k_spinlock_key_t key;
+
+	k_timer_init(&release_timer, release_expired, NULL);
+
+	key = k_spin_lock(&lock);
+
+	/* Boot counts as a wake, keys held at power up are scanned out */
+	state_since = k_uptime_get();
+	woken_by_key = true;
+	k_timer_start(&release_timer,
+		      K_MSEC(CONFIG_KEYPAD_SCAN_RELEASE_TIMEOUT_MS), K_NO_WAIT);
+	k_spin_unlock(&lock, key);
+}
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static const char *const state_names[] = {
+	[SCAN_RATE_IDLE] = "idle",
+	[SCAN_RATE_ACTIVE] = "active",
+	[SCAN_RATE_RELEASE] = "release",
+};
+
+static int cmd_scan_show(const struct shell *sh, size_t argc, char **argv)
+{
+	struct scan_rate_stats s;
+
+	scan_rate_stats_get(&s);
+
+	shell_print(sh, "state: %s, spurious wakeups: %u", state_names[state],
+		    s.spurious_wakeups);
+
+	for (int i = 0; i < SCAN_RATE_STATE_COUNT; i++) {
+		/* Effective scan rate over the whole residency */
+		uint32_t hz = s.state_ms[i] ?
+			      (uint32_t)(s.scans[i] * 1000ULL / s.state_ms[i]) :
+			      0;
+
+		shell_print(sh, "  %-7s %u entries, %llu ms, %u scans, %u Hz",
+			    state_names[i], s.entries[i], s.state_ms[i],
+			    s.scans[i], hz);
+	}
+
+	return 0;
+}
+
+static int cmd_scan_reset(const struct shell *sh, size_t argc, char **argv)
+{
+	scan_rate_stats_reset();
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_scan,
+	SHELL_CMD(show, NULL, "Print scan rate counters", cmd_scan_show),
+	SHELL_CMD(reset, NULL, "Clear scan rate counters", cmd_scan_reset),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(scan, &sub_scan, "Keypad scan rate scheduler", NULL);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Scan rate scheduler for the matrix and shift register backends.
+ * An idle keypad is not scanned: the matrix parks with all columns
+ * driven and waits for a row interrupt, the shift register chain drops
+ * to CONFIG_KEYPAD_SHIFTREG_IDLE_HZ. Any key down switches to the full
+ * rate, which is kept until all keys have been up for
+ * CONFIG_KEYPAD_SCAN_RELEASE_TIMEOUT_MS.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_SCAN_ADAPTIVE is enabled.
+ */
+
+#ifndef KEYPAD_INPUT_SCAN_RATE_H_
+#define KEYPAD_INPUT_SCAN_RATE_H_
+
+#include <zephyr/zephyr.h>
+
+#include "keymap.h"
+
+enum scan_rate_state {
+	/* Waiting for a wake interrupt or scanning at the idle rate */
+	SCAN_RATE_IDLE,
+	/* At least one key down, full rate */
+	SCAN_RATE_ACTIVE,
+	/* All keys up, full rate until the release timeout */
+	SCAN_RATE_RELEASE,
+	SCAN_RATE_STATE_COUNT,
+};
+
+struct scan_rate_stats {
+	/* Completed scans in each state */
+	uint32_t scans[SCAN_RATE_STATE_COUNT];
+	/* Time spent in each state, ms */
+	uint64_t state_ms[SCAN_RATE_STATE_COUNT];
+	/* Number of times each state was entered */
+	uint32_t entries[SCAN_RATE_STATE_COUNT];
+	/* Wakeups that timed out again without any key seen */
+	uint32_t spurious_wakeups;
+};
+
+#if defined(CONFIG_KEYPAD_SCAN_ADAPTIVE)
+
+/* Start in SCAN_RATE_RELEASE, call once the backend is running */
+void scan_rate_init(void);
+
+/* Every completed scan, from the backend interrupt */
+void scan_rate_update(keypad_bitmap_t state);
+
+enum scan_rate_state scan_rate_state_get(void);
+
+void scan_rate_stats_get(struct scan_rate_stats *out);
+void scan_rate_stats_reset(void);
+
+#else
+
+static inline void scan_rate_init(void) {}
+
+static inline void scan_rate_update(keypad_bitmap_t state) {}
+
+static inline enum scan_rate_state scan_rate_state_get(void)
+{
+	return SCAN_RATE_ACTIVE;
+}
+
+#endif /* CONFIG_KEYPAD_SCAN_ADAPTIVE */
+
+#endif /* KEYPAD_INPUT_SCAN_RATE_H_ */
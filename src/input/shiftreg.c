@@ -0,0 +1,233 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * TIMER2 COMPARE0 ends every scan period and clears the timer; over
+ * DPPI it pulls PL low, latching all inputs. COMPARE1, 1 us into the
+ * next period, releases PL and starts the SPIM transfer prepared with
+ * NRFX_SPIM_FLAG_HOLD_XFER | NRFX_SPIM_FLAG_REPEATED_XFER, so the same
+ * transfer runs again on every start task.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/gpio.h>
+#include <zephyr/logging/log.h>
+
+#include <nrfx_dppi.h>
+#include <nrfx_gpiote.h>
+#include <nrfx_spim.h>
+#include <nrfx_timer.h>
+#include <helpers/nrfx_gppi.h>
+
+#include "input/shiftreg.h"
+#include "irq_plan.h"
+#include "nrf_psel.h"
+
+LOG_MODULE_REGISTER(shiftreg, LOG_LEVEL_INF);
+
+#define SHIFTREG_TIMER_NODE DT_NODELABEL(timer2)
+#define SHIFTREG_SPIM_NODE DT_NODELABEL(spi3)
+#define SHIFTREG_PERIOD_US (USEC_PER_SEC / CONFIG_KEYPAD_SHIFTREG_SCAN_HZ)
+/* PL low time, far above the 74HC165 minimum pulse width */
+#define SHIFTREG_LOAD_US 1
+
+BUILD_ASSERT(SHIFTREG_KEYS <= KEYPAD_MAX_KEYS,
+	     "shift register chain has more keys than KEYPAD_MAX_KEYS");
+
+static const struct gpio_dt_spec sck =
+	GPIO_DT_SPEC_GET(SHIFTREG_NODE, sck_gpios);
+static const struct gpio_dt_spec miso =
+	GPIO_DT_SPEC_GET(SHIFTREG_NODE, miso_gpios);
+static const struct gpio_dt_spec load =
+	GPIO_DT_SPEC_GET(SHIFTREG_NODE, load_gpios);
+
+static const nrfx_timer_t shiftreg_timer = NRFX_TIMER_INSTANCE(2);
+static const nrfx_spim_t spim = NRFX_SPIM_INSTANCE(3);
+
+/* EasyDMA target, rewritten by every transfer */
+static uint8_t rx_buf[SHIFTREG_BYTES];
+
+static uint8_t load_channel;
+static uint8_t shift_channel;
+static shiftreg_scan_t scan_handler;
+static uint32_t scan_count;
+/* Period to switch to at the end of the next transfer, 0 for none */
+static atomic_t next_period_us;
+
+static void shiftreg_timer_handler(nrf_timer_event_t event, void *context)
+{
+	/* nrfx requires a handler even with no compare interrupt enabled */
+}
+
+static void shiftreg_spim_handler(nrfx_spim_evt_t const *event,
+				  void *context)
+{
+	keypad_bitmap_t state = 0;
+	uint32_t period_us;
+
+	if (event->type != NRFX_SPIM_EVENT_DONE) {
+		return;
+	}
+
+	/* MSB first: bit 7 of the first byte is key 0 */
+	for (uint8_t i = 0; i < SHIFTREG_BYTES; i++) {
+		state |= (keypad_bitmap_t)__RBIT(rx_buf[i] << 24) << (8 * i);
+	}
+
+	if (DT_PROP(SHIFTREG_NODE, active_low)) {
+		state = ~state;
+	}
+
+	scan_count++;
+	scan_handler(state & BIT_MASK(SHIFTREG_KEYS));
+
+	period_us = atomic_clear(&next_period_us);
+	if (period_us != 0) {
+		/* The counter is just past the transfer, below any period */
+		nrfx_timer_extended_compare(&shiftreg_timer,
+			NRF_TIMER_CC_CHANNEL0,
+			nrfx_timer_us_to_ticks(&shiftreg_timer, period_us),
+			NRF_TIMER_SHORT_COMPARE0_CLEAR_MASK, false);
+	}
+}
+
+static int shiftreg_load_configure(uint32_t *load_task, uint32_t *done_task)
+{
+	nrfx_gpiote_pin_t pin = nrf_psel_get(&load);
+	nrfx_gpiote_output_config_t output = NRFX_GPIOTE_DEFAULT_OUTPUT_CONFIG;
+	nrfx_gpiote_task_config_t task = {
+		.polarity = NRF_GPIOTE_POLARITY_TOGGLE,
+		/* PL idles high, shifting enabled */
+		.init_val = NRF_GPIOTE_INITIAL_VALUE_HIGH,
+	};
+	nrfx_err_t err;
+
+	err = nrfx_gpiote_channel_alloc(&task.task_ch);
+	if (err != NRFX_SUCCESS) {
+		LOG_ERR("No GPIOTE channel left for the load line");
+		return -ENOMEM;
+	}
+
+	err = nrfx_gpiote_output_configure(pin, &output, &task);
+	if (err != NRFX_SUCCESS) {
+		LOG_ERR("Failed to configure the load line, error: 0x%08x",
+			err);
+		return -EIO;
+	}
+
+	nrfx_gpiote_out_task_enable(pin);
+	*load_task = nrfx_gpiote_clr_task_address_get(pin);
+	*done_task = nrfx_gpiote_set_task_address_get(pin);
+
+	return 0;
+}
+
+static int shiftreg_spim_configure(void)
+{
+	nrfx_spim_config_t config = NRFX_SPIM_DEFAULT_CONFIG(
+		nrf_psel_get(&sck), NRFX_SPIM_PIN_NOT_USED,
+		nrf_psel_get(&miso), NRFX_SPIM_PIN_NOT_USED);
+	nrfx_spim_xfer_desc_t xfer = NRFX_SPIM_XFER_RX(rx_buf, sizeof(rx_buf));
+	nrfx_err_t err;
+
+	/* Q7 is valid after PL and shifts on the rising CP edge */
+	config.mode = NRF_SPIM_MODE_0;
+	config.bit_order = NRF_SPIM_BIT_ORDER_MSB_FIRST;
+	config.frequency = NRF_SPIM_FREQ_1M;
+	config.irq_priority = IRQ_PLAN_INPUT;
+
+	err = nrfx_spim_init(&spim, &config, shiftreg_spim_handler, NULL);
+	if (err != NRFX_SUCCESS) {
+		LOG_ERR("Failed to init SPIM, error: 0x%08x", err);
+		return -EIO;
+	}
+
+	IRQ_CONNECT(DT_IRQN(SHIFTREG_SPIM_NODE), IRQ_PLAN_INPUT,
+		    nrfx_spim_3_irq_handler, NULL, 0);
+
+	/* Armed only, every START task from DPPI repeats it */
+	err = nrfx_spim_xfer(&spim, &xfer, NRFX_SPIM_FLAG_HOLD_XFER |
+					   NRFX_SPIM_FLAG_REPEATED_XFER);
+	if (err != NRFX_SUCCESS) {
+		LOG_ERR("Failed to arm SPIM transfer, error: 0x%08x", err);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+int shiftreg_init(shiftreg_scan_t scan_done)
+{
+	nrfx_timer_config_t config = NRFX_TIMER_DEFAULT_CONFIG;
+	uint32_t load_task;
+	uint32_t done_task;
+	nrfx_err_t err;
+	int ret;
+
+	scan_handler = scan_done;
+
+	ret = shiftreg_load_configure(&load_task, &done_task);
+	if (ret < 0) {
+		return ret;
+	}
+
+	ret = shiftreg_spim_configure();
+	if (ret < 0) {
+		return ret;
+	}
+
+	config.frequency = NRF_TIMER_FREQ_1MHz;
+	config.bit_width = NRF_TIMER_BIT_WIDTH_32;
+
+	/* No timer interrupt, the SPIM completion is the only one */
+	err = nrfx_timer_init(&shiftreg_timer, &config,
+			      shiftreg_timer_handler);
+	if (err != NRFX_SUCCESS) {
+		LOG_ERR("Failed to init shift register timer, error: 0x%08x",
+			err);
+		return -EIO;
+	}
+
+	nrfx_timer_extended_compare(&shiftreg_timer, NRF_TIMER_CC_CHANNEL0,
+				    nrfx_timer_us_to_ticks(&shiftreg_timer,
+							   SHIFTREG_PERIOD_US),
+				    NRF_TIMER_SHORT_COMPARE0_CLEAR_MASK, false);
+	nrfx_timer_compare(&shiftreg_timer, NRF_TIMER_CC_CHANNEL1,
+			   nrfx_timer_us_to_ticks(&shiftreg_timer,
+						  SHIFTREG_LOAD_US),
+			   false);
+
+	if (nrfx_dppi_channel_alloc(&load_channel) != NRFX_SUCCESS ||
+	    nrfx_dppi_channel_alloc(&shift_channel) != NRFX_SUCCESS) {
+		LOG_ERR("Failed to allocate DPPI channels");
+		return -ENOMEM;
+	}
+
+	nrfx_gppi_channel_endpoints_setup(load_channel,
+		nrfx_timer_compare_event_address_get(&shiftreg_timer,
+						     NRF_TIMER_CC_CHANNEL0),
+		load_task);
+	nrfx_gppi_channel_endpoints_setup(shift_channel,
+		nrfx_timer_compare_event_address_get(&shiftreg_timer,
+						     NRF_TIMER_CC_CHANNEL1),
+		done_task);
+	nrfx_gppi_fork_endpoint_setup(shift_channel,
+				      nrfx_spim_start_task_get(&spim));
+	nrfx_gppi_channels_enable(BIT(load_channel) | BIT(shift_channel));
+
+	nrfx_timer_enable(&shiftreg_timer);
+
+	return 0;
+}
+
+void shiftreg_rate_set(uint32_t hz)
+{
+	atomic_set(&next_period_us, USEC_PER_SEC / hz);
+}
+
+uint32_t shiftreg_scan_count(void)
+{
+	return scan_count;
+}
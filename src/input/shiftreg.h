@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * 74HC165 shift register chain. TIMER2 pulses the parallel load line
+ * and starts an SPIM3 receive of the whole chain over DPPI, so one
+ * EasyDMA transfer lands every scan in RAM without CPU work. Only the
+ * transfer completion interrupt looks at the result.
+ */
+
+#ifndef KEYPAD_INPUT_SHIFTREG_H_
+#define KEYPAD_INPUT_SHIFTREG_H_
+
+#include <zephyr/devicetree.h>
+
+#include "keymap.h"
+
+#define SHIFTREG_NODE DT_INST(0, richeffects_keypad_shift_register)
+#define SHIFTREG_KEYS DT_PROP_LEN(SHIFTREG_NODE, keycodes)
+/* Registers in the chain, eight inputs each */
+#define SHIFTREG_BYTES DIV_ROUND_UP(SHIFTREG_KEYS, 8)
+
+/* Called from the SPIM interrupt after every completed scan */
+typedef void (*shiftreg_scan_t)(keypad_bitmap_t state);
+
+int shiftreg_init(shiftreg_scan_t scan_done);
+
+/*
+ * Change the scan rate. The chain has no interrupt line, so an idle
+ * keypad is scanned slowly instead of stopped. Takes effect after the
+ * transfer in progress, any context.
+ */
+void shiftreg_rate_set(uint32_t hz);
+
+/* Completed scans since boot */
+uint32_t shiftreg_scan_count(void);
+
+#endif /* KEYPAD_INPUT_SHIFTREG_H_ */
@@ -0,0 +1,359 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Three DPPI channels run a pad measurement without the CPU: COMP
+ * CROSS counts on TIMER0, COMP READY starts the TIMER1 gate, so the
+ * comparator startup is not counted, and the gate's COMPARE0 stops
+ * COMP and captures the count. The gate interrupt moves COMP to the
+ * next pad, and after the last one works the counts into a position.
+ * LPCOMP has no current source to oscillate with, hence COMP.
+ *
+ * A pad's signal is how far its count is below its untouched baseline.
+ * The baselines follow drift in temperature and humidity through a
+ * slow IIR, only over sweeps where no pad is touched. The position is
+ * the centroid of the strongest pad and its neighbours, which
+ * interpolates between pads; far pads only add noise to it.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/logging/log.h>
+
+#include <nrfx_comp.h>
+#include <nrfx_dppi.h>
+#include <nrfx_timer.h>
+#include <helpers/nrfx_gppi.h>
+
+#include "input/slider.h"
+#include "irq_plan.h"
+#include "suspend.h"
+#include "usb/control.h"
+
+LOG_MODULE_REGISTER(slider, LOG_LEVEL_INF);
+
+#define SLIDER_GATE_NODE DT_NODELABEL(timer1)
+#define SLIDER_PADS DT_PROP_LEN(SLIDER_NODE, ain)
+/* Position units per pad */
+#define SLIDER_SPAN 256
+#define SLIDER_MAX ((SLIDER_PADS - 1) * SLIDER_SPAN)
+#define SLIDER_STEP (SLIDER_MAX / DT_PROP(SLIDER_NODE, steps))
+#define SLIDER_TOUCH_PERMILLE DT_PROP(SLIDER_NODE, touch_permille)
+/* Fraction bits of the baselines, also the IIR shift */
+#define SLIDER_BASE_Q 4
+
+BUILD_ASSERT(SLIDER_PADS >= 2 && SLIDER_PADS <= 8,
+	     "2 to 8 pads, on AIN0 to AIN7");
+BUILD_ASSERT(SLIDER_STEP > 0, "more steps than slider positions");
+BUILD_ASSERT(SLIDER_PADS * CONFIG_KEYPAD_SLIDER_GATE_US <
+	     CONFIG_KEYPAD_SLIDER_POLL_MS * USEC_PER_MSEC,
+	     "a sweep of all pads must fit the poll interval");
+
+static const uint8_t ain[] = DT_PROP(SLIDER_NODE, ain);
+
+static const nrfx_timer_t count_timer = NRFX_TIMER_INSTANCE(0);
+static const nrfx_timer_t gate_timer = NRFX_TIMER_INSTANCE(1);
+static uint8_t cross_channel;
+static uint8_t ready_channel;
+static uint8_t gate_channel;
+
+static struct k_timer poll_timer;
+/* Pad being measured, SLIDER_PADS between sweeps */
+static uint8_t pad = SLIDER_PADS;
+static uint32_t counts[SLIDER_PADS];
+/* Untouched counts in Q SLIDER_BASE_Q, 0 until the first sweep */
+static uint32_t base_q[SLIDER_PADS];
+static int32_t position = -1;
+/* Position the next step is counted from */
+static int32_t anchor;
+/* Steps not yet tapped, positive towards the last pad */
+static atomic_t steps;
+static uint32_t sweeps;
+/* Polls that found the previous sweep still running */
+static uint32_t overruns;
+
+static void slider_comp_handler(nrf_comp_event_t event)
+{
+	/* No COMP interrupts are enabled, its events go over DPPI */
+}
+
+static void slider_count_handler(nrf_timer_event_t event, void *context)
+{
+	/* No interrupts are enabled on the counter either */
+}
+
+static void slider_pad_start(uint8_t next)
+{
+	pad = next;
+	nrfx_timer_clear(&count_timer);
+	/* Also stops COMP, the gate end already has */
+	nrfx_comp_pin_select((nrf_comp_input_t)ain[next]);
+	nrfx_comp_start(0, 0);
+}
+
+/* The strongest pad and its neighbours, in SLIDER_SPAN units */
+static int32_t slider_centroid(const uint32_t *delta)
+{
+	uint32_t total = 0;
+	uint32_t weighted = 0;
+	uint8_t peak = 0;
+
+	for (uint8_t i = 1; i < SLIDER_PADS; i++) {
+		if (delta[i] > delta[peak]) {
+			peak = i;
+		}
+	}
+
+	for (uint8_t i = MAX(peak, 1) - 1;
+	     i <= MIN(peak + 1, SLIDER_PADS - 1); i++) {
+		total += delta[i];
+		weighted += delta[i] * i * SLIDER_SPAN;
+	}
+
+	return weighted / total;
+}
+
+/* Once per sweep, from the gate interrupt */
+static void slider_update(void)
+{
+	uint32_t delta[SLIDER_PADS];
+	bool touched = false;
+	int32_t pos;
+
+	sweeps++;
+
+	for (uint8_t i = 0; i < SLIDER_PADS; i++) {
+		uint32_t base;
+
+		if (base_q[i] == 0) {
+			base_q[i] = counts[i] << SLIDER_BASE_Q;
+		}
+
+		base = base_q[i] >> SLIDER_BASE_Q;
+		delta[i] = base > counts[i] ? base - counts[i] : 0;
+		if (delta[i] * 1000 > base * SLIDER_TOUCH_PERMILLE) {
+			touched = true;
+		}
+	}
+
+	if (!touched) {
+		for (uint8_t i = 0; i < SLIDER_PADS; i++) {
+			base_q[i] += counts[i] - (base_q[i] >> SLIDER_BASE_Q);
+		}
+		position = -1;
+		return;
+	}
+
+	pos = slider_centroid(delta);
+	if (DT_PROP(SLIDER_NODE, reverse)) {
+		pos = SLIDER_MAX - pos;
+	}
+
+	if (position < 0 || suspend_is_active()) {
+		if (position < 0 && suspend_is_active()) {
+			/* A touch wakes the host but is not replayed */
+			suspend_wakeup_request();
+		}
+		anchor = pos;
+	}
+
+	while (pos - anchor >= SLIDER_STEP) {
+		anchor += SLIDER_STEP;
+		atomic_inc(&steps);
+	}
+	while (anchor - pos >= SLIDER_STEP) {
+		anchor -= SLIDER_STEP;
+		atomic_dec(&steps);
+	}
+
+	position = pos;
+}
+
+static void slider_gate_handler(nrf_timer_event_t event, void *context)
+{
+	if (event != NRF_TIMER_EVENT_COMPARE0) {
+		return;
+	}
+
+	counts[pad] = nrfx_timer_capture_get(&count_timer,
+					     NRF_TIMER_CC_CHANNEL0);
+
+	if (pad + 1 < SLIDER_PADS) {
+		slider_pad_start(pad + 1);
+		return;
+	}
+
+	pad = SLIDER_PADS;
+	slider_update();
+}
+
+/* One step per poll, each a tap of its own usage */
+static void slider_poll(struct k_timer *timer)
+{
+	atomic_val_t pending = atomic_get(&steps);
+	uint16_t usage;
+
+	if (pending != 0) {
+		if (pending > 0) {
+			usage = DT_PROP(SLIDER_NODE, increment_usage);
+			atomic_dec(&steps);
+		} else {
+			usage = DT_PROP(SLIDER_NODE, decrement_usage);
+			atomic_inc(&steps);
+		}
+		control_consumer_set(usage, true);
+		control_consumer_set(usage, false);
+	}
+
+	if (pad != SLIDER_PADS) {
+		overruns++;
+		return;
+	}
+
+	slider_pad_start(0);
+}
+
+static int slider_timers_init(void)
+{
+	nrfx_timer_config_t config = NRFX_TIMER_DEFAULT_CONFIG;
+	nrfx_err_t err;
+
+	config.mode = NRF_TIMER_MODE_LOW_POWER_COUNTER;
+	config.bit_width = NRF_TIMER_BIT_WIDTH_32;
+
+	err = nrfx_timer_init(&count_timer, &config, slider_count_handler);
+	if (err != NRFX_SUCCESS) {
+		LOG_ERR("Failed to init slider counter, error: 0x%08x", err);
+		return -EIO;
+	}
+
+	config = (nrfx_timer_config_t)NRFX_TIMER_DEFAULT_CONFIG;
+	config.frequency = NRF_TIMER_FREQ_1MHz;
+	config.bit_width = NRF_TIMER_BIT_WIDTH_32;
+	config.interrupt_priority = IRQ_PLAN_INPUT;
+
+	err = nrfx_timer_init(&gate_timer, &config, slider_gate_handler);
+	if (err != NRFX_SUCCESS) {
+		LOG_ERR("Failed to init slider gate, error: 0x%08x", err);
+		return -EIO;
+	}
+
+	IRQ_CONNECT(DT_IRQN(SLIDER_GATE_NODE), IRQ_PLAN_INPUT,
+		    nrfx_timer_1_irq_handler, NULL, 0);
+
+	/* Left stopped; COMP READY starts it over DPPI */
+	nrfx_timer_extended_compare(&gate_timer, NRF_TIMER_CC_CHANNEL0,
+				    nrfx_timer_us_to_ticks(&gate_timer,
+					CONFIG_KEYPAD_SLIDER_GATE_US),
+				    NRF_TIMER_SHORT_COMPARE0_STOP_MASK |
+				    NRF_TIMER_SHORT_COMPARE0_CLEAR_MASK, true);
+
+	/* Counts COUNT tasks only, so it can run throughout */
+	nrfx_timer_enable(&count_timer);
+
+	return 0;
+}
+
+static int slider_dppi_init(void)
+{
+	if (nrfx_dppi_channel_alloc(&cross_channel) != NRFX_SUCCESS ||
+	    nrfx_dppi_channel_alloc(&ready_channel) != NRFX_SUCCESS ||
+	    nrfx_dppi_channel_alloc(&gate_channel) != NRFX_SUCCESS) {
+		LOG_ERR("Failed to allocate DPPI channels");
+		return -ENOMEM;
+	}
+
+	nrfx_gppi_channel_endpoints_setup(cross_channel,
+		nrfx_comp_event_address_get(NRF_COMP_EVENT_CROSS),
+		nrfx_timer_task_address_get(&count_timer,
+					    NRF_TIMER_TASK_COUNT));
+	nrfx_gppi_channel_endpoints_setup(ready_channel,
+		nrfx_comp_event_address_get(NRF_COMP_EVENT_READY),
+		nrfx_timer_task_address_get(&gate_timer,
+					    NRF_TIMER_TASK_START));
+	nrfx_gppi_channel_endpoints_setup(gate_channel,
+		nrfx_timer_compare_event_address_get(&gate_timer,
+						     NRF_TIMER_CC_CHANNEL0),
+		nrfx_comp_task_address_get(NRF_COMP_TASK_STOP));
+	nrfx_gppi_fork_endpoint_setup(gate_channel,
+		nrfx_timer_capture_task_address_get(&count_timer,
+						    NRF_TIMER_CC_CHANNEL0));
+	nrfx_gppi_channels_enable(BIT(cross_channel) | BIT(ready_channel) |
+				  BIT(gate_channel));
+
+	return 0;
+}
+
+int slider_init(void)
+{
+	nrfx_comp_config_t config =
+		NRFX_COMP_DEFAULT_CONFIG((nrf_comp_input_t)ain[0]);
+	nrfx_err_t err;
+	int ret;
+
+	config.reference = NRF_COMP_REF_VDD;
+	/*
+	 * Thresholds are (TH + 1) / 64 of VDD: the current source swings
+	 * the pad between a quarter and three quarters of it
+	 */
+	config.threshold.th_down = 15;
+	config.threshold.th_up = 47;
+	config.main_mode = NRF_COMP_MAIN_MODE_SE;
+	config.speed_mode = NRF_COMP_SP_MODE_High;
+	config.hyst = NRF_COMP_HYST_NoHyst;
+	config.isource = NRF_COMP_ISOURCE_Ien10uA;
+	config.interrupt_priority = IRQ_PLAN_INPUT;
+
+	err = nrfx_comp_init(&config, slider_comp_handler);
+	if (err != NRFX_SUCCESS) {
+		LOG_ERR("Failed to init COMP, error: 0x%08x", err);
+		return -EIO;
+	}
+
+	ret = slider_timers_init();
+	if (ret < 0) {
+		return ret;
+	}
+
+	ret = slider_dppi_init();
+	if (ret < 0) {
+		return ret;
+	}
+
+	k_timer_init(&poll_timer, slider_poll, NULL);
+	k_timer_start(&poll_timer, K_MSEC(CONFIG_KEYPAD_SLIDER_POLL_MS),
+		      K_MSEC(CONFIG_KEYPAD_SLIDER_POLL_MS));
+
+	return 0;
+}
+
+int32_t slider_position_get(void)
+{
+	return position;
+}
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static int cmd_slider_show(const struct shell *sh, size_t argc, char **argv)
+{
+	for (uint8_t i = 0; i < SLIDER_PADS; i++) {
+		shell_print(sh, "pad %u AIN%u: count %u, baseline %u", i,
+			    ain[i], counts[i], base_q[i] >> SLIDER_BASE_Q);
+	}
+
+	shell_print(sh, "position %d, %u sweeps, %u overruns",
+		    slider_position_get(), sweeps, overruns);
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_slider,
+	SHELL_CMD(show, NULL, "Print pad counts and position",
+		  cmd_slider_show),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(slider, &sub_slider, "Capacitive touch slider", NULL);
+#endif /* CONFIG_SHELL */
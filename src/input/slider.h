@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Capacitive touch slider. COMP runs as a relaxation oscillator on one
+ * pad at a time, its current source charging and discharging the pad
+ * between two thresholds, and TIMER0 counts the oscillations over
+ * DPPI for a gate timed by TIMER1. A finger adds capacitance and slows
+ * the oscillator. The CPU is involved once per pad per poll, to move
+ * COMP to the next pad, and the position is worked out once per poll
+ * from the counts of all pads. Each step slid along it is tapped as a
+ * Consumer Control usage, one per poll, volume up and down by default.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_SLIDER is enabled.
+ */
+
+#ifndef KEYPAD_INPUT_SLIDER_H_
+#define KEYPAD_INPUT_SLIDER_H_
+
+#include <zephyr/zephyr.h>
+
+#define SLIDER_NODE DT_INST(0, richeffects_keypad_slider)
+
+#if defined(CONFIG_KEYPAD_SLIDER)
+
+/* Takes COMP, TIMER0 and TIMER1, after control_init() */
+int slider_init(void);
+
+/*
+ * Touch position along the slider, 256 per pad from 0 over the first,
+ * or -1 when not touched.
+ */
+int32_t slider_position_get(void);
+
+#else
+
+static inline int slider_init(void)
+{
+	return 0;
+}
+
+static inline int32_t slider_position_get(void)
+{
+	return -1;
+}
+
+#endif /* CONFIG_KEYPAD_SLIDER */
+
+#endif /* KEYPAD_INPUT_SLIDER_H_ */
@@ -0,0 +1,393 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Frames are SOF, a header with a 4-bit sequence number and a change
+ * count, the changes and a CRC-8 of header and changes. A change is a
+ * key index with the pressed bit, so one keystroke is a 4-byte frame;
+ * a count of 0 carries the whole 32-bit bitmap instead. The satellite
+ * keeps the bitmap the master was last sent and, whenever the UART is
+ * free, sends the difference to its debounced keys, so changes that
+ * pile up behind flow control go out together in one frame.
+ *
+ * A change frame that fails its CRC or skips a sequence number is
+ * dropped and the master answers with a NAK byte; the satellite's next
+ * frame is then a full bitmap, as it is every CONFIG_KEYPAD_SPLIT_SYNC_MS
+ * anyway. A master that hears nothing for three of those releases the
+ * satellite's keys, so a pulled cable cannot leave a key stuck.
+ *
+ * Transfers are EasyDMA with the Zephyr async UART API. The master
+ * parses in the UARTE interrupt at the end of each burst, after
+ * SPLIT_RX_IDLE_US of silence, and hands the changes on right there
+ * with interrupts locked, as the local scan interrupt does: at 1 Mbaud
+ * a keystroke reaches keys_changed() about 100 us after the satellite
+ * debounced it.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/uart.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/crc.h>
+#include <zephyr/logging/log.h>
+
+#include "input/split.h"
+#include "keymap.h"
+
+LOG_MODULE_REGISTER(split, LOG_LEVEL_INF);
+
+#define SPLIT_SOF 0xa5
+#define SPLIT_NAK 0x15
+/* Header: sequence number in the high nibble, changes in the low one */
+#define SPLIT_SEQ_SHIFT 4
+#define SPLIT_COUNT_MASK BIT_MASK(4)
+#define SPLIT_CHANGES_MAX SPLIT_COUNT_MASK
+/* Change byte: key index and the new state */
+#define SPLIT_PRESSED BIT(7)
+#define SPLIT_KEY_MASK BIT_MASK(5)
+/* SOF, header, changes and CRC */
+#define SPLIT_FRAME_MAX (2 + SPLIT_CHANGES_MAX + 1)
+
+/* Silence that ends a received burst and raises RX_RDY */
+#define SPLIT_RX_IDLE_US 50
+/* A stalled transfer gives up after this, the master is gone */
+#define SPLIT_TX_TIMEOUT_US 10000
+#define SPLIT_TIMEOUT_MS (3 * CONFIG_KEYPAD_SPLIT_SYNC_MS)
+
+static const struct device *const uart =
+	DEVICE_DT_GET(DT_PHANDLE(SPLIT_NODE, uart));
+
+static struct k_spinlock lock;
+static struct split_stats stats;
+
+/* EasyDMA fills one while the other is handed back */
+static uint8_t rx_bufs[2][32];
+static uint8_t rx_next;
+static bool tx_busy;
+
+#if defined(CONFIG_KEYPAD_SPLIT_SATELLITE)
+static uint8_t tx_buf[SPLIT_FRAME_MAX];
+/* Debounced keys, and what the master has been sent */
+static keypad_bitmap_t pressed;
+static keypad_bitmap_t sent;
+/* The next frame must be a full bitmap */
+static bool full_due = true;
+static uint8_t seq;
+static struct k_timer sync_timer;
+
+static size_t split_frame(uint8_t *buf, keypad_bitmap_t changed, bool full)
+{
+	size_t len = 2;
+	uint8_t key;
+
+	buf[0] = SPLIT_SOF;
+	buf[1] = seq << SPLIT_SEQ_SHIFT;
+	if (full) {
+		sys_put_le32(pressed, &buf[len]);
+		len += sizeof(uint32_t);
+	} else {
+		buf[1] |= __builtin_popcount(changed);
+		while (changed != 0) {
+			key = find_lsb_set(changed) - 1;
+			changed &= ~BIT(key);
+			buf[len++] = key |
+				((pressed & BIT(key)) ? SPLIT_PRESSED : 0);
+		}
+	}
+
+	buf[len] = crc8_ccitt(0xff, &buf[1], len - 1);
+	seq = (seq + 1) & SPLIT_COUNT_MASK;
+
+	return len + 1;
+}
+
+/* Send what the master is missing, if the UART is free; lock held */
+static void split_send(void)
+{
+	keypad_bitmap_t changed = pressed ^ sent;
+	bool full = full_due ||
+		    __builtin_popcount(changed) > SPLIT_CHANGES_MAX;
+	size_t len;
+
+	if (tx_busy || (changed == 0 && !full)) {
+		return;
+	}
+
+	len = split_frame(tx_buf, changed, full);
+	if (uart_tx(uart, tx_buf, len, SPLIT_TX_TIMEOUT_US) < 0) {
+		/* Sequence number is used up, the master will NAK */
+		return;
+	}
+
+	tx_busy = true;
+	sent = pressed;
+	full_due = false;
+	stats.frames++;
+	stats.bytes += len;
+	stats.full += full;
+}
+
+void split_keys_changed(keypad_bitmap_t now, keypad_bitmap_t changed)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	pressed = now;
+	split_send();
+	k_spin_unlock(&lock, key);
+}
+
+static void split_sync(struct k_timer *timer)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	full_due = true;
+	split_send();
+	k_spin_unlock(&lock, key);
+}
+
+static void split_rx(const uint8_t *buf, size_t len)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	for (size_t i = 0; i < len; i++) {
+		if (buf[i] == SPLIT_NAK && !full_due) {
+			full_due = true;
+			stats.resyncs++;
+		}
+	}
+
+	split_send();
+	k_spin_unlock(&lock, key);
+}
+
+static void split_tx_done(bool aborted)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	tx_busy = false;
+	/* Whatever the master got of it, start over from a full bitmap */
+	full_due |= aborted;
+	split_send();
+	k_spin_unlock(&lock, key);
+}
+#else
+static const uint8_t nak = SPLIT_NAK;
+static scan_handler_t handler;
+/* Satellite's keys from bit 0, as the master has them */
+static keypad_bitmap_t remote;
+/* Frame being received: header, changes or bitmap, CRC */
+static uint8_t frame[SPLIT_FRAME_MAX];
+static uint8_t frame_len;
+static uint8_t frame_need;
+static uint8_t expected;
+/* A full bitmap came in since the last lost frame */
+static bool synced;
+static struct k_timer timeout_timer;
+
+/* Hand the changed keys of the satellite on, lock held */
+static void split_apply(keypad_bitmap_t next)
+{
+	keypad_bitmap_t changed = next ^ remote;
+	size_t first = keypad_key_count - DT_PROP_LEN(SPLIT_NODE, keycodes);
+
+	remote = next;
+	if (changed != 0) {
+		handler(scan_pressed_get() | (remote << first),
+			changed << first);
+	}
+}
+
+/* Frame lost, ask for a full bitmap; lock held */
+static void split_nak(void)
+{
+	stats.errors++;
+	synced = false;
+	if (!tx_busy && uart_tx(uart, &nak, 1, SPLIT_TX_TIMEOUT_US) == 0) {
+		tx_busy = true;
+		stats.resyncs++;
+	}
+}
+
+static void split_frame_take(void)
+{
+	uint8_t seq = frame[0] >> SPLIT_SEQ_SHIFT;
+	uint8_t count = frame[0] & SPLIT_COUNT_MASK;
+	keypad_bitmap_t next = remote;
+	uint8_t change;
+	uint8_t key;
+
+	if (crc8_ccitt(0xff, frame, frame_len - 1) != frame[frame_len - 1]) {
+		split_nak();
+		return;
+	}
+
+	if (count == 0) {
+		next = sys_get_le32(&frame[1]);
+		synced = true;
+		stats.full++;
+	} else if (!synced || seq != expected) {
+		split_nak();
+		return;
+	}
+
+	for (uint8_t i = 0; i < count; i++) {
+		change = frame[1 + i];
+		key = change & SPLIT_KEY_MASK;
+		WRITE_BIT(next, key, change & SPLIT_PRESSED);
+	}
+
+	expected = (seq + 1) & SPLIT_COUNT_MASK;
+	stats.frames++;
+	stats.bytes += frame_len + 1;
+	k_timer_start(&timeout_timer, K_MSEC(SPLIT_TIMEOUT_MS), K_NO_WAIT);
+	split_apply(next & BIT_MASK(DT_PROP_LEN(SPLIT_NODE, keycodes)));
+}
+
+static void split_rx(const uint8_t *buf, size_t len)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	uint8_t count;
+
+	for (size_t i = 0; i < len; i++) {
+		if (frame_need == 0) {
+			/* Between frames: anything but SOF is line noise */
+			frame_len = 0;
+			frame_need = buf[i] == SPLIT_SOF ? 1 : 0;
+			continue;
+		}
+
+		frame[frame_len++] = buf[i];
+		if (frame_len == 1) {
+			count = buf[i] & SPLIT_COUNT_MASK;
+			/* Changes or bitmap, then the CRC */
+			frame_need = 1 + (count ? count : sizeof(uint32_t)) + 1;
+		}
+
+		if (frame_len == frame_need) {
+			split_frame_take();
+			frame_need = 0;
+		}
+	}
+
+	k_spin_unlock(&lock, key);
+}
+
+static void split_tx_done(bool aborted)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	tx_busy = false;
+	k_spin_unlock(&lock, key);
+}
+
+static void split_timeout(struct k_timer *timer)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	if (remote != 0) {
+		stats.timeouts++;
+		LOG_WRN("Satellite quiet for %u ms, keys released",
+			SPLIT_TIMEOUT_MS);
+	}
+
+	synced = false;
+	split_apply(0);
+	k_spin_unlock(&lock, key);
+}
+#endif /* CONFIG_KEYPAD_SPLIT_SATELLITE */
+
+static void split_uart_cb(const struct device *dev, struct uart_event *evt,
+			  void *user_data)
+{
+	switch (evt->type) {
+	case UART_TX_DONE:
+		split_tx_done(false);
+		break;
+	case UART_TX_ABORTED:
+		split_tx_done(true);
+		break;
+	case UART_RX_RDY:
+		split_rx(evt->data.rx.buf + evt->data.rx.offset,
+			 evt->data.rx.len);
+		break;
+	case UART_RX_BUF_REQUEST:
+		(void)uart_rx_buf_rsp(dev, rx_bufs[rx_next],
+				      sizeof(rx_bufs[0]));
+		rx_next ^= 1;
+		break;
+	case UART_RX_DISABLED:
+		/* After a line error: pick up again with the next frame */
+		(void)uart_rx_enable(dev, rx_bufs[rx_next],
+				     sizeof(rx_bufs[0]), SPLIT_RX_IDLE_US);
+		rx_next ^= 1;
+		break;
+	default:
+		break;
+	}
+}
+
+void split_stats_get(struct split_stats *out)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	*out = stats;
+	k_spin_unlock(&lock, key);
+}
+
+int split_init(scan_handler_t on_change)
+{
+	int ret;
+
+	if (!device_is_ready(uart)) {
+		LOG_ERR("Split link UART %s not ready", uart->name);
+		return -ENODEV;
+	}
+
+	ret = uart_callback_set(uart, split_uart_cb, NULL);
+	if (ret < 0) {
+		return ret;
+	}
+
+#if defined(CONFIG_KEYPAD_SPLIT_SATELLITE)
+	ARG_UNUSED(on_change);
+	k_timer_init(&sync_timer, split_sync, NULL);
+	k_timer_start(&sync_timer, K_NO_WAIT,
+		      K_MSEC(CONFIG_KEYPAD_SPLIT_SYNC_MS));
+#else
+	handler = on_change;
+	k_timer_init(&timeout_timer, split_timeout, NULL);
+#endif
+
+	rx_next = 1;
+
+	return uart_rx_enable(uart, rx_bufs[0], sizeof(rx_bufs[0]),
+			      SPLIT_RX_IDLE_US);
+}
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static int cmd_split_show(const struct shell *sh, size_t argc, char **argv)
+{
+	struct split_stats s;
+
+	split_stats_get(&s);
+	shell_print(sh, "%s, frames %u (%u full), %u bytes",
+		    IS_ENABLED(CONFIG_KEYPAD_SPLIT_SATELLITE) ? "satellite" :
+							       "master",
+		    s.frames, s.full, s.bytes);
+	shell_print(sh, "errors %u, resyncs %u, timeouts %u", s.errors,
+		    s.resyncs, s.timeouts);
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_split,
+	SHELL_CMD(show, NULL, "Print link counters", cmd_split_show),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(split, &sub_split, "Split keypad link", NULL);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Split keypad link on the richeffects,keypad-split devicetree node.
+ * A satellite module sends the changes of its debounced key bitmap
+ * over a UARTE with hardware flow control; the master turns them into
+ * key transitions of keypad_keys[] entries after its own keys, so
+ * layers, combos and reports see one keypad. An idle link only carries
+ * a full bitmap every CONFIG_KEYPAD_SPLIT_SYNC_MS.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_SPLIT is enabled.
+ */
+
+#ifndef KEYPAD_INPUT_SPLIT_H_
+#define KEYPAD_INPUT_SPLIT_H_
+
+#include <zephyr/zephyr.h>
+
+#include "scan.h"
+
+#define SPLIT_NODE DT_INST(0, richeffects_keypad_split)
+
+struct split_stats {
+	/* Frames sent or taken, and the bytes they took on the wire */
+	uint32_t frames;
+	uint32_t bytes;
+	/* Of the frames, full bitmaps: sync, resync or many changes */
+	uint32_t full;
+	/* Master: frames dropped for a bad CRC or a missing sequence */
+	uint32_t errors;
+	/* Full bitmaps asked for, by the master or of the satellite */
+	uint32_t resyncs;
+	/* Master: times the satellite went quiet and its keys released */
+	uint32_t timeouts;
+};
+
+#if defined(CONFIG_KEYPAD_SPLIT)
+
+/*
+ * Start the link. On the master, the satellite's key changes go to
+ * handler with interrupts locked, like those of the local scan.
+ */
+int split_init(scan_handler_t handler);
+
+/* Satellite: scan handler that sends the key changes to the master */
+void split_keys_changed(keypad_bitmap_t pressed, keypad_bitmap_t changed);
+
+void split_stats_get(struct split_stats *out);
+
+#else
+
+static inline int split_init(scan_handler_t handler)
+{
+	return 0;
+}
+
+static inline void split_keys_changed(keypad_bitmap_t pressed,
+				      keypad_bitmap_t changed) {}
+
+#endif /* CONFIG_KEYPAD_SPLIT */
+
+#endif /* KEYPAD_INPUT_SPLIT_H_ */
@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Two bitmaps track the keys: what the input layer last reported,
+ * and what reached the event ring, so what the host is told is held.
+ * A key held downstream but released by the input lost its release on
+ * the ring; one held by both while its line reads released lost an
+ * edge interrupt. The check timer runs only while something is held
+ * downstream, started by the first press and stopped by the check that
+ * finds nothing held, so an idle keypad pays for neither.
+ *
+ * The bitmaps are written from the scan interrupts and read by the
+ * timer, which may preempt them or be preempted; all of them are
+ * atomics. The corrective release goes through keys_changed() like
+ * any other, with interrupts locked to keep it the ring's only
+ * producer.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/logging/log.h>
+
+#include "keys.h"
+#include "scan.h"
+#include "input/stuck.h"
+
+LOG_MODULE_REGISTER(stuck, LOG_LEVEL_INF);
+
+#define STUCK_PERIOD K_MSEC(CONFIG_KEYPAD_STUCK_CHECK_MS)
+
+/* Pressed set of the input layer */
+static atomic_t input;
+/* Keys held downstream */
+static atomic_t delivered;
+/* Keys that looked stuck on the previous check */
+static atomic_t suspect;
+
+static struct stuck_stats stats;
+
+static void stuck_check(struct k_timer *timer);
+
+static K_TIMER_DEFINE(check_timer, stuck_check, NULL);
+
+void stuck_input(keypad_bitmap_t pressed)
+{
+	atomic_set(&input, pressed);
+}
+
+void stuck_delivered(uint8_t key, bool pressed)
+{
+	/* A transition of its own, whatever the previous check saw */
+	atomic_and(&suspect, ~BIT(key));
+
+	if (!pressed) {
+		atomic_and(&delivered, ~BIT(key));
+	} else if (atomic_or(&delivered, BIT(key)) == 0) {
+		k_timer_start(&check_timer, STUCK_PERIOD, STUCK_PERIOD);
+	}
+}
+
+static void stuck_check(struct k_timer *timer)
+{
+	keypad_bitmap_t held = atomic_get(&delivered);
+	keypad_bitmap_t pressed = atomic_get(&input);
+	keypad_bitmap_t known;
+	keypad_bitmap_t levels;
+	keypad_bitmap_t lost;
+	keypad_bitmap_t missed;
+	keypad_bitmap_t seen;
+	unsigned int key;
+
+	if (held == 0) {
+		k_timer_stop(timer);
+		atomic_set(&suspect, 0);
+		return;
+	}
+
+	stats.checks++;
+	levels = scan_levels_get(&known);
+
+	/* Released by the input, the event ring dropped the release */
+	lost = held & ~pressed;
+	/* Held by the input, but the line says otherwise */
+	missed = held & pressed & known & ~levels;
+
+	seen = atomic_set(&suspect, lost | missed);
+	lost &= seen;
+	missed &= seen;
+
+	if (lost != 0) {
+		LOG_WRN("Releasing stuck keys 0x%08x", lost);
+		stats.released += __builtin_popcount(lost);
+		atomic_and(&suspect, ~lost);
+
+		key = irq_lock();
+		keys_changed(pressed, lost);
+		irq_unlock(key);
+	}
+
+	if (missed != 0) {
+		LOG_WRN("Reading stuck keys 0x%08x again", missed);
+		stats.resynced += __builtin_popcount(missed);
+		atomic_and(&suspect, ~missed);
+
+		/* The release comes back through the debounce */
+		scan_resync();
+	}
+}
+
+void stuck_stats_get(struct stuck_stats *out)
+{
+	*out = stats;
+}
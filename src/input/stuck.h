@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Stuck key reconciliation. While any key is held downstream, every
+ * CONFIG_KEYPAD_STUCK_CHECK_MS the keys the pipeline holds are
+ * compared with the input: a release that never made it onto the full
+ * event ring is sent again, and a key whose line reads released while
+ * the scan still holds it is read again through the debounce. A key
+ * must look stuck on two checks in a row, with no transition of its
+ * own in between. Nothing runs while no key is held.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_STUCK_CHECK is enabled.
+ */
+
+#ifndef KEYPAD_INPUT_STUCK_H_
+#define KEYPAD_INPUT_STUCK_H_
+
+#include <zephyr/zephyr.h>
+
+#include "keymap.h"
+
+struct stuck_stats {
+	/* Checks run, i.e. periods with a key held */
+	uint32_t checks;
+	/* Releases sent again after the event ring dropped them */
+	uint32_t released;
+	/* Keys read again because the scan missed their release */
+	uint32_t resynced;
+};
+
+#if defined(CONFIG_KEYPAD_STUCK_CHECK)
+
+/* From keys_changed(): the pressed set the input layer reports */
+void stuck_input(keypad_bitmap_t pressed);
+
+/*
+ * From keys_changed(): the transition of key is on the event ring, or
+ * in its summary when the ring was full
+ */
+void stuck_delivered(uint8_t key, bool pressed);
+
+void stuck_stats_get(struct stuck_stats *out);
+
+#else
+
+static inline void stuck_input(keypad_bitmap_t pressed) {}
+
+static inline void stuck_delivered(uint8_t key, bool pressed) {}
+
+#endif /* CONFIG_KEYPAD_STUCK_CHECK */
+
+#endif /* KEYPAD_INPUT_STUCK_H_ */
@@ -0,0 +1,245 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * The running statistics are exponentially weighted, each sample
+ * counting 1/8, in ms with four fraction bits: a shift and an add per
+ * sample, no history kept. Mean deviation rather than variance, so
+ * there is no square root. The term of a key is worked out when it
+ * learns, not when it is asked, as the report thread asks on every
+ * tap-hold press. Only the report thread writes; the shell and the
+ * store may read a sample behind.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/init.h>
+#include <zephyr/logging/log.h>
+
+#include "config/config_store.h"
+#include "input/tap_term.h"
+#include "keymap.h"
+
+LOG_MODULE_REGISTER(tap_term, LOG_LEVEL_INF);
+
+#define TAP_TERM_MIN CONFIG_KEYPAD_ADAPTIVE_TERM_MIN_MS
+#define TAP_TERM_MAX CONFIG_KEYPAD_ADAPTIVE_TERM_MAX_MS
+#define TAP_TERM_SAMPLES CONFIG_KEYPAD_ADAPTIVE_TERM_SAMPLES
+
+/* Fraction bits of the statistics, and weight of a sample as a shift */
+#define FRAC 4
+#define WEIGHT 3
+/* Longest sample, so the statistics fit 16 bits */
+#define SAMPLE_MAX_MS ((UINT16_MAX >> FRAC) - 1)
+
+BUILD_ASSERT(TAP_TERM_MIN <= TAP_TERM_MAX, "term bounds are reversed");
+BUILD_ASSERT(TAP_TERM_MAX <= SAMPLE_MAX_MS, "term bound out of range");
+
+/* Per key, as stored, little endian */
+struct tap_term_stats {
+	/* Taps learned, and their mean and mean deviation */
+	uint16_t taps;
+	uint16_t tap_mean;
+	uint16_t tap_dev;
+	/* Holds learned, and their mean and mean deviation */
+	uint16_t holds;
+	uint16_t hold_mean;
+	uint16_t hold_dev;
+};
+
+static struct tap_term_stats stats[KEYPAD_MAX_KEYS];
+/* Term in use per key, from stats[] */
+static uint16_t term[KEYPAD_MAX_KEYS];
+/* Holds that were learned as taps */
+static uint32_t misfires;
+/* Learned since the last save */
+static bool learned;
+
+static void tap_term_update(uint8_t key)
+{
+	const struct tap_term_stats *s = &stats[key];
+	int32_t t;
+
+	if (s->taps < TAP_TERM_SAMPLES) {
+		term[key] = CLAMP(CONFIG_KEYPAD_TAPPING_TERM_MS, TAP_TERM_MIN,
+				  TAP_TERM_MAX);
+		return;
+	}
+
+	/* Nearly every tap, and still short of nearly every hold */
+	t = s->tap_mean + 4 * s->tap_dev;
+	if (s->holds >= TAP_TERM_SAMPLES) {
+		t = MIN(t, s->hold_mean - 2 * s->hold_dev);
+	}
+
+	term[key] = CLAMP(t >> FRAC, TAP_TERM_MIN, TAP_TERM_MAX);
+}
+
+static void sample(uint16_t *count, uint16_t *mean, uint16_t *dev,
+		   uint32_t ms)
+{
+	int32_t x = MIN(ms, SAMPLE_MAX_MS) << FRAC;
+
+	if (*count == 0) {
+		*mean = x;
+		*dev = x / 4;
+	} else {
+		*dev += (abs(x - *mean) - *dev) >> WEIGHT;
+		*mean += (x - *mean) >> WEIGHT;
+	}
+
+	if (*count < UINT16_MAX) {
+		(*count)++;
+	}
+}
+
+uint32_t tap_term_get(uint8_t key)
+{
+	return key < KEYPAD_MAX_KEYS ? term[key] : TAP_TERM_MAX;
+}
+
+void tap_term_learn(uint8_t key, bool hold, uint32_t ms, bool alone)
+{
+	struct tap_term_stats *s;
+
+	if (key >= KEYPAD_MAX_KEYS) {
+		return;
+	}
+
+	s = &stats[key];
+
+	/* Only waited out the term, unless it was a hold on purpose */
+	if (hold && alone) {
+		if (ms > TAP_TERM_MAX) {
+			return;
+		}
+		misfires++;
+		hold = false;
+	}
+
+	if (hold) {
+		sample(&s->holds, &s->hold_mean, &s->hold_dev, ms);
+	} else {
+		sample(&s->taps, &s->tap_mean, &s->tap_dev, ms);
+	}
+
+	tap_term_update(key);
+	learned = true;
+}
+
+#if defined(CONFIG_KEYPAD_CONFIG_STORE)
+BUILD_ASSERT(sizeof(stats) <= CONFIG_KEYPAD_CONFIG_STORE_MAX_SIZE,
+	     "the statistics must fit a stored value");
+
+static ssize_t tap_term_store_get(void *buf, size_t size)
+{
+	memcpy(buf, stats, sizeof(stats));
+
+	return sizeof(stats);
+}
+
+static int tap_term_store_set(const void *data, size_t len)
+{
+	if (len != sizeof(stats)) {
+		/* Stored for another key limit */
+		return -EINVAL;
+	}
+
+	memcpy(stats, data, len);
+
+	return 0;
+}
+#endif /* CONFIG_KEYPAD_CONFIG_STORE */
+
+static struct config_entry tap_term_entry = {
+	.name = "keypad/tap_term",
+#if defined(CONFIG_KEYPAD_CONFIG_STORE)
+	.get = tap_term_store_get,
+	.set = tap_term_store_set,
+#endif
+};
+
+static void tap_term_save(struct k_work *work);
+
+static K_WORK_DELAYABLE_DEFINE(save_work, tap_term_save);
+
+static void tap_term_save(struct k_work *work)
+{
+	if (learned) {
+		learned = false;
+		config_store_changed(&tap_term_entry);
+	}
+
+	k_work_schedule(&save_work, K_HOURS(1));
+}
+
+static int tap_term_init(const struct device *dev)
+{
+	ARG_UNUSED(dev);
+
+	if (config_store_register(&tap_term_entry) < 0) {
+		LOG_WRN("Stored tapping terms not loaded");
+	}
+
+	for (uint8_t i = 0; i < KEYPAD_MAX_KEYS; i++) {
+		tap_term_update(i);
+	}
+
+	k_work_schedule(&save_work, K_HOURS(1));
+
+	return 0;
+}
+
+SYS_INIT(tap_term_init, APPLICATION, 0);
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static int cmd_tap_term_show(const struct shell *sh, size_t argc,
+			     char **argv)
+{
+	shell_print(sh, "bounds %u..%u ms, %u holds learned as taps",
+		    TAP_TERM_MIN, TAP_TERM_MAX, misfires);
+
+	for (uint8_t i = 0; i < keypad_key_count; i++) {
+		const struct tap_term_stats *s = &stats[i];
+
+		if (s->taps == 0 && s->holds == 0) {
+			continue;
+		}
+
+		shell_print(sh, "key %2u: term %u ms, %u taps %u+-%u ms, "
+			    "%u holds %u+-%u ms", i, term[i], s->taps,
+			    s->tap_mean >> FRAC, s->tap_dev >> FRAC, s->holds,
+			    s->hold_mean >> FRAC, s->hold_dev >> FRAC);
+	}
+
+	return 0;
+}
+
+static int cmd_tap_term_reset(const struct shell *sh, size_t argc,
+			      char **argv)
+{
+	/* From the shell thread, a sample may land in between */
+	memset(stats, 0, sizeof(stats));
+	for (uint8_t i = 0; i < KEYPAD_MAX_KEYS; i++) {
+		tap_term_update(i);
+	}
+	config_store_changed(&tap_term_entry);
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_tap_term,
+	SHELL_CMD(show, NULL, "Print the learned terms per key",
+		  cmd_tap_term_show),
+	SHELL_CMD(reset, NULL, "Forget what was learned",
+		  cmd_tap_term_reset),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(tapterm, &sub_tap_term, "Adaptive tapping term", NULL);
+#endif /* CONFIG_SHELL */
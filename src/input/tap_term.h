@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Tapping term learned per key from the way it is typed. Every tap of
+ * a LAYER_LT or LAYER_MT key feeds a running mean and mean deviation
+ * of its press to release time, every hold one of its hold time. The
+ * key's term is then the tap mean plus four deviations, enough to tell
+ * nearly every tap of that finger as a tap, kept below the holds and
+ * within CONFIG_KEYPAD_ADAPTIVE_TERM_MIN_MS and _MAX_MS. A quick
+ * typist's keys decide sooner than the fixed term would.
+ *
+ * A hold released with no other key pressed meanwhile did nothing
+ * but wait out the term: most likely a tap that ran a little long.
+ * It is learned as a tap, so the term grows back after a misfire.
+ * Until a key has CONFIG_KEYPAD_ADAPTIVE_TERM_SAMPLES taps it keeps
+ * CONFIG_KEYPAD_TAPPING_TERM_MS. The statistics are kept in the
+ * config store, saved at most once an hour.
+ *
+ * Compiles to CONFIG_KEYPAD_TAPPING_TERM_MS for every key unless
+ * CONFIG_KEYPAD_ADAPTIVE_TERM is enabled.
+ */
+
+#ifndef KEYPAD_INPUT_TAP_TERM_H_
+#define KEYPAD_INPUT_TAP_TERM_H_
+
+#include <zephyr/zephyr.h>
+
+#if defined(CONFIG_KEYPAD_ADAPTIVE_TERM)
+
+/* Report thread: tapping term of a tap-hold key, in ms */
+uint32_t tap_term_get(uint8_t key);
+
+/*
+ * Report thread: a decided tap-hold key was released ms after its
+ * press, alone if no other key was pressed meanwhile.
+ */
+void tap_term_learn(uint8_t key, bool hold, uint32_t ms, bool alone);
+
+#else
+
+static inline uint32_t tap_term_get(uint8_t key)
+{
+	return CONFIG_KEYPAD_TAPPING_TERM_MS;
+}
+
+static inline void tap_term_learn(uint8_t key, bool hold, uint32_t ms,
+				  bool alone) {}
+
+#endif /* CONFIG_KEYPAD_ADAPTIVE_TERM */
+
+#endif /* KEYPAD_INPUT_TAP_TERM_H_ */
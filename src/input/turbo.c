@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Every held turbo key has a phase and the frame of its next step,
+ * the same state as the key repeat but one per key. A period rarely
+ * is a whole number of frames: each step carries the remainder of its
+ * half period over to the next, so the rate is exact over time and no
+ * step is more than a frame off its ideal time. Steps are scheduled
+ * from the previous step, not from the frame that applied it, so a
+ * late report does not slow the key down.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/devicetree.h>
+
+#include "keymap.h"
+#include "report.h"
+#include "input/turbo.h"
+
+/* Full speed USB frames are 1 ms */
+#define TURBO_FRAMES_PER_S 1000
+
+#define TURBO_ENTRY(node_id)						\
+	{ .key = DT_PROP(node_id, key), .rate_hz = DT_PROP(node_id, rate_hz) },
+
+#define TURBO_RATE_CHECK(node_id)					\
+	BUILD_ASSERT(DT_PROP(node_id, rate_hz) > 0 &&			\
+		     DT_PROP(node_id, rate_hz) * 2 <=			\
+		     TURBO_FRAMES_PER_S / CONFIG_USB_HID_POLL_INTERVAL_MS, \
+		     "turbo rate above half the host polling rate");
+
+struct turbo_entry {
+	/* Index into keypad_keys[] */
+	uint8_t key;
+	uint16_t rate_hz;
+};
+
+struct turbo_state {
+	/* Usage being repeated, 0 while the key is up */
+	uint8_t usage;
+	/* The turbo released it, the next step presses it again */
+	bool released;
+	/* Remainder of the half periods so far, in 1/rate_hz frames */
+	uint16_t carry;
+	/* Frame of the next step */
+	uint32_t next;
+};
+
+DT_FOREACH_CHILD_STATUS_OKAY(TURBO_NODE, TURBO_RATE_CHECK)
+
+static const struct turbo_entry entries[] = {
+	DT_FOREACH_CHILD_STATUS_OKAY(TURBO_NODE, TURBO_ENTRY)
+};
+
+BUILD_ASSERT(ARRAY_SIZE(entries) <= 32, "held entries tracked in a word");
+
+static struct turbo_state state[ARRAY_SIZE(entries)];
+/* Bit n set while the key of entries[n] is held */
+static uint32_t held;
+
+/* Frames to the next step of entry n, a period has two steps */
+static uint32_t turbo_step(size_t n)
+{
+	struct turbo_state *s = &state[n];
+	uint32_t steps_per_s = entries[n].rate_hz * 2;
+	uint32_t frames;
+
+	s->carry += TURBO_FRAMES_PER_S;
+	frames = s->carry / steps_per_s;
+	s->carry %= steps_per_s;
+
+	return frames;
+}
+
+void turbo_key(uint8_t key, uint8_t usage, bool pressed, uint32_t sof)
+{
+	for (size_t n = 0; n < ARRAY_SIZE(entries); n++) {
+		if (entries[n].key != key) {
+			continue;
+		}
+
+		if (!pressed) {
+			held &= ~BIT(n);
+		} else if (usage != 0) {
+			/* The press is in this report, release it next */
+			state[n].usage = usage;
+			state[n].released = false;
+			state[n].carry = 0;
+			state[n].next = sof + turbo_step(n);
+			held |= BIT(n);
+		}
+
+		return;
+	}
+}
+
+bool turbo_due(uint32_t sof)
+{
+	for (uint32_t pending = held; pending != 0; ) {
+		size_t n = find_lsb_set(pending) - 1;
+
+		pending &= ~BIT(n);
+		if ((int32_t)(sof - state[n].next) >= 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool turbo_frame(uint32_t sof)
+{
+	bool changed = false;
+
+	for (uint32_t pending = held; pending != 0; ) {
+		size_t n = find_lsb_set(pending) - 1;
+		struct turbo_state *s = &state[n];
+
+		pending &= ~BIT(n);
+		if ((int32_t)(sof - s->next) < 0) {
+			continue;
+		}
+
+		if (s->released) {
+			report_key_press(s->usage);
+		} else {
+			report_key_release(s->usage);
+		}
+
+		s->released = !s->released;
+		s->next += turbo_step(n);
+		if ((int32_t)(sof - s->next) >= 0) {
+			/* Frames went by without a report, e.g. suspended */
+			s->next = sof + 1;
+		}
+
+		changed = true;
+	}
+
+	return changed;
+}
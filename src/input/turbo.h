@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Turbo keys of the richeffects,keypad-turbo devicetree node: while
+ * one is held, its usage is released and pressed again at the rate-hz
+ * of its entry, up to half the host polling rate. Like the key repeat,
+ * timing is counted in USB frames by the report scheduler, with no
+ * timer or interrupt of its own.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_TURBO is enabled.
+ */
+
+#ifndef KEYPAD_INPUT_TURBO_H_
+#define KEYPAD_INPUT_TURBO_H_
+
+#include <zephyr/zephyr.h>
+
+#define TURBO_NODE DT_INST(0, richeffects_keypad_turbo)
+
+#if defined(CONFIG_KEYPAD_TURBO)
+
+/*
+ * Report thread: key of keypad_keys[] went into the report at frame
+ * sof, resolved to usage
+ */
+void turbo_key(uint8_t key, uint8_t usage, bool pressed, uint32_t sof);
+
+/* SOF interrupt: a turbo step is due at frame sof */
+bool turbo_due(uint32_t sof);
+
+/*
+ * Report thread, once per report: apply the due turbo steps. Returns
+ * true if the report changed.
+ */
+bool turbo_frame(uint32_t sof);
+
+#else
+
+static inline void turbo_key(uint8_t key, uint8_t usage, bool pressed,
+			     uint32_t sof) {}
+
+static inline bool turbo_due(uint32_t sof)
+{
+	return false;
+}
+
+static inline bool turbo_frame(uint32_t sof)
+{
+	return false;
+}
+
+#endif /* CONFIG_KEYPAD_TURBO */
+
+#endif /* KEYPAD_INPUT_TURBO_H_ */
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * State is one usage, a phase and the frame of the next step. The SOF
+ * interrupt compares its frame count with that and marks a frame
+ * pending, the report thread then applies the step while it builds the
+ * report, with the live key events of the same frame.
+ */
+
+#include <zephyr/zephyr.h>
+
+#include "report.h"
+#include "input/typematic.h"
+
+/* Full speed USB frames are 1 ms */
+#define TYPEMATIC_DELAY_FRAMES CONFIG_KEYPAD_TYPEMATIC_DELAY_MS
+#define TYPEMATIC_PERIOD_FRAMES MAX(1000 / CONFIG_KEYPAD_TYPEMATIC_RATE_HZ, 2)
+
+/* Usage being repeated, 0 for none */
+static uint8_t usage;
+/* The repeat released it, the next step presses it again */
+static bool released;
+/* Frame of the next step */
+static uint32_t next;
+
+static inline bool usage_is_modifier(uint8_t u)
+{
+	return u >= REPORT_USAGE_MODIFIER_FIRST &&
+	       u <= REPORT_USAGE_MODIFIER_LAST;
+}
+
+void typematic_key(uint8_t u, bool pressed, uint32_t sof)
+{
+	if (u == 0 || usage_is_modifier(u)) {
+		/* Shift and friends stay held under the repeated key */
+		return;
+	}
+
+	if (pressed) {
+		released = false;
+		next = sof + TYPEMATIC_DELAY_FRAMES;
+		usage = u;
+	} else if (u == usage) {
+		usage = 0;
+	}
+}
+
+bool typematic_due(uint32_t sof)
+{
+	return usage != 0 && (int32_t)(sof - next) >= 0;
+}
+
+bool typematic_frame(uint32_t sof)
+{
+	if (!typematic_due(sof)) {
+		return false;
+	}
+
+	if (released) {
+		report_key_press(usage);
+		released = false;
+		next = sof + TYPEMATIC_PERIOD_FRAMES - 1;
+	} else {
+		/* Press goes in the next report, a frame later */
+		report_key_release(usage);
+		released = true;
+		next = sof + 1;
+	}
+
+	return true;
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * On-device key repeat for hosts that do not repeat keys themselves.
+ * The last pressed non-modifier usage is repeated, after
+ * CONFIG_KEYPAD_TYPEMATIC_DELAY_MS, at CONFIG_KEYPAD_TYPEMATIC_RATE_HZ
+ * as a release and a press in consecutive reports. Timing is counted
+ * in USB frames by the report scheduler, there is no timer of its own.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_TYPEMATIC is enabled.
+ */
+
+#ifndef KEYPAD_INPUT_TYPEMATIC_H_
+#define KEYPAD_INPUT_TYPEMATIC_H_
+
+#include <zephyr/zephyr.h>
+
+#if defined(CONFIG_KEYPAD_TYPEMATIC)
+
+/* Report thread: a keyboard usage went into the report at frame sof */
+void typematic_key(uint8_t usage, bool pressed, uint32_t sof);
+
+/* SOF interrupt: a repeat step is due at frame sof */
+bool typematic_due(uint32_t sof);
+
+/*
+ * Report thread, once per report: apply a due repeat step. Returns
+ * true if the report changed.
+ */
+bool typematic_frame(uint32_t sof);
+
+#else
+
+static inline void typematic_key(uint8_t usage, bool pressed, uint32_t sof) {}
+
+static inline bool typematic_due(uint32_t sof)
+{
+	return false;
+}
+
+static inline bool typematic_frame(uint32_t sof)
+{
+	return false;
+}
+
+#endif /* CONFIG_KEYPAD_TYPEMATIC */
+
+#endif /* KEYPAD_INPUT_TYPEMATIC_H_ */
@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * The scan.h API of CONFIG_KEYPAD_SCAN_NETCORE, in place of src/scan.c:
+ * the network core image of scan/netcore scans and debounces the key
+ * lines, and only a debounced change rings the doorbell here. Edges,
+ * bounces and the debounce timers never wake the application core,
+ * which sleeps until a report has to be built.
+ *
+ * scan_init() hands the GPIO of every key to the network core before
+ * it tells it to start, so no line is configured by the wrong core. A
+ * change arrives in the doorbell interrupt and goes to the scan
+ * handler from there, in interrupt context like a local scan.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/logging/log.h>
+#include <hal/nrf_gpio.h>
+#include <keypad/scan_link.h>
+
+#include "ipc/shm_ring.h"
+#include "keymap.h"
+#include "nrf_psel.h"
+#include "scan.h"
+
+LOG_MODULE_REGISTER(scan_remote, LOG_LEVEL_INF);
+
+static scan_handler_t scan_handler;
+/* Debounced state as last handed to the scan handler */
+static keypad_bitmap_t pressed;
+
+/* Suspend, resume and refresh can come from any context */
+static int scan_remote_post(uint8_t type, uint8_t value)
+{
+	struct shm_msg *msg;
+	unsigned int key;
+	int ret;
+
+	/* The ring has one producer, keep the callers apart */
+	key = irq_lock();
+
+	msg = shm_ring_claim();
+	if (msg == NULL) {
+		irq_unlock(key);
+		LOG_WRN("Ring to the network core full");
+		return -ENOMEM;
+	}
+
+	msg->type = type;
+	msg->len = 1;
+	msg->data[0] = value;
+	ret = shm_ring_commit();
+
+	irq_unlock(key);
+
+	return ret;
+}
+
+static void scan_remote_received(void)
+{
+	const struct shm_msg *msg;
+	keypad_bitmap_t changed;
+
+	while ((msg = shm_ring_peek()) != NULL) {
+		if (msg->type == SCAN_MSG_KEYS &&
+		    msg->len == SCAN_MSG_KEYS_LEN) {
+			pressed = sys_get_le32(&msg->data[0]);
+			changed = sys_get_le32(&msg->data[4]);
+			scan_handler(pressed, changed);
+		} else {
+			LOG_WRN("Unknown message 0x%02x", msg->type);
+		}
+
+		shm_ring_release();
+	}
+}
+
+int scan_init(scan_handler_t handler)
+{
+	unsigned int key;
+
+	scan_handler = handler;
+
+	for (size_t i = 0; i < keypad_key_count; i++) {
+		if (keypad_keys[i].spec.port == NULL) {
+			/* Optional GPIO is missing. */
+			continue;
+		}
+
+		nrf_gpio_pin_control_select(nrf_psel_get(&keypad_keys[i].spec),
+					    NRF_GPIO_PIN_SEL_NETWORK);
+	}
+
+	shm_ring_callback_set(scan_remote_received);
+
+	/* Messages committed before the callback was set, off the IRQ */
+	key = irq_lock();
+	scan_remote_received();
+	irq_unlock(key);
+
+	return scan_remote_post(SCAN_MSG_START, 0);
+}
+
+keypad_bitmap_t scan_pressed_get(void)
+{
+	return pressed;
+}
+
+void scan_refresh(void)
+{
+	(void)scan_remote_post(SCAN_MSG_REFRESH, 0);
+}
+
+void scan_resync(void)
+{
+	(void)scan_remote_post(SCAN_MSG_RESYNC, 0);
+}
+
+keypad_bitmap_t scan_levels_get(keypad_bitmap_t *known)
+{
+	/* The lines belong to the network core */
+	*known = 0;
+
+	return pressed;
+}
+
+void scan_suspend(void)
+{
+	(void)scan_remote_post(SCAN_MSG_SUSPEND, 1);
+}
+
+void scan_resume(void)
+{
+	(void)scan_remote_post(SCAN_MSG_SUSPEND, 0);
+}
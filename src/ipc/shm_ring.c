@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Neither core caches SRAM, so a data memory barrier between the slot
+ * and the index is all the ordering the other core needs. The
+ * doorbell is rung on every commit; the consumer drains the ring until
+ * it is empty, so a doorbell for messages already read costs nothing.
+ */
+
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/device.h>
+#include <zephyr/devicetree.h>
+#include <zephyr/drivers/mbox.h>
+#include <zephyr/logging/log.h>
+#include <soc.h>
+
+#include "ipc/shm_ring.h"
+
+LOG_MODULE_REGISTER(shm_ring, LOG_LEVEL_INF);
+
+#define RING_NODE DT_CHOSEN(richeffects_ipc_ring)
+#define RING_SLOTS CONFIG_KEYPAD_IPC_RING_SLOTS
+
+BUILD_ASSERT(DT_NODE_EXISTS(RING_NODE),
+	     "the ring needs a richeffects,ipc-ring region, see ipc-ring.overlay");
+BUILD_ASSERT(sizeof(struct shm_region) <= DT_REG_SIZE(RING_NODE),
+	     "the rings do not fit the shared region");
+BUILD_ASSERT(IS_POWER_OF_TWO(RING_SLOTS), "slots must be a power of two");
+
+static struct shm_region *const region =
+	(struct shm_region *)DT_REG_ADDR(RING_NODE);
+
+static struct mbox_channel tx_channel;
+static struct mbox_channel rx_channel;
+
+static void (*received_cb)(void);
+static struct shm_ring_stats stats;
+
+static void doorbell(const struct device *dev, uint32_t channel,
+		     void *user_data, struct mbox_msg *data)
+{
+	stats.doorbells++;
+
+	if (received_cb != NULL) {
+		received_cb();
+	}
+}
+
+void shm_ring_callback_set(void (*received)(void))
+{
+	received_cb = received;
+}
+
+struct shm_msg *shm_ring_claim(void)
+{
+	struct shm_ring *ring = &region->to_net;
+	uint32_t head = ring->head;
+
+	if (head - *(volatile uint32_t *)&ring->tail == RING_SLOTS) {
+		stats.full++;
+		return NULL;
+	}
+
+	return &ring->slot[head % RING_SLOTS];
+}
+
+int shm_ring_commit(void)
+{
+	struct shm_ring *ring = &region->to_net;
+
+	/* The slot is complete before the network core sees the index */
+	__DMB();
+	*(volatile uint32_t *)&ring->head = ring->head + 1;
+	stats.sent++;
+
+	return mbox_send(&tx_channel, NULL);
+}
+
+const struct shm_msg *shm_ring_peek(void)
+{
+	struct shm_ring *ring = &region->to_app;
+	uint32_t tail = ring->tail;
+
+	if (*(volatile uint32_t *)&ring->head == tail) {
+		return NULL;
+	}
+
+	/* The index was published after the slot */
+	__DMB();
+
+	return &ring->slot[tail % RING_SLOTS];
+}
+
+void shm_ring_release(void)
+{
+	struct shm_ring *ring = &region->to_app;
+
+	/* Done reading before the slot is handed back */
+	__DMB();
+	*(volatile uint32_t *)&ring->tail = ring->tail + 1;
+	stats.received++;
+}
+
+void shm_ring_stats_get(struct shm_ring_stats *out)
+{
+	*out = stats;
+}
+
+static int shm_ring_init(const struct device *dev)
+{
+	const struct device *mbox = DEVICE_DT_GET(DT_NODELABEL(mbox));
+	int ret;
+
+	ARG_UNUSED(dev);
+
+	if (!device_is_ready(mbox)) {
+		LOG_ERR("IPC mailbox not ready");
+		return -ENODEV;
+	}
+
+	region->magic = 0;
+	__DMB();
+	memset(&region->to_net, 0, sizeof(region->to_net));
+	memset(&region->to_app, 0, sizeof(region->to_app));
+	__DMB();
+	/* The network core waits for this before touching the rings */
+	region->magic = SHM_RING_MAGIC;
+
+	mbox_init_channel(&tx_channel, mbox, CONFIG_KEYPAD_IPC_RING_TX_CHANNEL);
+	mbox_init_channel(&rx_channel, mbox, CONFIG_KEYPAD_IPC_RING_RX_CHANNEL);
+
+	ret = mbox_register_callback(&rx_channel, doorbell, NULL);
+	if (ret < 0) {
+		LOG_ERR("Failed to register the doorbell, error: %d", ret);
+		return ret;
+	}
+
+	ret = mbox_set_enabled(&rx_channel, true);
+	if (ret < 0) {
+		LOG_ERR("Failed to enable the doorbell, error: %d", ret);
+	}
+
+	return ret;
+}
+
+SYS_INIT(shm_ring_init, POST_KERNEL, CONFIG_APPLICATION_INIT_PRIORITY);
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static int cmd_ipc_show(const struct shell *sh, size_t argc, char **argv)
+{
+	shell_print(sh, "sent %u, ring full %u, received %u, doorbells %u",
+		    stats.sent, stats.full, stats.received, stats.doorbells);
+	shell_print(sh, "to net %u/%u, to app %u/%u",
+		    region->to_net.head - region->to_net.tail, RING_SLOTS,
+		    region->to_app.head - region->to_app.tail, RING_SLOTS);
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_ipc,
+	SHELL_CMD(show, NULL, "Print the shared-memory ring counters",
+		  cmd_ipc_show),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(ipc, &sub_ipc, "Application/network core rings", NULL);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Message rings between the application and network cores, in a
+ * region of shared SRAM with an IPC doorbell per direction. A message
+ * is written in place into its slot and read in place by the other
+ * core, nothing is copied or serialized on the way. Each ring has one
+ * producer and one consumer, so the free-running head and tail
+ * indices are the only synchronization besides a barrier.
+ *
+ * The layout below is shared with the network core image, which maps
+ * the same region (ipc-ring.overlay) and uses the doorbell channels
+ * the other way round. The application core owns the region: it
+ * clears both rings and then sets the magic word.
+ *
+ * Only available with CONFIG_KEYPAD_IPC_RING.
+ */
+
+#ifndef KEYPAD_IPC_SHM_RING_H_
+#define KEYPAD_IPC_SHM_RING_H_
+
+#include <zephyr/zephyr.h>
+
+#if defined(CONFIG_KEYPAD_IPC_RING)
+
+#define SHM_RING_MAGIC 0x52494e47
+
+/* Slot size, a message with the largest keyboard report fits */
+#define SHM_MSG_SIZE 32
+#define SHM_MSG_PAYLOAD (SHM_MSG_SIZE - 2)
+
+struct shm_msg {
+	/* Meaning is up to the user of the ring */
+	uint8_t type;
+	uint8_t len;
+	uint8_t data[SHM_MSG_PAYLOAD];
+};
+
+struct shm_ring {
+	/* Written by the producer only */
+	uint32_t head;
+	/* Written by the consumer only */
+	uint32_t tail;
+	struct shm_msg slot[CONFIG_KEYPAD_IPC_RING_SLOTS];
+};
+
+struct shm_region {
+	uint32_t magic;
+	struct shm_ring to_net;
+	struct shm_ring to_app;
+};
+
+struct shm_ring_stats {
+	uint32_t sent;
+	/* Claims refused, the ring was full */
+	uint32_t full;
+	uint32_t received;
+	uint32_t doorbells;
+};
+
+/*
+ * Called from the IPC interrupt when the network core has committed
+ * messages. The rings themselves are set up at boot.
+ */
+void shm_ring_callback_set(void (*received)(void));
+
+/*
+ * Slot of the next message to the network core, NULL if the ring is
+ * full. Fill it in place, then shm_ring_commit(). One producer only.
+ */
+struct shm_msg *shm_ring_claim(void);
+
+/* Hand the claimed message to the network core and ring its doorbell */
+int shm_ring_commit(void);
+
+/* Oldest message from the network core, NULL if none */
+const struct shm_msg *shm_ring_peek(void);
+
+/* Done with the message of shm_ring_peek(), its slot is reused */
+void shm_ring_release(void);
+
+void shm_ring_stats_get(struct shm_ring_stats *out);
+
+#endif /* CONFIG_KEYPAD_IPC_RING */
+
+#endif /* KEYPAD_IPC_SHM_RING_H_ */
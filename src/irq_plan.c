@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Zephyr drivers connect their interrupts at the devicetree priority
+ * from their init functions, which have all run by the time main
+ * starts; irq_plan_init() then moves each line to its level. The
+ * "irq show" command prints the level every line is at in the NVIC and
+ * the longest input interrupt latency measured, so each configuration
+ * can be checked on the bench.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/irq.h>
+
+#include "input/debounce_hw.h"
+#include "input/split.h"
+#include "irq_plan.h"
+
+BUILD_ASSERT(IRQ_PLAN_INPUT < IRQ_PLAN_USB,
+	     "key input must preempt USB, see src/irq_plan.h");
+BUILD_ASSERT(IRQ_PLAN_USB < IRQ_PLAN_LOW,
+	     "USB must preempt the low urgency interrupts");
+
+#if defined(CONFIG_USB_WORKQUEUE_PRIORITY)
+/* The config store, log, lighting and display threads run there */
+BUILD_ASSERT(CONFIG_USB_WORKQUEUE_PRIORITY <
+	     CONFIG_NUM_PREEMPT_PRIORITIES - 1,
+	     "the USB work queue must preempt the lowest priority threads");
+#endif
+
+struct irq_plan_line {
+	const char *name;
+	unsigned int irq;
+	unsigned int prio;
+};
+
+static const struct irq_plan_line lines[] = {
+#if DT_NODE_HAS_STATUS(DT_NODELABEL(gpiote), okay)
+	{ "gpiote", DT_IRQN(DT_NODELABEL(gpiote)), IRQ_PLAN_INPUT },
+#endif
+#if defined(CONFIG_KEYPAD_SPLIT)
+	{ "split", DT_IRQN(DT_PHANDLE(SPLIT_NODE, uart)), IRQ_PLAN_INPUT },
+#endif
+#if defined(CONFIG_KEYPAD_SCAN_NETCORE)
+	/* Key changes ring the doorbell of the network core scan */
+	{ "ipc", DT_IRQN(DT_NODELABEL(mbox)), IRQ_PLAN_INPUT },
+#endif
+#if DT_NODE_HAS_STATUS(DT_NODELABEL(usbd), okay)
+	{ "usbd", DT_IRQN(DT_NODELABEL(usbd)), IRQ_PLAN_USB },
+#endif
+#if DT_HAS_CHOSEN(zephyr_console) && \
+	DT_NODE_HAS_COMPAT(DT_CHOSEN(zephyr_console), nordic_nrf_uarte)
+	{ "console", DT_IRQN(DT_CHOSEN(zephyr_console)), IRQ_PLAN_LOW },
+#endif
+#if defined(CONFIG_KEYPAD_LED_RGB)
+	{ "rgb", DT_IRQN(DT_BUS(DT_ALIAS(led_strip))), IRQ_PLAN_LOW },
+#endif
+#if defined(CONFIG_KEYPAD_DISPLAY)
+	{ "display", DT_IRQN(DT_BUS(DT_CHOSEN(zephyr_display))),
+	  IRQ_PLAN_LOW },
+#endif
+};
+
+void irq_plan_init(void)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(lines); i++) {
+		z_arm_irq_priority_set(lines[i].irq, lines[i].prio, 0);
+	}
+}
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static int cmd_irq_show(const struct shell *sh, size_t argc, char **argv)
+{
+	shell_print(sh, "plan: input %u, usb %u, low %u", IRQ_PLAN_INPUT,
+		    IRQ_PLAN_USB, IRQ_PLAN_LOW);
+
+	for (size_t i = 0; i < ARRAY_SIZE(lines); i++) {
+		shell_print(sh, "%-8s irq %u: level %u, plan %u",
+			    lines[i].name, lines[i].irq,
+			    NVIC_GetPriority(lines[i].irq) - _IRQ_PRIO_OFFSET,
+			    lines[i].prio);
+	}
+
+#if defined(CONFIG_KEYPAD_EDGE_TIMESTAMP)
+	shell_print(sh, "input latency: %u ns worst",
+		    debounce_hw_irq_latency_ns(false));
+#else
+	shell_print(sh, "input latency: needs CONFIG_KEYPAD_EDGE_TIMESTAMP");
+#endif
+
+	return 0;
+}
+
+#if defined(CONFIG_KEYPAD_EDGE_TIMESTAMP)
+static int cmd_irq_reset(const struct shell *sh, size_t argc, char **argv)
+{
+	(void)debounce_hw_irq_latency_ns(true);
+
+	return 0;
+}
+#endif
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_irq,
+	SHELL_CMD(show, NULL, "Print the interrupt levels and latency",
+		  cmd_irq_show),
+#if defined(CONFIG_KEYPAD_EDGE_TIMESTAMP)
+	SHELL_CMD(reset, NULL, "Measure the latency again", cmd_irq_reset),
+#endif
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(irq, &sub_irq, "Interrupt priority plan", NULL);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Interrupt priority plan, three levels from Kconfig, most urgent
+ * first:
+ *
+ *   IRQ_PLAN_INPUT  key capture: GPIOTE, the scan and debounce timers,
+ *                   the shift register SPIM, QDEC, SAADC, the slider
+ *                   gate timer and the split link UART
+ *   IRQ_PLAN_USB    USBD
+ *   IRQ_PLAN_LOW    the console UART, the RGB and display SPIMs, the
+ *                   click I2S, the LED PWM and the battery SAADC
+ *
+ * A key edge is thus taken while a USB transfer or a log line is being
+ * handled, and USB while the rest is. The keypad's own interrupts are
+ * connected at their level; those of Zephyr drivers are moved to it by
+ * irq_plan_init(). The order is checked at build time.
+ *
+ * The zero latency debounce interrupt, CONFIG_KEYPAD_DEBOUNCE_HW_ZLI,
+ * is above the plan.
+ */
+
+#ifndef KEYPAD_IRQ_PLAN_H_
+#define KEYPAD_IRQ_PLAN_H_
+
+#include <zephyr/zephyr.h>
+
+#define IRQ_PLAN_INPUT CONFIG_KEYPAD_IRQ_PRIO_INPUT
+#define IRQ_PLAN_USB CONFIG_KEYPAD_IRQ_PRIO_USB
+#define IRQ_PLAN_LOW CONFIG_KEYPAD_IRQ_PRIO_LOW
+
+/* Once every driver is initialized, before the keypad's own */
+void irq_plan_init(void);
+
+#endif /* KEYPAD_IRQ_PLAN_H_ */
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/usb/class/usb_hid.h>
+
+#include "keymap.h"
+#if defined(CONFIG_KEYPAD_SCAN_MATRIX)
+#include "input/matrix.h"
+#elif defined(CONFIG_KEYPAD_SCAN_SHIFTREG)
+#include "input/shiftreg.h"
+#elif defined(CONFIG_KEYPAD_SCAN_ANALOG)
+#include "input/analog.h"
+#endif
+#include "input/split.h"
+
+/*
+ * Helper macro for initializing a gpio_dt_spec from the devicetree
+ * with fallback values when the nodes are missing.
+ */
+#define GPIO_SPEC(node_id) GPIO_DT_SPEC_GET_OR(node_id, gpios, {0})
+
+#if defined(CONFIG_KEYPAD_SPLIT) && !defined(CONFIG_KEYPAD_SPLIT_SATELLITE)
+/* The satellite's keys follow the local ones, read over the link */
+#define SPLIT_KEY(node_id, prop, idx) \
+	{ .keycode = DT_PROP_BY_IDX(node_id, prop, idx) },
+#define SPLIT_KEYS DT_FOREACH_PROP_ELEM(SPLIT_NODE, keycodes, SPLIT_KEY)
+#else
+#define SPLIT_KEYS
+#endif
+
+#if defined(CONFIG_KEYPAD_SCAN_MATRIX)
+/* Matrix positions row by row, lines are owned by the matrix scanner */
+#define MATRIX_KEY(node_id, prop, idx) \
+	{ .keycode = DT_PROP_BY_IDX(node_id, prop, idx) },
+
+const struct keypad_key keypad_keys[] = {
+	DT_FOREACH_PROP_ELEM(MATRIX_NODE, keycodes, MATRIX_KEY)
+	SPLIT_KEYS
+};
+#elif defined(CONFIG_KEYPAD_SCAN_SHIFTREG)
+/* Shift-out order, the chain is owned by the shift register reader */
+#define SHIFTREG_KEY(node_id, prop, idx) \
+	{ .keycode = DT_PROP_BY_IDX(node_id, prop, idx) },
+
+const struct keypad_key keypad_keys[] = {
+	DT_FOREACH_PROP_ELEM(SHIFTREG_NODE, keycodes, SHIFTREG_KEY)
+	SPLIT_KEYS
+};
+#elif defined(CONFIG_KEYPAD_SCAN_ANALOG)
+/* Same order as the node's ain property, sensors belong to the SAADC */
+#define ANALOG_KEY(node_id, prop, idx) \
+	{ .keycode = DT_PROP_BY_IDX(node_id, prop, idx) },
+
+const struct keypad_key keypad_keys[] = {
+	DT_FOREACH_PROP_ELEM(ANALOG_NODE, keycodes, ANALOG_KEY)
+	SPLIT_KEYS
+};
+#elif DT_HAS_COMPAT_STATUS_OKAY(richeffects_keypad_keymap)
+/*
+ * One entry per child of the keymap node. debounce-mode and
+ * release-debounce-mode are enums in the binding, listed in enum
+ * keypad_debounce_mode order.
+ */
+#define KEYMAP_NODE DT_INST(0, richeffects_keypad_keymap)
+#define KEYMAP_KEY(node_id) {						\
+	.spec = GPIO_DT_SPEC_GET(node_id, gpios),			\
+	.keycode = DT_PROP(node_id, keycode),				\
+	.debounce_mode = DT_ENUM_IDX(node_id, debounce_mode),		\
+	.release_debounce_mode =					\
+		DT_ENUM_IDX(node_id, release_debounce_mode),		\
+	.debounce_us = DT_PROP(node_id, debounce_us),			\
+	.release_debounce_us = DT_PROP(node_id, release_debounce_us),	\
+},
+
+const struct keypad_key keypad_keys[] = {
+	DT_FOREACH_CHILD_STATUS_OKAY(KEYMAP_NODE, KEYMAP_KEY)
+	SPLIT_KEYS
+};
+#else
+/* Boards without a keymap node: the first four buttons */
+const struct keypad_key keypad_keys[] = {
+	{ .spec = GPIO_SPEC(DT_ALIAS(sw0)), .keycode = HID_KEY_R },
+	{ .spec = GPIO_SPEC(DT_ALIAS(sw1)), .keycode = HID_KEY_I },
+	{ .spec = GPIO_SPEC(DT_ALIAS(sw2)), .keycode = HID_KEY_C },
+	{ .spec = GPIO_SPEC(DT_ALIAS(sw3)), .keycode = HID_KEY_H },
+	SPLIT_KEYS
+};
+#endif
+
+const size_t keypad_key_count = ARRAY_SIZE(keypad_keys);
+
+BUILD_ASSERT(ARRAY_SIZE(keypad_keys) <= KEYPAD_MAX_KEYS,
+	     "keymap exceeds KEYPAD_MAX_KEYS");
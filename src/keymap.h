@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Static keymap: one entry per physical key, stored in flash.
+ */
+
+#ifndef KEYPAD_KEYMAP_H_
+#define KEYPAD_KEYMAP_H_
+
+#include <zephyr/zephyr.h>
+#include <zephyr/drivers/gpio.h>
+
+/*
+ * Upper bound on the number of keys the scan engine tracks. Pressed
+ * state is kept as one bit per key in a keypad_bitmap_t.
+ */
+#define KEYPAD_MAX_KEYS 32
+
+typedef uint32_t keypad_bitmap_t;
+
+enum keypad_debounce_mode {
+	/* Use the mode selected by CONFIG_KEYPAD_DEBOUNCE_MODE_* */
+	KEYPAD_DEBOUNCE_DEFAULT,
+	/* Report once the line has been quiet for the whole window */
+	KEYPAD_DEBOUNCE_SETTLE,
+	/* Report the first edge, then ignore the line for the window */
+	KEYPAD_DEBOUNCE_EAGER,
+};
+
+struct keypad_key {
+	/* Input line of the key */
+	struct gpio_dt_spec spec;
+	/* Base layer action: HID usage or layer key, see layers.h */
+	uint16_t keycode;
+	/* Software debounce algorithm, enum keypad_debounce_mode */
+	uint8_t debounce_mode;
+	/* The same for releases, KEYPAD_DEBOUNCE_DEFAULT as for presses */
+	uint8_t release_debounce_mode;
+	/* Settle or hold-off window, 0 selects CONFIG_KEYPAD_DEBOUNCE_US */
+	uint16_t debounce_us;
+	/* The same for releases, 0 as for presses */
+	uint16_t release_debounce_us;
+};
+
+extern const struct keypad_key keypad_keys[];
+extern const size_t keypad_key_count;
+
+#endif /* KEYPAD_KEYMAP_H_ */
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/zephyr.h>
+
+#include "ble/ble_hid.h"
+#include "config/config_store.h"
+#include "diag/journal.h"
+#include "diag/latency.h"
+#include "diag/seqtrace.h"
+#include "diag/usage.h"
+#include "event_ring.h"
+#include "feedback/click.h"
+#include "feedback/haptic.h"
+#include "hot_path.h"
+#include "input/stuck.h"
+#include "keys.h"
+#include "led/led_pwm.h"
+#include "power/deep_sleep.h"
+#include "power/activity.h"
+#include "report_sched.h"
+#include "suspend.h"
+
+KEYPAD_HOT void keys_changed(keypad_bitmap_t pressed,
+			     keypad_bitmap_t changed)
+{
+	struct key_event event = {
+		.timestamp = latency_edge_timestamp(),
+	};
+	bool press = false;
+
+	activity_mark();
+	deep_sleep_activity();
+	ble_hid_activity();
+	config_store_activity();
+	stuck_input(pressed);
+
+	/* One event per transition, so nothing is lost before main runs */
+	while (changed != 0) {
+		event.key = find_lsb_set(changed) - 1;
+		event.pressed = (pressed & BIT(event.key)) != 0;
+		changed &= ~BIT(event.key);
+		seqtrace_detect(&event);
+
+		/* Queued or summarized, the consumer gets the state */
+		(void)event_ring_put(&event);
+		stuck_delivered(event.key, event.pressed);
+		journal_key(event.key, event.pressed);
+		usage_key(event.key, event.pressed);
+
+		if (event.pressed) {
+			led_pwm_flash(event.key % LED_PWM_COUNT);
+			press = true;
+		}
+	}
+
+	/* Feedback starts here, not from a ring reader: one per chord */
+	if (press) {
+		haptic_press();
+		click_press();
+	}
+
+	/* Lighting, MIDI and typing read the ring on their own */
+	event_ring_notify();
+
+	if (suspend_is_active()) {
+		/* Queued events are flushed once the host has resumed */
+		suspend_wakeup_request();
+		return;
+	}
+
+	report_sched_notify();
+}
@@ -0,0 +1,20 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Scan handler of the keypad: turns debounced key changes into events
+ * on the event ring and wakes the report scheduler. The hardware runs
+ * it from the scan engine, the host simulation from emulated GPIO
+ * edges, on the same path from there on.
+ */
+
+#ifndef KEYPAD_KEYS_H_
+#define KEYPAD_KEYS_H_
+
+#include "keymap.h"
+
+/* For scan_init(), from interrupt context */
+void keys_changed(keypad_bitmap_t pressed, keypad_bitmap_t changed);
+
+#endif /* KEYPAD_KEYS_H_ */
@@ -0,0 +1,1258 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Each key has a mask of the layers that map it to something other
+ * than LAYER_TRANSPARENT, built once at init. The key's effective layer
+ * is then the highest bit of (active layers & key mask), one CLZ
+ * however many layers are active. Only layer actions touch the active
+ * mask, plain key events are a single table lookup.
+ *
+ * Tap-hold keys are decided in event order: from the press of one,
+ * every later event waits in a queue until the queue decides it (its
+ * release, another key, see CONFIG_KEYPAD_PERMISSIVE_HOLD and
+ * CONFIG_KEYPAD_HOLD_ON_OTHER_KEY_PRESS) or the tapping term runs out.
+ * Tap-hold keys pressed meanwhile are queued behind it, so only one
+ * deadline is ever pending and one k_timer serves any number of them.
+ * With CONFIG_KEYPAD_ADAPTIVE_TERM the deadline is the key's own term,
+ * and every decided key tells input/tap_term.c on its release how long
+ * it was held and whether another key was pressed meanwhile.
+ *
+ * Combos are matched the same way, at the queue head, on masks built
+ * at init: key_combos[k] has a bit for every combo that contains key k
+ * and combos_of_size[n] one for every combo of n keys. ANDing the
+ * key_combos[] of the keys pressed so far leaves the combos the chord
+ * can still grow into, and the ones of its own size among them are
+ * exact matches; all constant time, however many combos there are.
+ * Keys that are in no combo never wait.
+ *
+ * Multi-tap keys are counted at the queue head too, from the presses
+ * and releases of the key queued behind its first press: another key,
+ * or a pause of CONFIG_KEYPAD_MULTI_TAP_TERM_MS, ends the count, and so
+ * does the last tap the multi-tap has an action for. They share the
+ * one deadline and timer of the tap-hold keys, and the only state is
+ * the multi-tap being counted: whatever is pressed behind it waits.
+ * Keys without a LAYER_MULTI_TAP action are never held back for it.
+ *
+ * The layer tables and masks are copied to RAM at init, into one of
+ * two keymap buffers. A remap is written into the other one, which the
+ * report thread never reads, and handed over with a single pointer
+ * write; the report thread takes it at the start of layer_get(),
+ * between two events. Held keys release what they pressed through
+ * held[], so a swap drops or repeats no keystroke.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/logging/log.h>
+
+#include "keymap.h"
+#include "layer.h"
+#include "leader.h"
+#include "macro.h"
+#include "pipeline.h"
+#include "report.h"
+#include "report_sched.h"
+#include "shortcut.h"
+#include "ble/host.h"
+#include "config/config_store.h"
+#include "config/config_xip.h"
+#include "diag/stage_bench.h"
+#include "diag/usage.h"
+#include "input/macro_rec.h"
+#include "input/tap_term.h"
+#include "usb/control.h"
+#include "usb/mouse.h"
+
+LOG_MODULE_REGISTER(layer, LOG_LEVEL_INF);
+
+#if DT_HAS_COMPAT_STATUS_OKAY(richeffects_keypad_layers)
+#define LAYERS_NODE DT_INST(0, richeffects_keypad_layers)
+
+#define LAYER_ACTION(node_id, prop, idx) DT_PROP_BY_IDX(node_id, prop, idx),
+#define LAYER_ROW(node_id) \
+	{ DT_FOREACH_PROP_ELEM(node_id, keycodes, LAYER_ACTION) },
+#define LAYER_LEN(node_id) DT_PROP_LEN(node_id, keycodes),
+
+/* Layers 1 and up, layer 0 is keypad_keys[] */
+static const uint16_t layer_map[][KEYPAD_MAX_KEYS] = {
+	DT_FOREACH_CHILD_STATUS_OKAY(LAYERS_NODE, LAYER_ROW)
+};
+
+static const uint8_t layer_len[] = {
+	DT_FOREACH_CHILD_STATUS_OKAY(LAYERS_NODE, LAYER_LEN)
+};
+
+#define LAYER_COUNT (1 + ARRAY_SIZE(layer_map))
+#else
+static const uint16_t layer_map[][KEYPAD_MAX_KEYS] = {};
+static const uint8_t layer_len[] = {};
+
+#define LAYER_COUNT 1
+#endif
+
+struct combo {
+	/* Keys to press together, one bit per keypad_keys[] index */
+	keypad_bitmap_t keys;
+	uint16_t action;
+};
+
+#if DT_HAS_COMPAT_STATUS_OKAY(richeffects_keypad_combos)
+#define COMBOS_NODE DT_INST(0, richeffects_keypad_combos)
+#define COMBO_KEY(node_id, prop, idx) BIT(DT_PROP_BY_IDX(node_id, prop, idx)) |
+#define COMBO_ENTRY(node_id) {						\
+	.keys = DT_FOREACH_PROP_ELEM(node_id, keys, COMBO_KEY) 0,	\
+	.action = DT_PROP(node_id, keycode),				\
+},
+
+static const struct combo combos[] = {
+	DT_FOREACH_CHILD_STATUS_OKAY(COMBOS_NODE, COMBO_ENTRY)
+};
+#else
+static const struct combo combos[] = {};
+#endif
+
+#define COMBO_MAX 32
+
+/* Taps a multi-tap counts at most */
+#define MULTI_TAP_MAX 4
+
+struct multi_tap {
+	/* Action of one tap, of two taps, ... */
+	uint16_t actions[MULTI_TAP_MAX];
+	uint8_t count;
+};
+
+#if DT_HAS_COMPAT_STATUS_OKAY(richeffects_keypad_multi_taps)
+#define MULTI_TAPS_NODE DT_INST(0, richeffects_keypad_multi_taps)
+#define MULTI_TAP_ACTION(node_id, prop, idx) DT_PROP_BY_IDX(node_id, prop, idx),
+#define MULTI_TAP_ENTRY(node_id) {					\
+	.actions = { DT_FOREACH_PROP_ELEM(node_id, keycodes,		\
+					  MULTI_TAP_ACTION) },		\
+	.count = DT_PROP_LEN(node_id, keycodes),			\
+},
+
+static const struct multi_tap multi_taps[] = {
+	DT_FOREACH_CHILD_STATUS_OKAY(MULTI_TAPS_NODE, MULTI_TAP_ENTRY)
+};
+#else
+static const struct multi_tap multi_taps[] = {};
+#endif
+
+BUILD_ASSERT(ARRAY_SIZE(combos) <= COMBO_MAX, "too many combos");
+
+BUILD_ASSERT(LAYER_COUNT <= LAYER_MAX, "too many keymap layers");
+
+struct keymap_buf {
+	uint16_t actions[LAYER_COUNT][KEYPAD_MAX_KEYS];
+	/* Bit n: layer n maps the key, the base layer always does */
+	uint32_t key_layers[KEYPAD_MAX_KEYS];
+};
+
+BUILD_ASSERT(LAYER_COUNT == LAYER_COUNT_BUILD &&
+	     sizeof(struct keymap_buf) == LAYER_IMAGE_SIZE,
+	     "the keymap image must have no padding");
+
+static struct keymap_buf keymaps[2];
+/* Only the report thread moves it */
+static struct keymap_buf *keymap = &keymaps[0];
+/* Committed buffer, not yet taken by the report thread */
+static atomic_ptr_t keymap_next;
+/* The inactive buffer is being written by layer_keymap_begin() */
+static atomic_t keymap_editing;
+/* Action of every held key, as resolved when it was pressed */
+static uint16_t held[KEYPAD_MAX_KEYS];
+
+static uint32_t toggled;
+/* Held momentary keys per layer */
+static uint8_t momentary[LAYER_COUNT];
+static uint32_t active = BIT(0);
+/* Modifier usages pressed through layer_apply(), bits of the report */
+static uint8_t modifiers;
+/*
+ * One-shot layers: armed by a LAYER_OSL() tap for the next key press,
+ * and of those the keys still down or already used while held
+ */
+static uint32_t oneshot;
+static uint32_t oneshot_held;
+static uint32_t oneshot_used;
+/* Frame the armed layers run out at */
+static uint32_t oneshot_deadline;
+
+#define QUEUE_SIZE CONFIG_KEYPAD_TAP_HOLD_QUEUE
+
+enum tap_hold_decision {
+	TAP_HOLD_WAIT,
+	TAP_HOLD_TAP,
+	TAP_HOLD_HOLD,
+};
+
+struct queued_event {
+	struct key_event event;
+	/* k_uptime_get_32() when taken from the event ring */
+	uint32_t time;
+};
+
+/* Events taken from the ring and not yet resolved */
+static struct queued_event queue[QUEUE_SIZE];
+static size_t queue_head;
+static size_t queue_len;
+
+/* Bit n: combo n contains the key */
+static uint32_t key_combos[KEYPAD_MAX_KEYS];
+/* Bit n: combo n has that many keys */
+static uint32_t combos_of_size[KEYPAD_MAX_KEYS + 1];
+/* Keys in any combo */
+static keypad_bitmap_t combo_keys;
+/* Combos whose action is held, and the key it is held under */
+static uint32_t combo_fired;
+static uint8_t combo_owner[COMBO_MAX];
+/* Keys taken by a combo, their releases do not reach the layers */
+static keypad_bitmap_t combo_taken;
+/* The queue head was found to start no combo */
+static bool combo_checked;
+
+/* The queue head is a tap-hold press waiting to be decided */
+static bool undecided;
+static uint16_t undecided_action;
+/* The queue head is the first press of a multi-tap being counted */
+static bool tapping;
+static uint8_t tapping_id;
+static uint32_t deadline;
+static struct k_timer decide_timer;
+/*
+ * Decided tap-hold keys still held, those decided hold and those no
+ * other key was pressed after, and when each was taken from the ring
+ */
+static keypad_bitmap_t decided_keys;
+static keypad_bitmap_t decided_hold;
+static keypad_bitmap_t decided_alone;
+static uint32_t decided_time[KEYPAD_MAX_KEYS];
+
+/* A leader sequence is being typed, never in a build without one */
+static inline bool layer_leader_active(void)
+{
+	return PIPELINE_LEADER && leader_active();
+}
+
+/* Presses only */
+static uint16_t layer_resolve(uint8_t key)
+{
+	uint8_t layer = find_msb_set(active & keymap->key_layers[key]) - 1;
+	uint16_t action;
+
+	usage_layer(layer);
+
+	/* Typing into a leader sequence is never a shortcut */
+	if (PIPELINE_SHORTCUTS && !layer_leader_active() &&
+	    shortcut_lookup(layer, key, modifiers | report_oneshot_get(),
+			    &action)) {
+		return action;
+	}
+
+	return keymap->actions[layer][key];
+}
+
+static void layer_update(void)
+{
+	uint32_t mask = BIT(0) | toggled | oneshot;
+
+	for (uint8_t i = 1; i < LAYER_COUNT; i++) {
+		if (momentary[i] != 0) {
+			mask |= BIT(i);
+		}
+	}
+
+	active = mask;
+}
+
+static inline bool action_is_tap_hold(uint16_t action)
+{
+	uint16_t kind = action & LAYER_ACTION_TAP_HOLD_MASK;
+
+	return kind == LAYER_ACTION_LT || kind == LAYER_ACTION_MT;
+}
+
+static bool layer_action_valid(uint16_t action)
+{
+	if ((action & LAYER_ACTION_TAP_HOLD_MASK) == LAYER_ACTION_LT) {
+		return ((action >> 8) & 0x1f) < LAYER_COUNT &&
+		       report_usage_reportable(action & 0xff);
+	}
+
+	if ((action & LAYER_ACTION_TAP_HOLD_MASK) == LAYER_ACTION_MT) {
+		return (action & 0x1800) == 0 &&
+		       report_usage_reportable(action & 0xff);
+	}
+
+	if ((action & LAYER_ACTION_TAP_HOLD_MASK) == LAYER_ACTION_CONSUMER ||
+	    (action & LAYER_ACTION_TAP_HOLD_MASK) == LAYER_ACTION_SYSTEM) {
+		return IS_ENABLED(CONFIG_KEYPAD_HID_CONTROL);
+	}
+
+	if ((action & LAYER_ACTION_TAP_HOLD_MASK) == LAYER_ACTION_MOUSE) {
+		return IS_ENABLED(CONFIG_KEYPAD_MOUSE_KEYS);
+	}
+
+	switch (action & LAYER_ACTION_MASK) {
+	case LAYER_ACTION_USAGE:
+		return report_usage_reportable(action);
+	case LAYER_ACTION_NONE:
+		return true;
+	case LAYER_ACTION_LEADER:
+		return action == LAYER_LEADER;
+	case LAYER_ACTION_MO:
+	case LAYER_ACTION_TG:
+		return (action & ~LAYER_ACTION_MASK) < LAYER_COUNT;
+	case LAYER_ACTION_MACRO:
+		return (action & ~LAYER_ACTION_MASK) < macro_count();
+	case LAYER_ACTION_HOST:
+		return (action & ~LAYER_ACTION_MASK) < HOST_SLOTS;
+	case LAYER_ACTION_OSM:
+		return (action & ~LAYER_ACTION_MASK) >=
+		       REPORT_USAGE_MODIFIER_FIRST &&
+		       (action & ~LAYER_ACTION_MASK) <=
+		       REPORT_USAGE_MODIFIER_LAST;
+	case LAYER_ACTION_OSL:
+		return (action & ~LAYER_ACTION_MASK) < LAYER_COUNT;
+	case LAYER_ACTION_MULTI_TAP:
+		return (action & ~LAYER_ACTION_MASK) < ARRAY_SIZE(multi_taps);
+	case LAYER_ACTION_MACRO_RECORD:
+		return IS_ENABLED(CONFIG_KEYPAD_MACRO_RECORD) &&
+		       (action & ~LAYER_ACTION_MASK) < MACRO_MAX;
+	default:
+		return false;
+	}
+}
+
+/* A LAYER_OSL() key, the same three taps as a one-shot modifier */
+static void oneshot_layer_set(uint8_t layer, bool pressed)
+{
+	uint32_t bit = BIT(layer);
+
+	if (!pressed) {
+		oneshot_held &= ~bit;
+		if (oneshot_used & bit) {
+			/* Keys went down under it: momentary */
+			oneshot &= ~bit;
+			oneshot_used &= ~bit;
+		}
+	} else if (toggled & bit) {
+		toggled &= ~bit;
+	} else if ((oneshot & bit) && !(oneshot_used & bit)) {
+		/* Second tap: on until tapped once more */
+		oneshot &= ~bit;
+		toggled |= bit;
+	} else {
+		oneshot |= bit;
+		oneshot_held |= bit;
+		oneshot_deadline = report_sched_sof_count() +
+				   CONFIG_KEYPAD_ONESHOT_TIMEOUT_MS;
+	}
+
+	layer_update();
+}
+
+/* A key was pressed on the layers, armed ones not held are spent */
+static void oneshot_layer_spend(void)
+{
+	oneshot_used |= oneshot;
+	if (oneshot & ~oneshot_held) {
+		oneshot &= oneshot_held;
+		oneshot_used &= oneshot_held;
+		layer_update();
+	}
+}
+
+static void decide_timer_expired(struct k_timer *timer)
+{
+	/* The report thread decides on its next pass */
+	report_sched_notify();
+}
+
+static void keymap_masks_build(struct keymap_buf *buf)
+{
+	for (uint8_t i = 0; i < keypad_key_count; i++) {
+		uint32_t mask = BIT(0);
+
+		for (uint8_t l = 1; l < LAYER_COUNT; l++) {
+			if (buf->actions[l][i] != LAYER_TRANSPARENT) {
+				mask |= BIT(l);
+			}
+		}
+
+		buf->key_layers[i] = mask;
+	}
+}
+
+static struct keymap_buf *keymap_inactive(void)
+{
+	return keymap == &keymaps[0] ? &keymaps[1] : &keymaps[0];
+}
+
+#if defined(CONFIG_KEYPAD_CONFIG_STORE)
+BUILD_ASSERT(sizeof(keymaps[0].actions) <= CONFIG_KEYPAD_CONFIG_STORE_MAX_SIZE,
+	     "the keymap must fit a stored value");
+
+/*
+ * The latest keymap committed, taken or not. A commit racing the copy
+ * marks the entry changed again, so the store ends up with the last one.
+ */
+static ssize_t keymap_store_get(void *buf, size_t size)
+{
+	const struct keymap_buf *latest = atomic_ptr_get(&keymap_next);
+
+	if (latest == NULL) {
+		latest = keymap;
+	}
+
+	if (size < sizeof(latest->actions)) {
+		return -ENOSPC;
+	}
+
+	memcpy(buf, latest->actions, sizeof(latest->actions));
+
+	return sizeof(latest->actions);
+}
+
+static int keymap_store_set(const void *data, size_t len)
+{
+	const uint16_t (*actions)[KEYPAD_MAX_KEYS] = data;
+	int ret;
+
+	if (len != sizeof(keymaps[0].actions)) {
+		/* Stored for other layers or keys */
+		return -EINVAL;
+	}
+
+	ret = layer_keymap_begin();
+	if (ret < 0) {
+		return ret;
+	}
+
+	for (uint8_t layer = 0; layer < LAYER_COUNT; layer++) {
+		for (uint8_t key = 0; key < keypad_key_count; key++) {
+			ret = layer_keymap_set(layer, key, actions[layer][key]);
+			if (ret < 0) {
+				layer_keymap_abort();
+				return ret;
+			}
+		}
+	}
+
+	return layer_keymap_commit();
+}
+#endif /* CONFIG_KEYPAD_CONFIG_STORE */
+
+static struct config_entry keymap_entry = {
+	.name = "keypad/keymap",
+#if defined(CONFIG_KEYPAD_CONFIG_STORE)
+	.get = keymap_store_get,
+	.set = keymap_store_set,
+#endif
+#if defined(CONFIG_KEYPAD_CONFIG_XIP)
+	.xip = XIP_TABLE_KEYMAP,
+#endif
+};
+
+int layer_init(void)
+{
+	for (uint8_t l = 0; l < LAYER_COUNT; l++) {
+		if (l > 0 && layer_len[l - 1] != keypad_key_count) {
+			LOG_ERR("Layer %u has %u keys, keymap has %u", l,
+				layer_len[l - 1], keypad_key_count);
+			return -EINVAL;
+		}
+
+		for (uint8_t i = 0; i < keypad_key_count; i++) {
+			uint16_t action = l == 0 ? keypad_keys[i].keycode :
+						   layer_map[l - 1][i];
+
+			if (!layer_action_valid(action)) {
+				LOG_ERR("Layer %u key %u: bad action 0x%04x",
+					l, i, action);
+				return -EINVAL;
+			}
+
+			keymaps[0].actions[l][i] = action;
+		}
+	}
+
+	keymap_masks_build(&keymaps[0]);
+
+	for (uint8_t c = 0; c < ARRAY_SIZE(combos); c++) {
+		keypad_bitmap_t keys = combos[c].keys;
+
+		if (__builtin_popcount(keys) < 2 ||
+		    keys >= BIT64(keypad_key_count) ||
+		    !layer_action_valid(combos[c].action) ||
+		    action_is_tap_hold(combos[c].action)) {
+			LOG_ERR("Combo %u: bad keys 0x%08x or action 0x%04x",
+				c, keys, combos[c].action);
+			return -EINVAL;
+		}
+
+		combos_of_size[__builtin_popcount(keys)] |= BIT(c);
+		combo_keys |= keys;
+		while (keys != 0) {
+			uint8_t i = find_lsb_set(keys) - 1;
+
+			key_combos[i] |= BIT(c);
+			keys &= ~BIT(i);
+		}
+	}
+
+	for (uint8_t m = 0; m < ARRAY_SIZE(multi_taps); m++) {
+		const struct multi_tap *mt = &multi_taps[m];
+
+		if (mt->count < 2 || mt->count > MULTI_TAP_MAX) {
+			LOG_ERR("Multi-tap %u: %u actions", m, mt->count);
+			return -EINVAL;
+		}
+
+		for (uint8_t t = 0; t < mt->count; t++) {
+			uint16_t action = mt->actions[t];
+
+			if (!layer_action_valid(action) ||
+			    action_is_tap_hold(action) ||
+			    (action & LAYER_ACTION_MASK) ==
+			    LAYER_ACTION_MULTI_TAP) {
+				LOG_ERR("Multi-tap %u: bad action 0x%04x",
+					m, action);
+				return -EINVAL;
+			}
+		}
+	}
+
+	for (uint16_t s = 0; s < shortcut_slot_count; s++) {
+		const struct shortcut_entry *e = &shortcut_entries[s];
+
+		if (e->trigger == SHORTCUT_TRIGGER_NONE) {
+			continue;
+		}
+
+		if ((e->trigger >> 16) >= LAYER_COUNT ||
+		    (e->trigger & 0xff) >= keypad_key_count ||
+		    !layer_action_valid(e->action) ||
+		    action_is_tap_hold(e->action)) {
+			LOG_ERR("Shortcut 0x%06x: bad layer, key or action "
+				"0x%04x", e->trigger, e->action);
+			return -EINVAL;
+		}
+	}
+
+	k_timer_init(&decide_timer, decide_timer_expired, NULL);
+
+	/* The tables above check the devicetree keymap, the stored one next */
+	if (config_store_register(&keymap_entry) < 0) {
+		LOG_WRN("Stored keymap not loaded");
+	}
+
+	return 0;
+}
+
+static inline struct queued_event *queue_at(size_t i)
+{
+	return &queue[(queue_head + i) % QUEUE_SIZE];
+}
+
+static void queue_fill(uint32_t now)
+{
+	while (queue_len < QUEUE_SIZE) {
+		struct queued_event *q = queue_at(queue_len);
+
+		if (event_ring_get(&q->event, 1) == 0) {
+			break;
+		}
+
+		q->time = now;
+		queue_len++;
+	}
+}
+
+static void queue_pop(void)
+{
+	queue_head = (queue_head + 1) % QUEUE_SIZE;
+	queue_len--;
+}
+
+/* Decide the tap-hold key at the queue head from what came after it */
+static enum tap_hold_decision tap_hold_decide(uint32_t now)
+{
+	uint8_t key = queue_at(0)->event.key;
+	keypad_bitmap_t pressed = 0;
+
+	for (size_t i = 1; i < queue_len; i++) {
+		const struct queued_event *q = queue_at(i);
+
+		if ((int32_t)(q->time - deadline) >= 0) {
+			/* The term ran out before this event */
+			return TAP_HOLD_HOLD;
+		}
+
+		if (q->event.key == key) {
+			if (!q->event.pressed) {
+				return TAP_HOLD_TAP;
+			}
+		} else if (q->event.pressed) {
+			if (IS_ENABLED(CONFIG_KEYPAD_HOLD_ON_OTHER_KEY_PRESS)) {
+				return TAP_HOLD_HOLD;
+			}
+			pressed |= BIT(q->event.key);
+		} else if (IS_ENABLED(CONFIG_KEYPAD_PERMISSIVE_HOLD) &&
+			   (pressed & BIT(q->event.key))) {
+			/* A whole key press nested in the tap-hold key */
+			return TAP_HOLD_HOLD;
+		}
+	}
+
+	if ((int32_t)(now - deadline) >= 0 || queue_len == QUEUE_SIZE) {
+		return TAP_HOLD_HOLD;
+	}
+
+	return TAP_HOLD_WAIT;
+}
+
+/*
+ * Count the taps of the multi-tap key at the queue head. Returns false
+ * while another tap can still come, else true with *taps and *len, the
+ * queued events of the key that make them up.
+ */
+static bool multi_tap_decide(uint32_t now, uint8_t *taps, size_t *len)
+{
+	const struct queued_event *head = queue_at(0);
+	uint8_t max = multi_taps[tapping_id].count;
+	uint32_t last = head->time;
+	size_t i;
+
+	*taps = 1;
+	for (i = 1; i < queue_len && *taps < max; i++) {
+		const struct queued_event *q = queue_at(i);
+
+		if (q->event.key != head->event.key ||
+		    (int32_t)(q->time - last) >=
+		    CONFIG_KEYPAD_MULTI_TAP_TERM_MS) {
+			/* Another key or a pause ends the count */
+			break;
+		}
+
+		if (q->event.pressed) {
+			(*taps)++;
+		}
+		last = q->time;
+	}
+
+	*len = i;
+	if (i < queue_len || *taps == max || queue_len == QUEUE_SIZE ||
+	    (int32_t)(now - last) >= CONFIG_KEYPAD_MULTI_TAP_TERM_MS) {
+		return true;
+	}
+
+	deadline = last + CONFIG_KEYPAD_MULTI_TAP_TERM_MS;
+
+	return false;
+}
+
+/* Timing of the tap-hold keys for the adaptive term, d for a decided one */
+static void tap_hold_track(const struct queued_event *q,
+			   enum tap_hold_decision d)
+{
+	uint8_t key = q->event.key;
+
+	if (!IS_ENABLED(CONFIG_KEYPAD_ADAPTIVE_TERM)) {
+		return;
+	}
+
+	if (q->event.pressed) {
+		decided_alone = 0;
+		if (d != TAP_HOLD_WAIT) {
+			decided_keys |= BIT(key);
+			decided_alone |= BIT(key);
+			WRITE_BIT(decided_hold, key, d == TAP_HOLD_HOLD);
+			decided_time[key] = q->time;
+		}
+	} else if (decided_keys & BIT(key)) {
+		decided_keys &= ~BIT(key);
+		tap_term_learn(key, (decided_hold & BIT(key)) != 0,
+			       q->time - decided_time[key],
+			       (decided_alone & BIT(key)) != 0);
+	}
+}
+
+/* Action a decided tap-hold key runs until it is released */
+static uint16_t tap_hold_action(uint16_t action, bool hold)
+{
+	uint8_t arg = (action >> 8) & 0x1f;
+
+	if (!hold) {
+		return action & 0xff;
+	}
+
+	if ((action & LAYER_ACTION_TAP_HOLD_MASK) == LAYER_ACTION_LT) {
+		return LAYER_MO(arg);
+	}
+
+	return REPORT_USAGE_MODIFIER_FIRST + arg;
+}
+
+enum combo_decision {
+	COMBO_WAIT,
+	COMBO_NONE,
+	COMBO_FIRE,
+};
+
+/*
+ * Match the presses at the head of the queue against the combos. On
+ * COMBO_FIRE, *combo is the match and *len the number of presses it
+ * takes from the queue.
+ */
+static enum combo_decision combo_decide(uint32_t now, uint8_t *combo,
+					size_t *len)
+{
+	const struct queued_event *head = queue_at(0);
+	uint32_t end = head->time + CONFIG_KEYPAD_COMBO_TERM_MS;
+	uint32_t candidates = key_combos[head->event.key];
+	keypad_bitmap_t chord = BIT(head->event.key);
+	uint32_t exact = 0;
+	size_t i;
+
+	for (i = 1; i < queue_len; i++) {
+		const struct queued_event *q = queue_at(i);
+
+		if ((int32_t)(q->time - end) >= 0 || !q->event.pressed ||
+		    (chord & BIT(q->event.key)) ||
+		    (candidates & key_combos[q->event.key]) == 0) {
+			/* Window over, a release or a key off every combo */
+			break;
+		}
+
+		chord |= BIT(q->event.key);
+		candidates &= key_combos[q->event.key];
+	}
+
+	exact = candidates & combos_of_size[__builtin_popcount(chord)];
+
+	if (i == queue_len && (candidates & ~exact) != 0 &&
+	    (int32_t)(now - end) < 0 && queue_len < QUEUE_SIZE) {
+		/* A longer combo can still complete */
+		deadline = end;
+		return COMBO_WAIT;
+	}
+
+	if (exact == 0) {
+		return COMBO_NONE;
+	}
+
+	*combo = find_lsb_set(exact) - 1;
+	*len = __builtin_popcount(chord);
+
+	return COMBO_FIRE;
+}
+
+/*
+ * Run the action of one event. Returns true and fills out if the report
+ * changes.
+ */
+static bool layer_apply(const struct key_event *event, uint16_t action,
+			struct key_event *out)
+{
+	uint8_t layer;
+	uint8_t mods;
+
+	if (event->pressed) {
+		held[event->key] = action;
+	} else {
+		action = held[event->key];
+		held[event->key] = LAYER_TRANSPARENT;
+	}
+
+	layer = action & ~LAYER_ACTION_MASK;
+
+	if (event->pressed && oneshot != 0 &&
+	    (action & LAYER_ACTION_MASK) != LAYER_ACTION_OSL &&
+	    (action & LAYER_ACTION_MASK) != LAYER_ACTION_OSM) {
+		/* Resolved on the armed layers already */
+		oneshot_layer_spend();
+	}
+
+	if ((action & LAYER_ACTION_TAP_HOLD_MASK) == LAYER_ACTION_CONSUMER) {
+		control_consumer_set(action & ~LAYER_ACTION_TAP_HOLD_MASK,
+				     event->pressed);
+		return false;
+	}
+
+	if ((action & LAYER_ACTION_TAP_HOLD_MASK) == LAYER_ACTION_SYSTEM) {
+		control_system_set(action & ~LAYER_ACTION_TAP_HOLD_MASK,
+				   event->pressed);
+		return false;
+	}
+
+	if ((action & LAYER_ACTION_TAP_HOLD_MASK) == LAYER_ACTION_MOUSE) {
+		mouse_key_set(action & ~LAYER_ACTION_TAP_HOLD_MASK,
+			      event->pressed);
+		return false;
+	}
+
+	switch (action & LAYER_ACTION_MASK) {
+	case LAYER_ACTION_USAGE:
+		if (event->pressed && layer_leader_active()) {
+			/* Typed into the sequence, the release sends nothing */
+			held[event->key] = LAYER_NONE;
+			leader_feed(action);
+			return false;
+		}
+		if (action >= REPORT_USAGE_MODIFIER_FIRST &&
+		    action <= REPORT_USAGE_MODIFIER_LAST) {
+			WRITE_BIT(modifiers,
+				  action - REPORT_USAGE_MODIFIER_FIRST,
+				  event->pressed);
+		}
+		*out = *event;
+		out->usage = action;
+		return true;
+	case LAYER_ACTION_MO:
+		if (event->pressed) {
+			momentary[layer]++;
+		} else if (momentary[layer] > 0) {
+			momentary[layer]--;
+		}
+		layer_update();
+		return false;
+	case LAYER_ACTION_TG:
+		if (event->pressed) {
+			toggled ^= BIT(layer);
+			layer_update();
+		}
+		return false;
+	case LAYER_ACTION_MACRO:
+		if (event->pressed) {
+			macro_play(layer);
+		}
+		return false;
+	case LAYER_ACTION_MACRO_RECORD:
+		if (event->pressed) {
+			macro_rec_toggle(layer);
+		}
+		return false;
+	case LAYER_ACTION_LEADER:
+		if (PIPELINE_LEADER && event->pressed) {
+			leader_start();
+		}
+		return false;
+	case LAYER_ACTION_HOST:
+		if (event->pressed) {
+			(void)host_select(layer);
+		}
+		return false;
+	case LAYER_ACTION_OSM:
+		/* Bits of the report, the usage never goes into it */
+		mods = BIT(layer - REPORT_USAGE_MODIFIER_FIRST);
+		if (event->pressed) {
+			report_oneshot_press(mods, report_sched_sof_count());
+		} else {
+			report_oneshot_release(mods);
+		}
+		return false;
+	case LAYER_ACTION_OSL:
+		oneshot_layer_set(layer, event->pressed);
+		return false;
+	default:
+		return false;
+	}
+}
+
+int layer_keymap_begin(void)
+{
+	if (atomic_set(&keymap_editing, 1) != 0) {
+		return -EBUSY;
+	}
+
+	if (atomic_ptr_get(&keymap_next) != NULL) {
+		/* The last commit has not been taken yet */
+		atomic_set(&keymap_editing, 0);
+		return -EBUSY;
+	}
+
+	*keymap_inactive() = *keymap;
+
+	return 0;
+}
+
+int layer_keymap_set(uint8_t layer, uint8_t key, uint16_t action)
+{
+	if (atomic_get(&keymap_editing) == 0) {
+		return -EACCES;
+	}
+
+	if (layer >= LAYER_COUNT || key >= keypad_key_count ||
+	    !layer_action_valid(action)) {
+		return -EINVAL;
+	}
+
+	keymap_inactive()->actions[layer][key] = action;
+
+	return 0;
+}
+
+/* Hand an edited buffer to the report thread and end the edit */
+static void keymap_publish(struct keymap_buf *buf, bool store)
+{
+	atomic_ptr_set(&keymap_next, buf);
+	atomic_set(&keymap_editing, 0);
+
+	/* Swap even when no key is pressed meanwhile */
+	report_sched_notify();
+	if (store) {
+		config_store_changed(&keymap_entry);
+	}
+}
+
+int layer_keymap_commit(void)
+{
+	struct keymap_buf *buf = keymap_inactive();
+
+	if (atomic_get(&keymap_editing) == 0) {
+		return -EACCES;
+	}
+
+	keymap_masks_build(buf);
+	keymap_publish(buf, true);
+
+	return 0;
+}
+
+uint8_t *layer_keymap_image(size_t *size)
+{
+	if (atomic_get(&keymap_editing) == 0) {
+		return NULL;
+	}
+
+	*size = sizeof(struct keymap_buf);
+
+	return (uint8_t *)keymap_inactive();
+}
+
+int layer_keymap_image_verify(const uint8_t *image)
+{
+	const struct keymap_buf *buf = (const struct keymap_buf *)image;
+
+	for (uint8_t i = 0; i < keypad_key_count; i++) {
+		uint32_t mask = buf->key_layers[i];
+
+		/* A layer past the last would be looked up out of range */
+		if ((mask & BIT(0)) == 0 ||
+		    (mask & ~GENMASK(LAYER_COUNT - 1, 0)) != 0) {
+			return -EINVAL;
+		}
+
+		for (uint8_t l = 0; l < LAYER_COUNT; l++) {
+			if (!layer_action_valid(buf->actions[l][i])) {
+				return -EINVAL;
+			}
+		}
+	}
+
+	return 0;
+}
+
+int layer_keymap_image_check(void)
+{
+	if (atomic_get(&keymap_editing) == 0) {
+		return -EACCES;
+	}
+
+	return layer_keymap_image_verify((const uint8_t *)keymap_inactive());
+}
+
+static int keymap_image_publish(bool store)
+{
+	int ret = layer_keymap_image_check();
+
+	if (ret < 0) {
+		atomic_set(&keymap_editing, 0);
+		return ret;
+	}
+
+	keymap_publish(keymap_inactive(), store);
+
+	return 0;
+}
+
+int layer_keymap_image_commit(void)
+{
+	return keymap_image_publish(true);
+}
+
+int layer_keymap_image_swap(void)
+{
+	return keymap_image_publish(false);
+}
+
+void layer_keymap_abort(void)
+{
+	atomic_set(&keymap_editing, 0);
+}
+
+uint8_t layer_count(void)
+{
+	return LAYER_COUNT;
+}
+
+uint16_t layer_keymap_get(uint8_t layer, uint8_t key)
+{
+	if (layer >= LAYER_COUNT || key >= keypad_key_count) {
+		return LAYER_NONE;
+	}
+
+	return keymap->actions[layer][key];
+}
+
+size_t layer_get(struct key_event *out, size_t max)
+{
+	uint32_t bench = stage_bench_begin();
+	uint32_t now = k_uptime_get_32();
+	struct keymap_buf *next = atomic_ptr_set(&keymap_next, NULL);
+	size_t count = 0;
+
+	if (next != NULL) {
+		keymap = next;
+	}
+
+	queue_fill(now);
+
+	while (count < max && queue_len > 0) {
+		struct queued_event *head = queue_at(0);
+		enum tap_hold_decision decided = TAP_HOLD_WAIT;
+		uint16_t action = LAYER_TRANSPARENT;
+
+		if (PIPELINE_COMBOS && !undecided && !combo_checked &&
+		    head->event.pressed &&
+		    (combo_keys & BIT(head->event.key))) {
+			struct key_event press = head->event;
+			uint32_t combo_bench = stage_bench_begin();
+			enum combo_decision d;
+			uint8_t c;
+			size_t len;
+
+			d = combo_decide(now, &c, &len);
+			stage_bench_end(STAGE_BENCH_COMBO, combo_bench);
+			if (d == COMBO_WAIT) {
+				k_timer_start(&decide_timer,
+					      K_MSEC(deadline - now), K_NO_WAIT);
+				break;
+			}
+
+			if (d == COMBO_FIRE) {
+				/* Held under the first key of the chord */
+				combo_fired |= BIT(c);
+				combo_owner[c] = press.key;
+				combo_taken |= combos[c].keys;
+				if (layer_apply(&press, combos[c].action,
+						&out[count])) {
+					count++;
+				}
+
+				while (len-- > 0) {
+					queue_pop();
+				}
+				queue_fill(now);
+				continue;
+			}
+
+			combo_checked = true;
+		}
+
+		if (PIPELINE_COMBOS && !head->event.pressed &&
+		    (combo_taken & BIT(head->event.key))) {
+			struct key_event release = head->event;
+			uint32_t fired = combo_fired;
+
+			combo_taken &= ~BIT(release.key);
+			queue_pop();
+			queue_fill(now);
+
+			/* First key up releases the combo, the rest are dropped */
+			while (fired != 0) {
+				uint8_t c = find_lsb_set(fired) - 1;
+
+				fired &= ~BIT(c);
+				if (combos[c].keys & BIT(release.key)) {
+					combo_fired &= ~BIT(c);
+					release.key = combo_owner[c];
+					if (layer_apply(&release, 0, &out[count])) {
+						count++;
+					}
+					break;
+				}
+			}
+			continue;
+		}
+
+		if (undecided) {
+			enum tap_hold_decision d = tap_hold_decide(now);
+
+			if (d == TAP_HOLD_WAIT) {
+				k_timer_start(&decide_timer,
+					      K_MSEC(deadline - now), K_NO_WAIT);
+				break;
+			}
+
+			undecided = false;
+			decided = d;
+			action = tap_hold_action(undecided_action,
+						 d == TAP_HOLD_HOLD);
+		} else if (PIPELINE_MULTI_TAP && tapping) {
+			uint8_t taps;
+			size_t len;
+
+			if (!multi_tap_decide(now, &taps, &len)) {
+				k_timer_start(&decide_timer,
+					      K_MSEC(deadline - now), K_NO_WAIT);
+				break;
+			}
+
+			if (!queue_at(len - 1)->event.pressed &&
+			    count + 2 > max) {
+				/* A tap takes two, in the next batch */
+				break;
+			}
+
+			tapping = false;
+			tap_hold_track(head, TAP_HOLD_WAIT);
+			action = multi_taps[tapping_id].actions[taps - 1];
+
+			/* Down to the last edge of the key, which runs it */
+			while (len-- > 1) {
+				queue_pop();
+			}
+			head = queue_at(0);
+
+			if (!head->event.pressed) {
+				/* Tapped: pressed here, released by the edge */
+				struct key_event press = head->event;
+
+				press.pressed = true;
+				if (layer_apply(&press, action, &out[count])) {
+					count++;
+				}
+				action = LAYER_TRANSPARENT;
+			}
+		} else if (head->event.pressed) {
+			action = layer_resolve(head->event.key);
+			if (action_is_tap_hold(action)) {
+				undecided = true;
+				undecided_action = action;
+				deadline = head->time +
+					   tap_term_get(head->event.key);
+				continue;
+			}
+
+			if (PIPELINE_MULTI_TAP &&
+			    (action & LAYER_ACTION_MASK) ==
+			    LAYER_ACTION_MULTI_TAP) {
+				tapping = true;
+				tapping_id = action & ~LAYER_ACTION_MASK;
+				continue;
+			}
+		}
+
+		tap_hold_track(head, decided);
+		if (layer_apply(&head->event, action, &out[count])) {
+			count++;
+		}
+
+		combo_checked = false;
+		queue_pop();
+		queue_fill(now);
+	}
+
+	stage_bench_end(STAGE_BENCH_RESOLVE, bench);
+
+	return count;
+}
+
+bool layer_oneshot_due(uint32_t sof)
+{
+	return CONFIG_KEYPAD_ONESHOT_TIMEOUT_MS > 0 &&
+	       (oneshot & ~oneshot_held & ~oneshot_used) != 0 &&
+	       (int32_t)(sof - oneshot_deadline) >= 0;
+}
+
+void layer_oneshot_frame(uint32_t sof)
+{
+	if (layer_oneshot_due(sof)) {
+		oneshot &= oneshot_held | oneshot_used;
+		layer_update();
+	}
+}
+
+uint32_t layer_active_get(void)
+{
+	return active;
+}
+
+uint32_t layer_toggled_get(void)
+{
+	return toggled;
+}
+
+void layer_toggled_set(uint32_t mask)
+{
+	/* Layers of this keymap, the base layer is always on */
+	toggled = mask & GENMASK(LAYER_COUNT - 1, 1);
+	layer_update();
+}
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static int cmd_layer_show(const struct shell *sh, size_t argc, char **argv)
+{
+	shell_print(sh, "layers: %u, active: 0x%08x, toggled: 0x%08x",
+		    LAYER_COUNT, active, toggled);
+	shell_print(sh, "one-shot layers: 0x%08x, modifiers: 0x%02x",
+		    oneshot, report_oneshot_get());
+	shell_print(sh, "queued: %u, tap-hold pending: %s, multi-tap "
+		    "pending: %s", queue_len, undecided ? "yes" : "no",
+		    tapping ? "yes" : "no");
+	shell_print(sh, "combos: %u, held: 0x%08x", ARRAY_SIZE(combos),
+		    combo_fired);
+
+	return 0;
+}
+
+static int cmd_layer_set(const struct shell *sh, size_t argc, char **argv)
+{
+	uint8_t layer = strtoul(argv[1], NULL, 0);
+	uint8_t key = strtoul(argv[2], NULL, 0);
+	uint16_t action = strtoul(argv[3], NULL, 0);
+	int err;
+
+	err = layer_keymap_begin();
+	if (err) {
+		shell_error(sh, "Keymap busy");
+		return err;
+	}
+
+	err = layer_keymap_set(layer, key, action);
+	if (err) {
+		layer_keymap_abort();
+		shell_error(sh, "Bad layer, key or action");
+		return err;
+	}
+
+	return layer_keymap_commit();
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_layer,
+	SHELL_CMD(show, NULL, "Print the active layers", cmd_layer_show),
+	SHELL_CMD_ARG(set, NULL, "Remap a key: <layer> <key> <action>",
+		      cmd_layer_set, 4, 0),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(layer, &sub_layer, "Keymap layers", NULL);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Keymap layers. Resolves key events through the active layers and
+ * the tap-hold keys, applies layer actions and hands out the events
+ * that change the report.
+ */
+
+#ifndef KEYPAD_LAYER_H_
+#define KEYPAD_LAYER_H_
+
+#include <zephyr/zephyr.h>
+#include <dt-bindings/keypad/layers.h>
+
+#include "event_ring.h"
+#include "keymap.h"
+
+/* Base keymap plus the children of the richeffects,keypad-layers node */
+#define LAYER_MAX 32
+
+#if DT_HAS_COMPAT_STATUS_OKAY(richeffects_keypad_layers)
+#define LAYER_COUNT_ONE(node_id) + 1
+#define LAYER_COUNT_BUILD \
+	(1 DT_FOREACH_CHILD_STATUS_OKAY( \
+		DT_INST(0, richeffects_keypad_layers), LAYER_COUNT_ONE))
+#else
+#define LAYER_COUNT_BUILD 1
+#endif
+
+/* Bytes of a keymap image, see layer_keymap_image() */
+#define LAYER_IMAGE_SIZE \
+	(LAYER_COUNT_BUILD * KEYPAD_MAX_KEYS * 2 + KEYPAD_MAX_KEYS * 4)
+
+/* Build the per-key layer masks, checks the layer tables */
+int layer_init(void);
+
+/*
+ * Move up to max resolved key events from the event ring into out,
+ * oldest first, with usage set. Layer keys are applied and not handed
+ * out. Events behind an undecided tap-hold key are held back until it
+ * is decided; a timeout wakes the report scheduler. A release always
+ * undoes its press, whatever the layers have done in between.
+ */
+size_t layer_get(struct key_event *out, size_t max);
+
+/*
+ * Live remap. layer_keymap_begin() copies the keymap in use into the
+ * spare buffer, layer_keymap_set() changes one action in the copy and
+ * layer_keymap_commit() hands it to the report thread, which swaps it
+ * in between two events. One editor at a time: begin returns -EBUSY
+ * while another edit or an untaken commit is outstanding. Keys held
+ * across the swap still release what they pressed.
+ */
+int layer_keymap_begin(void);
+int layer_keymap_set(uint8_t layer, uint8_t key, uint16_t action);
+int layer_keymap_commit(void);
+
+/* End an edit without swapping, the copy is discarded */
+void layer_keymap_abort(void);
+
+/*
+ * Load a compiled keymap in place, instead of layer_keymap_set():
+ * after layer_keymap_begin(), layer_keymap_image() returns the spare
+ * buffer and its size for the caller to fill with the image, in the
+ * byte order of the build, little-endian on every target:
+ *
+ *   le16 actions[layer_count()][KEYPAD_MAX_KEYS]
+ *   le32 masks[KEYPAD_MAX_KEYS], bit n set if layer n maps the key
+ *
+ * layer_keymap_image_check() checks every action and mask of the keys
+ * there are, and layer_keymap_image_commit() swaps the image in like
+ * layer_keymap_commit(), without building the masks again. A failed
+ * commit ends the edit. layer_keymap_image_swap() is the same commit
+ * for a keymap that is not to be stored, one of the profile cache:
+ * the stored keymap stays that of the last edit.
+ */
+uint8_t *layer_keymap_image(size_t *size);
+int layer_keymap_image_check(void);
+int layer_keymap_image_commit(void);
+int layer_keymap_image_swap(void);
+
+/* The check of layer_keymap_image_check() on any LAYER_IMAGE_SIZE image */
+int layer_keymap_image_verify(const uint8_t *image);
+
+/* Number of layers including the base layer */
+uint8_t layer_count(void);
+
+/* Action of a key on a layer in the keymap in use */
+uint16_t layer_keymap_get(uint8_t layer, uint8_t key);
+
+/*
+ * One-shot layers that no key used run out after
+ * CONFIG_KEYPAD_ONESHOT_TIMEOUT_MS, counted in USB frames: due from the
+ * SOF interrupt, frame from the report thread once per report.
+ */
+bool layer_oneshot_due(uint32_t sof);
+void layer_oneshot_frame(uint32_t sof);
+
+/* Bitmap of the active layers, bit 0 is the base layer */
+uint32_t layer_active_get(void);
+
+/*
+ * Toggled layers, the layer state kept per host. From the report
+ * thread; held momentary keys stay as they are.
+ */
+uint32_t layer_toggled_get(void);
+void layer_toggled_set(uint32_t mask);
+
+#endif /* KEYPAD_LAYER_H_ */
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * The trie is const and stays in flash. The only state is the node
+ * being matched, so the number of sequences costs flash, never RAM, and
+ * each key costs a binary search over the edges of one node.
+ */
+
+#include <zephyr/zephyr.h>
+
+#include "leader.h"
+#include "macro.h"
+
+/* Node reached so far, NULL while no sequence is being entered */
+static const struct leader_node *node;
+
+void leader_start(void)
+{
+	node = &leader_nodes[0];
+}
+
+bool leader_active(void)
+{
+	return node != NULL;
+}
+
+void leader_feed(uint8_t usage)
+{
+	int lo = node->edge;
+	int hi = node->edge + node->edges - 1;
+
+	node = NULL;
+
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+
+		if (leader_edge_usage[mid] == usage) {
+			node = &leader_nodes[leader_edge_node[mid]];
+			break;
+		}
+
+		if (leader_edge_usage[mid] < usage) {
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+
+	if (node != NULL && node->macro != LEADER_NO_MACRO) {
+		macro_play(node->macro);
+		node = NULL;
+	}
+}
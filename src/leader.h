@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Leader key sequences. After a LAYER_LEADER key, the usages of the
+ * next keys walk a trie generated from the richeffects,keypad-leader
+ * node by scripts/gen_leader_trie.py; reaching a leaf plays its macro.
+ */
+
+#ifndef KEYPAD_LEADER_H_
+#define KEYPAD_LEADER_H_
+
+#include <zephyr/zephyr.h>
+
+/* leader_node::macro of nodes that continue */
+#define LEADER_NO_MACRO 0xff
+
+struct leader_node {
+	/* Edges of the node: leader_edge_*[edge .. edge + edges - 1] */
+	uint16_t edge;
+	uint8_t edges;
+	/* Macro of a leaf, LEADER_NO_MACRO otherwise */
+	uint8_t macro;
+};
+
+/* Generated tables, node 0 is the root. Edges are sorted by usage */
+extern const struct leader_node leader_nodes[];
+extern const uint8_t leader_edge_usage[];
+extern const uint16_t leader_edge_node[];
+
+/* Leader key pressed: the next usages are matched */
+void leader_start(void);
+
+/* A sequence is being entered */
+bool leader_active(void);
+
+/*
+ * Feed the usage of the next pressed key. The sequence ends on a leaf,
+ * which plays its macro, or on a usage it does not continue with.
+ */
+void leader_feed(uint8_t usage);
+
+#endif /* KEYPAD_LEADER_H_ */
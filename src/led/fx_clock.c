@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * The offset steps straight to each sample rather than slewing: a
+ * sample is good to a fraction of a frame, the crystals drift about a
+ * millisecond a minute apart, and an effect phase moving by that much
+ * is not visible. The SOF is only read every SOF_EVERY frames, into
+ * the low 11 bits of the clock, by the shortest way round.
+ *
+ * The frame number is the USBD's FRAMECNTR, which the USB stack does
+ * not pass on with its SOF status.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/sys/atomic.h>
+
+#if defined(CONFIG_USB_NRFX)
+#include <hal/nrf_usbd.h>
+#endif
+
+#include "led/fx_clock.h"
+
+/* USB frame numbers, one per ms */
+#define SOF_SPAN_MS 2048
+#define SOF_EVERY 256
+/* The dongle is followed until it was not heard from for this long */
+#define DONGLE_TIMEOUT_MS 2000
+
+/* Added to k_uptime_get_32() */
+static atomic_t offset;
+static atomic_t source = ATOMIC_INIT(FX_CLOCK_LOCAL);
+/* k_uptime_get_32() of the last dongle clock */
+static atomic_t dongle_at;
+static uint32_t sofs;
+
+uint32_t fx_clock_ms(void)
+{
+	return k_uptime_get_32() + (uint32_t)atomic_get(&offset);
+}
+
+uint32_t fx_clock_span_ms(void)
+{
+	return atomic_get(&source) == FX_CLOCK_SOF ? SOF_SPAN_MS : 0;
+}
+
+enum fx_clock_source fx_clock_source_get(void)
+{
+	return atomic_get(&source);
+}
+
+static bool fx_clock_dongle_heard(void)
+{
+	return atomic_get(&source) == FX_CLOCK_DONGLE &&
+	       k_uptime_get_32() - (uint32_t)atomic_get(&dongle_at) <
+	       DONGLE_TIMEOUT_MS;
+}
+
+void fx_clock_sof(void)
+{
+#if defined(CONFIG_USB_NRFX)
+	uint32_t frame;
+	int32_t diff;
+
+	if (sofs++ % SOF_EVERY != 0 || fx_clock_dongle_heard()) {
+		return;
+	}
+
+	frame = nrf_usbd_framecntr_get(NRF_USBD);
+	diff = (frame - fx_clock_ms()) % SOF_SPAN_MS;
+	if (diff >= SOF_SPAN_MS / 2) {
+		diff -= SOF_SPAN_MS;
+	}
+
+	atomic_add(&offset, diff);
+	atomic_set(&source, FX_CLOCK_SOF);
+#endif
+}
+
+void fx_clock_dongle(uint32_t dongle_ms, uint32_t age_us)
+{
+	uint32_t now = k_uptime_get_32();
+
+	atomic_set(&offset, dongle_ms + age_us / USEC_PER_MSEC - now);
+	atomic_set(&dongle_at, now);
+	atomic_set(&source, FX_CLOCK_DONGLE);
+}
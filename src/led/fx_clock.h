@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Lighting clock shared by the keypads on a desk, so the breathing
+ * and wave effects of all of them run in phase without a host
+ * streaming frames. It is the uptime plus an offset, pulled onto:
+ *
+ *   the ESB dongle    its uptime, in the ACK of every payload, for all
+ *                     keypads on one dongle and any effect period
+ *   the USB SOF       the 11 bit frame number of the bus, for keypads
+ *                     on one host controller; they agree on the clock
+ *                     modulo 2048 ms only, see fx_clock_span_ms()
+ *
+ * The dongle wins while it is heard from. Either stays within a frame
+ * of the others, and neither adds bus traffic.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_FX_SYNC is enabled.
+ */
+
+#ifndef KEYPAD_LED_FX_CLOCK_H_
+#define KEYPAD_LED_FX_CLOCK_H_
+
+#include <zephyr/zephyr.h>
+
+enum fx_clock_source {
+	FX_CLOCK_LOCAL,
+	FX_CLOCK_SOF,
+	FX_CLOCK_DONGLE,
+};
+
+#if defined(CONFIG_KEYPAD_FX_SYNC)
+
+/* Shared clock in ms */
+uint32_t fx_clock_ms(void);
+
+/*
+ * Span the keypads agree on the clock within, 0 for all of it: an
+ * effect period has to divide it to stay in phase
+ */
+uint32_t fx_clock_span_ms(void);
+
+enum fx_clock_source fx_clock_source_get(void);
+
+/* A Start-of-Frame, from the USB status callback */
+void fx_clock_sof(void);
+
+/* The dongle's clock was dongle_ms age_us ago, from the ESB sink */
+void fx_clock_dongle(uint32_t dongle_ms, uint32_t age_us);
+
+#else
+
+static inline uint32_t fx_clock_ms(void)
+{
+	return k_uptime_get_32();
+}
+
+static inline uint32_t fx_clock_span_ms(void)
+{
+	return 0;
+}
+
+static inline enum fx_clock_source fx_clock_source_get(void)
+{
+	return FX_CLOCK_LOCAL;
+}
+
+static inline void fx_clock_sof(void) {}
+static inline void fx_clock_dongle(uint32_t dongle_ms, uint32_t age_us) {}
+
+#endif /* CONFIG_KEYPAD_FX_SYNC */
+
+#endif /* KEYPAD_LED_FX_CLOCK_H_ */
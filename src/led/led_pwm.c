@@ -0,0 +1,531 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Requests from the key path only set bits and submit a work item. The
+ * work item renders CONFIG_KEYPAD_LED_FX_STEPS frames into whichever of
+ * two sequence buffers is not being played and restarts playback from
+ * it. Each frame is held for CONFIG_KEYPAD_LED_FX_STEP_PERIODS PWM
+ * periods by the sequence repeat counter.
+ *
+ * An animation is compiled into CONFIG_KEYPAD_LED_ANIM_STEPS frames
+ * at most, each held for as many periods as it takes the loop to fit,
+ * brightness applied. The PWM plays it with LOOP and no interrupt per
+ * loop. Its phase follows the uptime from the compile, so a restart
+ * after a flash splits the loop at the step due: the tail as SEQ0 and
+ * the head as SEQ1, which LOOP plays round without a seam. A flash
+ * takes the animation's frames for its time as the levels it decays
+ * to and ends with the one interrupt that restarts the loop.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/gpio.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/logging/log.h>
+
+#include <nrfx_pwm.h>
+
+#include "config/config_store.h"
+#include "irq_plan.h"
+#include "led/led_pwm.h"
+#include "nrf_psel.h"
+#include "suspend.h"
+
+LOG_MODULE_REGISTER(led_pwm, LOG_LEVEL_INF);
+
+#define LED_SPEC(n) GPIO_DT_SPEC_GET_OR(DT_ALIAS(led##n), gpios, {0})
+
+static const struct gpio_dt_spec leds[LED_PWM_COUNT] = {
+	LED_SPEC(0), LED_SPEC(1), LED_SPEC(2), LED_SPEC(3),
+};
+
+static const nrfx_pwm_t pwm = NRFX_PWM_INSTANCE(1);
+
+/* EasyDMA reads these, so they must stay in RAM */
+static nrf_pwm_values_individual_t frames[2][CONFIG_KEYPAD_LED_FX_STEPS];
+static uint8_t frame_buf;
+
+/* Polarity bit per channel so that a larger value is always brighter */
+static uint16_t polarity[LED_PWM_COUNT];
+static uint16_t level[LED_PWM_COUNT];
+/* Step of the running flash of every LED, STEPS when idle */
+static uint8_t flash_step[LED_PWM_COUNT];
+
+static atomic_t flash_request;
+static bool suspended;
+/* Set by led_pwm_init(), levels and flashes before it wait for it */
+static bool ready;
+
+static void led_render(struct k_work *work);
+
+static K_WORK_DEFINE(render_work, led_render);
+
+#if defined(CONFIG_KEYPAD_LED_ANIM)
+#define ANIM_STEPS CONFIG_KEYPAD_LED_ANIM_STEPS
+#define ANIM_SIZE (CONFIG_KEYPAD_LED_ANIM_KEYFRAMES * LED_PWM_KEYFRAME_SIZE)
+
+static struct k_spinlock anim_lock;
+/* Keyframes: anim_keys[anim_cur] is the profile's, the other spare */
+static uint8_t anim_keys[2][ANIM_SIZE];
+static size_t anim_keys_len;
+static uint8_t anim_cur;
+static uint8_t brightness = 255;
+/* Keyframes or brightness changed since the last compile */
+static atomic_t anim_dirty;
+
+/* The compiled loop, EasyDMA reads it too */
+static nrf_pwm_values_individual_t anim_seq[ANIM_STEPS];
+/* Steps in it, 0 for none, and PWM periods per step */
+static uint16_t anim_len;
+static uint32_t anim_periods;
+/* k_uptime_get_32() at step 0 */
+static uint32_t anim_start_ms;
+static uint32_t compiles;
+#endif /* CONFIG_KEYPAD_LED_ANIM */
+
+static uint16_t led_scale(uint16_t duty)
+{
+#if defined(CONFIG_KEYPAD_LED_ANIM)
+	return duty * brightness / 255;
+#else
+	return duty;
+#endif
+}
+
+/* Level under a flash t ms from now: the animation or the steady one */
+static uint16_t led_base(uint8_t led, uint32_t t)
+{
+#if defined(CONFIG_KEYPAD_LED_ANIM)
+	if (anim_len > 0) {
+		uint32_t step = (t - anim_start_ms) / anim_periods % anim_len;
+
+		return ((uint16_t *)&anim_seq[step])[led] & ~BIT(15);
+	}
+#endif
+
+	return led_scale(level[led]);
+}
+
+static uint16_t led_value(uint8_t led, uint8_t step, uint32_t t)
+{
+	uint16_t duty = led_base(led, t);
+
+	if (step < CONFIG_KEYPAD_LED_FX_STEPS) {
+		/* Linear decay from full brightness to the steady level */
+		uint16_t flash = LED_PWM_MAX -
+			(LED_PWM_MAX * step) / CONFIG_KEYPAD_LED_FX_STEPS;
+
+		duty = MAX(duty, led_scale(flash));
+	}
+
+	if (suspended) {
+		duty = 0;
+	}
+
+	return duty | polarity[led];
+}
+
+#if defined(CONFIG_KEYPAD_LED_ANIM)
+static uint16_t key_level(const uint8_t *key, uint8_t led)
+{
+	return MIN(sys_get_le16(&key[2 * led]), LED_PWM_MAX);
+}
+
+static uint16_t key_ms(const uint8_t *key)
+{
+	return sys_get_le16(&key[2 * LED_PWM_COUNT]);
+}
+
+static void led_anim_compile(void)
+{
+	uint8_t keys[ANIM_SIZE];
+	const uint8_t *from;
+	const uint8_t *to;
+	k_spinlock_key_t key;
+	uint32_t total = 0;
+	uint32_t start = 0;
+	size_t n;
+	size_t i = 0;
+	uint8_t scale;
+
+	key = k_spin_lock(&anim_lock);
+	n = anim_keys_len / LED_PWM_KEYFRAME_SIZE;
+	memcpy(keys, anim_keys[anim_cur], anim_keys_len);
+	scale = brightness;
+	k_spin_unlock(&anim_lock, key);
+
+	for (size_t k = 0; k < n; k++) {
+		total += key_ms(&keys[k * LED_PWM_KEYFRAME_SIZE]);
+	}
+
+	compiles++;
+	anim_len = 0;
+	if (total == 0) {
+		return;
+	}
+
+	/* One PWM period is 1 ms */
+	anim_periods = DIV_ROUND_UP(total, ANIM_STEPS);
+	anim_len = total / anim_periods;
+
+	for (uint16_t step = 0; step < anim_len; step++) {
+		uint16_t *values = (uint16_t *)&anim_seq[step];
+		uint32_t t = step * anim_periods;
+
+		while (t >= start + key_ms(&keys[i * LED_PWM_KEYFRAME_SIZE])) {
+			start += key_ms(&keys[i * LED_PWM_KEYFRAME_SIZE]);
+			i++;
+		}
+
+		from = &keys[i * LED_PWM_KEYFRAME_SIZE];
+		to = &keys[((i + 1) % n) * LED_PWM_KEYFRAME_SIZE];
+
+		for (uint8_t led = 0; led < LED_PWM_COUNT; led++) {
+			int32_t a = key_level(from, led);
+			int32_t v = a + (key_level(to, led) - a) *
+				    (int32_t)(t - start) / key_ms(from);
+
+			values[led] = (v * scale / 255) | polarity[led];
+		}
+	}
+
+	anim_start_ms = k_uptime_get_32();
+}
+
+/* Loop the animation from the step due now */
+static void led_anim_play(void)
+{
+	uint32_t step = (k_uptime_get_32() - anim_start_ms) / anim_periods %
+			anim_len;
+	uint16_t width = NRF_PWM_VALUES_LENGTH(anim_seq[0]);
+	nrf_pwm_sequence_t tail = {
+		.values.p_individual = &anim_seq[step],
+		.length = width * (anim_len - step),
+		.repeats = anim_periods - 1,
+	};
+	nrf_pwm_sequence_t head = {
+		.values.p_individual = anim_seq,
+		.length = width * step,
+		.repeats = anim_periods - 1,
+	};
+	uint32_t flags = NRFX_PWM_FLAG_LOOP | NRFX_PWM_FLAG_NO_EVT_FINISHED;
+
+	if (step == 0) {
+		nrfx_pwm_simple_playback(&pwm, &tail, 1, flags);
+	} else {
+		nrfx_pwm_complex_playback(&pwm, &tail, &head, 1, flags);
+	}
+}
+
+/* A flash is over, pick the loop up again */
+static void led_pwm_handler(nrfx_pwm_evt_type_t event, void *context)
+{
+	ARG_UNUSED(context);
+
+	if (event == NRFX_PWM_EVT_FINISHED && anim_len > 0) {
+		k_work_submit(&render_work);
+	}
+}
+#endif /* CONFIG_KEYPAD_LED_ANIM */
+
+static void led_render(struct k_work *work)
+{
+	atomic_val_t request = atomic_clear(&flash_request);
+	nrf_pwm_values_individual_t *seq_frames;
+	nrf_pwm_sequence_t seq;
+	bool animated = false;
+	uint32_t flags = 0;
+	uint32_t now;
+	bool lit = false;
+
+	if (!ready) {
+		return;
+	}
+
+#if defined(CONFIG_KEYPAD_LED_ANIM)
+	if (atomic_clear(&anim_dirty)) {
+		led_anim_compile();
+	}
+
+	animated = anim_len > 0 && !suspended;
+	if (animated && request == 0) {
+		led_anim_play();
+		return;
+	}
+#endif
+
+	frame_buf ^= 1;
+	seq_frames = frames[frame_buf];
+	now = k_uptime_get_32();
+
+	for (uint8_t led = 0; led < LED_PWM_COUNT; led++) {
+		if (request & BIT(led)) {
+			flash_step[led] = 0;
+		} else {
+			/* The previous sequence was cut short or has ended */
+			flash_step[led] = CONFIG_KEYPAD_LED_FX_STEPS;
+		}
+	}
+
+	for (uint8_t step = 0; step < CONFIG_KEYPAD_LED_FX_STEPS; step++) {
+		uint16_t *values = (uint16_t *)&seq_frames[step];
+		uint32_t t = now + step * CONFIG_KEYPAD_LED_FX_STEP_PERIODS;
+
+		for (uint8_t led = 0; led < LED_PWM_COUNT; led++) {
+			values[led] = led_value(led, flash_step[led] + step, t);
+		}
+	}
+
+	for (uint8_t led = 0; led < LED_PWM_COUNT; led++) {
+		lit |= (level[led] != 0) && !suspended;
+	}
+
+	seq = (nrf_pwm_sequence_t) {
+		.values.p_individual = seq_frames,
+		.length = NRF_PWM_VALUES_LENGTH(frames[0]),
+		.repeats = CONFIG_KEYPAD_LED_FX_STEP_PERIODS - 1,
+		.end_delay = 0,
+	};
+
+	/*
+	 * Without STOP the PWM keeps generating the last frame, i.e. the
+	 * steady levels. With everything dark it stops and the pins fall
+	 * back to their idle (off) level, so the PWM draws no current.
+	 * Only an animation needs to hear that the flash is over.
+	 */
+	if (!lit && !animated) {
+		flags |= NRFX_PWM_FLAG_STOP;
+	}
+	if (!animated) {
+		flags |= NRFX_PWM_FLAG_NO_EVT_FINISHED;
+	}
+
+	nrfx_pwm_simple_playback(&pwm, &seq, 1, flags);
+}
+
+void led_pwm_flash(uint8_t led)
+{
+	if (led >= LED_PWM_COUNT) {
+		return;
+	}
+
+	atomic_or(&flash_request, BIT(led));
+	k_work_submit(&render_work);
+}
+
+void led_pwm_level_set(uint8_t led, uint16_t value)
+{
+	if (led >= LED_PWM_COUNT) {
+		return;
+	}
+
+	level[led] = MIN(value, LED_PWM_MAX);
+	k_work_submit(&render_work);
+}
+
+#if defined(CONFIG_KEYPAD_LED_ANIM)
+#if defined(CONFIG_KEYPAD_CONFIG_STORE)
+BUILD_ASSERT(ANIM_SIZE + 1 <= CONFIG_KEYPAD_CONFIG_STORE_MAX_SIZE,
+	     "the keyframes must fit a stored value");
+
+/* Stored as the brightness, then the keyframes */
+static ssize_t anim_store_get(void *buf, size_t size)
+{
+	k_spinlock_key_t key = k_spin_lock(&anim_lock);
+	uint8_t *out = buf;
+	size_t len = anim_keys_len;
+
+	out[0] = brightness;
+	memcpy(&out[1], anim_keys[anim_cur], len);
+	k_spin_unlock(&anim_lock, key);
+
+	return len + 1;
+}
+
+static int anim_store_set(const void *data, size_t len)
+{
+	const uint8_t *in = data;
+	k_spinlock_key_t key;
+
+	if (len < 1 || len - 1 > ANIM_SIZE ||
+	    (len - 1) % LED_PWM_KEYFRAME_SIZE != 0) {
+		return -EINVAL;
+	}
+
+	key = k_spin_lock(&anim_lock);
+	brightness = in[0];
+	memcpy(anim_keys[anim_cur], &in[1], len - 1);
+	anim_keys_len = len - 1;
+	k_spin_unlock(&anim_lock, key);
+
+	atomic_set(&anim_dirty, 1);
+	k_work_submit(&render_work);
+
+	return 0;
+}
+#endif /* CONFIG_KEYPAD_CONFIG_STORE */
+
+static struct config_entry anim_entry = {
+	.name = "keypad/led_anim",
+#if defined(CONFIG_KEYPAD_CONFIG_STORE)
+	.get = anim_store_get,
+	.set = anim_store_set,
+#endif
+};
+
+uint8_t *led_pwm_anim_begin(size_t *size)
+{
+	*size = ANIM_SIZE;
+
+	return anim_keys[anim_cur ^ 1];
+}
+
+int led_pwm_anim_commit(size_t len)
+{
+	k_spinlock_key_t key;
+
+	if (len > ANIM_SIZE || len % LED_PWM_KEYFRAME_SIZE != 0) {
+		return -EINVAL;
+	}
+
+	key = k_spin_lock(&anim_lock);
+	anim_cur ^= 1;
+	anim_keys_len = len;
+	k_spin_unlock(&anim_lock, key);
+
+	atomic_set(&anim_dirty, 1);
+	k_work_submit(&render_work);
+	config_store_changed(&anim_entry);
+
+	return 0;
+}
+
+void led_pwm_brightness_set(uint8_t value)
+{
+	if (value == brightness) {
+		return;
+	}
+
+	brightness = value;
+	atomic_set(&anim_dirty, 1);
+	k_work_submit(&render_work);
+	config_store_changed(&anim_entry);
+}
+#endif /* CONFIG_KEYPAD_LED_ANIM */
+
+static void led_suspend(bool state)
+{
+	suspended = state;
+	k_work_submit(&render_work);
+}
+
+static struct suspend_listener listener = {
+	.changed = led_suspend,
+};
+
+int led_pwm_init(void)
+{
+	nrfx_pwm_config_t config = NRFX_PWM_DEFAULT_CONFIG(
+		NRFX_PWM_PIN_NOT_USED, NRFX_PWM_PIN_NOT_USED,
+		NRFX_PWM_PIN_NOT_USED, NRFX_PWM_PIN_NOT_USED);
+	nrfx_err_t err;
+
+	for (uint8_t led = 0; led < LED_PWM_COUNT; led++) {
+		bool active_low = leds[led].dt_flags & GPIO_ACTIVE_LOW;
+
+		flash_step[led] = CONFIG_KEYPAD_LED_FX_STEPS;
+
+		if (leds[led].port == NULL) {
+			continue;
+		}
+
+		config.output_pins[led] = nrf_psel_get(&leds[led]) |
+			(active_low ? NRFX_PWM_PIN_INVERTED : 0);
+		/* Rising edge first drives the pin high for the duty time */
+		polarity[led] = active_low ? 0 : BIT(15);
+	}
+
+	config.base_clock = NRF_PWM_CLK_1MHz;
+	config.count_mode = NRF_PWM_MODE_UP;
+	config.top_value = LED_PWM_MAX;
+	config.load_mode = NRF_PWM_LOAD_INDIVIDUAL;
+	config.step_mode = NRF_PWM_STEP_AUTO;
+
+#if defined(CONFIG_KEYPAD_LED_ANIM)
+	/* Only the end of a flash over an animation interrupts */
+	config.irq_priority = IRQ_PLAN_LOW;
+	IRQ_CONNECT(DT_IRQN(DT_NODELABEL(pwm1)), IRQ_PLAN_LOW,
+		    nrfx_pwm_1_irq_handler, NULL, 0);
+	err = nrfx_pwm_init(&pwm, &config, led_pwm_handler, NULL);
+#else
+	/* No handler: playback needs no interrupt at all */
+	err = nrfx_pwm_init(&pwm, &config, NULL, NULL);
+#endif
+	if (err != NRFX_SUCCESS) {
+		LOG_ERR("Failed to init LED PWM, error: 0x%08x", err);
+		return -EIO;
+	}
+
+	suspend_listener_register(&listener);
+
+#if defined(CONFIG_KEYPAD_LED_ANIM)
+	if (config_store_register(&anim_entry) < 0) {
+		LOG_WRN("Stored LED animation not loaded");
+	}
+#endif
+
+	/* Flashes asked for before are stale, the levels are not */
+	atomic_clear(&flash_request);
+	ready = true;
+	k_work_submit(&render_work);
+
+	return 0;
+}
+
+#if defined(CONFIG_KEYPAD_LED_ANIM) && defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static int cmd_led_show(const struct shell *sh, size_t argc, char **argv)
+{
+	shell_print(sh, "brightness %u, %u keyframes, compiled %u times",
+		    brightness, anim_keys_len / LED_PWM_KEYFRAME_SIZE,
+		    compiles);
+	if (anim_len > 0) {
+		shell_print(sh, "loop of %u steps of %u ms", anim_len,
+			    anim_periods);
+	}
+
+	return 0;
+}
+
+static int cmd_led_brightness(const struct shell *sh, size_t argc,
+			      char **argv)
+{
+	unsigned long value = strtoul(argv[1], NULL, 0);
+
+	if (value > UINT8_MAX) {
+		shell_error(sh, "brightness is 0..255");
+		return -EINVAL;
+	}
+
+	led_pwm_brightness_set(value);
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_led,
+	SHELL_CMD(show, NULL, "Print the animation", cmd_led_show),
+	SHELL_CMD_ARG(brightness, NULL, "Scale every level: <0..255>",
+		      cmd_led_brightness, 2, 0),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(led, &sub_led, "PWM LED animation", NULL);
+#endif /* CONFIG_KEYPAD_LED_ANIM && CONFIG_SHELL */
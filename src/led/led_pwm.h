@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * LED feedback through the nRF PWM peripheral. led0..led3 are the four
+ * PWM channels; an effect is rendered once into a RAM sequence that
+ * EasyDMA plays without further CPU work, so no LED update ever runs on
+ * the report path.
+ *
+ * With CONFIG_KEYPAD_LED_ANIM the profile may hold an animation, looped
+ * in place of the steady levels: keyframes of LED_PWM_COUNT levels,
+ * each ramped to the next over its time, the last back to the first.
+ * It is compiled once into a PWM sequence in RAM, again only when the
+ * keyframes or the brightness change, and the peripheral loops it on
+ * its own. A flash is drawn over the animation, which carries on in
+ * step after it.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_LED_PWM is enabled.
+ */
+
+#ifndef KEYPAD_LED_LED_PWM_H_
+#define KEYPAD_LED_LED_PWM_H_
+
+#include <zephyr/zephyr.h>
+
+#define LED_PWM_COUNT 4
+/* Full brightness, one PWM period is LED_PWM_MAX us */
+#define LED_PWM_MAX 1000
+
+/* Keyframe as uploaded: LED_PWM_COUNT le16 levels, le16 ms to the next */
+#define LED_PWM_KEYFRAME_SIZE (2 * LED_PWM_COUNT + 2)
+
+#if defined(CONFIG_KEYPAD_LED_PWM)
+
+int led_pwm_init(void);
+
+/* Start a decaying flash on one LED, ISR safe */
+void led_pwm_flash(uint8_t led);
+
+/* Steady brightness of one LED between flashes, 0..LED_PWM_MAX */
+void led_pwm_level_set(uint8_t led, uint16_t level);
+
+#if defined(CONFIG_KEYPAD_LED_ANIM)
+/* Spare keyframe buffer for an upload to fill, its size in *size */
+uint8_t *led_pwm_anim_begin(size_t *size);
+
+/*
+ * The spare buffer holds len bytes of keyframes, 0 for no animation:
+ * make it the profile's and compile it at the next render.
+ */
+int led_pwm_anim_commit(size_t len);
+
+/* Scale of every level, 255 for full */
+void led_pwm_brightness_set(uint8_t brightness);
+#endif /* CONFIG_KEYPAD_LED_ANIM */
+
+#else
+
+static inline int led_pwm_init(void)
+{
+	return 0;
+}
+
+static inline void led_pwm_flash(uint8_t led) {}
+static inline void led_pwm_level_set(uint8_t led, uint16_t level) {}
+
+#endif /* CONFIG_KEYPAD_LED_PWM */
+
+#endif /* KEYPAD_LED_LED_PWM_H_ */
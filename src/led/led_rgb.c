@@ -0,0 +1,702 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * The render thread reads the key events from the event ring as a
+ * second consumer with its own cursor, so lighting adds nothing to the
+ * report path but a wakeup. Each frame it hands the held keys and the
+ * presses since the previous frame to the effect, led/rgb_fx.h. The
+ * strip is only written when a pixel changed, and the thread stops its
+ * frame timer altogether while the effect is still, so a static keypad
+ * costs neither DMA nor wakeups.
+ *
+ * A host may stream frames instead, over the raw HID interface. They
+ * are written into the back half of a double buffer; the sync at the
+ * end of a frame is taken at the render thread's next frame, the
+ * vsync, which swaps the halves and only then acks the host. Writes
+ * while a swap is pending are refused, so a shown frame is never
+ * mixed with the next. The effects take over again once no sync came
+ * for CONFIG_KEYPAD_RGB_STREAM_TIMEOUT_MS.
+ *
+ * Run length and palette encoded writes are decoded in the raw HID
+ * handler straight into that back half, so a compressed frame costs
+ * the bus its encoded size and the keypad no buffer of its own. An
+ * effect with few colors, or long stretches of one, fits a report or
+ * two where raw r, g, b takes one per 19 LEDs.
+ *
+ * Every frame is held to the USB current budget before it goes out:
+ * the strip's draw is estimated from the frame, its idle current plus
+ * CONFIG_KEYPAD_RGB_CHANNEL_UA per channel at full duty, and all LEDs
+ * are dimmed alike if it would take the keypad over bMaxPower, or the
+ * 100 mA of an unconfigured device. The WS2812 drives its LEDs with a
+ * constant current for the PWM duty, so the draw is linear in the
+ * channel values and the estimate is a sum and a multiply. In suspend
+ * the frame is dark and the strip's supply, the led-strip-power alias
+ * if the board has one, is switched off.
+ *
+ * Rendering has CONFIG_KEYPAD_RGB_FRAME_BUDGET_US. A frame over it,
+ * whether from the effect or from being preempted by input, halves
+ * the frame rate down to 1/RGB_DIVIDER_MAX of CONFIG_KEYPAD_RGB_FPS;
+ * a second of frames under half the budget doubles it again. The
+ * load gives way on the lighting, never on the input thread.
+ *
+ * The WS2812 SPI driver encodes the frame into SPIM bytes in RAM and
+ * the transfer runs on EasyDMA, waited for on a semaphore. The input
+ * thread is cooperative at a higher priority and preempts rendering at
+ * any point; a frame that falls behind is counted late, it does not
+ * hold up the next key.
+ */
+
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/gpio.h>
+#include <zephyr/drivers/led_strip.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/logging/log.h>
+
+#include "event_ring.h"
+#include "keymap.h"
+#include "led/fx_clock.h"
+#include "led/led_rgb.h"
+#include "led/rgb_fx.h"
+#include "suspend.h"
+#include "usb/usb_state.h"
+
+LOG_MODULE_REGISTER(led_rgb, LOG_LEVEL_INF);
+
+#define STRIP_NODE DT_ALIAS(led_strip)
+#define STRIP_LEN DT_PROP(STRIP_NODE, chain_length)
+/* LEDs with a key over them */
+#define RGB_KEYS MIN(STRIP_LEN, KEYPAD_MAX_KEYS)
+
+#define FRAME_US (USEC_PER_SEC / CONFIG_KEYPAD_RGB_FPS)
+/* Slowest frame rate the budget may fall back to, 1/8 of the target */
+#define RGB_DIVIDER_MAX 8
+
+/* Current a configured and an unconfigured device may draw, in mA */
+#define USB_BUDGET_MA (CONFIG_USB_MAX_POWER * 2)
+#define USB_UNCONFIGURED_MA 100
+/* Strip with every LED dark, in uA */
+#define STRIP_IDLE_UA (STRIP_LEN * CONFIG_KEYPAD_RGB_IDLE_UA)
+
+BUILD_ASSERT(STRIP_IDLE_UA / 1000 + CONFIG_KEYPAD_RGB_BOARD_MA <
+	     MIN(USB_BUDGET_MA, USB_UNCONFIGURED_MA),
+	     "the dark strip alone takes the USB current budget");
+
+static const struct device *const strip = DEVICE_DT_GET(STRIP_NODE);
+static const struct gpio_dt_spec power =
+	GPIO_DT_SPEC_GET_OR(DT_ALIAS(led_strip_power), gpios, {0});
+static bool powered = true;
+
+/* Frame on the strip, and the one handed to the driver as scratch */
+static struct led_rgb shown[STRIP_LEN];
+static struct led_rgb frame[STRIP_LEN];
+
+static void led_rgb_notify(void);
+
+/* Key events as the render thread last saw them */
+static struct event_ring_sub sub = {
+	.name = "rgb",
+	.notify = led_rgb_notify,
+};
+static keypad_bitmap_t held;
+static atomic_t suspended;
+
+static struct k_spinlock lock;
+static struct led_rgb base = { .r = 0, .g = 0, .b = 32 };
+static struct led_rgb hit = { .r = 255, .g = 255, .b = 255 };
+/* Host frames: stream[front] is shown, the other half is written */
+static struct led_rgb stream[2][STRIP_LEN];
+static uint8_t front;
+/* Colors of the indexed stream formats, from the host */
+static struct led_rgb palette[LED_RGB_PALETTE_SIZE];
+/* Done callback of the sync waiting for the next vsync */
+static atomic_ptr_t sync_done;
+/* k_uptime_get_32() of the last swap, streaming since it if true */
+static uint32_t stream_ms;
+static bool streaming;
+
+static enum rgb_fx fx = RGB_FX_REACTIVE;
+static struct led_rgb_stats stats = {
+	.fps_target = CONFIG_KEYPAD_RGB_FPS,
+};
+
+/* Frame periods per frame, and frames under half the budget since */
+static uint8_t divider = 1;
+static uint32_t quiet;
+/* Achieved rate: frames since k_uptime_get_32() of the window start */
+static uint32_t window_ms;
+static uint32_t window_frames;
+
+static K_SEM_DEFINE(wake_sem, 0, 1);
+static K_TIMER_DEFINE(frame_timer, NULL, NULL);
+
+static uint8_t rgb_scale(uint8_t c)
+{
+	return c * CONFIG_KEYPAD_RGB_BRIGHTNESS / 255;
+}
+
+/* Swap in a synced host frame, true while the host streams */
+static bool rgb_stream_vsync(uint32_t now_ms)
+{
+	void (*done)(void) = atomic_ptr_clear(&sync_done);
+	k_spinlock_key_t key;
+
+	if (done != NULL) {
+		front ^= 1;
+		stream_ms = now_ms;
+		streaming = true;
+		key = k_spin_lock(&lock);
+		stats.stream_frames++;
+		k_spin_unlock(&lock, key);
+		done();
+	}
+
+	if (streaming &&
+	    now_ms - stream_ms >= CONFIG_KEYPAD_RGB_STREAM_TIMEOUT_MS) {
+		streaming = false;
+		rgb_fx_reset();
+	}
+
+	return streaming;
+}
+
+/* Dim frame[] to what the USB budget leaves for the LEDs */
+static void rgb_limit(void)
+{
+	uint32_t budget_ma = usb_state_configured() ? USB_BUDGET_MA :
+				MIN(USB_BUDGET_MA, USB_UNCONFIGURED_MA);
+	uint32_t color_budget_ua = (budget_ma - CONFIG_KEYPAD_RGB_BOARD_MA) *
+				   1000 - STRIP_IDLE_UA;
+	uint32_t sum = 0;
+	uint32_t color_ua;
+	uint32_t scale;
+	k_spinlock_key_t key;
+
+	for (int i = 0; i < STRIP_LEN; i++) {
+		sum += frame[i].r + frame[i].g + frame[i].b;
+	}
+
+	color_ua = (uint64_t)sum * CONFIG_KEYPAD_RGB_CHANNEL_UA / 255;
+	if (color_ua > color_budget_ua) {
+		/* 1/256 steps, rounded down to stay under */
+		scale = (uint64_t)color_budget_ua * 256 / color_ua;
+		for (int i = 0; i < STRIP_LEN; i++) {
+			frame[i].r = frame[i].r * scale / 256;
+			frame[i].g = frame[i].g * scale / 256;
+			frame[i].b = frame[i].b * scale / 256;
+		}
+		color_ua = (uint64_t)color_ua * scale / 256;
+	}
+
+	key = k_spin_lock(&lock);
+	stats.limited += color_ua < (uint64_t)sum *
+			 CONFIG_KEYPAD_RGB_CHANNEL_UA / 255;
+	stats.current_ua = powered ? STRIP_IDLE_UA + color_ua : 0;
+	stats.current_max_ua = MAX(stats.current_max_ua, stats.current_ua);
+	k_spin_unlock(&lock, key);
+}
+
+/* Switch the strip supply, if the board has a switch for it */
+static void rgb_power(bool on)
+{
+	if (power.port == NULL || on == powered) {
+		return;
+	}
+
+	if (on) {
+		(void)gpio_pin_set_dt(&power, 1);
+		/* The strip forgot its frame, send it again */
+		memset(shown, 0xff, sizeof(shown));
+	} else {
+		(void)gpio_pin_set_dt(&power, 0);
+	}
+
+	powered = on;
+}
+
+/* Render the next frame into frame[], returns true while it moves */
+static bool rgb_render(void)
+{
+	struct rgb_fx_input in = {
+		.now_ms = k_uptime_get_32(),
+		.sync_ms = fx_clock_ms(),
+		.span_ms = fx_clock_span_ms(),
+	};
+	struct key_event events[8];
+	k_spinlock_key_t key;
+	enum rgb_fx effect;
+	size_t n;
+
+	/* The ring only keeps recent events, catch up with all of them */
+	while ((n = event_ring_read(&sub.reader, events,
+				    ARRAY_SIZE(events))) > 0) {
+		for (size_t i = 0; i < n; i++) {
+			if (events[i].pressed) {
+				held |= BIT(events[i].key);
+				in.hits |= BIT(events[i].key);
+			} else {
+				held &= ~BIT(events[i].key);
+			}
+		}
+	}
+
+	in.held = held;
+	key = k_spin_lock(&lock);
+	effect = fx;
+
+	in.base = base;
+	in.hit = hit;
+	k_spin_unlock(&lock, key);
+
+	if (atomic_get(&suspended)) {
+		memset(frame, 0, sizeof(frame));
+		rgb_fx_reset();
+		return false;
+	}
+
+	if (rgb_stream_vsync(in.now_ms)) {
+		for (int i = 0; i < STRIP_LEN; i++) {
+			frame[i].r = rgb_scale(stream[front][i].r);
+			frame[i].g = rgb_scale(stream[front][i].g);
+			frame[i].b = rgb_scale(stream[front][i].b);
+		}
+
+		/* Keep the frames coming, to notice the host going away */
+		return true;
+	}
+
+	return rgb_fx_render(effect, &in, frame, STRIP_LEN, RGB_KEYS);
+}
+
+static void rgb_timer_start(void)
+{
+	k_timeout_t period = K_USEC(FRAME_US * divider);
+
+	k_timer_start(&frame_timer, period, period);
+}
+
+/* Follow the render time of the last frame, true to restart the timer */
+static bool rgb_budget(uint32_t render_us)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	uint8_t was = divider;
+
+	stats.render_max_us = MAX(stats.render_max_us, render_us);
+
+	if (render_us > CONFIG_KEYPAD_RGB_FRAME_BUDGET_US) {
+		quiet = 0;
+		if (divider < RGB_DIVIDER_MAX) {
+			divider *= 2;
+			stats.degraded++;
+		}
+	} else if (render_us < CONFIG_KEYPAD_RGB_FRAME_BUDGET_US / 2 &&
+		   divider > 1 &&
+		   ++quiet >= CONFIG_KEYPAD_RGB_FPS / divider) {
+		quiet = 0;
+		divider /= 2;
+	}
+
+	stats.fps_target = CONFIG_KEYPAD_RGB_FPS / divider;
+	k_spin_unlock(&lock, key);
+
+	return divider != was;
+}
+
+static void rgb_count_frame(uint32_t now_ms)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	window_frames++;
+	if (now_ms - window_ms >= MSEC_PER_SEC) {
+		stats.fps = window_frames * MSEC_PER_SEC / (now_ms - window_ms);
+		window_ms = now_ms;
+		window_frames = 0;
+	}
+	k_spin_unlock(&lock, key);
+}
+
+static bool rgb_changed(void)
+{
+	for (int i = 0; i < STRIP_LEN; i++) {
+		if (frame[i].r != shown[i].r || frame[i].g != shown[i].g ||
+		    frame[i].b != shown[i].b) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void rgb_run(void *p1, void *p2, void *p3)
+{
+	bool running = false;
+
+	while (true) {
+		uint32_t start = k_cycle_get_32();
+		bool moving = rgb_render();
+		uint32_t render_us = k_cyc_to_us_floor32(k_cycle_get_32() -
+							 start);
+		bool dark = atomic_get(&suspended) != 0;
+		k_spinlock_key_t key;
+		uint32_t missed;
+		int ret;
+
+		rgb_limit();
+		if (!dark) {
+			rgb_power(true);
+		}
+
+		if (rgb_changed()) {
+			memcpy(shown, frame, sizeof(shown));
+			/* The driver may use frame[] as scratch */
+			ret = led_strip_update_rgb(strip, frame, STRIP_LEN);
+			if (ret < 0) {
+				LOG_WRN("Strip update failed, error: %d", ret);
+			}
+
+			key = k_spin_lock(&lock);
+			stats.frames++;
+			stats.update_max_us = MAX(stats.update_max_us,
+				k_cyc_to_us_floor32(k_cycle_get_32() - start));
+			k_spin_unlock(&lock, key);
+		}
+
+		if (dark) {
+			/* Dark frame is out, the supply can go */
+			rgb_power(false);
+		}
+
+		if (!moving) {
+			/* Still frame: sleep until a key or a resume */
+			k_timer_stop(&frame_timer);
+			running = false;
+			key = k_spin_lock(&lock);
+			stats.fps = 0;
+			k_spin_unlock(&lock, key);
+			k_sem_take(&wake_sem, K_FOREVER);
+			continue;
+		}
+
+		if (!running) {
+			window_ms = k_uptime_get_32();
+			window_frames = 0;
+		}
+
+		if (rgb_budget(render_us) || !running) {
+			rgb_timer_start();
+			running = true;
+		}
+
+		missed = k_timer_status_sync(&frame_timer);
+		if (missed > 1) {
+			key = k_spin_lock(&lock);
+			stats.late += missed - 1;
+			k_spin_unlock(&lock, key);
+		}
+
+		rgb_count_frame(k_uptime_get_32());
+	}
+}
+
+K_THREAD_DEFINE(rgb_thread, CONFIG_KEYPAD_RGB_STACK_SIZE, rgb_run, NULL,
+		NULL, NULL, K_LOWEST_APPLICATION_THREAD_PRIO, 0,
+		SYS_FOREVER_MS);
+
+/* Key events were put in the event ring */
+static void led_rgb_notify(void)
+{
+	k_sem_give(&wake_sem);
+}
+
+static void rgb_copy(struct led_rgb *out, const uint8_t *rgb, size_t count)
+{
+	for (size_t i = 0; i < count; i++) {
+		out[i].r = rgb[3 * i];
+		out[i].g = rgb[3 * i + 1];
+		out[i].b = rgb[3 * i + 2];
+	}
+}
+
+/* Runs of n, r, g, b, to cover count LEDs exactly */
+static int rgb_decode_rle(struct led_rgb *out, size_t count,
+			  const uint8_t *data, size_t len)
+{
+	size_t n;
+
+	for (; count > 0; data += 4, len -= 4) {
+		n = len >= 4 ? data[0] : 0;
+		if (n == 0 || n > count) {
+			return -EINVAL;
+		}
+
+		for (size_t i = 0; i < n; i++) {
+			rgb_copy(out++, &data[1], 1);
+		}
+		count -= n;
+	}
+
+	return 0;
+}
+
+static int rgb_decode_indexed(struct led_rgb *out, size_t count,
+			      const uint8_t *data, size_t len)
+{
+	if (len < DIV_ROUND_UP(count, 2)) {
+		return -EINVAL;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		out[i] = palette[(data[i / 2] >> (4 * (i & 1))) & 0xf];
+	}
+
+	return 0;
+}
+
+static int rgb_decode_indexed_rle(struct led_rgb *out, size_t count,
+				  const uint8_t *data, size_t len)
+{
+	size_t n;
+
+	for (; count > 0; data++, len--) {
+		n = len > 0 ? (*data >> 4) + 1 : 0;
+		if (n == 0 || n > count) {
+			return -EINVAL;
+		}
+
+		for (size_t i = 0; i < n; i++) {
+			*out++ = palette[*data & 0xf];
+		}
+		count -= n;
+	}
+
+	return 0;
+}
+
+/* Decode a write of the LEDs into the back half */
+static int rgb_decode(enum led_rgb_format format, uint8_t first,
+		      size_t count, const uint8_t *data, size_t len)
+{
+	struct led_rgb *out;
+
+	if (first >= STRIP_LEN || count > STRIP_LEN - first) {
+		return -EINVAL;
+	}
+
+	if (atomic_ptr_get(&sync_done) != NULL) {
+		/* The back half is waiting for the vsync */
+		return -EBUSY;
+	}
+
+	out = &stream[front ^ 1][first];
+
+	switch (format) {
+	case LED_RGB_FORMAT_RAW:
+		if (len < 3 * count) {
+			return -EINVAL;
+		}
+		rgb_copy(out, data, count);
+		return 0;
+	case LED_RGB_FORMAT_RLE:
+		return rgb_decode_rle(out, count, data, len);
+	case LED_RGB_FORMAT_INDEXED:
+		return rgb_decode_indexed(out, count, data, len);
+	case LED_RGB_FORMAT_INDEXED_RLE:
+		return rgb_decode_indexed_rle(out, count, data, len);
+	default:
+		return -EINVAL;
+	}
+}
+
+int led_rgb_stream_write(enum led_rgb_format format, uint8_t first,
+			 size_t count, const uint8_t *data, size_t len)
+{
+	k_spinlock_key_t key;
+	int ret;
+
+	if (format != LED_RGB_FORMAT_PALETTE) {
+		ret = rgb_decode(format, first, count, data, len);
+	} else if (first >= LED_RGB_PALETTE_SIZE ||
+		   count > LED_RGB_PALETTE_SIZE - first || len < 3 * count) {
+		ret = -EINVAL;
+	} else {
+		rgb_copy(&palette[first], data, count);
+		ret = 0;
+	}
+
+	if (ret == 0) {
+		key = k_spin_lock(&lock);
+		stats.stream_writes++;
+		k_spin_unlock(&lock, key);
+	}
+
+	return ret;
+}
+
+int led_rgb_stream_sync(void (*done)(void))
+{
+	if (!atomic_ptr_cas(&sync_done, NULL, done)) {
+		return -EBUSY;
+	}
+
+	k_sem_give(&wake_sem);
+
+	return 0;
+}
+
+static void rgb_suspend(bool state)
+{
+	atomic_set(&suspended, state);
+	k_sem_give(&wake_sem);
+}
+
+static struct suspend_listener listener = {
+	.changed = rgb_suspend,
+};
+
+void led_rgb_stats_get(struct led_rgb_stats *out)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	*out = stats;
+	k_spin_unlock(&lock, key);
+	out->missed = sub.reader.missed;
+}
+
+int led_rgb_init(void)
+{
+	int ret;
+
+	if (!device_is_ready(strip)) {
+		LOG_ERR("LED strip %s not ready", strip->name);
+		return -ENODEV;
+	}
+
+	if (power.port != NULL) {
+		ret = gpio_pin_configure_dt(&power, GPIO_OUTPUT_ACTIVE);
+		if (ret < 0) {
+			LOG_ERR("Failed to switch on the strip, error: %d",
+				ret);
+			return ret;
+		}
+	} else if (STRIP_IDLE_UA > 0) {
+		LOG_WRN("No led-strip-power, %u uA stay on in suspend",
+			STRIP_IDLE_UA);
+	}
+
+	event_ring_subscribe(&sub);
+	suspend_listener_register(&listener);
+	/* First frame draws the base color */
+	memset(shown, 0xff, sizeof(shown));
+	k_thread_start(rgb_thread);
+
+	return 0;
+}
+
+#if defined(CONFIG_SHELL)
+#include <stdlib.h>
+#include <string.h>
+
+#include <zephyr/shell/shell.h>
+
+static int rgb_color_parse(const struct shell *sh, char **argv,
+			   struct led_rgb *out)
+{
+	k_spinlock_key_t key;
+	unsigned long c[3];
+
+	for (int i = 0; i < 3; i++) {
+		c[i] = strtoul(argv[i + 1], NULL, 0);
+		if (c[i] > UINT8_MAX) {
+			shell_error(sh, "color components are 0 to 255");
+			return -EINVAL;
+		}
+	}
+
+	key = k_spin_lock(&lock);
+	out->r = c[0];
+	out->g = c[1];
+	out->b = c[2];
+	k_spin_unlock(&lock, key);
+	k_sem_give(&wake_sem);
+
+	return 0;
+}
+
+static int cmd_rgb_base(const struct shell *sh, size_t argc, char **argv)
+{
+	return rgb_color_parse(sh, argv, &base);
+}
+
+static int cmd_rgb_hit(const struct shell *sh, size_t argc, char **argv)
+{
+	return rgb_color_parse(sh, argv, &hit);
+}
+
+static int cmd_rgb_fx(const struct shell *sh, size_t argc, char **argv)
+{
+	k_spinlock_key_t key;
+
+	for (int i = 0; i < RGB_FX_COUNT; i++) {
+		if (strcmp(argv[1], rgb_fx_name(i)) == 0) {
+			key = k_spin_lock(&lock);
+			fx = i;
+			k_spin_unlock(&lock, key);
+			k_sem_give(&wake_sem);
+			return 0;
+		}
+	}
+
+	shell_error(sh, "no effect %s, one of reactive, breathing, wave, "
+		    "ripple, heatmap", argv[1]);
+
+	return -EINVAL;
+}
+
+static const char *const clock_names[] = {
+	[FX_CLOCK_LOCAL] = "local",
+	[FX_CLOCK_SOF] = "USB SOF",
+	[FX_CLOCK_DONGLE] = "dongle",
+};
+
+static int cmd_rgb_show(const struct shell *sh, size_t argc, char **argv)
+{
+	struct led_rgb_stats s;
+
+	led_rgb_stats_get(&s);
+	shell_print(sh, "%u LEDs, %u under keys, effect %s", STRIP_LEN,
+		    RGB_KEYS, rgb_fx_name(fx));
+	shell_print(sh, "%u fps, running at %u of %u for a %u us budget",
+		    s.fps, s.fps_target, CONFIG_KEYPAD_RGB_FPS,
+		    CONFIG_KEYPAD_RGB_FRAME_BUDGET_US);
+	shell_print(sh, "frames %u, late %u, rate lowered %u times",
+		    s.frames, s.late, s.degraded);
+	shell_print(sh, "slowest render %u us, slowest update %u us",
+		    s.render_max_us, s.update_max_us);
+	shell_print(sh, "key events missed %u, host frames %u in %u writes",
+		    s.missed, s.stream_frames, s.stream_writes);
+	shell_print(sh, "strip %u uA, most %u uA, %u frames dimmed to the "
+		    "USB budget", s.current_ua, s.current_max_ua, s.limited);
+	shell_print(sh, "effect clock %s, %u ms",
+		    clock_names[fx_clock_source_get()], fx_clock_ms());
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_rgb,
+	SHELL_CMD(show, NULL, "Print frame counters", cmd_rgb_show),
+	SHELL_CMD_ARG(base, NULL, "Color between presses: <r> <g> <b>",
+		      cmd_rgb_base, 4, 0),
+	SHELL_CMD_ARG(hit, NULL, "Color of a pressed key: <r> <g> <b>",
+		      cmd_rgb_hit, 4, 0),
+	SHELL_CMD_ARG(fx, NULL, "Effect: reactive, breathing, wave, ripple "
+		      "or heatmap", cmd_rgb_fx, 2, 0),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(rgb, &sub_rgb, "Per-key RGB lighting", NULL);
+#endif /* CONFIG_SHELL */
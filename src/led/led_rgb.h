@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Per-key RGB lighting on a WS2812 strip, the led-strip alias in the
+ * devicetree, with LED n under key n. A framebuffer is rendered at
+ * up to CONFIG_KEYPAD_RGB_FPS on a thread of the lowest application
+ * priority, within a CPU budget per frame, and clocked out by the
+ * SPIM EasyDMA, so the key path only sets a bit and lighting never
+ * delays a report.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_LED_RGB is enabled.
+ */
+
+#ifndef KEYPAD_LED_LED_RGB_H_
+#define KEYPAD_LED_LED_RGB_H_
+
+#include <zephyr/zephyr.h>
+
+struct led_rgb_stats {
+	/* Frames written to the strip */
+	uint32_t frames;
+	/* Frame periods missed because the render thread was preempted */
+	uint32_t late;
+	/* Longest render, and render plus transfer, in microseconds */
+	uint32_t render_max_us;
+	uint32_t update_max_us;
+	/* Frames per second over the last second of animation, 0 if still */
+	uint32_t fps;
+	/* Rate the frame budget allows right now */
+	uint32_t fps_target;
+	/* Times a frame over budget lowered the rate */
+	uint32_t degraded;
+	/* Key events overwritten in the ring before lighting read them */
+	uint32_t missed;
+	/* Frames streamed by the host and swapped in */
+	uint32_t stream_frames;
+	/* Stream writes decoded, of any format, palettes included */
+	uint32_t stream_writes;
+	/* Estimated strip current of the last frame, and the most */
+	uint32_t current_ua;
+	uint32_t current_max_ua;
+	/* Frames dimmed to stay within the USB current budget */
+	uint32_t limited;
+};
+
+/* Encodings of a host stream write */
+enum led_rgb_format {
+	/* r, g, b per LED */
+	LED_RGB_FORMAT_RAW,
+	/* Runs of n, r, g, b: n LEDs of one color, n at least 1 */
+	LED_RGB_FORMAT_RLE,
+	/* A 4 bit palette index per LED, the low nibble first */
+	LED_RGB_FORMAT_INDEXED,
+	/* A byte per run: (n - 1) << 4 | palette index, n up to 16 */
+	LED_RGB_FORMAT_INDEXED_RLE,
+	/* r, g, b per palette entry, first and count in entries */
+	LED_RGB_FORMAT_PALETTE,
+	LED_RGB_FORMAT_COUNT,
+};
+
+/* Entries of the palette the indexed formats look up */
+#define LED_RGB_PALETTE_SIZE 16
+
+#if defined(CONFIG_KEYPAD_LED_RGB)
+
+int led_rgb_init(void);
+
+/*
+ * Host stream: decode len bytes of data in format into count LEDs from
+ * first on of the frame being written. -EINVAL if the data does not
+ * cover exactly those LEDs, -EBUSY while a sync waits for its vsync.
+ * The palette is looked up as the LEDs are decoded, so a new one may
+ * be written at any time and only changes the writes after it.
+ */
+int led_rgb_stream_write(enum led_rgb_format format, uint8_t first,
+			 size_t count, const uint8_t *data, size_t len);
+
+/*
+ * The written frame is complete: it is shown from the next vsync, then
+ * done is called from the render thread. -EBUSY if a sync is pending.
+ */
+int led_rgb_stream_sync(void (*done)(void));
+
+void led_rgb_stats_get(struct led_rgb_stats *out);
+
+#else
+
+static inline int led_rgb_init(void)
+{
+	return 0;
+}
+
+static inline int led_rgb_stream_write(enum led_rgb_format format,
+				       uint8_t first, size_t count,
+				       const uint8_t *data, size_t len)
+{
+	return -ENOTSUP;
+}
+
+static inline int led_rgb_stream_sync(void (*done)(void))
+{
+	return -ENOTSUP;
+}
+
+#endif /* CONFIG_KEYPAD_LED_RGB */
+
+#endif /* KEYPAD_LED_LED_RGB_H_ */
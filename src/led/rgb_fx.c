@@ -0,0 +1,302 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Effects work on time, not on frames: a frame rendered late, or at a
+ * lower rate when the render thread is over its budget, shows the
+ * effect where it would be anyway. Phases are 8-bit turns into the
+ * sine table, distances along the strip are in 1/256 LED.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/drivers/led_strip.h>
+
+#include "led/rgb_fx.h"
+
+/* Ripples running at once, the oldest one gives way */
+#define RIPPLE_MAX 4
+/* Heat added per press and lost per HEAT_DECAY_MS, of 255 */
+#define HEAT_HIT 48
+#define HEAT_DECAY_MS 125
+#define HEAT_DECAY 2
+
+/* 128 + 127.5 sin(2 pi i / 256) */
+static const uint8_t sine[256] = {
+	128, 131, 134, 137, 140, 143, 146, 149, 152, 155, 158, 162,
+	165, 167, 170, 173, 176, 179, 182, 185, 188, 190, 193, 196,
+	198, 201, 203, 206, 208, 211, 213, 215, 218, 220, 222, 224,
+	226, 228, 230, 232, 234, 235, 237, 238, 240, 241, 243, 244,
+	245, 246, 248, 249, 250, 250, 251, 252, 253, 253, 254, 254,
+	254, 255, 255, 255, 255, 255, 255, 255, 254, 254, 254, 253,
+	253, 252, 251, 250, 250, 249, 248, 246, 245, 244, 243, 241,
+	240, 238, 237, 235, 234, 232, 230, 228, 226, 224, 222, 220,
+	218, 215, 213, 211, 208, 206, 203, 201, 198, 196, 193, 190,
+	188, 185, 182, 179, 176, 173, 170, 167, 165, 162, 158, 155,
+	152, 149, 146, 143, 140, 137, 134, 131, 128, 124, 121, 118,
+	115, 112, 109, 106, 103, 100,  97,  93,  90,  88,  85,  82,
+	 79,  76,  73,  70,  67,  65,  62,  59,  57,  54,  52,  49,
+	 47,  44,  42,  40,  37,  35,  33,  31,  29,  27,  25,  23,
+	 21,  20,  18,  17,  15,  14,  12,  11,  10,   9,   7,   6,
+	  5,   5,   4,   3,   2,   2,   1,   1,   1,   0,   0,   0,
+	  0,   0,   0,   0,   1,   1,   1,   2,   2,   3,   4,   5,
+	  5,   6,   7,   9,  10,  11,  12,  14,  15,  17,  18,  20,
+	 21,  23,  25,  27,  29,  31,  33,  35,  37,  40,  42,  44,
+	 47,  49,  52,  54,  57,  59,  62,  65,  67,  70,  73,  76,
+	 79,  82,  85,  88,  90,  93,  97, 100, 103, 106, 109, 112,
+	115, 118, 121, 124,
+};
+
+/* 255 (i / 255)^2.2, perceived brightness to LED duty */
+static const uint8_t gamma[256] = {
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+	  0,   0,   0,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+	  1,   2,   2,   2,   2,   2,   2,   2,   3,   3,   3,   3,
+	  3,   4,   4,   4,   4,   5,   5,   5,   5,   6,   6,   6,
+	  6,   7,   7,   7,   8,   8,   8,   9,   9,   9,  10,  10,
+	 11,  11,  11,  12,  12,  13,  13,  13,  14,  14,  15,  15,
+	 16,  16,  17,  17,  18,  18,  19,  19,  20,  20,  21,  22,
+	 22,  23,  23,  24,  25,  25,  26,  26,  27,  28,  28,  29,
+	 30,  30,  31,  32,  33,  33,  34,  35,  35,  36,  37,  38,
+	 39,  39,  40,  41,  42,  43,  43,  44,  45,  46,  47,  48,
+	 49,  49,  50,  51,  52,  53,  54,  55,  56,  57,  58,  59,
+	 60,  61,  62,  63,  64,  65,  66,  67,  68,  69,  70,  71,
+	 73,  74,  75,  76,  77,  78,  79,  81,  82,  83,  84,  85,
+	 87,  88,  89,  90,  91,  93,  94,  95,  97,  98,  99, 100,
+	102, 103, 105, 106, 107, 109, 110, 111, 113, 114, 116, 117,
+	119, 120, 121, 123, 124, 126, 127, 129, 130, 132, 133, 135,
+	137, 138, 140, 141, 143, 145, 146, 148, 149, 151, 153, 154,
+	156, 158, 159, 161, 163, 165, 166, 168, 170, 172, 173, 175,
+	177, 179, 181, 182, 184, 186, 188, 190, 192, 194, 196, 197,
+	199, 201, 203, 205, 207, 209, 211, 213, 215, 217, 219, 221,
+	223, 225, 227, 229, 231, 234, 236, 238, 240, 242, 244, 246,
+	248, 251, 253, 255,
+};
+
+static const char *const fx_names[RGB_FX_COUNT] = {
+	[RGB_FX_REACTIVE] = "reactive",
+	[RGB_FX_BREATHING] = "breathing",
+	[RGB_FX_WAVE] = "wave",
+	[RGB_FX_RIPPLE] = "ripple",
+	[RGB_FX_HEATMAP] = "heatmap",
+};
+
+/* Reactive: keys released and not faded out yet, and when */
+static keypad_bitmap_t fading;
+static keypad_bitmap_t prev_held;
+static uint32_t released_ms[KEYPAD_MAX_KEYS];
+
+static struct {
+	uint8_t origin;
+	uint32_t start_ms;
+} ripples[RIPPLE_MAX];
+static uint8_t ripple_next;
+static uint8_t ripples_live;
+
+static uint8_t heat[KEYPAD_MAX_KEYS];
+static uint32_t heat_ms;
+
+static keypad_bitmap_t keys_mask(size_t keys)
+{
+	return keys >= KEYPAD_MAX_KEYS ? UINT32_MAX : BIT_MASK(keys);
+}
+
+static uint8_t fx_phase(const struct rgb_fx_input *in)
+{
+	uint32_t cycles;
+
+	if (in->span_ms == 0) {
+		return (in->sync_ms % CONFIG_KEYPAD_RGB_FX_PERIOD_MS) * 256 /
+		       CONFIG_KEYPAD_RGB_FX_PERIOD_MS;
+	}
+
+	/* A whole number of periods in the span, the nearest to the set one */
+	cycles = MAX((in->span_ms + CONFIG_KEYPAD_RGB_FX_PERIOD_MS / 2) /
+		     CONFIG_KEYPAD_RGB_FX_PERIOD_MS, 1);
+
+	return (in->sync_ms % in->span_ms) * cycles * 256 / in->span_ms;
+}
+
+/* 255 at age 0 down to 0 at CONFIG_KEYPAD_RGB_FADE_MS */
+static uint8_t fx_fade(uint32_t age_ms)
+{
+	if (age_ms >= CONFIG_KEYPAD_RGB_FADE_MS) {
+		return 0;
+	}
+
+	return 255 - age_ms * 255 / CONFIG_KEYPAD_RGB_FADE_MS;
+}
+
+static bool reactive_prepare(const struct rgb_fx_input *in, size_t keys)
+{
+	keypad_bitmap_t released = (prev_held | in->hits) & ~in->held;
+
+	for (keypad_bitmap_t b = released; b != 0; b &= b - 1) {
+		released_ms[find_lsb_set(b) - 1] = in->now_ms;
+	}
+
+	fading = (fading | released) & ~in->held & keys_mask(keys);
+	prev_held = in->held;
+
+	return fading != 0;
+}
+
+static uint8_t reactive_level(const struct rgb_fx_input *in, size_t i)
+{
+	uint8_t level;
+
+	if (in->held & BIT(i)) {
+		return 255;
+	}
+
+	if (!(fading & BIT(i))) {
+		return 0;
+	}
+
+	level = fx_fade(in->now_ms - released_ms[i]);
+	if (level == 0) {
+		fading &= ~BIT(i);
+	}
+
+	return level;
+}
+
+static bool ripple_prepare(const struct rgb_fx_input *in, size_t keys)
+{
+	for (keypad_bitmap_t b = in->hits & keys_mask(keys); b != 0;
+	     b &= b - 1) {
+		ripples[ripple_next].origin = find_lsb_set(b) - 1;
+		ripples[ripple_next].start_ms = in->now_ms;
+		ripples_live |= BIT(ripple_next);
+		ripple_next = (ripple_next + 1) % RIPPLE_MAX;
+	}
+
+	for (int r = 0; r < RIPPLE_MAX; r++) {
+		if (in->now_ms - ripples[r].start_ms >=
+		    CONFIG_KEYPAD_RGB_FADE_MS) {
+			ripples_live &= ~BIT(r);
+		}
+	}
+
+	return ripples_live != 0;
+}
+
+/* Rings cross the strip in CONFIG_KEYPAD_RGB_FADE_MS, one LED wide */
+static uint8_t ripple_level(const struct rgb_fx_input *in, size_t i,
+			    size_t len)
+{
+	uint8_t level = 0;
+
+	for (int r = 0; r < RIPPLE_MAX; r++) {
+		uint32_t age = in->now_ms - ripples[r].start_ms;
+		int32_t radius;
+		int32_t off;
+
+		if (!(ripples_live & BIT(r))) {
+			continue;
+		}
+
+		radius = age * len * 256 / CONFIG_KEYPAD_RGB_FADE_MS;
+		off = abs(abs((int)i - ripples[r].origin) * 256 - radius);
+		if (off < 256) {
+			level = MAX(level, (256 - off) * fx_fade(age) / 256);
+		}
+	}
+
+	return level;
+}
+
+static bool heatmap_prepare(const struct rgb_fx_input *in, size_t keys)
+{
+	uint32_t steps = (in->now_ms - heat_ms) / HEAT_DECAY_MS;
+	uint32_t cool = MIN(steps * HEAT_DECAY, 255);
+	bool warm = false;
+
+	heat_ms += steps * HEAT_DECAY_MS;
+
+	for (size_t i = 0; i < keys; i++) {
+		heat[i] -= MIN(heat[i], cool);
+		if (in->hits & BIT(i)) {
+			heat[i] = MIN(heat[i] + HEAT_HIT, 255);
+		}
+		warm |= heat[i] != 0;
+	}
+
+	return warm;
+}
+
+static uint8_t rgb_mix(uint8_t from, uint8_t to, uint8_t level)
+{
+	int32_t c = from + ((int32_t)to - from) * level / 255;
+
+	return gamma[c] * CONFIG_KEYPAD_RGB_BRIGHTNESS / 255;
+}
+
+bool rgb_fx_render(enum rgb_fx fx, const struct rgb_fx_input *in,
+		   struct led_rgb *frame, size_t len, size_t keys)
+{
+	uint8_t phase = fx_phase(in);
+	bool moving;
+
+	switch (fx) {
+	case RGB_FX_REACTIVE:
+		moving = reactive_prepare(in, keys);
+		break;
+	case RGB_FX_RIPPLE:
+		moving = ripple_prepare(in, keys);
+		break;
+	case RGB_FX_HEATMAP:
+		moving = heatmap_prepare(in, keys);
+		break;
+	default:
+		moving = true;
+		break;
+	}
+
+	for (size_t i = 0; i < len; i++) {
+		uint8_t level = 0;
+
+		switch (fx) {
+		case RGB_FX_REACTIVE:
+			level = i < keys ? reactive_level(in, i) : 0;
+			break;
+		case RGB_FX_BREATHING:
+			level = sine[phase];
+			break;
+		case RGB_FX_WAVE:
+			level = sine[(uint8_t)(phase - i * 256 / len)];
+			break;
+		case RGB_FX_RIPPLE:
+			level = ripple_level(in, i, len);
+			break;
+		case RGB_FX_HEATMAP:
+			level = i < keys ? heat[i] : 0;
+			break;
+		default:
+			break;
+		}
+
+		frame[i].r = rgb_mix(in->base.r, in->hit.r, level);
+		frame[i].g = rgb_mix(in->base.g, in->hit.g, level);
+		frame[i].b = rgb_mix(in->base.b, in->hit.b, level);
+	}
+
+	return moving;
+}
+
+void rgb_fx_reset(void)
+{
+	fading = 0;
+	prev_held = 0;
+	ripples_live = 0;
+	heat_ms = k_uptime_get_32();
+	memset(heat, 0, sizeof(heat));
+}
+
+const char *rgb_fx_name(enum rgb_fx fx)
+{
+	return fx < RGB_FX_COUNT ? fx_names[fx] : "?";
+}
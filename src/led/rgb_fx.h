@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Lighting effects of the per-key RGB, see led/led_rgb.h. Integer math
+ * only, with the sine and gamma curves as tables in flash. An effect
+ * renders a level of 0 (base color) to 255 (hit color) per LED, the
+ * gamma table turns the mix into LED duty.
+ */
+
+#ifndef KEYPAD_LED_RGB_FX_H_
+#define KEYPAD_LED_RGB_FX_H_
+
+#include <zephyr/zephyr.h>
+#include <zephyr/drivers/led_strip.h>
+
+#include "keymap.h"
+
+enum rgb_fx {
+	/* Hit color while held, fading out after the release */
+	RGB_FX_REACTIVE,
+	/* Every LED between the two colors on a sine */
+	RGB_FX_BREATHING,
+	/* The breathing sine moving along the strip */
+	RGB_FX_WAVE,
+	/* A ring running out from each pressed key */
+	RGB_FX_RIPPLE,
+	/* Keys glow with how much they were typed lately */
+	RGB_FX_HEATMAP,
+	RGB_FX_COUNT,
+};
+
+struct rgb_fx_input {
+	/* k_uptime_get_32() of the frame */
+	uint32_t now_ms;
+	/*
+	 * fx_clock_ms() of the frame, for the phase of the breathing and
+	 * the wave, and the span other keypads agree on it, 0 for all
+	 */
+	uint32_t sync_ms;
+	uint32_t span_ms;
+	/* Keys held, and pressed since the previous frame */
+	keypad_bitmap_t held;
+	keypad_bitmap_t hits;
+	struct led_rgb base;
+	struct led_rgb hit;
+};
+
+/*
+ * Render one frame of fx into frame[], LEDs 0 to keys - 1 under keys.
+ * Returns true while the effect moves, false once the frame is still.
+ */
+bool rgb_fx_render(enum rgb_fx fx, const struct rgb_fx_input *in,
+		   struct led_rgb *frame, size_t len, size_t keys);
+
+/* Drop the state of every effect, e.g. on suspend */
+void rgb_fx_reset(void);
+
+const char *rgb_fx_name(enum rgb_fx fx);
+
+#endif /* KEYPAD_LED_RGB_FX_H_ */
@@ -0,0 +1,518 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * A plain usage byte is a tap: pressed by one step, released by the
+ * next, so a 200 character macro is 400 reports and takes 400 host
+ * polls. Steps are pulled by the report scheduler while it builds a
+ * report, so the live keys of the same frame go out in the same report
+ * and nothing goes back through main between steps. Pauses run on one
+ * k_timer that wakes the scheduler when they end.
+ *
+ * An uploaded table goes into the one of two RAM buffers not in use and
+ * replaces the devicetree macros between two macros, never in the
+ * middle of one. With CONFIG_KEYPAD_CONFIG_XIP the stored table is
+ * played from flash at boot; only its entries are indexed in RAM, the
+ * sequences stay where they are. Each macro is pulled into the cache
+ * as it starts, so its steps never wait on a QSPI flash read.
+ *
+ * Text and unicode macros are plain sequences by the time they get
+ * here: the build writes the keys of each character on the host's
+ * layout, or of each code point for its input method, into
+ * macro_unicode.h, see scripts/gen_macro_unicode.py. Playback does no
+ * layout work at all.
+ */
+
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/init.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/logging/log.h>
+
+#include "macro.h"
+#include "report.h"
+#include "report_sched.h"
+#include "config/config_store.h"
+#include "config/config_xip.h"
+#include "macro_unicode.h"
+
+LOG_MODULE_REGISTER(macro, LOG_LEVEL_INF);
+
+struct macro {
+	const uint8_t *seq;
+	uint16_t len;
+	/* Pause after every step, 0 for one step per report */
+	uint16_t delay_ms;
+};
+
+#if DT_HAS_COMPAT_STATUS_OKAY(richeffects_keypad_macros)
+#define MACROS_NODE DT_INST(0, richeffects_keypad_macros)
+
+/*
+ * Sequences of the text macros, typed on CONFIG_KEYPAD_HOST_LAYOUT, and
+ * of the unicode macros, typed as set by host-os
+ */
+#define MACRO_UNICODE(node_id) \
+	UTIL_CAT(MACRO_UNICODE_SEQ_, DT_DEP_ORD(node_id))
+#define MACRO_UNICODE_LEN(node_id) \
+	UTIL_CAT(MACRO_UNICODE_LEN_, DT_DEP_ORD(node_id))
+#define MACRO_GENERATED(node_id)					\
+	UTIL_OR(DT_NODE_HAS_PROP(node_id, unicode),			\
+		DT_NODE_HAS_PROP(node_id, text))
+
+#define MACRO_SEQ(node_id)						\
+	COND_CODE_1(MACRO_GENERATED(node_id),				\
+		    (MACRO_UNICODE(node_id)),				\
+		    (DT_PROP(node_id, sequence)))
+#define MACRO_LEN(node_id)						\
+	COND_CODE_1(MACRO_GENERATED(node_id),				\
+		    (MACRO_UNICODE_LEN(node_id)),			\
+		    (DT_PROP_LEN(node_id, sequence)))
+
+#define MACRO_ENTRY(node_id) {						\
+	.seq = (const uint8_t[])MACRO_SEQ(node_id),			\
+	.len = MACRO_LEN(node_id),					\
+	.delay_ms = DT_PROP(node_id, delay_ms),				\
+},
+
+static const struct macro macros[] = {
+	DT_FOREACH_CHILD_STATUS_OKAY(MACROS_NODE, MACRO_ENTRY)
+};
+#else
+static const struct macro macros[] = {};
+#endif
+
+BUILD_ASSERT(ARRAY_SIZE(macros) <= MACRO_MAX, "too many macros");
+
+/* Macro table in use, only moved by the report thread */
+static const struct macro *table = macros;
+static size_t table_len = ARRAY_SIZE(macros);
+
+#if defined(CONFIG_KEYPAD_MACRO_UPLOAD)
+struct macro_upload {
+	struct macro macros[MACRO_MAX];
+	size_t count;
+	/* Bytes of data the entries take, as uploaded */
+	size_t len;
+	uint8_t data[CONFIG_KEYPAD_MACRO_UPLOAD_SIZE];
+};
+
+static struct macro_upload uploads[2];
+/* Committed upload, not yet taken by the report thread */
+static atomic_ptr_t upload_next;
+static atomic_t upload_editing;
+#endif
+
+/* Macros queued for playback, one bit per id */
+static uint32_t pending;
+/* Macro being played and the position in its sequence */
+static const struct macro *playing;
+static uint16_t pos;
+/* The usage at pos has been pressed by the previous step */
+static bool tap_down;
+
+static atomic_t pausing;
+static struct k_timer pause_timer;
+
+static void pause_expired(struct k_timer *timer)
+{
+	atomic_set(&pausing, 0);
+	report_sched_notify();
+}
+
+static void macro_pause(uint32_t ms)
+{
+	if (ms == 0) {
+		return;
+	}
+
+	atomic_set(&pausing, 1);
+	k_timer_start(&pause_timer, K_MSEC(ms), K_NO_WAIT);
+}
+
+size_t macro_count(void)
+{
+	return table_len;
+}
+
+void macro_play(uint8_t id)
+{
+	if (id >= MACRO_MAX) {
+		return;
+	}
+
+	pending |= BIT(id);
+}
+
+bool macro_ready(void)
+{
+	return (playing != NULL || pending != 0) && !atomic_get(&pausing);
+}
+
+/* Apply one step at pos. Returns true if the report changed */
+static bool macro_step(void)
+{
+	uint8_t op = playing->seq[pos];
+
+	switch (op) {
+	case MACRO_DOWN:
+	case MACRO_UP:
+	case MACRO_WAIT:
+		if (pos + 1 >= playing->len) {
+			/* Truncated opcode: end the macro */
+			pos = playing->len;
+			return false;
+		}
+		break;
+	default:
+		break;
+	}
+
+	switch (op) {
+	case MACRO_DOWN:
+		report_key_press(playing->seq[pos + 1]);
+		pos += 2;
+		return true;
+	case MACRO_UP:
+		report_key_release(playing->seq[pos + 1]);
+		pos += 2;
+		return true;
+	case MACRO_WAIT:
+		macro_pause(playing->seq[pos + 1]);
+		pos += 2;
+		return false;
+	default:
+		if (!tap_down) {
+			report_key_press(op);
+			tap_down = true;
+		} else {
+			report_key_release(op);
+			tap_down = false;
+			pos++;
+		}
+		return true;
+	}
+}
+
+#if defined(CONFIG_KEYPAD_MACRO_UPLOAD)
+static void macro_table_swap(void)
+{
+	struct macro_upload *next = atomic_ptr_set(&upload_next, NULL);
+
+	if (next != NULL) {
+		table = next->macros;
+		table_len = next->count;
+	}
+}
+
+static struct macro_upload *upload_inactive(void)
+{
+	return table == uploads[0].macros ? &uploads[1] : &uploads[0];
+}
+
+/* Every usage the sequence presses shows in the report */
+static bool macro_seq_reportable(const uint8_t *seq, size_t len)
+{
+	size_t pos = 0;
+
+	while (pos < len) {
+		switch (seq[pos]) {
+		case MACRO_DOWN:
+		case MACRO_UP:
+			if (pos + 1 < len &&
+			    !report_usage_reportable(seq[pos + 1])) {
+				return false;
+			}
+			pos += 2;
+			break;
+		case MACRO_WAIT:
+			pos += 2;
+			break;
+		default:
+			if (!report_usage_reportable(seq[pos])) {
+				return false;
+			}
+			pos++;
+			break;
+		}
+	}
+
+	return true;
+}
+
+/* Entries of a table in upload format, pointing into data */
+static int macro_index(struct macro *index, size_t *count,
+		       const uint8_t *data, size_t len)
+{
+	size_t pos = 0;
+
+	*count = 0;
+	while (pos < len) {
+		struct macro *m;
+
+		if (*count == MACRO_MAX || len - pos < 4 ||
+		    sys_get_le16(&data[pos]) > len - pos - 4) {
+			return -EINVAL;
+		}
+
+		m = &index[(*count)++];
+		m->len = sys_get_le16(&data[pos]);
+		m->delay_ms = sys_get_le16(&data[pos + 2]);
+		m->seq = &data[pos + 4];
+		if (!macro_seq_reportable(m->seq, m->len)) {
+			return -EINVAL;
+		}
+		pos += 4 + m->len;
+	}
+
+	return 0;
+}
+
+#if defined(CONFIG_KEYPAD_CONFIG_STORE)
+BUILD_ASSERT(CONFIG_KEYPAD_MACRO_UPLOAD_SIZE <=
+	     CONFIG_KEYPAD_CONFIG_STORE_MAX_SIZE,
+	     "an uploaded table must fit a stored value");
+
+#if defined(CONFIG_KEYPAD_CONFIG_XIP)
+/* Stored table read in place, indexed at boot */
+static struct macro xip_macros[MACRO_MAX];
+static const uint8_t *xip_data;
+static size_t xip_len;
+#endif
+
+/*
+ * The latest table committed, in upload format. Nothing for the
+ * devicetree macros, which deletes the stored table.
+ */
+static ssize_t macro_store_get(void *buf, size_t size)
+{
+	const struct macro_upload *latest = atomic_ptr_get(&upload_next);
+
+#if defined(CONFIG_KEYPAD_CONFIG_XIP)
+	if (latest == NULL && table == xip_macros) {
+		memcpy(buf, xip_data, xip_len);
+		return xip_len;
+	}
+#endif
+
+	if (latest == NULL && table != macros) {
+		latest = CONTAINER_OF(table, struct macro_upload, macros);
+	}
+
+	if (latest == NULL) {
+		return 0;
+	}
+
+	memcpy(buf, latest->data, latest->len);
+
+	return latest->len;
+}
+
+static int macro_store_set(const void *data, size_t len)
+{
+#if defined(CONFIG_KEYPAD_CONFIG_XIP)
+	size_t count;
+	int ret;
+
+	/* Nothing plays before the report thread runs */
+	ret = macro_index(xip_macros, &count, data, len);
+	if (ret == 0) {
+		xip_data = data;
+		xip_len = len;
+		table = xip_macros;
+		table_len = count;
+	}
+
+	return ret;
+#else
+	size_t size;
+	uint8_t *buf = macro_upload_begin(&size);
+	int ret;
+
+	if (buf == NULL) {
+		return -EBUSY;
+	}
+
+	if (len > size) {
+		macro_upload_abort();
+		return -EINVAL;
+	}
+
+	memcpy(buf, data, len);
+	ret = macro_upload_commit(len);
+	if (ret == 0) {
+		/* Nothing plays before the report thread runs */
+		macro_table_swap();
+	}
+
+	return ret;
+#endif
+}
+#endif /* CONFIG_KEYPAD_CONFIG_STORE */
+
+static struct config_entry macro_entry = {
+	.name = "keypad/macros",
+#if defined(CONFIG_KEYPAD_CONFIG_STORE)
+	.get = macro_store_get,
+	.set = macro_store_set,
+#endif
+#if defined(CONFIG_KEYPAD_CONFIG_XIP)
+	.xip = XIP_TABLE_MACROS,
+#endif
+};
+
+uint8_t *macro_upload_begin(size_t *size)
+{
+	if (atomic_set(&upload_editing, 1) != 0) {
+		return NULL;
+	}
+
+	if (atomic_ptr_get(&upload_next) != NULL) {
+		/* The last commit has not been taken yet */
+		atomic_set(&upload_editing, 0);
+		return NULL;
+	}
+
+	*size = sizeof(uploads[0].data);
+
+	return upload_inactive()->data;
+}
+
+int macro_upload_commit(size_t len)
+{
+	struct macro_upload *up = upload_inactive();
+	int ret;
+
+	if (atomic_get(&upload_editing) == 0) {
+		return -EACCES;
+	}
+
+	ret = macro_index(up->macros, &up->count, up->data, len);
+	if (ret < 0) {
+		atomic_set(&upload_editing, 0);
+		return ret;
+	}
+
+	up->len = len;
+	atomic_ptr_set(&upload_next, up);
+	atomic_set(&upload_editing, 0);
+
+	/* Swap even when no macro is played meanwhile */
+	report_sched_notify();
+	config_store_changed(&macro_entry);
+
+	return 0;
+}
+
+void macro_upload_abort(void)
+{
+	atomic_set(&upload_editing, 0);
+}
+
+int macro_upload_patch(uint8_t id, size_t entry_len, uint8_t **entry,
+		       size_t *len)
+{
+	size_t size;
+	size_t pos = 0;
+	uint8_t *buf;
+
+	if (id >= MACRO_MAX || entry_len < 4) {
+		return -EINVAL;
+	}
+
+	buf = macro_upload_begin(&size);
+	if (buf == NULL) {
+		return -EBUSY;
+	}
+
+	/* No commit is pending, so the report thread leaves table alone */
+	for (size_t i = 0; i < MAX(table_len, id + 1); i++) {
+		const struct macro *m = i < table_len ? &table[i] : NULL;
+		size_t n = i == id ? entry_len : 4 + (m != NULL ? m->len : 0);
+
+		if (n > size - pos) {
+			macro_upload_abort();
+			return -ENOSPC;
+		}
+
+		if (i == id) {
+			*entry = &buf[pos];
+		} else {
+			sys_put_le16(m != NULL ? m->len : 0, &buf[pos]);
+			sys_put_le16(m != NULL ? m->delay_ms : 0, &buf[pos + 2]);
+			if (m != NULL) {
+				memcpy(&buf[pos + 4], m->seq, m->len);
+			}
+		}
+
+		pos += n;
+	}
+
+	*len = pos;
+
+	return 0;
+}
+#else
+static inline void macro_table_swap(void) {}
+#endif
+
+bool macro_frame(void)
+{
+	bool changed = false;
+
+	while (!changed && !atomic_get(&pausing)) {
+		if (playing == NULL) {
+			uint8_t id;
+
+			macro_table_swap();
+			if (pending == 0) {
+				break;
+			}
+
+			id = find_lsb_set(pending) - 1;
+			pending &= ~BIT(id);
+			if (id >= table_len) {
+				continue;
+			}
+
+			playing = &table[id];
+			pos = 0;
+			tap_down = false;
+			config_xip_prefetch(playing->seq, playing->len);
+		}
+
+		if (pos == playing->len) {
+			playing = NULL;
+			continue;
+		}
+
+		changed = macro_step();
+	}
+
+	if (changed && playing->delay_ms != 0) {
+		macro_pause(playing->delay_ms);
+	}
+
+	return changed;
+}
+
+static int macro_init(const struct device *dev)
+{
+	ARG_UNUSED(dev);
+
+	k_timer_init(&pause_timer, pause_expired, NULL);
+
+#if defined(CONFIG_KEYPAD_MACRO_UPLOAD)
+	/* Before layer_init(), which checks the keymap's macro ids */
+	if (config_store_register(&macro_entry) < 0) {
+		LOG_WRN("Stored macros not loaded");
+	}
+#endif
+
+	return 0;
+}
+
+SYS_INIT(macro_init, APPLICATION, 0);
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Macro player. Sequences live in flash, generated from the
+ * richeffects,keypad-macros devicetree node, and are played into the
+ * report one step per report next to the live keys. With
+ * CONFIG_KEYPAD_MACRO_UPLOAD a table uploaded at runtime replaces them.
+ */
+
+#ifndef KEYPAD_MACRO_H_
+#define KEYPAD_MACRO_H_
+
+#include <zephyr/zephyr.h>
+#include <dt-bindings/keypad/macros.h>
+
+/* Upper bound on the number of macros, one pending bit each */
+#define MACRO_MAX 32
+
+/* Number of macros in the table in use */
+size_t macro_count(void);
+
+/*
+ * Queue macro id for playback. Macros play one after the other in id
+ * order; a macro already queued or playing is not queued again.
+ */
+void macro_play(uint8_t id);
+
+/*
+ * Report thread, once per report: apply the next step of the macro
+ * being played. Returns true if the report changed.
+ */
+bool macro_frame(void);
+
+/* A step can be applied now, i.e. playing and not pausing */
+bool macro_ready(void);
+
+#if defined(CONFIG_KEYPAD_MACRO_UPLOAD)
+
+/*
+ * Replace the macro table. macro_upload_begin() returns the spare
+ * buffer and its size, or NULL while another upload or an untaken
+ * commit is outstanding. The caller fills it with one entry per macro,
+ * in id order:
+ *
+ *   le16 sequence length, le16 delay-ms, sequence bytes
+ *
+ * macro_upload_commit() checks the entries and hands the table to the
+ * report thread, which swaps it in as soon as no macro is playing.
+ */
+uint8_t *macro_upload_begin(size_t *size);
+int macro_upload_commit(size_t len);
+void macro_upload_abort(void);
+
+/*
+ * Replace macro id only, instead of macro_upload_begin(): the table in
+ * use is laid out in the spare buffer with room for an entry of
+ * entry_len bytes at id, ids past its end are added empty. Returns the
+ * place to write the entry to and the table length to commit, -EBUSY
+ * like macro_upload_begin() or -ENOSPC if the table would not fit.
+ */
+int macro_upload_patch(uint8_t id, size_t entry_len, uint8_t **entry,
+		       size_t *len);
+
+#endif /* CONFIG_KEYPAD_MACRO_UPLOAD */
+
+#endif /* KEYPAD_MACRO_H_ */
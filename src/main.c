@@ -19,16 +19,55 @@
 #include <zephyr/usb/usb_device.h>
 #include <zephyr/usb/class/usb_hid.h>
 
+#include "ble/ble_hid.h"
+#include "dfu/dfu.h"
+#include "diag/inject.h"
+#include "diag/journal.h"
+#include "diag/log_flush.h"
+#include "diag/startup.h"
+#include "diag/watchdog.h"
+#include "display/status_display.h"
+#include "esb/esb_sink.h"
+#include "feedback/click.h"
+#include "feedback/haptic.h"
+#include "host_leds.h"
+#include "input/encoder.h"
+#include "input/slider.h"
+#include "input/split.h"
+#include "irq_plan.h"
+#include "keymap.h"
+#include "keys.h"
+#include "layer.h"
+#include "led/fx_clock.h"
+#include "led/led_pwm.h"
+#include "led/led_rgb.h"
+#include "power/deep_sleep.h"
+#include "report.h"
+#include "report_sched.h"
+#include "scan.h"
+#include "suspend.h"
+#include "upload.h"
+#include "usb/control.h"
+#include "usb/gamepad.h"
+#include "usb/hid_iface.h"
+#include "usb/hid_shared.h"
+#include "usb/midi.h"
+#include "usb/mouse.h"
+#include "usb/poll_profile.h"
+#include "usb/raw_hid.h"
+#include "usb/usb_attach.h"
+#include "usb/usb_fault.h"
+#include "usb/usb_health.h"
+#include "usb/usb_sink.h"
+#include "usb/usb_state.h"
+#include "usb/webusb.h"
+
 #define LOG_LEVEL LOG_LEVEL_INF
 LOG_MODULE_REGISTER(main);
 
 /*
- * Devicetree node identifiers for the buttons and LEDs
+ * Devicetree node identifiers for the LEDs
  */
-#define SW0_NODE DT_ALIAS(sw0)
-#define SW1_NODE DT_ALIAS(sw1)
-#define SW2_NODE DT_ALIAS(sw2)
-#define SW3_NODE DT_ALIAS(sw3)
 #define LED0_NODE DT_ALIAS(led0)
 #define LED1_NODE DT_ALIAS(led1)
 #define LED2_NODE DT_ALIAS(led2)
@@ -40,315 +79,399 @@ LOG_MODULE_REGISTER(main);
  */
 #define GPIO_SPEC(node_id) GPIO_DT_SPEC_GET_OR(node_id, gpios, {0})
 
-
-/*
- * Macro for byte position in HID report packet
-*/
-#define KEYPAD_BTN_MODIFIER_REPORT_POS 0
-#define KEYPAD_BTN_LED_REPORT_POS 2
-#define KEYPAD_BTN_CODE_REPORT_POS 7
-
 /*
  * Create gpio_dt_spec structures from the devicetree.
  */
 static const struct gpio_dt_spec 
-	sw0 = GPIO_SPEC(SW0_NODE),
-	sw1 = GPIO_SPEC(SW1_NODE),
-	sw2 = GPIO_SPEC(SW2_NODE),
-	sw3 = GPIO_SPEC(SW3_NODE),
 	led0 = GPIO_SPEC(LED0_NODE),
 	led1 = GPIO_SPEC(LED1_NODE),
 	led2 = GPIO_SPEC(LED2_NODE),
 	led3 = GPIO_SPEC(LED3_NODE);
 
-static const uint8_t hid_report_desc[] = HID_KEYBOARD_REPORT_DESC();
-
-static uint8_t def_val[4];
-static volatile uint8_t status[8];
-static K_SEM_DEFINE(sem, 0, 1); /* starts off "not available" */
-static struct gpio_callback callback[4];
-static enum usb_dc_status_code usb_status;
-
-static void status_cb(enum usb_dc_status_code status, const uint8_t *param)
+static const struct gpio_dt_spec *const leds[] = {
+	&led0, &led1, &led2, &led3,
+};
+
+static const struct hid_ops ops = {
+	.get_report = report_sched_get_report,
+	.set_report = host_leds_set_report,
+	.protocol_change = report_sched_protocol_change,
+	.on_idle = report_sched_idle,
+	.int_in_ready = usb_sink_in_ready,
+#if defined(CONFIG_ENABLE_HID_INT_OUT_EP)
+	.int_out_ready = host_leds_out_ready,
+#endif
+};
+
+/* Forget every in-flight transfer, they never complete */
+static void usb_ifaces_reset(void)
 {
-	usb_status = status;
+	usb_sink_reset();
+	report_sched_reset();
+	/* Ahead of its classes, which write again from their reset */
+	hid_shared_reset();
+	encoder_reset();
+	control_reset();
+	mouse_reset();
+	gamepad_reset();
+	raw_hid_reset();
 }
 
-static void one_button(const struct device *gpio, struct gpio_callback *cb,
-			uint32_t pins)
-{
-	int ret;
-	uint8_t state = status[KEYPAD_BTN_CODE_REPORT_POS];
+/* Given once the host has configured the device */
+static K_SEM_DEFINE(configured_sem, 0, 1);
 
-	if (IS_ENABLED(CONFIG_USB_DEVICE_REMOTE_WAKEUP)) {
-		if (usb_status == USB_DC_SUSPEND) {
-			usb_wakeup_request();
-			return;
-		}
-	}
-
-	ret = gpio_pin_get(gpio, sw0.pin);
-	if (ret < 0) {
-		LOG_ERR("Failed to get the state of port %s pin %u, error: %d",
-			gpio->name, sw0.pin, ret);
+static void status_cb(enum usb_dc_status_code status, const uint8_t *param)
+{
+	usb_health_status(status);
+	usb_fault_status(status);
+
+	if (status == USB_DC_SOF) {
+		/* Not a device state change */
+		report_sched_sof();
+		midi_sof();
+		fx_clock_sof();
+		inject_sof();
 		return;
 	}
 
-	if (def_val[0] != (uint8_t)ret) {
-		state = HID_KEY_R;
-	} else {
-		state = HID_KBD_MODIFIER_NONE;
+	if (status == USB_DC_CONFIGURED) {
+		k_sem_give(&configured_sem);
 	}
 
-	if (status[KEYPAD_BTN_CODE_REPORT_POS] != state) {
-		status[KEYPAD_BTN_CODE_REPORT_POS] = state;
-		k_sem_give(&sem);
+	journal_put(JOURNAL_USB, status, 0);
+	usb_state_event(status);
+	/* Once the state is in, a configured device takes the reports */
+	usb_attach_status(status);
+}
+
+static void leds_suspend(bool suspended)
+{
+	if (!suspended) {
+		/* Activity LED starts again with the next report */
+		return;
 	}
+
+	gpio_pin_set_dt(&led0, 0);
+	gpio_pin_set_dt(&led1, 0);
+	gpio_pin_set_dt(&led2, 0);
+	gpio_pin_set_dt(&led3, 0);
 }
 
-static void two_button(const struct device *gpio, struct gpio_callback *cb,
-			 uint32_t pins)
+static struct suspend_listener led_listener = {
+	.changed = leds_suspend,
+};
+
+/* Register every HID interface, call before usb_enable() */
+static int usb_init(const struct device *hid_dev)
 {
+	const uint8_t *hid_report_desc;
+	size_t hid_report_desc_size;
 	int ret;
-	uint8_t state = status[KEYPAD_BTN_CODE_REPORT_POS];
 
-	if (IS_ENABLED(CONFIG_USB_DEVICE_REMOTE_WAKEUP)) {
-		if (usb_status == USB_DC_SUSPEND) {
-			usb_wakeup_request();
-			return;
-		}
+	hid_report_desc = report_desc_get(&hid_report_desc_size);
+	usb_hid_register_device(hid_dev, hid_report_desc, 
+				hid_report_desc_size, &ops);
+
+#if defined(CONFIG_USB_HID_BOOT_PROTOCOL)
+	/* Boot keyboard subclass, for BIOS and UEFI setup screens */
+	ret = usb_hid_set_proto_code(hid_dev, HID_BOOT_IFACE_CODE_KEYBOARD);
+	if (ret < 0) {
+		LOG_ERR("Failed to set the boot protocol code, error: %d", ret);
+		return ret;
 	}
+#endif
+	
+	usb_hid_init(hid_dev);
+	usb_sink_init(hid_dev);
 
-	ret = gpio_pin_get(gpio, sw1.pin);
+	ret = control_init();
 	if (ret < 0) {
-		LOG_ERR("Failed to get the state of port %s pin %u, error: %d",
-			gpio->name, sw1.pin, ret);
-		return;
+		LOG_ERR("Failed to start the control interfaces, error: %d",
+			ret);
+		return ret;
 	}
 
-	if (def_val[1] != (uint8_t)ret) {
-		state = HID_KEY_I;
-	} else {
-		state = HID_KBD_MODIFIER_NONE;
+	ret = encoder_init();
+	if (ret < 0) {
+		LOG_ERR("Failed to start the encoder, error: %d", ret);
+		return ret;
 	}
 
-	if (status[KEYPAD_BTN_CODE_REPORT_POS] != state) {
-		status[KEYPAD_BTN_CODE_REPORT_POS] = state;
-		k_sem_give(&sem);
+	ret = slider_init();
+	if (ret < 0) {
+		LOG_ERR("Failed to start the slider, error: %d", ret);
+		return ret;
 	}
-}
 
-static void three_button(const struct device *gpio, struct gpio_callback *cb,
-			 uint32_t pins)
-{
-	int ret;
-	uint8_t state = status[KEYPAD_BTN_CODE_REPORT_POS];
+	ret = mouse_init();
+	if (ret < 0) {
+		LOG_ERR("Failed to start mouse keys, error: %d", ret);
+		return ret;
+	}
 
-	if (IS_ENABLED(CONFIG_USB_DEVICE_REMOTE_WAKEUP)) {
-		if (usb_status == USB_DC_SUSPEND) {
-			usb_wakeup_request();
-			return;
-		}
+	/* Consumer, System Control, encoder and mouse keys are in */
+	ret = hid_shared_init();
+	if (ret < 0) {
+		LOG_ERR("Failed to start the shared HID interface, error: %d",
+			ret);
+		return ret;
 	}
 
-	ret = gpio_pin_get(gpio, sw2.pin);
+	ret = gamepad_init();
 	if (ret < 0) {
-		LOG_ERR("Failed to get the state of port %s pin %u, error: %d",
-			gpio->name, sw2.pin, ret);
-		return;
+		LOG_ERR("Failed to start the gamepad, error: %d", ret);
+		return ret;
+	}
+
+	ret = raw_hid_init();
+	if (ret < 0) {
+		LOG_ERR("Failed to start the configuration interface, error: %d",
+			ret);
+		return ret;
 	}
 
-	if (def_val[2] != (uint8_t)ret) {
-		state = HID_KEY_C;
-	} else {
-		state = HID_KBD_MODIFIER_NONE;
+	ret = webusb_init();
+	if (ret < 0) {
+		LOG_ERR("Failed to start WebUSB, error: %d", ret);
+		return ret;
 	}
 
-	if (status[KEYPAD_BTN_CODE_REPORT_POS] != state) {
-		status[KEYPAD_BTN_CODE_REPORT_POS] = state;
-		k_sem_give(&sem);
+	ret = midi_init();
+	if (ret < 0) {
+		LOG_ERR("Failed to start MIDI, error: %d", ret);
+		return ret;
 	}
+
+	return 0;
 }
 
-static void four_button(const struct device *gpio, struct gpio_callback *cb,
-			 uint32_t pins)
+/*
+ * Scan interrupt -> input thread -> link. The thread is cooperative
+ * and ahead of every work queue, so once the ring wakes it, it builds
+ * and writes the report before any background work runs. It waits on
+ * a semaphore and the links take reports without locks, so it never
+ * waits on a lower priority thread.
+ */
+static void input_run(void *p1, void *p2, void *p3)
 {
 	int ret;
-	uint8_t state = status[KEYPAD_BTN_CODE_REPORT_POS];
 
-	if (IS_ENABLED(CONFIG_USB_DEVICE_REMOTE_WAKEUP)) {
-		if (usb_status == USB_DC_SUSPEND) {
-			usb_wakeup_request();
-			return;
-		}
-	}
+	while (true) {
+		/* The ring is drained, the log can go out between frames */
+		log_flush_kick();
 
-	ret = gpio_pin_get(gpio, sw3.pin);
-	if (ret < 0) {
-		LOG_ERR("Failed to get the state of port %s pin %u, error: %d",
-			gpio->name, sw3.pin, ret);
-		return;
-	}
+		if (report_sched_process() == 0 || suspend_is_active()) {
+			continue;
+		}
 
-	if (def_val[3] != (uint8_t)ret) {
-		state = HID_KEY_H;
-	} else {
-		state = HID_KBD_MODIFIER_NONE;
-	}
+		if (IS_ENABLED(CONFIG_KEYPAD_LED_PWM)) {
+			/* Key presses flash the LEDs from the PWM instead */
+			continue;
+		}
 
-	if (status[KEYPAD_BTN_CODE_REPORT_POS] != state) {
-		status[KEYPAD_BTN_CODE_REPORT_POS] = state;
-		k_sem_give(&sem);
+		/* Toggle LED on sent reports */
+		ret = gpio_pin_toggle(led0.port, led0.pin);
+		if (ret < 0) {
+			LOG_ERR("Failed to toggle the LED pin, error: %d", ret);
+		}
 	}
 }
 
-int callbacks_configure(const struct gpio_dt_spec *spec,
-			gpio_callback_handler_t handler,
-			struct gpio_callback *callback, uint8_t *val)
+K_THREAD_DEFINE(input_thread, CONFIG_KEYPAD_INPUT_STACK_SIZE, input_run, NULL,
+		NULL, NULL, CONFIG_KEYPAD_INPUT_THREAD_PRIORITY, 0,
+		SYS_FOREVER_MS);
+
+static int usb_start(const struct device *hid_dev)
 {
-	const struct device *gpio = spec->port;
-	gpio_pin_t pin = spec->pin;
 	int ret;
 
-	if (gpio == NULL) {
-		/* Optional GPIO is missing. */
-		return 0;
+	ret = usb_init(hid_dev);
+	if (ret < 0) {
+		return ret;
 	}
 
-	if (!device_is_ready(gpio)) {
-		LOG_ERR("GPIO port %s is not ready", gpio->name);
-		return -ENODEV;
-	}
+	usb_state_init(usb_ifaces_reset);
+	usb_health_init(usb_ifaces_reset);
+	usb_fault_init(status_cb);
 
-	ret = gpio_pin_configure_dt(spec, GPIO_INPUT);
+	ret = poll_profile_init(hid_dev, status_cb);
 	if (ret < 0) {
-		LOG_ERR("Failed to configure port %s pin %u, error: %d",
-			gpio->name, pin, ret);
+		LOG_ERR("Failed to set the polling profile, error: %d", ret);
 		return ret;
 	}
 
-	ret = gpio_pin_get(gpio, pin);
-	if (ret < 0) {
-		LOG_ERR("Failed to get the state of port %s pin %u, error: %d",
-			gpio->name, pin, ret);
+	ret = usb_enable(status_cb);
+	if (ret != 0) {
+		LOG_ERR("Failed to enable USB");
 		return ret;
 	}
 
-	*val = (uint8_t)ret;
+	startup_mark(STARTUP_USB_ENABLED);
+
+	return 0;
+}
 
-	gpio_init_callback(callback, handler, BIT(pin));
-	ret = gpio_add_callback(gpio, callback);
+static int input_start(void)
+{
+	int ret;
+
+	ret = layer_init();
 	if (ret < 0) {
-		LOG_ERR("Failed to add the callback for port %s pin %u, "
-			"error: %d",
-			gpio->name, pin, ret);
+		LOG_ERR("Failed to set up the keymap layers, error: %d", ret);
 		return ret;
 	}
 
-	ret = gpio_pin_interrupt_configure_dt(spec, GPIO_INT_EDGE_BOTH);
+	ret = split_init(keys_changed);
 	if (ret < 0) {
-		LOG_ERR("Failed to configure interrupt for port %s pin %u, "
-			"error: %d",
-			gpio->name, pin, ret);
+		LOG_ERR("Failed to start the split link, error: %d", ret);
 		return ret;
 	}
 
+	/* A satellite's keys only go to the master */
+	ret = scan_init(IS_ENABLED(CONFIG_KEYPAD_SPLIT_SATELLITE) ?
+			split_keys_changed : keys_changed);
+	if (ret) {
+		LOG_ERR("Failed configuring key scan engine.");
+		return ret;
+	}
+
+	startup_mark(STARTUP_INPUT_READY);
+	deep_sleep_start();
+
 	return 0;
 }
 
+static int leds_init(void)
+{
+	int ret;
+
+	for (size_t i = 0; i < ARRAY_SIZE(leds); i++) {
+		if (!device_is_ready(leds[i]->port)) {
+			LOG_ERR("LED device %s is not ready",
+				leds[i]->port->name);
+			return -ENODEV;
+		}
+
+		ret = gpio_pin_configure_dt(leds[i], GPIO_OUTPUT);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+/* The keypad types without these, they start once it does */
+static const struct {
+	const char *name;
+	int (*init)(void);
+} deferred[] = {
+	{ "BLE", ble_hid_init },
+	{ "the LEDs", leds_init },
+	{ "LED PWM", led_pwm_init },
+	{ "the stored LED levels", upload_init },
+	{ "RGB lighting", led_rgb_init },
+	{ "haptic feedback", haptic_init },
+	{ "click feedback", click_init },
+	{ "the status display", status_display_init },
+	/* A test image that got this far keeps itself */
+	{ "the DFU image check", dfu_init },
+};
+
+/*
+ * On main's own stack, at CONFIG_KEYPAD_DEFERRED_INIT_PRIORITY: after
+ * the host configured the device, or a timeout off the cable, so none
+ * of it delays enumeration or the first report. A subsystem that fails
+ * is left out, the others still start.
+ */
+static void deferred_init(bool woke)
+{
+	int ret;
+
+	k_thread_priority_set(k_current_get(),
+			      CONFIG_KEYPAD_DEFERRED_INIT_PRIORITY);
+	(void)k_sem_take(&configured_sem,
+			 woke ? K_NO_WAIT :
+			 K_MSEC(CONFIG_KEYPAD_DEFERRED_INIT_TIMEOUT_MS));
+
+	for (size_t i = 0; i < ARRAY_SIZE(deferred); i++) {
+		if (woke && deferred[i].init == ble_hid_init) {
+			/* Already up for the host waiting on it */
+			continue;
+		}
+
+		ret = deferred[i].init();
+		if (ret < 0) {
+			LOG_ERR("Failed to start %s, error: %d",
+				deferred[i].name, ret);
+		}
+	}
+
+	startup_mark(STARTUP_DEFERRED);
+}
+
 void main(void)
 {
 	LOG_INF("Starting application");
 
 	int ret;
-	uint8_t report[8] = { 0x00 };
 	const struct device *hid_dev;
+	bool woke = deep_sleep_woke();
 
-	if (!device_is_ready(led0.port)) {
-		LOG_ERR("LED device %s is not ready", led0.port->name);
-		return;
-	}
-	if (!device_is_ready(led1.port)) {
-		LOG_ERR("LED device %s is not ready", led1.port->name);
-		return;
-	}
-	if (!device_is_ready(led2.port)) {
-		LOG_ERR("LED device %s is not ready", led2.port->name);
-		return;
-	}
-	if (!device_is_ready(led3.port)) {
-		LOG_ERR("LED device %s is not ready", led3.port->name);
-		return;
-	}
+	startup_mark(STARTUP_MAIN);
 
-	hid_dev = device_get_binding("HID_0");
+	/* Every driver has connected its interrupts by now */
+	irq_plan_init();
+
+	hid_dev = hid_iface_get(HID_IFACE_KEYBOARD);
 	if (hid_dev == NULL) {
 		LOG_ERR("Cannot get USB HID Device");
 		return;
 	}
 
-	ret = gpio_pin_configure_dt(&led0, GPIO_OUTPUT);
-	if (ret < 0) {
-		LOG_ERR("Failed to configure the LED pin, error: %d", ret);
-		return;
-	}
-	ret = gpio_pin_configure_dt(&led1, GPIO_OUTPUT);
-	if (ret < 0) {
-		LOG_ERR("Failed to configure the LED pin, error: %d", ret);
-		return;
-	}
-	ret = gpio_pin_configure_dt(&led2, GPIO_OUTPUT);
-	if (ret < 0) {
-		LOG_ERR("Failed to configure the LED pin, error: %d", ret);
+	/*
+	 * Only what a report needs comes up here: USB, the links and the
+	 * key path. USB goes first, the host takes tens of milliseconds to
+	 * reset and enumerate the device and the rest runs meanwhile.
+	 * Woken from System OFF the keypad is off the cable, with a BLE
+	 * host waiting for the key that woke it: BLE comes first then, and
+	 * USB last.
+	 */
+	suspend_listener_register(&led_listener);
+	host_leds_init();
+
+	if (woke) {
+		ret = ble_hid_init();
+		if (ret < 0) {
+			LOG_ERR("Failed to start BLE, error: %d", ret);
+			return;
+		}
+	} else if (usb_start(hid_dev) < 0) {
 		return;
 	}
-	ret = gpio_pin_configure_dt(&led3, GPIO_OUTPUT);
+
+	ret = esb_sink_init();
 	if (ret < 0) {
-		LOG_ERR("Failed to configure the LED pin, error: %d", ret);
+		LOG_ERR("Failed to start ESB, error: %d", ret);
 		return;
 	}
 
-	if (callbacks_configure(&sw0, &one_button, &callback[0], &def_val[0])) {
-		LOG_ERR("Failed configuring one button callback.");
-		return;
-	}
-	if (callbacks_configure(&sw1, &two_button, &callback[1], &def_val[1])) {
-		LOG_ERR("Failed configuring two button callback.");
+	if (input_start() < 0) {
 		return;
 	}
-	if (callbacks_configure(&sw2, &three_button, &callback[2], &def_val[2])) {
-		LOG_ERR("Failed configuring three button callback.");
-		return;
-	}
-	if (callbacks_configure(&sw3, &four_button, &callback[3], &def_val[3])) {
-		LOG_ERR("Failed configuring four button callback.");
+
+	ret = watchdog_init();
+	if (ret < 0) {
+		LOG_ERR("Failed to start the watchdog, error: %d", ret);
 		return;
 	}
 
-	usb_hid_register_device(hid_dev, hid_report_desc, 
-				sizeof(hid_report_desc),NULL);
-	
-	usb_hid_init(hid_dev);
+	k_thread_start(input_thread);
 
-	ret = usb_enable(status_cb);
-	if (ret != 0) {
-		LOG_ERR("Failed to enable USB");
+	if (woke && usb_start(hid_dev) < 0) {
 		return;
 	}
 
-	while (true) {
-		k_sem_take(&sem, K_FOREVER);
-
-		report[KEYPAD_BTN_CODE_REPORT_POS] = status[KEYPAD_BTN_CODE_REPORT_POS];
-		ret = hid_int_ep_write(hid_dev, report, sizeof(report), NULL);
-		if (ret) {
-			LOG_ERR("HID write error, %d", ret);
-		}
-
-		/* Toggle LED on sent report */
-		ret = gpio_pin_toggle(led0.port, led0.pin);
-		if (ret < 0) {
-			LOG_ERR("Failed to toggle the LED pin, error: %d", ret);
-		}
-	}
-}
\ No newline at end of file
+	/* Main then ends and leaves the core to the input thread */
+	deferred_init(woke);
+}
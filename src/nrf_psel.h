@@ -0,0 +1,28 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Absolute nRF pin number (port * 32 + pin) as used by nrfx and the
+ * peripheral PSEL registers, from a devicetree GPIO spec.
+ */
+
+#ifndef KEYPAD_NRF_PSEL_H_
+#define KEYPAD_NRF_PSEL_H_
+
+#include <zephyr/device.h>
+#include <zephyr/drivers/gpio.h>
+
+#define NRF_PSEL_GPIO1_NODE DT_NODELABEL(gpio1)
+
+static inline uint32_t nrf_psel_get(const struct gpio_dt_spec *spec)
+{
+#if DT_NODE_HAS_STATUS(NRF_PSEL_GPIO1_NODE, okay)
+	if (spec->port == DEVICE_DT_GET(NRF_PSEL_GPIO1_NODE)) {
+		return 32 + spec->pin;
+	}
+#endif
+	return spec->pin;
+}
+
+#endif /* KEYPAD_NRF_PSEL_H_ */
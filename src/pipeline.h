@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Stages of the key pipeline in this build. Each is a compile-time
+ * constant from Kconfig or the devicetree, so the layers and the report
+ * scheduler test it in a plain if and the compiler drops a stage that
+ * is left out together with its test: no branch, call or table lookup
+ * per event for a feature the build does not have. Stages a keymap
+ * upload can bring in at run time, tap-hold and one-shot keys, are
+ * always in.
+ *
+ * PIPELINE_STAGES() lists them in the order an event goes through, for
+ * the "report pipeline" shell command and the boot log.
+ */
+
+#ifndef KEYPAD_PIPELINE_H_
+#define KEYPAD_PIPELINE_H_
+
+#include <zephyr/devicetree.h>
+#include <zephyr/sys/util.h>
+
+#define PIPELINE_COMBOS DT_HAS_COMPAT_STATUS_OKAY(richeffects_keypad_combos)
+#define PIPELINE_MULTI_TAP \
+	DT_HAS_COMPAT_STATUS_OKAY(richeffects_keypad_multi_taps)
+#define PIPELINE_LEADER DT_HAS_COMPAT_STATUS_OKAY(richeffects_keypad_leader)
+#define PIPELINE_SHORTCUTS \
+	DT_HAS_COMPAT_STATUS_OKAY(richeffects_keypad_shortcuts)
+#define PIPELINE_MACROS \
+	(DT_HAS_COMPAT_STATUS_OKAY(richeffects_keypad_macros) || \
+	 IS_ENABLED(CONFIG_KEYPAD_MACRO_UPLOAD))
+#define PIPELINE_SOCD DT_HAS_COMPAT_STATUS_OKAY(richeffects_keypad_socd)
+#define PIPELINE_TYPEMATIC IS_ENABLED(CONFIG_KEYPAD_TYPEMATIC)
+#define PIPELINE_TURBO IS_ENABLED(CONFIG_KEYPAD_TURBO)
+
+/* X(name, in the build) for every stage, in pipeline order */
+#define PIPELINE_STAGES(X)				\
+	X("combos", PIPELINE_COMBOS)			\
+	X("tap-hold", 1)				\
+	X("multi-tap", PIPELINE_MULTI_TAP)		\
+	X("layers", 1)					\
+	X("leader", PIPELINE_LEADER)			\
+	X("shortcuts", PIPELINE_SHORTCUTS)		\
+	X("one-shot", 1)				\
+	X("macros", PIPELINE_MACROS)			\
+	X("typematic", PIPELINE_TYPEMATIC)		\
+	X("turbo", PIPELINE_TURBO)			\
+	X("socd", PIPELINE_SOCD)			\
+	X("report", 1)
+
+#endif /* KEYPAD_PIPELINE_H_ */
@@ -0,0 +1,284 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * The mode is switched from activity_mark() and from a one-shot timer
+ * restarted on every key event. Residency is accounted at each mode
+ * change and, with CONFIG_PM, from PM notifier entry/exit callbacks.
+ *
+ * Typing holds a PM policy lock on every state below runtime idle, one
+ * reference taken on entering the mode and given back on leaving it,
+ * so the window is kept by any policy, not only the one here, and
+ * follow-on presses see the same shallow wakeup as the first one after
+ * the lock was taken. With CONFIG_KEYPAD_EDGE_TIMESTAMP the delay from
+ * the end of the debounce window to its interrupt is what each key
+ * event paid to wake the core; it is kept apart for the events that
+ * found the keypad idle and those inside a window, whose minimum is
+ * the floor the mode buys.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/logging/log.h>
+
+#include <hal/nrf_power.h>
+
+#if defined(CONFIG_PM)
+#include <zephyr/pm/pm.h>
+#include <zephyr/pm/policy.h>
+#endif
+
+#if defined(CONFIG_KEYPAD_EDGE_TIMESTAMP)
+#include "input/debounce_hw.h"
+#endif
+#include "power/activity.h"
+
+LOG_MODULE_REGISTER(activity, LOG_LEVEL_INF);
+
+static struct k_spinlock lock;
+static enum activity_mode mode = ACTIVITY_TYPING;
+static int64_t mode_since;
+static struct activity_stats stats;
+
+static struct k_timer quiet_timer;
+
+#if defined(CONFIG_PM)
+/* States that add wakeup latency, shut out while typing */
+static void deep_states_lock(bool lock)
+{
+	for (enum pm_state state = PM_STATE_SUSPEND_TO_IDLE;
+	     state < PM_STATE_COUNT; state++) {
+		if (lock) {
+			pm_policy_state_lock_get(state);
+		} else {
+			pm_policy_state_lock_put(state);
+		}
+	}
+}
+#else
+static inline void deep_states_lock(bool lock) {}
+#endif
+
+#if defined(CONFIG_KEYPAD_EDGE_TIMESTAMP)
+/* Settled windows already counted */
+static uint32_t settles_seen;
+
+/* A key event found the keypad in mode, lock held */
+static void wake_sample(enum activity_mode found)
+{
+	struct activity_wake *w = &stats.wake[found];
+	uint32_t settles = debounce_hw_settle_count();
+	uint32_t ns;
+
+	if (settles == settles_seen) {
+		/* Not from a debounce window, nothing was measured */
+		return;
+	}
+
+	settles_seen = settles;
+	ns = debounce_hw_irq_latency_last_ns();
+
+	w->min_ns = w->count == 0 ? ns : MIN(w->min_ns, ns);
+	w->max_ns = MAX(w->max_ns, ns);
+	w->count++;
+}
+#else
+static inline void wake_sample(enum activity_mode found) {}
+#endif
+
+/* Called with lock held */
+static void mode_set(enum activity_mode next)
+{
+	int64_t now = k_uptime_get();
+
+	stats.mode_ms[mode] += now - mode_since;
+	mode_since = now;
+
+	if (next == mode) {
+		return;
+	}
+
+	mode = next;
+
+	if (next == ACTIVITY_TYPING) {
+		/* Regulators and clocks stay up, wakeup latency is fixed */
+		nrf_power_task_trigger(NRF_POWER, NRF_POWER_TASK_CONSTLAT);
+		deep_states_lock(true);
+	} else {
+		nrf_power_task_trigger(NRF_POWER, NRF_POWER_TASK_LOWPWR);
+		deep_states_lock(false);
+		stats.idle_entries++;
+	}
+}
+
+static void quiet_expired(struct k_timer *timer)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	mode_set(ACTIVITY_IDLE);
+	k_spin_unlock(&lock, key);
+}
+
+void activity_mark(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	wake_sample(mode);
+	mode_set(ACTIVITY_TYPING);
+	k_spin_unlock(&lock, key);
+
+	/* Every event pushes the end of the window out again */
+	k_timer_start(&quiet_timer, K_MSEC(CONFIG_KEYPAD_ACTIVITY_QUIET_MS),
+		      K_NO_WAIT);
+}
+
+enum activity_mode activity_mode_get(void)
+{
+	return mode;
+}
+
+void activity_stats_get(struct activity_stats *out)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	/* Bring the current mode up to date */
+	mode_set(mode);
+	*out = stats;
+	k_spin_unlock(&lock, key);
+}
+
+void activity_stats_reset(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	memset(&stats, 0, sizeof(stats));
+	mode_since = k_uptime_get();
+	k_spin_unlock(&lock, key);
+}
+
+#if defined(CONFIG_PM)
+static int64_t state_since;
+
+static void state_entry(enum pm_state state)
+{
+	state_since = k_uptime_get();
+	stats.state_entries[state]++;
+}
+
+static void state_exit(enum pm_state state)
+{
+	stats.state_ms[state] += k_uptime_get() - state_since;
+}
+
+static struct pm_notifier notifier = {
+	.state_entry = state_entry,
+	.state_exit = state_exit,
+};
+
+const struct pm_state_info *pm_policy_next_state(uint8_t cpu, int32_t ticks)
+{
+	const struct pm_state_info *states;
+	const struct pm_state_info *best = NULL;
+	uint8_t count;
+
+	count = pm_state_cpu_get_all(cpu, &states);
+
+	for (uint8_t i = 0; i < count; i++) {
+		uint32_t min_ticks = k_us_to_ticks_ceil32(
+			states[i].min_residency_us + states[i].exit_latency_us);
+
+		/* Held while typing, see deep_states_lock() */
+		if (pm_policy_state_lock_is_active(states[i].state)) {
+			continue;
+		}
+
+		if (ticks == K_TICKS_FOREVER || ticks >= min_ticks) {
+			best = &states[i];
+		}
+	}
+
+	return best;
+}
+#endif /* CONFIG_PM */
+
+static int activity_init(const struct device *dev)
+{
+	ARG_UNUSED(dev);
+
+	mode_since = k_uptime_get();
+	/* The mode starts out typing, with nothing yet taken for it */
+	nrf_power_task_trigger(NRF_POWER, NRF_POWER_TASK_CONSTLAT);
+	deep_states_lock(true);
+	k_timer_init(&quiet_timer, quiet_expired, NULL);
+	k_timer_start(&quiet_timer, K_MSEC(CONFIG_KEYPAD_ACTIVITY_QUIET_MS),
+		      K_NO_WAIT);
+
+#if defined(CONFIG_PM)
+	pm_notifier_register(&notifier);
+#endif
+
+	return 0;
+}
+
+SYS_INIT(activity_init, APPLICATION, 0);
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static const char *const mode_names[] = {
+	[ACTIVITY_TYPING] = "typing",
+	[ACTIVITY_IDLE] = "idle",
+};
+
+static int cmd_power_show(const struct shell *sh, size_t argc, char **argv)
+{
+	struct activity_stats s;
+
+	activity_stats_get(&s);
+
+	shell_print(sh, "mode: %s, idle entries: %u", mode_names[mode],
+		    s.idle_entries);
+
+	for (int m = 0; m < ACTIVITY_MODE_COUNT; m++) {
+		shell_print(sh, "  %-7s %llu ms", mode_names[m], s.mode_ms[m]);
+	}
+
+#if defined(CONFIG_PM)
+	for (int state = 0; state < PM_STATE_COUNT; state++) {
+		if (s.state_entries[state] != 0) {
+			shell_print(sh, "  state %d: %u entries, %llu ms", state,
+				    s.state_entries[state], s.state_ms[state]);
+		}
+	}
+#endif
+
+#if defined(CONFIG_KEYPAD_EDGE_TIMESTAMP)
+	for (int m = 0; m < ACTIVITY_MODE_COUNT; m++) {
+		if (s.wake[m].count != 0) {
+			shell_print(sh, "  wake from %-7s %u events, "
+				    "%u..%u ns", mode_names[m],
+				    s.wake[m].count, s.wake[m].min_ns,
+				    s.wake[m].max_ns);
+		}
+	}
+#endif
+
+	return 0;
+}
+
+static int cmd_power_reset(const struct shell *sh, size_t argc, char **argv)
+{
+	activity_stats_reset();
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_power,
+	SHELL_CMD(show, NULL, "Print residency counters", cmd_power_show),
+	SHELL_CMD(reset, NULL, "Clear residency counters", cmd_power_reset),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(power, &sub_power, "Keypad power policy", NULL);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Activity-aware power policy. Key traffic keeps the app core in the
+ * constant latency regulator mode and, with CONFIG_PM, holds a policy
+ * lock on the PM states deeper than runtime idle; once the keypad has
+ * been quiet for CONFIG_KEYPAD_ACTIVITY_QUIET_MS the core returns to
+ * low power mode, the lock is released and the deepest state whose
+ * residency fits the next timeout is allowed. Every key event restarts
+ * the quiet period.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_ACTIVITY_PM is enabled.
+ */
+
+#ifndef KEYPAD_POWER_ACTIVITY_H_
+#define KEYPAD_POWER_ACTIVITY_H_
+
+#include <zephyr/zephyr.h>
+
+#if defined(CONFIG_PM)
+#include <zephyr/pm/state.h>
+#endif
+
+enum activity_mode {
+	/* Keys in use: constant latency, deep PM states locked */
+	ACTIVITY_TYPING,
+	/* Quiet period elapsed: low power, deep PM states allowed */
+	ACTIVITY_IDLE,
+	ACTIVITY_MODE_COUNT,
+};
+
+/* Wakeup latency of the key events that found the keypad in a mode */
+struct activity_wake {
+	uint32_t count;
+	uint32_t min_ns;
+	uint32_t max_ns;
+};
+
+struct activity_stats {
+	/* Time spent in each mode, ms */
+	uint64_t mode_ms[ACTIVITY_MODE_COUNT];
+	/* Number of TYPING -> IDLE transitions */
+	uint32_t idle_entries;
+#if defined(CONFIG_PM)
+	/* Time spent in each PM state, ms */
+	uint64_t state_ms[PM_STATE_COUNT];
+	uint32_t state_entries[PM_STATE_COUNT];
+#endif
+#if defined(CONFIG_KEYPAD_EDGE_TIMESTAMP)
+	/* Debounce window end to interrupt, the TYPING minimum the floor */
+	struct activity_wake wake[ACTIVITY_MODE_COUNT];
+#endif
+};
+
+#if defined(CONFIG_KEYPAD_ACTIVITY_PM)
+
+/* Key activity seen, ISR safe */
+void activity_mark(void);
+
+enum activity_mode activity_mode_get(void);
+
+void activity_stats_get(struct activity_stats *out);
+void activity_stats_reset(void);
+
+#else
+
+static inline void activity_mark(void) {}
+
+static inline enum activity_mode activity_mode_get(void)
+{
+	return ACTIVITY_TYPING;
+}
+
+#endif /* CONFIG_KEYPAD_ACTIVITY_PM */
+
+#endif /* KEYPAD_POWER_ACTIVITY_H_ */
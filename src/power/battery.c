@@ -0,0 +1,359 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * RTC0 runs at 8 Hz and COMPARE0 ends every interval. It is published
+ * on a DPPI channel the SAADC SAMPLE task and the RTC CLEAR task both
+ * subscribe to, as the RTC has no clear-on-compare short. The SAADC
+ * channel is in burst mode, so the one SAMPLE takes all the oversamples
+ * and stores their average; a second channel restarts the SAADC from
+ * its END into the same one sample buffer. Nothing of this needs the
+ * CPU, and the SAADC only draws current while it converts.
+ *
+ * The channel limits are a window of the hysteresis around the last
+ * published reading, and only the limit interrupts are enabled. A
+ * reading outside the window arms a one-off END interrupt, as the
+ * result may not be in RAM yet when the limit event is taken; if the
+ * END of that measurement has gone by already the next one is used.
+ * The END moves the window to the new reading and leaves the level
+ * and the publishing to the system work queue. The window starts out
+ * empty, so the first measurement is always taken.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/logging/log.h>
+#if defined(CONFIG_BT_BAS)
+#include <zephyr/bluetooth/services/bas.h>
+#endif
+
+#include <nrfx_dppi.h>
+#include <nrfx_rtc.h>
+#include <hal/nrf_saadc.h>
+#include <helpers/nrfx_gppi.h>
+
+#include "power/battery.h"
+#include "irq_plan.h"
+
+LOG_MODULE_REGISTER(battery, LOG_LEVEL_INF);
+
+#define BATTERY_RTC_NODE DT_NODELABEL(rtc0)
+#define BATTERY_ADC_NODE DT_NODELABEL(adc)
+#define BATTERY_RTC_HZ 8
+#define BATTERY_INTERVAL_TICKS \
+	(CONFIG_KEYPAD_BATTERY_INTERVAL_S * BATTERY_RTC_HZ)
+#define BATTERY_CHANNEL 0
+#define BATTERY_RESOLUTION_BITS 12
+
+#if defined(CONFIG_KEYPAD_BATTERY_VDDH)
+/* VDDH / 5 at gain 1/2 against the internal 0.6 V */
+#define BATTERY_INPUT NRF_SAADC_INPUT_VDDHDIV5
+#define BATTERY_GAIN NRF_SAADC_GAIN1_2
+#define BATTERY_FULL_SCALE_MV 6000
+#else
+/* VDD at gain 1/6 against the internal 0.6 V */
+#define BATTERY_INPUT NRF_SAADC_INPUT_VDD
+#define BATTERY_GAIN NRF_SAADC_GAIN1_6
+#define BATTERY_FULL_SCALE_MV 3600
+#endif
+
+/* Half width of the window, in SAADC counts */
+#define BATTERY_HYST_RAW                                                   \
+	MAX(CONFIG_KEYPAD_BATTERY_HYSTERESIS_MV *                          \
+	    BIT(BATTERY_RESOLUTION_BITS) / BATTERY_FULL_SCALE_MV, 1)
+
+BUILD_ASSERT(CONFIG_KEYPAD_BATTERY_EMPTY_MV < CONFIG_KEYPAD_BATTERY_FULL_MV,
+	     "an empty battery must read below a full one");
+BUILD_ASSERT(CONFIG_KEYPAD_BATTERY_FULL_MV <= BATTERY_FULL_SCALE_MV,
+	     "a full battery reads above the SAADC range");
+
+static const nrfx_rtc_t battery_rtc = NRFX_RTC_INSTANCE(0);
+static uint8_t sample_channel;
+static uint8_t restart_channel;
+
+/* Written by EasyDMA at the end of every measurement */
+static nrf_saadc_value_t sample;
+
+static struct k_spinlock lock;
+/* Reading the window was last moved to, for the work item */
+static int16_t window_raw;
+static uint32_t wakeups;
+
+/* Owned by the work item, read under the lock */
+static int level = -EAGAIN;
+static uint16_t level_mv;
+static uint32_t published;
+
+static void battery_publish(struct k_work *work);
+
+static K_WORK_DEFINE(publish_work, battery_publish);
+
+static uint32_t battery_limit_ints(void)
+{
+	return nrf_saadc_limit_int_get(BATTERY_CHANNEL, NRF_SAADC_LIMIT_LOW) |
+	       nrf_saadc_limit_int_get(BATTERY_CHANNEL, NRF_SAADC_LIMIT_HIGH);
+}
+
+static bool battery_limit_events_take(void)
+{
+	nrf_saadc_event_t low = nrf_saadc_limit_event_get(BATTERY_CHANNEL,
+							NRF_SAADC_LIMIT_LOW);
+	nrf_saadc_event_t high = nrf_saadc_limit_event_get(BATTERY_CHANNEL,
+							 NRF_SAADC_LIMIT_HIGH);
+	bool crossed = nrf_saadc_event_check(NRF_SAADC, low) ||
+		       nrf_saadc_event_check(NRF_SAADC, high);
+
+	nrf_saadc_event_clear(NRF_SAADC, low);
+	nrf_saadc_event_clear(NRF_SAADC, high);
+
+	return crossed;
+}
+
+static void battery_saadc_isr(const void *arg)
+{
+	k_spinlock_key_t key;
+	int16_t raw;
+
+	ARG_UNUSED(arg);
+
+	if (nrf_saadc_int_enable_check(NRF_SAADC, NRF_SAADC_INT_END)) {
+		if (!nrf_saadc_event_check(NRF_SAADC, NRF_SAADC_EVENT_END)) {
+			return;
+		}
+
+		nrf_saadc_event_clear(NRF_SAADC, NRF_SAADC_EVENT_END);
+		nrf_saadc_int_disable(NRF_SAADC, NRF_SAADC_INT_END);
+
+		raw = sample;
+		nrf_saadc_channel_limits_set(NRF_SAADC, BATTERY_CHANNEL,
+					     raw - BATTERY_HYST_RAW,
+					     raw + BATTERY_HYST_RAW);
+		/* Raised against the old window by this measurement */
+		(void)battery_limit_events_take();
+		nrf_saadc_int_enable(NRF_SAADC, battery_limit_ints());
+
+		key = k_spin_lock(&lock);
+		window_raw = raw;
+		wakeups++;
+		k_spin_unlock(&lock, key);
+
+		k_work_submit(&publish_work);
+		return;
+	}
+
+	if (battery_limit_events_take()) {
+		nrf_saadc_int_disable(NRF_SAADC, battery_limit_ints());
+		nrf_saadc_event_clear(NRF_SAADC, NRF_SAADC_EVENT_END);
+		nrf_saadc_int_enable(NRF_SAADC, NRF_SAADC_INT_END);
+	}
+}
+
+static int battery_percent(uint32_t mv)
+{
+	if (mv <= CONFIG_KEYPAD_BATTERY_EMPTY_MV) {
+		return 0;
+	}
+	if (mv >= CONFIG_KEYPAD_BATTERY_FULL_MV) {
+		return 100;
+	}
+
+	return (mv - CONFIG_KEYPAD_BATTERY_EMPTY_MV) * 100 /
+	       (CONFIG_KEYPAD_BATTERY_FULL_MV - CONFIG_KEYPAD_BATTERY_EMPTY_MV);
+}
+
+static void battery_publish(struct k_work *work)
+{
+	k_spinlock_key_t key;
+	uint32_t mv;
+	int16_t raw;
+	int percent;
+	bool changed;
+
+	key = k_spin_lock(&lock);
+	raw = window_raw;
+	k_spin_unlock(&lock, key);
+
+	/* Single ended, a few counts below zero read as zero */
+	mv = (uint32_t)MAX(raw, 0) * BATTERY_FULL_SCALE_MV >>
+	     BATTERY_RESOLUTION_BITS;
+	percent = battery_percent(mv);
+
+	key = k_spin_lock(&lock);
+	changed = percent != level;
+	level = percent;
+	level_mv = mv;
+	if (changed) {
+		published++;
+	}
+	k_spin_unlock(&lock, key);
+
+	if (!changed) {
+		return;
+	}
+
+	LOG_DBG("%u mV, %d %%", mv, percent);
+
+#if defined(CONFIG_BT_BAS)
+	/* Stored for later reads when nobody is subscribed */
+	(void)bt_bas_set_battery_level(percent);
+#endif
+}
+
+int battery_level_get(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	int ret = level;
+
+	k_spin_unlock(&lock, key);
+
+	return ret;
+}
+
+uint16_t battery_mv_get(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	uint16_t ret = level_mv;
+
+	k_spin_unlock(&lock, key);
+
+	return ret;
+}
+
+static void battery_rtc_handler(nrfx_rtc_int_type_t int_type)
+{
+	/* nrfx requires a handler even with no RTC interrupt enabled */
+}
+
+static void battery_saadc_configure(void)
+{
+	nrf_saadc_channel_config_t config = {
+		.resistor_p = NRF_SAADC_RESISTOR_DISABLED,
+		.resistor_n = NRF_SAADC_RESISTOR_DISABLED,
+		.gain = BATTERY_GAIN,
+		.reference = NRF_SAADC_REFERENCE_INTERNAL,
+		.acq_time = NRF_SAADC_ACQTIME_10US,
+		.mode = NRF_SAADC_MODE_SINGLE_ENDED,
+		/* One SAMPLE task takes every oversample */
+		.burst = NRF_SAADC_BURST_ENABLED,
+	};
+
+	nrf_saadc_enable(NRF_SAADC);
+	nrf_saadc_resolution_set(NRF_SAADC, NRF_SAADC_RESOLUTION_12BIT);
+	nrf_saadc_oversample_set(NRF_SAADC, (nrf_saadc_oversample_t)
+				 CONFIG_KEYPAD_BATTERY_OVERSAMPLE);
+	nrf_saadc_channel_init(NRF_SAADC, BATTERY_CHANNEL, &config);
+	nrf_saadc_channel_input_set(NRF_SAADC, BATTERY_CHANNEL, BATTERY_INPUT,
+				    NRF_SAADC_INPUT_DISABLED);
+	/* Empty window, the first measurement is above it */
+	nrf_saadc_channel_limits_set(NRF_SAADC, BATTERY_CHANNEL, INT16_MIN,
+				     INT16_MIN);
+	nrf_saadc_buffer_init(NRF_SAADC, &sample, 1);
+
+	/* Once at boot, takes a few hundred microseconds */
+	nrf_saadc_event_clear(NRF_SAADC, NRF_SAADC_EVENT_CALIBRATEDONE);
+	nrf_saadc_task_trigger(NRF_SAADC, NRF_SAADC_TASK_CALIBRATEOFFSET);
+	while (!nrf_saadc_event_check(NRF_SAADC,
+				      NRF_SAADC_EVENT_CALIBRATEDONE)) {
+	}
+	nrf_saadc_event_clear(NRF_SAADC, NRF_SAADC_EVENT_CALIBRATEDONE);
+
+	(void)battery_limit_events_take();
+	nrf_saadc_event_clear(NRF_SAADC, NRF_SAADC_EVENT_END);
+	nrf_saadc_int_enable(NRF_SAADC, battery_limit_ints());
+
+	IRQ_CONNECT(DT_IRQN(BATTERY_ADC_NODE), IRQ_PLAN_LOW,
+		    battery_saadc_isr, NULL, 0);
+	irq_enable(DT_IRQN(BATTERY_ADC_NODE));
+
+	nrf_saadc_event_clear(NRF_SAADC, NRF_SAADC_EVENT_STARTED);
+	nrf_saadc_task_trigger(NRF_SAADC, NRF_SAADC_TASK_START);
+	while (!nrf_saadc_event_check(NRF_SAADC, NRF_SAADC_EVENT_STARTED)) {
+	}
+}
+
+static int battery_init(const struct device *dev)
+{
+	nrfx_rtc_config_t config = NRFX_RTC_DEFAULT_CONFIG;
+	nrfx_err_t err;
+
+	ARG_UNUSED(dev);
+
+	config.prescaler = RTC_FREQ_TO_PRESCALER(BATTERY_RTC_HZ);
+	config.interrupt_priority = IRQ_PLAN_LOW;
+
+	err = nrfx_rtc_init(&battery_rtc, &config, battery_rtc_handler);
+	if (err != NRFX_SUCCESS) {
+		LOG_ERR("Failed to init battery RTC, error: 0x%08x", err);
+		return -EIO;
+	}
+
+	IRQ_CONNECT(DT_IRQN(BATTERY_RTC_NODE), IRQ_PLAN_LOW,
+		    nrfx_rtc_0_irq_handler, NULL, 0);
+
+	if (nrfx_dppi_channel_alloc(&sample_channel) != NRFX_SUCCESS ||
+	    nrfx_dppi_channel_alloc(&restart_channel) != NRFX_SUCCESS) {
+		LOG_ERR("Failed to allocate DPPI channels");
+		return -ENOMEM;
+	}
+
+	battery_saadc_configure();
+
+	nrfx_gppi_channel_endpoints_setup(sample_channel,
+		nrfx_rtc_event_address_get(&battery_rtc,
+					   NRF_RTC_EVENT_COMPARE_0),
+		nrf_saadc_task_address_get(NRF_SAADC, NRF_SAADC_TASK_SAMPLE));
+	nrfx_gppi_fork_endpoint_setup(sample_channel,
+		nrfx_rtc_task_address_get(&battery_rtc, NRF_RTC_TASK_CLEAR));
+	nrfx_gppi_channel_endpoints_setup(restart_channel,
+		nrf_saadc_event_address_get(NRF_SAADC, NRF_SAADC_EVENT_END),
+		nrf_saadc_task_address_get(NRF_SAADC, NRF_SAADC_TASK_START));
+	nrfx_gppi_channels_enable(BIT(sample_channel) | BIT(restart_channel));
+
+	(void)nrfx_rtc_cc_set(&battery_rtc, 0, BATTERY_INTERVAL_TICKS, false);
+	nrfx_rtc_enable(&battery_rtc);
+
+	/* The first interval would leave the level unknown for too long */
+	nrf_saadc_task_trigger(NRF_SAADC, NRF_SAADC_TASK_SAMPLE);
+
+	return 0;
+}
+
+SYS_INIT(battery_init, APPLICATION, 0);
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static int cmd_battery_show(const struct shell *sh, size_t argc,
+			    char **argv)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	int16_t raw = window_raw;
+	uint32_t woke = wakeups;
+	uint32_t changes = published;
+	uint16_t mv = level_mv;
+	int percent = level;
+
+	k_spin_unlock(&lock, key);
+
+	if (percent < 0) {
+		shell_print(sh, "no measurement yet");
+		return 0;
+	}
+
+	shell_print(sh, "%u mV, %d %%, raw %d +- %d", mv, percent, raw,
+		    BATTERY_HYST_RAW);
+	shell_print(sh, "every %u s, %u wakeups, %u changes published",
+		    CONFIG_KEYPAD_BATTERY_INTERVAL_S, woke, changes);
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_battery,
+	SHELL_CMD(show, NULL, "Print the battery level and wakeups",
+		  cmd_battery_show),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(battery, &sub_battery, "Battery monitor", NULL);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Battery monitor. The supply is measured every
+ * CONFIG_KEYPAD_BATTERY_INTERVAL_S seconds without the CPU: RTC0 starts
+ * the SAADC over DPPI and the SAADC averages its oversamples itself.
+ * The core only wakes when the reading has moved by more than the
+ * hysteresis, to publish the new level to BLE Battery Service with
+ * CONFIG_BT_BAS and to the Battery Strength feature report of the
+ * System Control interface with CONFIG_KEYPAD_HID_CONTROL.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_BATTERY is enabled.
+ */
+
+#ifndef KEYPAD_POWER_BATTERY_H_
+#define KEYPAD_POWER_BATTERY_H_
+
+#include <zephyr/zephyr.h>
+
+#if defined(CONFIG_KEYPAD_BATTERY)
+
+/* Charge in percent, -EAGAIN until the first measurement is in */
+int battery_level_get(void);
+
+/* Supply in mV of the last published measurement, 0 before it */
+uint16_t battery_mv_get(void);
+
+#else
+
+static inline int battery_level_get(void)
+{
+	return -ENOTSUP;
+}
+
+static inline uint16_t battery_mv_get(void)
+{
+	return 0;
+}
+
+#endif /* CONFIG_KEYPAD_BATTERY */
+
+#endif /* KEYPAD_POWER_BATTERY_H_ */
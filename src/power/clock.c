@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * HFXO is requested through the clock control on/off manager, so the
+ * USB driver and any other user keep their own references. The core
+ * divider is shared state: only this module changes it.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/init.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/drivers/clock_control/nrf_clock_control.h>
+
+#include <nrfx_clock.h>
+
+#include "power/clock.h"
+#include "suspend.h"
+
+LOG_MODULE_REGISTER(clock, LOG_LEVEL_INF);
+
+static struct k_spinlock lock;
+static struct onoff_client hfxo_client;
+static bool hfxo_held;
+static bool usb_active;
+static bool bus_suspended;
+static uint32_t boost_count;
+
+/* Called with lock held */
+static void hfxo_update(void)
+{
+	struct onoff_manager *mgr =
+		z_nrf_clock_control_get_onoff(CLOCK_CONTROL_NRF_SUBSYS_HF);
+	bool want = usb_active && !bus_suspended;
+	int ret;
+
+	if (want == hfxo_held) {
+		return;
+	}
+
+	if (want) {
+		sys_notify_init_spinwait(&hfxo_client.notify);
+		ret = onoff_request(mgr, &hfxo_client);
+	} else {
+		ret = onoff_release(mgr);
+	}
+
+	if (ret < 0) {
+		LOG_ERR("Failed to %s HFXO, error: %d",
+			want ? "request" : "release", ret);
+		return;
+	}
+
+	hfxo_held = want;
+}
+
+static void core_clock_set(bool fast)
+{
+	nrfx_err_t err;
+
+	err = nrfx_clock_divider_set(NRF_CLOCK_DOMAIN_HFCLK,
+				     fast ? NRF_CLOCK_HFCLK_DIV_1 :
+					    NRF_CLOCK_HFCLK_DIV_2);
+	if (err != NRFX_SUCCESS) {
+		LOG_ERR("Failed to set core clock, error: 0x%08x", err);
+	}
+
+	SystemCoreClockUpdate();
+}
+
+void clock_usb_set(bool active)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	usb_active = active;
+	hfxo_update();
+	k_spin_unlock(&lock, key);
+}
+
+void clock_boost_get(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	if (boost_count++ == 0) {
+		core_clock_set(true);
+	}
+
+	k_spin_unlock(&lock, key);
+}
+
+void clock_boost_put(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	if (boost_count != 0 && --boost_count == 0) {
+		core_clock_set(false);
+	}
+
+	k_spin_unlock(&lock, key);
+}
+
+static void clock_suspend(bool suspended)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	bus_suspended = suspended;
+	hfxo_update();
+	k_spin_unlock(&lock, key);
+}
+
+static struct suspend_listener listener = {
+	.changed = clock_suspend,
+};
+
+static int clock_init(const struct device *dev)
+{
+	ARG_UNUSED(dev);
+
+	core_clock_set(false);
+	suspend_listener_register(&listener);
+
+	return 0;
+}
+
+SYS_INIT(clock_init, APPLICATION, 0);
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Clock management for the nRF5340 app core. HFXO is held only while
+ * the USB bus is configured and not suspended; otherwise the core runs
+ * from HFINT. The core clock stays at 64 MHz unless a user of
+ * clock_boost_get() needs 128 MHz for a burst of work.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_CLOCK_MGMT is enabled.
+ */
+
+#ifndef KEYPAD_POWER_CLOCK_H_
+#define KEYPAD_POWER_CLOCK_H_
+
+#include <zephyr/zephyr.h>
+
+#if defined(CONFIG_KEYPAD_CLOCK_MGMT)
+
+/* Bus configured (true) or gone (false), from the USB status callback */
+void clock_usb_set(bool active);
+
+/* Run the core at 128 MHz until the matching clock_boost_put() */
+void clock_boost_get(void);
+void clock_boost_put(void);
+
+#else
+
+static inline void clock_usb_set(bool active) {}
+static inline void clock_boost_get(void) {}
+static inline void clock_boost_put(void) {}
+
+#endif /* CONFIG_KEYPAD_CLOCK_MGMT */
+
+#endif /* KEYPAD_POWER_CLOCK_H_ */
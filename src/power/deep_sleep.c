@@ -0,0 +1,205 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * The retained state is 16 bytes of .noinit, aligned so it sits in one
+ * 4 KB RAM section, and only that section is kept powered in System
+ * OFF. A magic and a CRC tell it from whatever a cold boot finds
+ * there, and it is consumed once read, so a later reset that is not a
+ * wake from System OFF does not take it again.
+ *
+ * The GPIO LATCH registers record which line sensed the press, and are
+ * read before the GPIO driver starts. A key whose line is already up
+ * again by the time the scan runs would not be seen at all, so it is
+ * put through keys_changed() as a tap, the way replay injects events.
+ * Matrix rows do not say which column was pressed: there the key has
+ * to be still held when the scan starts, a few ms after the reset.
+ */
+
+#include <stddef.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/init.h>
+#include <zephyr/devicetree.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/crc.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/logging/log_ctrl.h>
+
+#include <hal/nrf_gpio.h>
+#include <hal/nrf_regulators.h>
+#include <hal/nrf_reset.h>
+#include <hal/nrf_usbreg.h>
+#include <hal/nrf_vmc.h>
+
+#include "ble/host.h"
+#include "keys.h"
+#include "layer.h"
+#include "power/deep_sleep.h"
+#include "scan.h"
+
+LOG_MODULE_REGISTER(deep_sleep, LOG_LEVEL_INF);
+
+#define DEEP_SLEEP_TIMEOUT_MS (CONFIG_KEYPAD_DEEP_SLEEP_TIMEOUT_S * 1000U)
+#define DEEP_SLEEP_MAGIC 0x4b504f46
+
+#define RAM_BASE DT_REG_ADDR(DT_CHOSEN(zephyr_sram))
+#define RAM_BLOCK_SIZE 0x10000
+#define RAM_SECTION_SIZE 0x1000
+
+struct retained {
+	uint32_t magic;
+	struct deep_sleep_state state;
+	/* CRC32 of the fields above */
+	uint32_t crc;
+} __aligned(16);
+
+BUILD_ASSERT(sizeof(struct retained) <= 16,
+	     "the retained state must not cross a RAM section");
+
+static struct retained retained __noinit;
+
+/* Copy of the retained state for this boot, valid if woke */
+static struct deep_sleep_state kept;
+static bool woke;
+/* Lines that sensed the waking press, P0 and P1 */
+static uint32_t latch[2];
+
+static atomic_t last_ms;
+static struct k_work_delayable off_work;
+
+static uint32_t retained_crc(void)
+{
+	return crc32_ieee((const uint8_t *)&retained,
+			  offsetof(struct retained, crc));
+}
+
+bool deep_sleep_woke(void)
+{
+	return woke;
+}
+
+int deep_sleep_state_get(struct deep_sleep_state *out)
+{
+	if (!woke) {
+		return -ENOENT;
+	}
+
+	*out = kept;
+
+	return 0;
+}
+
+/* Keep the section of the retained state powered in System OFF */
+static void deep_sleep_retain(void)
+{
+	uintptr_t offset = (uintptr_t)&retained - RAM_BASE;
+
+	nrf_vmc_ram_block_retention_set(NRF_VMC, offset / RAM_BLOCK_SIZE,
+		BIT((offset % RAM_BLOCK_SIZE) / RAM_SECTION_SIZE));
+}
+
+static void deep_sleep_enter(void)
+{
+	retained.state.host = host_current();
+	retained.state.toggled = layer_toggled_get();
+	retained.magic = DEEP_SLEEP_MAGIC;
+	retained.crc = retained_crc();
+	deep_sleep_retain();
+
+	LOG_INF("System OFF, host %u", retained.state.host);
+	log_panic();
+
+	/* Nothing runs again before the reset */
+	(void)irq_lock();
+	scan_off_arm();
+	nrf_regulators_system_off(NRF_REGULATORS);
+}
+
+static void deep_sleep_check(struct k_work *work)
+{
+	uint32_t quiet = k_uptime_get_32() - (uint32_t)atomic_get(&last_ms);
+
+	if (quiet < DEEP_SLEEP_TIMEOUT_MS) {
+		k_work_reschedule(&off_work,
+				  K_MSEC(DEEP_SLEEP_TIMEOUT_MS - quiet));
+		return;
+	}
+
+	/* On the cable the keypad stays up for the USB host */
+	if ((nrf_usbreg_status_get(NRF_USBREGULATOR) &
+	     NRF_USBREG_STATUS_VBUSDETECT_MASK) || scan_pressed_get() != 0) {
+		k_work_reschedule(&off_work, K_MSEC(DEEP_SLEEP_TIMEOUT_MS));
+		return;
+	}
+
+	deep_sleep_enter();
+}
+
+void deep_sleep_activity(void)
+{
+	atomic_set(&last_ms, k_uptime_get_32());
+}
+
+/* The waking key, if it was released before the scan could see it */
+static void deep_sleep_wake_key(void)
+{
+	keypad_bitmap_t known;
+	keypad_bitmap_t levels = scan_levels_get(&known);
+	keypad_bitmap_t keys;
+	unsigned int key;
+
+	keys = scan_keys_of_pins(DEVICE_DT_GET(DT_NODELABEL(gpio0)),
+				 latch[0]) |
+	       scan_keys_of_pins(DEVICE_DT_GET(DT_NODELABEL(gpio1)),
+				 latch[1]);
+	keys &= known & ~levels;
+	if (keys == 0) {
+		return;
+	}
+
+	/* Like an edge: keys_changed() expects its interrupt's context */
+	key = irq_lock();
+	keys_changed(scan_pressed_get() | keys, keys);
+	keys_changed(scan_pressed_get(), keys);
+	irq_unlock(key);
+}
+
+void deep_sleep_start(void)
+{
+	if (woke) {
+		if (host_select(kept.host) == 0) {
+			layer_toggled_set(kept.toggled);
+		}
+
+		deep_sleep_wake_key();
+		LOG_INF("Woke from System OFF, host %u", kept.host);
+	}
+
+	deep_sleep_activity();
+	k_work_init_delayable(&off_work, deep_sleep_check);
+	k_work_schedule(&off_work, K_MSEC(DEEP_SLEEP_TIMEOUT_MS));
+}
+
+static int deep_sleep_init(const struct device *dev)
+{
+	ARG_UNUSED(dev);
+
+	/* Left set for hwinfo, the magic tells the wakes apart */
+	if ((nrf_reset_resetreas_get(NRF_RESET) &
+	     NRF_RESET_RESETREAS_OFF_MASK) &&
+	    retained.magic == DEEP_SLEEP_MAGIC &&
+	    retained.crc == retained_crc()) {
+		kept = retained.state;
+		woke = true;
+		nrf_gpio_latches_read_and_clear(0, ARRAY_SIZE(latch), latch);
+	}
+
+	retained.magic = 0;
+
+	return 0;
+}
+
+/* Ahead of the GPIO driver, which would clear the latches */
+SYS_INIT(deep_sleep_init, PRE_KERNEL_1, 0);
@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * System OFF for a battery keypad left alone. Once no key has changed
+ * for CONFIG_KEYPAD_DEEP_SLEEP_TIMEOUT_S and no USB cable is in, the
+ * key lines, or the matrix rows with every column driven, are armed
+ * for SENSE and the whole chip goes to System OFF, drawing about 1 uA.
+ * A press resets it.
+ *
+ * The state a reset would lose and the user would notice is kept in a
+ * single retained RAM section: the host slot typed to and its toggled
+ * layers. A boot from System OFF finds it, brings up the key path and
+ * BLE before anything else and calls the retained host first, and the
+ * key that woke the keypad is delivered even when it was let go of
+ * before the scan started.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_DEEP_SLEEP is enabled.
+ */
+
+#ifndef KEYPAD_POWER_DEEP_SLEEP_H_
+#define KEYPAD_POWER_DEEP_SLEEP_H_
+
+#include <zephyr/zephyr.h>
+
+struct deep_sleep_state {
+	/* Host slot, see ble/host.h */
+	uint8_t host;
+	/* layer_toggled_get() of that slot */
+	uint32_t toggled;
+};
+
+#if defined(CONFIG_KEYPAD_DEEP_SLEEP)
+
+/* This boot is a wake from System OFF with the state retained */
+bool deep_sleep_woke(void);
+
+/* The retained state, -ENOENT unless deep_sleep_woke() */
+int deep_sleep_state_get(struct deep_sleep_state *out);
+
+/*
+ * After layer_init() and scan_init(): restore the retained host and
+ * layers, deliver the key that woke the keypad and start counting
+ * toward the next System OFF.
+ */
+void deep_sleep_start(void);
+
+/* Key activity seen, ISR safe */
+void deep_sleep_activity(void);
+
+#else
+
+static inline bool deep_sleep_woke(void)
+{
+	return false;
+}
+
+static inline int deep_sleep_state_get(struct deep_sleep_state *out)
+{
+	return -ENOENT;
+}
+
+static inline void deep_sleep_start(void) {}
+static inline void deep_sleep_activity(void) {}
+
+#endif /* CONFIG_KEYPAD_DEEP_SLEEP */
+
+#endif /* KEYPAD_POWER_DEEP_SLEEP_H_ */
@@ -0,0 +1,379 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Opposing key pairs of a richeffects,keypad-socd node are resolved
+ * as their usages are pressed and released: the usage that loses is
+ * set in a mask the builders clear from the held usages, so a report
+ * never shows both, and the loser is back as soon as the winner is
+ * let go. Each press is one table lookup, in the same report as the
+ * key itself.
+ *
+ * One-shot modifiers are a few bytes of state next to the held
+ * modifiers, and a report takes them with one OR into its modifier
+ * byte: a tap changes no report of its own, the modifier shows up in
+ * the report of the next key and leaves with its release. The timeout
+ * is counted in USB frames, like the key repeat.
+ *
+ * Both reports are kept as they go on the wire and a press or release
+ * edits them in place, so building one is a copy. The NKRO bitmap is
+ * the set of shown usages itself. The boot report keeps each shown
+ * usage in a slot, with slot_of[] the slot of every usage: a press
+ * takes the next free slot and a release moves the last one into the
+ * hole, both O(1). Usages past the sixth get no slot and turn the
+ * report into ErrorRollOver while there are any; the release that
+ * frees a slot for one of them is the only edit that looks for a
+ * usage, over the eight words of the bitmap.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/usb/class/usb_hid.h>
+
+#include "diag/markers.h"
+#include "diag/stage_bench.h"
+#include "hot_path.h"
+#include "report.h"
+#include "report_desc.h"
+
+/* Non-modifier usages currently held, one bit per usage */
+static uint32_t usage_bitmap[256 / 32];
+/* The held usages the reports show, those no SOCD pair hides */
+static uint32_t shown[256 / 32];
+static uint8_t modifiers;
+
+/* Boot report but its modifier byte, and the slot + 1 of every usage */
+static uint8_t boot_report[REPORT_BOOT_SIZE];
+static uint8_t slot_of[256];
+static uint8_t slots_used;
+/* Shown usages with no slot, past the sixth */
+static uint8_t overflow;
+
+static KEYPAD_HOT void boot_insert(uint8_t usage)
+{
+	if (slots_used == KEYPAD_BTN_CODE_REPORT_SLOTS) {
+		overflow++;
+		return;
+	}
+
+	boot_report[KEYPAD_BTN_CODE_REPORT_POS + slots_used] = usage;
+	slot_of[usage] = ++slots_used;
+}
+
+/* A slot came free with usages waiting for one */
+static void boot_refill(void)
+{
+	for (size_t word = 0; word < ARRAY_SIZE(shown); word++) {
+		for (uint32_t bits = shown[word]; bits != 0; ) {
+			uint8_t bit = find_lsb_set(bits) - 1;
+			uint8_t usage = word * 32 + bit;
+
+			bits &= ~BIT(bit);
+			if (slot_of[usage] == 0) {
+				overflow--;
+				boot_insert(usage);
+				return;
+			}
+		}
+	}
+}
+
+static KEYPAD_HOT void boot_remove(uint8_t usage)
+{
+	uint8_t *slots = &boot_report[KEYPAD_BTN_CODE_REPORT_POS];
+	uint8_t slot = slot_of[usage];
+	uint8_t last;
+
+	if (slot == 0) {
+		overflow--;
+		return;
+	}
+
+	slot_of[usage] = 0;
+	last = slots_used--;
+	if (slot != last) {
+		slots[slot - 1] = slots[last - 1];
+		slot_of[slots[slot - 1]] = slot;
+	}
+	slots[last - 1] = 0;
+
+	if (overflow > 0) {
+		boot_refill();
+	}
+}
+
+/* Bring both reports in line with whether usage is to be shown */
+static KEYPAD_HOT void usage_show(uint8_t usage, bool show)
+{
+	uint32_t *word = &shown[usage / 32];
+
+	if (((*word & BIT(usage % 32)) != 0) == show) {
+		return;
+	}
+
+	*word ^= BIT(usage % 32);
+	if (show) {
+		boot_insert(usage);
+	} else {
+		boot_remove(usage);
+	}
+}
+
+/* One-shot modifiers armed by a tap, and locked by a second one */
+static uint8_t oneshot;
+static uint8_t oneshot_locked;
+/* One-shot keys down, and armed modifiers a key went down under */
+static uint8_t oneshot_held;
+static uint8_t oneshot_used;
+/* oneshot | oneshot_locked, ORed into every report */
+static uint8_t sticky;
+/* Frame the armed modifiers run out at */
+static uint32_t oneshot_deadline;
+
+#if DT_HAS_COMPAT_STATUS_OKAY(richeffects_keypad_socd)
+#define SOCD_NODE DT_INST(0, richeffects_keypad_socd)
+
+/* Index of the mode property enum */
+enum socd_mode {
+	/* The usage pressed last wins */
+	SOCD_LAST,
+	/* Neither is reported while both are held */
+	SOCD_NEUTRAL,
+	/* The usage pressed first wins */
+	SOCD_FIRST,
+};
+
+struct socd_side {
+	/* Opposing usage, 0 for none */
+	uint8_t opponent;
+	uint8_t mode;
+};
+
+#define SOCD_PAIR(node_id)						\
+	[DT_PROP_BY_IDX(node_id, usages, 0)] = {			\
+		.opponent = DT_PROP_BY_IDX(node_id, usages, 1),		\
+		.mode = DT_ENUM_IDX(node_id, mode),			\
+	},								\
+	[DT_PROP_BY_IDX(node_id, usages, 1)] = {			\
+		.opponent = DT_PROP_BY_IDX(node_id, usages, 0),		\
+		.mode = DT_ENUM_IDX(node_id, mode),			\
+	},
+
+static const struct socd_side socd[256] = {
+	DT_FOREACH_CHILD_STATUS_OKAY(SOCD_NODE, SOCD_PAIR)
+};
+
+/* Held usages a pair currently hides, one bit per usage */
+static uint32_t socd_masked[256 / 32];
+
+static inline void socd_mask(uint8_t usage, bool masked)
+{
+	WRITE_BIT(socd_masked[usage / 32], usage % 32, masked);
+	usage_show(usage, !masked &&
+		   (usage_bitmap[usage / 32] & BIT(usage % 32)));
+}
+
+static KEYPAD_HOT void socd_press(uint8_t usage)
+{
+	const struct socd_side *side = &socd[usage];
+	uint8_t other = side->opponent;
+
+	if (other == 0 || !(usage_bitmap[other / 32] & BIT(other % 32))) {
+		return;
+	}
+
+	socd_mask(other, side->mode != SOCD_FIRST);
+	socd_mask(usage, side->mode != SOCD_LAST);
+}
+
+static KEYPAD_HOT void socd_release(uint8_t usage)
+{
+	uint8_t other = socd[usage].opponent;
+
+	socd_mask(usage, false);
+	if (other != 0) {
+		/* Still held or not, the opposing usage is reported as is */
+		socd_mask(other, false);
+	}
+}
+
+static inline bool socd_hidden(uint8_t usage)
+{
+	return (socd_masked[usage / 32] & BIT(usage % 32)) != 0;
+}
+#else
+static inline void socd_press(uint8_t usage) {}
+static inline void socd_release(uint8_t usage) {}
+
+static inline bool socd_hidden(uint8_t usage)
+{
+	return false;
+}
+#endif
+
+#if defined(CONFIG_KEYPAD_REPORT_NKRO)
+static const uint8_t hid_report_desc[] = REPORT_NKRO_DESC();
+
+BUILD_ASSERT(REPORT_NKRO_LAST < REPORT_USAGE_MODIFIER_FIRST,
+	     "NKRO bitmap must not overlap the modifier usages");
+#else
+static const uint8_t hid_report_desc[] = HID_KEYBOARD_REPORT_DESC();
+#endif
+
+#if defined(CONFIG_HID_INTERRUPT_EP_MPS)
+BUILD_ASSERT(REPORT_SIZE <= CONFIG_HID_INTERRUPT_EP_MPS,
+	     "keyboard report does not fit the interrupt endpoint");
+#endif
+
+static inline bool usage_is_modifier(uint8_t usage)
+{
+	return usage >= REPORT_USAGE_MODIFIER_FIRST &&
+	       usage <= REPORT_USAGE_MODIFIER_LAST;
+}
+
+/* Armed modifiers no key holds any more are spent */
+static void oneshot_spend(void)
+{
+	uint8_t spent = oneshot_used & ~oneshot_held;
+
+	oneshot &= ~spent;
+	oneshot_used &= ~spent;
+	sticky = oneshot | oneshot_locked;
+}
+
+KEYPAD_HOT void report_key_press(uint8_t usage)
+{
+	if (usage_is_modifier(usage)) {
+		modifiers |= BIT(usage - REPORT_USAGE_MODIFIER_FIRST);
+	} else if (usage != 0) {
+		socd_press(usage);
+		usage_bitmap[usage / 32] |= BIT(usage % 32);
+		usage_show(usage, !socd_hidden(usage));
+		/* Stay in the reports until the key is let go */
+		oneshot_used |= oneshot;
+	}
+}
+
+KEYPAD_HOT void report_key_release(uint8_t usage)
+{
+	if (usage_is_modifier(usage)) {
+		modifiers &= ~BIT(usage - REPORT_USAGE_MODIFIER_FIRST);
+	} else {
+		usage_bitmap[usage / 32] &= ~BIT(usage % 32);
+		usage_show(usage, false);
+		socd_release(usage);
+		if (oneshot_used != 0) {
+			oneshot_spend();
+		}
+	}
+}
+
+void report_oneshot_press(uint8_t mods, uint32_t sof)
+{
+	if (oneshot_locked & mods) {
+		/* Third tap, the release is then a plain one */
+		oneshot_locked &= ~mods;
+	} else if ((oneshot & mods) == mods && !(oneshot_used & mods)) {
+		/* Tapped again before any key used them */
+		oneshot &= ~mods;
+		oneshot_locked |= mods;
+	} else {
+		oneshot |= mods;
+		oneshot_held |= mods;
+		oneshot_deadline = sof + CONFIG_KEYPAD_ONESHOT_TIMEOUT_MS;
+	}
+
+	sticky = oneshot | oneshot_locked;
+}
+
+void report_oneshot_release(uint8_t mods)
+{
+	/* Used while held: a plain modifier, gone with the key */
+	oneshot_held &= ~mods;
+	oneshot_spend();
+}
+
+uint8_t report_oneshot_get(void)
+{
+	return sticky;
+}
+
+bool report_oneshot_due(uint32_t sof)
+{
+	return CONFIG_KEYPAD_ONESHOT_TIMEOUT_MS > 0 &&
+	       (oneshot & ~oneshot_held & ~oneshot_used) != 0 &&
+	       (int32_t)(sof - oneshot_deadline) >= 0;
+}
+
+bool report_oneshot_frame(uint32_t sof)
+{
+	if (!report_oneshot_due(sof)) {
+		return false;
+	}
+
+	oneshot &= oneshot_held | oneshot_used;
+	sticky = oneshot | oneshot_locked;
+
+	return true;
+}
+
+#if defined(CONFIG_KEYPAD_REPORT_NKRO)
+static KEYPAD_HOT size_t report_build_nkro(uint8_t *buf)
+{
+	buf[KEYPAD_BTN_MODIFIER_REPORT_POS] = modifiers | sticky;
+	memcpy(&buf[1], (const uint8_t *)shown + REPORT_NKRO_FIRST / 8,
+	       REPORT_NKRO_BITS / 8);
+
+	return REPORT_NKRO_SIZE;
+}
+#endif
+
+static KEYPAD_HOT size_t report_build_boot(uint8_t *buf)
+{
+	memcpy(buf, boot_report, REPORT_BOOT_SIZE);
+	buf[KEYPAD_BTN_MODIFIER_REPORT_POS] = modifiers | sticky;
+
+	if (overflow > 0) {
+		/* More keys than slots: report phantom state */
+		memset(&buf[KEYPAD_BTN_CODE_REPORT_POS],
+		       REPORT_USAGE_ERROR_ROLLOVER,
+		       KEYPAD_BTN_CODE_REPORT_SLOTS);
+	}
+
+	return REPORT_BOOT_SIZE;
+}
+
+#if defined(CONFIG_KEYPAD_REPORT_NKRO)
+#define REPORT_BUILD_DEFAULT report_build_nkro
+#else
+#define REPORT_BUILD_DEFAULT report_build_boot
+#endif
+
+/* Chosen on protocol changes, so building a report never checks it */
+static size_t (*report_builder)(uint8_t *buf) = REPORT_BUILD_DEFAULT;
+
+KEYPAD_HOT size_t report_build(uint8_t *buf)
+{
+	uint32_t bench = stage_bench_begin();
+	size_t len;
+
+	marker_begin(MARKER_REPORT_BUILD);
+	len = report_builder(buf);
+	marker_end(MARKER_REPORT_BUILD);
+	stage_bench_end(STAGE_BENCH_BUILD, bench);
+
+	return len;
+}
+
+void report_protocol_set(uint8_t protocol)
+{
+	report_builder = protocol == HID_PROTOCOL_BOOT ? report_build_boot :
+							 REPORT_BUILD_DEFAULT;
+}
+
+const uint8_t *report_desc_get(size_t *size)
+{
+	*size = sizeof(hid_report_desc);
+
+	return hid_report_desc;
+}
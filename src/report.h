@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Keyboard report builder. Keeps the held HID usages as a 6-key
+ * rollover boot-style report and as an N-key rollover bitmap, both
+ * edited in place by every press and release, and copies out the one
+ * CONFIG_KEYPAD_REPORT_* selects. Hosts that select the boot protocol
+ * get the boot report in either case.
+ */
+
+#ifndef KEYPAD_REPORT_H_
+#define KEYPAD_REPORT_H_
+
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+
+/*
+ * Macro for byte position in HID report packet
+ */
+#define KEYPAD_BTN_MODIFIER_REPORT_POS 0
+#define KEYPAD_BTN_CODE_REPORT_POS 2
+#define KEYPAD_BTN_CODE_REPORT_SLOTS 6
+
+/* First and last usage of the modifier range (LeftControl..RightGUI) */
+#define REPORT_USAGE_MODIFIER_FIRST 0xE0
+#define REPORT_USAGE_MODIFIER_LAST 0xE7
+
+/* Usage reported in every slot when more than six keys are held */
+#define REPORT_USAGE_ERROR_ROLLOVER 0x01
+
+#define REPORT_BOOT_SIZE \
+	(KEYPAD_BTN_CODE_REPORT_POS + KEYPAD_BTN_CODE_REPORT_SLOTS)
+
+#if defined(CONFIG_KEYPAD_REPORT_NKRO)
+#if defined(CONFIG_KEYPAD_NKRO_KEYMAP_RANGE)
+/* Usages the keymap emits, see scripts/gen_report_usages.py */
+#include "report_usages.h"
+#else
+#define REPORT_NKRO_FIRST 0
+#define REPORT_NKRO_LAST CONFIG_KEYPAD_NKRO_MAX_USAGE
+#endif
+/* Bit n of the bitmap is usage REPORT_NKRO_FIRST + n, a multiple of 8 */
+#define REPORT_NKRO_BITS \
+	(ROUND_UP(REPORT_NKRO_LAST + 1, 8) - REPORT_NKRO_FIRST)
+#define REPORT_NKRO_SIZE (1 + REPORT_NKRO_BITS / 8)
+/* Largest report of either protocol */
+#define REPORT_SIZE MAX(REPORT_NKRO_SIZE, REPORT_BOOT_SIZE)
+#else
+#define REPORT_SIZE REPORT_BOOT_SIZE
+#endif
+
+/* Report buffers are word aligned and compared a word at a time */
+#define REPORT_WORDS DIV_ROUND_UP(REPORT_SIZE, sizeof(uint32_t))
+
+/* The first len bytes of two REPORT_WORDS buffers are the same */
+static inline bool report_equal(const uint32_t *a, const uint32_t *b,
+				size_t len)
+{
+	size_t words = len / sizeof(uint32_t);
+
+	for (size_t i = 0; i < words; i++) {
+		if (a[i] != b[i]) {
+			return false;
+		}
+	}
+
+	return memcmp(&a[words], &b[words], len % sizeof(uint32_t)) == 0;
+}
+
+void report_key_press(uint8_t usage);
+void report_key_release(uint8_t usage);
+
+/*
+ * The usage shows in the report of either protocol. Only an NKRO bitmap
+ * cut to the usages of the keymap leaves any out, and keymaps loaded at
+ * run time are checked against it.
+ */
+static inline bool report_usage_reportable(uint8_t usage)
+{
+#if defined(CONFIG_KEYPAD_NKRO_KEYMAP_RANGE)
+	return usage == 0 ||
+	       (usage >= REPORT_NKRO_FIRST &&
+		usage - REPORT_NKRO_FIRST < REPORT_NKRO_BITS) ||
+	       (usage >= REPORT_USAGE_MODIFIER_FIRST &&
+		usage <= REPORT_USAGE_MODIFIER_LAST);
+#else
+	return true;
+#endif
+}
+
+/*
+ * One-shot modifier keys, mods a mask of the modifier byte. A tap arms
+ * them for the next key, a second tap before that key locks them on
+ * until a third, and held down with other keys they are plain
+ * modifiers. sof is the frame of the press: armed modifiers no key
+ * used run out CONFIG_KEYPAD_ONESHOT_TIMEOUT_MS later, 0 for never.
+ */
+void report_oneshot_press(uint8_t mods, uint32_t sof);
+void report_oneshot_release(uint8_t mods);
+
+/* Armed and locked one-shot modifiers, bits of the modifier byte */
+uint8_t report_oneshot_get(void);
+
+/* SOF interrupt: the armed modifiers run out at frame sof */
+bool report_oneshot_due(uint32_t sof);
+
+/*
+ * Report thread, once per report: drop modifiers that ran out. Returns
+ * true if the report changed.
+ */
+bool report_oneshot_frame(uint32_t sof);
+
+/*
+ * Render the current key state into buf, which must hold REPORT_SIZE
+ * bytes. Returns the number of bytes written, which depends on the
+ * protocol.
+ */
+size_t report_build(uint8_t *buf);
+
+/*
+ * Select the report format for HID_PROTOCOL_BOOT or
+ * HID_PROTOCOL_REPORT, from struct hid_ops::protocol_change.
+ */
+void report_protocol_set(uint8_t protocol);
+
+const uint8_t *report_desc_get(size_t *size);
+
+#endif /* KEYPAD_REPORT_H_ */
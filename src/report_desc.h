@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * N-key rollover keyboard report descriptor, next to the boot one of
+ * HID_KEYBOARD_REPORT_DESC(). A macro so the ESB dongle image, which
+ * presents the keypad's reports to its own host, uses the same one.
+ */
+
+#ifndef KEYPAD_REPORT_DESC_H_
+#define KEYPAD_REPORT_DESC_H_
+
+#include <zephyr/usb/class/usb_hid.h>
+
+#include "report.h"
+
+#if defined(CONFIG_KEYPAD_REPORT_NKRO)
+#define REPORT_NKRO_DESC() { \
+	HID_USAGE_PAGE(HID_USAGE_GEN_DESKTOP), \
+	HID_USAGE(HID_USAGE_GEN_DESKTOP_KEYBOARD), \
+	HID_COLLECTION(HID_COLLECTION_APPLICATION), \
+		/* Modifier byte */ \
+		HID_USAGE_PAGE(HID_USAGE_GEN_DESKTOP_KEYPAD), \
+		HID_USAGE_MIN8(REPORT_USAGE_MODIFIER_FIRST), \
+		HID_USAGE_MAX8(REPORT_USAGE_MODIFIER_LAST), \
+		HID_LOGICAL_MIN8(0), \
+		HID_LOGICAL_MAX8(1), \
+		HID_REPORT_SIZE(1), \
+		HID_REPORT_COUNT(8), \
+		/* Data,Var,Abs */ \
+		HID_INPUT(0x02), \
+		/* One bit per usage from REPORT_NKRO_FIRST on */ \
+		HID_USAGE_MIN8(REPORT_NKRO_FIRST), \
+		HID_USAGE_MAX8(REPORT_NKRO_FIRST + REPORT_NKRO_BITS - 1), \
+		HID_REPORT_COUNT(REPORT_NKRO_BITS), \
+		/* Data,Var,Abs */ \
+		HID_INPUT(0x02), \
+		/* Lock key LEDs, same layout as the boot keyboard */ \
+		HID_USAGE_PAGE(HID_USAGE_GEN_LEDS), \
+		HID_USAGE_MIN8(1), \
+		HID_USAGE_MAX8(5), \
+		HID_REPORT_COUNT(5), \
+		/* Data,Var,Abs */ \
+		HID_OUTPUT(0x02), \
+		HID_REPORT_SIZE(3), \
+		HID_REPORT_COUNT(1), \
+		/* Cnst,Array,Abs */ \
+		HID_OUTPUT(0x03), \
+	HID_END_COLLECTION, \
+}
+#endif /* CONFIG_KEYPAD_REPORT_NKRO */
+
+#endif /* KEYPAD_REPORT_DESC_H_ */
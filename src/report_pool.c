@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * The free list is a bitmap in one atomic word: allocation claims the
+ * lowest clear bit with a compare-and-swap, the last unref clears it.
+ * Neither takes a lock, so a link's completion interrupt can release
+ * a buffer while the report thread allocates the next one.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/util.h>
+
+#include "hot_path.h"
+#include "report_pool.h"
+
+BUILD_ASSERT(CONFIG_KEYPAD_REPORT_POOL_SIZE <= 32,
+	     "the free bitmap is one word");
+BUILD_ASSERT(CONFIG_KEYPAD_REPORT_POOL_SIZE >= REPORT_POOL_WORST_CASE,
+	     "report pool smaller than the reports in flight at once");
+
+#define POOL_MASK BIT_MASK(CONFIG_KEYPAD_REPORT_POOL_SIZE)
+
+static struct report_buf pool[CONFIG_KEYPAD_REPORT_POOL_SIZE];
+/* Bit n set while pool[n] is allocated */
+static atomic_t used;
+static atomic_t peak;
+static atomic_t exhausted;
+
+KEYPAD_HOT struct report_buf *report_pool_alloc(void)
+{
+	atomic_val_t old;
+	atomic_val_t now;
+	uint32_t free;
+	int count;
+	int n;
+
+	do {
+		old = atomic_get(&used);
+		free = ~(uint32_t)old & POOL_MASK;
+		if (free == 0) {
+			atomic_inc(&exhausted);
+			return NULL;
+		}
+
+		n = find_lsb_set(free) - 1;
+		now = old | BIT(n);
+	} while (!atomic_cas(&used, old, now));
+
+	count = __builtin_popcount(now);
+	do {
+		old = atomic_get(&peak);
+	} while (count > old && !atomic_cas(&peak, old, count));
+
+	atomic_set(&pool[n].refs, 1);
+
+	return &pool[n];
+}
+
+KEYPAD_HOT struct report_buf *report_buf_ref(struct report_buf *buf)
+{
+	__ASSERT(atomic_get(&buf->refs) > 0, "ref of a free report buffer");
+
+	atomic_inc(&buf->refs);
+
+	return buf;
+}
+
+KEYPAD_HOT void report_buf_unref(struct report_buf *buf)
+{
+	__ASSERT(atomic_get(&buf->refs) > 0, "unref of a free report buffer");
+
+	if (atomic_dec(&buf->refs) == 1) {
+		atomic_and(&used, ~BIT(buf - pool));
+	}
+}
+
+void report_pool_stats_get(struct report_pool_stats *out)
+{
+	out->in_use = __builtin_popcount(atomic_get(&used));
+	out->peak = atomic_get(&peak);
+	out->exhausted = atomic_get(&exhausted);
+}
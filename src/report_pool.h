@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Fixed pool of report buffers, shared by the report builders and the
+ * links. A buffer is reference counted: the builder holds one reference,
+ * every link it was written to holds another until the report is
+ * delivered or forgotten, so one report can sit on several links
+ * without a copy of its own. Allocation and release are lock-free and
+ * may be used from any context.
+ *
+ * No heap: CONFIG_KEYPAD_REPORT_POOL_SIZE buffers, checked at build time
+ * against the most that can be in use at once.
+ */
+
+#ifndef KEYPAD_REPORT_POOL_H_
+#define KEYPAD_REPORT_POOL_H_
+
+#include <zephyr/zephyr.h>
+#include <zephyr/sys/atomic.h>
+
+#include "report.h"
+
+/* Largest report a pool user builds, in words */
+#define REPORT_POOL_WORDS REPORT_WORDS
+
+#if defined(CONFIG_KEYPAD_BLE)
+#define REPORT_POOL_BLE_DEPTH \
+	(CONFIG_KEYPAD_BLE_TX_DEPTH * CONFIG_KEYPAD_BLE_HOSTS)
+#else
+#define REPORT_POOL_BLE_DEPTH 0
+#endif
+
+#if defined(CONFIG_KEYPAD_ESB)
+#define REPORT_POOL_ESB_DEPTH CONFIG_KEYPAD_ESB_TX_DEPTH
+#else
+#define REPORT_POOL_ESB_DEPTH 0
+#endif
+
+/*
+ * Most buffers in use at once: the report being built and the one last
+ * sent, and every link full, USB (or the host simulation) with one.
+ */
+#define REPORT_POOL_WORST_CASE \
+	(2 + 1 + REPORT_POOL_BLE_DEPTH + REPORT_POOL_ESB_DEPTH)
+
+struct report_buf {
+	atomic_t refs;
+	uint32_t data[REPORT_POOL_WORDS];
+};
+
+struct report_pool_stats {
+	/* Buffers allocated right now, and the most ever */
+	uint32_t in_use;
+	uint32_t peak;
+	/* Allocations that found the pool empty */
+	uint32_t exhausted;
+};
+
+/* Buffer with one reference, contents undefined; NULL if none is free */
+struct report_buf *report_pool_alloc(void);
+
+/* Another reference to buf, returns buf */
+struct report_buf *report_buf_ref(struct report_buf *buf);
+
+/* Drop a reference, the last one returns buf to the pool */
+void report_buf_unref(struct report_buf *buf);
+
+void report_pool_stats_get(struct report_pool_stats *out);
+
+#endif /* KEYPAD_REPORT_POOL_H_ */
@@ -0,0 +1,874 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Reports are built into one of two buffers while the other one is on
+ * the IN endpoint. The staged report stays open while the endpoint is
+ * busy: later events are folded into it under the same one change per
+ * key rule, and it is written as soon as the previous transfer
+ * completes. Only the report thread builds and writes reports, so the
+ * buffers need no lock.
+ *
+ * The other buffer still holds the report last written, so a staged
+ * report is compared with it, a word at a time, and dropped when the
+ * wire bytes are the same: a key on an already held usage, a layer key
+ * or more keys than the 6-key report holds cost no bus slot.
+ *
+ * Reports go to the sink picked at the start of each pass. When the
+ * pick changes, the held keys are sent to the new link in full: its
+ * host has not seen the reports that went out on the old one. If the
+ * old link went down with a report on it, that report goes to the new
+ * link first, so a tap in it is not lost; if the old link is still
+ * up, it gets a report with everything released, also when no link
+ * takes over.
+ *
+ * A write that fails leaves the report staged, and nothing else may
+ * wake the scheduler until the next key: a retry timer does, backing
+ * off from 1 ms to CONFIG_KEYPAD_REPORT_RETRY_MAX_MS while the link
+ * keeps refusing. After CONFIG_KEYPAD_REPORT_RETRY_ATTEMPTS the timer
+ * stops; the report, with every event folded in since, is still staged
+ * for the next completion, SOF or key. It is never dropped: a lost
+ * release is a key stuck on the host.
+ *
+ * Without a link the events are normally folded into the staged report
+ * as they come, so the held keys are right once one is back but a tap
+ * in between is gone. While a link that is reconnecting holds the
+ * scheduler, a pass without a sink takes nothing from the ring, and
+ * the first pass with one sends every change. The other half of the
+ * ring is left for what comes after: once holding would fill it, the
+ * pass folds everything as before, so a release is never dropped for
+ * a press kept back.
+ *
+ * A sink with a schedule callback, a BLE link that knows its connection
+ * events, is woken like the USB frames: a key or a completion asks the
+ * sink, and the pass runs at report_sched_frame() just ahead of the
+ * next event rather than right away.
+ *
+ * The lanes of the staged report are a bitmap, set as changes are
+ * folded in; its lane is the lowest bit. Live events are collected
+ * first and the generated steps only run in a fresh frame that took
+ * none, so a keystroke never shares a report with a macro step: it
+ * could not tell a modifier of the macro from one of its own. A
+ * generated report kept back for the link is still open, and a live
+ * event folded into it moves it to that event's lane and out.
+ */
+
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/device.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/logging/log.h>
+
+#include "diag/latency.h"
+#include "diag/loopback.h"
+#include "diag/stamps.h"
+#include "diag/seqtrace.h"
+#include "diag/stage_bench.h"
+#include "diag/startup.h"
+#include "diag/watchdog.h"
+#include "event_ring.h"
+#include "hot_path.h"
+#include "keymap.h"
+#include "layer.h"
+#include "macro.h"
+#include "pipeline.h"
+#include "report.h"
+#include "report_pool.h"
+#include "report_sched.h"
+#include "report_sink.h"
+#include "timebase.h"
+#include "ble/host.h"
+#include "input/turbo.h"
+#include "input/typematic.h"
+
+LOG_MODULE_REGISTER(report_sched, LOG_LEVEL_INF);
+
+/* Events pulled from the ring at once */
+#define EVENT_BATCH_SIZE 8
+
+#define SCHED_REPORT_TYPE_INPUT 0x01
+/* Reads of wire_buf a GET_REPORT tries before it gives up */
+#define GET_REPORT_TRIES 3
+
+static K_SEM_DEFINE(sched_sem, 0, 1);
+static void sched_retry_expired(struct k_timer *timer);
+static K_TIMER_DEFINE(retry_timer, sched_retry_expired, NULL);
+/* Delay of the pending retry, 0 after a successful write */
+static uint32_t retry_ms;
+/* Timer retries since the last successful write */
+static uint32_t retry_attempts;
+/* k_uptime_get_32() of the last write error logged, failures since */
+static uint32_t error_logged;
+static uint32_t error_quiet;
+/* Link the reports go to, NULL while none is up */
+static struct report_sink *sink;
+
+/* Host polling period estimate, tracked from link completions */
+static uint32_t poll_interval_us = CONFIG_KEYPAD_POLL_INTERVAL_US;
+/* timebase_now32() at the previous IN completion */
+static uint32_t last_done;
+/* In-flight report was queued right after the previous completion */
+static bool back_to_back;
+
+/* SOF sync: events are waiting for the next frame */
+static atomic_t frame_pending;
+/* Start-of-Frame count and timebase_now32() of the latest one */
+static uint32_t sof_count;
+static uint32_t sof_time;
+
+/* Events resolved by the layers but not yet applied */
+static struct key_event stash[EVENT_BATCH_SIZE];
+static size_t stash_len;
+static size_t stash_pos;
+
+/* Report being built and the one last sent, from the report pool */
+static struct report_buf *stage_buf;
+static struct report_buf *wire_buf;
+static size_t stage_len;
+/* Length of the report last sent, 0 if the host may not have it */
+static size_t sent_len;
+/* Length of the report last sent, whatever became of it */
+static size_t last_len;
+/*
+ * Odd while wire_buf and last_len change, for the GET_REPORT reader,
+ * which must not wait on the input thread
+ */
+static atomic_t wire_seq;
+/* The staged report goes out even if it is the same as the last one */
+static bool forced;
+/* Set while stage_buf holds changes not yet written */
+static atomic_t staged;
+/* Keys changed in the staged report */
+static keypad_bitmap_t frame_keys;
+/* Lanes of the changes in it, and timebase_now32() of each one's first */
+static uint8_t stage_lanes;
+static uint32_t lane_since[REPORT_LANE_COUNT];
+
+/* HID idle period expired, and a changed report was built since the last */
+static atomic_t idle_due;
+static bool changed_since_idle;
+/* The protocol changed, the staged report must be rebuilt */
+static atomic_t rebuild;
+/* A link is coming up, see report_sched_hold() */
+static atomic_t hold;
+
+static struct report_sched_stats stats;
+
+/* Nothing held, in either protocol */
+static const uint32_t released[REPORT_WORDS];
+
+/* Every wakeup is work the watchdog waits to see the thread finish */
+static inline void sched_wake(void)
+{
+	watchdog_post(WATCHDOG_REPORT);
+	k_sem_give(&sched_sem);
+}
+
+static KEYPAD_HOT void sched_lane(enum report_lane lane)
+{
+	if ((stage_lanes & BIT(lane)) == 0) {
+		stage_lanes |= BIT(lane);
+		lane_since[lane] = timebase_now32();
+	}
+}
+
+static KEYPAD_HOT void event_apply(const struct key_event *event)
+{
+	bool modifier = event->usage >= REPORT_USAGE_MODIFIER_FIRST &&
+			event->usage <= REPORT_USAGE_MODIFIER_LAST;
+
+	if (event->summarized) {
+		/* Whatever was lost in between, the state goes out first */
+		stats.summarized++;
+		modifier = true;
+	}
+
+	sched_lane(!event->pressed || modifier ? REPORT_LANE_URGENT :
+						 REPORT_LANE_LIVE);
+
+	typematic_key(event->usage, event->pressed, sof_count);
+	turbo_key(event->key, event->usage, event->pressed, sof_count);
+
+	if (event->pressed) {
+		report_key_press(event->usage);
+	} else {
+		report_key_release(event->usage);
+	}
+}
+
+/*
+ * Apply pending events up to the first one that touches a key already
+ * changed in this frame, or the next generated steps if there are
+ * none. Returns true if anything was applied.
+ */
+static KEYPAD_HOT bool sched_collect(void)
+{
+	bool fresh = !atomic_get(&staged);
+	bool changed = false;
+
+	if (fresh) {
+		stage_lanes = 0;
+
+		/* The one-shot timeouts still go ahead of the keys */
+		if (report_oneshot_frame(sof_count)) {
+			sched_lane(REPORT_LANE_URGENT);
+			changed = true;
+		}
+		layer_oneshot_frame(sof_count);
+		host_frame();
+		frame_keys = 0;
+	}
+
+	while (true) {
+		const struct key_event *event;
+
+		if (stash_pos == stash_len) {
+			stash_len = layer_get(stash, ARRAY_SIZE(stash));
+			stash_pos = 0;
+			if (stash_len == 0) {
+				break;
+			}
+		}
+
+		event = &stash[stash_pos];
+		if (frame_keys & BIT(event->key)) {
+			/* Second edge of this key goes into the next frame */
+			break;
+		}
+
+		frame_keys |= BIT(event->key);
+		latency_frame_event(event->timestamp);
+		loopback_frame_event(event);
+		stamps_frame_event(event);
+		event_apply(event);
+		stash_pos++;
+		stats.events++;
+		changed = true;
+	}
+
+	if (fresh && stage_lanes == 0) {
+		/*
+		 * Macro playback, key repeat and turbo advance one step per
+		 * report, in a report of their own
+		 */
+		bool step = PIPELINE_MACROS && macro_frame();
+
+		step |= typematic_frame(sof_count);
+		step |= turbo_frame(sof_count);
+		if (step) {
+			sched_lane(REPORT_LANE_GENERATED);
+			changed = true;
+		}
+	}
+
+	return changed;
+}
+
+static void sched_retry_expired(struct k_timer *timer)
+{
+	sched_wake();
+}
+
+static void sched_write_failed(int err)
+{
+	uint32_t now = k_uptime_get_32();
+
+	stats.failures++;
+
+	/* One line a second at most, a refusing link fails every retry */
+	if (stats.failures == 1 || now - error_logged >= MSEC_PER_SEC) {
+		LOG_WRN("%s write error %d, %u more since the last", sink->name,
+			err, error_quiet);
+		error_logged = now;
+		error_quiet = 0;
+	} else {
+		error_quiet++;
+	}
+
+	if (retry_attempts >= CONFIG_KEYPAD_REPORT_RETRY_ATTEMPTS) {
+		if (retry_attempts++ == CONFIG_KEYPAD_REPORT_RETRY_ATTEMPTS) {
+			/* Left to the link's next completion or a key */
+			stats.exhausted++;
+		}
+		return;
+	}
+
+	retry_attempts++;
+	retry_ms = CLAMP(retry_ms * 2, 1, CONFIG_KEYPAD_REPORT_RETRY_MAX_MS);
+	k_timer_start(&retry_timer, K_MSEC(retry_ms), K_NO_WAIT);
+	stats.retries++;
+}
+
+static bool sched_busy(void)
+{
+	return sink != NULL && report_sink_busy(sink);
+}
+
+/* A report of the lane was written with ahead reports before it */
+static void sched_lane_sent(enum report_lane lane, uint8_t ahead)
+{
+	struct report_lane_stats *l = &stats.lanes[lane];
+	uint32_t wait = timebase_to_us32(timebase_now32() -
+					    lane_since[lane]);
+
+	l->sent++;
+	l->ahead += ahead;
+	l->ahead_max = MAX(l->ahead_max, ahead);
+	l->wait_us += ((int32_t)wait - (int32_t)l->wait_us) / 8;
+	l->wait_max_us = MAX(l->wait_max_us, wait);
+}
+
+/* Write the staged report, returns 1 if it is on the link now */
+static KEYPAD_HOT int sched_submit(void)
+{
+	enum report_lane lane;
+	struct report_buf *next;
+	uint32_t bench;
+	uint8_t ahead;
+	int ret;
+
+	if (stage_lanes == 0) {
+		/* Staged without a change, the held keys for a new host */
+		sched_lane(REPORT_LANE_URGENT);
+	}
+	lane = find_lsb_set(stage_lanes) - 1;
+
+	if (sink == NULL) {
+		/* Staged until a link comes up */
+		return 0;
+	}
+
+	if (report_sink_busy(sink)) {
+		stats.busy++;
+		return 0;
+	}
+
+	ahead = report_sink_queued(sink);
+	if (lane == REPORT_LANE_GENERATED && ahead > 0) {
+		/* Left the slots for live keys, the completion wakes us */
+		stats.lanes[lane].deferred++;
+		return 0;
+	}
+
+	/* Built into next, the staged one stays with its links */
+	next = report_pool_alloc();
+	if (next == NULL) {
+		/* A delivery returns a buffer and wakes the scheduler */
+		stats.busy++;
+		return 0;
+	}
+
+	back_to_back = timebase_to_us32(timebase_now32() - last_done) <
+		       poll_interval_us / 4;
+	latency_frame_submit();
+	loopback_frame_submit();
+	stamps_frame_submit();
+	bench = stage_bench_begin();
+	ret = report_sink_write_buf(sink, stage_buf, stage_len);
+	stage_bench_end(STAGE_BENCH_SUBMIT, bench);
+	if (ret) {
+		/*
+		 * Nobody will pick it up; keep it staged and folding events
+		 * so the state is current once the host polls again.
+		 */
+		report_buf_unref(next);
+		sched_write_failed(ret);
+		return ret;
+	}
+
+	retry_ms = 0;
+	retry_attempts = 0;
+
+	sched_lane_sent(lane, ahead);
+	stage_lanes = 0;
+	sent_len = stage_len;
+	forced = false;
+	atomic_inc(&wire_seq);
+	last_len = stage_len;
+	report_buf_unref(wire_buf);
+	wire_buf = stage_buf;
+	atomic_inc(&wire_seq);
+	stage_buf = next;
+	atomic_set(&staged, 0);
+	startup_mark(STARTUP_FIRST_REPORT);
+	seqtrace_report();
+
+	return 1;
+}
+
+/* Leave the events for the link coming up, see report_sched_hold() */
+static bool sched_holding(void)
+{
+	size_t pending;
+
+	if (sink != NULL || !atomic_get(&hold)) {
+		return false;
+	}
+
+	pending = event_ring_pending();
+	if (pending >= CONFIG_KEYPAD_EVENT_RING_SIZE / 2) {
+		return false;
+	}
+
+	stats.held_peak = MAX(stats.held_peak, pending);
+
+	return true;
+}
+
+static void sched_switch(struct report_sink *next)
+{
+	struct report_sink *prev = sink;
+	bool replay = prev != NULL && report_sink_take_lost(prev) > 0;
+	size_t len;
+
+	sink = next;
+	/* A fresh link gets the whole backoff */
+	retry_ms = 0;
+	retry_attempts = 0;
+
+	/* The new link starts from whatever is held now */
+	atomic_set(&rebuild, 1);
+	len = report_build((uint8_t *)stage_buf->data);
+
+	if (prev != NULL && prev->active(prev)) {
+		/* Nothing stays held on a host that is still connected */
+		(void)report_sink_write(prev, (const uint8_t *)released, len);
+	}
+
+	if (next == NULL) {
+		/* Staged until a link is back */
+		return;
+	}
+
+	LOG_INF("Reports go to %s", next->name);
+	stats.switches++;
+
+	if (replay && last_len == len) {
+		/* Only the latest report on the old link is kept */
+		if (report_sink_write_buf(next, wire_buf, len) == 0) {
+			stats.replayed++;
+		}
+	}
+}
+
+void report_sched_notify(void)
+{
+	struct report_sink *s = sink;
+
+	if (s != NULL && s->schedule != NULL) {
+		/* Woken ahead of the link's next transmission */
+		s->schedule(s);
+		return;
+	}
+
+	if (IS_ENABLED(CONFIG_KEYPAD_REPORT_SOF_SYNC)) {
+		/* Picked up by the next Start-of-Frame */
+		atomic_set(&frame_pending, 1);
+		return;
+	}
+
+	sched_wake();
+}
+
+void report_sched_sof(void)
+{
+	sof_time = timebase_now32();
+	sof_count++;
+
+	if (typematic_due(sof_count) || turbo_due(sof_count) ||
+	    report_oneshot_due(sof_count) || layer_oneshot_due(sof_count)) {
+		atomic_set(&frame_pending, 1);
+	}
+
+	/*
+	 * Build and arm at the frame boundary, so a key event waits for the
+	 * time to the next SOF rather than a random offset into the frame.
+	 */
+	if (!sched_busy() &&
+	    (atomic_get(&staged) || atomic_cas(&frame_pending, 1, 0))) {
+		sched_wake();
+	}
+}
+
+void report_sched_frame(void)
+{
+	sched_wake();
+}
+
+uint32_t report_sched_sof_count(void)
+{
+	return sof_count;
+}
+
+int report_sched_process(void)
+{
+	struct report_sink *next;
+	atomic_val_t seen;
+	uint32_t start;
+	int sent = 0;
+
+	k_sem_take(&sched_sem, K_FOREVER);
+	seen = watchdog_seen(WATCHDOG_REPORT);
+	start = latency_timestamp();
+
+	next = report_sink_select();
+	if (next != sink) {
+		sched_switch(next);
+	}
+
+	if (sched_holding()) {
+		watchdog_done(WATCHDOG_REPORT, seen);
+		return 0;
+	}
+
+	if (atomic_cas(&rebuild, 1, 0)) {
+		/* Held keys again, in the format of the new protocol */
+		if (!atomic_get(&staged)) {
+			frame_keys = 0;
+			stage_lanes = 0;
+		}
+
+		sched_lane(REPORT_LANE_URGENT);
+		stage_len = report_build((uint8_t *)stage_buf->data);
+		atomic_set(&staged, 1);
+		forced = true;
+	}
+
+	while (true) {
+		if (sched_collect()) {
+			stage_len = report_build((uint8_t *)stage_buf->data);
+			if (!forced && stage_len == sent_len &&
+			    report_equal(stage_buf->data, wire_buf->data,
+					 stage_len)) {
+				/* Nothing the host would see, go on collecting */
+				atomic_set(&staged, 0);
+				stage_lanes = 0;
+				stats.unchanged++;
+				continue;
+			}
+
+			atomic_set(&staged, 1);
+			changed_since_idle = true;
+		} else if (!atomic_get(&staged) && atomic_cas(&idle_due, 1, 0)) {
+			if (!changed_since_idle) {
+				/* Unchanged report, the host asked to be told */
+				stage_len = report_build((uint8_t *)stage_buf->data);
+				atomic_set(&staged, 1);
+				forced = true;
+				sched_lane(REPORT_LANE_GENERATED);
+				stats.idle++;
+			}
+
+			changed_since_idle = false;
+		}
+
+		if (!atomic_get(&staged) || sched_submit() <= 0) {
+			/* Nothing new, or staged until the endpoint is free */
+			break;
+		}
+
+		sent++;
+	}
+
+	if (IS_ENABLED(CONFIG_KEYPAD_REPORT_SOF_SYNC) &&
+	    (stash_pos != stash_len || (PIPELINE_MACROS && macro_ready()))) {
+		/*
+		 * Frame ended early on a repeated key, or a macro has more
+		 * steps: continue next SOF.
+		 */
+		atomic_set(&frame_pending, 1);
+	} else if (!IS_ENABLED(CONFIG_KEYPAD_REPORT_SOF_SYNC) &&
+		   !sched_busy() && !atomic_get(&staged) &&
+		   PIPELINE_MACROS && macro_ready()) {
+		/*
+		 * Macro started by a key that changed nothing else, or held
+		 * back by live keys. One kept back for the link is staged and
+		 * woken by the completion.
+		 */
+		sched_wake();
+	}
+
+	stats.sent += sent;
+	stats.cycles += latency_timestamp() - start;
+	watchdog_done(WATCHDOG_REPORT, seen);
+
+	return sent;
+}
+
+void report_sched_hold(bool on)
+{
+	atomic_set(&hold, on);
+
+	if (!on) {
+		/* Sent if a link took over, folded if not */
+		sched_wake();
+	}
+}
+
+void report_sched_reset(void)
+{
+	atomic_set(&idle_due, 0);
+	/* The host starts from no keys, whatever went out before */
+	sent_len = 0;
+	sched_wake();
+}
+
+/*
+ * Two completions of reports sent back to back are exactly one host
+ * polling period apart. Follow that with a 1/8 IIR so a host that polls
+ * slower (or faster) than bInterval is tracked.
+ */
+static void sched_track_interval(uint32_t now)
+{
+	if (back_to_back) {
+		int32_t sample = timebase_to_us32(now - last_done);
+
+		poll_interval_us += (sample - (int32_t)poll_interval_us) / 8;
+	}
+
+	back_to_back = false;
+	last_done = now;
+}
+
+void report_sched_idle(const struct device *dev, uint16_t report_id)
+{
+	/*
+	 * Counted in frames by the HID class from the SET_IDLE rate; with
+	 * SOF sync this is already on a frame boundary.
+	 */
+	atomic_set(&idle_due, 1);
+
+	if (!sched_busy()) {
+		sched_wake();
+	}
+}
+
+/*
+ * A seqlock read: the buffer is copied and kept only if no report was
+ * swapped onto the wire meanwhile. The old one may be back in the pool
+ * and built into by then, which the sequence covers too.
+ */
+static int sched_wire_read(uint8_t *buf, size_t *len)
+{
+	atomic_val_t seq;
+
+	for (int i = 0; i < GET_REPORT_TRIES; i++) {
+		seq = atomic_get(&wire_seq);
+		if (seq & 1) {
+			/* Mid swap, which cannot go on until this returns */
+			return -EAGAIN;
+		}
+
+		*len = last_len;
+		memcpy(buf, wire_buf->data, *len);
+		if (atomic_get(&wire_seq) == seq) {
+			return 0;
+		}
+	}
+
+	return -EAGAIN;
+}
+
+int report_sched_get_report(const struct device *dev,
+			    struct usb_setup_packet *setup, int32_t *len,
+			    uint8_t **data)
+{
+	static uint8_t input[REPORT_SIZE];
+	size_t input_len;
+	int ret;
+
+	ARG_UNUSED(dev);
+
+	/* The keyboard has one report, an Input one without an ID */
+	if ((setup->wValue >> 8) != SCHED_REPORT_TYPE_INPUT ||
+	    (setup->wValue & 0xFF) != 0) {
+		return -ENOTSUP;
+	}
+
+	ret = sched_wire_read(input, &input_len);
+	if (ret < 0) {
+		return ret;
+	}
+
+	*data = input;
+	*len = input_len;
+
+	return 0;
+}
+
+void report_sched_protocol_change(const struct device *dev,
+				  uint8_t protocol)
+{
+	report_protocol_set(protocol);
+	atomic_set(&rebuild, 1);
+	report_sched_notify();
+}
+
+void report_sched_stats_get(struct report_sched_stats *out)
+{
+	*out = stats;
+	out->staged = atomic_get(&staged) != 0;
+	out->sink = sink;
+}
+
+uint32_t report_sched_next_frame_us(uint32_t *period_us)
+{
+	struct report_sink *s = sink;
+	uint32_t period = poll_interval_us;
+	uint32_t since;
+
+	if (s != NULL && s->next_frame != NULL) {
+		return s->next_frame(s, period_us);
+	}
+
+	*period_us = period;
+	if (s == NULL || last_done == 0 || period == 0) {
+		return UINT32_MAX;
+	}
+
+	/* The host polls on the phase of the last completion */
+	since = timebase_to_us32(timebase_now32() - last_done);
+
+	return period - since % period;
+}
+
+uint32_t report_sched_poll_interval_us(void)
+{
+	return poll_interval_us;
+}
+
+void report_sched_poll_interval_set(uint32_t us)
+{
+	poll_interval_us = us;
+	back_to_back = false;
+}
+
+void report_sched_sink_done(struct report_sink *done)
+{
+	report_sink_done(done);
+
+	if (done != sink) {
+		/* Drained from a link no longer picked */
+		return;
+	}
+
+	latency_frame_done();
+	loopback_frame_done();
+	stamps_frame_done();
+	sched_track_interval(timebase_now32());
+
+	if (sink->schedule != NULL) {
+		/* Reports of the next event are built just before it */
+		sink->schedule(sink);
+		return;
+	}
+
+	if (IS_ENABLED(CONFIG_KEYPAD_REPORT_SOF_SYNC)) {
+		/* Next report goes out on the next SOF */
+		return;
+	}
+
+	/* Next IN opportunity: send whatever accumulated meanwhile */
+	sched_wake();
+}
+
+static int report_sched_init(const struct device *dev)
+{
+	ARG_UNUSED(dev);
+
+	/* Ahead of every link, the pool cannot be empty yet */
+	stage_buf = report_pool_alloc();
+	wire_buf = report_pool_alloc();
+	memset(wire_buf->data, 0, sizeof(wire_buf->data));
+	/* No keys yet, what a GET_REPORT before the first report reads */
+	last_len = report_build((uint8_t *)wire_buf->data);
+
+	return 0;
+}
+
+SYS_INIT(report_sched_init, APPLICATION, 0);
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static const char *const lane_names[] = {
+	[REPORT_LANE_URGENT] = "urgent",
+	[REPORT_LANE_LIVE] = "live",
+	[REPORT_LANE_GENERATED] = "generated",
+};
+
+static int cmd_report_show(const struct shell *sh, size_t argc, char **argv)
+{
+	struct report_sched_stats s;
+	struct report_pool_stats pool;
+
+	report_sched_stats_get(&s);
+
+	shell_print(sh, "link %s, switched %u times, %u lost reports replayed",
+		    s.sink != NULL ? s.sink->name : "none", s.switches,
+		    s.replayed);
+	shell_print(sh, "sent %u, waited on busy link %u", s.sent, s.busy);
+	shell_print(sh, "write failures %u, timer retries %u, "
+		    "retries exhausted %u", s.failures, s.retries, s.exhausted);
+	shell_print(sh, "idle re-sends %u, unchanged reports dropped %u",
+		    s.idle, s.unchanged);
+	shell_print(sh, "events held for a link coming up: at most %u%s",
+		    s.held_peak, atomic_get(&hold) ? ", holding" : "");
+	shell_print(sh, "key states summarized for a full ring %u",
+		    s.summarized);
+	shell_print(sh, "staged: %s, poll interval %u us",
+		    s.staged ? "yes" : "no", poll_interval_us);
+	for (int i = 0; i < REPORT_LANE_COUNT; i++) {
+		const struct report_lane_stats *l = &s.lanes[i];
+
+		shell_print(sh, "lane %-9s sent %u, deferred %u, ahead %u.%02u "
+			    "max %u, wait %u us max %u", lane_names[i], l->sent,
+			    l->deferred, l->sent ? l->ahead / l->sent : 0,
+			    l->sent ? l->ahead * 100 / l->sent % 100 : 0,
+			    l->ahead_max, l->wait_us, l->wait_max_us);
+	}
+	report_pool_stats_get(&pool);
+	shell_print(sh, "report pool %u/%u in use, peak %u, empty %u times",
+		    pool.in_use, CONFIG_KEYPAD_REPORT_POOL_SIZE, pool.peak,
+		    pool.exhausted);
+
+	return 0;
+}
+
+#define SCHED_STAGE(name, on) { name, on },
+
+static int cmd_report_pipeline(const struct shell *sh, size_t argc,
+			       char **argv)
+{
+	static const struct {
+		const char *name;
+		bool on;
+	} stages[] = { PIPELINE_STAGES(SCHED_STAGE) };
+	struct report_sched_stats s;
+
+	report_sched_stats_get(&s);
+
+	for (size_t i = 0; i < ARRAY_SIZE(stages); i++) {
+		shell_print(sh, "  %-10s %s", stages[i].name,
+			    stages[i].on ? "built in" : "left out");
+	}
+
+	shell_print(sh, "%u events, %llu cycles each", s.events,
+		    s.events > 0 ? s.cycles / s.events : 0);
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_report,
+	SHELL_CMD(show, NULL, "Print report transport counters",
+		  cmd_report_show),
+	SHELL_CMD(pipeline, NULL, "Print the stages of this build and "
+		  "the report thread's cycles per key event",
+		  cmd_report_pipeline),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(report, &sub_report, "Keyboard report scheduler", NULL);
+#endif /* CONFIG_SHELL */
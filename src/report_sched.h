@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Report scheduler. Merges all pending key events into the report state
+ * and writes it to a report sink once per transfer opportunity. A key
+ * that changes twice before the host picks up a report (press then
+ * release) ends the frame at the first change, so no transition is
+ * coalesced away. The next report is kept staged while the previous one
+ * is on the endpoint.
+ *
+ * Every report goes in the lane of the most urgent change it carries.
+ * Live typing has two lanes, releases and modifier changes ahead of
+ * presses, and both take any free slot on the link. Macro playback,
+ * key repeat and turbo steps are generated and wait: they advance only
+ * in a frame without live events, and a report of nothing else is
+ * only written to a link with no report on it, so a live key finds at
+ * most one generated report ahead of it whatever streams meanwhile.
+ */
+
+#ifndef KEYPAD_REPORT_SCHED_H_
+#define KEYPAD_REPORT_SCHED_H_
+
+#include <zephyr/device.h>
+#include <zephyr/usb/usb_device.h>
+
+#include "report_sink.h"
+
+enum report_lane {
+	/* Live releases and modifier changes, and rebuilds of the state */
+	REPORT_LANE_URGENT,
+	/* Live presses */
+	REPORT_LANE_LIVE,
+	/* Macro, key repeat and turbo steps, HID idle re-sends */
+	REPORT_LANE_GENERATED,
+	REPORT_LANE_COUNT,
+};
+
+struct report_lane_stats {
+	/* Reports written in the lane */
+	uint32_t sent;
+	/* Times one was kept back for a link to empty */
+	uint32_t deferred;
+	/* Reports already on the link as one was written, all and most */
+	uint32_t ahead;
+	uint8_t ahead_max;
+	/*
+	 * First change of the lane to its report written, in microseconds,
+	 * 1/8 IIR average and worst
+	 */
+	uint32_t wait_us;
+	uint32_t wait_max_us;
+};
+
+struct report_sched_stats {
+	/* Times a staged report had to wait for the previous transfer */
+	uint32_t busy;
+	/* Unchanged reports re-sent for the HID idle rate */
+	uint32_t idle;
+	/* Reports dropped for matching the last one on the wire */
+	uint32_t unchanged;
+	/* Times the reports moved to another link */
+	uint32_t switches;
+	/* Reports lost on a link that went down, sent again on the next */
+	uint32_t replayed;
+	/* Writes the link refused */
+	uint32_t failures;
+	/* Of those, retried from the backoff timer */
+	uint32_t retries;
+	/* Times CONFIG_KEYPAD_REPORT_RETRY_ATTEMPTS ran out on a report */
+	uint32_t exhausted;
+	/* Reports written to a link */
+	uint32_t sent;
+	/* Key events folded into reports */
+	uint32_t events;
+	/* Most events left in the ring for a link coming up */
+	uint32_t held_peak;
+	/* Summarized events folded in, see event_ring.h */
+	uint32_t summarized;
+	/*
+	 * Time spent building and writing reports, in latency_timestamp()
+	 * units: timebase units, core cycles with CONFIG_KEYPAD_LATENCY_DWT
+	 */
+	uint64_t cycles;
+	/* Per enum report_lane */
+	struct report_lane_stats lanes[REPORT_LANE_COUNT];
+	/* A report is staged right now */
+	bool staged;
+	/* Link the reports go to, NULL for none */
+	struct report_sink *sink;
+};
+
+/* Wake the scheduler; safe to call from interrupt context */
+void report_sched_notify(void);
+
+/*
+ * Block until notified, then send whatever is pending. Returns the
+ * number of reports written.
+ */
+int report_sched_process(void);
+
+/*
+ * Polling period the host actually uses, in microseconds. Starts at
+ * CONFIG_KEYPAD_POLL_INTERVAL_US and follows link completions.
+ */
+uint32_t report_sched_poll_interval_us(void);
+
+/* Restart the estimate from a new bInterval, while the link is down */
+void report_sched_poll_interval_set(uint32_t us);
+
+/* USB Start-of-Frame, from the device status callback */
+void report_sched_sof(void);
+
+/*
+ * The next transmission of the picked sink is close, asked for by its
+ * struct report_sink::schedule. Safe to call from interrupt context.
+ */
+void report_sched_frame(void);
+
+/*
+ * Microseconds to the next transmission of the picked link and the
+ * period between two, UINT32_MAX while no link is up or its phase is
+ * not known yet. For background work that keeps clear of the frames.
+ */
+uint32_t report_sched_next_frame_us(uint32_t *period_us);
+
+/* Number of Start-of-Frame notifications seen */
+uint32_t report_sched_sof_count(void);
+
+void report_sched_stats_get(struct report_sched_stats *out);
+
+/*
+ * The host starts over after a bus reset or reconfiguration; the link
+ * forgets its own in-flight reports.
+ */
+void report_sched_reset(void);
+
+/*
+ * A link is coming up, from the link that knows: while no sink is
+ * active the key events stay in the event ring instead of being
+ * folded into the staged report, and go out one report per change
+ * once the link is. Holding stops by itself when the ring is half
+ * full. Safe to call from interrupt context.
+ */
+void report_sched_hold(bool on);
+
+/* A report on sink was delivered, from the link's completion */
+void report_sched_sink_done(struct report_sink *sink);
+
+/*
+ * HID idle period expired, from struct hid_ops::on_idle. Re-sends the
+ * current report unless one went out during the period; reports are
+ * otherwise only sent when they change.
+ */
+void report_sched_idle(const struct device *dev, uint16_t report_id);
+
+/*
+ * GET_REPORT, from struct hid_ops::get_report, in the control request
+ * context. An Input report is the one last sent, read in place from
+ * the buffer on the wire, so a host or KVM polling the control pipe
+ * sees what the interrupt endpoint carried; nothing of the scheduler
+ * runs or waits. Any other report type or ID is -ENOTSUP, the
+ * descriptor declares none. -EAGAIN, a stall the host retries, if a
+ * report kept being sent while it was read.
+ */
+int report_sched_get_report(const struct device *dev,
+			    struct usb_setup_packet *setup, int32_t *len,
+			    uint8_t **data);
+
+/*
+ * SET_PROTOCOL, from struct hid_ops::protocol_change. Switches the
+ * report format and sends the held keys in the new one.
+ */
+void report_sched_protocol_change(const struct device *dev,
+				  uint8_t protocol);
+
+#endif /* KEYPAD_REPORT_SCHED_H_ */
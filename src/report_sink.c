@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Writes come from the report thread, completions from the link's
+ * callbacks, so each sink keeps its queue under a spinlock. Reports
+ * complete in order: the write timestamps are a ring of depth entries
+ * and the oldest one is queued entries behind the head. Pool buffers
+ * are kept in a ring beside it, their reference dropped on delivery.
+ */
+
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/slist.h>
+
+#include "hot_path.h"
+#include "report_sink.h"
+#include "timebase.h"
+
+static sys_slist_t sinks = SYS_SLIST_STATIC_INIT(&sinks);
+/* Set from the report thread only, like the selection */
+static struct report_sink *preferred;
+/* Set from the link coming up, see report_sink_claim() */
+static atomic_ptr_t claimed;
+
+void report_sink_register(struct report_sink *sink)
+{
+	__ASSERT(sink->depth > 0 && sink->depth <= REPORT_SINK_DEPTH_MAX,
+		 "bad sink depth %u", sink->depth);
+
+	sys_slist_append(&sinks, &sink->node);
+}
+
+struct report_sink *report_sink_select(void)
+{
+	struct report_sink *best = NULL;
+	struct report_sink *sink;
+
+	sink = atomic_ptr_get(&claimed);
+	if (sink != NULL) {
+		return sink->active(sink) ? sink : NULL;
+	}
+
+	if (preferred != NULL) {
+		return preferred->active(preferred) ? preferred : NULL;
+	}
+
+	SYS_SLIST_FOR_EACH_CONTAINER(&sinks, sink, node) {
+		if (!sink->active(sink)) {
+			continue;
+		}
+
+		if (best == NULL || sink->priority < best->priority ||
+		    (sink->priority == best->priority &&
+		     sink->stats.latency_us < best->stats.latency_us)) {
+			best = sink;
+		}
+	}
+
+	return best;
+}
+
+void report_sink_prefer(struct report_sink *sink)
+{
+	preferred = sink;
+}
+
+void report_sink_claim(struct report_sink *sink)
+{
+	(void)atomic_ptr_set(&claimed, sink);
+}
+
+bool report_sink_busy(struct report_sink *sink)
+{
+	return sink->stats.queued >= sink->depth;
+}
+
+uint8_t report_sink_queued(struct report_sink *sink)
+{
+	return sink->stats.queued;
+}
+
+static KEYPAD_HOT int sink_write(struct report_sink *sink,
+				 struct report_buf *buf,
+				 const uint8_t *report, size_t len)
+{
+	k_spinlock_key_t key = k_spin_lock(&sink->lock);
+	uint8_t slot = sink->head;
+	int ret;
+
+	if (sink->stats.queued >= sink->depth) {
+		k_spin_unlock(&sink->lock, key);
+		return -EBUSY;
+	}
+
+	sink->stamps[slot] = timebase_now32();
+	sink->bufs[slot] = buf != NULL ? report_buf_ref(buf) : NULL;
+	sink->head = (slot + 1) % REPORT_SINK_DEPTH_MAX;
+	sink->stats.queued++;
+	k_spin_unlock(&sink->lock, key);
+
+	ret = sink->write(sink, report, len);
+
+	key = k_spin_lock(&sink->lock);
+	if (ret) {
+		/* Nothing was queued, take the stamp back */
+		sink->head = slot;
+		sink->bufs[slot] = NULL;
+		sink->stats.queued--;
+		sink->stats.errors++;
+	} else {
+		sink->stats.sent++;
+	}
+	k_spin_unlock(&sink->lock, key);
+
+	if (ret && buf != NULL) {
+		report_buf_unref(buf);
+	}
+
+	return ret;
+}
+
+KEYPAD_HOT int report_sink_write(struct report_sink *sink,
+				 const uint8_t *report, size_t len)
+{
+	return sink_write(sink, NULL, report, len);
+}
+
+KEYPAD_HOT int report_sink_write_buf(struct report_sink *sink,
+				     struct report_buf *buf, size_t len)
+{
+	return sink_write(sink, buf, (const uint8_t *)buf->data, len);
+}
+
+void report_sink_done(struct report_sink *sink)
+{
+	k_spinlock_key_t key = k_spin_lock(&sink->lock);
+	struct report_sink_stats *s = &sink->stats;
+	struct report_buf *buf;
+	uint32_t us;
+	uint8_t oldest;
+
+	if (s->queued == 0) {
+		/* Completion of a report forgotten by a reset */
+		k_spin_unlock(&sink->lock, key);
+		return;
+	}
+
+	oldest = (sink->head + REPORT_SINK_DEPTH_MAX - s->queued) %
+		 REPORT_SINK_DEPTH_MAX;
+	us = timebase_to_us32(timebase_now32() - sink->stamps[oldest]);
+	buf = sink->bufs[oldest];
+	sink->bufs[oldest] = NULL;
+
+	if (s->completed == 0) {
+		s->latency_us = us;
+	} else {
+		s->latency_us += ((int32_t)us - (int32_t)s->latency_us) / 8;
+	}
+
+	s->latency_max_us = MAX(s->latency_max_us, us);
+	s->queued--;
+	s->completed++;
+	k_spin_unlock(&sink->lock, key);
+
+	if (buf != NULL) {
+		report_buf_unref(buf);
+	}
+}
+
+void report_sink_reset(struct report_sink *sink)
+{
+	k_spinlock_key_t key = k_spin_lock(&sink->lock);
+
+	sink->lost = MIN(sink->lost + sink->stats.queued, UINT8_MAX);
+	sink->stats.dropped += sink->stats.queued;
+	sink->stats.queued = 0;
+
+	for (int i = 0; i < REPORT_SINK_DEPTH_MAX; i++) {
+		if (sink->bufs[i] != NULL) {
+			/* Lock-free, safe under the sink's lock */
+			report_buf_unref(sink->bufs[i]);
+			sink->bufs[i] = NULL;
+		}
+	}
+	k_spin_unlock(&sink->lock, key);
+}
+
+uint8_t report_sink_take_lost(struct report_sink *sink)
+{
+	k_spinlock_key_t key = k_spin_lock(&sink->lock);
+	uint8_t lost = sink->lost;
+
+	sink->lost = 0;
+	k_spin_unlock(&sink->lock, key);
+
+	return lost;
+}
+
+void report_sink_stats_get(struct report_sink *sink,
+			   struct report_sink_stats *out)
+{
+	k_spinlock_key_t key = k_spin_lock(&sink->lock);
+
+	*out = sink->stats;
+	k_spin_unlock(&sink->lock, key);
+}
+
+void report_sink_totals_get(struct report_sink_stats *out)
+{
+	struct report_sink_stats s;
+	struct report_sink *sink;
+
+	memset(out, 0, sizeof(*out));
+
+	SYS_SLIST_FOR_EACH_CONTAINER(&sinks, sink, node) {
+		report_sink_stats_get(sink, &s);
+		out->sent += s.sent;
+		out->completed += s.completed;
+		out->errors += s.errors;
+		out->dropped += s.dropped;
+		out->queued += s.queued;
+		out->latency_max_us = MAX(out->latency_max_us,
+					  s.latency_max_us);
+	}
+}
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static int cmd_sink_show(const struct shell *sh, size_t argc, char **argv)
+{
+	struct report_sink_stats s;
+	struct report_sink *sink;
+
+	SYS_SLIST_FOR_EACH_CONTAINER(&sinks, sink, node) {
+		report_sink_stats_get(sink, &s);
+
+		shell_print(sh, "%s: %s, priority %u, queued %u/%u",
+			    sink->name, sink->active(sink) ? "active" : "down",
+			    sink->priority, s.queued, sink->depth);
+		shell_print(sh, "  sent %u, completed %u, write errors %u, "
+			    "dropped %u", s.sent, s.completed, s.errors,
+			    s.dropped);
+		shell_print(sh, "  latency %u us average, %u us worst",
+			    s.latency_us, s.latency_max_us);
+	}
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_sink,
+	SHELL_CMD(show, NULL, "Print per-link counters", cmd_sink_show),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(sink, &sub_sink, "Keyboard report links", NULL);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Report sinks, the links keyboard reports go out on. The scheduler
+ * builds a single report stream and hands each report to the active
+ * sink of the highest priority, the one with the lowest
+ * write-to-completion latency among equals; USB HID is one sink, a
+ * radio link is another. A sink takes up to its depth of reports at
+ * once, beyond that it is busy and the scheduler keeps the report
+ * staged until the link completes one. A link of several hosts
+ * registers one sink per host.
+ */
+
+#ifndef KEYPAD_REPORT_SINK_H_
+#define KEYPAD_REPORT_SINK_H_
+
+#include <zephyr/zephyr.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/sys/slist.h>
+
+#include "report_pool.h"
+
+#define REPORT_SINK_DEPTH_MAX 4
+
+struct report_sink_stats {
+	/* Reports written to the link, and their completions */
+	uint32_t sent;
+	uint32_t completed;
+	/* write() failures, the report stayed with the scheduler */
+	uint32_t errors;
+	/* Reports on the link when it went down, never delivered */
+	uint32_t dropped;
+	/* Write to completion in microseconds, 1/8 IIR average and worst */
+	uint32_t latency_us;
+	uint32_t latency_max_us;
+	/* Reports on the link right now */
+	uint8_t queued;
+};
+
+struct report_sink {
+	sys_snode_t node;
+	const char *name;
+	/* 0 is picked first, e.g. a cable over a radio link */
+	uint8_t priority;
+	/* Reports the link holds at once, 1 to REPORT_SINK_DEPTH_MAX */
+	uint8_t depth;
+	/*
+	 * Queue a report on the link, copied before returning. The link
+	 * calls report_sched_sink_done() once for every report delivered.
+	 */
+	int (*write)(struct report_sink *sink, const uint8_t *report,
+		     size_t len);
+	/* The link is up and may be picked */
+	bool (*active)(struct report_sink *sink);
+	/*
+	 * Optional, for a link that transmits at known times: have
+	 * report_sched_frame() called shortly ahead of the next one. The
+	 * scheduler then builds the report there instead of at the key,
+	 * so it carries the latest state. Called from interrupt context.
+	 */
+	void (*schedule)(struct report_sink *sink);
+	/*
+	 * Optional, for the same links: microseconds to the next
+	 * transmission and the period between them, UINT32_MAX if the
+	 * link does not know. Without it the scheduler goes by the
+	 * completions of the link and the host polling period.
+	 */
+	uint32_t (*next_frame)(struct report_sink *sink, uint32_t *period_us);
+
+	/* Owned by report_sink.c */
+	struct k_spinlock lock;
+	uint32_t stamps[REPORT_SINK_DEPTH_MAX];
+	/* Pool buffers of the queued reports, NULL for a plain write */
+	struct report_buf *bufs[REPORT_SINK_DEPTH_MAX];
+	uint8_t head;
+	/* Dropped by the last reset and not yet taken */
+	uint8_t lost;
+	struct report_sink_stats stats;
+};
+
+/* Add a link, from its init */
+void report_sink_register(struct report_sink *sink);
+
+/*
+ * Active sink of the lowest priority value, then of the lowest average
+ * latency, then the first registered. A sink without completions yet
+ * counts as 0 so it is tried. NULL if no link is up.
+ */
+struct report_sink *report_sink_select(void);
+
+/*
+ * Pin the selection to sink: it is picked while active and nothing is
+ * picked while it is down. NULL goes back to the priority order. The
+ * scheduler sees the change at its next pass.
+ */
+void report_sink_prefer(struct report_sink *sink);
+
+/*
+ * A link coming up takes the reports over: until released with NULL,
+ * sink is picked once active and nothing before, over the priorities
+ * and report_sink_prefer(). Any context, seen at the next pass.
+ */
+void report_sink_claim(struct report_sink *sink);
+
+/* Sink holds as many reports as its depth */
+bool report_sink_busy(struct report_sink *sink);
+
+/* Reports on sink right now */
+uint8_t report_sink_queued(struct report_sink *sink);
+
+/* Hand a report to sink, -EBUSY if it is full */
+int report_sink_write(struct report_sink *sink, const uint8_t *report,
+		      size_t len);
+
+/*
+ * The same for a pool buffer, sink holds a reference to it until the
+ * report is delivered or forgotten by a reset
+ */
+int report_sink_write_buf(struct report_sink *sink, struct report_buf *buf,
+			  size_t len);
+
+/* The oldest report on sink was delivered */
+void report_sink_done(struct report_sink *sink);
+
+/* Forget the reports on sink, their transfers never complete */
+void report_sink_reset(struct report_sink *sink);
+
+/* Reports dropped by resets since the last call, clears the count */
+uint8_t report_sink_take_lost(struct report_sink *sink);
+
+void report_sink_stats_get(struct report_sink *sink,
+			   struct report_sink_stats *out);
+
+/*
+ * Counters of every link added up, the worst latency of any and no
+ * average
+ */
+void report_sink_totals_get(struct report_sink_stats *out);
+
+#endif /* KEYPAD_REPORT_SINK_H_ */
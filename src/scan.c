@@ -0,0 +1,727 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/gpio.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/logging/log.h>
+
+#if defined(CONFIG_KEYPAD_SCAN_LATCH)
+#include <hal/nrf_gpio.h>
+#endif
+
+#include "debounce.h"
+#include "diag/markers.h"
+#include "diag/scan_stream.h"
+#include "hot_path.h"
+#include "input/analog.h"
+#include "input/debounce_hw.h"
+#include "input/matrix.h"
+#include "input/scan_rate.h"
+#include "input/shiftreg.h"
+#include "nrf_psel.h"
+#include "scan.h"
+
+LOG_MODULE_REGISTER(scan, LOG_LEVEL_INF);
+
+/* nRF5340 application core exposes P0 and P1 */
+#define SCAN_MAX_PORTS 2
+
+#define SCAN_NO_KEY 0xFF
+
+struct scan_port {
+	const struct device *dev;
+	/* Pins of this port that carry keys */
+	gpio_port_pins_t mask;
+	/*
+	 * Raw pin levels of released keys, from the devicetree active
+	 * level: a key held at boot cannot be taken for released
+	 */
+	gpio_port_value_t idle;
+	/* Active pins seen by the previous scan */
+	gpio_port_value_t last;
+	/* Index into keypad_keys[] for every pin in mask */
+	uint8_t key_of_pin[32];
+	/*
+	 * The pins are one run of bits carrying consecutive keys: a pin
+	 * set moves to the key bitmap with a shift, see scan_port_pack()
+	 */
+	bool packed;
+	uint8_t pin_shift;
+	uint8_t key_base;
+#if defined(CONFIG_KEYPAD_SCAN_LATCH)
+	NRF_GPIO_Type *reg;
+	/* Absolute pin number of pin 0 */
+	uint8_t psel_base;
+#endif
+	struct gpio_callback callback;
+};
+
+/* Polls the ports while a key is down, sense only wakes us up */
+static struct k_timer poll_timer;
+/* Lines are armed for SENSE only while the bus is suspended */
+static bool suspended;
+static struct k_spinlock lock;
+
+static struct scan_port ports[SCAN_MAX_PORTS];
+static size_t port_count;
+/* Keys on a port line, those scan_levels_get() reads */
+static keypad_bitmap_t line_keys;
+/* Line level of every key as last read from the ports */
+static keypad_bitmap_t raw;
+/* Debounced state as last handed to the scan handler */
+static keypad_bitmap_t pressed;
+static scan_handler_t scan_handler;
+#if defined(CONFIG_KEYPAD_SCAN_LATCH)
+/* Keys whose line went over and back between two reads */
+static keypad_bitmap_t pulsed;
+static uint32_t pulse_count;
+#endif
+
+/* Keys of a set of the port's pins */
+static KEYPAD_HOT keypad_bitmap_t scan_port_keys(const struct scan_port *port,
+						 gpio_port_pins_t pins)
+{
+	keypad_bitmap_t keys = 0;
+
+	if (port->packed) {
+		return (keypad_bitmap_t)(pins >> port->pin_shift) <<
+		       port->key_base;
+	}
+
+	/* Cost scales with the number of pins set, not with key count */
+	while (pins != 0) {
+		gpio_pin_t pin = find_lsb_set(pins) - 1;
+
+		pins &= ~BIT(pin);
+		keys |= BIT(port->key_of_pin[pin]);
+	}
+
+	return keys;
+}
+
+#if defined(CONFIG_KEYPAD_SCAN_LATCH)
+/* Point SENSE of pins at the level that leaves their last read state */
+static KEYPAD_HOT void scan_latch_point(const struct scan_port *port,
+					gpio_port_pins_t pins)
+{
+	while (pins != 0) {
+		gpio_pin_t pin = find_lsb_set(pins) - 1;
+		bool high = (port->idle ^ port->last) & BIT(pin);
+
+		pins &= ~BIT(pin);
+		nrf_gpio_cfg_sense_set(port->psel_base + pin,
+				       high ? NRF_GPIO_PIN_SENSE_LOW :
+					      NRF_GPIO_PIN_SENSE_HIGH);
+	}
+}
+
+/* After the driver has set up the pins, which clears their SENSE */
+static void scan_latch_arm(struct scan_port *port)
+{
+	scan_latch_point(port, port->mask);
+	port->reg->LATCH = port->mask;
+}
+#endif
+
+/*
+ * Read the whole input register of a port once and fold the pins that
+ * changed since the previous read into the pressed-key bitmap.
+ *
+ * With CONFIG_KEYPAD_SCAN_LATCH the latches are taken ahead of the
+ * level: a pin that changes in between shows as changed, not as a
+ * pulse. They are cleared only once SENSE points away from the new
+ * level, or the pins that just changed would latch again.
+ */
+static KEYPAD_HOT keypad_bitmap_t scan_port_update(struct scan_port *port)
+{
+	keypad_bitmap_t changed_keys;
+	gpio_port_value_t value;
+	gpio_port_value_t active;
+	gpio_port_value_t changed;
+#if defined(CONFIG_KEYPAD_SCAN_LATCH)
+	gpio_port_pins_t latched = 0;
+#endif
+	int ret;
+
+#if defined(CONFIG_KEYPAD_SCAN_LATCH)
+	if (!suspended) {
+		latched = port->reg->LATCH & port->mask;
+	}
+#endif
+
+	ret = gpio_port_get_raw(port->dev, &value);
+	if (ret < 0) {
+		return 0;
+	}
+
+	active = (value ^ port->idle) & port->mask;
+	changed = active ^ port->last;
+	port->last = active;
+
+	changed_keys = scan_port_keys(port, changed);
+	raw = (raw & ~changed_keys) | scan_port_keys(port, active & changed);
+
+#if defined(CONFIG_KEYPAD_SCAN_LATCH)
+	if (!suspended) {
+		scan_latch_point(port, changed);
+		port->reg->LATCH = latched;
+		pulsed |= scan_port_keys(port, latched & ~changed);
+	}
+#endif
+
+	return changed_keys;
+}
+
+/* Pulses first, as the press and the release the reads missed */
+static KEYPAD_HOT void scan_input(keypad_bitmap_t changed)
+{
+#if defined(CONFIG_KEYPAD_SCAN_LATCH)
+	if (pulsed != 0) {
+		pulse_count += __builtin_popcount(pulsed);
+		debounce_input(raw ^ pulsed, pulsed);
+		changed |= pulsed;
+		pulsed = 0;
+	}
+#endif
+
+	if (changed != 0) {
+		debounce_input(raw, changed);
+	}
+}
+
+static int scan_port_sense(struct scan_port *port, bool enable)
+{
+	int ret;
+
+	for (gpio_port_pins_t pins = port->mask; pins != 0; ) {
+		gpio_pin_t pin = find_lsb_set(pins) - 1;
+		gpio_flags_t flags = GPIO_INT_DISABLE;
+
+		pins &= ~BIT(pin);
+
+		if (enable) {
+			/* Level interrupts use PIN_CNF.SENSE, not GPIOTE */
+			flags = (port->idle & BIT(pin)) ? GPIO_INT_LEVEL_LOW :
+							  GPIO_INT_LEVEL_HIGH;
+		}
+
+		ret = gpio_pin_interrupt_configure(port->dev, pin, flags);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static void scan_sense_isr(const struct device *gpio, struct gpio_callback *cb,
+			   uint32_t pins)
+{
+	marker_point(MARKER_KEY_ISR);
+
+	/* Level interrupts would keep firing while the key is held */
+	for (size_t i = 0; i < port_count; i++) {
+		scan_port_sense(&ports[i], false);
+	}
+
+	k_timer_start(&poll_timer, K_NO_WAIT,
+		      K_USEC(CONFIG_KEYPAD_SCAN_PERIOD_US));
+}
+
+static void scan_poll(struct k_timer *timer)
+{
+	keypad_bitmap_t changed = 0;
+	k_spinlock_key_t key;
+
+	for (size_t i = 0; i < port_count; i++) {
+		changed |= scan_port_update(&ports[i]);
+	}
+
+	if (changed != 0) {
+		debounce_input(raw, changed);
+	}
+
+	if (raw != 0 || pressed != 0) {
+		/* Keep polling until the release has been debounced */
+		return;
+	}
+
+	key = k_spin_lock(&lock);
+
+	if (suspended || IS_ENABLED(CONFIG_KEYPAD_SCAN_SENSE)) {
+		k_timer_stop(&poll_timer);
+
+		for (size_t i = 0; i < port_count; i++) {
+			scan_port_sense(&ports[i], true);
+		}
+	}
+
+	k_spin_unlock(&lock, key);
+}
+
+static KEYPAD_HOT void scan_port_isr(const struct device *gpio,
+				     struct gpio_callback *cb, uint32_t pins)
+{
+	struct scan_port *port = CONTAINER_OF(cb, struct scan_port, callback);
+	keypad_bitmap_t changed;
+
+	if (suspended) {
+		/* Woken through SENSE, poll like the sense backend */
+		scan_sense_isr(gpio, cb, pins);
+		return;
+	}
+
+	marker_point(MARKER_KEY_ISR);
+
+	/* Nothing changed if the bounce settled back to the previous state */
+	changed = scan_port_update(port);
+	scan_input(changed);
+}
+
+static KEYPAD_HOT void scan_emit(keypad_bitmap_t state,
+				 keypad_bitmap_t changed)
+{
+	pressed = state;
+	scan_handler(state, changed);
+}
+
+/* Backends that read every key at once hand over the whole bitmap */
+static KEYPAD_HOT void scan_bulk_done(keypad_bitmap_t state)
+{
+	keypad_bitmap_t changed = state ^ raw;
+
+	scan_stream_bitmap(state);
+
+#if defined(CONFIG_KEYPAD_DEBOUNCE_VERTICAL)
+	/* A release is only seen after some more scans, keep the full rate */
+	scan_rate_update(state | pressed);
+
+	raw = state;
+	changed = debounce_sample(state);
+	if (changed != 0) {
+		scan_emit(debounce_state_get(), changed);
+	}
+#else
+	scan_rate_update(state);
+
+	if (changed == 0) {
+		return;
+	}
+
+	raw = state;
+	debounce_input(raw, changed);
+#endif
+}
+
+static void scan_analog_done(keypad_bitmap_t state)
+{
+	keypad_bitmap_t changed = state ^ raw;
+
+	if (changed == 0) {
+		return;
+	}
+
+	/* Travel thresholds have hysteresis, debouncing would only add delay */
+	raw = state;
+	scan_emit(raw, changed);
+}
+
+KEYPAD_HOT void scan_refresh(void)
+{
+	keypad_bitmap_t changed = 0;
+
+	for (size_t i = 0; i < port_count; i++) {
+		changed |= scan_port_update(&ports[i]);
+	}
+
+	if (changed != 0) {
+		/* Called once the lines have settled, no further filtering */
+		scan_emit(raw, changed);
+	}
+}
+
+/*
+ * Also the first read of every port, once their interrupts are armed.
+ * Keys held at boot have no edge to report them, and an edge while
+ * arming may have come before its interrupt; either way the line
+ * differs from the released level here and goes through the debounce
+ * like any edge. With interrupts locked no edge interrupt reads a port
+ * in between.
+ */
+void scan_resync(void)
+{
+	keypad_bitmap_t changed = 0;
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	for (size_t i = 0; i < port_count; i++) {
+		changed |= scan_port_update(&ports[i]);
+	}
+
+	if (IS_ENABLED(CONFIG_KEYPAD_DEBOUNCE_HW)) {
+		if (changed != 0) {
+			/* Held since before boot, long settled */
+			scan_emit(raw, changed);
+		}
+	} else {
+		scan_input(changed);
+	}
+
+	k_spin_unlock(&lock, key);
+}
+
+static struct scan_port *scan_port_get(const struct device *dev)
+{
+	for (size_t i = 0; i < port_count; i++) {
+		if (ports[i].dev == dev) {
+			return &ports[i];
+		}
+	}
+
+	if (port_count == ARRAY_SIZE(ports)) {
+		return NULL;
+	}
+
+	ports[port_count].dev = dev;
+	memset(ports[port_count].key_of_pin, SCAN_NO_KEY,
+	       sizeof(ports[port_count].key_of_pin));
+
+	return &ports[port_count++];
+}
+
+static int scan_key_configure(const struct keypad_key *key, uint8_t index)
+{
+	const struct device *gpio = key->spec.port;
+	gpio_pin_t pin = key->spec.pin;
+	struct scan_port *port;
+#if defined(CONFIG_KEYPAD_SCAN_LATCH)
+	uint32_t psel;
+#endif
+	int ret;
+
+	if (gpio == NULL) {
+		/* Optional GPIO is missing. */
+		return 0;
+	}
+
+	if (!device_is_ready(gpio)) {
+		LOG_ERR("GPIO port %s is not ready", gpio->name);
+		return -ENODEV;
+	}
+
+	port = scan_port_get(gpio);
+	if (port == NULL) {
+		LOG_ERR("Too many GPIO ports for key %u", index);
+		return -ENOMEM;
+	}
+
+	ret = gpio_pin_configure_dt(&key->spec, GPIO_INPUT);
+	if (ret < 0) {
+		LOG_ERR("Failed to configure port %s pin %u, error: %d",
+			gpio->name, pin, ret);
+		return ret;
+	}
+
+#if defined(CONFIG_KEYPAD_SCAN_LATCH)
+	psel = nrf_psel_get(&key->spec);
+	port->psel_base = psel - pin;
+	port->reg = nrf_gpio_pin_port_decode(&psel);
+#endif
+
+	port->mask |= BIT(pin);
+	port->key_of_pin[pin] = index;
+	line_keys |= BIT(index);
+	WRITE_BIT(port->idle, pin, key->spec.dt_flags & GPIO_ACTIVE_LOW);
+
+	return 0;
+}
+
+/*
+ * Take the shift path if the key lines of the port are contiguous and
+ * in key order, as on the keypad board. Mixed wiring, e.g. the DK
+ * buttons, keeps the per-pin table.
+ */
+static void scan_port_pack(struct scan_port *port)
+{
+	uint8_t shift = find_lsb_set(port->mask) - 1;
+	uint8_t width = find_msb_set(port->mask) - shift;
+	uint8_t base = port->key_of_pin[shift];
+
+	if (port->mask != GENMASK(shift + width - 1, shift) ||
+	    base + width > KEYPAD_MAX_KEYS) {
+		return;
+	}
+
+	for (uint8_t i = 0; i < width; i++) {
+		if (port->key_of_pin[shift + i] != base + i) {
+			return;
+		}
+	}
+
+	port->packed = true;
+	port->pin_shift = shift;
+	port->key_base = base;
+
+	LOG_DBG("Port %s: keys %u to %u from pins %u to %u",
+		port->dev->name, base, base + width - 1, shift,
+		shift + width - 1);
+}
+
+static int scan_port_edge(struct scan_port *port, bool enable)
+{
+	int ret;
+
+	for (gpio_port_pins_t pins = port->mask; pins != 0; ) {
+		gpio_pin_t pin = find_lsb_set(pins) - 1;
+
+		pins &= ~BIT(pin);
+		ret = gpio_pin_interrupt_configure(port->dev, pin,
+						   enable ? GPIO_INT_EDGE_BOTH :
+							    GPIO_INT_DISABLE);
+		if (ret < 0) {
+			LOG_ERR("Failed to configure interrupt for port %s "
+				"pin %u, error: %d",
+				port->dev->name, pin, ret);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static int scan_port_arm(struct scan_port *port)
+{
+	int ret;
+
+	/* Also used by the hardware debounce path for suspend wakeup */
+	gpio_init_callback(&port->callback,
+			   IS_ENABLED(CONFIG_KEYPAD_SCAN_SENSE) ?
+			   scan_sense_isr : scan_port_isr, port->mask);
+	ret = gpio_add_callback(port->dev, &port->callback);
+	if (ret < 0) {
+		LOG_ERR("Failed to add the callback for port %s, error: %d",
+			port->dev->name, ret);
+		return ret;
+	}
+
+	if (IS_ENABLED(CONFIG_KEYPAD_DEBOUNCE_HW)) {
+		/* Edges are routed to the debounce timer instead */
+		return 0;
+	}
+
+	if (IS_ENABLED(CONFIG_KEYPAD_SCAN_SENSE)) {
+		ret = scan_port_sense(port, true);
+		if (ret < 0) {
+			LOG_ERR("Failed to enable sense for port %s, error: %d",
+				port->dev->name, ret);
+		}
+		return ret;
+	}
+
+	ret = scan_port_edge(port, true);
+#if defined(CONFIG_KEYPAD_SCAN_LATCH)
+	if (ret == 0) {
+		scan_latch_arm(port);
+	}
+#endif
+
+	return ret;
+}
+
+int scan_init(scan_handler_t handler)
+{
+	int ret;
+
+	scan_handler = handler;
+
+	if (IS_ENABLED(CONFIG_KEYPAD_DEBOUNCE_HW)) {
+		ret = debounce_hw_init(scan_refresh);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+
+	/* Also filters the polled lines while suspended */
+	debounce_init(scan_emit);
+
+	if (IS_ENABLED(CONFIG_KEYPAD_SCAN_MATRIX) ||
+	    IS_ENABLED(CONFIG_KEYPAD_SCAN_SHIFTREG)) {
+		/* Keys carry no GPIO of their own, nothing else to set up */
+		ret = IS_ENABLED(CONFIG_KEYPAD_SCAN_MATRIX) ?
+		      matrix_init(scan_bulk_done) :
+		      shiftreg_init(scan_bulk_done);
+		if (ret == 0) {
+			scan_rate_init();
+		}
+		return ret;
+	}
+
+	if (IS_ENABLED(CONFIG_KEYPAD_SCAN_ANALOG)) {
+		return analog_init(scan_analog_done);
+	}
+
+	k_timer_init(&poll_timer, scan_poll, NULL);
+
+	for (size_t i = 0; i < keypad_key_count; i++) {
+		ret = scan_key_configure(&keypad_keys[i], i);
+		if (ret < 0) {
+			return ret;
+		}
+
+		if (IS_ENABLED(CONFIG_KEYPAD_DEBOUNCE_HW) &&
+		    keypad_keys[i].spec.port != NULL) {
+			ret = debounce_hw_attach(&keypad_keys[i].spec);
+			if (ret < 0) {
+				return ret;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < port_count; i++) {
+		scan_port_pack(&ports[i]);
+
+		ret = scan_port_arm(&ports[i]);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+
+	scan_resync();
+
+	return 0;
+}
+
+void scan_suspend(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	suspended = true;
+
+	if (!IS_ENABLED(CONFIG_KEYPAD_SCAN_SENSE) &&
+	    !IS_ENABLED(CONFIG_KEYPAD_SCAN_MATRIX) &&
+	    !IS_ENABLED(CONFIG_KEYPAD_SCAN_SHIFTREG) &&
+	    !IS_ENABLED(CONFIG_KEYPAD_SCAN_ANALOG)) {
+		if (IS_ENABLED(CONFIG_KEYPAD_DEBOUNCE_HW)) {
+			debounce_hw_enable(false);
+		}
+
+		for (size_t i = 0; i < port_count; i++) {
+			scan_port_edge(&ports[i], false);
+		}
+
+		/* Poll out any held key, SENSE is armed once all are up */
+		k_timer_start(&poll_timer, K_NO_WAIT,
+			      K_USEC(CONFIG_KEYPAD_SCAN_PERIOD_US));
+	}
+
+	k_spin_unlock(&lock, key);
+}
+
+void scan_resume(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	suspended = false;
+
+	if (!IS_ENABLED(CONFIG_KEYPAD_SCAN_SENSE) &&
+	    !IS_ENABLED(CONFIG_KEYPAD_SCAN_MATRIX) &&
+	    !IS_ENABLED(CONFIG_KEYPAD_SCAN_SHIFTREG) &&
+	    !IS_ENABLED(CONFIG_KEYPAD_SCAN_ANALOG)) {
+		k_timer_stop(&poll_timer);
+
+		for (size_t i = 0; i < port_count; i++) {
+			scan_port_sense(&ports[i], false);
+
+			if (!IS_ENABLED(CONFIG_KEYPAD_DEBOUNCE_HW)) {
+				scan_port_edge(&ports[i], true);
+			}
+#if defined(CONFIG_KEYPAD_SCAN_LATCH)
+			scan_latch_arm(&ports[i]);
+#endif
+		}
+
+		if (IS_ENABLED(CONFIG_KEYPAD_DEBOUNCE_HW)) {
+			debounce_hw_enable(true);
+		}
+	}
+
+	k_spin_unlock(&lock, key);
+}
+
+void scan_off_arm(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	suspended = true;
+
+	if (IS_ENABLED(CONFIG_KEYPAD_SCAN_MATRIX)) {
+		matrix_off_enter();
+	} else if (port_count > 0) {
+		k_timer_stop(&poll_timer);
+
+		if (IS_ENABLED(CONFIG_KEYPAD_DEBOUNCE_HW)) {
+			debounce_hw_enable(false);
+		}
+
+		for (size_t i = 0; i < port_count; i++) {
+			(void)scan_port_edge(&ports[i], false);
+			(void)scan_port_sense(&ports[i], true);
+		}
+	}
+
+	k_spin_unlock(&lock, key);
+}
+
+keypad_bitmap_t scan_keys_of_pins(const struct device *dev,
+				  gpio_port_pins_t pins)
+{
+	for (size_t i = 0; i < port_count; i++) {
+		if (ports[i].dev == dev) {
+			return scan_port_keys(&ports[i],
+					      pins & ports[i].mask);
+		}
+	}
+
+	return 0;
+}
+
+uint32_t scan_pulse_count(void)
+{
+#if defined(CONFIG_KEYPAD_SCAN_LATCH)
+	return pulse_count;
+#else
+	return 0;
+#endif
+}
+
+keypad_bitmap_t scan_pressed_get(void)
+{
+	return pressed;
+}
+
+keypad_bitmap_t scan_levels_get(keypad_bitmap_t *known)
+{
+	keypad_bitmap_t levels = 0;
+
+	/* Read only, the edge path keeps its own snapshot of the ports */
+	for (size_t i = 0; i < port_count; i++) {
+		struct scan_port *port = &ports[i];
+		gpio_port_value_t value;
+		gpio_port_value_t active;
+
+		if (gpio_port_get_raw(port->dev, &value) < 0) {
+			continue;
+		}
+
+		active = (value ^ port->idle) & port->mask;
+		levels |= scan_port_keys(port, active);
+	}
+
+	*known = line_keys;
+
+	return levels;
+}
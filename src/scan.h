@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Table-driven key scan engine. Keys from the keymap are grouped per
+ * GPIO port; each port interrupt reads the whole input register once and
+ * diffs it against the previous snapshot. With CONFIG_KEYPAD_SCAN_SENSE
+ * the port interrupt only wakes a poll timer that does the same while
+ * any key is down.
+ */
+
+#ifndef KEYPAD_SCAN_H_
+#define KEYPAD_SCAN_H_
+
+#include <zephyr/drivers/gpio.h>
+
+#include "keymap.h"
+
+/*
+ * Called from interrupt context whenever the debounced pressed-key set
+ * changes. Bit n of both bitmaps refers to keypad_keys[n].
+ */
+typedef void (*scan_handler_t)(keypad_bitmap_t pressed,
+			       keypad_bitmap_t changed);
+
+int scan_init(scan_handler_t handler);
+
+keypad_bitmap_t scan_pressed_get(void);
+
+/*
+ * Re-read every key port and report any change to the scan handler
+ * without software debounce. Used once the lines are known to have
+ * settled. Safe to call from interrupt context.
+ */
+void scan_refresh(void);
+
+/*
+ * Read every key port again and put whatever differs from the last
+ * read through the debounce, as if its edge had just come in. Repairs
+ * a key whose edge interrupt was lost. Safe to call from interrupt
+ * context.
+ */
+void scan_resync(void);
+
+/*
+ * Line level of every key that has a line of its own, read from the
+ * ports right now without debounce or any change to the scan state.
+ * Those keys are set in *known; keys of the bulk backends, which are
+ * read whole at every scan, and of a split satellite are not.
+ */
+keypad_bitmap_t scan_levels_get(keypad_bitmap_t *known);
+
+/*
+ * USB suspend: stop edge interrupts and the hardware debounce, poll any
+ * held key until release and then wait on PORT/SENSE only. Key changes
+ * while suspended still reach the scan handler. scan_resume() restores
+ * the configured backend.
+ */
+void scan_suspend(void);
+void scan_resume(void);
+
+/*
+ * System OFF: arm SENSE on every key line, or on the matrix rows with
+ * all columns driven, for the press that resets the chip. Nothing is
+ * scanned after this.
+ */
+void scan_off_arm(void);
+
+/* Keys on the given pins of a GPIO port, 0 for pins without a key */
+keypad_bitmap_t scan_keys_of_pins(const struct device *dev,
+				  gpio_port_pins_t pins);
+
+/*
+ * Key presses recovered from the GPIO latches, CONFIG_KEYPAD_SCAN_LATCH,
+ * that no port read saw. Always 0 without.
+ */
+uint32_t scan_pulse_count(void);
+
+#endif /* KEYPAD_SCAN_H_ */
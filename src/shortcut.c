@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Hash and displace: the generator put every bucket's triggers into
+ * free slots by trying seeds until one hashed them all apart, so the
+ * slot a trigger lands in is the only one it can be in. A miss is the
+ * same two hashes and a compare against whatever holds that slot.
+ *
+ * shortcut_hash() must stay the same as the one in
+ * scripts/gen_shortcut_hash.py.
+ */
+
+#include <zephyr/zephyr.h>
+
+#include "hot_path.h"
+#include "shortcut.h"
+
+/* 32-bit finalizer, every input bit moves every output bit */
+static inline uint32_t shortcut_hash(uint32_t x, uint32_t seed)
+{
+	x ^= seed * 0x9e3779b9U;
+	x ^= x >> 16;
+	x *= 0x7feb352dU;
+	x ^= x >> 15;
+	x *= 0x846ca68bU;
+	x ^= x >> 16;
+
+	return x;
+}
+
+KEYPAD_HOT bool shortcut_lookup(uint8_t layer, uint8_t key,
+				uint8_t modifiers, uint16_t *action)
+{
+	uint32_t trigger = SHORTCUT_TRIGGER(layer, key, modifiers);
+	uint16_t seed = shortcut_seeds[shortcut_hash(trigger, 0) %
+				       shortcut_bucket_count];
+	const struct shortcut_entry *entry =
+		&shortcut_entries[shortcut_hash(trigger, seed) %
+				  shortcut_slot_count];
+
+	if (entry->trigger != trigger) {
+		return false;
+	}
+
+	*action = entry->action;
+
+	return true;
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Shortcut table: the children of the richeffects,keypad-shortcuts node
+ * give a key pressed on a layer with an exact set of modifiers held an
+ * action of its own. scripts/gen_shortcut_hash.py turns them into a
+ * minimal perfect hash in flash, so a press costs two hashes and one
+ * compare however many shortcuts a profile has.
+ */
+
+#ifndef KEYPAD_SHORTCUT_H_
+#define KEYPAD_SHORTCUT_H_
+
+#include <zephyr/zephyr.h>
+
+/* Trigger of a key on a layer, modifiers as in the report byte */
+#define SHORTCUT_TRIGGER(layer, key, modifiers) \
+	(((uint32_t)(layer) << 16) | ((uint32_t)(modifiers) << 8) | (key))
+
+/* shortcut_entry::trigger of the filler slot of an empty table */
+#define SHORTCUT_TRIGGER_NONE UINT32_MAX
+
+struct shortcut_entry {
+	uint32_t trigger;
+	/* Action, a HID usage or one from dt-bindings/keypad/layers.h */
+	uint16_t action;
+};
+
+/*
+ * Generated tables. A trigger hashes with seed 0 to one of the
+ * shortcut_bucket_count buckets, whose seed then hashes it to its slot
+ * of shortcut_entries[]. Never empty: without shortcuts there is one
+ * slot holding SHORTCUT_TRIGGER_NONE.
+ */
+extern const struct shortcut_entry shortcut_entries[];
+extern const uint16_t shortcut_seeds[];
+extern const uint16_t shortcut_slot_count;
+extern const uint16_t shortcut_bucket_count;
+/* Shortcuts in the table, 0 when the only slot is the filler */
+extern const uint16_t shortcut_count;
+
+/*
+ * Find the action of key on layer while modifiers are held. Returns
+ * true and sets action on a match.
+ */
+bool shortcut_lookup(uint8_t layer, uint8_t key, uint8_t modifiers,
+		     uint16_t *action);
+
+#endif /* KEYPAD_SHORTCUT_H_ */
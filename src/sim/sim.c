@@ -0,0 +1,329 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Host simulation of the keypad, for native_posix. The keys of the
+ * keymap sit on the emulated GPIO controller; a stimulus thread drives
+ * them with random presses, releases and contact bounce, and the
+ * reports go to the captured sink of sim/sim_sink.h. Everything from
+ * the GPIO callback to the report builder is the firmware's own code.
+ * Time is simulated and not slowed to real time, so a run takes as long
+ * as its events cost on the host.
+ *
+ * Every transition is at least two debounce windows after the previous
+ * one of the same key, and bounce ends within the window, so every
+ * driven press must show up as one press on the wire and every release
+ * as one release. At the end everything is released and the last
+ * report must be empty. The result is printed as PASS or FAIL, which
+ * is also the exit status:
+ *
+ *   build/zephyr/zephyr.exe -keystrokes=1000000 -sim-seed=7
+ *
+ * With CONFIG_KEYPAD_SIM_TRACE the thread runs the scripted traces of
+ * sim_trace.c instead, which check every report and its timing. With
+ * CONFIG_KEYPAD_REPLAY it replays the built-in key trace, see
+ * diag/replay.h, at -replay-speed.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/gpio.h>
+#include <zephyr/drivers/gpio/gpio_emul.h>
+
+#include "cmdline.h"
+#include "posix_board_if.h"
+#include "soc.h"
+
+#include "diag/replay.h"
+#include "event_ring.h"
+#include "keymap.h"
+#include "keys.h"
+#include "layer.h"
+#include "report.h"
+#include "report_sched.h"
+#include "scan.h"
+#include "sim/sim.h"
+#include "sim/sim_sink.h"
+
+/* Chance of bounce on an edge, 1 in this many */
+#define SIM_BOUNCE_ODDS 4
+#define SIM_BOUNCE_MAX 3
+/* Drain time at the end, in debounce windows */
+#define SIM_DRAIN_WINDOWS 8
+
+#if defined(CONFIG_KEYPAD_REPORT_NKRO)
+#define SIM_HELD_MAX KEYPAD_MAX_KEYS
+#else
+#define SIM_HELD_MAX KEYPAD_BTN_CODE_REPORT_SLOTS
+#endif
+
+static uint32_t keystrokes = CONFIG_KEYPAD_SIM_KEYSTROKES;
+static uint32_t seed = CONFIG_KEYPAD_SIM_SEED;
+static uint32_t replay_speed =
+	COND_CODE_1(CONFIG_KEYPAD_REPLAY, (CONFIG_KEYPAD_REPLAY_SPEED), (1));
+
+static keypad_bitmap_t held;
+static uint32_t presses[KEYPAD_MAX_KEYS];
+static int64_t last_edge[KEYPAD_MAX_KEYS];
+
+static void sim_options(void)
+{
+	static struct args_struct_t options[] = {
+		{
+			.option = "keystrokes",
+			.name = "count",
+			.type = 'u',
+			.dest = (void *)&keystrokes,
+			.descript = "Key presses to simulate",
+		},
+		{
+			.option = "sim-seed",
+			.name = "seed",
+			.type = 'u',
+			.dest = (void *)&seed,
+			.descript = "Seed of the simulated key presses",
+		},
+#if defined(CONFIG_KEYPAD_REPLAY)
+		{
+			.option = "replay-speed",
+			.name = "speed",
+			.type = 'u',
+			.dest = (void *)&replay_speed,
+			.descript = "Speed of the trace replay, 0 for no gaps",
+		},
+#endif
+		ARG_TABLE_ENDMARKER
+	};
+
+	native_add_command_line_opts(options);
+}
+
+NATIVE_TASK(sim_options, PRE_BOOT_1, 10);
+
+/* xorshift32, reproducible for a seed on every host */
+static uint32_t sim_random(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+
+	return seed;
+}
+
+/* The wider of the press and release windows */
+static uint32_t window_us(uint8_t k)
+{
+	uint32_t us = keypad_keys[k].debounce_us != 0 ?
+		      keypad_keys[k].debounce_us : CONFIG_KEYPAD_DEBOUNCE_US;
+
+	return MAX(us, keypad_keys[k].release_debounce_us);
+}
+
+void sim_line_set(uint8_t k, bool active)
+{
+	const struct gpio_dt_spec *spec = &keypad_keys[k].spec;
+	unsigned int key;
+
+	/* The edge arrives like an interrupt, between two instructions */
+	key = irq_lock();
+	gpio_emul_input_set(spec->port, spec->pin, active);
+	irq_unlock(key);
+}
+
+static void key_drive(uint8_t k, bool pressed)
+{
+	int64_t ready = last_edge[k] + 2 * window_us(k);
+	int64_t now = k_ticks_to_us_floor64(k_uptime_ticks());
+
+	if (now < ready) {
+		k_sleep(K_USEC(ready - now));
+	}
+
+	if (sim_random() % SIM_BOUNCE_ODDS == 0) {
+		uint32_t bounces = 1 + sim_random() % SIM_BOUNCE_MAX;
+		/* All of it within the window */
+		uint32_t gap = MAX(window_us(k) / (4 * SIM_BOUNCE_MAX), 1);
+
+		while (bounces-- > 0) {
+			sim_line_set(k, pressed);
+			k_sleep(K_USEC(1 + sim_random() % gap));
+			sim_line_set(k, !pressed);
+			k_sleep(K_USEC(1 + sim_random() % gap));
+		}
+	}
+
+	sim_line_set(k, pressed);
+	last_edge[k] = k_ticks_to_us_floor64(k_uptime_ticks());
+	WRITE_BIT(held, k, pressed);
+	if (pressed) {
+		presses[k]++;
+	}
+}
+
+static uint8_t held_pick(uint32_t r)
+{
+	uint8_t n = r % __builtin_popcount(held);
+	keypad_bitmap_t rest = held;
+
+	while (n-- > 0) {
+		rest &= rest - 1;
+	}
+
+	return find_lsb_set(rest) - 1;
+}
+
+static bool sim_check(void)
+{
+	struct sim_sink_stats s;
+	bool pass = true;
+
+	sim_sink_stats_get(&s);
+
+	for (uint8_t k = 0; k < keypad_key_count; k++) {
+		if (s.presses[k] != presses[k] || s.releases[k] != presses[k]) {
+			printk("sim: key %u driven %u presses, seen %u presses "
+			       "and %u releases\n", k, presses[k], s.presses[k],
+			       s.releases[k]);
+			pass = false;
+		}
+	}
+
+	if (s.held != 0) {
+		printk("sim: keys 0x%08x still held on the wire\n", s.held);
+		pass = false;
+	}
+
+	if (event_ring_overflow_count() != 0) {
+		printk("sim: %u events summarized for a full ring\n",
+		       event_ring_overflow_count());
+		pass = false;
+	}
+
+	printk("sim: %u keystrokes, %u reports, %u ms simulated\n",
+	       keystrokes, s.reports, k_uptime_get_32());
+
+	return pass;
+}
+
+static bool sim_random_run(void)
+{
+	uint32_t window = 0;
+
+	if (seed == 0) {
+		/* xorshift would stay at 0 */
+		seed = 1;
+	}
+
+	for (uint8_t k = 0; k < keypad_key_count; k++) {
+		window = MAX(window, window_us(k));
+	}
+
+	printk("sim: %u keys, %u keystrokes, seed %u\n", keypad_key_count,
+	       keystrokes, seed);
+
+	for (uint32_t done = 0; done < keystrokes; ) {
+		uint8_t k = sim_random() % keypad_key_count;
+
+		if (held & BIT(k)) {
+			key_drive(k, false);
+		} else if (__builtin_popcount(held) >= SIM_HELD_MAX) {
+			key_drive(held_pick(sim_random()), false);
+		} else {
+			key_drive(k, true);
+			done++;
+		}
+
+		/* Up to a window apart, chords overlap their bounce */
+		k_sleep(K_USEC(sim_random() % (window + 1)));
+	}
+
+	while (held != 0) {
+		key_drive(find_lsb_set(held) - 1, false);
+	}
+
+	k_sleep(K_USEC(SIM_DRAIN_WINDOWS * window +
+		       SIM_DRAIN_WINDOWS * CONFIG_KEYPAD_POLL_INTERVAL_US));
+
+	return sim_check();
+}
+
+static bool sim_replay_run(void)
+{
+	struct replay_result r;
+	struct sim_sink_stats s;
+	int ret;
+
+	ret = replay_run(replay_speed, &r);
+	if (ret < 0) {
+		printk("sim: replay failed, error: %d\n", ret);
+		return false;
+	}
+
+	sim_sink_stats_get(&s);
+
+	printk("sim: replay at speed %u, %u events, %u skipped, %u reports "
+	       "in %u ms\n", replay_speed, r.events, r.skipped, r.reports,
+	       r.ms);
+	printk("sim: event->done p50 %u p90 %u p99 %u max %u us\n",
+	       r.p50_us, r.p90_us, r.p99_us, r.max_us);
+
+	if (s.held != 0 || event_ring_overflow_count() != 0) {
+		printk("sim: keys 0x%08x held, %u summarized for a full ring\n",
+		       s.held, event_ring_overflow_count());
+		return false;
+	}
+
+	return true;
+}
+
+static void sim_run(void *p1, void *p2, void *p3)
+{
+	bool pass;
+
+	if (IS_ENABLED(CONFIG_KEYPAD_SIM_TRACE)) {
+		pass = sim_trace_run();
+	} else if (IS_ENABLED(CONFIG_KEYPAD_REPLAY)) {
+		pass = sim_replay_run();
+	} else {
+		pass = sim_random_run();
+	}
+
+	if (pass) {
+		printk("sim: PASS\n");
+		posix_exit(0);
+	}
+
+	printk("sim: FAIL\n");
+	posix_exit(1);
+}
+
+K_THREAD_DEFINE(sim_thread, CONFIG_KEYPAD_SIM_STACK_SIZE, sim_run, NULL, NULL,
+		NULL, K_LOWEST_APPLICATION_THREAD_PRIO, 0, SYS_FOREVER_MS);
+
+void main(void)
+{
+	int ret;
+
+	ret = layer_init();
+	if (ret < 0) {
+		printk("sim: keymap layers failed, error: %d\n", ret);
+		posix_exit(1);
+	}
+
+	sim_sink_init();
+
+	ret = scan_init(keys_changed);
+	if (ret < 0) {
+		printk("sim: key scan failed, error: %d\n", ret);
+		posix_exit(1);
+	}
+
+	/* Take the link now, so its first report is not a trace's */
+	report_sched_notify();
+	k_thread_start(sim_thread);
+
+	while (true) {
+		report_sched_process();
+	}
+}
@@ -0,0 +1,31 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Between the stimulus of the host simulation in sim.c and the scripted
+ * traces of sim_trace.c.
+ */
+
+#ifndef KEYPAD_SIM_SIM_H_
+#define KEYPAD_SIM_SIM_H_
+
+#include <zephyr/zephyr.h>
+
+/* Drive the emulated line of a key, arriving like an interrupt */
+void sim_line_set(uint8_t key, bool active);
+
+#if defined(CONFIG_KEYPAD_SIM_TRACE)
+/*
+ * Run every trace of sim_trace.c on the keymap of sim_trace.overlay.
+ * Prints each failed expectation, returns true if there were none.
+ */
+bool sim_trace_run(void);
+#else
+static inline bool sim_trace_run(void)
+{
+	return false;
+}
+#endif
+
+#endif /* KEYPAD_SIM_SIM_H_ */
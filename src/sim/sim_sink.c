@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/spinlock.h>
+
+#include "report.h"
+#include "report_sched.h"
+#include "report_sink.h"
+#include "sim/sim_sink.h"
+
+static struct k_spinlock lock;
+static struct sim_sink_stats stats;
+static struct k_timer poll_timer;
+static struct sim_report log[SIM_SINK_LOG_SIZE];
+static size_t log_count;
+
+static bool report_has(const uint8_t *report, size_t len, uint8_t usage)
+{
+#if defined(CONFIG_KEYPAD_REPORT_NKRO)
+	if (len == REPORT_NKRO_SIZE) {
+		uint32_t bit = usage - REPORT_NKRO_FIRST;
+
+		return usage >= REPORT_NKRO_FIRST && bit < REPORT_NKRO_BITS &&
+		       (report[1 + bit / 8] & BIT(bit % 8)) != 0;
+	}
+#endif
+
+	for (size_t i = 0; i < KEYPAD_BTN_CODE_REPORT_SLOTS; i++) {
+		if (report[KEYPAD_BTN_CODE_REPORT_POS + i] == usage) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void report_log(const uint8_t *report, size_t len)
+{
+	struct sim_report *r;
+	size_t n = 0;
+
+	if (log_count++ >= ARRAY_SIZE(log)) {
+		return;
+	}
+
+	r = &log[log_count - 1];
+	memset(r, 0, sizeof(*r));
+	r->at_us = k_ticks_to_us_floor64(k_uptime_ticks());
+	r->modifiers = report[KEYPAD_BTN_MODIFIER_REPORT_POS];
+
+#if defined(CONFIG_KEYPAD_REPORT_NKRO)
+	if (len == REPORT_NKRO_SIZE) {
+		for (uint32_t b = 0;
+		     b < REPORT_NKRO_BITS && n < ARRAY_SIZE(r->usages); b++) {
+			if (report[1 + b / 8] & BIT(b % 8)) {
+				r->usages[n++] = REPORT_NKRO_FIRST + b;
+			}
+		}
+
+		return;
+	}
+#endif
+
+	for (size_t i = 0; i < KEYPAD_BTN_CODE_REPORT_SLOTS; i++) {
+		uint8_t usage = report[KEYPAD_BTN_CODE_REPORT_POS + i];
+		size_t j;
+
+		if (usage == 0) {
+			continue;
+		}
+
+		/* Insertion sort, the slots are in press order */
+		for (j = n++; j > 0 && r->usages[j - 1] > usage; j--) {
+			r->usages[j] = r->usages[j - 1];
+		}
+
+		r->usages[j] = usage;
+	}
+}
+
+static int sim_sink_write(struct report_sink *s, const uint8_t *report,
+			  size_t len)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	keypad_bitmap_t held = 0;
+	keypad_bitmap_t changed;
+
+	for (uint8_t k = 0; k < keypad_key_count; k++) {
+		if (report_has(report, len, keypad_keys[k].keycode)) {
+			held |= BIT(k);
+		}
+	}
+
+	changed = held ^ stats.held;
+	while (changed != 0) {
+		uint8_t k = find_lsb_set(changed) - 1;
+
+		changed &= ~BIT(k);
+		if (held & BIT(k)) {
+			stats.presses[k]++;
+		} else {
+			stats.releases[k]++;
+		}
+	}
+
+	stats.held = held;
+	stats.reports++;
+	report_log(report, len);
+	k_spin_unlock(&lock, key);
+
+	/* The host picks it up at its next poll */
+	k_timer_start(&poll_timer, K_USEC(CONFIG_KEYPAD_POLL_INTERVAL_US),
+		      K_NO_WAIT);
+
+	return 0;
+}
+
+static bool sim_sink_active(struct report_sink *s)
+{
+	return true;
+}
+
+static struct report_sink sink = {
+	.name = "sim",
+	.priority = 0,
+	.depth = 1,
+	.write = sim_sink_write,
+	.active = sim_sink_active,
+};
+
+static void sim_sink_polled(struct k_timer *timer)
+{
+	report_sched_sink_done(&sink);
+}
+
+void sim_sink_init(void)
+{
+	k_timer_init(&poll_timer, sim_sink_polled, NULL);
+	report_sink_register(&sink);
+}
+
+void sim_sink_stats_get(struct sim_sink_stats *out)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	*out = stats;
+	k_spin_unlock(&lock, key);
+}
+
+size_t sim_sink_log_take(struct sim_report *out, size_t max)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	size_t count = log_count;
+
+	memcpy(out, log, MIN(count, MIN(max, ARRAY_SIZE(log))) * sizeof(*out));
+	log_count = 0;
+	k_spin_unlock(&lock, key);
+
+	return count;
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Captured report sink of the host simulation. Takes one report at a
+ * time like the USB endpoint, completes it one poll interval later and
+ * decodes it: every key whose usage appears in a report counts a press
+ * seen on the wire, and every one that disappears a release. The
+ * simulation compares these with the transitions it drove.
+ *
+ * Keys must have distinct, non-modifier base layer usages, and with the
+ * 6-key report no more than six may be held at once.
+ *
+ * The scripted traces also see the reports themselves: the sink logs
+ * the time and content of every one until the trace takes them.
+ */
+
+#ifndef KEYPAD_SIM_SIM_SINK_H_
+#define KEYPAD_SIM_SIM_SINK_H_
+
+#include <zephyr/zephyr.h>
+
+#include "keymap.h"
+#include "report.h"
+
+struct sim_sink_stats {
+	uint32_t reports;
+	/* Per key, see above */
+	uint32_t presses[KEYPAD_MAX_KEYS];
+	uint32_t releases[KEYPAD_MAX_KEYS];
+	/* Keys held in the last report */
+	keypad_bitmap_t held;
+};
+
+/* Reports logged between two sim_sink_log_take() */
+#define SIM_SINK_LOG_SIZE 32
+
+struct sim_report {
+	/* Written to the sink, microseconds of uptime */
+	int64_t at_us;
+	uint8_t modifiers;
+	/* Usages in the report, ascending, zero after the last */
+	uint8_t usages[KEYPAD_BTN_CODE_REPORT_SLOTS];
+};
+
+/* Register the sink, before the first key event */
+void sim_sink_init(void);
+
+void sim_sink_stats_get(struct sim_sink_stats *out);
+
+/*
+ * Copy up to max of the reports logged since the last call into out,
+ * oldest first, and start a new log. Returns the number logged, which
+ * is more than max if some did not fit.
+ */
+size_t sim_sink_log_take(struct sim_report *out, size_t max);
+
+#endif /* KEYPAD_SIM_SIM_SINK_H_ */
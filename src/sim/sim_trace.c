@@ -0,0 +1,317 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Scripted traces of the host simulation, on the keymap of
+ * sim_trace.overlay. A trace sets key lines at fixed times from its
+ * start and lists every report it must produce, in order, each with
+ * the step that causes it and the latency from that step. Any other,
+ * missing or reordered report fails it, and so does one that arrives
+ * before its latency or more than TRACE_SLACK_US after it. The slack
+ * is half a poll interval, so a change that delays a report by one
+ * more poll fails the trace.
+ *
+ * Simulated time advances only with the events themselves, so a trace
+ * gives the same times on every run and host. Traces start on a whole
+ * millisecond, the resolution of the tap-hold and combo deadlines.
+ */
+
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+
+#include "keymap.h"
+#include "report.h"
+#include "sim/sim.h"
+#include "sim/sim_sink.h"
+
+/* Keys of sim_trace.overlay */
+enum {
+	KEY_SETTLE,
+	KEY_EAGER,
+	KEY_EAGER_2,
+	KEY_TAP_HOLD,
+	KEY_COMBO_1,
+	KEY_COMBO_2,
+	TRACE_KEYS,
+};
+
+/* Times of the traces, in microseconds */
+#define TRACE_WINDOW CONFIG_KEYPAD_DEBOUNCE_US
+#define TRACE_POLL CONFIG_KEYPAD_POLL_INTERVAL_US
+#define TRACE_TAP_TERM (CONFIG_KEYPAD_TAPPING_TERM_MS * USEC_PER_MSEC)
+#define TRACE_COMBO_TERM (CONFIG_KEYPAD_COMBO_TERM_MS * USEC_PER_MSEC)
+
+#define TRACE_SLACK_US (TRACE_POLL / 2)
+/* After the last step, for every deadline and hold-off to pass */
+#define TRACE_QUIET_US \
+	(TRACE_TAP_TERM + TRACE_COMBO_TERM + 4 * TRACE_WINDOW + 4 * TRACE_POLL)
+#define TRACE_STEPS_MAX 8
+
+BUILD_ASSERT(4 * TRACE_POLL <= TRACE_WINDOW,
+	     "the traces need polls well inside a debounce window");
+BUILD_ASSERT(4 * TRACE_WINDOW <= TRACE_COMBO_TERM &&
+	     TRACE_COMBO_TERM <= TRACE_TAP_TERM,
+	     "the traces need windows well inside the combo term");
+
+/* Modifier of the tap-hold key, Left Shift */
+#define TRACE_MOD_SHIFT BIT(1)
+#define USAGE_A 0x04
+#define USAGE_B 0x05
+#define USAGE_C 0x06
+#define USAGE_D 0x07
+#define USAGE_E 0x08
+#define USAGE_ENTER 0x28
+
+struct trace_step {
+	/* From the start of the trace */
+	uint32_t at_us;
+	uint8_t key;
+	bool pressed;
+};
+
+struct trace_expect {
+	/* Step the latency counts from */
+	uint8_t step;
+	uint32_t latency_us;
+	uint8_t modifiers;
+	/* Ascending, zero after the last */
+	uint8_t usages[KEYPAD_BTN_CODE_REPORT_SLOTS];
+};
+
+struct trace {
+	const char *name;
+	const struct trace_step *steps;
+	size_t steps_len;
+	const struct trace_expect *expect;
+	size_t expect_len;
+};
+
+#define STEP(t, k, p) { .at_us = (t), .key = (k), .pressed = (p) }
+#define EXPECT(s, lat, mods, ...)					\
+	{ .step = (s), .latency_us = (lat), .modifiers = (mods),	\
+	  .usages = { __VA_ARGS__ } }
+#define TRACE(n)							\
+	{ .name = #n, .steps = n##_steps,				\
+	  .steps_len = ARRAY_SIZE(n##_steps), .expect = n##_expect,	\
+	  .expect_len = ARRAY_SIZE(n##_expect) }
+
+/* Bounce on both edges, each reported a window after its last edge */
+static const struct trace_step settle_steps[] = {
+	STEP(0, KEY_SETTLE, true),
+	STEP(TRACE_WINDOW / 16, KEY_SETTLE, false),
+	STEP(TRACE_WINDOW / 8, KEY_SETTLE, true),
+	STEP(4 * TRACE_WINDOW, KEY_SETTLE, false),
+	STEP(4 * TRACE_WINDOW + TRACE_WINDOW / 16, KEY_SETTLE, true),
+	STEP(4 * TRACE_WINDOW + TRACE_WINDOW / 8, KEY_SETTLE, false),
+};
+
+static const struct trace_expect settle_expect[] = {
+	EXPECT(2, TRACE_WINDOW, 0, USAGE_A),
+	EXPECT(5, TRACE_WINDOW, 0),
+};
+
+/*
+ * First edges reported at once, bounce in the hold-off ignored. A
+ * release inside the hold-off goes out when it ends.
+ */
+static const struct trace_step eager_steps[] = {
+	STEP(0, KEY_EAGER, true),
+	STEP(TRACE_WINDOW / 16, KEY_EAGER, false),
+	STEP(TRACE_WINDOW / 8, KEY_EAGER, true),
+	STEP(2 * TRACE_WINDOW, KEY_EAGER, false),
+	STEP(4 * TRACE_WINDOW, KEY_EAGER, true),
+	STEP(4 * TRACE_WINDOW + TRACE_WINDOW / 4, KEY_EAGER, false),
+};
+
+static const struct trace_expect eager_expect[] = {
+	EXPECT(0, 0, 0, USAGE_B),
+	EXPECT(3, 0, 0),
+	EXPECT(4, 0, 0, USAGE_B),
+	EXPECT(5, TRACE_WINDOW - TRACE_WINDOW / 4, 0),
+};
+
+/* Changes while a report is on the wire share the next one */
+static const struct trace_step coalesce_steps[] = {
+	STEP(0, KEY_EAGER, true),
+	STEP(TRACE_POLL / 4, KEY_EAGER_2, true),
+	STEP(2 * TRACE_WINDOW, KEY_EAGER, false),
+	STEP(2 * TRACE_WINDOW + TRACE_POLL / 4, KEY_EAGER_2, false),
+};
+
+static const struct trace_expect coalesce_expect[] = {
+	EXPECT(0, 0, 0, USAGE_B),
+	EXPECT(1, TRACE_POLL - TRACE_POLL / 4, 0, USAGE_B, USAGE_C),
+	EXPECT(2, 0, 0, USAGE_C),
+	EXPECT(3, TRACE_POLL - TRACE_POLL / 4, 0),
+};
+
+/* Released inside the tapping term: the tap, press and release */
+static const struct trace_step tap_steps[] = {
+	STEP(0, KEY_TAP_HOLD, true),
+	STEP(TRACE_TAP_TERM / 4, KEY_TAP_HOLD, false),
+};
+
+static const struct trace_expect tap_expect[] = {
+	EXPECT(1, 0, 0, USAGE_D),
+	EXPECT(1, TRACE_POLL, 0),
+};
+
+/* Held past the tapping term: the modifier, from the deadline on */
+static const struct trace_step hold_steps[] = {
+	STEP(0, KEY_TAP_HOLD, true),
+	STEP(TRACE_TAP_TERM + TRACE_TAP_TERM / 2, KEY_TAP_HOLD, false),
+};
+
+static const struct trace_expect hold_expect[] = {
+	EXPECT(0, TRACE_TAP_TERM, TRACE_MOD_SHIFT),
+	EXPECT(1, 0, 0),
+};
+
+/*
+ * Both keys inside the combo term: the combo, on the second press and
+ * released with the first key. The second release is taken.
+ */
+static const struct trace_step combo_steps[] = {
+	STEP(0, KEY_COMBO_1, true),
+	STEP(TRACE_COMBO_TERM / 4, KEY_COMBO_2, true),
+	STEP(TRACE_COMBO_TERM, KEY_COMBO_1, false),
+	STEP(TRACE_COMBO_TERM + TRACE_WINDOW, KEY_COMBO_2, false),
+};
+
+static const struct trace_expect combo_expect[] = {
+	EXPECT(1, 0, 0, USAGE_ENTER),
+	EXPECT(2, 0, 0),
+};
+
+/* One key of a combo alone: its own usage once the term is over */
+static const struct trace_step combo_alone_steps[] = {
+	STEP(0, KEY_COMBO_1, true),
+	STEP(2 * TRACE_COMBO_TERM, KEY_COMBO_1, false),
+};
+
+static const struct trace_expect combo_alone_expect[] = {
+	EXPECT(0, TRACE_COMBO_TERM, 0, USAGE_E),
+	EXPECT(1, 0, 0),
+};
+
+static const struct trace traces[] = {
+	TRACE(settle),
+	TRACE(eager),
+	TRACE(coalesce),
+	TRACE(tap),
+	TRACE(hold),
+	TRACE(combo),
+	TRACE(combo_alone),
+};
+
+static int64_t now_us(void)
+{
+	return k_ticks_to_us_floor64(k_uptime_ticks());
+}
+
+static void sleep_until(int64_t when)
+{
+	int64_t now = now_us();
+
+	if (when > now) {
+		k_sleep(K_USEC(when - now));
+	}
+}
+
+static void report_print(const char *what, uint8_t modifiers,
+			 const uint8_t *usages)
+{
+	printk("sim:   %s modifiers 0x%02x usages", what, modifiers);
+	for (size_t i = 0; i < KEYPAD_BTN_CODE_REPORT_SLOTS && usages[i]; i++) {
+		printk(" 0x%02x", usages[i]);
+	}
+	printk("\n");
+}
+
+static bool trace_check(const struct trace *t, const int64_t *at,
+			const struct sim_report *got, size_t count)
+{
+	bool pass = true;
+
+	if (count != t->expect_len) {
+		printk("sim: trace %s: %u reports, expected %u\n", t->name,
+		       count, t->expect_len);
+		pass = false;
+	}
+
+	for (size_t i = 0; i < MIN(count, t->expect_len); i++) {
+		const struct trace_expect *e = &t->expect[i];
+		int64_t latency = got[i].at_us - at[e->step];
+
+		if (got[i].modifiers != e->modifiers ||
+		    memcmp(got[i].usages, e->usages, sizeof(e->usages)) != 0) {
+			printk("sim: trace %s: report %u differs\n", t->name,
+			       i);
+			report_print("got", got[i].modifiers, got[i].usages);
+			report_print("expected", e->modifiers, e->usages);
+			pass = false;
+		}
+
+		if (latency < e->latency_us ||
+		    latency > e->latency_us + TRACE_SLACK_US) {
+			printk("sim: trace %s: report %u after %d us from step "
+			       "%u, expected %u to %u us\n", t->name, i,
+			       (int32_t)latency, e->step, e->latency_us,
+			       e->latency_us + TRACE_SLACK_US);
+			pass = false;
+		}
+	}
+
+	return pass;
+}
+
+static bool trace_run(const struct trace *t)
+{
+	struct sim_report got[SIM_SINK_LOG_SIZE];
+	int64_t at[TRACE_STEPS_MAX];
+	int64_t start;
+	size_t count;
+
+	__ASSERT_NO_MSG(t->steps_len <= ARRAY_SIZE(at));
+
+	/* On a whole millisecond, from a quiet keypad */
+	start = ROUND_UP(now_us() + 1, USEC_PER_MSEC);
+	sleep_until(start);
+	(void)sim_sink_log_take(got, 0);
+
+	for (size_t i = 0; i < t->steps_len; i++) {
+		sleep_until(start + t->steps[i].at_us);
+		sim_line_set(t->steps[i].key, t->steps[i].pressed);
+		at[i] = now_us();
+	}
+
+	sleep_until(at[t->steps_len - 1] + TRACE_QUIET_US);
+	count = sim_sink_log_take(got, ARRAY_SIZE(got));
+
+	return trace_check(t, at, got, count);
+}
+
+bool sim_trace_run(void)
+{
+	size_t failed = 0;
+
+	if (keypad_key_count != TRACE_KEYS) {
+		printk("sim: traces need the keymap of sim_trace.overlay\n");
+		return false;
+	}
+
+	/* The link's first report is the empty one, out of the way */
+	sleep_until(now_us() + 2 * TRACE_POLL);
+
+	for (size_t i = 0; i < ARRAY_SIZE(traces); i++) {
+		if (!trace_run(&traces[i])) {
+			failed++;
+		}
+	}
+
+	printk("sim: %u traces, %u failed\n", ARRAY_SIZE(traces), failed);
+
+	return failed == 0;
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/sys/slist.h>
+#include <zephyr/logging/log.h>
+
+#include <zephyr/usb/usb_device.h>
+
+#include "scan.h"
+#include "suspend.h"
+
+LOG_MODULE_REGISTER(suspend, LOG_LEVEL_INF);
+
+static sys_slist_t listeners = SYS_SLIST_STATIC_INIT(&listeners);
+static bool suspended;
+
+/* Uptime of the last remote wakeup request, valid while requested */
+static int64_t wakeup_time;
+static bool wakeup_requested;
+
+void suspend_listener_register(struct suspend_listener *listener)
+{
+	sys_slist_append(&listeners, &listener->node);
+}
+
+void suspend_enter(void)
+{
+	struct suspend_listener *listener;
+
+	if (suspended) {
+		return;
+	}
+
+	suspended = true;
+
+	SYS_SLIST_FOR_EACH_CONTAINER(&listeners, listener, node) {
+		listener->changed(true);
+	}
+
+	/* Last, so the lines are sense-only once everything else is off */
+	scan_suspend();
+}
+
+void suspend_exit(void)
+{
+	struct suspend_listener *listener;
+
+	if (!suspended) {
+		return;
+	}
+
+	/* Host allows 10 ms of resume recovery, nothing here blocks */
+	scan_resume();
+	wakeup_requested = false;
+
+	SYS_SLIST_FOR_EACH_CONTAINER(&listeners, listener, node) {
+		listener->changed(false);
+	}
+
+	suspended = false;
+}
+
+bool suspend_is_active(void)
+{
+	return suspended;
+}
+
+void suspend_wakeup_request(void)
+{
+	int64_t now = k_uptime_get();
+	int ret;
+
+	if (!IS_ENABLED(CONFIG_USB_DEVICE_REMOTE_WAKEUP) || !suspended) {
+		return;
+	}
+
+	/* Bounces and further keys must not signal resume again */
+	if (wakeup_requested &&
+	    now - wakeup_time < CONFIG_KEYPAD_WAKEUP_RETRY_MS) {
+		return;
+	}
+
+	wakeup_time = now;
+	wakeup_requested = true;
+
+	ret = usb_wakeup_request();
+	if (ret < 0) {
+		LOG_WRN("Remote wakeup failed, error: %d", ret);
+	}
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * USB suspend/resume handling. On suspend every registered listener is
+ * told to shed its load (LEDs off, clocks released) and the key scan
+ * drops to PORT/SENSE wake only; resume undoes it in reverse order.
+ * The USB 2.0 suspend budget is 2.5 mA for the whole device.
+ */
+
+#ifndef KEYPAD_SUSPEND_H_
+#define KEYPAD_SUSPEND_H_
+
+#include <zephyr/zephyr.h>
+#include <zephyr/sys/slist.h>
+
+struct suspend_listener {
+	sys_snode_t node;
+	/* Called from the USB status callback, must not block */
+	void (*changed)(bool suspended);
+};
+
+void suspend_listener_register(struct suspend_listener *listener);
+
+/* Bus suspended by the host */
+void suspend_enter(void);
+
+/* Bus resumed, reset or reconfigured */
+void suspend_exit(void);
+
+bool suspend_is_active(void);
+
+/*
+ * Ask the host to resume the bus, at most once per
+ * CONFIG_KEYPAD_WAKEUP_RETRY_MS until it does. ISR safe.
+ */
+void suspend_wakeup_request(void);
+
+#endif /* KEYPAD_SUSPEND_H_ */
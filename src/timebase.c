@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * The fused time is an anchor, a unit count taken at some cycle count,
+ * plus the cycles since, scaled by a multiplier worked out from
+ * SystemCoreClock. Every read checks it against the system clock: it
+ * has to fall within the current tick. If it does not, the core slept
+ * with the counter stopped, the counter wrapped or the core clock was
+ * scaled, and the anchor is moved to the start of the tick.
+ *
+ * The start of a tick is up to a tick before the true time, so after a
+ * wake the fused time may lag the system clock by less than a tick.
+ * Whenever a read then finds a new tick before the fused time has got
+ * there, the anchor moves up again and the lag shrinks; it never grows.
+ * The value handed out never goes back, at worst it stands still for
+ * the rest of a tick.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/init.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/logging/log.h>
+
+#if defined(CONFIG_KEYPAD_TIMEBASE_DWT)
+#include <soc.h>
+#endif
+
+#include "timebase.h"
+
+LOG_MODULE_REGISTER(timebase, LOG_LEVEL_INF);
+
+#define TICK_HZ CONFIG_SYS_CLOCK_TICKS_PER_SEC
+
+/* Fraction bits of the cycle to unit multiplier */
+#define MULT_SHIFT 24
+/* Cycles the anchor may age before it is moved up, well short of a wrap */
+#define ANCHOR_MAX_AGE BIT(30)
+
+BUILD_ASSERT(TICK_HZ <= TIMEBASE_HZ, "a tick must be at least a unit");
+
+static struct k_spinlock lock;
+/* Latest value handed out */
+static uint64_t last;
+
+#if defined(CONFIG_KEYPAD_TIMEBASE_DWT)
+static bool fine;
+static uint64_t anchor;
+static uint32_t anchor_cyc;
+static uint32_t core_hz;
+static uint32_t mult;
+/* Times the anchor went back to the system clock */
+static uint32_t resyncs;
+#endif
+
+static uint64_t ticks_to_units(uint64_t ticks)
+{
+	if (TIMEBASE_HZ % TICK_HZ == 0) {
+		return ticks * (TIMEBASE_HZ / TICK_HZ);
+	}
+
+	return (ticks / TICK_HZ) * TIMEBASE_HZ +
+	       (ticks % TICK_HZ) * TIMEBASE_HZ / TICK_HZ;
+}
+
+#if defined(CONFIG_KEYPAD_TIMEBASE_DWT)
+static uint64_t timebase_fuse(uint64_t ticks)
+{
+	uint64_t start = ticks_to_units(ticks);
+	uint32_t cyc = DWT->CYCCNT;
+	uint32_t age = cyc - anchor_cyc;
+	uint64_t t;
+
+	/* Read every time, the core clock may be scaled at runtime */
+	if (SystemCoreClock != core_hz) {
+		core_hz = SystemCoreClock;
+		mult = (TIMEBASE_HZ << MULT_SHIFT) / core_hz;
+		t = 0;
+	} else {
+		t = anchor + (((uint64_t)age * mult) >> MULT_SHIFT);
+	}
+
+	if (t < start || t >= ticks_to_units(ticks + 1)) {
+		anchor = start;
+		anchor_cyc = cyc;
+		resyncs++;
+		return start;
+	}
+
+	if (age >= ANCHOR_MAX_AGE) {
+		anchor = t;
+		anchor_cyc = cyc;
+	}
+
+	return t;
+}
+#endif /* CONFIG_KEYPAD_TIMEBASE_DWT */
+
+uint64_t timebase_now(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	uint64_t ticks = k_uptime_ticks();
+	uint64_t t;
+
+#if defined(CONFIG_KEYPAD_TIMEBASE_DWT)
+	t = fine ? timebase_fuse(ticks) : ticks_to_units(ticks);
+#else
+	t = ticks_to_units(ticks);
+#endif
+	t = MAX(t, last);
+	last = t;
+
+	k_spin_unlock(&lock, key);
+
+	return t;
+}
+
+bool timebase_fine(void)
+{
+#if defined(CONFIG_KEYPAD_TIMEBASE_DWT)
+	return fine;
+#else
+	return false;
+#endif
+}
+
+#if defined(CONFIG_KEYPAD_TIMEBASE_DWT)
+static int timebase_init(const struct device *dev)
+{
+	uint32_t cyc;
+
+	ARG_UNUSED(dev);
+
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+	/* Reads as zero and stands still if the secure side keeps it */
+	cyc = DWT->CYCCNT;
+	compiler_barrier();
+	fine = DWT->CYCCNT != cyc;
+	if (!fine) {
+		LOG_WRN("No cycle counter, timebase at the system clock");
+	}
+
+	return 0;
+}
+
+/* Ahead of anything that stamps */
+SYS_INIT(timebase_init, PRE_KERNEL_1, 0);
+#endif /* CONFIG_KEYPAD_TIMEBASE_DWT */
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static int cmd_timebase(const struct shell *sh, size_t argc, char **argv)
+{
+	uint64_t now = timebase_now();
+
+	shell_print(sh, "%llu us since boot, %u Hz system clock",
+		    TIMEBASE_TO_US(now), TICK_HZ);
+#if defined(CONFIG_KEYPAD_TIMEBASE_DWT)
+	shell_print(sh, "cycle counter: %s, %u Hz core, %u resyncs",
+		    fine ? "in use" : "none", core_hz, resyncs);
+#endif
+
+	return 0;
+}
+
+SHELL_CMD_REGISTER(timebase, NULL, "Print the timebase", cmd_timebase);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * One clock for the whole keypad. The system clock, RTC1 at 32768 Hz
+ * on the nRF5340, keeps running through every sleep but resolves only
+ * 30.5 us; the DWT cycle counter resolves a core clock cycle but stops
+ * whenever the core does. The timebase counts from boot in units of
+ * 1/TIMEBASE_HZ s, 2^26 Hz or about 15 ns: the RTC gives the epoch and
+ * the cycle counter the time within a tick while the core is awake.
+ * Every stamp taken from it is on the same clock, whichever subsystem
+ * took it, asleep or awake in between.
+ *
+ * TIMEBASE_HZ is a power of two, so converting units to us or ns is a
+ * multiply and a shift with constants known at compile time, and a
+ * 32768 Hz system clock tick is a whole 2048 units.
+ *
+ * Without CONFIG_KEYPAD_TIMEBASE_DWT, or where the secure firmware
+ * keeps the DWT to itself, the timebase is the system clock alone.
+ */
+
+#ifndef KEYPAD_TIMEBASE_H_
+#define KEYPAD_TIMEBASE_H_
+
+#include <zephyr/zephyr.h>
+
+#define TIMEBASE_HZ_LOG2 26
+#define TIMEBASE_HZ BIT64(TIMEBASE_HZ_LOG2)
+
+/* 10^6 and 10^9 over TIMEBASE_HZ, reduced: 5^6 / 2^20, 5^9 / 2^17 */
+#define TIMEBASE_US_MUL 15625U
+#define TIMEBASE_US_SHIFT (TIMEBASE_HZ_LOG2 - 6)
+#define TIMEBASE_NS_MUL 1953125U
+#define TIMEBASE_NS_SHIFT (TIMEBASE_HZ_LOG2 - 9)
+
+/* Units, 64 bits: TIMEBASE_TO_US() of them fits until about 8000 years */
+#define TIMEBASE_TO_US(t) \
+	(((uint64_t)(t) >> TIMEBASE_US_SHIFT) * TIMEBASE_US_MUL + \
+	 ((((uint64_t)(t) & BIT_MASK(TIMEBASE_US_SHIFT)) * TIMEBASE_US_MUL) >> \
+	  TIMEBASE_US_SHIFT))
+#define TIMEBASE_TO_NS(t) \
+	(((uint64_t)(t) >> TIMEBASE_NS_SHIFT) * TIMEBASE_NS_MUL + \
+	 ((((uint64_t)(t) & BIT_MASK(TIMEBASE_NS_SHIFT)) * TIMEBASE_NS_MUL) >> \
+	  TIMEBASE_NS_SHIFT))
+
+/* Units since boot; ISR safe, never goes back */
+uint64_t timebase_now(void);
+
+/* Low 32 bits of timebase_now(), for intervals under a minute */
+static inline uint32_t timebase_now32(void)
+{
+	return (uint32_t)timebase_now();
+}
+
+/* An interval of timebase_now32() units in us */
+static inline uint32_t timebase_to_us32(uint32_t delta)
+{
+	return ((uint64_t)delta * TIMEBASE_US_MUL) >> TIMEBASE_US_SHIFT;
+}
+
+/* Microseconds since boot, wraps after 71 minutes */
+static inline uint32_t timebase_uptime_us32(void)
+{
+	return (uint32_t)TIMEBASE_TO_US(timebase_now());
+}
+
+/* The cycle counter refines the system clock right now */
+bool timebase_fine(void);
+
+#endif /* KEYPAD_TIMEBASE_H_ */
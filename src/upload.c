@@ -0,0 +1,779 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Chunk boundaries are wherever the transport puts them, so keymap
+ * actions and LED frames split across two chunks are carried over in
+ * a small buffer. All calls come from the USB stack's threads, one
+ * owner at a time, and need no lock.
+ */
+
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/crc.h>
+
+#include "keymap.h"
+#include "layer.h"
+#include "led/led_pwm.h"
+#include "macro.h"
+#include "upload.h"
+#include "config/config_store.h"
+#include "config/profile_cache.h"
+#include "config/upload_crypt.h"
+#include "dfu/dfu.h"
+#include "diag/upload_bench.h"
+
+/* Upload in progress, 0 for none */
+static uint8_t target;
+static const void *owner_of;
+static uint16_t length;
+static uint16_t offset;
+/* Of every byte taken so far */
+static uint32_t crc;
+
+/* Sent encrypted, length and offset are then those of the plaintext */
+static bool sealed;
+static uint16_t wire_length;
+static uint16_t wire_offset;
+
+/* Bytes of an item not complete yet, an action, a change or an LED frame */
+static uint8_t carry[LED_PWM_COUNT * 2];
+static uint8_t carry_len;
+
+#if defined(CONFIG_KEYPAD_LED_ANIM)
+static uint8_t *anim_buf;
+#endif
+
+#if defined(CONFIG_KEYPAD_MACRO_UPLOAD)
+static uint8_t *macro_buf;
+/* Table length to commit for UPLOAD_TARGET_MACRO */
+static size_t macro_len;
+#endif
+
+/*
+ * UPLOAD_TARGET_PROFILE and UPLOAD_TARGET_APP_PROFILE: the header and
+ * the keymap image it fills
+ */
+static uint8_t profile_header[PROFILE_HEADER_SIZE];
+static uint8_t *profile_image;
+static size_t profile_image_len;
+
+BUILD_ASSERT(sizeof(carry) >= 4, "carry must fit a keymap change");
+
+/* Levels of the last LED frame, kept across resets */
+static uint16_t led_levels[LED_PWM_COUNT];
+
+#if defined(CONFIG_KEYPAD_CONFIG_STORE)
+static ssize_t led_store_get(void *buf, size_t size)
+{
+	memcpy(buf, led_levels, sizeof(led_levels));
+
+	return sizeof(led_levels);
+}
+
+static int led_store_set(const void *data, size_t len)
+{
+	if (len != sizeof(led_levels)) {
+		return -EINVAL;
+	}
+
+	memcpy(led_levels, data, len);
+	for (uint8_t led = 0; led < LED_PWM_COUNT; led++) {
+		led_pwm_level_set(led, led_levels[led]);
+	}
+
+	return 0;
+}
+#endif /* CONFIG_KEYPAD_CONFIG_STORE */
+
+static struct config_entry led_entry = {
+	.name = "keypad/led",
+#if defined(CONFIG_KEYPAD_CONFIG_STORE)
+	.get = led_store_get,
+	.set = led_store_set,
+#endif
+};
+
+/* LED frames and images are streamed, their length is not checked */
+static bool target_sized(uint8_t t)
+{
+	return t != UPLOAD_TARGET_LED && t != UPLOAD_TARGET_DFU;
+}
+
+static bool target_app(uint8_t t)
+{
+	return t >= UPLOAD_TARGET_APP_PROFILE(0) &&
+	       t < UPLOAD_TARGET_APP_PROFILE(UPLOAD_APP_PROFILE_MAX);
+}
+
+/* The whole header is in: check it against the build */
+static uint8_t profile_header_check(void)
+{
+	uint16_t macros_len = sys_get_le16(&profile_header[8]);
+	size_t size;
+
+	if (sys_get_le32(profile_header) != PROFILE_MAGIC) {
+		return UPLOAD_STATUS_INVALID;
+	}
+
+	if (profile_header[4] != PROFILE_VERSION) {
+		return UPLOAD_STATUS_UNSUPPORTED;
+	}
+
+	/* Compiled for another keypad */
+	if (profile_header[5] != layer_count() ||
+	    profile_header[6] != KEYPAD_MAX_KEYS ||
+	    profile_header[7] != keypad_key_count ||
+	    length != PROFILE_HEADER_SIZE + profile_image_len + macros_len) {
+		return UPLOAD_STATUS_INVALID;
+	}
+
+	if (macros_len == 0) {
+		return UPLOAD_STATUS_OK;
+	}
+
+#if defined(CONFIG_KEYPAD_MACRO_UPLOAD)
+	macro_buf = macro_upload_begin(&size);
+	if (macro_buf == NULL) {
+		return UPLOAD_STATUS_BUSY;
+	}
+
+	if (macros_len > size) {
+		macro_upload_abort();
+		macro_buf = NULL;
+		return UPLOAD_STATUS_INVALID;
+	}
+
+	return UPLOAD_STATUS_OK;
+#else
+	ARG_UNUSED(size);
+	return UPLOAD_STATUS_UNSUPPORTED;
+#endif
+}
+
+/* An application profile goes to the profile cache, not the keymap */
+static uint8_t app_profile_begin(uint8_t slot)
+{
+#if defined(CONFIG_KEYPAD_PROFILE_CACHE)
+	if (slot >= CONFIG_KEYPAD_PROFILE_SLOTS) {
+		return UPLOAD_STATUS_INVALID;
+	}
+
+	profile_image = profile_cache_upload_begin(slot, &profile_image_len);
+	if (profile_image == NULL) {
+		return UPLOAD_STATUS_BUSY;
+	}
+
+	/* No macro table: the macros are shared by every profile */
+	if (length != PROFILE_HEADER_SIZE + profile_image_len) {
+		profile_cache_upload_abort();
+		return UPLOAD_STATUS_INVALID;
+	}
+
+	return UPLOAD_STATUS_OK;
+#else
+	ARG_UNUSED(slot);
+	return UPLOAD_STATUS_UNSUPPORTED;
+#endif
+}
+
+/* Header, keymap image and macro table, each copied where it goes */
+static uint8_t profile_data(const uint8_t *data, size_t len)
+{
+	size_t image_end = PROFILE_HEADER_SIZE + profile_image_len;
+
+	while (len > 0) {
+		size_t n;
+
+		if (offset < PROFILE_HEADER_SIZE) {
+			n = MIN(len, PROFILE_HEADER_SIZE - offset);
+			memcpy(&profile_header[offset], data, n);
+		} else if (offset < image_end) {
+			n = MIN(len, image_end - offset);
+			memcpy(&profile_image[offset - PROFILE_HEADER_SIZE],
+			       data, n);
+		} else {
+#if defined(CONFIG_KEYPAD_MACRO_UPLOAD)
+			n = len;
+			memcpy(&macro_buf[offset - image_end], data, n);
+#else
+			/* The header check refuses a macro table */
+			return UPLOAD_STATUS_INVALID;
+#endif
+		}
+
+		offset += n;
+		data += n;
+		len -= n;
+
+		if (offset == PROFILE_HEADER_SIZE) {
+			uint8_t status = profile_header_check();
+
+			if (status != UPLOAD_STATUS_OK) {
+				return status;
+			}
+		}
+	}
+
+	return UPLOAD_STATUS_OK;
+}
+
+static void upload_drop(void)
+{
+	switch (target) {
+	case UPLOAD_TARGET_KEYMAP:
+	case UPLOAD_TARGET_KEYS:
+		layer_keymap_abort();
+		break;
+	case UPLOAD_TARGET_PROFILE:
+		layer_keymap_abort();
+#if defined(CONFIG_KEYPAD_MACRO_UPLOAD)
+		if (macro_buf != NULL) {
+			macro_upload_abort();
+		}
+#endif
+		break;
+#if defined(CONFIG_KEYPAD_MACRO_UPLOAD)
+	case UPLOAD_TARGET_MACROS:
+		macro_upload_abort();
+		break;
+	case UPLOAD_TARGET_MACRO:
+		/* Only begun once the id is in */
+		if (macro_buf != NULL) {
+			macro_upload_abort();
+		}
+		break;
+#endif
+	case UPLOAD_TARGET_DFU:
+		dfu_abort();
+		break;
+	case UPLOAD_TARGET_BENCH:
+		/* Whatever is in the slot stays there */
+		break;
+	default:
+		if (target_app(target)) {
+			profile_cache_upload_abort();
+		}
+		break;
+	}
+
+	upload_crypt_abort();
+	sealed = false;
+	target = 0;
+	owner_of = NULL;
+}
+
+uint8_t upload_begin(const void *owner, uint8_t new_target, uint16_t len)
+{
+	uint8_t status;
+	size_t size;
+
+	if (target != 0 && owner_of != owner) {
+		return UPLOAD_STATUS_BUSY;
+	}
+
+	upload_drop();
+
+	sealed = new_target & UPLOAD_TARGET_ENCRYPTED;
+	new_target &= ~UPLOAD_TARGET_ENCRYPTED;
+	wire_length = len;
+	wire_offset = 0;
+
+	if (sealed) {
+		/* LED frames and images are applied before the tag is in */
+		if (!IS_ENABLED(CONFIG_KEYPAD_UPLOAD_CRYPT) ||
+		    !target_sized(new_target)) {
+			sealed = false;
+			return UPLOAD_STATUS_UNSUPPORTED;
+		}
+
+		if (len < UPLOAD_CRYPT_OVERHEAD) {
+			sealed = false;
+			return UPLOAD_STATUS_INVALID;
+		}
+
+		len -= UPLOAD_CRYPT_OVERHEAD;
+	} else if (IS_ENABLED(CONFIG_KEYPAD_UPLOAD_CRYPT_REQUIRED) &&
+		   target_sized(new_target)) {
+		return UPLOAD_STATUS_AUTH;
+	}
+
+	length = len;
+	offset = 0;
+	carry_len = 0;
+	crc = 0;
+
+	switch (new_target) {
+	case UPLOAD_TARGET_KEYMAP:
+		if (length != layer_count() * keypad_key_count * 2) {
+			return UPLOAD_STATUS_INVALID;
+		}
+
+		if (layer_keymap_begin() < 0) {
+			return UPLOAD_STATUS_BUSY;
+		}
+		break;
+	case UPLOAD_TARGET_KEYS:
+		if (length == 0 || length % 4 != 0) {
+			return UPLOAD_STATUS_INVALID;
+		}
+
+		if (layer_keymap_begin() < 0) {
+			return UPLOAD_STATUS_BUSY;
+		}
+		break;
+	case UPLOAD_TARGET_PROFILE:
+		if (layer_keymap_begin() < 0) {
+			return UPLOAD_STATUS_BUSY;
+		}
+
+		profile_image = layer_keymap_image(&profile_image_len);
+		if (length < PROFILE_HEADER_SIZE + profile_image_len) {
+			layer_keymap_abort();
+			return UPLOAD_STATUS_INVALID;
+		}
+
+#if defined(CONFIG_KEYPAD_MACRO_UPLOAD)
+		/* Only begun once the header asks for it */
+		macro_buf = NULL;
+#endif
+		break;
+	case UPLOAD_TARGET_MACRO:
+#if defined(CONFIG_KEYPAD_MACRO_UPLOAD)
+		/* An id and an entry header at least */
+		if (length < 5) {
+			return UPLOAD_STATUS_INVALID;
+		}
+
+		macro_buf = NULL;
+		break;
+#else
+		return UPLOAD_STATUS_UNSUPPORTED;
+#endif
+	case UPLOAD_TARGET_MACROS:
+#if defined(CONFIG_KEYPAD_MACRO_UPLOAD)
+		macro_buf = macro_upload_begin(&size);
+		if (macro_buf == NULL) {
+			return UPLOAD_STATUS_BUSY;
+		}
+
+		if (length > size) {
+			macro_upload_abort();
+			return UPLOAD_STATUS_INVALID;
+		}
+		break;
+#else
+		ARG_UNUSED(size);
+		return UPLOAD_STATUS_UNSUPPORTED;
+#endif
+	case UPLOAD_TARGET_LED:
+		if (!IS_ENABLED(CONFIG_KEYPAD_LED_PWM)) {
+			return UPLOAD_STATUS_UNSUPPORTED;
+		}
+		break;
+	case UPLOAD_TARGET_LED_ANIM:
+#if defined(CONFIG_KEYPAD_LED_ANIM)
+		anim_buf = led_pwm_anim_begin(&size);
+		if (length > size || length % LED_PWM_KEYFRAME_SIZE != 0) {
+			return UPLOAD_STATUS_INVALID;
+		}
+		break;
+#else
+		return UPLOAD_STATUS_UNSUPPORTED;
+#endif
+	case UPLOAD_TARGET_DFU:
+		if (!IS_ENABLED(CONFIG_KEYPAD_DFU)) {
+			return UPLOAD_STATUS_UNSUPPORTED;
+		}
+
+		if (dfu_begin() < 0) {
+			return UPLOAD_STATUS_INVALID;
+		}
+		break;
+	case UPLOAD_TARGET_BENCH:
+		if (!IS_ENABLED(CONFIG_KEYPAD_UPLOAD_BENCH)) {
+			return UPLOAD_STATUS_UNSUPPORTED;
+		}
+
+		if (upload_bench_target_begin() < 0) {
+			return UPLOAD_STATUS_INVALID;
+		}
+		break;
+	default:
+		if (!target_app(new_target)) {
+			return UPLOAD_STATUS_UNSUPPORTED;
+		}
+
+		status = app_profile_begin(new_target -
+					   UPLOAD_TARGET_APP_PROFILE(0));
+		if (status != UPLOAD_STATUS_OK) {
+			return status;
+		}
+		break;
+	}
+
+	target = new_target;
+	owner_of = owner;
+	upload_bench_begin();
+
+	if (sealed) {
+		status = upload_crypt_begin(target, length);
+		if (status != UPLOAD_STATUS_OK) {
+			upload_drop();
+			return status;
+		}
+	}
+
+	return UPLOAD_STATUS_OK;
+}
+
+/* One complete action or frame */
+static uint8_t upload_item(const uint8_t *item)
+{
+	if (target == UPLOAD_TARGET_KEYMAP) {
+		size_t index = offset / 2;
+
+		if (layer_keymap_set(index / keypad_key_count,
+				     index % keypad_key_count,
+				     sys_get_le16(item)) < 0) {
+			return UPLOAD_STATUS_INVALID;
+		}
+
+		offset += 2;
+		return UPLOAD_STATUS_OK;
+	}
+
+	if (target == UPLOAD_TARGET_KEYS) {
+		if (layer_keymap_set(item[0], item[1],
+				     sys_get_le16(&item[2])) < 0) {
+			return UPLOAD_STATUS_INVALID;
+		}
+
+		offset += 4;
+		return UPLOAD_STATUS_OK;
+	}
+
+	for (uint8_t led = 0; led < LED_PWM_COUNT; led++) {
+		led_levels[led] = MIN(sys_get_le16(&item[2 * led]),
+				      LED_PWM_MAX);
+		led_pwm_level_set(led, led_levels[led]);
+	}
+
+	return UPLOAD_STATUS_OK;
+}
+
+/* The plaintext, to where its target keeps it */
+static uint8_t upload_apply(const uint8_t *data, size_t len)
+{
+	size_t item_size;
+
+	if (target == UPLOAD_TARGET_BENCH) {
+		offset += len;
+		if (upload_bench_target_data(data, len) < 0) {
+			upload_drop();
+			return UPLOAD_STATUS_INVALID;
+		}
+
+		return UPLOAD_STATUS_OK;
+	}
+
+	if (target == UPLOAD_TARGET_DFU) {
+		if (dfu_data(data, len) < 0) {
+			upload_drop();
+			return UPLOAD_STATUS_INVALID;
+		}
+
+		return UPLOAD_STATUS_OK;
+	}
+
+	if (target == UPLOAD_TARGET_PROFILE || target_app(target)) {
+		uint8_t status = profile_data(data, len);
+
+		if (status != UPLOAD_STATUS_OK) {
+			upload_drop();
+		}
+
+		return status;
+	}
+
+#if defined(CONFIG_KEYPAD_LED_ANIM)
+	if (target == UPLOAD_TARGET_LED_ANIM) {
+		memcpy(&anim_buf[offset], data, len);
+		offset += len;
+		return UPLOAD_STATUS_OK;
+	}
+#endif
+
+#if defined(CONFIG_KEYPAD_MACRO_UPLOAD)
+	if (target == UPLOAD_TARGET_MACROS) {
+		memcpy(&macro_buf[offset], data, len);
+		offset += len;
+		return UPLOAD_STATUS_OK;
+	}
+
+	if (target == UPLOAD_TARGET_MACRO) {
+		if (macro_buf == NULL) {
+			int err;
+
+			if (len == 0) {
+				return UPLOAD_STATUS_OK;
+			}
+
+			err = macro_upload_patch(data[0], length - 1, &macro_buf,
+						 &macro_len);
+
+			if (err < 0) {
+				macro_buf = NULL;
+				upload_drop();
+				return err == -EBUSY ? UPLOAD_STATUS_BUSY :
+						       UPLOAD_STATUS_INVALID;
+			}
+
+			data++;
+			len--;
+			offset++;
+		}
+
+		/* The entry follows the id byte */
+		memcpy(&macro_buf[offset - 1], data, len);
+		offset += len;
+		return UPLOAD_STATUS_OK;
+	}
+#endif
+
+	switch (target) {
+	case UPLOAD_TARGET_KEYMAP:
+		item_size = 2;
+		break;
+	case UPLOAD_TARGET_KEYS:
+		item_size = 4;
+		break;
+	default:
+		item_size = sizeof(carry);
+		break;
+	}
+
+	while (len > 0) {
+		const uint8_t *item = data;
+		uint8_t status;
+
+		if (carry_len > 0 || len < item_size) {
+			size_t n = MIN(len, item_size - carry_len);
+
+			memcpy(&carry[carry_len], data, n);
+			carry_len += n;
+			data += n;
+			len -= n;
+			if (carry_len < item_size) {
+				break;
+			}
+
+			item = carry;
+			carry_len = 0;
+		} else {
+			data += item_size;
+			len -= item_size;
+		}
+
+		status = upload_item(item);
+		if (status != UPLOAD_STATUS_OK) {
+			upload_drop();
+			return status;
+		}
+	}
+
+	return UPLOAD_STATUS_OK;
+}
+
+/* Next bytes of the plaintext, from upload_data() or decrypted */
+static uint8_t upload_plain(const uint8_t *data, size_t len)
+{
+	uint8_t status;
+
+	upload_bench_enter(UPLOAD_BENCH_APPLY);
+	status = upload_apply(data, len);
+	upload_bench_exit();
+
+	return status;
+}
+
+uint8_t upload_data(const void *owner, const uint8_t *data, size_t len)
+{
+	uint8_t status;
+
+	if (target == 0 || owner_of != owner) {
+		return UPLOAD_STATUS_INVALID;
+	}
+
+	if (sealed) {
+		len = MIN(len, wire_length - wire_offset);
+		wire_offset += len;
+		upload_bench_enter(UPLOAD_BENCH_CRC);
+		crc = crc32_ieee_update(crc, data, len);
+		upload_bench_exit();
+
+		upload_bench_enter(UPLOAD_BENCH_DECRYPT);
+		status = upload_crypt_data(data, len, upload_plain);
+		upload_bench_exit();
+		if (status != UPLOAD_STATUS_OK) {
+			upload_drop();
+		}
+
+		return status;
+	}
+
+	if (target_sized(target)) {
+		len = MIN(len, length - offset - carry_len);
+	}
+
+	upload_bench_enter(UPLOAD_BENCH_CRC);
+	crc = crc32_ieee_update(crc, data, len);
+	upload_bench_exit();
+
+	return upload_plain(data, len);
+}
+
+uint8_t upload_check(const void *owner, uint32_t expected)
+{
+	if (target == 0 || owner_of != owner) {
+		return UPLOAD_STATUS_INVALID;
+	}
+
+	if (crc != expected) {
+		upload_drop();
+		return UPLOAD_STATUS_CORRUPT;
+	}
+
+	return UPLOAD_STATUS_OK;
+}
+
+/*
+ * The keymap is checked before the macros are committed, so a bad one
+ * leaves both as they were
+ */
+static int profile_commit(void)
+{
+	int err = layer_keymap_image_check();
+
+#if defined(CONFIG_KEYPAD_MACRO_UPLOAD)
+	if (err < 0) {
+		if (macro_buf != NULL) {
+			macro_upload_abort();
+		}
+	} else if (macro_buf != NULL) {
+		err = macro_upload_commit(length - PROFILE_HEADER_SIZE -
+					  profile_image_len);
+	}
+#endif
+
+	if (err < 0) {
+		layer_keymap_abort();
+		return err;
+	}
+
+	return layer_keymap_image_commit();
+}
+
+uint8_t upload_end(const void *owner)
+{
+	uint8_t new_target = target;
+	uint8_t status;
+	int err = 0;
+
+	if (target == 0 || owner_of != owner) {
+		return UPLOAD_STATUS_INVALID;
+	}
+
+	if (sealed) {
+		/* Nothing of it is applied unless it is authentic */
+		upload_bench_enter(UPLOAD_BENCH_DECRYPT);
+		status = upload_crypt_end(upload_plain);
+		upload_bench_exit();
+		if (status != UPLOAD_STATUS_OK) {
+			upload_drop();
+			return status;
+		}
+
+		sealed = false;
+	}
+
+	if (target_sized(target) && offset != length) {
+		upload_drop();
+		return UPLOAD_STATUS_INVALID;
+	}
+
+	target = 0;
+	owner_of = NULL;
+
+	upload_bench_enter(UPLOAD_BENCH_COMMIT);
+	switch (new_target) {
+	case UPLOAD_TARGET_KEYMAP:
+	case UPLOAD_TARGET_KEYS:
+		err = layer_keymap_commit();
+		break;
+	case UPLOAD_TARGET_PROFILE:
+		err = profile_commit();
+		break;
+#if defined(CONFIG_KEYPAD_MACRO_UPLOAD)
+	case UPLOAD_TARGET_MACROS:
+		err = macro_upload_commit(length);
+		break;
+	case UPLOAD_TARGET_MACRO:
+		/* The entry must fill its room exactly, or it shifts the rest */
+		if (sys_get_le16(macro_buf) != length - 5) {
+			macro_upload_abort();
+			err = -EINVAL;
+			break;
+		}
+
+		err = macro_upload_commit(macro_len);
+		break;
+#endif
+	case UPLOAD_TARGET_LED:
+		/* Only the last frame is kept, not the animation */
+		config_store_changed(&led_entry);
+		break;
+#if defined(CONFIG_KEYPAD_LED_ANIM)
+	case UPLOAD_TARGET_LED_ANIM:
+		err = led_pwm_anim_commit(length);
+		break;
+#endif
+	case UPLOAD_TARGET_DFU:
+		err = dfu_end();
+		break;
+	case UPLOAD_TARGET_BENCH:
+		err = upload_bench_target_end();
+		break;
+	default:
+		if (target_app(new_target)) {
+			err = profile_cache_upload_commit();
+		}
+		break;
+	}
+	upload_bench_exit();
+
+	if (err >= 0) {
+		upload_bench_end(wire_length);
+	}
+
+	return err < 0 ? UPLOAD_STATUS_INVALID : UPLOAD_STATUS_OK;
+}
+
+void upload_abort(const void *owner)
+{
+	if (owner_of == owner) {
+		upload_drop();
+	}
+}
+
+int upload_init(void)
+{
+	if (!IS_ENABLED(CONFIG_KEYPAD_LED_PWM)) {
+		return 0;
+	}
+
+	return config_store_register(&led_entry);
+}
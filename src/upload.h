@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Runtime configuration uploads, shared by the configuration
+ * transports. An upload is a target and a length, then the bytes in
+ * chunks of any size, then an end that applies it:
+ *
+ *   UPLOAD_TARGET_KEYMAP  every layer in order, keypad_key_count le16
+ *                         actions each, see layer_keymap_set()
+ *   UPLOAD_TARGET_MACROS  a macro table, format in macro.h
+ *   UPLOAD_TARGET_LED     LED_PWM_COUNT le16 levels per frame, each
+ *                         frame shown as soon as it is complete; the
+ *                         length is ignored
+ *   UPLOAD_TARGET_KEYS    keymap changes, u8 layer, u8 key and le16
+ *                         action each; every other key keeps its action
+ *   UPLOAD_TARGET_MACRO   one macro, u8 id and then its entry in the
+ *                         macro table format; the other macros are kept
+ *   UPLOAD_TARGET_DFU     a firmware image as blocks, see dfu/dfu.h;
+ *                         the length is ignored
+ *   UPLOAD_TARGET_LED_ANIM  the profile's LED animation, keyframes of
+ *                         LED_PWM_COUNT le16 levels and a le16 time in
+ *                         ms to ramp to the next, see led/led_pwm.h;
+ *                         none for no animation
+ *   UPLOAD_TARGET_PROFILE  a profile compiled by
+ *                         scripts/profile_compile.py: a header of
+ *                         le32 PROFILE_MAGIC, u8 PROFILE_VERSION, u8
+ *                         layer count, u8 KEYPAD_MAX_KEYS, u8 key
+ *                         count, le16 macro table length and le16 0;
+ *                         the keymap image of layer_keymap_image(),
+ *                         masks included; the macro table, none to
+ *                         keep the macros in use
+ *   UPLOAD_TARGET_BENCH   any bytes, written to the secondary slot and
+ *                         left there, for the upload benchmark, see
+ *                         diag/upload_bench.h
+ *   UPLOAD_TARGET_APP_PROFILE(slot)  a profile as above without a
+ *                         macro table, stored as the keymap of one
+ *                         application, see config/profile_cache.h
+ *
+ * KEYS and MACRO are deltas: a tool changing one key or one macro sends
+ * a few bytes instead of the whole profile, and the config store
+ * finds every other entry unchanged. Keymap and macro chunks go
+ * straight into the spare buffers of layer and macro, so there is no
+ * staging copy. A profile is the keymap and the macros at once, laid
+ * out as the firmware keeps them: the header is checked against the
+ * build and the rest is copied in place, nothing is parsed or indexed
+ * but the macro table. One upload at a time, from
+ * whichever transport began it.
+ *
+ * The CRC32 (IEEE 802.3, as zlib.crc32()) of the bytes is computed as
+ * they come in. A transport that carries the sender's CRC checks it
+ * with upload_check() before the end, and a damaged upload is dropped
+ * with UPLOAD_STATUS_CORRUPT instead of being applied.
+ *
+ * A sized target ORed with UPLOAD_TARGET_ENCRYPTED is sent encrypted
+ * and authenticated, see config/upload_crypt.h. The length and the CRC
+ * are then those of the bytes as sent, and an upload that does not
+ * authenticate is dropped at the end with UPLOAD_STATUS_AUTH. With
+ * CONFIG_KEYPAD_UPLOAD_CRYPT_REQUIRED the sized targets are only taken
+ * encrypted.
+ */
+
+#ifndef KEYPAD_UPLOAD_H_
+#define KEYPAD_UPLOAD_H_
+
+#include <zephyr/zephyr.h>
+
+#define UPLOAD_TARGET_KEYMAP 0x01
+#define UPLOAD_TARGET_MACROS 0x02
+#define UPLOAD_TARGET_LED 0x03
+#define UPLOAD_TARGET_KEYS 0x04
+#define UPLOAD_TARGET_MACRO 0x05
+#define UPLOAD_TARGET_DFU 0x06
+#define UPLOAD_TARGET_LED_ANIM 0x07
+#define UPLOAD_TARGET_PROFILE 0x08
+#define UPLOAD_TARGET_BENCH 0x09
+#define UPLOAD_TARGET_APP_PROFILE(slot) (0x10 + (slot))
+#define UPLOAD_APP_PROFILE_MAX 16
+#define UPLOAD_TARGET_ENCRYPTED 0x80
+
+#define UPLOAD_STATUS_OK 0x00
+#define UPLOAD_STATUS_SEQUENCE 0x01
+#define UPLOAD_STATUS_BUSY 0x02
+#define UPLOAD_STATUS_INVALID 0x03
+#define UPLOAD_STATUS_UNSUPPORTED 0x04
+#define UPLOAD_STATUS_CORRUPT 0x05
+#define UPLOAD_STATUS_AUTH 0x06
+
+/* "KPRF", first in an UPLOAD_TARGET_PROFILE header */
+#define PROFILE_MAGIC 0x4652504b
+#define PROFILE_VERSION 1
+#define PROFILE_HEADER_SIZE 12
+
+/* Restore the stored LED levels, after led_pwm_init() */
+int upload_init(void);
+
+/*
+ * Start an upload for owner, a token of the transport. An upload of
+ * the same owner still in progress is dropped; one of another owner
+ * makes this UPLOAD_STATUS_BUSY.
+ */
+uint8_t upload_begin(const void *owner, uint8_t target, uint16_t length);
+
+/* Next bytes of the upload, anything beyond its length is ignored */
+uint8_t upload_data(const void *owner, const uint8_t *data, size_t len);
+
+/*
+ * All bytes are in, crc is the CRC32 of them as sent: drop the upload
+ * unless it matches
+ */
+uint8_t upload_check(const void *owner, uint32_t crc);
+
+/* All bytes are in: apply the upload */
+uint8_t upload_end(const void *owner);
+
+/* Drop the upload of owner, if any */
+void upload_abort(const void *owner);
+
+#endif /* KEYPAD_UPLOAD_H_ */
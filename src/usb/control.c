@@ -0,0 +1,338 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Both reports are arrays of held usages. Reports are written from the
+ * system work queue, like the encoder's, and the IN completion kicks
+ * the next one. A usage pressed and released before its press went out
+ * keeps its slot until it has been reported once, so a short tap is
+ * never folded away.
+ *
+ * With CONFIG_KEYPAD_BATTERY the System Control collection also holds
+ * the Battery Strength of the Generic Device Controls page as a feature
+ * report. Hosts read it with GET_REPORT when they like, so a change of
+ * the level costs no interrupt transfer.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/usb/class/usb_hid.h>
+
+#include "usb/control.h"
+#include "usb/hid_iface.h"
+#include "power/battery.h"
+
+LOG_MODULE_REGISTER(control, LOG_LEVEL_INF);
+
+#define CONTROL_USAGE_PAGE_CONSUMER 0x0C
+#define CONTROL_USAGE_CONSUMER_CONTROL 0x01
+#define CONTROL_USAGE_CONSUMER_MAX 0x3FF
+#define CONTROL_USAGE_SYSTEM_CONTROL 0x80
+#define CONTROL_USAGE_SYSTEM_FIRST 0x81
+#define CONTROL_USAGE_SYSTEM_LAST 0x83
+#define CONTROL_USAGE_PAGE_DEVICE_CONTROLS 0x06
+#define CONTROL_USAGE_BATTERY_STRENGTH 0x20
+#define CONTROL_REPORT_TYPE_FEATURE 0x03
+
+/* Consumer usages held at once */
+#define CONSUMER_SLOTS 2
+
+static const uint8_t consumer_report_desc[] = {
+	HID_USAGE_PAGE(CONTROL_USAGE_PAGE_CONSUMER),
+	HID_USAGE(CONTROL_USAGE_CONSUMER_CONTROL),
+	HID_COLLECTION(HID_COLLECTION_APPLICATION),
+		HID_LOGICAL_MIN8(0),
+		HID_LOGICAL_MAX16(0xFF, 0x03),
+		HID_USAGE_MIN8(0),
+		HID_USAGE_MAX16(0xFF, 0x03),
+		HID_REPORT_SIZE(16),
+		HID_REPORT_COUNT(CONSUMER_SLOTS),
+		/* Data,Array,Abs */
+		HID_INPUT(0x00),
+	HID_END_COLLECTION,
+};
+
+static const uint8_t system_report_desc[] = {
+	HID_USAGE_PAGE(HID_USAGE_GEN_DESKTOP),
+	HID_USAGE(CONTROL_USAGE_SYSTEM_CONTROL),
+	HID_COLLECTION(HID_COLLECTION_APPLICATION),
+		HID_LOGICAL_MIN8(CONTROL_USAGE_SYSTEM_FIRST),
+		HID_LOGICAL_MAX8(CONTROL_USAGE_SYSTEM_LAST),
+		HID_USAGE_MIN8(CONTROL_USAGE_SYSTEM_FIRST),
+		HID_USAGE_MAX8(CONTROL_USAGE_SYSTEM_LAST),
+		HID_REPORT_SIZE(8),
+		HID_REPORT_COUNT(1),
+		/* Data,Array,Abs; 0 is out of range, i.e. nothing held */
+		HID_INPUT(0x00),
+#if defined(CONFIG_KEYPAD_BATTERY)
+		HID_USAGE_PAGE(CONTROL_USAGE_PAGE_DEVICE_CONTROLS),
+		HID_USAGE(CONTROL_USAGE_BATTERY_STRENGTH),
+		HID_LOGICAL_MIN8(0),
+		HID_LOGICAL_MAX8(100),
+		HID_REPORT_SIZE(8),
+		HID_REPORT_COUNT(1),
+		/* Data,Var,Abs, in percent */
+		HID_FEATURE(0x02),
+#endif
+	HID_END_COLLECTION,
+};
+
+struct control_slot {
+	uint16_t usage;
+	/* Went out in a report */
+	bool sent;
+	/* Released, cleared once sent */
+	bool released;
+};
+
+struct control_iface {
+	const struct device *hid;
+	/* Report ID on the shared interface */
+	uint8_t id;
+	struct k_work work;
+	atomic_t in_flight;
+	/* A report with the current state has not been written yet */
+	atomic_t dirty;
+	struct k_spinlock lock;
+	struct control_slot slots[CONSUMER_SLOTS];
+	uint8_t slot_count;
+	/* Bytes per slot in the report */
+	uint8_t slot_size;
+};
+
+static struct control_iface consumer = {
+	.id = HID_SHARED_ID_CONSUMER,
+	.slot_count = CONSUMER_SLOTS,
+	.slot_size = 2,
+};
+
+static struct control_iface system = {
+	.id = HID_SHARED_ID_SYSTEM,
+	.slot_count = 1,
+	.slot_size = 1,
+};
+
+static void control_set(struct control_iface *iface, uint16_t usage,
+			bool pressed)
+{
+	k_spinlock_key_t key = k_spin_lock(&iface->lock);
+	struct control_slot *free = NULL;
+	uint8_t i;
+
+	for (i = 0; i < iface->slot_count; i++) {
+		struct control_slot *s = &iface->slots[i];
+
+		if (s->usage == 0 && free == NULL) {
+			free = s;
+		}
+
+		if (s->usage == usage && !s->released) {
+			break;
+		}
+	}
+
+	if (i < iface->slot_count) {
+		struct control_slot *s = &iface->slots[i];
+
+		if (!pressed && s->sent) {
+			s->usage = 0;
+		} else if (!pressed) {
+			s->released = true;
+		}
+	} else if (pressed && free != NULL) {
+		*free = (struct control_slot){ .usage = usage };
+	} else if (pressed) {
+		LOG_WRN("No slot for usage 0x%03x", usage);
+	}
+
+	k_spin_unlock(&iface->lock, key);
+
+	atomic_set(&iface->dirty, 1);
+	k_work_submit(&iface->work);
+}
+
+/* Render the slots, returns true if another report must follow */
+static bool control_build(struct control_iface *iface, uint8_t *buf)
+{
+	k_spinlock_key_t key = k_spin_lock(&iface->lock);
+	bool again = false;
+
+	for (uint8_t i = 0; i < iface->slot_count; i++) {
+		struct control_slot *s = &iface->slots[i];
+
+		if (s->released && s->sent) {
+			s->usage = 0;
+		}
+
+		if (iface->slot_size == 2) {
+			sys_put_le16(s->usage, &buf[2 * i]);
+		} else {
+			buf[i] = s->usage;
+		}
+
+		if (s->usage != 0) {
+			s->sent = true;
+			/* The release of a tap goes in the next report */
+			again |= s->released;
+		}
+	}
+
+	k_spin_unlock(&iface->lock, key);
+
+	return again;
+}
+
+static void control_send(struct k_work *work)
+{
+	struct control_iface *iface =
+		CONTAINER_OF(work, struct control_iface, work);
+	uint8_t report[CONSUMER_SLOTS * 2];
+	bool again;
+	int ret;
+
+	if (!atomic_cas(&iface->in_flight, 0, 1)) {
+		/* The IN completion submits us again */
+		return;
+	}
+
+	if (!atomic_cas(&iface->dirty, 1, 0)) {
+		atomic_set(&iface->in_flight, 0);
+		return;
+	}
+
+	again = control_build(iface, report);
+	if (again) {
+		atomic_set(&iface->dirty, 1);
+	}
+
+	ret = hid_iface_write(iface->hid, iface->id, report,
+			      iface->slot_count * iface->slot_size);
+	if (ret) {
+		LOG_ERR("Control HID write error, %d", ret);
+		atomic_set(&iface->in_flight, 0);
+	}
+}
+
+static void consumer_in_ready(const struct device *dev)
+{
+	atomic_set(&consumer.in_flight, 0);
+	k_work_submit(&consumer.work);
+}
+
+static void system_in_ready(const struct device *dev)
+{
+	atomic_set(&system.in_flight, 0);
+	k_work_submit(&system.work);
+}
+
+static const struct hid_ops consumer_ops = {
+	.int_in_ready = consumer_in_ready,
+};
+
+#if defined(CONFIG_KEYPAD_BATTERY)
+static uint8_t battery_report;
+
+static int system_get_report(const struct device *dev,
+			     struct usb_setup_packet *setup, int32_t *len,
+			     uint8_t **data)
+{
+	int level;
+
+	if ((setup->wValue >> 8) != CONTROL_REPORT_TYPE_FEATURE) {
+		return -ENOTSUP;
+	}
+
+	level = battery_level_get();
+	if (level < 0) {
+		/* Not measured yet, the stall tells the host to ask again */
+		return level;
+	}
+
+	battery_report = level;
+	*data = &battery_report;
+	*len = sizeof(battery_report);
+
+	return 0;
+}
+#endif /* CONFIG_KEYPAD_BATTERY */
+
+static const struct hid_ops system_ops = {
+#if defined(CONFIG_KEYPAD_BATTERY)
+	.get_report = system_get_report,
+#endif
+	.int_in_ready = system_in_ready,
+};
+
+static int control_iface_init(struct control_iface *iface, uint8_t index,
+			      const uint8_t *desc, size_t desc_size,
+			      const struct hid_ops *ops, uint8_t interval_ms)
+{
+	int ret;
+
+	iface->hid = hid_iface_get(index);
+	if (iface->hid == NULL) {
+		LOG_ERR("Cannot get USB HID Device %u", index);
+		return -ENODEV;
+	}
+
+	k_work_init(&iface->work, control_send);
+
+	ret = hid_iface_add(iface->hid, iface->id, desc, desc_size, ops,
+			    interval_ms);
+	if (ret < 0) {
+		LOG_ERR("Failed to init HID %u, error: %d", index, ret);
+	}
+
+	return ret;
+}
+
+int control_init(void)
+{
+	int ret;
+
+	ret = control_iface_init(&consumer, HID_IFACE_CONSUMER,
+				 consumer_report_desc,
+				 sizeof(consumer_report_desc), &consumer_ops,
+				 CONFIG_KEYPAD_HID_CONSUMER_POLL_MS);
+	if (ret < 0) {
+		return ret;
+	}
+
+	return control_iface_init(&system, HID_IFACE_SYSTEM,
+				  system_report_desc,
+				  sizeof(system_report_desc), &system_ops,
+				  CONFIG_KEYPAD_HID_SYSTEM_POLL_MS);
+}
+
+static void control_iface_reset(struct control_iface *iface)
+{
+	/* A transfer queued before a bus reset never completes */
+	atomic_set(&iface->in_flight, 0);
+	atomic_set(&iface->dirty, 1);
+	k_work_submit(&iface->work);
+}
+
+void control_reset(void)
+{
+	control_iface_reset(&consumer);
+	control_iface_reset(&system);
+}
+
+void control_consumer_set(uint16_t usage, bool pressed)
+{
+	if (usage != 0 && usage <= CONTROL_USAGE_CONSUMER_MAX) {
+		control_set(&consumer, usage, pressed);
+	}
+}
+
+void control_system_set(uint16_t usage, bool pressed)
+{
+	if (usage >= CONTROL_USAGE_SYSTEM_FIRST &&
+	    usage <= CONTROL_USAGE_SYSTEM_LAST) {
+		control_set(&system, usage, pressed);
+	}
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Consumer Control (media keys, volume) and System Control (power,
+ * sleep, wake) on interfaces of their own, so keyboard traffic never
+ * delays them and each has its own polling interval. Keys reach them
+ * through the LAYER_CONSUMER() and LAYER_SYSTEM() actions.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_HID_CONTROL is enabled.
+ */
+
+#ifndef KEYPAD_USB_CONTROL_H_
+#define KEYPAD_USB_CONTROL_H_
+
+#include <zephyr/zephyr.h>
+
+#if defined(CONFIG_KEYPAD_HID_CONTROL)
+
+/* Registers both interfaces, call before usb_enable() */
+int control_init(void);
+
+/* Forget the in-flight reports after a bus reset or reconfiguration */
+void control_reset(void);
+
+/* Usage of the Consumer page (0x0c) */
+void control_consumer_set(uint16_t usage, bool pressed);
+
+/* System Power Down, Sleep or Wake Up usage (0x81..0x83) */
+void control_system_set(uint16_t usage, bool pressed);
+
+#else
+
+static inline int control_init(void)
+{
+	return 0;
+}
+
+static inline void control_reset(void) {}
+static inline void control_consumer_set(uint16_t usage, bool pressed) {}
+static inline void control_system_set(uint16_t usage, bool pressed) {}
+
+#endif /* CONFIG_KEYPAD_HID_CONTROL */
+
+#endif /* KEYPAD_USB_CONTROL_H_ */
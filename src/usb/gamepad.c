@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * A timer at the polling interval of the gamepad endpoint runs one tick
+ * on the system work queue. The tick does nothing unless the SAADC has
+ * converted a scan since the previous one, then reads the travel of
+ * the axis keys from that scan, once each. An axis is the travel of its
+ * key less that of its negative key, scaled to the 16-bit logical range
+ * with a Q12 gain fixed at build time, so a tick costs a multiply per
+ * axis and no division.
+ *
+ * Travel moving by no more than CONFIG_KEYPAD_GAMEPAD_DEADBAND_UM from
+ * the value last sent leaves the axis where the host has it, so sensor
+ * noise on a still key writes no report. An axis back at rest is always
+ * sent, a released stick centers exactly. Only a tick that moved an
+ * axis writes to the endpoint, and nothing is sent while the bus is
+ * suspended, so resting keys never wake the host.
+ */
+
+#include <stdlib.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/devicetree.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/usb/class/usb_hid.h>
+
+#include "input/analog.h"
+#include "usb/gamepad.h"
+#include "usb/hid_iface.h"
+#include "usb/usb_state.h"
+
+LOG_MODULE_REGISTER(gamepad, LOG_LEVEL_INF);
+
+/* Generic Desktop X, the axis enum of the binding follows it in order */
+#define GAMEPAD_USAGE_X 0x30
+#define GAMEPAD_NO_KEY 0xff
+
+#define GAMEPAD_DEADBAND_UM CONFIG_KEYPAD_GAMEPAD_DEADBAND_UM
+#define GAMEPAD_AXIS_MAX 32767
+#define GAMEPAD_TRAVEL_UM DT_PROP(ANALOG_NODE, travel_um)
+/* um of travel to axis counts */
+#define GAMEPAD_GAIN_Q12 ((GAMEPAD_AXIS_MAX << 12) / GAMEPAD_TRAVEL_UM)
+
+#define GAMEPAD_AXIS(node_id)						\
+	{ .usage = GAMEPAD_USAGE_X + DT_ENUM_IDX(node_id, axis),	\
+	  .key = DT_PROP(node_id, key),					\
+	  .negative = DT_PROP_OR(node_id, negative_key, GAMEPAD_NO_KEY) },
+
+#define GAMEPAD_USAGE(node_id)						\
+	HID_USAGE(GAMEPAD_USAGE_X + DT_ENUM_IDX(node_id, axis)),
+
+#define GAMEPAD_KEY_CHECK(node_id)					\
+	BUILD_ASSERT(DT_PROP(node_id, key) < ANALOG_KEYS &&		\
+		     DT_PROP_OR(node_id, negative_key, 0) < ANALOG_KEYS, \
+		     "gamepad axis on a key that is not analog");
+
+struct gamepad_axis {
+	uint8_t usage;
+	/* Indexes of the analog keys, negative GAMEPAD_NO_KEY on a trigger */
+	uint8_t key;
+	uint8_t negative;
+};
+
+DT_FOREACH_CHILD_STATUS_OKAY(GAMEPAD_NODE, GAMEPAD_KEY_CHECK)
+
+static const struct gamepad_axis axes[] = {
+	DT_FOREACH_CHILD_STATUS_OKAY(GAMEPAD_NODE, GAMEPAD_AXIS)
+};
+
+BUILD_ASSERT(ARRAY_SIZE(axes) > 0, "the gamepad node has no axis");
+BUILD_ASSERT(GAMEPAD_TRAVEL_UM * GAMEPAD_GAIN_Q12 <= INT32_MAX,
+	     "travel-um too long for the axis gain");
+
+static const uint8_t gamepad_report_desc[] = {
+	HID_USAGE_PAGE(HID_USAGE_GEN_DESKTOP),
+	HID_USAGE(HID_USAGE_GEN_DESKTOP_GAMEPAD),
+	HID_COLLECTION(HID_COLLECTION_APPLICATION),
+		DT_FOREACH_CHILD_STATUS_OKAY(GAMEPAD_NODE, GAMEPAD_USAGE)
+		/* -32767 to 32767 */
+		HID_LOGICAL_MIN16(0x01, 0x80),
+		HID_LOGICAL_MAX16(0xff, 0x7f),
+		HID_REPORT_SIZE(16),
+		HID_REPORT_COUNT(ARRAY_SIZE(axes)),
+		/* Data,Var,Abs */
+		HID_INPUT(0x02),
+	HID_END_COLLECTION,
+};
+
+static const struct device *hid;
+static struct k_work tick_work;
+static atomic_t in_flight;
+/* The host was reset and has every axis at 0 */
+static atomic_t host_reset;
+
+/* Tick state, only touched by the tick */
+static uint32_t last_scan;
+/* Travel difference of every axis as last sent, um */
+static int16_t sent_um[ARRAY_SIZE(axes)];
+static uint8_t report[ARRAY_SIZE(axes) * sizeof(int16_t)];
+
+static void gamepad_timer_expired(struct k_timer *timer)
+{
+	k_work_submit(&tick_work);
+}
+
+static K_TIMER_DEFINE(gamepad_timer, gamepad_timer_expired, NULL);
+
+static inline bool gamepad_bus_active(void)
+{
+	enum usb_state state = usb_state_get();
+
+	return state == USB_STATE_CONFIGURED || state == USB_STATE_RESUMED;
+}
+
+static int16_t gamepad_axis_get(const struct gamepad_axis *axis)
+{
+	int32_t um = analog_travel_get(axis->key);
+
+	if (axis->negative != GAMEPAD_NO_KEY) {
+		um -= analog_travel_get(axis->negative);
+	}
+
+	return CLAMP(um, -GAMEPAD_TRAVEL_UM, GAMEPAD_TRAVEL_UM);
+}
+
+static void gamepad_tick(struct k_work *work)
+{
+	uint32_t scan = analog_scan_count();
+	bool moved = false;
+	int32_t value;
+	int16_t um;
+	int ret;
+
+	if (scan == last_scan || !gamepad_bus_active() ||
+	    atomic_get(&in_flight)) {
+		/* Same scan as last time, or the report would not go out */
+		return;
+	}
+
+	last_scan = scan;
+
+	if (atomic_cas(&host_reset, 1, 0)) {
+		memset(sent_um, 0, sizeof(sent_um));
+		memset(report, 0, sizeof(report));
+	}
+
+	for (size_t i = 0; i < ARRAY_SIZE(axes); i++) {
+		um = gamepad_axis_get(&axes[i]);
+
+		/* Within the deadband, unless it came back to rest */
+		if (um == sent_um[i] ||
+		    (um != 0 && abs(um - sent_um[i]) <= GAMEPAD_DEADBAND_UM)) {
+			continue;
+		}
+
+		value = (um * GAMEPAD_GAIN_Q12) / BIT(12);
+		sys_put_le16((uint16_t)(int16_t)value, &report[i * 2]);
+		sent_um[i] = um;
+		moved = true;
+	}
+
+	if (!moved) {
+		return;
+	}
+
+	atomic_set(&in_flight, 1);
+
+	ret = hid_int_ep_write(hid, report, sizeof(report), NULL);
+	if (ret) {
+		LOG_ERR("Gamepad HID write error, %d", ret);
+		atomic_set(&in_flight, 0);
+		/* Not knowing what the host has, start over from rest */
+		atomic_set(&host_reset, 1);
+	}
+}
+
+static void gamepad_in_ready(const struct device *dev)
+{
+	atomic_set(&in_flight, 0);
+}
+
+static const struct hid_ops gamepad_ops = {
+	.int_in_ready = gamepad_in_ready,
+};
+
+int gamepad_init(void)
+{
+	int ret;
+
+	hid = hid_iface_get(HID_IFACE_GAMEPAD);
+	if (hid == NULL) {
+		LOG_ERR("Cannot get USB HID Device for the gamepad");
+		return -ENODEV;
+	}
+
+	k_work_init(&tick_work, gamepad_tick);
+
+	usb_hid_register_device(hid, gamepad_report_desc,
+				sizeof(gamepad_report_desc), &gamepad_ops);
+	hid_iface_interval_set(hid, CONFIG_KEYPAD_GAMEPAD_POLL_MS);
+
+	ret = usb_hid_init(hid);
+	if (ret < 0) {
+		LOG_ERR("Failed to init gamepad HID, error: %d", ret);
+		return ret;
+	}
+
+	k_timer_start(&gamepad_timer, K_MSEC(CONFIG_KEYPAD_GAMEPAD_POLL_MS),
+		      K_MSEC(CONFIG_KEYPAD_GAMEPAD_POLL_MS));
+
+	return 0;
+}
+
+void gamepad_reset(void)
+{
+	/* A transfer queued before a bus reset never completes */
+	atomic_set(&host_reset, 1);
+	atomic_set(&in_flight, 0);
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Analog gamepad on a HID interface of its own. The axes of the
+ * richeffects,keypad-gamepad node follow the travel of analog keys:
+ * once per poll of the gamepad endpoint the latest converted SAADC
+ * scan is mapped to axis values in fixed point, and a report is only
+ * written when an axis moved further than the deadband.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_GAMEPAD is enabled.
+ */
+
+#ifndef KEYPAD_USB_GAMEPAD_H_
+#define KEYPAD_USB_GAMEPAD_H_
+
+#include <zephyr/zephyr.h>
+
+#define GAMEPAD_NODE DT_INST(0, richeffects_keypad_gamepad)
+
+#if defined(CONFIG_KEYPAD_GAMEPAD)
+
+/* Registers the gamepad HID interface, call before usb_enable() */
+int gamepad_init(void);
+
+/* Forget the in-flight report after a bus reset or reconfiguration */
+void gamepad_reset(void);
+
+#else
+
+static inline int gamepad_init(void)
+{
+	return 0;
+}
+
+static inline void gamepad_reset(void) {}
+
+#endif /* CONFIG_KEYPAD_GAMEPAD */
+
+#endif /* KEYPAD_USB_GAMEPAD_H_ */
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * The HID class takes bInterval for every instance from
+ * CONFIG_USB_HID_POLL_INTERVAL_MS. The descriptors live in RAM, where
+ * the USB stack fixes up interface and endpoint numbers anyway, so the
+ * interval of one interface is changed in place before the stack is
+ * enabled.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/device.h>
+#include <zephyr/usb/usb_device.h>
+#include <zephyr/usb/class/usb_hid.h>
+
+#include "usb/hid_iface.h"
+#include "usb/hid_shared.h"
+
+/* An instance nothing registers still takes its endpoints */
+BUILD_ASSERT(HID_IFACE_COUNT == CONFIG_USB_HID_DEVICE_COUNT,
+	     "CONFIG_USB_HID_DEVICE_COUNT does not match the interfaces");
+
+static const char *const hid_names[] = {
+	"HID_0", "HID_1", "HID_2", "HID_3", "HID_4", "HID_5", "HID_6",
+};
+
+const struct device *hid_iface_get(uint8_t index)
+{
+	if (index >= ARRAY_SIZE(hid_names)) {
+		return NULL;
+	}
+
+	return device_get_binding(hid_names[index]);
+}
+
+void hid_iface_interval_set(const struct device *dev, uint8_t ms)
+{
+	const struct usb_cfg_data *cfg = dev->config;
+	uint8_t *desc = (uint8_t *)cfg->interface_descriptor;
+	const struct usb_desc_header *head = (void *)desc;
+
+	/* Interface, HID and endpoint descriptors up to the next interface */
+	do {
+		if (head->bDescriptorType == USB_DESC_ENDPOINT) {
+			((struct usb_ep_descriptor *)head)->bInterval = ms;
+		}
+
+		desc += head->bLength;
+		head = (void *)desc;
+	} while (head->bLength != 0 &&
+		 head->bDescriptorType != USB_DESC_INTERFACE);
+}
+
+int hid_iface_add(const struct device *dev, uint8_t id, const uint8_t *desc,
+		  size_t desc_size, const struct hid_ops *ops,
+		  uint8_t interval_ms)
+{
+	if (IS_ENABLED(CONFIG_KEYPAD_HID_SHARED)) {
+		/* Started with the others by hid_shared_init() */
+		return hid_shared_add(dev, id, desc, desc_size, ops,
+				      interval_ms);
+	}
+
+	usb_hid_register_device(dev, desc, desc_size, ops);
+	if (interval_ms != 0) {
+		hid_iface_interval_set(dev, interval_ms);
+	}
+
+	return usb_hid_init(dev);
+}
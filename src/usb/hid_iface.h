@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * HID interfaces of the composite device. Every report class has its
+ * own interface and interrupt IN endpoint, numbered in this order (only
+ * the enabled ones take a number):
+ *
+ *   HID_0  keyboard
+ *   HID_n  Consumer Control, CONFIG_KEYPAD_HID_CONTROL
+ *   HID_n  System Control, CONFIG_KEYPAD_HID_CONTROL
+ *   HID_n  rotary encoder, CONFIG_KEYPAD_ENCODER
+ *   HID_n  mouse keys, CONFIG_KEYPAD_MOUSE_KEYS
+ *   HID_n  analog gamepad, CONFIG_KEYPAD_GAMEPAD
+ *   HID_n  configuration, CONFIG_KEYPAD_RAW_HID
+ *
+ * With CONFIG_KEYPAD_HID_SHARED, Consumer Control, System Control, the
+ * encoder and mouse keys are report IDs of one interface instead, HID_1,
+ * see usb/hid_shared.h. scripts/usb_endpoints.py checks the endpoints of
+ * every build against the USB controller's.
+ */
+
+#ifndef KEYPAD_USB_HID_IFACE_H_
+#define KEYPAD_USB_HID_IFACE_H_
+
+#include <zephyr/zephyr.h>
+#include <zephyr/device.h>
+#include <zephyr/usb/class/usb_hid.h>
+
+#include "usb/hid_shared.h"
+
+#define HID_IFACE_KEYBOARD 0
+#if defined(CONFIG_KEYPAD_HID_SHARED)
+#define HID_IFACE_SHARED 1
+#define HID_IFACE_CONSUMER HID_IFACE_SHARED
+#define HID_IFACE_SYSTEM HID_IFACE_SHARED
+#define HID_IFACE_ENCODER HID_IFACE_SHARED
+#define HID_IFACE_MOUSE HID_IFACE_SHARED
+#define HID_IFACE_GAMEPAD (HID_IFACE_SHARED + 1)
+#else
+#define HID_IFACE_CONSUMER 1
+#define HID_IFACE_SYSTEM 2
+#define HID_IFACE_ENCODER (1 + 2 * IS_ENABLED(CONFIG_KEYPAD_HID_CONTROL))
+#define HID_IFACE_MOUSE \
+	(HID_IFACE_ENCODER + IS_ENABLED(CONFIG_KEYPAD_ENCODER))
+#define HID_IFACE_GAMEPAD \
+	(HID_IFACE_MOUSE + IS_ENABLED(CONFIG_KEYPAD_MOUSE_KEYS))
+#endif
+#define HID_IFACE_RAW \
+	(HID_IFACE_GAMEPAD + IS_ENABLED(CONFIG_KEYPAD_GAMEPAD))
+#define HID_IFACE_COUNT \
+	(HID_IFACE_RAW + IS_ENABLED(CONFIG_KEYPAD_RAW_HID))
+
+/* HID device of interface index, NULL if there is none */
+const struct device *hid_iface_get(uint8_t index);
+
+/*
+ * Set bInterval of the interrupt endpoints of a HID interface. Must be
+ * called before usb_enable(), when the descriptors are still editable.
+ */
+void hid_iface_interval_set(const struct device *dev, uint8_t ms);
+
+/*
+ * Register and start a report class on interface dev, before
+ * usb_enable(); on the shared interface under report ID id with
+ * CONFIG_KEYPAD_HID_SHARED. interval_ms 0 keeps
+ * CONFIG_USB_HID_POLL_INTERVAL_MS.
+ */
+int hid_iface_add(const struct device *dev, uint8_t id, const uint8_t *desc,
+		  size_t desc_size, const struct hid_ops *ops,
+		  uint8_t interval_ms);
+
+/* Write a report of the class added as id */
+static inline int hid_iface_write(const struct device *dev, uint8_t id,
+				  const uint8_t *report, size_t len)
+{
+	if (IS_ENABLED(CONFIG_KEYPAD_HID_SHARED)) {
+		return hid_shared_write(id, report, len);
+	}
+
+	return hid_int_ep_write(dev, report, len, NULL);
+}
+
+#endif /* KEYPAD_USB_HID_IFACE_H_ */
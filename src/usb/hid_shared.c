@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * The classes already wait for their int_in_ready before the next
+ * report, so each needs one slot and no queue: a report is copied into
+ * its class's slot with the ID in front and the endpoint, once free,
+ * takes the next slot in turn after the class it sent last. A busy
+ * mouse cannot starve a media key that way, each waits at most one
+ * report of every other class. The report descriptor is put together
+ * in RAM as the classes are added, in the order they start.
+ */
+
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/device.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/usb/class/usb_hid.h>
+
+#include "usb/hid_iface.h"
+#include "usb/hid_shared.h"
+
+LOG_MODULE_REGISTER(hid_shared, LOG_LEVEL_INF);
+
+/* Room for the descriptors of all classes */
+#define SHARED_DESC_MAX 256
+/* Report ID (8) */
+#define SHARED_REPORT_ID_ITEM 0x85
+
+struct shared_class {
+	const struct hid_ops *ops;
+	/* Report waiting for the endpoint, ID first; len 0 for none */
+	uint8_t report[1 + HID_SHARED_REPORT_MAX];
+	uint8_t len;
+};
+
+static const struct device *hid;
+static uint8_t report_desc[SHARED_DESC_MAX];
+static size_t desc_len;
+static uint8_t interval;
+
+static struct k_spinlock lock;
+static struct shared_class classes[HID_SHARED_CLASSES];
+/* Report ID on the endpoint, 0 while it is free */
+static uint8_t sending;
+/* Slot the endpoint looks at first */
+static uint8_t next;
+/* Feature report of a GET_REPORT, ID first */
+static uint8_t feature[1 + HID_SHARED_REPORT_MAX];
+
+static inline struct shared_class *shared_class_get(uint8_t id)
+{
+	if (id == 0 || id > HID_SHARED_CLASSES) {
+		return NULL;
+	}
+
+	return &classes[id - 1];
+}
+
+/*
+ * Start the next report if the endpoint is free. A write error is
+ * returned if it was the report of class id, any other class gets its
+ * int_in_ready and writes again, to be told on its own.
+ */
+static int shared_kick(uint8_t id)
+{
+	uint8_t report[1 + HID_SHARED_REPORT_MAX];
+	const struct hid_ops *ops;
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	uint8_t len = 0;
+	int ret;
+
+	for (uint8_t i = 0; sending == 0 && i < HID_SHARED_CLASSES; i++) {
+		struct shared_class *c = &classes[(next + i) %
+						  HID_SHARED_CLASSES];
+
+		if (c->len != 0) {
+			len = c->len;
+			memcpy(report, c->report, len);
+			c->len = 0;
+			sending = report[0];
+			next = sending % HID_SHARED_CLASSES;
+		}
+	}
+	k_spin_unlock(&lock, key);
+
+	if (len == 0) {
+		return 0;
+	}
+
+	ret = hid_int_ep_write(hid, report, len, NULL);
+	if (ret == 0) {
+		return 0;
+	}
+
+	key = k_spin_lock(&lock);
+	sending = 0;
+	k_spin_unlock(&lock, key);
+
+	if (report[0] == id) {
+		return ret;
+	}
+
+	ops = shared_class_get(report[0])->ops;
+	if (ops->int_in_ready != NULL) {
+		ops->int_in_ready(hid);
+	}
+
+	return 0;
+}
+
+static void shared_in_ready(const struct device *dev)
+{
+	struct shared_class *done;
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	done = shared_class_get(sending);
+	sending = 0;
+	k_spin_unlock(&lock, key);
+
+	/* The others first, the class done queues behind them */
+	(void)shared_kick(0);
+
+	if (done != NULL && done->ops->int_in_ready != NULL) {
+		done->ops->int_in_ready(dev);
+	}
+}
+
+static int shared_get_report(const struct device *dev,
+			     struct usb_setup_packet *setup, int32_t *len,
+			     uint8_t **data)
+{
+	struct shared_class *c = shared_class_get(setup->wValue & 0xFF);
+	uint8_t *report;
+	int32_t report_len;
+	int ret;
+
+	if (c == NULL || c->ops->get_report == NULL) {
+		return -ENOTSUP;
+	}
+
+	ret = c->ops->get_report(dev, setup, &report_len, &report);
+	if (ret < 0) {
+		return ret;
+	}
+
+	if (report_len > HID_SHARED_REPORT_MAX) {
+		return -ENOMEM;
+	}
+
+	feature[0] = setup->wValue & 0xFF;
+	memcpy(&feature[1], report, report_len);
+	*data = feature;
+	*len = report_len + 1;
+
+	return 0;
+}
+
+static const struct hid_ops shared_ops = {
+	.get_report = shared_get_report,
+	.int_in_ready = shared_in_ready,
+};
+
+int hid_shared_add(const struct device *dev, uint8_t id,
+		   const uint8_t *desc, size_t desc_size,
+		   const struct hid_ops *ops, uint8_t interval_ms)
+{
+	struct shared_class *c = shared_class_get(id);
+
+	if (c == NULL || c->ops != NULL) {
+		return -EINVAL;
+	}
+
+	if (desc_len + 2 + desc_size > sizeof(report_desc)) {
+		LOG_ERR("No room for the descriptor of report ID %u", id);
+		return -ENOMEM;
+	}
+
+	report_desc[desc_len++] = SHARED_REPORT_ID_ITEM;
+	report_desc[desc_len++] = id;
+	memcpy(&report_desc[desc_len], desc, desc_size);
+	desc_len += desc_size;
+
+	c->ops = ops;
+	hid = dev;
+	if (interval_ms != 0 && (interval == 0 || interval_ms < interval)) {
+		interval = interval_ms;
+	}
+
+	return 0;
+}
+
+int hid_shared_init(void)
+{
+	int ret;
+
+	if (hid == NULL) {
+		/* No class started */
+		return 0;
+	}
+
+	usb_hid_register_device(hid, report_desc, desc_len, &shared_ops);
+	if (interval != 0) {
+		hid_iface_interval_set(hid, interval);
+	}
+
+	ret = usb_hid_init(hid);
+	if (ret < 0) {
+		LOG_ERR("Failed to init shared HID, error: %d", ret);
+	}
+
+	return ret;
+}
+
+int hid_shared_write(uint8_t id, const uint8_t *report, size_t len)
+{
+	struct shared_class *c = shared_class_get(id);
+	k_spinlock_key_t key;
+
+	if (c == NULL || len == 0 || len > HID_SHARED_REPORT_MAX) {
+		return -EINVAL;
+	}
+
+	key = k_spin_lock(&lock);
+	c->report[0] = id;
+	memcpy(&c->report[1], report, len);
+	c->len = len + 1;
+	k_spin_unlock(&lock, key);
+
+	return shared_kick(id);
+}
+
+void hid_shared_reset(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	/* The classes write again from their own reset */
+	for (uint8_t i = 0; i < HID_SHARED_CLASSES; i++) {
+		classes[i].len = 0;
+	}
+	sending = 0;
+	k_spin_unlock(&lock, key);
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * One HID interface for the classes that can wait a poll: Consumer
+ * Control, System Control, the encoder and mouse keys each keep their
+ * report descriptor, prefixed with a report ID, and their reports go
+ * out on one interrupt IN endpoint with that ID in front. A class
+ * writes as it would on its own interface and gets its int_in_ready
+ * once its report is on the bus; reports of several classes take turns.
+ * The endpoint polls at the shortest interval of the classes on it.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_HID_SHARED is enabled.
+ */
+
+#ifndef KEYPAD_USB_HID_SHARED_H_
+#define KEYPAD_USB_HID_SHARED_H_
+
+#include <zephyr/zephyr.h>
+#include <zephyr/device.h>
+#include <zephyr/usb/class/usb_hid.h>
+
+/* Report IDs of the classes, 0 is no report ID */
+#define HID_SHARED_ID_CONSUMER 1
+#define HID_SHARED_ID_SYSTEM 2
+#define HID_SHARED_ID_ENCODER 3
+#define HID_SHARED_ID_MOUSE 4
+#define HID_SHARED_CLASSES 4
+
+/* Longest report of a class, without its ID */
+#define HID_SHARED_REPORT_MAX 8
+
+#if defined(CONFIG_KEYPAD_HID_SHARED)
+
+/*
+ * Add the class of report ID id on the shared interface dev, before
+ * hid_shared_init(). interval_ms 0 leaves the interval to the others.
+ */
+int hid_shared_add(const struct device *dev, uint8_t id,
+		   const uint8_t *desc, size_t desc_size,
+		   const struct hid_ops *ops, uint8_t interval_ms);
+
+/* Register the interface with every class added, before usb_enable() */
+int hid_shared_init(void);
+
+/*
+ * Queue a report of class id, sent once the endpoint is free. A class
+ * has one report queued at a time, a second one replaces the first.
+ * Returns the error of hid_int_ep_write() if it was written at once.
+ */
+int hid_shared_write(uint8_t id, const uint8_t *report, size_t len);
+
+/* Bus reset: the report on the endpoint and those queued are dropped */
+void hid_shared_reset(void);
+
+#else
+
+static inline int hid_shared_add(const struct device *dev, uint8_t id,
+				 const uint8_t *desc, size_t desc_size,
+				 const struct hid_ops *ops,
+				 uint8_t interval_ms)
+{
+	return -ENOTSUP;
+}
+
+static inline int hid_shared_init(void)
+{
+	return 0;
+}
+
+static inline int hid_shared_write(uint8_t id, const uint8_t *report,
+				   size_t len)
+{
+	return -ENOTSUP;
+}
+
+static inline void hid_shared_reset(void) {}
+
+#endif /* CONFIG_KEYPAD_HID_SHARED */
+
+#endif /* KEYPAD_USB_HID_SHARED_H_ */
@@ -0,0 +1,412 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * The MIDI interface follows the key stream with an event ring reader
+ * of its own, like lighting, so it never holds the report path back.
+ * The scan interrupt only marks events pending; the next SOF submits
+ * one batch to the system work queue, which reads what the frame
+ * collected, packs it and starts one bulk IN transfer. Events of later
+ * frames wait for that transfer to complete and go out together in
+ * the next one. A note waits at most a frame for its SOF and the host
+ * polls bulk IN in the same frame, so it is on the bus within 2 ms.
+ *
+ * Events the reader missed because the ring overwrote them may include
+ * releases, so the next batch starts with All Notes Off rather than
+ * leave a note hanging.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/usb/usb_device.h>
+
+#include "event_ring.h"
+#include "usb/midi.h"
+#include "usb/usb_state.h"
+
+#if defined(CONFIG_KEYPAD_SCAN_ANALOG)
+#include "input/analog.h"
+#endif
+
+LOG_MODULE_REGISTER(midi, LOG_LEVEL_INF);
+
+#define MIDI_IN_EP_ADDR 0x81
+
+/* Audio class subclasses and class-specific descriptor subtypes */
+#define AUDIO_SUBCLASS_CONTROL 0x01
+#define AUDIO_SUBCLASS_MIDI_STREAMING 0x03
+#define AUDIO_AC_HEADER 0x01
+#define MIDI_MS_HEADER 0x01
+#define MIDI_IN_JACK 0x02
+#define MIDI_OUT_JACK 0x03
+#define MIDI_MS_GENERAL 0x01
+#define MIDI_JACK_EMBEDDED 0x01
+#define MIDI_JACK_EXTERNAL 0x02
+
+/* The keys are an external IN jack feeding the embedded OUT jack */
+#define MIDI_JACK_KEYS 1
+#define MIDI_JACK_HOST 2
+
+/* Code Index Numbers of the event packets, cable 0 */
+#define MIDI_CIN_NOTE_OFF 0x08
+#define MIDI_CIN_NOTE_ON 0x09
+#define MIDI_CIN_CONTROL 0x0b
+
+#define MIDI_NOTE_OFF 0x80
+#define MIDI_NOTE_ON 0x90
+#define MIDI_CONTROL 0xb0
+#define MIDI_ALL_NOTES_OFF 123
+#define MIDI_RELEASE_VELOCITY 64
+
+#define MIDI_PACKET_SIZE 4
+/* Short of a full-speed packet, so no zero-length packet ends it */
+#define MIDI_BATCH_PACKETS (USB_MAX_FS_BULK_MPS / MIDI_PACKET_SIZE - 1)
+
+#define MIDI_CHANNEL (CONFIG_KEYPAD_MIDI_CHANNEL - 1)
+#define MIDI_NOTE_MAX 127
+
+struct audio_ac_header_descriptor {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint8_t bDescriptorSubtype;
+	uint16_t bcdADC;
+	uint16_t wTotalLength;
+	uint8_t bInCollection;
+	uint8_t baInterfaceNr;
+} __packed;
+
+struct midi_ms_header_descriptor {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint8_t bDescriptorSubtype;
+	uint16_t bcdMSC;
+	uint16_t wTotalLength;
+} __packed;
+
+struct midi_in_jack_descriptor {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint8_t bDescriptorSubtype;
+	uint8_t bJackType;
+	uint8_t bJackID;
+	uint8_t iJack;
+} __packed;
+
+struct midi_out_jack_descriptor {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint8_t bDescriptorSubtype;
+	uint8_t bJackType;
+	uint8_t bJackID;
+	uint8_t bNrInputPins;
+	uint8_t baSourceID;
+	uint8_t baSourcePin;
+	uint8_t iJack;
+} __packed;
+
+/* Audio class endpoints have the two synchronization bytes */
+struct midi_ep_descriptor {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint8_t bEndpointAddress;
+	uint8_t bmAttributes;
+	uint16_t wMaxPacketSize;
+	uint8_t bInterval;
+	uint8_t bRefresh;
+	uint8_t bSynchAddress;
+} __packed;
+
+struct midi_cs_ep_descriptor {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint8_t bDescriptorSubtype;
+	uint8_t bNumEmbMIDIJack;
+	uint8_t baAssocJackID;
+} __packed;
+
+struct midi_desc {
+	struct usb_if_descriptor if0;
+	struct audio_ac_header_descriptor if0_header;
+	struct usb_if_descriptor if1;
+	struct midi_ms_header_descriptor if1_header;
+	struct midi_in_jack_descriptor if1_keys_jack;
+	struct midi_out_jack_descriptor if1_host_jack;
+	struct midi_ep_descriptor if1_in_ep;
+	struct midi_cs_ep_descriptor if1_cs_in_ep;
+} __packed;
+
+/* Class-specific MIDI Streaming descriptors, wTotalLength of the header */
+#define MIDI_MS_TOTAL_LENGTH \
+	(sizeof(struct midi_desc) - offsetof(struct midi_desc, if1_header))
+
+USBD_CLASS_DESCR_DEFINE(primary, 0) struct midi_desc midi_desc = {
+	.if0 = {
+		.bLength = sizeof(struct usb_if_descriptor),
+		.bDescriptorType = USB_DESC_INTERFACE,
+		.bInterfaceNumber = 0,
+		.bAlternateSetting = 0,
+		.bNumEndpoints = 0,
+		.bInterfaceClass = USB_BCC_AUDIO,
+		.bInterfaceSubClass = AUDIO_SUBCLASS_CONTROL,
+		.bInterfaceProtocol = 0,
+		.iInterface = 0,
+	},
+	.if0_header = {
+		.bLength = sizeof(struct audio_ac_header_descriptor),
+		.bDescriptorType = USB_DESC_CS_INTERFACE,
+		.bDescriptorSubtype = AUDIO_AC_HEADER,
+		.bcdADC = sys_cpu_to_le16(0x0100),
+		.wTotalLength = sys_cpu_to_le16(
+			sizeof(struct audio_ac_header_descriptor)),
+		.bInCollection = 1,
+		.baInterfaceNr = 1,
+	},
+	.if1 = {
+		.bLength = sizeof(struct usb_if_descriptor),
+		.bDescriptorType = USB_DESC_INTERFACE,
+		.bInterfaceNumber = 1,
+		.bAlternateSetting = 0,
+		.bNumEndpoints = 1,
+		.bInterfaceClass = USB_BCC_AUDIO,
+		.bInterfaceSubClass = AUDIO_SUBCLASS_MIDI_STREAMING,
+		.bInterfaceProtocol = 0,
+		.iInterface = 0,
+	},
+	.if1_header = {
+		.bLength = sizeof(struct midi_ms_header_descriptor),
+		.bDescriptorType = USB_DESC_CS_INTERFACE,
+		.bDescriptorSubtype = MIDI_MS_HEADER,
+		.bcdMSC = sys_cpu_to_le16(0x0100),
+		.wTotalLength = sys_cpu_to_le16(MIDI_MS_TOTAL_LENGTH),
+	},
+	.if1_keys_jack = {
+		.bLength = sizeof(struct midi_in_jack_descriptor),
+		.bDescriptorType = USB_DESC_CS_INTERFACE,
+		.bDescriptorSubtype = MIDI_IN_JACK,
+		.bJackType = MIDI_JACK_EXTERNAL,
+		.bJackID = MIDI_JACK_KEYS,
+		.iJack = 0,
+	},
+	.if1_host_jack = {
+		.bLength = sizeof(struct midi_out_jack_descriptor),
+		.bDescriptorType = USB_DESC_CS_INTERFACE,
+		.bDescriptorSubtype = MIDI_OUT_JACK,
+		.bJackType = MIDI_JACK_EMBEDDED,
+		.bJackID = MIDI_JACK_HOST,
+		.bNrInputPins = 1,
+		.baSourceID = MIDI_JACK_KEYS,
+		.baSourcePin = 1,
+		.iJack = 0,
+	},
+	.if1_in_ep = {
+		.bLength = sizeof(struct midi_ep_descriptor),
+		.bDescriptorType = USB_DESC_ENDPOINT,
+		.bEndpointAddress = MIDI_IN_EP_ADDR,
+		.bmAttributes = USB_DC_EP_BULK,
+		.wMaxPacketSize = sys_cpu_to_le16(USB_MAX_FS_BULK_MPS),
+		.bInterval = 0,
+		.bRefresh = 0,
+		.bSynchAddress = 0,
+	},
+	.if1_cs_in_ep = {
+		.bLength = sizeof(struct midi_cs_ep_descriptor),
+		.bDescriptorType = USB_DESC_CS_ENDPOINT,
+		.bDescriptorSubtype = MIDI_MS_GENERAL,
+		.bNumEmbMIDIJack = 1,
+		.baAssocJackID = MIDI_JACK_HOST,
+	},
+};
+
+static struct usb_ep_cfg_data midi_ep_data[] = {
+	{
+		.ep_cb = usb_transfer_ep_callback,
+		.ep_addr = MIDI_IN_EP_ADDR,
+	},
+};
+
+static void midi_notify(void);
+
+static struct event_ring_sub sub = {
+	.name = "midi",
+	.notify = midi_notify,
+};
+static struct k_work batch_work;
+/* Events put since the last batch read the ring */
+static atomic_t pending;
+/* A transfer is on the endpoint */
+static atomic_t busy;
+/* The bus was reset, read from the events put after it */
+static atomic_t restart;
+
+/* Batch state, only touched by the batch */
+static uint32_t missed;
+static uint8_t tx_buf[MIDI_BATCH_PACKETS * MIDI_PACKET_SIZE];
+
+static uint8_t midi_velocity(uint8_t key)
+{
+#if defined(CONFIG_KEYPAD_SCAN_ANALOG)
+	uint32_t speed = analog_press_speed_get(key);
+
+	/* 1 for the slowest press, 127 from the full velocity speed on */
+	return 1 + MIN(speed * 126 / CONFIG_KEYPAD_MIDI_SPEED_FULL, 126);
+#else
+	ARG_UNUSED(key);
+
+	return CONFIG_KEYPAD_MIDI_VELOCITY;
+#endif
+}
+
+static void midi_packet_put(uint8_t *packet, uint8_t cin, uint8_t status,
+			    uint8_t data1, uint8_t data2)
+{
+	packet[0] = cin;
+	packet[1] = status | MIDI_CHANNEL;
+	packet[2] = data1;
+	packet[3] = data2;
+}
+
+static void midi_tx_done(uint8_t ep, int size, void *priv)
+{
+	atomic_set(&busy, 0);
+
+	if (atomic_get(&pending)) {
+		/* Collected while this one was on the bus */
+		k_work_submit(&batch_work);
+	}
+}
+
+static void midi_batch(struct k_work *work)
+{
+	/* One packet is kept for All Notes Off */
+	struct key_event events[MIDI_BATCH_PACKETS - 1];
+	uint8_t *packet = tx_buf;
+	size_t count;
+	int ret;
+
+	if (usb_state_get() != USB_STATE_CONFIGURED &&
+	    usb_state_get() != USB_STATE_RESUMED) {
+		return;
+	}
+
+	if (!atomic_cas(&busy, 0, 1)) {
+		/* The completion submits the next batch */
+		return;
+	}
+
+	if (atomic_cas(&restart, 1, 0)) {
+		event_ring_reader_init(&sub.reader);
+		missed = 0;
+	}
+
+	atomic_set(&pending, 0);
+	count = event_ring_read(&sub.reader, events, ARRAY_SIZE(events));
+	if (count == ARRAY_SIZE(events)) {
+		/* More than a transfer holds, the rest goes next */
+		atomic_set(&pending, 1);
+	}
+
+	if (sub.reader.missed != missed) {
+		LOG_WRN("Missed %u key events", sub.reader.missed - missed);
+		missed = sub.reader.missed;
+		midi_packet_put(packet, MIDI_CIN_CONTROL, MIDI_CONTROL,
+				MIDI_ALL_NOTES_OFF, 0);
+		packet += MIDI_PACKET_SIZE;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		uint32_t note = CONFIG_KEYPAD_MIDI_NOTE_BASE + events[i].key;
+
+		if (note > MIDI_NOTE_MAX) {
+			/* Keys past the top of the note range are silent */
+			continue;
+		}
+
+		if (events[i].pressed) {
+			midi_packet_put(packet, MIDI_CIN_NOTE_ON, MIDI_NOTE_ON,
+					note, midi_velocity(events[i].key));
+		} else {
+			midi_packet_put(packet, MIDI_CIN_NOTE_OFF,
+					MIDI_NOTE_OFF, note,
+					MIDI_RELEASE_VELOCITY);
+		}
+
+		packet += MIDI_PACKET_SIZE;
+	}
+
+	if (packet == tx_buf) {
+		atomic_set(&busy, 0);
+		return;
+	}
+
+	ret = usb_transfer(midi_ep_data[0].ep_addr, tx_buf, packet - tx_buf,
+			   USB_TRANS_WRITE, midi_tx_done, NULL);
+	if (ret < 0) {
+		LOG_ERR("MIDI write error, %d", ret);
+		atomic_set(&busy, 0);
+	}
+}
+
+/* Key events were put in the event ring */
+static void midi_notify(void)
+{
+	atomic_set(&pending, 1);
+}
+
+void midi_sof(void)
+{
+	if (atomic_get(&pending) && !atomic_get(&busy)) {
+		k_work_submit(&batch_work);
+	}
+}
+
+static void midi_status_cb(struct usb_cfg_data *cfg,
+			   enum usb_dc_status_code cb_status,
+			   const uint8_t *param)
+{
+	switch (cb_status) {
+	case USB_DC_CONFIGURED:
+	case USB_DC_RESET:
+	case USB_DC_DISCONNECTED:
+		/* The stack cancels the transfers, notes from here on */
+		atomic_set(&restart, 1);
+		atomic_set(&busy, 0);
+		break;
+	default:
+		break;
+	}
+}
+
+static void midi_interface_config(struct usb_desc_header *head,
+				  uint8_t bInterfaceNumber)
+{
+	ARG_UNUSED(head);
+
+	midi_desc.if0.bInterfaceNumber = bInterfaceNumber;
+	midi_desc.if0_header.baInterfaceNr = bInterfaceNumber + 1;
+	midi_desc.if1.bInterfaceNumber = bInterfaceNumber + 1;
+}
+
+USBD_DEFINE_CFG_DATA(midi_cfg) = {
+	.usb_device_description = NULL,
+	.interface_config = midi_interface_config,
+	.interface_descriptor = &midi_desc.if0,
+	.cb_usb_status = midi_status_cb,
+	.interface = {
+		.class_handler = NULL,
+		.custom_handler = NULL,
+		.vendor_handler = NULL,
+	},
+	.num_endpoints = ARRAY_SIZE(midi_ep_data),
+	.endpoint = midi_ep_data,
+};
+
+int midi_init(void)
+{
+	k_work_init(&batch_work, midi_batch);
+	event_ring_subscribe(&sub);
+
+	return 0;
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * USB MIDI 1.0 interface: an Audio Control interface and a MIDI
+ * Streaming interface with one bulk IN endpoint. Every key is a note,
+ * CONFIG_KEYPAD_MIDI_NOTE_BASE plus its index, played on
+ * CONFIG_KEYPAD_MIDI_CHANNEL. The events of a USB frame are packed
+ * into 4-byte event packets and written as one transfer on the next
+ * SOF, so a chord arrives in one transfer.
+ *
+ * Note-on velocity follows the travel speed of an analog key, see
+ * analog_press_speed_get(); switch keys have one contact and no press
+ * time to measure, they play at CONFIG_KEYPAD_MIDI_VELOCITY.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_MIDI is enabled.
+ */
+
+#ifndef KEYPAD_USB_MIDI_H_
+#define KEYPAD_USB_MIDI_H_
+
+#include <zephyr/zephyr.h>
+
+#if defined(CONFIG_KEYPAD_MIDI)
+
+/* Start following the key events, call before usb_enable() */
+int midi_init(void);
+
+/* Start of frame, from the device status callback */
+void midi_sof(void);
+
+#else
+
+static inline int midi_init(void)
+{
+	return 0;
+}
+
+static inline void midi_sof(void) {}
+
+#endif /* CONFIG_KEYPAD_MIDI */
+
+#endif /* KEYPAD_USB_MIDI_H_ */
@@ -0,0 +1,264 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * The mouse endpoint paces itself: every IN completion runs one tick on
+ * the system work queue, which reads the held keys once, advances the
+ * motion by the time since the previous tick and writes the next
+ * report. The cost per tick is the same however many keys are held,
+ * and there are no ticks while nothing moves.
+ *
+ * Speed follows a quadratic ease-in, in Q16, from
+ * CONFIG_KEYPAD_MOUSE_SPEED_MIN to _MAX over
+ * CONFIG_KEYPAD_MOUSE_TIME_TO_MAX_MS after CONFIG_KEYPAD_MOUSE_DELAY_MS.
+ * Distances are kept in Q8 pixels and the fraction left after rounding
+ * to whole counts carries into the next report, so slow motion is
+ * smooth and the average speed exact at any polling interval.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/usb/class/usb_hid.h>
+
+#include "usb/hid_iface.h"
+#include "usb/mouse.h"
+
+LOG_MODULE_REGISTER(mouse, LOG_LEVEL_INF);
+
+#define MOUSE_BUTTONS 5
+#define MOUSE_BUTTON_FIRST MOUSE_BUTTON(1)
+
+#define MOUSE_MOTION_KEYS \
+	(BIT(MOUSE_UP) | BIT(MOUSE_DOWN) | BIT(MOUSE_LEFT) | BIT(MOUSE_RIGHT))
+#define MOUSE_WHEEL_KEYS (BIT(MOUSE_WHEEL_UP) | BIT(MOUSE_WHEEL_DOWN))
+
+/* 1/sqrt(2) in Q8, diagonal motion keeps the straight line speed */
+#define MOUSE_DIAGONAL_Q8 181
+
+/* Longest time a tick accounts for, in poll intervals */
+#define MOUSE_MAX_TICK_POLLS 4
+
+static const uint8_t mouse_report_desc[] = {
+	HID_USAGE_PAGE(HID_USAGE_GEN_DESKTOP),
+	HID_USAGE(HID_USAGE_GEN_DESKTOP_MOUSE),
+	HID_COLLECTION(HID_COLLECTION_APPLICATION),
+		HID_USAGE(HID_USAGE_GEN_DESKTOP_POINTER),
+		HID_COLLECTION(HID_COLLECTION_PHYSICAL),
+			HID_USAGE_PAGE(HID_USAGE_GEN_BUTTON),
+			HID_USAGE_MIN8(1),
+			HID_USAGE_MAX8(MOUSE_BUTTONS),
+			HID_LOGICAL_MIN8(0),
+			HID_LOGICAL_MAX8(1),
+			HID_REPORT_SIZE(1),
+			HID_REPORT_COUNT(MOUSE_BUTTONS),
+			/* Data,Var,Abs */
+			HID_INPUT(0x02),
+			HID_REPORT_SIZE(8 - MOUSE_BUTTONS),
+			HID_REPORT_COUNT(1),
+			/* Cnst,Array,Abs */
+			HID_INPUT(0x03),
+			HID_USAGE_PAGE(HID_USAGE_GEN_DESKTOP),
+			HID_USAGE(HID_USAGE_GEN_DESKTOP_X),
+			HID_USAGE(HID_USAGE_GEN_DESKTOP_Y),
+			HID_USAGE(HID_USAGE_GEN_DESKTOP_WHEEL),
+			HID_LOGICAL_MIN8(-127),
+			HID_LOGICAL_MAX8(127),
+			HID_REPORT_SIZE(8),
+			HID_REPORT_COUNT(3),
+			/* Data,Var,Rel */
+			HID_INPUT(0x06),
+		HID_END_COLLECTION,
+	HID_END_COLLECTION,
+};
+
+struct mouse_axis {
+	/* Q8 counts not reported yet */
+	int32_t rem_q8;
+};
+
+static const struct device *hid;
+static struct k_work tick_work;
+static atomic_t in_flight;
+/* BIT(code) of every held LAYER_MOUSE() key */
+static atomic_t held;
+
+/* Tick state, only touched by the tick */
+static bool moving;
+static uint32_t motion_start;
+static uint32_t last_tick;
+static uint8_t sent_buttons;
+static struct mouse_axis axis_x, axis_y, axis_wheel;
+
+/* Speed after held_ms on the acceleration curve, same unit as min/max */
+static uint32_t mouse_speed(uint32_t held_ms, uint32_t min, uint32_t max)
+{
+	uint32_t t;
+	uint32_t f;
+
+	if (held_ms <= CONFIG_KEYPAD_MOUSE_DELAY_MS) {
+		return min;
+	}
+
+	t = MIN(held_ms - CONFIG_KEYPAD_MOUSE_DELAY_MS,
+		CONFIG_KEYPAD_MOUSE_TIME_TO_MAX_MS);
+	f = ((uint64_t)t << 16) / CONFIG_KEYPAD_MOUSE_TIME_TO_MAX_MS;
+	f = ((uint64_t)f * f) >> 16;
+
+	return min + (uint32_t)(((uint64_t)(max - min) * f) >> 16);
+}
+
+/* Move by dir * step_q8, returns the whole counts to report */
+static int8_t mouse_axis_move(struct mouse_axis *axis, int dir,
+			      uint32_t step_q8)
+{
+	int32_t out;
+
+	if (dir == 0) {
+		/* No drift from a fraction left by a released key */
+		axis->rem_q8 = 0;
+		return 0;
+	}
+
+	axis->rem_q8 += dir * (int32_t)step_q8;
+	out = CLAMP(axis->rem_q8 / 256, -127, 127);
+	axis->rem_q8 -= out * 256;
+
+	return out;
+}
+
+static inline int mouse_dir(uint32_t keys, uint8_t pos, uint8_t neg)
+{
+	return !!(keys & BIT(pos)) - !!(keys & BIT(neg));
+}
+
+static void mouse_tick(struct k_work *work)
+{
+	uint32_t keys = atomic_get(&held);
+	uint32_t now = k_cycle_get_32();
+	uint8_t buttons = (keys >> MOUSE_BUTTON_FIRST) & BIT_MASK(MOUSE_BUTTONS);
+	uint8_t report[4];
+	int ret;
+
+	if (!atomic_cas(&in_flight, 0, 1)) {
+		/* The IN completion runs the next tick */
+		return;
+	}
+
+	if ((keys & (MOUSE_MOTION_KEYS | MOUSE_WHEEL_KEYS)) == 0) {
+		moving = false;
+		memset(report, 0, sizeof(report));
+	} else {
+		uint32_t dt_us = CONFIG_KEYPAD_MOUSE_POLL_MS * USEC_PER_MSEC;
+		uint32_t held_ms;
+		uint32_t step_q8;
+		int dx = mouse_dir(keys, MOUSE_RIGHT, MOUSE_LEFT);
+		int dy = mouse_dir(keys, MOUSE_DOWN, MOUSE_UP);
+
+		if (!moving) {
+			/* First tick moves by one poll interval */
+			moving = true;
+			motion_start = now;
+		} else {
+			dt_us = MIN(k_cyc_to_us_floor32(now - last_tick),
+				    MOUSE_MAX_TICK_POLLS * dt_us);
+		}
+
+		held_ms = k_cyc_to_ms_floor32(now - motion_start);
+
+		step_q8 = ((uint64_t)mouse_speed(held_ms,
+						 CONFIG_KEYPAD_MOUSE_SPEED_MIN,
+						 CONFIG_KEYPAD_MOUSE_SPEED_MAX) *
+			   dt_us * 256) / USEC_PER_SEC;
+		if (dx != 0 && dy != 0) {
+			step_q8 = step_q8 * MOUSE_DIAGONAL_Q8 / 256;
+		}
+
+		report[1] = mouse_axis_move(&axis_x, dx, step_q8);
+		report[2] = mouse_axis_move(&axis_y, dy, step_q8);
+
+		step_q8 = ((uint64_t)mouse_speed(held_ms,
+					CONFIG_KEYPAD_MOUSE_WHEEL_SPEED_MIN,
+					CONFIG_KEYPAD_MOUSE_WHEEL_SPEED_MAX) *
+			   dt_us * 256) / USEC_PER_SEC;
+		report[3] = mouse_axis_move(&axis_wheel,
+					    mouse_dir(keys, MOUSE_WHEEL_UP,
+						      MOUSE_WHEEL_DOWN),
+					    step_q8);
+	}
+
+	last_tick = now;
+	report[0] = buttons;
+
+	if (!moving && buttons == sent_buttons) {
+		/* Nothing to say, the next key change starts a tick */
+		atomic_set(&in_flight, 0);
+		return;
+	}
+
+	/* While moving, zero steps are sent too: they keep the ticks going */
+	ret = hid_iface_write(hid, HID_SHARED_ID_MOUSE, report,
+			      sizeof(report));
+	if (ret) {
+		LOG_ERR("Mouse HID write error, %d", ret);
+		atomic_set(&in_flight, 0);
+		return;
+	}
+
+	sent_buttons = buttons;
+}
+
+static void mouse_in_ready(const struct device *dev)
+{
+	atomic_set(&in_flight, 0);
+	k_work_submit(&tick_work);
+}
+
+static const struct hid_ops mouse_ops = {
+	.int_in_ready = mouse_in_ready,
+};
+
+int mouse_init(void)
+{
+	int ret;
+
+	hid = hid_iface_get(HID_IFACE_MOUSE);
+	if (hid == NULL) {
+		LOG_ERR("Cannot get USB HID Device for mouse keys");
+		return -ENODEV;
+	}
+
+	k_work_init(&tick_work, mouse_tick);
+
+	ret = hid_iface_add(hid, HID_SHARED_ID_MOUSE, mouse_report_desc,
+			    sizeof(mouse_report_desc), &mouse_ops,
+			    CONFIG_KEYPAD_MOUSE_POLL_MS);
+	if (ret < 0) {
+		LOG_ERR("Failed to init mouse HID, error: %d", ret);
+	}
+
+	return ret;
+}
+
+void mouse_reset(void)
+{
+	/* A transfer queued before a bus reset never completes */
+	atomic_set(&in_flight, 0);
+	k_work_submit(&tick_work);
+}
+
+void mouse_key_set(uint8_t code, bool pressed)
+{
+	if (code >= MOUSE_BUTTON_FIRST + MOUSE_BUTTONS) {
+		return;
+	}
+
+	if (pressed) {
+		atomic_or(&held, BIT(code));
+	} else {
+		atomic_and(&held, ~BIT(code));
+	}
+
+	k_work_submit(&tick_work);
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Mouse keys on a HID mouse interface of their own. Keys only set or
+ * clear bits in the held state; cursor and wheel motion are computed
+ * once per poll of the mouse endpoint from the time the direction keys
+ * have been held, along a fixed-point acceleration curve.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_MOUSE_KEYS is enabled.
+ */
+
+#ifndef KEYPAD_USB_MOUSE_H_
+#define KEYPAD_USB_MOUSE_H_
+
+#include <zephyr/zephyr.h>
+#include <dt-bindings/keypad/layers.h>
+
+#if defined(CONFIG_KEYPAD_MOUSE_KEYS)
+
+/* Registers the mouse HID interface, call before usb_enable() */
+int mouse_init(void);
+
+/* Forget the in-flight report after a bus reset or reconfiguration */
+void mouse_reset(void);
+
+/* LAYER_MOUSE() code pressed or released */
+void mouse_key_set(uint8_t code, bool pressed);
+
+#else
+
+static inline int mouse_init(void)
+{
+	return 0;
+}
+
+static inline void mouse_reset(void) {}
+static inline void mouse_key_set(uint8_t code, bool pressed) {}
+
+#endif /* CONFIG_KEYPAD_MOUSE_KEYS */
+
+#endif /* KEYPAD_USB_MOUSE_H_ */
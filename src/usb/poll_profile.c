@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * A switch runs as two steps on the system work queue. The detach
+ * disables the device stack, which pulls D+ low, and tells the device
+ * status callback the bus is gone, so the state machine and every
+ * interface drop their transfers as on a real unplug; the descriptor
+ * is rewritten while nothing reads it. The attach enables the stack
+ * again CONFIG_KEYPAD_POLL_PROFILE_DETACH_MS later, long enough for
+ * the hub to see the disconnect, and the host enumerates the new
+ * bInterval. The report scheduler restarts its poll period estimate
+ * from the new profile.
+ */
+
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/device.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/usb/usb_device.h>
+
+#include "config/config_store.h"
+#include "report_sched.h"
+#include "usb/hid_iface.h"
+#include "usb/poll_profile.h"
+
+LOG_MODULE_REGISTER(poll_profile, LOG_LEVEL_INF);
+
+static const uint8_t interval_ms[POLL_PROFILE_COUNT] = {
+	[POLL_PROFILE_GAMING] = 1,
+	[POLL_PROFILE_BALANCED] = 4,
+	[POLL_PROFILE_LOW_POWER] = 10,
+};
+
+static const char *const names[POLL_PROFILE_COUNT] = {
+	[POLL_PROFILE_GAMING] = "gaming",
+	[POLL_PROFILE_BALANCED] = "balanced",
+	[POLL_PROFILE_LOW_POWER] = "low-power",
+};
+
+static const struct device *keyboard;
+static usb_dc_status_callback status_fn;
+static uint8_t profile =
+	IS_ENABLED(CONFIG_KEYPAD_POLL_LOW_POWER) ? POLL_PROFILE_LOW_POWER :
+	IS_ENABLED(CONFIG_KEYPAD_POLL_BALANCED) ? POLL_PROFILE_BALANCED :
+	POLL_PROFILE_GAMING;
+/* A switch is between its request and the attach */
+static atomic_t switching;
+static uint32_t switches;
+
+static void poll_profile_detach(struct k_work *work);
+static void poll_profile_attach(struct k_work *work);
+
+static K_WORK_DELAYABLE_DEFINE(detach_work, poll_profile_detach);
+static K_WORK_DELAYABLE_DEFINE(attach_work, poll_profile_attach);
+
+#if defined(CONFIG_KEYPAD_CONFIG_STORE)
+static ssize_t poll_profile_store_get(void *buf, size_t size)
+{
+	*(uint8_t *)buf = profile;
+
+	return sizeof(profile);
+}
+
+static int poll_profile_store_set(const void *data, size_t len)
+{
+	uint8_t stored = *(const uint8_t *)data;
+
+	if (len != sizeof(profile) || stored >= POLL_PROFILE_COUNT) {
+		return -EINVAL;
+	}
+
+	profile = stored;
+
+	return 0;
+}
+#endif /* CONFIG_KEYPAD_CONFIG_STORE */
+
+static struct config_entry poll_profile_entry = {
+	.name = "keypad/poll",
+#if defined(CONFIG_KEYPAD_CONFIG_STORE)
+	.get = poll_profile_store_get,
+	.set = poll_profile_store_set,
+#endif
+};
+
+static void poll_profile_apply(void)
+{
+	hid_iface_interval_set(keyboard, interval_ms[profile]);
+	report_sched_poll_interval_set(interval_ms[profile] * USEC_PER_MSEC);
+}
+
+static void poll_profile_detach(struct k_work *work)
+{
+	int ret;
+
+	ret = usb_disable();
+	if (ret < 0) {
+		LOG_ERR("Failed to detach, error: %d", ret);
+		atomic_set(&switching, 0);
+		return;
+	}
+
+	/* The stack reports nothing once disabled */
+	status_fn(USB_DC_DISCONNECTED, NULL);
+	poll_profile_apply();
+
+	k_work_schedule(&attach_work,
+			K_MSEC(CONFIG_KEYPAD_POLL_PROFILE_DETACH_MS));
+}
+
+static void poll_profile_attach(struct k_work *work)
+{
+	int ret;
+
+	ret = usb_enable(status_fn);
+	if (ret < 0) {
+		LOG_ERR("Failed to attach, error: %d", ret);
+	} else {
+		LOG_INF("Polling every %u ms", interval_ms[profile]);
+	}
+
+	atomic_set(&switching, 0);
+}
+
+int poll_profile_init(const struct device *hid,
+		      usb_dc_status_callback status)
+{
+	keyboard = hid;
+	status_fn = status;
+
+	if (config_store_register(&poll_profile_entry) < 0) {
+		LOG_WRN("Stored polling profile not loaded");
+	}
+
+	poll_profile_apply();
+
+	return 0;
+}
+
+int poll_profile_set(enum poll_profile next)
+{
+	if (next >= POLL_PROFILE_COUNT) {
+		return -EINVAL;
+	}
+
+	if (!atomic_cas(&switching, 0, 1)) {
+		return -EBUSY;
+	}
+
+	if (next == profile) {
+		atomic_set(&switching, 0);
+		return 0;
+	}
+
+	profile = next;
+	switches++;
+	config_store_changed(&poll_profile_entry);
+	/* Now, a host may power the port down once it sees the detach */
+	config_store_flush();
+
+	k_work_schedule(&detach_work,
+			K_MSEC(CONFIG_KEYPAD_POLL_PROFILE_SETTLE_MS));
+
+	return 0;
+}
+
+enum poll_profile poll_profile_get(void)
+{
+	return profile;
+}
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static int cmd_poll_show(const struct shell *sh, size_t argc, char **argv)
+{
+	shell_print(sh, "%s, %u ms, %u switches%s", names[profile],
+		    interval_ms[profile], switches,
+		    atomic_get(&switching) ? ", switching" : "");
+
+	return 0;
+}
+
+static int cmd_poll_set(const struct shell *sh, size_t argc, char **argv)
+{
+	int ret = -EINVAL;
+
+	for (size_t i = 0; i < POLL_PROFILE_COUNT; i++) {
+		if (strcmp(argv[1], names[i]) == 0) {
+			ret = poll_profile_set(i);
+			break;
+		}
+	}
+
+	if (ret < 0) {
+		shell_error(sh, "Failed to switch profile, error: %d", ret);
+	}
+
+	return ret;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_poll,
+	SHELL_CMD(show, NULL, "Print the polling profile", cmd_poll_show),
+	SHELL_CMD_ARG(set, NULL,
+		      "Switch and re-enumerate: <gaming|balanced|low-power>",
+		      cmd_poll_set, 2, 0),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(poll, &sub_poll, "Keyboard polling profile", NULL);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Keyboard polling profile chosen at runtime. The profile sets the
+ * bInterval of the keyboard endpoint, which the host only reads while
+ * enumerating, so a change detaches from the bus, rewrites the
+ * descriptor and attaches again. The choice is kept in the config
+ * store and applied before the first enumeration after a reboot.
+ *
+ * The key state is untouched by the re-enumeration: the scan keeps
+ * running while detached, and the first report after the host
+ * configured the device again carries whatever is held by then.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_POLL_PROFILE_SWITCH is
+ * enabled.
+ */
+
+#ifndef KEYPAD_USB_POLL_PROFILE_H_
+#define KEYPAD_USB_POLL_PROFILE_H_
+
+#include <zephyr/zephyr.h>
+#include <zephyr/device.h>
+#include <zephyr/usb/usb_device.h>
+
+enum poll_profile {
+	/* 1 ms */
+	POLL_PROFILE_GAMING,
+	/* 4 ms */
+	POLL_PROFILE_BALANCED,
+	/* 10 ms */
+	POLL_PROFILE_LOW_POWER,
+	POLL_PROFILE_COUNT,
+};
+
+#if defined(CONFIG_KEYPAD_POLL_PROFILE_SWITCH)
+
+/*
+ * Apply the stored profile to the keyboard interface hid, call before
+ * usb_enable(). status is the device status callback, passed to
+ * usb_enable() again when attaching after a change.
+ */
+int poll_profile_init(const struct device *hid,
+		      usb_dc_status_callback status);
+
+/*
+ * Switch to profile: store it and re-enumerate with its bInterval
+ * after CONFIG_KEYPAD_POLL_PROFILE_SETTLE_MS, so an answer to the
+ * request still goes out. -EINVAL for an unknown profile, -EBUSY
+ * while a switch is in progress.
+ */
+int poll_profile_set(enum poll_profile profile);
+
+enum poll_profile poll_profile_get(void);
+
+#else
+
+static inline int poll_profile_init(const struct device *hid,
+				    usb_dc_status_callback status)
+{
+	return 0;
+}
+
+static inline int poll_profile_set(enum poll_profile profile)
+{
+	return -ENOTSUP;
+}
+
+#endif /* CONFIG_KEYPAD_POLL_PROFILE_SWITCH */
+
+#endif /* KEYPAD_USB_POLL_PROFILE_H_ */
@@ -0,0 +1,550 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Output reports are handled as they are read, in the OUT completion,
+ * and their payload handed to upload.c as it comes. The USB stack NAKs
+ * the OUT endpoint until a report has been read, which is all the flow
+ * control the stream needs. Acks are written from the system work
+ * queue and only the latest one matters, like the control interfaces'
+ * reports.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/usb/class/usb_hid.h>
+
+#include "upload.h"
+#include "config/profile_cache.h"
+#include "diag/batch.h"
+#include "diag/factory.h"
+#include "diag/inject.h"
+#include "diag/journal.h"
+#include "diag/loopback.h"
+#include "diag/seqtrace.h"
+#include "diag/stamps.h"
+#include "diag/telemetry.h"
+#include "diag/thread_mon.h"
+#include "diag/typing.h"
+#include "diag/upload_bench.h"
+#include "diag/usage.h"
+#include "led/led_rgb.h"
+#include "usb/hid_iface.h"
+#include "usb/poll_profile.h"
+#include "usb/raw_hid.h"
+
+LOG_MODULE_REGISTER(raw_hid, LOG_LEVEL_INF);
+
+#define RAW_HID_USAGE_PAGE 0xFF60
+#define RAW_HID_USAGE 0x61
+
+#define RAW_HID_WINDOW CONFIG_KEYPAD_RAW_HID_WINDOW
+
+BUILD_ASSERT(RAW_HID_REPORT_SIZE <= CONFIG_HID_INTERRUPT_EP_MPS,
+	     "configuration report does not fit the interrupt endpoint");
+
+static const uint8_t raw_hid_report_desc[] = {
+	HID_ITEM(HID_ITEM_TAG_USAGE_PAGE, HID_ITEM_TYPE_GLOBAL, 2),
+	RAW_HID_USAGE_PAGE & 0xFF, RAW_HID_USAGE_PAGE >> 8,
+	HID_USAGE(RAW_HID_USAGE),
+	HID_COLLECTION(HID_COLLECTION_APPLICATION),
+		HID_LOGICAL_MIN8(0),
+		HID_LOGICAL_MAX16(0xFF, 0x00),
+		HID_REPORT_SIZE(8),
+		HID_REPORT_COUNT(RAW_HID_REPORT_SIZE),
+		HID_USAGE(RAW_HID_USAGE),
+		/* Data,Var,Abs */
+		HID_INPUT(0x02),
+		HID_USAGE(RAW_HID_USAGE),
+		/* Data,Var,Abs */
+		HID_OUTPUT(0x02),
+	HID_END_COLLECTION,
+};
+
+static const struct device *hid;
+static struct k_work ack_work;
+static atomic_t in_flight;
+/* An ack with the current state has not been written yet */
+static atomic_t dirty;
+
+static struct k_spinlock lock;
+/* Sticky until written, so an error is never replaced by a later OK */
+static uint8_t ack_status;
+static uint8_t expected;
+
+/* DATA reports since the last ack */
+static uint8_t since_ack;
+
+/* Read asked for, answered with the next ack; 0 for none */
+static uint8_t read_cmd;
+static uint8_t read_which;
+static uint16_t read_offset;
+
+static void raw_hid_ack(uint8_t status)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	if (ack_status == UPLOAD_STATUS_OK) {
+		ack_status = status;
+	}
+
+	k_spin_unlock(&lock, key);
+
+	since_ack = 0;
+	atomic_set(&dirty, 1);
+	k_work_submit(&ack_work);
+}
+
+static void raw_hid_send(struct k_work *work)
+{
+	uint8_t report[RAW_HID_REPORT_SIZE] = { 0 };
+	k_spinlock_key_t key;
+	uint8_t cmd;
+	int ret;
+
+	if (!atomic_cas(&in_flight, 0, 1)) {
+		/* The IN completion submits us again */
+		return;
+	}
+
+	if (!atomic_cas(&dirty, 1, 0)) {
+		/* Acks first, stamps and batches in the gaps between them */
+		if (stamps_read(report, sizeof(report)) == 0 &&
+		    batch_read(report, sizeof(report)) == 0) {
+			atomic_set(&in_flight, 0);
+			return;
+		}
+
+		ret = hid_int_ep_write(hid, report, sizeof(report), NULL);
+		if (ret) {
+			LOG_ERR("Raw HID write error, %d", ret);
+			atomic_set(&in_flight, 0);
+		}
+		return;
+	}
+
+	key = k_spin_lock(&lock);
+	report[0] = ack_status;
+	report[1] = expected;
+	report[2] = RAW_HID_WINDOW;
+	ack_status = UPLOAD_STATUS_OK;
+	if (read_cmd == RAW_HID_CMD_JOURNAL) {
+		report[3] = journal_read(read_which, read_offset, &report[4],
+					 sizeof(report) - 4);
+	} else if (read_cmd == RAW_HID_CMD_USAGE) {
+		report[3] = usage_read(read_offset, &report[4],
+				       sizeof(report) - 4);
+	} else if (read_cmd == RAW_HID_CMD_THREADS) {
+		report[3] = thread_mon_read(read_offset, &report[4],
+					    sizeof(report) - 4);
+	} else if (read_cmd == RAW_HID_CMD_SEQ) {
+		report[3] = seqtrace_read(read_offset, &report[4],
+					  sizeof(report) - 4);
+	} else if (read_cmd == RAW_HID_CMD_LOOPBACK) {
+		report[3] = loopback_read(&report[4], sizeof(report) - 4);
+	} else if (read_cmd == RAW_HID_CMD_FACTORY) {
+		report[3] = factory_read(&report[4], sizeof(report) - 4);
+	} else if (read_cmd == RAW_HID_CMD_INJECT) {
+		report[3] = inject_read(&report[4], sizeof(report) - 4);
+	} else if (read_cmd == RAW_HID_CMD_BENCH) {
+		report[3] = upload_bench_read(&report[4], sizeof(report) - 4);
+	} else if (read_cmd == RAW_HID_CMD_TYPING) {
+		report[3] = typing_read(read_offset, read_which != 0,
+					&report[4], sizeof(report) - 4);
+	}
+	cmd = read_cmd;
+	read_cmd = 0;
+	k_spin_unlock(&lock, key);
+
+	if (cmd == RAW_HID_CMD_MEMFAULT) {
+		/* The SDK takes a mutex, so not under the lock */
+		report[3] = telemetry_chunk_read(&report[4],
+						 sizeof(report) - 4);
+	}
+
+	ret = hid_int_ep_write(hid, report, sizeof(report), NULL);
+	if (ret) {
+		LOG_ERR("Raw HID write error, %d", ret);
+		atomic_set(&in_flight, 0);
+	}
+}
+
+/* The report of a loopback event is done, echo its token */
+static void raw_hid_echo(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	read_cmd = RAW_HID_CMD_LOOPBACK;
+	k_spin_unlock(&lock, key);
+
+	raw_hid_ack(UPLOAD_STATUS_OK);
+}
+
+/* The factory test is done, answer with its result */
+static void raw_hid_factory_done(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	read_cmd = RAW_HID_CMD_FACTORY;
+	k_spin_unlock(&lock, key);
+
+	raw_hid_ack(UPLOAD_STATUS_OK);
+}
+
+/* Stamps of a done keyboard report or a batch can be read */
+static void raw_hid_data_ready(void)
+{
+	k_work_submit(&ack_work);
+}
+
+/* A synced lighting frame is on the LEDs */
+static void raw_hid_rgb_shown(void)
+{
+	raw_hid_ack(UPLOAD_STATUS_OK);
+}
+
+static int raw_hid_rgb(const uint8_t *payload, uint32_t len)
+{
+	int ret;
+
+	if (len < 3) {
+		return -EINVAL;
+	}
+
+	ret = led_rgb_stream_write(RAW_HID_RGB_FORMAT_GET(payload[2]),
+				   payload[0], payload[1], &payload[3],
+				   len - 3);
+	if (ret == 0 && (payload[2] & RAW_HID_RGB_SYNC)) {
+		ret = led_rgb_stream_sync(raw_hid_rgb_shown);
+		/* Acked from the vsync */
+		return ret == 0 ? 1 : ret;
+	}
+
+	return ret;
+}
+
+static void raw_hid_out_ready(const struct device *dev)
+{
+	uint8_t buf[RAW_HID_REPORT_SIZE];
+	k_spinlock_key_t key;
+	uint8_t status;
+	uint32_t len;
+	int ret;
+
+	ret = hid_int_ep_read(dev, buf, sizeof(buf), &len);
+	if (ret < 0 || len < 2) {
+		return;
+	}
+
+	if (buf[0] == RAW_HID_CMD_BEGIN) {
+		/* A new upload starts a new sequence */
+		expected = buf[1];
+	}
+
+	if (buf[1] != expected) {
+		/* Go back: the host resends from the ack */
+		raw_hid_ack(UPLOAD_STATUS_SEQUENCE);
+		return;
+	}
+
+	expected++;
+
+	switch (buf[0]) {
+	case RAW_HID_CMD_BEGIN:
+		status = len < 5 ? UPLOAD_STATUS_INVALID :
+				   upload_begin(&hid, buf[2],
+						sys_get_le16(&buf[3]));
+		break;
+	case RAW_HID_CMD_DATA:
+		status = upload_data(&hid, &buf[2], len - 2);
+		if (status == UPLOAD_STATUS_OK &&
+		    ++since_ack < RAW_HID_WINDOW / 2) {
+			return;
+		}
+		break;
+	case RAW_HID_CMD_CHECK:
+		status = len < 6 ? UPLOAD_STATUS_INVALID :
+				   upload_check(&hid, sys_get_le32(&buf[2]));
+		break;
+	case RAW_HID_CMD_END:
+		status = upload_end(&hid);
+		break;
+	case RAW_HID_CMD_ABORT:
+		upload_abort(&hid);
+		status = UPLOAD_STATUS_OK;
+		break;
+	case RAW_HID_CMD_JOURNAL:
+	case RAW_HID_CMD_USAGE:
+	case RAW_HID_CMD_THREADS:
+	case RAW_HID_CMD_MEMFAULT:
+	case RAW_HID_CMD_SEQ:
+	case RAW_HID_CMD_TYPING:
+		if ((buf[0] == RAW_HID_CMD_JOURNAL &&
+		     !IS_ENABLED(CONFIG_KEYPAD_JOURNAL)) ||
+		    (buf[0] == RAW_HID_CMD_USAGE &&
+		     !IS_ENABLED(CONFIG_KEYPAD_USAGE)) ||
+		    (buf[0] == RAW_HID_CMD_THREADS &&
+		     !IS_ENABLED(CONFIG_KEYPAD_THREAD_MON)) ||
+		    (buf[0] == RAW_HID_CMD_MEMFAULT &&
+		     !IS_ENABLED(CONFIG_KEYPAD_MEMFAULT)) ||
+		    (buf[0] == RAW_HID_CMD_SEQ &&
+		     !IS_ENABLED(CONFIG_KEYPAD_SEQ_TRACE)) ||
+		    (buf[0] == RAW_HID_CMD_TYPING &&
+		     !IS_ENABLED(CONFIG_KEYPAD_TYPING))) {
+			status = UPLOAD_STATUS_UNSUPPORTED;
+			break;
+		}
+
+		if (len < 5) {
+			status = UPLOAD_STATUS_INVALID;
+			break;
+		}
+
+		key = k_spin_lock(&lock);
+		read_cmd = buf[0];
+		read_which = buf[2];
+		read_offset = sys_get_le16(&buf[3]);
+		k_spin_unlock(&lock, key);
+
+		/* Not an upload command, leave one in progress alone */
+		raw_hid_ack(UPLOAD_STATUS_OK);
+		return;
+	case RAW_HID_CMD_LOOPBACK:
+		if (!IS_ENABLED(CONFIG_KEYPAD_LOOPBACK)) {
+			status = UPLOAD_STATUS_UNSUPPORTED;
+			break;
+		}
+
+		ret = len < 8 ? -EINVAL :
+		      loopback_inject(buf[2], buf[3] != 0,
+				      sys_get_le32(&buf[4]), raw_hid_echo);
+		if (ret == 0) {
+			/* Acked with the echo once the report is done */
+			return;
+		}
+
+		raw_hid_ack(ret == -EINVAL ? UPLOAD_STATUS_INVALID :
+					     UPLOAD_STATUS_BUSY);
+		return;
+	case RAW_HID_CMD_STAMPS:
+		if (!IS_ENABLED(CONFIG_KEYPAD_EVENT_STAMPS)) {
+			status = UPLOAD_STATUS_UNSUPPORTED;
+			break;
+		}
+
+		if (len < 3) {
+			status = UPLOAD_STATUS_INVALID;
+			break;
+		}
+
+		stamps_enable(buf[2] != 0 ? raw_hid_data_ready : NULL);
+
+		/* Not an upload command, leave one in progress alone */
+		raw_hid_ack(UPLOAD_STATUS_OK);
+		return;
+	case RAW_HID_CMD_BATCH:
+		if (!IS_ENABLED(CONFIG_KEYPAD_EVENT_BATCH)) {
+			status = UPLOAD_STATUS_UNSUPPORTED;
+			break;
+		}
+
+		if (len < 3) {
+			status = UPLOAD_STATUS_INVALID;
+			break;
+		}
+
+		batch_enable(buf[2] != 0 ? raw_hid_data_ready : NULL);
+
+		/* Not an upload command, leave one in progress alone */
+		raw_hid_ack(UPLOAD_STATUS_OK);
+		return;
+	case RAW_HID_CMD_APP:
+		if (!IS_ENABLED(CONFIG_KEYPAD_PROFILE_CACHE)) {
+			status = UPLOAD_STATUS_UNSUPPORTED;
+			break;
+		}
+
+		ret = len < 3 ? -EINVAL : profile_cache_select(buf[2]);
+
+		/* Not an upload command, leave one in progress alone */
+		raw_hid_ack(ret == 0 ? UPLOAD_STATUS_OK :
+			    ret == -EBUSY ? UPLOAD_STATUS_BUSY :
+			    UPLOAD_STATUS_INVALID);
+		return;
+	case RAW_HID_CMD_FACTORY:
+		if (!IS_ENABLED(CONFIG_KEYPAD_FACTORY_TEST)) {
+			status = UPLOAD_STATUS_UNSUPPORTED;
+			break;
+		}
+
+		if (len < 3 || (buf[2] != 0 && len < 5)) {
+			status = UPLOAD_STATUS_INVALID;
+			break;
+		}
+
+		if (buf[2] == 0) {
+			raw_hid_factory_done();
+			return;
+		}
+
+		ret = factory_start(sys_get_le16(&buf[3]),
+				    raw_hid_factory_done);
+		if (ret == 0) {
+			/* Acked with the result once the test is done */
+			return;
+		}
+
+		raw_hid_ack(UPLOAD_STATUS_BUSY);
+		return;
+	case RAW_HID_CMD_INJECT:
+		if (!IS_ENABLED(CONFIG_KEYPAD_INJECT)) {
+			status = UPLOAD_STATUS_UNSUPPORTED;
+			break;
+		}
+
+		if (len < 4 || buf[3] > RAW_HID_INJECT_MAX ||
+		    len < 4 + buf[3] * INJECT_RECORD_SIZE) {
+			status = UPLOAD_STATUS_INVALID;
+			break;
+		}
+
+		if (buf[2] & RAW_HID_INJECT_STOP) {
+			inject_stop();
+		}
+
+		ret = inject_queue(&buf[4], buf[3]);
+		if (ret == -ENOBUFS) {
+			/* Resent from the ack once the script has room */
+			expected--;
+		}
+
+		key = k_spin_lock(&lock);
+		read_cmd = RAW_HID_CMD_INJECT;
+		k_spin_unlock(&lock, key);
+
+		/* Not an upload command, leave one in progress alone */
+		raw_hid_ack(ret == 0 ? UPLOAD_STATUS_OK :
+			    ret == -EINVAL ? UPLOAD_STATUS_INVALID :
+			    UPLOAD_STATUS_BUSY);
+		return;
+	case RAW_HID_CMD_BENCH:
+		if (!IS_ENABLED(CONFIG_KEYPAD_UPLOAD_BENCH)) {
+			status = UPLOAD_STATUS_UNSUPPORTED;
+			break;
+		}
+
+		if (len < 3) {
+			status = UPLOAD_STATUS_INVALID;
+			break;
+		}
+
+		if (buf[2] != 0) {
+			upload_bench_start();
+		}
+
+		key = k_spin_lock(&lock);
+		read_cmd = RAW_HID_CMD_BENCH;
+		k_spin_unlock(&lock, key);
+
+		/* Not an upload command, leave one in progress alone */
+		raw_hid_ack(UPLOAD_STATUS_OK);
+		return;
+	case RAW_HID_CMD_POLL:
+		if (!IS_ENABLED(CONFIG_KEYPAD_POLL_PROFILE_SWITCH)) {
+			status = UPLOAD_STATUS_UNSUPPORTED;
+			break;
+		}
+
+		ret = len < 3 ? -EINVAL : poll_profile_set(buf[2]);
+
+		/* The ack goes out before the device detaches */
+		raw_hid_ack(ret == 0 ? UPLOAD_STATUS_OK :
+			    ret == -EINVAL ? UPLOAD_STATUS_INVALID :
+			    UPLOAD_STATUS_BUSY);
+		return;
+	case RAW_HID_CMD_RGB:
+		if (!IS_ENABLED(CONFIG_KEYPAD_LED_RGB)) {
+			status = UPLOAD_STATUS_UNSUPPORTED;
+			break;
+		}
+
+		/* Lighting is no upload, leave one in progress alone */
+		ret = raw_hid_rgb(&buf[2], len - 2);
+		if (ret > 0 ||
+		    (ret == 0 && ++since_ack < RAW_HID_WINDOW / 2)) {
+			return;
+		}
+
+		if (ret == -EBUSY) {
+			/* Ahead of the vsync, resent from the ack */
+			expected--;
+		}
+
+		raw_hid_ack(ret == 0 ? UPLOAD_STATUS_OK :
+			    ret == -EINVAL ? UPLOAD_STATUS_INVALID :
+			    UPLOAD_STATUS_BUSY);
+		return;
+	default:
+		status = UPLOAD_STATUS_UNSUPPORTED;
+		break;
+	}
+
+	if (status != UPLOAD_STATUS_OK) {
+		upload_abort(&hid);
+	}
+
+	raw_hid_ack(status);
+}
+
+static void raw_hid_in_ready(const struct device *dev)
+{
+	atomic_set(&in_flight, 0);
+	k_work_submit(&ack_work);
+}
+
+static const struct hid_ops raw_hid_ops = {
+	.int_in_ready = raw_hid_in_ready,
+	.int_out_ready = raw_hid_out_ready,
+};
+
+int raw_hid_init(void)
+{
+	int ret;
+
+	hid = hid_iface_get(HID_IFACE_RAW);
+	if (hid == NULL) {
+		LOG_ERR("Cannot get USB HID Device for configuration");
+		return -ENODEV;
+	}
+
+	k_work_init(&ack_work, raw_hid_send);
+
+	usb_hid_register_device(hid, raw_hid_report_desc,
+				sizeof(raw_hid_report_desc), &raw_hid_ops);
+	hid_iface_interval_set(hid, CONFIG_KEYPAD_RAW_HID_POLL_MS);
+
+	ret = usb_hid_init(hid);
+	if (ret < 0) {
+		LOG_ERR("Failed to init configuration HID, error: %d", ret);
+	}
+
+	return ret;
+}
+
+void raw_hid_reset(void)
+{
+	upload_abort(&hid);
+	/* Until the host asks again */
+	stamps_enable(NULL);
+	batch_enable(NULL);
+	/* Nothing stays held for a host that is gone */
+	inject_stop();
+
+	/* A transfer queued before a bus reset never completes */
+	atomic_set(&in_flight, 0);
+	atomic_set(&dirty, 0);
+}
@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Vendor-defined HID interface for configuration. The host streams a
+ * keymap, a macro table or LED frames in 64-byte output reports and
+ * does not wait for each one: it keeps up to CONFIG_KEYPAD_RAW_HID_WINDOW
+ * chunks unacknowledged, and the device acknowledges cumulatively with
+ * the next sequence number it expects.
+ *
+ * Output report (host to device):
+ *
+ *   [0]     command, RAW_HID_CMD_*
+ *   [1]     sequence number, one more per report, wraps at 256
+ *   [2..63] payload
+ *
+ *   BEGIN  payload [0] target UPLOAD_TARGET_*, with
+ *          UPLOAD_TARGET_ENCRYPTED for an encrypted one, [1..2] le16
+ *          length
+ *   DATA   up to RAW_HID_CHUNK bytes of the upload
+ *   CHECK  payload [0..3] le32 CRC32 of the upload, before END: drop it
+ *          with UPLOAD_STATUS_CORRUPT unless it matches
+ *   END    apply the upload
+ *   ABORT  discard it
+ *   JOURNAL  payload [0] JOURNAL_CURRENT or JOURNAL_PREVIOUS, [1..2]
+ *          le16 offset: read the post-mortem journal, see
+ *          diag/journal.h
+ *   USAGE  payload [0] unused, [1..2] le16 offset: read the usage
+ *          counters, see diag/usage.h
+ *   THREADS  payload [0] unused, [1..2] le16 offset: read the stack and
+ *          load records of the last sample, see diag/thread_mon.h
+ *   MEMFAULT  take the next Memfault chunk for the host agent to post,
+ *          none when the count is 0, see diag/telemetry.h
+ *   SEQ    payload [0] unused, [1..2] le16 offset: read the sequence
+ *          trace, see diag/seqtrace.h
+ *   LOOPBACK  payload [0] key index, [1] 1 press, 0 release, [2..5]
+ *          le32 token: inject the transition, acked with struct
+ *          loopback_echo once its report is done, see diag/loopback.h
+ *   RGB    payload [0] first LED, [1] count of LEDs, [2] RAW_HID_RGB_*
+ *          flags, [3..] the LEDs in the format of the flags: write the
+ *          host's lighting frame, see led/led_rgb.h. Raw r, g, b takes
+ *          up to RAW_HID_RGB_MAX LEDs, RLE and indexed as many as their
+ *          data covers. The palette format sets count palette entries
+ *          from first instead. Acked like DATA, and with
+ *          RAW_HID_RGB_SYNC once the frame is on the LEDs; before that
+ *          UPLOAD_STATUS_BUSY, to be resent from the ack.
+ *   STAMPS payload [0] 1 to send the event stamps of every keyboard
+ *          report, 0 to stop, see diag/stamps.h
+ *   POLL   payload [0] POLL_PROFILE_*: store the keyboard polling
+ *          profile and re-enumerate with its bInterval, see
+ *          usb/poll_profile.h. Acked before the detach, with
+ *          UPLOAD_STATUS_BUSY while a switch is in progress.
+ *   TYPING payload [0] 1 to start a new summary after this one, [1..2]
+ *          le16 offset: read the typing summary, see diag/typing.h. A
+ *          read at offset 0 takes the snapshot the others read.
+ *   BATCH  payload [0] 1 to send every key transition in batches, 0 to
+ *          stop, see diag/batch.h
+ *   APP    payload [0] slot, or PROFILE_CACHE_HOME: switch to the
+ *          keymap of the application in focus, see
+ *          config/profile_cache.h. UPLOAD_STATUS_INVALID for a slot with
+ *          nothing stored, UPLOAD_STATUS_BUSY during a keymap edit.
+ *   FACTORY  payload [0] 1, [1..2] le16 window in ms, 0 for the default:
+ *          start the factory test, acked with its result once it is
+ *          done; [0] 0 reads the result of the last one, see
+ *          diag/factory.h. UPLOAD_STATUS_BUSY while a test is running.
+ *   INJECT payload [0] RAW_HID_INJECT_STOP or 0, [1] count of records,
+ *          [2..] the records: queue scripted key transitions behind
+ *          those waiting, see diag/inject.h. STOP drops them and
+ *          releases the script's keys first. Acked with struct
+ *          inject_status; UPLOAD_STATUS_BUSY without room for all,
+ *          to be resent from the ack, UPLOAD_STATUS_INVALID for a key
+ *          out of range.
+ *   BENCH  payload [0] 1 to start a new window, 0 to read: answer with
+ *          the upload benchmark of the window, see diag/upload_bench.h
+ *
+ * Input report (device to host):
+ *
+ *   [0]     status, UPLOAD_STATUS_*
+ *   [1]     next sequence number expected
+ *   [2]     window, chunks the host may have unacknowledged
+ *   [3]     bytes that follow, for the reads JOURNAL to LOOPBACK,
+ *           TYPING, FACTORY, INJECT and BENCH
+ *   [4..63] bytes read from the offset asked for
+ *
+ * With STAMPS on, input reports starting with RAW_HID_IN_STAMPS carry
+ * event stamps instead, in between the acks, and with BATCH on those
+ * starting with RAW_HID_IN_BATCH carry transitions.
+ *
+ * An ack goes out for BEGIN, CHECK, END and ABORT, every half window of
+ * DATA and on any error. A report with an unexpected sequence number is
+ * dropped and answered with UPLOAD_STATUS_SEQUENCE; the host resends
+ * from the acknowledged sequence number. The upload formats are in
+ * upload.h.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_RAW_HID is enabled.
+ */
+
+#ifndef KEYPAD_USB_RAW_HID_H_
+#define KEYPAD_USB_RAW_HID_H_
+
+#include <zephyr/zephyr.h>
+
+#define RAW_HID_REPORT_SIZE 64
+#define RAW_HID_CHUNK (RAW_HID_REPORT_SIZE - 2)
+
+#define RAW_HID_CMD_BEGIN 0x01
+#define RAW_HID_CMD_DATA 0x02
+#define RAW_HID_CMD_END 0x03
+#define RAW_HID_CMD_ABORT 0x04
+#define RAW_HID_CMD_JOURNAL 0x05
+#define RAW_HID_CMD_USAGE 0x06
+#define RAW_HID_CMD_CHECK 0x07
+#define RAW_HID_CMD_THREADS 0x08
+#define RAW_HID_CMD_MEMFAULT 0x09
+#define RAW_HID_CMD_SEQ 0x0a
+#define RAW_HID_CMD_LOOPBACK 0x0b
+#define RAW_HID_CMD_RGB 0x0c
+#define RAW_HID_CMD_STAMPS 0x0d
+#define RAW_HID_CMD_POLL 0x0e
+#define RAW_HID_CMD_TYPING 0x0f
+#define RAW_HID_CMD_BATCH 0x10
+#define RAW_HID_CMD_APP 0x11
+#define RAW_HID_CMD_FACTORY 0x12
+#define RAW_HID_CMD_INJECT 0x13
+#define RAW_HID_CMD_BENCH 0x14
+
+/* Byte 0 of an event stamps report, never an UPLOAD_STATUS_* */
+#define RAW_HID_IN_STAMPS 0x80
+/* Byte 0 of an event batch report */
+#define RAW_HID_IN_BATCH 0x81
+
+/* Last report of a frame, swap it in at the next vsync */
+#define RAW_HID_RGB_SYNC BIT(0)
+/* Bits 1..3, enum led_rgb_format of the data */
+#define RAW_HID_RGB_FORMAT(f) (((f) & 0x7) << 1)
+#define RAW_HID_RGB_FORMAT_GET(flags) (((flags) >> 1) & 0x7)
+#define RAW_HID_RGB_MAX ((RAW_HID_CHUNK - 3) / 3)
+
+/* INJECT flags, and the records one report takes */
+#define RAW_HID_INJECT_STOP BIT(0)
+#define RAW_HID_INJECT_MAX ((RAW_HID_CHUNK - 2) / 4)
+
+#if defined(CONFIG_KEYPAD_RAW_HID)
+
+/* Registers the configuration interface, call before usb_enable() */
+int raw_hid_init(void);
+
+/* Drop the upload and the in-flight ack after a bus reset */
+void raw_hid_reset(void);
+
+#else
+
+static inline int raw_hid_init(void)
+{
+	return 0;
+}
+
+static inline void raw_hid_reset(void) {}
+
+#endif /* CONFIG_KEYPAD_RAW_HID */
+
+#endif /* KEYPAD_USB_RAW_HID_H_ */
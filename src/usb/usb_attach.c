@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Everything here runs on the driver's work queue but the grace timer,
+ * which runs on the system one, so the attach is one atomic that
+ * whichever ends it first clears. The slot the reports were on is
+ * remembered for a cable that never enumerates: it goes back to it.
+ *
+ * With CONFIG_USB_NRFX_ATTACHED_EVENT_DELAY at 0 the driver reports
+ * the plug as soon as the USB regulator is up, about a millisecond
+ * after VBUS. HFXO, which the first transfers need anyway, has started
+ * by the time the host resets the bus, 100 ms later at the earliest.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/logging/log.h>
+
+#include "ble/host.h"
+#include "diag/startup.h"
+#include "power/clock.h"
+#include "report_sched.h"
+#include "report_sink.h"
+#include "timebase.h"
+#include "usb/usb_attach.h"
+#include "usb/usb_sink.h"
+
+LOG_MODULE_REGISTER(usb_attach, LOG_LEVEL_INF);
+
+static void attach_expired(struct k_work *work);
+
+static K_WORK_DELAYABLE_DEFINE(grace_work, attach_expired);
+
+static atomic_t attaching;
+static uint8_t prev_slot;
+/* timebase_uptime_us32() of the plug */
+static uint32_t plugged_us;
+
+static struct k_spinlock lock;
+static struct usb_attach_stats stats;
+
+static void attach_start(void)
+{
+	if (!atomic_cas(&attaching, 0, 1)) {
+		return;
+	}
+
+	plugged_us = timebase_uptime_us32();
+	startup_mark(STARTUP_VBUS);
+	stats.attaches++;
+
+	clock_usb_set(true);
+	prev_slot = host_current();
+	if (prev_slot != 0) {
+		/* The wireless host gets its keys released */
+		host_request(0);
+	}
+
+	report_sink_claim(usb_sink_get());
+	report_sched_hold(true);
+	k_work_reschedule(&grace_work,
+			  K_MSEC(CONFIG_KEYPAD_USB_ATTACH_GRACE_MS));
+}
+
+/* Give the reports back to the scheduler, to USB if it is configured */
+static bool attach_end(void)
+{
+	if (!atomic_cas(&attaching, 1, 0)) {
+		return false;
+	}
+
+	report_sink_claim(NULL);
+	report_sched_hold(false);
+
+	return true;
+}
+
+static void attach_configured(void)
+{
+	uint32_t us = timebase_uptime_us32() - plugged_us;
+	k_spinlock_key_t key;
+
+	/* Before the first report: the hold lets it go at once */
+	if (!attach_end()) {
+		return;
+	}
+
+	(void)k_work_cancel_delayable(&grace_work);
+
+	key = k_spin_lock(&lock);
+	stats.enumerated++;
+	stats.last_us = us;
+	stats.max_us = MAX(stats.max_us, us);
+	k_spin_unlock(&lock, key);
+}
+
+static void attach_expired(struct k_work *work)
+{
+	if (!attach_end()) {
+		return;
+	}
+
+	LOG_INF("No host on the cable, reports back to slot %u", prev_slot);
+	clock_usb_set(false);
+	if (prev_slot != 0) {
+		host_request(prev_slot);
+	}
+}
+
+void usb_attach_status(enum usb_dc_status_code status)
+{
+	switch (status) {
+	case USB_DC_CONNECTED:
+		attach_start();
+		break;
+	case USB_DC_CONFIGURED:
+		attach_configured();
+		break;
+	case USB_DC_DISCONNECTED:
+		if (attach_end()) {
+			(void)k_work_cancel_delayable(&grace_work);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+void usb_attach_stats_get(struct usb_attach_stats *out)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	*out = stats;
+	k_spin_unlock(&lock, key);
+}
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static int cmd_usb_attach_show(const struct shell *sh, size_t argc,
+			       char **argv)
+{
+	struct usb_attach_stats s;
+
+	usb_attach_stats_get(&s);
+	shell_print(sh, "plugs %u, enumerated %u", s.attaches, s.enumerated);
+	shell_print(sh, "plug to configured %u us, slowest %u us",
+		    s.last_us, s.max_us);
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_usb_attach,
+	SHELL_CMD(show, NULL, "Print the cable plug counters",
+		  cmd_usb_attach_show),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(usb_attach, &sub_usb_attach, "USB fast attach", NULL);
+#endif /* CONFIG_SHELL */
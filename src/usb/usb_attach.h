@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Fast attach. The cable going in, the driver's USB_DC_CONNECTED as
+ * soon as VBUS is detected, starts everything the first report needs
+ * rather than waiting for the host to configure the device: HFXO is
+ * held from then on, the USB host slot is selected and the keyboard
+ * link claims the reports, so BLE or ESB stop taking them, and the
+ * keys typed meanwhile are held for it. Once the host configures the
+ * device they go out on the first pass, written to the endpoint ahead
+ * of its first poll. A cable that only charges gives everything back
+ * after CONFIG_KEYPAD_USB_ATTACH_GRACE_MS.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_USB_FAST_ATTACH is enabled.
+ */
+
+#ifndef KEYPAD_USB_USB_ATTACH_H_
+#define KEYPAD_USB_USB_ATTACH_H_
+
+#include <zephyr/zephyr.h>
+#include <zephyr/usb/usb_device.h>
+
+struct usb_attach_stats {
+	/* Cable plugs, and of those configured within the grace period */
+	uint32_t attaches;
+	uint32_t enumerated;
+	/* Plug to configured of the last, and the slowest, in us */
+	uint32_t last_us;
+	uint32_t max_us;
+};
+
+#if defined(CONFIG_KEYPAD_USB_FAST_ATTACH)
+
+/* From the device status callback, ahead of the state machine */
+void usb_attach_status(enum usb_dc_status_code status);
+
+void usb_attach_stats_get(struct usb_attach_stats *out);
+
+#else
+
+static inline void usb_attach_status(enum usb_dc_status_code status) {}
+
+#endif /* CONFIG_KEYPAD_USB_FAST_ATTACH */
+
+#endif /* KEYPAD_USB_USB_ATTACH_H_ */
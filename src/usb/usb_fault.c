@@ -0,0 +1,296 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Faults are injected above the driver. A busy endpoint fails the write
+ * with -EAGAIN, as hid_int_ep_write() does while a transfer is on it.
+ * A late completion is held on the system work queue and handed on
+ * after CONFIG_KEYPAD_USB_FAULT_DELAY_US. Suspend and reset go through
+ * the device status callback, as if the driver had reported them, and
+ * the state before is restored by a resume or a configured state after
+ * CONFIG_KEYPAD_USB_FAULT_SUSPEND_MS or CONFIG_KEYPAD_USB_FAULT_RESET_MS.
+ * The host never sees those two; the driver and the HID class keep
+ * their state, only the application goes through its recovery.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/logging/log.h>
+
+#include "usb/usb_fault.h"
+#include "timebase.h"
+
+LOG_MODULE_REGISTER(usb_fault, LOG_LEVEL_INF);
+
+#define FAULT_PERIOD K_MSEC(CONFIG_KEYPAD_USB_FAULT_PERIOD_MS)
+
+static const char *const fault_names[USB_FAULT_COUNT] = {
+	[USB_FAULT_BUSY] = "busy",
+	[USB_FAULT_DELAY] = "delay",
+	[USB_FAULT_SUSPEND] = "suspend",
+	[USB_FAULT_RESET] = "reset",
+};
+
+static uint16_t rates[USB_FAULT_COUNT] = {
+	[USB_FAULT_BUSY] = CONFIG_KEYPAD_USB_FAULT_BUSY,
+	[USB_FAULT_DELAY] = CONFIG_KEYPAD_USB_FAULT_DELAY,
+	[USB_FAULT_SUSPEND] = CONFIG_KEYPAD_USB_FAULT_SUSPEND,
+	[USB_FAULT_RESET] = CONFIG_KEYPAD_USB_FAULT_RESET,
+};
+
+static struct k_spinlock lock;
+static uint32_t seed;
+static struct usb_fault_stats stats[USB_FAULT_COUNT];
+/* Faults not yet followed by a delivered report, since timebase_now32() */
+static bool pending[USB_FAULT_COUNT];
+static uint32_t since[USB_FAULT_COUNT];
+
+static usb_dc_status_callback status_fn;
+static bool configured;
+/* Status injected by this module is being handled */
+static bool injecting;
+
+static struct k_work_delayable tick_work;
+/* State restored at the end of an injected suspend or reset */
+static struct k_work_delayable restore_work;
+static enum usb_dc_status_code restore_status;
+static bool restoring;
+
+static struct k_work_delayable delay_work;
+static void (*held_done)(void);
+
+/* xorshift32, a fault is a roll under its rate */
+static bool fault_roll(enum usb_fault fault)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+
+	return rates[fault] != 0 && seed % 1000 < rates[fault];
+}
+
+static void fault_mark(enum usb_fault fault)
+{
+	stats[fault].injected++;
+	if (!pending[fault]) {
+		pending[fault] = true;
+		since[fault] = timebase_now32();
+	}
+}
+
+static bool fault_inject(enum usb_fault fault)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	bool hit = fault_roll(fault);
+
+	if (hit) {
+		fault_mark(fault);
+	}
+	k_spin_unlock(&lock, key);
+
+	return hit;
+}
+
+static void fault_status(enum usb_dc_status_code status)
+{
+	injecting = true;
+	status_fn(status, NULL);
+	injecting = false;
+}
+
+static void fault_tick(struct k_work *work)
+{
+	k_work_schedule(&tick_work, FAULT_PERIOD);
+
+	if (!configured || restoring) {
+		return;
+	}
+
+	if (fault_inject(USB_FAULT_RESET)) {
+		LOG_DBG("Injecting a bus reset");
+		restore_status = USB_DC_CONFIGURED;
+		restoring = true;
+		fault_status(USB_DC_RESET);
+		k_work_schedule(&restore_work,
+				K_MSEC(CONFIG_KEYPAD_USB_FAULT_RESET_MS));
+	} else if (fault_inject(USB_FAULT_SUSPEND)) {
+		LOG_DBG("Injecting a suspend");
+		restore_status = USB_DC_RESUME;
+		restoring = true;
+		fault_status(USB_DC_SUSPEND);
+		k_work_schedule(&restore_work,
+				K_MSEC(CONFIG_KEYPAD_USB_FAULT_SUSPEND_MS));
+	}
+}
+
+static void fault_restore(struct k_work *work)
+{
+	if (restoring) {
+		restoring = false;
+		fault_status(restore_status);
+	}
+}
+
+static void fault_delay_over(struct k_work *work)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	void (*done)(void) = held_done;
+
+	held_done = NULL;
+	k_spin_unlock(&lock, key);
+
+	if (done != NULL) {
+		done();
+	}
+}
+
+void usb_fault_init(usb_dc_status_callback status)
+{
+	status_fn = status;
+	seed = k_cycle_get_32() | 1;
+	k_work_init_delayable(&tick_work, fault_tick);
+	k_work_init_delayable(&restore_work, fault_restore);
+	k_work_init_delayable(&delay_work, fault_delay_over);
+	k_work_schedule(&tick_work, FAULT_PERIOD);
+}
+
+bool usb_fault_busy(void)
+{
+	return fault_inject(USB_FAULT_BUSY);
+}
+
+bool usb_fault_delay(void (*done)(void))
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	bool hold = held_done == NULL && fault_roll(USB_FAULT_DELAY);
+
+	if (hold) {
+		fault_mark(USB_FAULT_DELAY);
+		held_done = done;
+	}
+	k_spin_unlock(&lock, key);
+
+	if (hold) {
+		k_work_schedule(&delay_work,
+				K_USEC(CONFIG_KEYPAD_USB_FAULT_DELAY_US));
+	}
+
+	return hold;
+}
+
+void usb_fault_delivered(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	uint32_t now = timebase_now32();
+
+	for (int f = 0; f < USB_FAULT_COUNT; f++) {
+		struct usb_fault_stats *s = &stats[f];
+
+		if (!pending[f]) {
+			continue;
+		}
+
+		pending[f] = false;
+		s->recovered++;
+		s->recovery_last_us = timebase_to_us32(now - since[f]);
+		s->recovery_max_us = MAX(s->recovery_max_us,
+					 s->recovery_last_us);
+	}
+
+	k_spin_unlock(&lock, key);
+}
+
+void usb_fault_status(enum usb_dc_status_code status)
+{
+	k_spinlock_key_t key;
+
+	switch (status) {
+	case USB_DC_CONFIGURED:
+		configured = true;
+		break;
+	case USB_DC_RESET:
+	case USB_DC_DISCONNECTED:
+		configured = false;
+		/* The held completion is of a transfer just forgotten */
+		key = k_spin_lock(&lock);
+		held_done = NULL;
+		k_spin_unlock(&lock, key);
+		(void)k_work_cancel_delayable(&delay_work);
+		break;
+	default:
+		break;
+	}
+
+	if (!injecting && (status == USB_DC_RESET ||
+			   status == USB_DC_DISCONNECTED ||
+			   status == USB_DC_SUSPEND)) {
+		/* The host took over, restoring would lie to the application */
+		(void)k_work_cancel_delayable(&restore_work);
+		restoring = false;
+	}
+}
+
+void usb_fault_stats_get(enum usb_fault fault, struct usb_fault_stats *out)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	*out = stats[fault];
+	k_spin_unlock(&lock, key);
+}
+
+#if defined(CONFIG_SHELL)
+#include <stdlib.h>
+#include <string.h>
+
+#include <zephyr/shell/shell.h>
+
+static int cmd_usb_fault_show(const struct shell *sh, size_t argc,
+			      char **argv)
+{
+	for (int f = 0; f < USB_FAULT_COUNT; f++) {
+		struct usb_fault_stats s;
+
+		usb_fault_stats_get(f, &s);
+		shell_print(sh, "%-8s %4u/1000: injected %u, recovered %u, "
+			    "last %u us, max %u us", fault_names[f],
+			    rates[f], s.injected, s.recovered,
+			    s.recovery_last_us, s.recovery_max_us);
+	}
+
+	return 0;
+}
+
+static int cmd_usb_fault_set(const struct shell *sh, size_t argc,
+			     char **argv)
+{
+	unsigned long rate = strtoul(argv[2], NULL, 0);
+
+	if (rate > 1000) {
+		shell_error(sh, "rate is 0 to 1000");
+		return -EINVAL;
+	}
+
+	for (int f = 0; f < USB_FAULT_COUNT; f++) {
+		if (strcmp(argv[1], fault_names[f]) == 0) {
+			rates[f] = rate;
+			return 0;
+		}
+	}
+
+	shell_error(sh, "no fault %s, one of busy, delay, suspend, reset",
+		    argv[1]);
+
+	return -EINVAL;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_usb_fault,
+	SHELL_CMD(show, NULL, "Print injected faults and their recovery",
+		  cmd_usb_fault_show),
+	SHELL_CMD_ARG(set, NULL, "Set a fault rate: <fault> <per 1000>",
+		      cmd_usb_fault_set, 3, 0),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(usb_fault, &sub_usb_fault, "USB fault injection", NULL);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * USB fault injection, for test builds. Makes the keyboard link behave
+ * like a bad host or KVM at configurable rates: endpoint busy on a
+ * write, an IN completion that comes late, a suspend the host did not
+ * ask for and a bus reset. Each injected fault is timed to the next
+ * keyboard report delivered after it, the recovery of the report
+ * scheduler and the device state handling.
+ *
+ * Rates are in 1/1000 per opportunity: per write, per completion, and
+ * per CONFIG_KEYPAD_USB_FAULT_PERIOD_MS for suspend and reset. Set from
+ * Kconfig and the "usb_fault" shell command.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_USB_FAULTS is enabled.
+ */
+
+#ifndef KEYPAD_USB_USB_FAULT_H_
+#define KEYPAD_USB_USB_FAULT_H_
+
+#include <zephyr/zephyr.h>
+#include <zephyr/usb/usb_device.h>
+
+enum usb_fault {
+	USB_FAULT_BUSY,
+	USB_FAULT_DELAY,
+	USB_FAULT_SUSPEND,
+	USB_FAULT_RESET,
+	USB_FAULT_COUNT,
+};
+
+struct usb_fault_stats {
+	/* Faults injected */
+	uint32_t injected;
+	/* Followed by a delivered report, and the time it took */
+	uint32_t recovered;
+	uint32_t recovery_max_us;
+	uint32_t recovery_last_us;
+};
+
+#if defined(CONFIG_KEYPAD_USB_FAULTS)
+
+/*
+ * status is the device status callback, fed the suspend, resume, reset
+ * and configured states of injected faults
+ */
+void usb_fault_init(usb_dc_status_callback status);
+
+/* Before a keyboard write, true to fail it as if the endpoint were busy */
+bool usb_fault_busy(void);
+
+/*
+ * From the keyboard IN completion, true if it is held back: done is
+ * called once the injected delay is over
+ */
+bool usb_fault_delay(void (*done)(void));
+
+/* A keyboard report was delivered, ends the faults pending recovery */
+void usb_fault_delivered(void);
+
+/* From the device status callback, drops a held completion on reset */
+void usb_fault_status(enum usb_dc_status_code status);
+
+void usb_fault_stats_get(enum usb_fault fault, struct usb_fault_stats *out);
+
+#else
+
+static inline void usb_fault_init(usb_dc_status_callback status) {}
+static inline bool usb_fault_busy(void)
+{
+	return false;
+}
+static inline bool usb_fault_delay(void (*done)(void))
+{
+	return false;
+}
+static inline void usb_fault_delivered(void) {}
+static inline void usb_fault_status(enum usb_dc_status_code status) {}
+
+#endif /* CONFIG_KEYPAD_USB_FAULTS */
+
+#endif /* KEYPAD_USB_USB_FAULT_H_ */
@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * The driver queues its events in fifo_elem_slab, one block per event,
+ * and runs the status and endpoint callbacks from its work queue. The
+ * blocks in use are sampled from there, i.e. while the backlog is being
+ * worked off, which is where the high-water mark is. When allocation
+ * fails the driver flushes the queue and reinitializes the peripheral:
+ * transfers already queued on an endpoint never complete and their
+ * in-flight flags would stay set for good. A periodic check catches a
+ * keyboard report that makes no progress and resets all interfaces.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/logging/log.h>
+
+#include "report_sink.h"
+#include "usb/usb_health.h"
+#include "usb/usb_sink.h"
+
+LOG_MODULE_REGISTER(usb_health, LOG_LEVEL_INF);
+
+#define CHECK_PERIOD K_MSEC(CONFIG_KEYPAD_USB_HEALTH_CHECK_MS)
+
+/* Defined by the nRF USB device driver */
+extern struct k_mem_slab fifo_elem_slab;
+
+static struct usb_health_stats stats = {
+	.queue_size = CONFIG_USB_NRFX_EVT_QUEUE_SIZE,
+};
+
+/* The driver work queue thread, seen from its callbacks */
+static k_tid_t work_thread;
+
+static void (*recover_fn)(void);
+static struct k_timer check_timer;
+static struct k_work check_work;
+/* Keyboard state at the previous check */
+static uint32_t last_completed;
+static bool last_in_flight;
+
+static void usb_health_check(struct k_work *work)
+{
+	struct report_sink_stats s;
+	bool in_flight;
+
+	report_sink_stats_get(usb_sink_get(), &s);
+	in_flight = s.queued > 0;
+
+	if (in_flight && last_in_flight && s.completed == last_completed) {
+		LOG_WRN("Keyboard report stalled, resetting the interfaces");
+		stats.recoveries++;
+		recover_fn();
+		in_flight = false;
+	}
+
+	last_completed = s.completed;
+	last_in_flight = in_flight;
+}
+
+static void check_expired(struct k_timer *timer)
+{
+	k_work_submit(&check_work);
+}
+
+void usb_health_init(void (*recover)(void))
+{
+	recover_fn = recover;
+	k_work_init(&check_work, usb_health_check);
+	k_timer_init(&check_timer, check_expired, NULL);
+}
+
+void usb_health_status(enum usb_dc_status_code status)
+{
+	uint32_t used = k_mem_slab_num_used_get(&fifo_elem_slab);
+
+	/* The event being handled has been freed already */
+	stats.queue_max = MAX(stats.queue_max, used);
+	if (used == stats.queue_size) {
+		stats.queue_full++;
+	}
+
+	if (work_thread == NULL) {
+		work_thread = k_current_get();
+	}
+
+	switch (status) {
+	case USB_DC_CONFIGURED:
+	case USB_DC_RESUME:
+		last_in_flight = false;
+		k_timer_start(&check_timer, CHECK_PERIOD, CHECK_PERIOD);
+		break;
+	case USB_DC_RESET:
+	case USB_DC_DISCONNECTED:
+	case USB_DC_SUSPEND:
+		/* No completions to expect, and no wakeups wanted */
+		k_timer_stop(&check_timer);
+		break;
+	default:
+		break;
+	}
+}
+
+void usb_health_stats_get(struct usb_health_stats *out)
+{
+	*out = stats;
+
+	out->stack_size = 0;
+	out->stack_unused = 0;
+	if (work_thread != NULL) {
+		out->stack_size = work_thread->stack_info.size;
+		k_thread_stack_space_get(work_thread, &out->stack_unused);
+	}
+}
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+
+static int cmd_usb_health_show(const struct shell *sh, size_t argc,
+			       char **argv)
+{
+	struct usb_health_stats s;
+
+	usb_health_stats_get(&s);
+
+	shell_print(sh, "event queue: max %u of %u, full %u times",
+		    s.queue_max, s.queue_size, s.queue_full);
+	shell_print(sh, "work queue stack: %u of %u bytes used",
+		    s.stack_size - s.stack_unused, s.stack_size);
+	shell_print(sh, "stalled transfers recovered: %u", s.recoveries);
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_usb_health,
+	SHELL_CMD(show, NULL, "Print USB driver health counters",
+		  cmd_usb_health_show),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(usb_health, &sub_usb_health, "USB driver health", NULL);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Health of the nRF USB device driver: event queue high-water mark,
+ * work queue stack use and recovery from keyboard transfers that never
+ * complete.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_USB_HEALTH is enabled.
+ */
+
+#ifndef KEYPAD_USB_USB_HEALTH_H_
+#define KEYPAD_USB_USB_HEALTH_H_
+
+#include <zephyr/zephyr.h>
+#include <zephyr/usb/usb_device.h>
+
+struct usb_health_stats {
+	/* Driver event queue, entries in use at most and its size */
+	uint32_t queue_max;
+	uint32_t queue_size;
+	/* Samples with the queue full, the next event was dropped */
+	uint32_t queue_full;
+	/* Driver work queue stack, bytes never used and its size */
+	size_t stack_unused;
+	size_t stack_size;
+	/* Stalled keyboard transfers given up on */
+	uint32_t recoveries;
+};
+
+#if defined(CONFIG_KEYPAD_USB_HEALTH)
+
+/* recover forgets every in-flight transfer, run from the work queue */
+void usb_health_init(void (*recover)(void));
+
+/* From the device status callback, which runs on the driver work queue */
+void usb_health_status(enum usb_dc_status_code status);
+
+void usb_health_stats_get(struct usb_health_stats *out);
+
+#else
+
+static inline void usb_health_init(void (*recover)(void)) {}
+static inline void usb_health_status(enum usb_dc_status_code status) {}
+
+#endif /* CONFIG_KEYPAD_USB_HEALTH */
+
+#endif /* KEYPAD_USB_USB_HEALTH_H_ */
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/device.h>
+#include <zephyr/usb/usb_device.h>
+#include <zephyr/usb/class/usb_hid.h>
+
+#include "diag/markers.h"
+#include "hot_path.h"
+#include "report_sched.h"
+#include "report_sink.h"
+#include "usb/usb_fault.h"
+#include "usb/usb_sink.h"
+#include "usb/usb_state.h"
+
+static const struct device *hid;
+
+static KEYPAD_HOT int usb_sink_write(struct report_sink *s,
+				     const uint8_t *report, size_t len)
+{
+	int ret;
+
+	if (usb_fault_busy()) {
+		return -EAGAIN;
+	}
+
+	/* Copied into the endpoint buffer before this returns */
+	marker_begin(MARKER_EP_WRITE);
+	ret = hid_int_ep_write(hid, report, len, NULL);
+	marker_end(MARKER_EP_WRITE);
+
+	return ret;
+}
+
+static bool usb_sink_active(struct report_sink *s)
+{
+	return usb_state_configured();
+}
+
+static struct report_sink sink = {
+	.name = "usb",
+	/* The cable wins whenever it is configured */
+	.priority = 0,
+	.depth = 1,
+	.write = usb_sink_write,
+	.active = usb_sink_active,
+};
+
+void usb_sink_init(const struct device *hid_dev)
+{
+	hid = hid_dev;
+	report_sink_register(&sink);
+}
+
+struct report_sink *usb_sink_get(void)
+{
+	return &sink;
+}
+
+void usb_sink_reset(void)
+{
+	/* A transfer queued before a bus reset never completes */
+	report_sink_reset(&sink);
+}
+
+static void usb_sink_done(void)
+{
+	usb_fault_delivered();
+	report_sched_sink_done(&sink);
+}
+
+void usb_sink_in_ready(const struct device *dev)
+{
+	marker_point(MARKER_EP_DONE);
+	if (!usb_fault_delay(usb_sink_done)) {
+		usb_sink_done();
+	}
+}
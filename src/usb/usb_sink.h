@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * The keyboard HID interface as a report sink: one report on the
+ * interrupt IN endpoint at a time, active while the device is
+ * configured.
+ */
+
+#ifndef KEYPAD_USB_USB_SINK_H_
+#define KEYPAD_USB_USB_SINK_H_
+
+#include <zephyr/device.h>
+#include <zephyr/usb/usb_device.h>
+
+#include "report_sink.h"
+
+/* Register the sink for the keyboard interface, call before usb_enable() */
+void usb_sink_init(const struct device *hid_dev);
+
+struct report_sink *usb_sink_get(void);
+
+/* Forget the in-flight report after a bus reset or reconfiguration */
+void usb_sink_reset(void);
+
+/* Interrupt IN endpoint completion, from struct hid_ops::int_in_ready */
+void usb_sink_in_ready(const struct device *dev);
+
+#endif /* KEYPAD_USB_USB_SINK_H_ */
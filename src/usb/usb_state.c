@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * One flat SMF state machine, run from the device status callback on
+ * the driver's work queue. A single run function maps the event to the
+ * next state: the driver reports what happened on the bus, not which
+ * transitions are legal, so events that change nothing in the current
+ * state are dropped there. A configuration or a reset while already in
+ * that state runs its exit and entry actions again; the host starts
+ * over either way.
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/smf.h>
+#include <zephyr/usb/class/usb_hid.h>
+
+#include "diag/startup.h"
+#include "diag/telemetry.h"
+#include "power/clock.h"
+#include "report.h"
+#include "report_sched.h"
+#include "suspend.h"
+#include "usb/usb_state.h"
+
+struct usb_sm {
+	struct smf_ctx ctx;
+	/* Event being handled */
+	enum usb_dc_status_code event;
+	/* Configured by the host, kept over a suspend */
+	bool configured;
+};
+
+static struct usb_sm sm;
+static atomic_t word;
+static void (*reset_fn)(void);
+
+static const struct smf_state states[USB_STATE_COUNT];
+
+static const char *const state_names[USB_STATE_COUNT] = {
+	[USB_STATE_DISCONNECTED] = "disconnected",
+	[USB_STATE_DEFAULT] = "default",
+	[USB_STATE_CONFIGURED] = "configured",
+	[USB_STATE_SUSPENDED] = "suspended",
+	[USB_STATE_RESUMED] = "resumed",
+};
+
+static void usb_state_publish(enum usb_state state)
+{
+	atomic_set(&word, state |
+		   (sm.configured ? USB_STATE_CONFIGURED_BIT : 0));
+}
+
+static void disconnected_entry(void *obj)
+{
+	sm.configured = false;
+	usb_state_publish(USB_STATE_DISCONNECTED);
+	clock_usb_set(false);
+	/* Other links only know the report protocol */
+	report_protocol_set(HID_PROTOCOL_REPORT);
+	reset_fn();
+}
+
+static void default_entry(void *obj)
+{
+	sm.configured = false;
+	usb_state_publish(USB_STATE_DEFAULT);
+	/* The HID class is back in report protocol */
+	report_protocol_set(HID_PROTOCOL_REPORT);
+	reset_fn();
+}
+
+static void configured_entry(void *obj)
+{
+	sm.configured = true;
+	usb_state_publish(USB_STATE_CONFIGURED);
+	startup_mark(STARTUP_CONFIGURED);
+	clock_usb_set(true);
+	reset_fn();
+}
+
+static void suspended_entry(void *obj)
+{
+	usb_state_publish(USB_STATE_SUSPENDED);
+	suspend_enter();
+}
+
+static void suspended_exit(void *obj)
+{
+	suspend_exit();
+}
+
+static void resumed_entry(void *obj)
+{
+	usb_state_publish(USB_STATE_RESUMED);
+	/* Deliver the keystrokes that woke the host */
+	report_sched_notify();
+}
+
+static void usb_state_run(void *obj)
+{
+	struct usb_sm *s = obj;
+	enum usb_state state = usb_state_get();
+	enum usb_state next;
+
+	switch (s->event) {
+	case USB_DC_CONNECTED:
+		if (state != USB_STATE_DISCONNECTED) {
+			return;
+		}
+		/* Powered, the bus reset that follows lands here again */
+		next = USB_STATE_DEFAULT;
+		break;
+	case USB_DC_RESET:
+		startup_mark(STARTUP_BUS_RESET);
+		telemetry_usb_reset();
+		next = USB_STATE_DEFAULT;
+		break;
+	case USB_DC_ERROR:
+		/* Transfers are lost, the host resets the bus to recover */
+		next = USB_STATE_DEFAULT;
+		break;
+	case USB_DC_CONFIGURED:
+		next = USB_STATE_CONFIGURED;
+		break;
+	case USB_DC_DISCONNECTED:
+		next = USB_STATE_DISCONNECTED;
+		break;
+	case USB_DC_SUSPEND:
+		if (state == USB_STATE_DISCONNECTED ||
+		    state == USB_STATE_SUSPENDED) {
+			return;
+		}
+		next = USB_STATE_SUSPENDED;
+		break;
+	case USB_DC_RESUME:
+		if (state != USB_STATE_SUSPENDED) {
+			return;
+		}
+		next = s->configured ? USB_STATE_RESUMED : USB_STATE_DEFAULT;
+		break;
+	default:
+		return;
+	}
+
+	smf_set_state(SMF_CTX(s), &states[next]);
+}
+
+static const struct smf_state states[USB_STATE_COUNT] = {
+	[USB_STATE_DISCONNECTED] =
+		SMF_CREATE_STATE(disconnected_entry, usb_state_run, NULL),
+	[USB_STATE_DEFAULT] =
+		SMF_CREATE_STATE(default_entry, usb_state_run, NULL),
+	[USB_STATE_CONFIGURED] =
+		SMF_CREATE_STATE(configured_entry, usb_state_run, NULL),
+	[USB_STATE_SUSPENDED] =
+		SMF_CREATE_STATE(suspended_entry, usb_state_run,
+				 suspended_exit),
+	[USB_STATE_RESUMED] =
+		SMF_CREATE_STATE(resumed_entry, usb_state_run, NULL),
+};
+
+void usb_state_init(void (*reset)(void))
+{
+	reset_fn = reset;
+	smf_set_initial(SMF_CTX(&sm), &states[USB_STATE_DISCONNECTED]);
+}
+
+void usb_state_event(enum usb_dc_status_code status)
+{
+	sm.event = status;
+	(void)smf_run_state(SMF_CTX(&sm));
+}
+
+atomic_val_t usb_state_word(void)
+{
+	return atomic_get(&word);
+}
+
+const char *usb_state_name(enum usb_state state)
+{
+	return state < USB_STATE_COUNT ? state_names[state] : "?";
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * USB device state machine. The device status callback feeds it the
+ * driver's events; each state's entry and exit actions do the work the
+ * state implies: clocks with the configured state, the suspend
+ * listeners (LEDs, key scan, power) with the suspended one, a clean
+ * slate of every interface after a reset or reconfiguration.
+ *
+ * The state is published as one word, so the hot path reads it with a
+ * single atomic load from any context.
+ */
+
+#ifndef KEYPAD_USB_USB_STATE_H_
+#define KEYPAD_USB_USB_STATE_H_
+
+#include <zephyr/zephyr.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/usb/usb_device.h>
+
+enum usb_state {
+	/* No VBUS, or not yet seen by the driver */
+	USB_STATE_DISCONNECTED,
+	/* Reset by the host, not configured */
+	USB_STATE_DEFAULT,
+	USB_STATE_CONFIGURED,
+	USB_STATE_SUSPENDED,
+	/* Configured again after a suspend, until the next event */
+	USB_STATE_RESUMED,
+	USB_STATE_COUNT,
+};
+
+/* Set in the published word while the host has the device configured */
+#define USB_STATE_CONFIGURED_BIT BIT(8)
+#define USB_STATE_MASK 0xff
+
+/*
+ * reset makes every interface forget its in-flight transfers, run on
+ * entering the default, configured and disconnected states
+ */
+void usb_state_init(void (*reset)(void));
+
+/* Driver event, from the device status callback */
+void usb_state_event(enum usb_dc_status_code status);
+
+/* State and USB_STATE_CONFIGURED_BIT, any context */
+atomic_val_t usb_state_word(void);
+
+static inline enum usb_state usb_state_get(void)
+{
+	return (enum usb_state)(usb_state_word() & USB_STATE_MASK);
+}
+
+/*
+ * The host configured the device and has not reset it since, also while
+ * the bus is suspended: reports can be staged for the remote wakeup
+ */
+static inline bool usb_state_configured(void)
+{
+	return (usb_state_word() & USB_STATE_CONFIGURED_BIT) != 0;
+}
+
+const char *usb_state_name(enum usb_state state);
+
+#endif /* KEYPAD_USB_USB_STATE_H_ */
@@ -0,0 +1,615 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Bulk OUT is read several packets per transfer into one buffer and
+ * parsed in the completion, which runs on the USB work queue like the
+ * status writes, so the stream state needs no lock. The endpoint NAKs
+ * while a buffer is parsed, the host just retries in the same frame.
+ *
+ * Bulk IN also carries the chunks of the raw scan stream, started from
+ * the scan interrupt as one fills, so the state of the IN endpoint is
+ * under a lock. A status waiting goes out ahead of the next chunk.
+ */
+
+#include <string.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/usb/usb_device.h>
+#include <zephyr/usb/bos.h>
+
+#include "upload.h"
+#include "diag/scan_stream.h"
+#include "usb/webusb.h"
+
+LOG_MODULE_REGISTER(webusb, LOG_LEVEL_INF);
+
+#define WEBUSB_OUT_EP_ADDR 0x01
+#define WEBUSB_IN_EP_ADDR 0x81
+
+#define WEBUSB_OUT_EP_IDX 0
+#define WEBUSB_IN_EP_IDX 1
+
+/* Vendor requests, bRequest values announced in the BOS capabilities */
+#define WEBUSB_VENDOR_CODE 0x01
+#define MSOS2_VENDOR_CODE 0x02
+
+#define WEBUSB_REQ_GET_URL 0x02
+#define WEBUSB_DESC_URL 0x03
+#define WEBUSB_URL_HTTPS 0x01
+
+#define MSOS2_DESCRIPTOR_INDEX 0x07
+#define MSOS2_WINDOWS_8_1 0x06030000
+
+#define MSOS2_SET_HEADER 0x00
+#define MSOS2_SUBSET_CONFIGURATION 0x01
+#define MSOS2_SUBSET_FUNCTION 0x02
+#define MSOS2_FEATURE_COMPATIBLE_ID 0x03
+#define MSOS2_FEATURE_REG_PROPERTY 0x04
+#define MSOS2_REG_MULTI_SZ 0x07
+
+#define MSOS2_PROPERTY_NAME "DeviceInterfaceGUIDs"
+/* Host tools open the interface by this GUID on Windows */
+#define MSOS2_INTERFACE_GUID "{8D3C1E2A-5F47-4B9E-A6D1-3C9F0B7E2A54}"
+
+/* Landing page without the scheme, https:// is implied */
+#define WEBUSB_URL CONFIG_KEYPAD_WEBUSB_URL
+#define WEBUSB_URL_LEN (sizeof(WEBUSB_URL) - 1)
+
+/* Several packets per transfer, the stack re-arms in between */
+#define WEBUSB_RX_SIZE (8 * USB_MAX_FS_BULK_MPS)
+
+struct webusb_desc {
+	struct usb_if_descriptor if0;
+	struct usb_ep_descriptor if0_out_ep;
+	struct usb_ep_descriptor if0_in_ep;
+} __packed;
+
+USBD_CLASS_DESCR_DEFINE(primary, 0) struct webusb_desc webusb_desc = {
+	.if0 = {
+		.bLength = sizeof(struct usb_if_descriptor),
+		.bDescriptorType = USB_DESC_INTERFACE,
+		.bInterfaceNumber = 0,
+		.bAlternateSetting = 0,
+		.bNumEndpoints = 2,
+		.bInterfaceClass = USB_BCC_VENDOR,
+		.bInterfaceSubClass = 0,
+		.bInterfaceProtocol = 0,
+		.iInterface = 0,
+	},
+	.if0_out_ep = {
+		.bLength = sizeof(struct usb_ep_descriptor),
+		.bDescriptorType = USB_DESC_ENDPOINT,
+		.bEndpointAddress = WEBUSB_OUT_EP_ADDR,
+		.bmAttributes = USB_DC_EP_BULK,
+		.wMaxPacketSize = sys_cpu_to_le16(USB_MAX_FS_BULK_MPS),
+		.bInterval = 0,
+	},
+	.if0_in_ep = {
+		.bLength = sizeof(struct usb_ep_descriptor),
+		.bDescriptorType = USB_DESC_ENDPOINT,
+		.bEndpointAddress = WEBUSB_IN_EP_ADDR,
+		.bmAttributes = USB_DC_EP_BULK,
+		.wMaxPacketSize = sys_cpu_to_le16(USB_MAX_FS_BULK_MPS),
+		.bInterval = 0,
+	},
+};
+
+USB_DEVICE_BOS_DESC_DEFINE_CAP struct webusb_bos_cap {
+	struct usb_bos_platform_descriptor platform;
+	struct usb_bos_capability_webusb cap;
+} __packed webusb_bos_cap = {
+	.platform = {
+		.bLength = sizeof(struct usb_bos_platform_descriptor) +
+			   sizeof(struct usb_bos_capability_webusb),
+		.bDescriptorType = USB_DESC_DEVICE_CAPABILITY,
+		.bDevCapabilityType = USB_BOS_CAPABILITY_PLATFORM,
+		.bReserved = 0,
+		/* 3408b638-09a9-47a0-8bfd-a0768815b665 */
+		.PlatformCapabilityUUID = {
+			0x38, 0xB6, 0x08, 0x34, 0xA9, 0x09, 0xA0, 0x47,
+			0x8B, 0xFD, 0xA0, 0x76, 0x88, 0x15, 0xB6, 0x65,
+		},
+	},
+	.cap = {
+		.bcdVersion = sys_cpu_to_le16(0x0100),
+		.bVendorCode = WEBUSB_VENDOR_CODE,
+		.iLandingPage = WEBUSB_URL_LEN > 0 ? 1 : 0,
+	},
+};
+
+static const struct {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint8_t bScheme;
+	char URL[sizeof(WEBUSB_URL)];
+} __packed webusb_url = {
+	.bLength = 3 + WEBUSB_URL_LEN,
+	.bDescriptorType = WEBUSB_DESC_URL,
+	.bScheme = WEBUSB_URL_HTTPS,
+	.URL = WEBUSB_URL,
+};
+
+/* MS OS 2.0 descriptor set, WinUSB for the configuration interface only */
+struct msos2_set_header {
+	uint16_t wLength;
+	uint16_t wDescriptorType;
+	uint32_t dwWindowsVersion;
+	uint16_t wTotalLength;
+} __packed;
+
+struct msos2_configuration_subset {
+	uint16_t wLength;
+	uint16_t wDescriptorType;
+	uint8_t bConfigurationValue;
+	uint8_t bReserved;
+	uint16_t wTotalLength;
+} __packed;
+
+struct msos2_function_subset {
+	uint16_t wLength;
+	uint16_t wDescriptorType;
+	uint8_t bFirstInterface;
+	uint8_t bReserved;
+	uint16_t wSubsetLength;
+} __packed;
+
+struct msos2_compatible_id {
+	uint16_t wLength;
+	uint16_t wDescriptorType;
+	uint8_t CompatibleID[8];
+	uint8_t SubCompatibleID[8];
+} __packed;
+
+struct msos2_guids_property {
+	uint16_t wLength;
+	uint16_t wDescriptorType;
+	uint16_t wPropertyDataType;
+	uint16_t wPropertyNameLength;
+	/* UTF-16LE, filled in by webusb_init() */
+	uint8_t PropertyName[2 * sizeof(MSOS2_PROPERTY_NAME)];
+	uint16_t wPropertyDataLength;
+	/* REG_MULTI_SZ, one GUID and an empty string */
+	uint8_t bPropertyData[2 * (sizeof(MSOS2_INTERFACE_GUID) + 1)];
+} __packed;
+
+struct msos2_function {
+	struct msos2_function_subset subset;
+	struct msos2_compatible_id compatible_id;
+	struct msos2_guids_property guids;
+} __packed;
+
+struct msos2_configuration {
+	struct msos2_configuration_subset subset;
+	struct msos2_function function;
+} __packed;
+
+static struct msos2_desc {
+	struct msos2_set_header header;
+	struct msos2_configuration configuration;
+} __packed msos2_desc = {
+	.header = {
+		.wLength = sys_cpu_to_le16(sizeof(struct msos2_set_header)),
+		.wDescriptorType = sys_cpu_to_le16(MSOS2_SET_HEADER),
+		.dwWindowsVersion = sys_cpu_to_le32(MSOS2_WINDOWS_8_1),
+		.wTotalLength = sys_cpu_to_le16(sizeof(struct msos2_desc)),
+	},
+	.configuration.subset = {
+		.wLength = sys_cpu_to_le16(
+			sizeof(struct msos2_configuration_subset)),
+		.wDescriptorType = sys_cpu_to_le16(MSOS2_SUBSET_CONFIGURATION),
+		.bConfigurationValue = 0,
+		.wTotalLength = sys_cpu_to_le16(
+			sizeof(struct msos2_configuration)),
+	},
+	.configuration.function.subset = {
+		.wLength = sys_cpu_to_le16(sizeof(struct msos2_function_subset)),
+		.wDescriptorType = sys_cpu_to_le16(MSOS2_SUBSET_FUNCTION),
+		/* Set once the interface is numbered */
+		.bFirstInterface = 0,
+		.wSubsetLength = sys_cpu_to_le16(sizeof(struct msos2_function)),
+	},
+	.configuration.function.compatible_id = {
+		.wLength = sys_cpu_to_le16(sizeof(struct msos2_compatible_id)),
+		.wDescriptorType = sys_cpu_to_le16(MSOS2_FEATURE_COMPATIBLE_ID),
+		.CompatibleID = { 'W', 'I', 'N', 'U', 'S', 'B' },
+	},
+	.configuration.function.guids = {
+		.wLength = sys_cpu_to_le16(sizeof(struct msos2_guids_property)),
+		.wDescriptorType = sys_cpu_to_le16(MSOS2_FEATURE_REG_PROPERTY),
+		.wPropertyDataType = sys_cpu_to_le16(MSOS2_REG_MULTI_SZ),
+		.wPropertyNameLength = sys_cpu_to_le16(
+			2 * sizeof(MSOS2_PROPERTY_NAME)),
+		.wPropertyDataLength = sys_cpu_to_le16(
+			2 * (sizeof(MSOS2_INTERFACE_GUID) + 1)),
+	},
+};
+
+USB_DEVICE_BOS_DESC_DEFINE_CAP struct msos2_bos_cap {
+	struct usb_bos_platform_descriptor platform;
+	struct usb_bos_capability_msos cap;
+} __packed msos2_bos_cap = {
+	.platform = {
+		.bLength = sizeof(struct usb_bos_platform_descriptor) +
+			   sizeof(struct usb_bos_capability_msos),
+		.bDescriptorType = USB_DESC_DEVICE_CAPABILITY,
+		.bDevCapabilityType = USB_BOS_CAPABILITY_PLATFORM,
+		.bReserved = 0,
+		/* d8dd60df-4589-4cc7-9cd2-659d9e648a9f */
+		.PlatformCapabilityUUID = {
+			0xDF, 0x60, 0xDD, 0xD8, 0x89, 0x45, 0xC7, 0x4C,
+			0x9C, 0xD2, 0x65, 0x9D, 0x9E, 0x64, 0x8A, 0x9F,
+		},
+	},
+	.cap = {
+		.dwWindowsVersion = sys_cpu_to_le32(MSOS2_WINDOWS_8_1),
+		.wMSOSDescriptorSetTotalLength =
+			sys_cpu_to_le16(sizeof(struct msos2_desc)),
+		.bMS_VendorCode = MSOS2_VENDOR_CODE,
+		.bAltEnumCode = 0,
+	},
+};
+
+static struct usb_ep_cfg_data webusb_ep_data[] = {
+	[WEBUSB_OUT_EP_IDX] = {
+		.ep_cb = usb_transfer_ep_callback,
+		.ep_addr = WEBUSB_OUT_EP_ADDR,
+	},
+	[WEBUSB_IN_EP_IDX] = {
+		.ep_cb = usb_transfer_ep_callback,
+		.ep_addr = WEBUSB_IN_EP_ADDR,
+	},
+};
+
+static uint8_t rx_buf[WEBUSB_RX_SIZE];
+
+/* Stream position: header bytes so far, or payload bytes still due */
+static uint8_t header[WEBUSB_HEADER_SIZE];
+static size_t header_len;
+static size_t remaining;
+/* CRC32 after the bytes of the upload, for WEBUSB_CMD_UPLOAD_CRC */
+static bool trailed;
+static uint8_t trailer[4];
+static size_t trailer_len;
+static uint8_t target;
+static uint8_t status;
+
+/*
+ * One status or scan stream chunk in flight and only the latest status
+ * waiting behind it
+ */
+static struct k_spinlock tx_lock;
+static uint8_t tx_buf[WEBUSB_STATUS_SIZE];
+static uint8_t tx_next[WEBUSB_STATUS_SIZE];
+static bool tx_busy;
+static bool tx_pending;
+static bool tx_chunk;
+
+static void webusb_write(void);
+
+static void webusb_tx_done(uint8_t ep, int size, void *priv)
+{
+	k_spinlock_key_t key = k_spin_lock(&tx_lock);
+
+	tx_busy = false;
+	if (tx_chunk) {
+		tx_chunk = false;
+		scan_stream_release();
+	}
+	k_spin_unlock(&tx_lock, key);
+
+	webusb_write();
+}
+
+/* Start the next write unless one is in flight, from any context */
+static void webusb_write(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&tx_lock);
+	const uint8_t *buf = NULL;
+	size_t len = 0;
+	int ret;
+
+	if (tx_busy) {
+		k_spin_unlock(&tx_lock, key);
+		return;
+	}
+
+	if (tx_pending) {
+		tx_pending = false;
+		memcpy(tx_buf, tx_next, sizeof(tx_buf));
+		buf = tx_buf;
+		len = sizeof(tx_buf);
+	} else {
+		buf = scan_stream_take(&len);
+		tx_chunk = buf != NULL;
+	}
+
+	if (buf == NULL) {
+		k_spin_unlock(&tx_lock, key);
+		return;
+	}
+
+	tx_busy = true;
+	ret = usb_transfer(webusb_ep_data[WEBUSB_IN_EP_IDX].ep_addr,
+			   (uint8_t *)buf, len, USB_TRANS_WRITE,
+			   webusb_tx_done, NULL);
+	if (ret < 0) {
+		tx_busy = false;
+		if (tx_chunk) {
+			tx_chunk = false;
+			scan_stream_release();
+		}
+	}
+	k_spin_unlock(&tx_lock, key);
+
+	if (ret < 0) {
+		LOG_ERR("WebUSB write error, %d", ret);
+	}
+}
+
+static void webusb_reply(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&tx_lock);
+
+	tx_next[0] = status;
+	tx_next[1] = target;
+	tx_pending = true;
+	k_spin_unlock(&tx_lock, key);
+
+	webusb_write();
+}
+
+/* WEBUSB_CMD_STREAM, target 1 starts the raw scan stream and 0 stops it */
+static uint8_t webusb_scan_stream(uint8_t on)
+{
+	if (!IS_ENABLED(CONFIG_KEYPAD_SCAN_STREAM)) {
+		return UPLOAD_STATUS_UNSUPPORTED;
+	}
+
+	if (on > 1) {
+		return UPLOAD_STATUS_INVALID;
+	}
+
+	scan_stream_enable(on ? webusb_write : NULL);
+
+	return UPLOAD_STATUS_OK;
+}
+
+static void webusb_finish(void)
+{
+	if (status == UPLOAD_STATUS_OK) {
+		status = upload_end(&webusb_desc);
+	}
+
+	webusb_reply();
+}
+
+static void webusb_begin(void)
+{
+	target = header[1];
+	remaining = sys_get_le16(&header[2]);
+
+	trailed = header[0] == WEBUSB_CMD_UPLOAD_CRC;
+
+	if (header[0] == WEBUSB_CMD_STREAM) {
+		/* Answered at once, any bytes are skipped */
+		status = remaining == 0 ? webusb_scan_stream(target) :
+					  UPLOAD_STATUS_INVALID;
+		if (remaining == 0) {
+			webusb_reply();
+		}
+		return;
+	}
+
+	if (header[0] == WEBUSB_CMD_UPLOAD || trailed) {
+		status = upload_begin(&webusb_desc, target, remaining);
+	} else {
+		/* Skipped like a failed upload */
+		status = UPLOAD_STATUS_UNSUPPORTED;
+	}
+
+	if (remaining == 0 && !trailed) {
+		webusb_finish();
+	}
+}
+
+static void webusb_stream(const uint8_t *buf, size_t len)
+{
+	size_t n;
+
+	while (len > 0) {
+		if (remaining == 0 && trailed) {
+			n = MIN(len, sizeof(trailer) - trailer_len);
+			memcpy(&trailer[trailer_len], buf, n);
+			trailer_len += n;
+			buf += n;
+			len -= n;
+
+			if (trailer_len == sizeof(trailer)) {
+				trailer_len = 0;
+				trailed = false;
+				if (status == UPLOAD_STATUS_OK) {
+					status = upload_check(&webusb_desc,
+							      sys_get_le32(trailer));
+				}
+				webusb_finish();
+			}
+			continue;
+		}
+
+		if (remaining == 0) {
+			n = MIN(len, WEBUSB_HEADER_SIZE - header_len);
+			memcpy(&header[header_len], buf, n);
+			header_len += n;
+			buf += n;
+			len -= n;
+
+			if (header_len == WEBUSB_HEADER_SIZE) {
+				header_len = 0;
+				webusb_begin();
+			}
+			continue;
+		}
+
+		n = MIN(len, remaining);
+
+		if (status == UPLOAD_STATUS_OK) {
+			status = upload_data(&webusb_desc, buf, n);
+			if (status != UPLOAD_STATUS_OK) {
+				upload_abort(&webusb_desc);
+			}
+		}
+
+		buf += n;
+		len -= n;
+		remaining -= n;
+
+		if (remaining == 0 && !trailed) {
+			webusb_finish();
+		}
+	}
+}
+
+static void webusb_tx_reset(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&tx_lock);
+
+	tx_busy = false;
+	tx_pending = false;
+	if (tx_chunk) {
+		tx_chunk = false;
+		scan_stream_release();
+	}
+	k_spin_unlock(&tx_lock, key);
+}
+
+static void webusb_read(void);
+
+static void webusb_rx_done(uint8_t ep, int size, void *priv)
+{
+	if (size < 0) {
+		/* Cancelled by a reset, read again once configured */
+		return;
+	}
+
+	webusb_stream(rx_buf, size);
+	webusb_read();
+}
+
+static void webusb_read(void)
+{
+	uint8_t ep = webusb_ep_data[WEBUSB_OUT_EP_IDX].ep_addr;
+	int ret;
+
+	if (usb_transfer_is_busy(ep)) {
+		return;
+	}
+
+	ret = usb_transfer(ep, rx_buf, sizeof(rx_buf), USB_TRANS_READ,
+			   webusb_rx_done, NULL);
+	if (ret < 0) {
+		LOG_ERR("WebUSB read error, %d", ret);
+	}
+}
+
+static void webusb_status_cb(struct usb_cfg_data *cfg,
+			     enum usb_dc_status_code cb_status,
+			     const uint8_t *param)
+{
+	switch (cb_status) {
+	case USB_DC_CONFIGURED:
+		webusb_read();
+		break;
+	case USB_DC_RESET:
+	case USB_DC_DISCONNECTED:
+		/* The stack cancels the transfers, start a fresh stream */
+		upload_abort(&webusb_desc);
+		header_len = 0;
+		remaining = 0;
+		trailed = false;
+		trailer_len = 0;
+		scan_stream_enable(NULL);
+		webusb_tx_reset();
+		break;
+	default:
+		break;
+	}
+}
+
+static int webusb_vendor_handler(struct usb_setup_packet *setup,
+				 int32_t *len, uint8_t **data)
+{
+	if (usb_reqtype_is_to_device(setup)) {
+		return -ENOTSUP;
+	}
+
+	if (setup->bRequest == WEBUSB_VENDOR_CODE &&
+	    setup->wIndex == WEBUSB_REQ_GET_URL) {
+		if (WEBUSB_URL_LEN == 0 || setup->wValue != 1) {
+			return -ENOTSUP;
+		}
+
+		*data = (uint8_t *)&webusb_url;
+		*len = webusb_url.bLength;
+		return 0;
+	}
+
+	if (setup->bRequest == MSOS2_VENDOR_CODE &&
+	    setup->wIndex == MSOS2_DESCRIPTOR_INDEX) {
+		*data = (uint8_t *)&msos2_desc;
+		*len = sizeof(msos2_desc);
+		return 0;
+	}
+
+	return -ENOTSUP;
+}
+
+static void webusb_interface_config(struct usb_desc_header *head,
+				    uint8_t bInterfaceNumber)
+{
+	ARG_UNUSED(head);
+
+	webusb_desc.if0.bInterfaceNumber = bInterfaceNumber;
+	msos2_desc.configuration.function.subset.bFirstInterface =
+		bInterfaceNumber;
+}
+
+USBD_DEFINE_CFG_DATA(webusb_cfg) = {
+	.usb_device_description = NULL,
+	.interface_config = webusb_interface_config,
+	.interface_descriptor = &webusb_desc.if0,
+	.cb_usb_status = webusb_status_cb,
+	.interface = {
+		.class_handler = NULL,
+		.custom_handler = NULL,
+		.vendor_handler = webusb_vendor_handler,
+	},
+	.num_endpoints = ARRAY_SIZE(webusb_ep_data),
+	.endpoint = webusb_ep_data,
+};
+
+/* ASCII to UTF-16LE, with the terminating NUL */
+static void utf16le_put(uint8_t *dst, const char *src)
+{
+	do {
+		*dst++ = *src;
+		*dst++ = 0;
+	} while (*src++ != '\0');
+}
+
+int webusb_init(void)
+{
+	struct msos2_guids_property *guids =
+		&msos2_desc.configuration.function.guids;
+
+	utf16le_put(guids->PropertyName, MSOS2_PROPERTY_NAME);
+	utf16le_put(guids->bPropertyData, MSOS2_INTERFACE_GUID);
+
+	usb_bos_register_cap((void *)&webusb_bos_cap);
+	usb_bos_register_cap((void *)&msos2_bos_cap);
+
+	return 0;
+}
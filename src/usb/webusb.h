@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2022 Rich Effects
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * WebUSB configuration interface: a vendor interface with a pair of
+ * bulk endpoints, announced through the BOS descriptor so a browser
+ * can open it without a driver. An MS OS 2.0 descriptor set binds
+ * WinUSB to it on Windows. Bulk traffic only uses the bus time the
+ * interrupt endpoints leave, so it never delays a keyboard report.
+ *
+ * Bulk OUT is a stream of uploads, each a header then its bytes:
+ *
+ *   [0]     command, WEBUSB_CMD_UPLOAD or WEBUSB_CMD_UPLOAD_CRC
+ *   [1]     target, UPLOAD_TARGET_*
+ *   [2..3]  le16 length of the upload
+ *   [4..]   length bytes, split into packets in any way
+ *
+ * WEBUSB_CMD_UPLOAD_CRC has a le32 CRC32 of the length bytes after
+ * them, and the upload is only applied if it matches.
+ *
+ * The upload is applied after its last byte and answered on bulk IN:
+ *
+ *   [0]     status, UPLOAD_STATUS_*
+ *   [1]     target
+ *
+ * After an error the rest of that upload is skipped, the next header
+ * is read after length bytes as usual. The upload formats are in
+ * upload.h.
+ *
+ * WEBUSB_CMD_STREAM with length 0 and target 1 starts the raw scan
+ * stream of diag/scan_stream.h on bulk IN, target 0 stops it. It is
+ * answered like an upload, UPLOAD_STATUS_UNSUPPORTED in a build without
+ * CONFIG_KEYPAD_SCAN_STREAM, and chunks follow from the next full one.
+ * Byte 0 tells them from the status replies.
+ *
+ * A bus reset drops the upload in progress, stops the scan stream and
+ * starts a new stream.
+ *
+ * Compiles to nothing unless CONFIG_KEYPAD_WEBUSB is enabled.
+ */
+
+#ifndef KEYPAD_USB_WEBUSB_H_
+#define KEYPAD_USB_WEBUSB_H_
+
+#include <zephyr/zephyr.h>
+
+#define WEBUSB_CMD_UPLOAD 0x01
+#define WEBUSB_CMD_UPLOAD_CRC 0x02
+#define WEBUSB_CMD_STREAM 0x03
+
+#define WEBUSB_HEADER_SIZE 4
+#define WEBUSB_STATUS_SIZE 2
+
+#if defined(CONFIG_KEYPAD_WEBUSB)
+
+/* Register the BOS capabilities, call before usb_enable() */
+int webusb_init(void);
+
+#else
+
+static inline int webusb_init(void)
+{
+	return 0;
+}
+
+#endif /* CONFIG_KEYPAD_WEBUSB */
+
+#endif /* KEYPAD_USB_WEBUSB_H_ */